@@ -0,0 +1,100 @@
+
+#include <new>
+#include <pthread.h>
+
+#include "allocators.hpp"
+
+namespace Whisper {
+
+
+//
+// BumpAllocatorPool
+//
+
+struct ThreadAllocatorPool
+{
+    BumpAllocator *allocators[BumpAllocatorPool::MaxAllocators];
+    uint32_t count;
+
+    ThreadAllocatorPool() : count(0) {}
+
+    ~ThreadAllocatorPool() {
+        for (uint32_t i = 0; i < count; i++)
+            delete allocators[i];
+    }
+};
+
+static pthread_once_t POOL_KEY_ONCE = PTHREAD_ONCE_INIT;
+static pthread_key_t POOL_KEY;
+static bool POOL_KEY_CREATED = false;
+
+static void
+DestroyThreadAllocatorPool(void *pool)
+{
+    delete reinterpret_cast<ThreadAllocatorPool *>(pool);
+}
+
+static void
+CreatePoolKey()
+{
+    POOL_KEY_CREATED =
+        pthread_key_create(&POOL_KEY, DestroyThreadAllocatorPool) == 0;
+}
+
+// Get the calling thread's pool, creating it if |create| is set.
+// Returns null if there is none.
+static ThreadAllocatorPool *
+GetThreadAllocatorPool(bool create)
+{
+    pthread_once(&POOL_KEY_ONCE, CreatePoolKey);
+    if (!POOL_KEY_CREATED)
+        return nullptr;
+
+    ThreadAllocatorPool *pool =
+        reinterpret_cast<ThreadAllocatorPool *>(pthread_getspecific(POOL_KEY));
+    if (pool || !create)
+        return pool;
+
+    pool = new (std::nothrow) ThreadAllocatorPool();
+    if (pool && pthread_setspecific(POOL_KEY, pool) != 0) {
+        delete pool;
+        pool = nullptr;
+    }
+    return pool;
+}
+
+/*static*/ BumpAllocator *
+BumpAllocatorPool::Acquire()
+{
+    ThreadAllocatorPool *pool = GetThreadAllocatorPool(false);
+    if (pool && pool->count > 0)
+        return pool->allocators[--pool->count];
+
+    BumpAllocator *allocator = new (std::nothrow) BumpAllocator();
+    if (!allocator)
+        throw BumpAllocatorError();
+    return allocator;
+}
+
+/*static*/ void
+BumpAllocatorPool::Release(BumpAllocator *allocator)
+{
+    ThreadAllocatorPool *pool = GetThreadAllocatorPool(true);
+    if (!pool || pool->count == MaxAllocators) {
+        delete allocator;
+        return;
+    }
+
+    // A reset which cannot allocate a first chunk leaves the allocator
+    // unusable.
+    try {
+        allocator->reset();
+    } catch (BumpAllocatorError &err) {
+        delete allocator;
+        return;
+    }
+    pool->allocators[pool->count++] = allocator;
+}
+
+
+} // namespace Whisper
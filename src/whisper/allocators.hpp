@@ -29,6 +29,12 @@ namespace Whisper {
 // Within a chunk, allocation happens from high-to-low, similar to stack
 // allocation.
 //
+// Standard chunks double in size each time one is pushed, up to
+// MaxChunkSize, so that large compilations need few of them.  reset()
+// frees everything allocated but keeps the largest chunks, up to
+// MaxRetainedBytes, for later allocations to reuse (see
+// BumpAllocatorPool).
+//
 // This allocator is not a proper STL allocator.  See STLAllocator
 // below.
 //
@@ -53,11 +59,26 @@ class BumpAllocator
 
     // Default chunk size for new chunk allocations.
     constexpr static size_t DefaultChunkSize = 4096;
+    constexpr static size_t MaxChunkSize = 256 * 1024;
+
+    // Most bytes of chunks kept by reset().
+    constexpr static size_t MaxRetainedBytes = 1024 * 1024;
+
+    // Size of the next standard chunk.
     size_t chunkSize_;
 
     // Pointer to the top of the chain.
     Chain *chainEnd_;
 
+    // Empty chunks kept by reset(), largest first, linked through
+    // |prev|.
+    Chain *spareChunks_;
+
+    // Bytes of the chunks in the chain, and the most there have been
+    // since the last reset.
+    size_t chunkBytes_;
+    size_t peakChunkBytes_;
+
     // Allocation grows down (top to bottom).
     uint8_t *allocBottom_;
     uint8_t *allocTop_;
@@ -67,6 +88,9 @@ class BumpAllocator
     BumpAllocator(size_t chunkSize)
       : chunkSize_(chunkSize),
         chainEnd_(nullptr),
+        spareChunks_(nullptr),
+        chunkBytes_(0),
+        peakChunkBytes_(0),
         allocBottom_(nullptr),
         allocTop_(nullptr)
     {
@@ -76,6 +100,13 @@ class BumpAllocator
         pushNewChunk(chunkSize_);
     }
 
+    BumpAllocator(const BumpAllocator &other) = delete;
+
+    ~BumpAllocator() {
+        releaseChunks();
+        releaseSpareChunks();
+    }
+
     void *allocate(size_t sz, unsigned align)
     {
         align = Max(align, BasicAlignment);
@@ -87,23 +118,92 @@ class BumpAllocator
             return result;
         }
 
-        // Otherwise, allocate new chunk.  First, determine if
-        // new chunk should be standard size or custom oversized.
-        size_t newChunkSize = chunkSize_;
-        if (sz > (chunkSize_ - MinOverhead))
-            newChunkSize = sz + MinOverhead;
-
-        // Allocate new chunk and use it.  If chunk is pushed successfully,
-        // then it is guaranteed to be able to satisfy the allocation.
-        pushNewChunk(newChunkSize);
+        // Otherwise, push a new chunk and use it.  If chunk is pushed
+        // successfully, then it is guaranteed to be able to satisfy the
+        // allocation.
+        pushNewChunk(sz + MinOverhead);
         result = AlignPtrDown(allocTop_ - sz, BasicAlignment);
         WH_ASSERT(result >= allocBottom_ && result <= allocTop_);
         allocTop_ = result;
         return result;
     }
 
+    // A point in the allocation history.  Releasing to a mark frees
+    // everything allocated after it was taken.  Marks must be released
+    // in the reverse order they were taken.
+    class Mark
+    {
+      friend class BumpAllocator;
+      private:
+        Chain *chain_;
+        uint8_t *allocTop_;
+
+        Mark(Chain *chain, uint8_t *allocTop)
+          : chain_(chain), allocTop_(allocTop)
+        {}
+    };
+
+    Mark mark() const {
+        return Mark(chainEnd_, allocTop_);
+    }
+
+    void release(const Mark &mark) {
+        while (chainEnd_ != mark.chain_)
+            popChunk();
+
+        WH_ASSERT(chainEnd_);
+        allocBottom_ = reinterpret_cast<uint8_t *>(chainEnd_) + sizeof(Chain);
+        allocTop_ = mark.allocTop_;
+    }
+
+    size_t chunkBytes() const {
+        return chunkBytes_;
+    }
+    size_t peakChunkBytes() const {
+        return peakChunkBytes_;
+    }
+
+    // Free everything allocated, keeping the largest chunks for reuse.
+    // Marks taken before the reset are invalid.
+    void reset() {
+        while (Chain *chain = chainEnd_) {
+            chainEnd_ = chain->prev;
+            addSpareChunk(chain);
+        }
+        chunkBytes_ = 0;
+        peakChunkBytes_ = 0;
+
+        // Continue in the largest chunk, or in a new one if every chunk
+        // was too large to keep.
+        if (spareChunks_)
+            pushNewChunk(spareChunks_->size);
+        else
+            pushNewChunk(chunkSize_);
+    }
+
   private:
-    void pushNewChunk(size_t size) {
+    // Push a chunk of at least |minSize| bytes: the largest spare chunk
+    // if it is large enough, or else a new standard chunk, or a custom
+    // oversized one.
+    void pushNewChunk(size_t minSize) {
+        if (spareChunks_ && spareChunks_->size >= minSize) {
+            Chain *chain = spareChunks_;
+            spareChunks_ = chain->prev;
+            chain->prev = chainEnd_;
+            chainEnd_ = chain;
+            noteChunkPushed(chain->size);
+
+            allocBottom_ = reinterpret_cast<uint8_t *>(chain) + sizeof(Chain);
+            allocTop_ = static_cast<uint8_t *>(chain->addr) + chain->size;
+            return;
+        }
+
+        size_t size = chunkSize_;
+        if (minSize > chunkSize_)
+            size = minSize;
+        else if (chunkSize_ < MaxChunkSize)
+            chunkSize_ = Min<size_t>(chunkSize_ * 2, MaxChunkSize);
+
         void *mem = AllocateMemory(size);
         if (!mem)
             throw BumpAllocatorError();
@@ -113,6 +213,7 @@ class BumpAllocator
         // Align the memory up to the alignment reqired by Chain.
         uint8_t *chainAddr = AlignPtrUp(memu8, alignof(Chain));
         chainEnd_ = new (chainAddr) Chain(memu8, size, chainEnd_);
+        noteChunkPushed(size);
 
         // Set up allocTop and allocBottom
         allocBottom_ = chainAddr + sizeof(Chain);
@@ -122,6 +223,8 @@ class BumpAllocator
     void popChunk() {
         WH_ASSERT(chainEnd_);
         Chain *chainPrev = chainEnd_->prev;
+        WH_ASSERT(chunkBytes_ >= chainEnd_->size);
+        chunkBytes_ -= chainEnd_->size;
         ReleaseMemory(chainEnd_->addr);
         chainEnd_ = chainPrev;
     }
@@ -130,6 +233,81 @@ class BumpAllocator
         while (chainEnd_)
             popChunk();
     }
+
+    void noteChunkPushed(size_t size) {
+        chunkBytes_ += size;
+        if (chunkBytes_ > peakChunkBytes_)
+            peakChunkBytes_ = chunkBytes_;
+    }
+
+    // Insert |chain| into the spare chunks by size, then free the
+    // smallest ones past MaxRetainedBytes.
+    void addSpareChunk(Chain *chain) {
+        Chain **link = &spareChunks_;
+        while (*link && (*link)->size > chain->size)
+            link = &(*link)->prev;
+        chain->prev = *link;
+        *link = chain;
+
+        size_t retained = 0;
+        for (link = &spareChunks_; *link; link = &(*link)->prev) {
+            retained += (*link)->size;
+            if (retained > MaxRetainedBytes)
+                break;
+        }
+        while (Chain *excess = *link) {
+            *link = excess->prev;
+            ReleaseMemory(excess->addr);
+        }
+    }
+
+    void releaseSpareChunks() {
+        while (Chain *chain = spareChunks_) {
+            spareChunks_ = chain->prev;
+            ReleaseMemory(chain->addr);
+        }
+    }
+};
+
+//
+// BumpAllocatorPool
+//
+// Each thread keeps up to MaxAllocators reset BumpAllocators, so that
+// repeated compilations on the thread reuse the chunks of earlier ones
+// instead of allocating them again.  BumpAllocatorHelper takes an
+// allocator from the calling thread's pool for its lifetime.
+//
+class BumpAllocatorPool
+{
+  public:
+    static constexpr uint32_t MaxAllocators = 4;
+
+    // Take an allocator from the calling thread's pool, or create one.
+    // Throws BumpAllocatorError if one could not be created.
+    static BumpAllocator *Acquire();
+
+    // Reset |allocator| and return it to the calling thread's pool, or
+    // delete it if the pool is full.
+    static void Release(BumpAllocator *allocator);
+};
+
+class BumpAllocatorHelper
+{
+  private:
+    BumpAllocator *allocator_;
+
+  public:
+    BumpAllocatorHelper() : allocator_(BumpAllocatorPool::Acquire()) {}
+
+    BumpAllocatorHelper(const BumpAllocatorHelper &other) = delete;
+
+    ~BumpAllocatorHelper() {
+        BumpAllocatorPool::Release(allocator_);
+    }
+
+    BumpAllocator &allocator() const {
+        return *allocator_;
+    }
 };
 
 //
@@ -182,6 +360,10 @@ class STLBumpAllocator
     STLBumpAllocator(const STLBumpAllocator<U> &other) throw ()
       : base_(other.base_) {}
 
+    BumpAllocator &base() const {
+        return base_;
+    }
+
     pointer address(reference x) const {
         return &x;
     }
@@ -208,15 +390,35 @@ class STLBumpAllocator
     void destroy(pointer p) {
         p->~value_type();
     }
+
+    template <typename U>
+    bool operator ==(const STLBumpAllocator<U> &other) const {
+        return &base_ == &other.base_;
+    }
+    template <typename U>
+    bool operator !=(const STLBumpAllocator<U> &other) const {
+        return &base_ != &other.base_;
+    }
 };
 
 
 //
 // PoolAllocator
 //
-// Uses an underlying BumpAllocator, but also keeps a free-list of
-// allocations of particular sizes.  Also, this allocator can only
-// be used to allocate with alignment equal to "BasicAlignment".
+// Uses an underlying BumpAllocator, but also recycles freed memory, so
+// that containers which grow and shrink (vectors, hash tables) reuse
+// their old storage instead of leaving it behind.  This allocator can
+// only be used to allocate with alignment equal to "BasicAlignment".
+//
+// Allocations of up to MaxPooledSize bytes are rounded up to a size
+// class: multiples of BasicAlignment up to SmallSizeLimit, then powers
+// of two.  Each class keeps a free list, and refills from a batch of
+// about BatchBytes carved from the bump allocator at once, so that most
+// allocations are a pop or a pointer bump.  Larger allocations go
+// directly to the bump allocator, and are not recycled.
+//
+// Like the bump allocator, a pool is used by one thread at a time, and
+// its memory is only given back when the bump allocator is.
 //
 
 class PoolAllocatorError {
@@ -228,7 +430,17 @@ class PoolAllocator
 {
   public:
     constexpr static unsigned BasicAlignment = sizeof(word_t);
-    constexpr static unsigned NumFreeLists = 16;
+    constexpr static size_t SmallSizeLimit = 128;
+    constexpr static size_t MaxPooledSize = 4096;
+    constexpr static size_t BatchBytes = 2048;
+
+    constexpr static unsigned NumSmallClasses =
+        SmallSizeLimit / BasicAlignment;
+    constexpr static unsigned NumClasses = NumSmallClasses + 5;
+
+    static_assert(SmallSizeLimit << (NumClasses - NumSmallClasses) ==
+                    MaxPooledSize,
+                  "Size classes must end at MaxPooledSize.");
 
   private:
     struct FreeList {
@@ -236,29 +448,62 @@ class PoolAllocator
         FreeList(FreeList *next) : next(next) {}
     };
 
+    struct SizeClass {
+        FreeList *freeList;
+
+        // The rest of the current batch.
+        uint8_t *batchNext;
+        uint8_t *batchEnd;
+    };
+
     BumpAllocator &bumpAllocator_;
-    FreeList **freeLists_;
+    SizeClass classes_[NumClasses];
 
   public:
     PoolAllocator(BumpAllocator &bumpAllocator)
-      : bumpAllocator_(bumpAllocator),
-        freeLists_(nullptr)
+      : bumpAllocator_(bumpAllocator)
     {
-        size_t arraySize = NumFreeLists * sizeof(FreeList *);
-        void *arrayPtr = bumpAllocator_.allocate(arraySize, BasicAlignment);
-        freeLists_ = static_cast<FreeList **>(arrayPtr);
+        for (unsigned i = 0; i < NumClasses; i++) {
+            classes_[i].freeList = nullptr;
+            classes_[i].batchNext = nullptr;
+            classes_[i].batchEnd = nullptr;
+        }
+    }
+
+    PoolAllocator(const PoolAllocator &other) = delete;
+
+    BumpAllocator &bumpAllocator() const {
+        return bumpAllocator_;
+    }
 
-        for (unsigned i = 0; i < NumFreeLists; i++)
-            freeLists_[i] = nullptr;
+    static unsigned ClassIndex(size_t sz) {
+        WH_ASSERT(sz <= MaxPooledSize);
+        if (sz <= SmallSizeLimit)
+            return sz ? (sz - 1) / BasicAlignment : 0;
+
+        unsigned idx = NumSmallClasses;
+        for (size_t limit = SmallSizeLimit * 2; limit < sz; limit *= 2)
+            idx++;
+        return idx;
+    }
+
+    static size_t ClassSize(unsigned idx) {
+        WH_ASSERT(idx < NumClasses);
+        if (idx < NumSmallClasses)
+            return (idx + 1) * BasicAlignment;
+        return SmallSizeLimit << (idx - NumSmallClasses + 1);
     }
 
     void *allocate(size_t sz)
     {
-        // Check the free list.
-        unsigned idx = sz / BasicAlignment;
-        if (idx < NumFreeLists && freeLists_[idx] != nullptr) {
-            FreeList *area = freeLists_[idx];
-            freeLists_[idx] = area->next;
+        if (sz > MaxPooledSize)
+            return bumpAllocator_.allocate(sz, BasicAlignment);
+
+        // Check the free list, then the current batch.
+        unsigned idx = ClassIndex(sz);
+        SizeClass &cls = classes_[idx];
+        if (FreeList *area = cls.freeList) {
+            cls.freeList = area->next;
 #if defined(ENABLE_DEBUG)
             uint8_t *ptr = reinterpret_cast<uint8_t *>(area);
             std::fill(ptr, ptr + sz, 0);
@@ -266,20 +511,36 @@ class PoolAllocator
             return area;
         }
 
-        // Otherwise, just allocate.
-        return bumpAllocator_.allocate(sz, BasicAlignment);
+        size_t classSize = ClassSize(idx);
+        if (static_cast<size_t>(cls.batchEnd - cls.batchNext) < classSize)
+            refill(cls, classSize);
+
+        uint8_t *result = cls.batchNext;
+        cls.batchNext += classSize;
+        return result;
     }
 
     void deallocate(void *ptr, size_t sz) {
-        // See if we can add it to the free list.
-        unsigned idx = sz / BasicAlignment;
-        if (idx < NumFreeLists) {
+        // Memory too large to pool is left in the bump allocator.
+        if (sz > MaxPooledSize)
+            return;
+
 #if defined(ENABLE_DEBUG)
-            uint8_t *u8ptr = reinterpret_cast<uint8_t *>(ptr);
-            std::fill(u8ptr, u8ptr + sz, 0);
+        uint8_t *u8ptr = reinterpret_cast<uint8_t *>(ptr);
+        std::fill(u8ptr, u8ptr + sz, 0);
 #endif
-            freeLists_[idx] = new (ptr) FreeList(freeLists_[idx]);
-        }
+        SizeClass &cls = classes_[ClassIndex(sz)];
+        cls.freeList = new (ptr) FreeList(cls.freeList);
+    }
+
+  private:
+    // Start a new batch for a size class.  The rest of the old batch, if
+    // any, is too small to hold anything of the class.
+    void refill(SizeClass &cls, size_t classSize) {
+        size_t batchSize = Max(BatchBytes / classSize, size_t(1)) * classSize;
+        void *mem = bumpAllocator_.allocate(batchSize, BasicAlignment);
+        cls.batchNext = static_cast<uint8_t *>(mem);
+        cls.batchEnd = cls.batchNext + batchSize;
     }
 };
 
@@ -334,6 +595,10 @@ class STLPoolAllocator
     STLPoolAllocator(const STLPoolAllocator<U> &other) throw ()
       : base_(other.base_) {}
 
+    PoolAllocator &base() const {
+        return base_;
+    }
+
     pointer address(reference x) const {
         return &x;
     }
@@ -361,6 +626,15 @@ class STLPoolAllocator
     void destroy(pointer p) {
         p->~value_type();
     }
+
+    template <typename U>
+    bool operator ==(const STLPoolAllocator<U> &other) const {
+        return &base_ == &other.base_;
+    }
+    template <typename U>
+    bool operator !=(const STLPoolAllocator<U> &other) const {
+        return &base_ != &other.base_;
+    }
 };
 
 
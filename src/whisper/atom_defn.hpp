@@ -0,0 +1,47 @@
+#ifndef WHISPER__ATOM_DEFN_HPP
+#define WHISPER__ATOM_DEFN_HPP
+
+#include "parser/token_defn.hpp"
+
+
+// Macro iterating over the common property names which every thread
+// interns when it starts (see StringTable::atom).  The keywords of
+// WHISPER_DEFN_KEYWORDS are interned as atoms too.
+#define WHISPER_DEFN_ATOMS(_)                                   \
+    /* Name                             String */               \
+    \
+    _(Length,                           "length")               \
+    _(Prototype,                        "prototype")            \
+    _(Constructor,                      "constructor")          \
+    _(Proto,                            "__proto__")            \
+    _(Name,                             "name")                 \
+    _(Message,                          "message")              \
+    _(ToString,                         "toString")             \
+    _(ValueOf,                          "valueOf")              \
+    _(HasOwnProperty,                   "hasOwnProperty")       \
+    \
+    _(Arguments,                        "arguments")            \
+    _(Callee,                           "callee")               \
+    _(Caller,                           "caller")               \
+    _(Call,                             "call")                 \
+    _(Apply,                            "apply")                \
+    \
+    _(Value,                            "value")                \
+    _(Writable,                         "writable")             \
+    _(Enumerable,                       "enumerable")           \
+    _(Configurable,                     "configurable")         \
+    _(Get,                              "get")                  \
+    _(Set,                              "set")                  \
+    \
+    _(Undefined,                        "undefined")            \
+    _(NaN,                              "NaN")                  \
+    _(Infinity,                         "Infinity")             \
+    _(Object,                           "Object")               \
+    _(Function,                         "Function")             \
+    _(Array,                            "Array")                \
+    _(String,                           "String")               \
+    _(Number,                           "Number")               \
+    _(Boolean,                          "Boolean")
+
+
+#endif // WHISPER__ATOM_DEFN_HPP
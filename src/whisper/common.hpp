@@ -15,6 +15,18 @@
 #   error "Neither ARCH_BITS_32 nor ARCH_BITS_64 are defined!"
 #endif
 
+// Exempts a function from AddressSanitizer checks, for code which must
+// read memory ASan considers off limits, such as raw stack words.
+#if defined(__has_attribute)
+#   if __has_attribute(no_sanitize_address)
+#       define WH_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#   endif
+#endif
+
+#if !defined(WH_NO_SANITIZE_ADDRESS)
+#   define WH_NO_SANITIZE_ADDRESS
+#endif
+
 namespace Whisper {
 
 
@@ -0,0 +1,85 @@
+
+#include "compilation_arena.hpp"
+
+namespace Whisper {
+
+
+const char *
+CompilationArenaKindString(CompilationArenaKind kind)
+{
+    switch (kind) {
+#define CASE_(n) \
+      case CompilationArenaKind::n: \
+        return #n;
+      WHISPER_DEFN_COMPILATION_ARENAS(CASE_)
+#undef CASE_
+      default:
+        return "INVALID";
+    }
+}
+
+CompilationArena::CompilationArena()
+{
+    for (uint32_t i = 0; i < NumKinds; i++)
+        arenas_[i] = nullptr;
+
+    try {
+        for (uint32_t i = 0; i < NumKinds; i++)
+            arenas_[i] = BumpAllocatorPool::Acquire();
+    } catch (BumpAllocatorError &err) {
+        release();
+        throw;
+    }
+}
+
+CompilationArena::~CompilationArena()
+{
+    release();
+}
+
+void
+CompilationArena::release()
+{
+    for (uint32_t i = 0; i < NumKinds; i++) {
+        if (arenas_[i]) {
+            BumpAllocatorPool::Release(arenas_[i]);
+            arenas_[i] = nullptr;
+        }
+    }
+}
+
+size_t
+CompilationArena::bytes(CompilationArenaKind kind) const
+{
+    return arena(kind).chunkBytes();
+}
+
+size_t
+CompilationArena::peakBytes() const
+{
+    // Sub-arenas only shrink when the parser backtracks, so the sum of
+    // their peaks is close to the peak of their sum.
+    size_t total = 0;
+    for (uint32_t i = 0; i < NumKinds; i++) {
+        if (arenas_[i])
+            total += arenas_[i]->peakChunkBytes();
+    }
+    return total;
+}
+
+void
+CompilationArena::printStats(FILE *out) const
+{
+    fprintf(out, "Compilation memory: %llu bytes peak (",
+            (unsigned long long) peakBytes());
+    for (uint32_t i = 0; i < NumKinds; i++) {
+        size_t peak = arenas_[i] ? arenas_[i]->peakChunkBytes() : 0;
+        fprintf(out, "%s%s=%llu", i ? ", " : "",
+                CompilationArenaKindString(CompilationArenaKind(i)),
+                (unsigned long long) peak);
+    }
+    fprintf(out, ")\n");
+}
+
+
+} // namespace Whisper
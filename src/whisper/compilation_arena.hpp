@@ -0,0 +1,86 @@
+#ifndef WHISPER__COMPILATION_ARENA_HPP
+#define WHISPER__COMPILATION_ARENA_HPP
+
+#include <stdio.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "allocators.hpp"
+
+namespace Whisper {
+
+
+//
+// CompilationArena
+//
+// Owns all the memory of one compilation of a script: its tokens and
+// syntax tree, its annotations, and the bytecode generator's scratch
+// state.  Each kind of memory is allocated from a sub-arena of its
+// own, so that the things of one kind are contiguous (e.g. walking the
+// annotations does not touch the syntax tree's chunks), and so that
+// each kind can be measured.
+//
+// The sub-arenas are BumpAllocators taken from the thread's
+// BumpAllocatorPool, and all of them are given back at once when the
+// arena is released or destroyed, to be reused by the thread's next
+// compilation.  Nothing allocated in the arena may be used afterward.
+//
+
+#define WHISPER_DEFN_COMPILATION_ARENAS(_) \
+    _(Syntax)                              \
+    _(Annotations)                         \
+    _(Codegen)
+
+enum class CompilationArenaKind : uint8_t
+{
+#define ENUM_(n) n,
+    WHISPER_DEFN_COMPILATION_ARENAS(ENUM_)
+#undef ENUM_
+    LIMIT
+};
+
+const char *CompilationArenaKindString(CompilationArenaKind kind);
+
+class CompilationArena
+{
+  public:
+    static constexpr uint32_t NumKinds =
+        static_cast<uint32_t>(CompilationArenaKind::LIMIT);
+
+  private:
+    BumpAllocator *arenas_[NumKinds];
+
+  public:
+    // Throws BumpAllocatorError if the sub-arenas could not be created.
+    CompilationArena();
+    ~CompilationArena();
+
+    CompilationArena(const CompilationArena &other) = delete;
+
+    BumpAllocator &arena(CompilationArenaKind kind) const {
+        WH_ASSERT(kind < CompilationArenaKind::LIMIT);
+        WH_ASSERT(arenas_[static_cast<uint32_t>(kind)]);
+        return *arenas_[static_cast<uint32_t>(kind)];
+    }
+
+    template <typename T>
+    STLBumpAllocator<T> allocatorFor(CompilationArenaKind kind) const {
+        return STLBumpAllocator<T>(arena(kind));
+    }
+
+    // Give back all the memory of the compilation.
+    void release();
+
+    // Bytes of memory held by a sub-arena, and the most held by all of
+    // them since the arena was created.
+    size_t bytes(CompilationArenaKind kind) const;
+    size_t peakBytes() const;
+
+    // Print the peak memory of each sub-arena.
+    void printStats(FILE *out) const;
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__COMPILATION_ARENA_HPP
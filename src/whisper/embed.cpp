@@ -0,0 +1,695 @@
+
+#include <new>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+
+#include "spew.hpp"
+#include "parser/code_source.hpp"
+#include "parser/tokenizer.hpp"
+#include "parser/syntax_tree.hpp"
+#include "parser/syntax_tree_inlines.hpp"
+#include "parser/syntax_annotations.hpp"
+#include "parser/parser.hpp"
+#include "parser/parallel_parser.hpp"
+#include "value_inlines.hpp"
+#include "runtime.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting.hpp"
+#include "rooting_inlines.hpp"
+#include "shared_code_heap.hpp"
+#include "embed.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
+#include "vm/tuple.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/script.hpp"
+#include "vm/global.hpp"
+#include "vm/object.hpp"
+#include "vm/shape_tree.hpp"
+#include "interp/bytecode_ops.hpp"
+#include "interp/bytecode_generator.hpp"
+#include "interp/bytecode_cache.hpp"
+#include "interp/interpreter.hpp"
+
+namespace Whisper {
+
+
+void
+InitializeWhisper()
+{
+    InitializeSpew();
+    Interp::InitializeOpcodeInfo();
+    VM::InitializeStringKernels();
+    InitializeKeywordTable();
+    InitializeQuickTokenTable();
+}
+
+struct Printer {
+    void operator ()(const char *s) {
+        fputs(s, stderr);
+    }
+    void operator ()(const uint8_t *s, uint32_t len) {
+        fwrite(s, 1, len, stderr);
+    }
+};
+
+// Generator options change the bytecode, so they are part of the key
+// of cached and frozen bytecode.
+static uint32_t
+CacheFlags(const CompileOptions &options)
+{
+    uint32_t flags = 0;
+    if (!options.fuseOps)
+        flags |= 1 << 0;
+    if (!options.foldConstants)
+        flags |= 1 << 1;
+    if (options.localTemps)
+        flags |= 1 << 2;
+    return flags;
+}
+
+// Parse, annotate and generate bytecode for |source|, or for |program|
+// if it was parsed already.  All compile-time memory is held by one
+// arena.  Returns an error message on failure.
+static const char *
+GenerateBytecode(RunContext *cx, CodeSource &source, ProgramNode *program,
+                 const CompileOptions &options, CompileInfo &info,
+                 MutHandle<VM::Bytecode *> bytecode,
+                 MutHandle<VM::Tuple *> constants,
+                 uint32_t *maxStackDepth, uint32_t *numLocals)
+{
+    CompilationArena arena;
+    if (!program) {
+        Tokenizer tokenizer(arena, source);
+        Parser parser(tokenizer);
+        parser.setLazyFunctions(options.lazyFunctions);
+
+        program = parser.parseProgram();
+        if (!program) {
+            WH_ASSERT(parser.hasError());
+            info.parseError = true;
+            info.errorPosition = tokenizer.position();
+            return parser.error();
+        }
+    }
+
+    if (options.printProgram) {
+        Printer pr;
+        PrintNode(source, program, pr, 0);
+    }
+
+    AST::SyntaxAnnotator annotator(arena, program, source);
+    if (!annotator.annotate())
+        return annotator.error();
+
+    Interp::BytecodeGenerator bcgen(cx, arena, program, annotator, false);
+    bcgen.setFuseOps(options.fuseOps);
+    bcgen.setFoldConstants(options.foldConstants);
+    bcgen.setLocalTemps(options.localTemps);
+    bytecode = bcgen.generateBytecode();
+    if (bcgen.hasError())
+        return bcgen.error();
+
+    VM::Tuple *tuple = nullptr;
+    if (!bcgen.constants(tuple))
+        return "Could not allocate constants.";
+    constants = tuple;
+    *maxStackDepth = bcgen.maxStackDepth();
+    *numLocals = bcgen.numLocals();
+
+    if (options.printStats)
+        arena.printStats(stderr);
+    return nullptr;
+}
+
+// Where the cached and frozen code of a source are found.  Both are
+// keyed by a hash of the whole source.
+struct CodeKeys
+{
+    const char *cacheDir;
+    char cachePath[4096];
+    SharedCodeHeap *codeHeap;
+    SharedCodeHeap::Key codeKey;
+
+    CodeKeys(RunContext *cx, CodeSource &source,
+             const CompileOptions &options)
+      : cacheDir(options.cacheDir),
+        codeHeap(cx->runtime()->maybeSharedCodeHeap()),
+        codeKey(0, CacheFlags(options))
+    {
+        if (cacheDir || codeHeap) {
+            while (source.readMore()) {}
+            codeKey.first = Interp::HashBytecodeSource(
+                source.data(), source.dataSize());
+        }
+        if (cacheDir) {
+            int len = snprintf(cachePath, sizeof(cachePath),
+                               "%s/%016llx-%x.whbc", cacheDir,
+                               (unsigned long long) codeKey.first,
+                               (unsigned) codeKey.second);
+            if (len < 0 || size_t(len) >= sizeof(cachePath))
+                cacheDir = nullptr;
+        }
+    }
+
+    // Whether there is frozen or cached code for the source, so that it
+    // need not be parsed.
+    bool hasCode() const {
+        SharedScriptCode code;
+        if (codeHeap && codeHeap->lookup(codeKey, &code))
+            return true;
+        if (!cacheDir)
+            return false;
+        Interp::BytecodeCacheFile cacheFile(cachePath);
+        return cacheFile.initialize(codeKey.first, codeKey.second);
+    }
+};
+
+// Compile |source| as CompileScript does, using |program| if the source
+// was parsed already.
+static const char *
+CompileSource(RunContext *cx, CodeSource &source, ProgramNode *program,
+              const CompileOptions &options, CompileInfo &info,
+              Root<VM::Script *> &script)
+{
+    CodeKeys keys(cx, source, options);
+    uint64_t sourceHash = keys.codeKey.first;
+    uint32_t cacheFlags = keys.codeKey.second;
+
+    Root<VM::Bytecode *> bc(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+
+    SharedScriptCode code;
+    bool frozen = keys.codeHeap && keys.codeHeap->lookup(keys.codeKey, &code);
+    if (!frozen) {
+        bool cached = false;
+        if (keys.cacheDir) {
+            Interp::BytecodeCacheFile cacheFile(keys.cachePath);
+            if (cacheFile.initialize(sourceHash, cacheFlags)) {
+                if (!cacheFile.load(cx, &bc, &constants))
+                    return "Could not load cached bytecode.";
+                maxStackDepth = cacheFile.maxStackDepth();
+                numLocals = cacheFile.numLocals();
+                cached = true;
+                info.cached = true;
+            }
+        }
+
+        if (!cached) {
+            if (const char *err = GenerateBytecode(cx, source, program,
+                                                   options, info, &bc,
+                                                   &constants,
+                                                   &maxStackDepth,
+                                                   &numLocals))
+            {
+                return err;
+            }
+
+            if (keys.cacheDir &&
+                !Interp::WriteBytecodeCache(keys.cachePath, sourceHash,
+                                            cacheFlags, bc, constants,
+                                            maxStackDepth, numLocals))
+            {
+                info.cacheWriteFailed = true;
+            }
+        }
+
+        // Freeze the code into the shared code heap, so that other
+        // threads need not compile it again.
+        if (keys.codeHeap) {
+            if (const char *err = keys.codeHeap->freeze(
+                    cx, keys.codeKey, bc, constants, maxStackDepth,
+                    numLocals, &code))
+            {
+                return err;
+            }
+            frozen = true;
+        }
+    }
+
+    if (frozen) {
+        bc = code.bytecode;
+        constants = code.constants;
+        maxStackDepth = code.maxStackDepth;
+        numLocals = code.numLocals;
+        info.frozen = true;
+    }
+
+    VM::Script::Config scriptCfg(false, VM::Script::TopLevel,
+                                 maxStackDepth, numLocals);
+    script = cx->inHatchery(AllocSite::Script).create<VM::Script>(
+        bc.get(), constants.get(), scriptCfg);
+    if (!script)
+        return "Could not allocate script.";
+
+    // Decode the bytecode for the interpreter, or use the frozen decoding.
+    bool decoded = frozen
+        ? Interp::AttachDecodedBytecode(cx, script, code.decoded)
+        : Interp::DecodeScript(cx, script);
+    if (!decoded)
+        return "Could not decode bytecode.";
+    return nullptr;
+}
+
+const char *
+CompileScript(RunContext *cx, CodeSource &source,
+              const CompileOptions &options,
+              MutHandle<VM::Script *> scriptOut,
+              CompileInfo *info)
+{
+    CompileInfo localInfo;
+    Root<VM::Script *> script(cx);
+    if (const char *err = CompileSource(cx, source, nullptr, options,
+                                        info ? *info : localInfo, script))
+    {
+        return err;
+    }
+    scriptOut = script;
+    return nullptr;
+}
+
+struct StringPrinter {
+    std::string *out;
+    void operator ()(const char *s) {
+        out->append(s);
+    }
+    void operator ()(const uint8_t *s, uint32_t len) {
+        out->append(reinterpret_cast<const char *>(s), len);
+    }
+};
+
+// Parse |source| on the calling thread, and check that it gives the same
+// syntax tree as |program|, as printed.
+static const char *
+CheckSerialParse(CodeSource &source, ProgramNode *program,
+                 const CompileOptions &options)
+{
+    CompilationArena arena;
+    Tokenizer tokenizer(arena, source);
+    Parser parser(tokenizer);
+    parser.setLazyFunctions(options.lazyFunctions);
+    ProgramNode *serialProgram = parser.parseProgram();
+    if (!serialProgram)
+        return "Serial parse failed after parallel parse succeeded.";
+
+    try {
+        std::string parallelTree;
+        std::string serialTree;
+        PrintNode(source, program, StringPrinter{&parallelTree}, 0);
+        PrintNode(source, serialProgram, StringPrinter{&serialTree}, 0);
+        if (parallelTree != serialTree)
+            return "Parallel parse differs from serial parse.";
+    } catch (std::bad_alloc &err) {
+        return "Could not print syntax trees.";
+    }
+    return nullptr;
+}
+
+const char *
+CompileScripts(RunContext *cx, CodeSource *const *sources, uint32_t count,
+               uint32_t numThreads, const CompileOptions &options,
+               VectorRoot<VM::Script *> &scriptsOut, CompileInfo *infos)
+{
+    WH_ASSERT(numThreads >= 1);
+    ParallelParser parser(Min<uint32_t>(numThreads,
+                                        ParallelParser::MaxThreads));
+    parser.setLazyFunctions(options.lazyFunctions);
+
+    // Sources with frozen or cached code are not parsed.
+    std::vector<int32_t> tasks;
+    try {
+        tasks.resize(count, -1);
+        for (uint32_t i = 0; i < count; i++) {
+            while (sources[i]->readMore()) {}
+            CodeKeys keys(cx, *sources[i], options);
+            if (!keys.hasCode())
+                tasks[i] = parser.addSource(sources[i]);
+        }
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate parse tasks.";
+    }
+
+    // Failed tasks are reported in order below.
+    parser.parse();
+
+    for (uint32_t i = 0; i < count; i++) {
+        CompileInfo localInfo;
+        CompileInfo &info = infos ? infos[i] : localInfo;
+
+        ProgramNode *program = nullptr;
+        if (tasks[i] >= 0) {
+            if (const char *err = parser.error(tasks[i])) {
+                info.parseError = true;
+                info.errorPosition = parser.errorPosition(tasks[i]);
+                return err;
+            }
+            program = parser.program(tasks[i]);
+
+            if (options.checkParallelParse) {
+                if (const char *err = CheckSerialParse(*sources[i], program,
+                                                       options))
+                {
+                    return err;
+                }
+            }
+        }
+
+        Root<VM::Script *> script(cx);
+        if (const char *err = CompileSource(cx, *sources[i], program,
+                                            options, info, script))
+        {
+            return err;
+        }
+        try {
+            scriptsOut.append(script);
+        } catch (std::bad_alloc &err) {
+            return "Could not append script.";
+        }
+    }
+    return nullptr;
+}
+
+static bool
+NormalizeName(RunContext *cx, const char *name, MutHandle<Value> nameOut)
+{
+    return VM::NormalizeString(cx,
+                               reinterpret_cast<const uint8_t *>(name),
+                               strlen(name), nameOut);
+}
+
+bool
+GetGlobal(RunContext *cx, const char *name, MutHandle<Value> valOut)
+{
+    VM::Global *global = cx->threadContext()->global();
+    if (!global)
+        return false;
+
+    Root<Value> nameVal(cx);
+    if (!NormalizeName(cx, name, &nameVal))
+        return false;
+
+    VM::GlobalCell *cell = global->lookupCell(cx, nameVal);
+    if (!cell)
+        return false;
+    valOut = cell->value();
+    return true;
+}
+
+bool
+SetGlobal(RunContext *cx, const char *name, Handle<Value> val)
+{
+    VM::Global *global = cx->threadContext()->global();
+    if (!global)
+        return false;
+
+    Root<Value> nameVal(cx);
+    if (!NormalizeName(cx, name, &nameVal))
+        return false;
+
+    Root<VM::GlobalCell *> cell(cx);
+    return global->defineGlobal(cx, nameVal, val, &cell);
+}
+
+bool
+DefineNativeFunction(RunContext *cx, const char *name,
+                     VM::NativeFastCall call, void *data)
+{
+    // Functions are defined once and called often, so they are tenured.
+    Root<Value> func(cx);
+    VM::NativeFunction *funcPtr =
+        cx->inTenured().create<VM::NativeFunction>(call, data);
+    if (!funcPtr)
+        return false;
+    func = Value::Object(funcPtr);
+    return SetGlobal(cx, name, func);
+}
+
+// Create an empty object, as NewObject does.
+static VM::HashObject *
+CreateEmptyObject(RunContext *cx)
+{
+    VM::Shape *shape = cx->threadContext()->emptyObjectShape();
+    if (!shape)
+        return nullptr;
+
+    VM::HashObject *obj =
+        cx->inHatchery(AllocSite::Object).create<VM::HashObject>(
+            static_cast<VM::Object *>(nullptr), shape);
+    if (!obj || !obj->initialize(cx))
+        return nullptr;
+    return obj;
+}
+
+bool
+CreateArray(RunContext *cx, const int32_t *vals, uint32_t length,
+            MutHandle<VM::HashObject *> arrayOut)
+{
+    VM::HashObject *array = CreateEmptyObject(cx);
+    if (!array || !array->initializeElements(cx, vals, length))
+        return false;
+    arrayOut = array;
+    return true;
+}
+
+bool
+CreateArray(RunContext *cx, const double *vals, uint32_t length,
+            MutHandle<VM::HashObject *> arrayOut)
+{
+    VM::HashObject *array = CreateEmptyObject(cx);
+    if (!array || !array->initializeElements(cx, vals, length))
+        return false;
+    arrayOut = array;
+    return true;
+}
+
+static VM::HashObject *
+MaybeHashObject(const Value &val)
+{
+    if (!val.isObject() || !val.objectPtr()->isHashObject())
+        return nullptr;
+    return val.objectPtr()->toHashObject();
+}
+
+bool
+ReadArray(const Value &val, int32_t *vals, uint32_t length)
+{
+    VM::HashObject *array = MaybeHashObject(val);
+    return array && array->readElements(vals, length);
+}
+
+bool
+ReadArray(const Value &val, double *vals, uint32_t length)
+{
+    VM::HashObject *array = MaybeHashObject(val);
+    return array && array->readElements(vals, length);
+}
+
+
+//
+// StructLayout
+//
+
+StructLayout::StructLayout(RunContext *cx, const StructField *fields,
+                           uint32_t numFields)
+  : cx_(cx),
+    fields_(fields),
+    numFields_(numFields),
+    names_(cx),
+    shape_(cx)
+{}
+
+bool
+StructLayout::initialize()
+{
+    WH_ASSERT(names_.size() == 0);
+    if (numFields_ > VM::HashObject::MaxShapedProperties)
+        return false;
+
+    Root<Value> name(cx_);
+    for (uint32_t i = 0; i < numFields_; i++) {
+        if (!NormalizeName(cx_, fields_[i].name, &name))
+            return false;
+        if (name->isImmIndexString())
+            return false;
+        try {
+            names_.append(name.get());
+        } catch (std::bad_alloc &err) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+StructLayout::createObject(const uint8_t *data, VM::HashObject **objOut)
+{
+    WH_ASSERT(names_.size() == numFields_);
+
+    // Nothing moves until the next safepoint, so the object and the
+    // field values are held raw while they are stored.
+    VM::HashObject *obj = CreateEmptyObject(cx_);
+    if (!obj)
+        return false;
+    if (shape_ && !obj->initializeFromTemplate(cx_, shape_, numFields_))
+        return false;
+
+    Root<Value> val(cx_);
+    for (uint32_t i = 0; i < numFields_; i++) {
+        const uint8_t *field = data + fields_[i].offset;
+        switch (fields_[i].kind) {
+          case StructField::Int32: {
+            int32_t i32;
+            memcpy(&i32, field, sizeof(int32_t));
+            val = Value::Int32(i32);
+            break;
+          }
+          case StructField::Double: {
+            double d;
+            memcpy(&d, field, sizeof(double));
+            if (!cx_->inHatchery().createNumber(d, val.get()))
+                return false;
+            break;
+          }
+          case StructField::Bool: {
+            bool b;
+            memcpy(&b, field, sizeof(bool));
+            val = b ? Value::True() : Value::False();
+            break;
+          }
+        }
+
+        if (shape_)
+            obj->setSlotValue(i, val);
+        else if (!obj->defineValueProperty(cx_, names_.get(i), val))
+            return false;
+    }
+
+    // The first object's shape is the template for the rest.
+    if (!shape_ && numFields_ > 0) {
+        if (obj->isDictionary() || obj->numProperties() != numFields_)
+            return false;
+        shape_ = obj->shape();
+    }
+
+    *objOut = obj;
+    return true;
+}
+
+bool
+StructLayout::toObject(const void *data, MutHandle<VM::HashObject *> objOut)
+{
+    VM::HashObject *obj;
+    if (!createObject(static_cast<const uint8_t *>(data), &obj))
+        return false;
+    objOut = obj;
+    return true;
+}
+
+bool
+StructLayout::toArray(const void *data, uint32_t length, size_t stride,
+                      MutHandle<VM::HashObject *> arrayOut)
+{
+    Root<VM::Tuple *> objs(cx_);
+    if (length > 0 && !cx_->inHatchery().createTuple(length, objs.get()))
+        return false;
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (uint32_t i = 0; i < length; i++) {
+        VM::HashObject *obj;
+        if (!createObject(bytes + i * stride, &obj))
+            return false;
+        objs->set(i, Value::Object(obj));
+    }
+
+    VM::HashObject *array = CreateEmptyObject(cx_);
+    if (!array)
+        return false;
+    if (objs)
+        array->initializeElements(objs);
+    arrayOut = array;
+    return true;
+}
+
+bool
+StructLayout::readObject(VM::HashObject *obj, uint8_t *data)
+{
+    WH_ASSERT(names_.size() == numFields_);
+
+    // Objects of the template's shape hold field |i| in slot |i|.
+    bool templated = shape_ && obj->shape() == shape_;
+    for (uint32_t i = 0; i < numFields_; i++) {
+        uint32_t slot = i;
+        if (!templated) {
+            slot = obj->lookupOwnSlot(cx_, names_.get(i));
+            if (slot == UINT32_MAX)
+                return false;
+        }
+
+        Value val = obj->slotValue(slot);
+        uint8_t *field = data + fields_[i].offset;
+        switch (fields_[i].kind) {
+          case StructField::Int32: {
+            if (!val.isInt32())
+                return false;
+            int32_t i32 = val.int32Value();
+            memcpy(field, &i32, sizeof(int32_t));
+            break;
+          }
+          case StructField::Double: {
+            if (!val.isNumber())
+                return false;
+            double d = val.numberValue();
+            memcpy(field, &d, sizeof(double));
+            break;
+          }
+          case StructField::Bool: {
+            if (!val.isBoolean())
+                return false;
+            bool b = val.isTrue();
+            memcpy(field, &b, sizeof(bool));
+            break;
+          }
+        }
+    }
+    return true;
+}
+
+bool
+StructLayout::fromObject(const Value &val, void *data)
+{
+    VM::HashObject *obj = MaybeHashObject(val);
+    return obj && readObject(obj, static_cast<uint8_t *>(data));
+}
+
+bool
+StructLayout::fromArray(const Value &val, void *data, uint32_t length,
+                        size_t stride)
+{
+    VM::HashObject *array = MaybeHashObject(val);
+    if (!array ||
+        array->elementsKind() != VM::HashObject::ElementsKind::Generic ||
+        array->elementsLength() < length)
+    {
+        return false;
+    }
+
+    // Generic elements are read without allocating.
+    Root<Value> elem(cx_);
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    for (uint32_t i = 0; i < length; i++) {
+        if (!array->getOwnElement(cx_, i, &elem))
+            return false;
+        VM::HashObject *obj = MaybeHashObject(elem);
+        if (!obj || !readObject(obj, bytes + i * stride))
+            return false;
+    }
+    return true;
+}
+
+
+} // namespace Whisper
@@ -0,0 +1,216 @@
+#ifndef WHISPER__EMBED_HPP
+#define WHISPER__EMBED_HPP
+
+#include <stddef.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "rooting.hpp"
+#include "vm/native_function.hpp"
+
+namespace Whisper {
+
+class RunContext;
+class CodeSource;
+
+namespace VM
+{
+    class Script;
+    class Shape;
+    class HashObject;
+}
+
+//
+// The embedding API.
+//
+// A host runs scripts the way whisper.cpp does: it creates a Runtime,
+// registers each of its threads with it, and runs scripts in a
+// RunContext on the thread.  Scripts are run with Interp::InterpretScript,
+// or with an Interp::PreparedScript when one script is run for many
+// inputs.  This file has the rest of what a host needs:
+//
+//  - InitializeWhisper sets up the tables of the process, once.
+//  - CompileScript compiles a source into a script, sharing and caching
+//    its code.  CompileScripts compiles several sources at once,
+//    parsing them in parallel.
+//  - GetGlobal and SetGlobal pass values in and out of scripts by name.
+//  - DefineNativeFunction gives scripts a host function to call, through
+//    the fast-call ABI of VM::NativeFunction.
+//  - CreateArray, ReadArray and StructLayout convert C++ arrays and
+//    structs to and from objects in bulk.  Only the results are rooted,
+//    and packed numbers are copied in one go.
+//
+// Between scripts, a host can also give the thread's idle time to the
+// collector, and pass on memory pressure, with
+// ThreadContext::notifyIdle and notifyMemoryPressure.
+//
+// Functions returning bool return false on error or OOM.
+//
+
+// Initialize the opcode, string and token tables.  Called once, before
+// any runtime is created.
+void InitializeWhisper();
+
+struct CompileOptions
+{
+    // If set, bytecode is loaded from and saved to this directory, as
+    // with WHBYTECODECACHE.
+    const char *cacheDir = nullptr;
+
+    // Parse function bodies only once they are needed.
+    bool lazyFunctions = true;
+
+    // Bytecode generator options.  These change the bytecode, so cached
+    // and frozen code is keyed by them as well as by the source.
+    bool fuseOps = true;
+    bool foldConstants = true;
+    bool localTemps = false;
+
+    // Print the parsed program, and the peak size of the compile arena,
+    // to stderr.
+    bool printProgram = false;
+    bool printStats = false;
+
+    // For CompileScripts: parse each source again on the calling thread,
+    // and fail if the syntax tree differs from the one parsed in
+    // parallel.
+    bool checkParallelParse = false;
+};
+
+// What CompileScript did, for hosts which report on it.
+struct CompileInfo
+{
+    // Whether the bytecode was loaded from the cache directory, or is
+    // frozen code from the shared code heap.
+    bool cached = false;
+    bool frozen = false;
+
+    // Whether the bytecode could not be written to the cache directory.
+    // This only costs a compile the next time.
+    bool cacheWriteFailed = false;
+
+    // For parse errors, the offset in the source the parser reached.
+    bool parseError = false;
+    uint32_t errorPosition = 0;
+};
+
+// Compile the whole of |source| into a top-level script, ready to run.
+// Cached and frozen code are keyed by a hash of the whole source, so
+// with a cache directory or a shared code heap, streamed sources are
+// read to their end first.  Otherwise they are parsed as they are read.
+// Callers check streamed sources for read errors.
+// If the runtime has a shared code heap, code frozen for the same source
+// is used, and new code is frozen into it.  Returns an error message on
+// failure.
+const char *CompileScript(RunContext *cx, CodeSource &source,
+                          const CompileOptions &options,
+                          MutHandle<VM::Script *> scriptOut,
+                          CompileInfo *info = nullptr);
+
+// Compile the |count| sources of a multi-file program into top-level
+// scripts, appended to |scriptsOut| in order, as CompileScript does.  The
+// sources without cached or frozen code are parsed in parallel, on up to
+// |numThreads| threads (see ParallelParser), and then compiled in order.
+// Sources are read to their end before parsing.  On failure, the source
+// which failed is the one at the index of the next script, and |infos|,
+// if given, holds a CompileInfo for each source.
+const char *CompileScripts(RunContext *cx, CodeSource *const *sources,
+                           uint32_t count, uint32_t numThreads,
+                           const CompileOptions &options,
+                           VectorRoot<VM::Script *> &scriptsOut,
+                           CompileInfo *infos = nullptr);
+
+// Get the global |name|.  Returns false if there is no such global.
+bool GetGlobal(RunContext *cx, const char *name, MutHandle<Value> valOut);
+
+// Set the global |name|, defining it if there is no such global.
+bool SetGlobal(RunContext *cx, const char *name, Handle<Value> val);
+
+// Define the global |name| as a native function calling |call| with
+// |data|.
+bool DefineNativeFunction(RunContext *cx, const char *name,
+                          VM::NativeFastCall call, void *data);
+
+// Create an object with the |length| values of |vals| as its elements,
+// packed unboxed.
+bool CreateArray(RunContext *cx, const int32_t *vals, uint32_t length,
+                 MutHandle<VM::HashObject *> arrayOut);
+bool CreateArray(RunContext *cx, const double *vals, uint32_t length,
+                 MutHandle<VM::HashObject *> arrayOut);
+
+// Copy the first |length| elements of the object |val| into |vals|.
+// Returns false if |val| is not an object, or if any of the elements is
+// missing or not an int32, or not a number.  Nothing is allocated, so
+// native functions can read their arguments with these.
+bool ReadArray(const Value &val, int32_t *vals, uint32_t length);
+bool ReadArray(const Value &val, double *vals, uint32_t length);
+
+//
+// A field of a C++ struct, converted to the property |name|.
+//
+struct StructField
+{
+    enum Kind : uint8_t { Int32, Double, Bool };
+
+    const char *name;
+    Kind kind;
+    size_t offset;
+};
+
+#define WHISPER_STRUCT_FIELD(type, field, kind) \
+    { #field, Whisper::StructField::kind, offsetof(type, field) }
+
+//
+// StructLayout
+//
+// Converts C++ structs with the given fields to objects with a property
+// for each field, and back.  Field names are normalized once, when the
+// layout is initialized.  The first object created takes its shape by
+// defining the fields in order, and later objects are created with that
+// shape as a template, as object literals are, and have their fields
+// stored straight into their slots.  Objects of that shape are read by
+// slot as well, and others by looking up each field.
+//
+// A layout holds roots, so it must live on the stack like other rooted
+// things.
+//
+class StructLayout
+{
+  private:
+    RunContext *cx_;
+    const StructField *fields_;
+    uint32_t numFields_;
+    VectorRoot<Value> names_;
+    Root<VM::Shape *> shape_;
+
+  public:
+    StructLayout(RunContext *cx, const StructField *fields,
+                 uint32_t numFields);
+
+    // Normalize the field names.  Fails if a name is an index, or if
+    // there are more fields than an object can hold in its shape.
+    bool initialize();
+
+    bool toObject(const void *data, MutHandle<VM::HashObject *> objOut);
+
+    // Fails if |val| is not an object, or if a field is missing or has
+    // a value of the wrong kind.  Nothing is allocated.
+    bool fromObject(const Value &val, void *data);
+
+    // Convert the |length| structs at |data|, |stride| bytes apart, to
+    // an object with their objects as its elements, and back.
+    bool toArray(const void *data, uint32_t length, size_t stride,
+                 MutHandle<VM::HashObject *> arrayOut);
+    bool fromArray(const Value &val, void *data, uint32_t length,
+                   size_t stride);
+
+  private:
+    bool createObject(const uint8_t *data, VM::HashObject **objOut);
+    bool readObject(VM::HashObject *obj, uint8_t *data);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__EMBED_HPP
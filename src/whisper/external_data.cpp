@@ -0,0 +1,84 @@
+
+#include <new>
+#include <sys/mman.h>
+
+#include "external_data.hpp"
+#include "parser/code_source.hpp"
+
+namespace Whisper {
+
+
+//
+// ExternalDataTable
+//
+
+ExternalDataTable::ExternalDataTable()
+  : entries_(),
+    bytes_(0)
+{}
+
+ExternalDataTable::~ExternalDataTable()
+{
+    for (const Entry &entry : entries_)
+        ReleaseEntry(entry);
+}
+
+/*static*/ void *
+ExternalDataTable::Allocate(uint32_t size)
+{
+    WH_ASSERT(IsExternalSize(size));
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (data == MAP_FAILED) ? nullptr : data;
+}
+
+/*static*/ void
+ExternalDataTable::Release(void *data, uint32_t size)
+{
+    munmap(data, size);
+}
+
+bool
+ExternalDataTable::add(VM::HeapThing *owner, void *data, uint32_t size)
+{
+    Entry entry;
+    entry.owner = owner;
+    entry.data = data;
+    entry.size = size;
+    entry.source = nullptr;
+    try {
+        entries_.push_back(entry);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    bytes_ += size;
+    return true;
+}
+
+bool
+ExternalDataTable::addSource(VM::HeapThing *owner, SourceData *source)
+{
+    Entry entry;
+    entry.owner = owner;
+    entry.data = nullptr;
+    entry.size = 0;
+    entry.source = source;
+    try {
+        entries_.push_back(entry);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+/*static*/ void
+ExternalDataTable::ReleaseEntry(const Entry &entry)
+{
+    if (entry.source)
+        entry.source->release();
+    else
+        Release(entry.data, entry.size);
+}
+
+
+} // namespace Whisper
@@ -0,0 +1,114 @@
+#ifndef WHISPER__EXTERNAL_DATA_HPP
+#define WHISPER__EXTERNAL_DATA_HPP
+
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+
+namespace Whisper {
+
+class SourceData;
+
+namespace VM
+{
+    class HeapThing;
+}
+
+//
+// ExternalDataTable
+//
+// Large payloads of untraced heap things (the chars of a LinearString,
+// the bytes of a Bytecode) are kept outside the heap, in their own
+// mappings.  The heap thing is then small and fixed in size: it never
+// needs a singleton slab, and a collection moving it copies only the
+// pointer to its payload.
+//
+// Untraced things have no finalizers, so the payloads are not freed by
+// their owners.  Instead, each ThreadContext records the owner of every
+// payload it has mapped, and the collectors sweep the records once they
+// know which things are live: the payloads of dead owners are unmapped,
+// and the records of moved owners are updated.
+//
+// Things may also point into the source text of scripts (see
+// VM::SourceString).  They are recorded with a reference to the source's
+// data instead, which is released with them.
+//
+
+class ExternalDataTable
+{
+  public:
+    // Payloads of at least this many bytes are kept outside the heap.
+    static constexpr uint32_t MinSize = 16 * 1024;
+
+  private:
+    struct Entry
+    {
+        VM::HeapThing *owner;
+        void *data;
+        uint32_t size;
+        SourceData *source;
+    };
+
+    std::vector<Entry> entries_;
+    uint64_t bytes_;
+
+  public:
+    ExternalDataTable();
+    ~ExternalDataTable();
+
+    static inline bool IsExternalSize(uint32_t size) {
+        return size >= MinSize;
+    }
+
+    // Map |size| bytes for a payload.  Returns null on OOM.
+    static void *Allocate(uint32_t size);
+    static void Release(void *data, uint32_t size);
+
+    // Record that |owner| holds |data|, which is released once |owner|
+    // is collected.  Returns false on OOM.
+    bool add(VM::HeapThing *owner, void *data, uint32_t size);
+
+    // Record that |owner| points into |source|, taking over a reference
+    // to it.  Returns false on OOM, and then the reference is kept.
+    bool addSource(VM::HeapThing *owner, SourceData *source);
+
+    uint32_t count() const {
+        return entries_.size();
+    }
+
+    // Bytes held by payloads, not counting source data.
+    uint64_t bytes() const {
+        return bytes_;
+    }
+
+    // Called by the collectors.  |op| is given the owner of each
+    // payload, and returns where the owner is now, or null if it is
+    // dead.  Returns the number of bytes released.
+    template <typename OwnerOp>
+    uint64_t sweep(OwnerOp op) {
+        uint64_t released = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < entries_.size(); i++) {
+            Entry entry = entries_[i];
+            entry.owner = op(entry.owner);
+            if (!entry.owner) {
+                ReleaseEntry(entry);
+                released += entry.size;
+                continue;
+            }
+            entries_[kept++] = entry;
+        }
+        entries_.resize(kept);
+        bytes_ -= released;
+        return released;
+    }
+
+  private:
+    static void ReleaseEntry(const Entry &entry);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__EXTERNAL_DATA_HPP
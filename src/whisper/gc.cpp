@@ -0,0 +1,1745 @@
+
+#include <algorithm>
+#include <new>
+#include <setjmp.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "spew.hpp"
+#include "trace.hpp"
+#include "slab.hpp"
+#include "runtime.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "gc.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/tuple.hpp"
+#include "vm/ephemeron_table.hpp"
+#include "vm/script.hpp"
+#include "vm/stack_frame.hpp"
+#include "vm/shape_tree.hpp"
+#include "vm/object.hpp"
+#include "vm/global.hpp"
+
+namespace Whisper {
+
+using VM::FreeSpace;
+
+
+//
+// ConservativeStackScanner
+//
+
+ConservativeStackScanner::ConservativeStackScanner()
+  : ranges_()
+{}
+
+void
+ConservativeStackScanner::addSlabs(const SlabList &list)
+{
+    for (Slab *slab = list.firstSlab(); slab != nullptr; slab = slab->next()) {
+        SlabRange range;
+        range.start = slab->headStartAlloc();
+        range.end = slab->tailStartAlloc();
+        range.slab = slab;
+        ranges_.push_back(range);
+    }
+}
+
+void
+ConservativeStackScanner::scan(const void *stackBase,
+                               std::vector<Candidate> &candidates)
+{
+    std::sort(ranges_.begin(), ranges_.end());
+
+    // Spill the registers into this frame, so that the scan finds
+    // pointers held only in registers.
+    jmp_buf regs;
+    setjmp(regs);
+
+    uintptr_t start = AlignIntUp<uintptr_t>(
+        reinterpret_cast<uintptr_t>(&regs), sizeof(uintptr_t));
+    uintptr_t end = reinterpret_cast<uintptr_t>(stackBase);
+    WH_ASSERT(start < end);
+
+    for (uintptr_t word = start; word < end; word += sizeof(uintptr_t)) {
+        uint8_t *ptr = *reinterpret_cast<uint8_t **>(word);
+        Slab *slab = findSlab(ptr);
+        if (!slab)
+            continue;
+
+        // Only the allocated parts of a slab hold things.
+        if (ptr >= slab->headEndAlloc() && ptr < slab->tailEndAlloc())
+            continue;
+
+        Candidate candidate;
+        candidate.slab = slab;
+        candidate.ptr = ptr;
+        candidates.push_back(candidate);
+    }
+}
+
+/*static*/ VM::HeapThingHeader *
+ConservativeStackScanner::FindTenuredThing(Slab *slab, uint8_t *ptr)
+{
+    WH_ASSERT(slab->gen() == Slab::Tenured);
+
+    // Find a thing starting at or before |ptr| to walk forward from.
+    // The untraced area has no object start table, so it is walked from
+    // its lowest thing.
+    uint8_t *pos;
+    uint8_t *limit;
+    if (ptr >= slab->headStartAlloc() && ptr < slab->headEndAlloc()) {
+        uint32_t card = slab->calculateCardNumber(ptr);
+        pos = slab->objectStartBefore(card);
+        if (pos && pos > ptr)
+            pos = (card > 0) ? slab->objectStartBefore(card - 1) : nullptr;
+        limit = slab->headEndAlloc();
+    } else if (ptr >= slab->tailEndAlloc() && ptr < slab->tailStartAlloc()) {
+        pos = slab->tailEndAlloc();
+        limit = slab->tailStartAlloc();
+    } else {
+        return nullptr;
+    }
+
+    while (pos && pos < limit) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint8_t *end = pos + VM::HeapThingHeader::HeaderSize +
+                       hdr->reservedSpace();
+        if (ptr < end) {
+            if (hdr->type() == VM::HeapType::FreeSpace)
+                return nullptr;
+            return hdr;
+        }
+        pos = end;
+    }
+    return nullptr;
+}
+
+Slab *
+ConservativeStackScanner::findSlab(uint8_t *ptr) const
+{
+    SlabRange key;
+    key.start = ptr;
+    auto iter = std::upper_bound(ranges_.begin(), ranges_.end(), key);
+    if (iter == ranges_.begin())
+        return nullptr;
+    --iter;
+    return (ptr < iter->end) ? iter->slab : nullptr;
+}
+
+
+//
+// MinorCollector
+//
+
+MinorCollector::MinorCollector(ThreadContext *cx, bool tenureAll)
+  : cx_(cx),
+    fromNursery_(),
+    nurseryCursor_(),
+    tenuredCursor_(),
+    holderSlab_(nullptr),
+    markedThings_(),
+    weakRefs_(),
+    ephemerons_(),
+    pinnedSlabs_(),
+    nurseryBytes_(0),
+    tenuredBytes_(0),
+    markedCards_(0),
+    failed_(false),
+    tenureAll_(tenureAll)
+{
+    WH_ASSERT(cx_ != nullptr);
+}
+
+bool
+MinorCollector::collect()
+{
+    SpewMemoryNote("MinorGC: start (hatchery=%u slabs, nursery=%u slabs)",
+                   (unsigned) cx_->hatcheryList_.numSlabs(),
+                   (unsigned) cx_->nurseryList_.numSlabs());
+
+    // Pin young slabs before anything is moved.
+    if (cx_->conservativeStackBase_ && !pinConservativeRoots()) {
+        SpewMemoryError("MinorGC: failed to replace pinned hatchery.");
+        return false;
+    }
+
+    // The current nursery slabs are the from-space for this collection,
+    // along with the hatchery.  Survivors from the hatchery are copied
+    // into a new set of nursery slabs.
+    fromNursery_ = cx_->nurseryList_;
+    cx_->nurseryList_ = SlabList();
+    cx_->nursery_ = nullptr;
+
+    // Objects are promoted into the current tenured slab.  Move it to the
+    // end of the tenured list so that the tenured scan cursor, which
+    // walks the list in order, finds every promoted object.
+    SlabList &tenuredList = cx_->tenuredList_;
+    if (cx_->tenured_ != tenuredList.lastSlab()) {
+        if (cx_->sweepCursor_ == cx_->tenured_)
+            cx_->sweepCursor_ = cx_->tenured_->next();
+        tenuredList.removeSlab(cx_->tenured_);
+        tenuredList.addSlab(cx_->tenured_);
+    }
+    tenuredCursor_.slab = cx_->tenured_;
+    tenuredCursor_.pos = cx_->tenured_->headEndAlloc();
+
+    // Evacuate the objects referenced directly from marked cards
+    // and roots.
+    scanMarkedCards();
+    scanRoots();
+    scanRunContexts();
+    scanPinnedSlabs();
+
+    // Scan evacuated objects until there is nothing left to scan.
+    // Tracing ephemerons whose keys were evacuated may leave more.
+    do {
+        for (;;) {
+            bool scanned = scanSlabs(cx_->nurseryList_, nurseryCursor_);
+            if (scanSlabs(tenuredList, tenuredCursor_))
+                scanned = true;
+
+            if (!scanned)
+                break;
+        }
+    } while (traceEphemerons());
+
+    sweepWeakRefs();
+    sweepExternalData();
+
+    if (failed_) {
+        // Some objects could not be moved because destination slabs
+        // could not be allocated.  Every reference has still been
+        // updated to the current location of its object, so the heap
+        // is consistent, but from-space cannot be released.
+        SpewMemoryError("MinorGC: failed to allocate destination slab.");
+        while (Slab *slab = fromNursery_.firstSlab()) {
+            fromNursery_.removeSlab(slab);
+            cx_->nurseryList_.addSlab(slab);
+        }
+        unpinSlabs();
+        return false;
+    }
+
+    releaseFromSpace();
+    unpinSlabs();
+
+    SpewMemoryNote("MinorGC: done (nursery=%u bytes, tenured=%u bytes, "
+                   "marked cards=%u, pinned slabs=%u)",
+                   (unsigned) nurseryBytes_, (unsigned) tenuredBytes_,
+                   (unsigned) markedCards_, (unsigned) pinnedSlabs_.size());
+    return true;
+}
+
+bool
+MinorCollector::pinConservativeRoots()
+{
+    ConservativeStackScanner scanner;
+    scanner.addSlabs(cx_->hatcheryList_);
+    scanner.addSlabs(cx_->nurseryList_);
+
+    std::vector<ConservativeStackScanner::Candidate> candidates;
+    scanner.scan(cx_->conservativeStackBase_, candidates);
+
+    uint32_t pinnedHatchery = 0;
+    for (const ConservativeStackScanner::Candidate &candidate : candidates) {
+        Slab *slab = candidate.slab;
+        if (slab->isPinned())
+            continue;
+        slab->setPinned(true);
+        pinnedSlabs_.push_back(slab);
+        if (slab->gen() == Slab::Hatchery)
+            pinnedHatchery++;
+    }
+
+    // Pinned hatchery slabs move to the nursery, so the hatchery needs
+    // a slab which is not pinned.
+    if (pinnedHatchery < cx_->hatcheryList_.numSlabs())
+        return true;
+
+    Slab *slab = cx_->allocateStandardSlab(Slab::Hatchery);
+    if (!slab) {
+        unpinSlabs();
+        return false;
+    }
+    cx_->hatcheryList_.addSlab(slab);
+    return true;
+}
+
+void
+MinorCollector::unpinSlabs()
+{
+    for (Slab *slab : pinnedSlabs_)
+        slab->setPinned(false);
+}
+
+void
+MinorCollector::scanRoots()
+{
+    RootStack &roots = cx_->rootStack_;
+    for (RootStack::Entry *entry = roots.base(); entry < roots.top();
+         entry++)
+    {
+        switch (entry->kind) {
+          case RootKind::Value:
+            updateRef(HeapRef::FromValue(entry->thingAddr<Value>()));
+            break;
+
+          case RootKind::HeapThing:
+            updateRef(HeapRef::FromHeapThing(
+                entry->thingAddr<VM::HeapThing *>()));
+            break;
+
+          case RootKind::ValueVector: {
+            VectorRootBase<Value> *vec =
+                static_cast<VectorRootBase<Value> *>(
+                    *entry->thingAddr<RootBase *>());
+            for (uint32_t i = 0; i < vec->size(); i++)
+                updateRef(HeapRef::FromValue(&vec->ref(i)));
+            break;
+          }
+
+          case RootKind::HeapThingVector: {
+            VectorRootBase<VM::HeapThing *> *vec =
+                static_cast<VectorRootBase<VM::HeapThing *> *>(
+                    *entry->thingAddr<RootBase *>());
+            for (uint32_t i = 0; i < vec->size(); i++)
+                updateRef(HeapRef::FromHeapThing(&vec->ref(i)));
+            break;
+          }
+
+          default:
+            WH_UNREACHABLE("Invalid root kind.");
+            break;
+        }
+    }
+}
+
+void
+MinorCollector::scanRunContexts()
+{
+    // The frames on native stacks are roots.
+    for (RunContext *runcx = cx_->runContextList_; runcx != nullptr;
+         runcx = runcx->next_)
+    {
+        for (VM::NativeFrame *frame = runcx->nativeStack_.topFrame();
+             frame != nullptr;
+             frame = frame->hasCallerFrame() ? frame->callerFrame() : nullptr)
+        {
+            updateRef(HeapRef::FromHeapThing(frame->addressOfScript()));
+            Value *vals = frame->valuesStart();
+            for (uint32_t i = 0; i < frame->numLiveValues(); i++)
+                updateRef(HeapRef::FromValue(&vals[i]));
+        }
+    }
+}
+
+void
+MinorCollector::scanPinnedSlabs()
+{
+    // Pinned things stay where they are, and may be referred to only
+    // from the native stack, so they are all treated as live.
+    for (Slab *slab : pinnedSlabs_) {
+        uint8_t *pos = slab->headStartAlloc();
+        while (pos < slab->headEndAlloc()) {
+            VM::HeapThingHeader *hdr =
+                reinterpret_cast<VM::HeapThingHeader *>(pos);
+            WH_ASSERT(!hdr->isForwarded());
+            pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+            scanHeapThing(hdr->payload());
+        }
+    }
+}
+
+void
+MinorCollector::scanMarkedCards()
+{
+    // Only slabs in the list at the start of the collection can have
+    // marked cards.  In the promotion slab, only the area before the
+    // tenured cursor needs to be scanned: promoted objects are scanned
+    // through the cursor.
+    for (Slab *slab = cx_->frozenList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        scanMarkedCards(slab, slab->headEndAlloc());
+    }
+    for (Slab *slab = cx_->tenuredList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        if (slab == tenuredCursor_.slab) {
+            scanMarkedCards(slab, tenuredCursor_.pos);
+            break;
+        }
+        scanMarkedCards(slab, slab->headEndAlloc());
+    }
+}
+
+void
+MinorCollector::scanMarkedCards(Slab *slab, uint8_t *limit)
+{
+    // Collect and clear the marked cards first, since scanning things
+    // may mark the cards of the things again.
+    markedThings_.clear();
+    uint8_t *nextThing = slab->headStartAlloc();
+    for (uint32_t card = 0; card < slab->dataCards(); card++) {
+        if (!slab->isCardMarked(card))
+            continue;
+        slab->clearCard(card);
+        markedCards_++;
+
+        uint8_t *cardStart = slab->cardStart(card);
+        uint8_t *cardEnd = cardStart + Slab::CardSize;
+        if (cardStart >= limit)
+            continue;
+
+        // Start from a thing beginning before the card, since the first
+        // thing starting on the card may be preceded by one spanning
+        // into it.  Things already collected for a previous card are
+        // skipped.
+        uint8_t *pos = slab->objectStartBefore(card > 0 ? card - 1 : 0);
+        if (!pos)
+            continue;
+        if (pos < nextThing)
+            pos = nextThing;
+
+        while (pos < limit && pos < cardEnd) {
+            VM::HeapThingHeader *hdr =
+                reinterpret_cast<VM::HeapThingHeader *>(pos);
+            uint8_t *end = pos + VM::HeapThingHeader::HeaderSize +
+                           hdr->reservedSpace();
+
+            // Free space, and dead things in slabs awaiting a sweep,
+            // are skipped: their references may be stale.
+            bool dead = hdr->type() == VM::HeapType::FreeSpace ||
+                        (slab->needsSweep() && !slab->isMarked(hdr));
+            if (end > cardStart && !dead)
+                markedThings_.push_back(pos);
+            pos = end;
+        }
+        nextThing = pos;
+    }
+
+    holderSlab_ = slab;
+    for (uint8_t *pos : markedThings_) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        scanHeapThing(hdr->payload());
+    }
+    holderSlab_ = nullptr;
+}
+
+bool
+MinorCollector::scanSlabs(const SlabList &list, ScanCursor &cursor)
+{
+    if (!cursor.slab) {
+        if (!list.firstSlab())
+            return false;
+        cursor.slab = list.firstSlab();
+        cursor.pos = cursor.slab->headStartAlloc();
+    }
+
+    bool scanned = false;
+    for (;;) {
+        while (cursor.pos < cursor.slab->headEndAlloc()) {
+            VM::HeapThingHeader *hdr =
+                reinterpret_cast<VM::HeapThingHeader *>(cursor.pos);
+            WH_ASSERT(!hdr->isForwarded());
+
+            cursor.pos += VM::HeapThingHeader::HeaderSize +
+                          hdr->reservedSpace();
+
+            holderSlab_ = (cursor.slab->gen() == Slab::Tenured) ? cursor.slab
+                                                                : nullptr;
+            scanHeapThing(hdr->payload());
+            holderSlab_ = nullptr;
+            scanned = true;
+        }
+
+        if (!cursor.slab->next())
+            break;
+
+        cursor.slab = cursor.slab->next();
+        cursor.pos = cursor.slab->headStartAlloc();
+    }
+
+    return scanned;
+}
+
+void
+MinorCollector::scanHeapThing(VM::HeapThing *thing)
+{
+    // Tables hashing their keys by address must rehash once the keys
+    // may have moved.
+    if (thing->isEphemeronTable())
+        thing->toEphemeronTable()->noteKeysMoved();
+
+    switch (thing->type()) {
+#define CASE_(name) \
+      case VM::HeapType::name: \
+        scanRefs(thing->to##name()); \
+        break;
+    WHISPER_DEFN_SCANNED_HEAP_TYPES(CASE_)
+#undef CASE_
+
+      default:
+        WH_UNREACHABLE("Cannot trace heap type.");
+        break;
+    }
+}
+
+void
+MinorCollector::updateRef(const HeapRef &ref)
+{
+    // An ephemeron value is set aside, whatever it holds, until its key
+    // is known to be live, so that it can be cleared if the key dies.
+    if (ref.isEphemeronValue() && !isEphemeronKeyLive(ref)) {
+        deferRef(ephemerons_, ref);
+        return;
+    }
+
+    VM::HeapThing *thing = reinterpret_cast<VM::HeapThing *>(ref.read());
+    if (!thing || !isYoung(thing))
+        return;
+
+    if (ref.isWeak()) {
+        deferRef(weakRefs_, ref);
+        return;
+    }
+
+    thing = evacuate(thing);
+    ref.update(thing);
+    noteReference(ref.slot(), thing);
+}
+
+void
+MinorCollector::deferRef(std::vector<DeferredRef> &list, const HeapRef &ref)
+{
+    DeferredRef deferred;
+    deferred.ref = ref;
+    deferred.holderSlab = holderSlab_;
+    list.push_back(deferred);
+}
+
+bool
+MinorCollector::traceEphemerons()
+{
+    bool traced = false;
+    size_t kept = 0;
+    for (size_t i = 0; i < ephemerons_.size(); i++) {
+        DeferredRef deferred = ephemerons_[i];
+        if (!isEphemeronKeyLive(deferred.ref)) {
+            ephemerons_[kept++] = deferred;
+            continue;
+        }
+
+        holderSlab_ = deferred.holderSlab;
+        updateRef(deferred.ref);
+        holderSlab_ = nullptr;
+        traced = true;
+    }
+    ephemerons_.resize(kept);
+    return traced;
+}
+
+void
+MinorCollector::sweepWeakRefs()
+{
+    // The keys of the remaining ephemerons are dead, and are among the
+    // weak refs cleared below.
+    for (const DeferredRef &deferred : ephemerons_)
+        deferred.ref.clear();
+    ephemerons_.clear();
+
+    for (const DeferredRef &deferred : weakRefs_) {
+        const HeapRef &ref = deferred.ref;
+        VM::HeapThing *thing = reinterpret_cast<VM::HeapThing *>(ref.read());
+        WH_ASSERT(thing && isYoung(thing));
+        if (!isKnownLive(thing)) {
+            ref.clear();
+            continue;
+        }
+
+        if (thing->header()->isForwarded()) {
+            thing = thing->header()->forwardedTo();
+            ref.update(thing);
+        }
+        holderSlab_ = deferred.holderSlab;
+        noteReference(ref.slot(), thing);
+        holderSlab_ = nullptr;
+    }
+    weakRefs_.clear();
+}
+
+void
+MinorCollector::sweepExternalData()
+{
+    uint64_t released = cx_->externalData_.sweep(
+        [this](VM::HeapThing *owner) -> VM::HeapThing * {
+            if (!isYoung(owner))
+                return owner;
+            if (!isKnownLive(owner))
+                return nullptr;
+            if (owner->header()->isForwarded())
+                return owner->header()->forwardedTo();
+            return owner;
+        });
+    cx_->noteExternalReleased(released);
+}
+
+void
+MinorCollector::noteReference(void *location, VM::HeapThing *thing)
+{
+    if (holderSlab_ && isYoung(thing))
+        holderSlab_->markCardFor(location);
+}
+
+bool
+MinorCollector::isYoung(VM::HeapThing *thing) const
+{
+    const VM::HeapThingHeader *hdr = thing->header();
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    return slab->gen() == Slab::Hatchery || slab->gen() == Slab::Nursery;
+}
+
+bool
+MinorCollector::isKnownLive(VM::HeapThing *thing) const
+{
+    // Things which could not be evacuated stay where they are.
+    if (failed_)
+        return true;
+
+    const VM::HeapThingHeader *hdr = thing->header();
+    if (hdr->isForwarded())
+        return true;
+    return Slab::FromAllocation(hdr, hdr->cardNo())->isPinned();
+}
+
+bool
+MinorCollector::isEphemeronKeyLive(const HeapRef &ref) const
+{
+    VM::HeapThing *key =
+        reinterpret_cast<VM::HeapThing *>(ref.ephemeronKey().read());
+    return !key || !isYoung(key) || isKnownLive(key);
+}
+
+VM::HeapThing *
+MinorCollector::evacuate(VM::HeapThing *thing)
+{
+    VM::HeapThingHeader *hdr = thing->header();
+    if (hdr->isForwarded())
+        return hdr->forwardedTo();
+
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    WH_ASSERT(slab->gen() != Slab::Tenured);
+    if (slab->isPinned())
+        return thing;
+
+    // Hatchery survivors move to the nursery, unless everything is
+    // being tenured.  Nursery survivors are promoted.
+    Slab::Generation destGen =
+        (slab->gen() == Slab::Hatchery && !tenureAll_) ? Slab::Nursery
+                                                      : Slab::Tenured;
+
+    uint32_t allocSize = VM::HeapThingHeader::HeaderSize +
+                         hdr->reservedSpace();
+    bool traced = VM::IsTracedHeapType(hdr->type());
+
+    // Once the nursery has grown to its limit, survivors which do not
+    // fit in its current slab are promoted.
+    if (destGen == Slab::Nursery && nurseryFull(allocSize, traced))
+        destGen = Slab::Tenured;
+
+    Slab *destSlab = nullptr;
+    uint8_t *mem = allocateIn(destGen, allocSize, traced, &destSlab);
+    if (!mem) {
+        failed_ = true;
+        return thing;
+    }
+
+    memcpy(mem, hdr, allocSize);
+
+    VM::HeapThingHeader *newHdr = reinterpret_cast<VM::HeapThingHeader *>(mem);
+    newHdr->setCardNo(destSlab->calculateCardNumber(mem));
+
+    VM::HeapThing *newThing = newHdr->payload();
+    hdr->setForwarded(newThing);
+
+    if (destGen == Slab::Nursery) {
+        nurseryBytes_ += allocSize;
+
+        // Count survivors of tracked allocation sites.
+        if (uint32_t site = hdr->allocSite())
+            cx_->allocSites_[site].survived++;
+    } else {
+        tenuredBytes_ += allocSize;
+    }
+
+    return newThing;
+}
+
+uint8_t *
+MinorCollector::allocateIn(Slab::Generation gen, uint32_t allocSize,
+                           bool traced, Slab **slabOut)
+{
+    WH_ASSERT(gen == Slab::Nursery || gen == Slab::Tenured);
+
+    Slab *&current = (gen == Slab::Nursery) ? cx_->nursery_ : cx_->tenured_;
+    SlabList &list = (gen == Slab::Nursery) ? cx_->nurseryList_
+                                            : cx_->tenuredList_;
+
+    uint8_t *mem = nullptr;
+    if (current) {
+        mem = traced ? current->allocateHead(allocSize)
+                     : current->allocateTail(allocSize);
+    }
+
+    if (!mem) {
+        // Every young object was allocated in a standard slab, so it
+        // will always fit in a fresh one.
+        Slab *slab = cx_->allocateStandardSlab(gen);
+        if (!slab)
+            return nullptr;
+
+        list.addSlab(slab);
+        current = slab;
+
+        mem = traced ? current->allocateHead(allocSize)
+                     : current->allocateTail(allocSize);
+        WH_ASSERT(mem);
+    }
+
+    *slabOut = current;
+    return mem;
+}
+
+bool
+MinorCollector::nurseryFull(uint32_t allocSize, bool traced) const
+{
+    uint32_t maxSlabs = cx_->runtime()->config().nurserySlabs;
+    if (maxSlabs == 0 || cx_->nurseryList_.numSlabs() < maxSlabs)
+        return false;
+
+    Slab *slab = cx_->nursery_;
+    return !slab || !CanAllocateInSlab(slab, allocSize, traced);
+}
+
+void
+MinorCollector::releaseFromSpace()
+{
+    // Release the old nursery slabs.  Pinned ones stay in the nursery.
+    while (Slab *slab = fromNursery_.firstSlab()) {
+        fromNursery_.removeSlab(slab);
+        if (slab->isPinned())
+            cx_->nurseryList_.addSlab(slab);
+        else
+            cx_->releaseSlab(slab);
+    }
+
+    // Pinned hatchery slabs move to the nursery.
+    SlabList &hatcheryList = cx_->hatcheryList_;
+    for (Slab *slab : pinnedSlabs_) {
+        if (slab->gen() != Slab::Hatchery)
+            continue;
+        hatcheryList.removeSlab(slab);
+        slab->moveToNursery();
+        cx_->nurseryList_.addSlab(slab);
+    }
+
+    // Release all but the first hatchery slab, and reset it.
+    while (hatcheryList.numSlabs() > 1) {
+        Slab *slab = hatcheryList.lastSlab();
+        hatcheryList.removeSlab(slab);
+        cx_->releaseSlab(slab);
+    }
+
+    Slab *hatchery = hatcheryList.firstSlab();
+    WH_ASSERT(hatchery != nullptr);
+
+#if defined(ENABLE_DEBUG)
+    // Poison the dead hatchery contents to catch stale references.
+    uint8_t *start = hatchery->headStartAlloc();
+    memset(start, 0xDB, hatchery->tailStartAlloc() - start);
+#endif
+
+    hatchery->resetAllocation();
+    cx_->hatchery_ = hatchery;
+
+    for (RunContext *runcx = cx_->runContextList_; runcx != nullptr;
+         runcx = runcx->next_)
+    {
+        if (runcx->hatchery_)
+            runcx->hatchery_ = hatchery;
+    }
+}
+
+
+
+
+//
+// MajorCollector
+//
+
+/*static*/ uint32_t
+MajorCollector::DefaultNumWorkers()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > static_cast<long>(MaxWorkers))
+        return MaxWorkers;
+    return cpus;
+}
+
+MajorCollector::Worker::Worker()
+  : collector(nullptr),
+    index(0),
+    thread(),
+    lock(),
+    stack(),
+    stackSize(0),
+    weakRefs(),
+    ephemerons(),
+    scannedThings(0),
+    scannedSlabs(0),
+    steals(0)
+{
+    pthread_mutex_init(&lock, nullptr);
+}
+
+MajorCollector::Worker::~Worker()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+MajorCollector::MajorCollector(ThreadContext *cx, uint32_t numWorkers,
+                               bool compact)
+  : cx_(cx),
+    numWorkers_(numWorkers),
+    workers_(),
+    rootSlabs_(),
+    nextRootSlab_(0),
+    idleWorkers_(0),
+    compact_(compact),
+    pinnedSlabs_()
+{
+    WH_ASSERT(cx_ != nullptr);
+    WH_ASSERT(numWorkers_ >= 1 && numWorkers_ <= MaxWorkers);
+
+    for (uint32_t i = 0; i < numWorkers_; i++) {
+        workers_[i].collector = this;
+        workers_[i].index = i;
+    }
+}
+
+bool
+MajorCollector::collect()
+{
+    SpewMemoryNote("MajorGC: start (tenured=%u slabs, workers=%u)",
+                   (unsigned) cx_->tenuredList_.numSlabs(),
+                   (unsigned) numWorkers_);
+
+    for (Slab *slab = cx_->tenuredList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        slab->clearMarks();
+    }
+
+    // Every young and frozen thing is treated as live.
+    for (Slab *slab = cx_->hatcheryList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        rootSlabs_.push_back(slab);
+    }
+    for (Slab *slab = cx_->nurseryList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        rootSlabs_.push_back(slab);
+    }
+    for (Slab *slab = cx_->frozenList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        rootSlabs_.push_back(slab);
+    }
+
+    {
+        TraceScope trace(TraceCategory::GC, "mark");
+        markRoots();
+        if (!runWorkers())
+            SpewMemoryWarn("MajorGC: could not start all mark workers.");
+        traceEphemerons();
+    }
+
+    {
+        TraceScope trace(TraceCategory::GC, "sweep_weak");
+        sweepWeakRefs();
+        sweepStringTable();
+        sweepExternalData();
+    }
+
+    uint32_t scanned = 0;
+    uint32_t steals = 0;
+    for (uint32_t i = 0; i < numWorkers_; i++) {
+        WH_ASSERT(workers_[i].stack.empty());
+        scanned += workers_[i].scannedThings;
+        steals += workers_[i].steals;
+    }
+
+    SpewMemoryNote("MajorGC: done (scanned=%u things, steals=%u)",
+                   (unsigned) scanned, (unsigned) steals);
+
+    if (compact_)
+        compact();
+
+    for (Slab *slab : pinnedSlabs_)
+        slab->setPinned(false);
+    return true;
+}
+
+template <typename RefOp>
+void
+MajorCollector::forEachRoot(RefOp op)
+{
+    RootStack &roots = cx_->rootStack_;
+    for (RootStack::Entry *entry = roots.base(); entry < roots.top();
+         entry++)
+    {
+        switch (entry->kind) {
+          case RootKind::Value:
+            op(HeapRef::FromValue(entry->thingAddr<Value>()));
+            break;
+
+          case RootKind::HeapThing:
+            op(HeapRef::FromHeapThing(entry->thingAddr<VM::HeapThing *>()));
+            break;
+
+          case RootKind::ValueVector: {
+            VectorRootBase<Value> *vec =
+                static_cast<VectorRootBase<Value> *>(
+                    *entry->thingAddr<RootBase *>());
+            for (uint32_t i = 0; i < vec->size(); i++)
+                op(HeapRef::FromValue(&vec->ref(i)));
+            break;
+          }
+
+          case RootKind::HeapThingVector: {
+            VectorRootBase<VM::HeapThing *> *vec =
+                static_cast<VectorRootBase<VM::HeapThing *> *>(
+                    *entry->thingAddr<RootBase *>());
+            for (uint32_t i = 0; i < vec->size(); i++)
+                op(HeapRef::FromHeapThing(&vec->ref(i)));
+            break;
+          }
+
+          default:
+            WH_UNREACHABLE("Invalid root kind.");
+            break;
+        }
+    }
+
+    for (RunContext *runcx = cx_->runContextList_; runcx != nullptr;
+         runcx = runcx->next_)
+    {
+        for (VM::NativeFrame *frame = runcx->nativeStack_.topFrame();
+             frame != nullptr;
+             frame = frame->hasCallerFrame() ? frame->callerFrame() : nullptr)
+        {
+            op(HeapRef::FromHeapThing(frame->addressOfScript()));
+            Value *vals = frame->valuesStart();
+            for (uint32_t i = 0; i < frame->numLiveValues(); i++)
+                op(HeapRef::FromValue(&vals[i]));
+        }
+    }
+
+    for (VM::LinearString *&atom : cx_->stringTable_.atoms_)
+        op(HeapRef::FromHeapThing(&atom));
+    op(HeapRef::FromHeapThing(&cx_->emptyObjectShape_));
+    op(HeapRef::FromHeapThing(&cx_->global_));
+}
+
+void
+MajorCollector::markRoots()
+{
+    // Grey roots are all pushed onto the first worker's stack.  Other
+    // workers pick them up by stealing.
+    forEachRoot([this] (const HeapRef &ref) { markRootRef(ref); });
+
+    // The string table holds its strings weakly (see sweepStringTable).
+    if (VM::Tuple *tuple = cx_->stringTable_.tuple_)
+        mark(tuple);
+
+    if (cx_->conservativeStackBase_)
+        markConservativeRoots();
+}
+
+void
+MajorCollector::markConservativeRoots()
+{
+    // Young things are all live anyway, so only tenured slabs are
+    // scanned for.
+    ConservativeStackScanner scanner;
+    scanner.addSlabs(cx_->tenuredList_);
+
+    std::vector<ConservativeStackScanner::Candidate> candidates;
+    scanner.scan(cx_->conservativeStackBase_, candidates);
+
+    for (const ConservativeStackScanner::Candidate &candidate : candidates) {
+        VM::HeapThingHeader *hdr =
+            ConservativeStackScanner::FindTenuredThing(candidate.slab,
+                                                       candidate.ptr);
+        if (!hdr)
+            continue;
+        if (mark(hdr->payload()))
+            push(workers_[0], hdr->payload());
+
+        // Things the native stack refers to must not be moved.
+        if (compact_ && !candidate.slab->isPinned()) {
+            try {
+                pinnedSlabs_.push_back(candidate.slab);
+            } catch (std::bad_alloc &err) {
+                compact_ = false;
+                continue;
+            }
+            candidate.slab->setPinned(true);
+        }
+    }
+}
+
+void
+MajorCollector::markRootRef(const HeapRef &ref)
+{
+    markRef(workers_[0], ref);
+}
+
+bool
+MajorCollector::runWorkers()
+{
+    uint32_t started = 1;
+    for (; started < numWorkers_; started++) {
+        Worker &worker = workers_[started];
+        if (pthread_create(&worker.thread, nullptr, WorkerMain, &worker) != 0)
+            break;
+    }
+
+    // Workers which could not be started hold no work, and count as
+    // idle from the outset.
+    if (started < numWorkers_)
+        idleWorkers_.fetch_add(numWorkers_ - started);
+
+    workerRun(workers_[0]);
+
+    for (uint32_t i = 1; i < started; i++)
+        pthread_join(workers_[i].thread, nullptr);
+
+    return started == numWorkers_;
+}
+
+/*static*/ void *
+MajorCollector::WorkerMain(void *arg)
+{
+    Worker *worker = reinterpret_cast<Worker *>(arg);
+    worker->collector->workerRun(*worker);
+    return nullptr;
+}
+
+void
+MajorCollector::workerRun(Worker &worker)
+{
+    TraceScope trace(TraceCategory::GC, "mark_worker");
+
+    // Claim and scan root slabs.
+    for (;;) {
+        uint32_t idx = nextRootSlab_.fetch_add(1);
+        if (idx >= rootSlabs_.size())
+            break;
+        scanRootSlab(worker, rootSlabs_[idx]);
+        worker.scannedSlabs++;
+    }
+
+    // Drain the mark stack, stealing when it runs dry.  An idle worker
+    // never gains work without leaving the idle state, so once every
+    // worker is idle, all mark stacks are empty.
+    for (;;) {
+        MarkItem item;
+        if (pop(worker, &item)) {
+            if (item.start < item.end) {
+                scanTupleChunk(worker, item.thing->toTuple(), item.start,
+                               item.end);
+            } else {
+                scanHeapThing(worker, item.thing);
+            }
+            continue;
+        }
+
+        if (steal(worker))
+            continue;
+
+        idleWorkers_.fetch_add(1);
+        for (;;) {
+            if (idleWorkers_.load() == numWorkers_)
+                return;
+            if (anyWorkAvailable())
+                break;
+            sched_yield();
+        }
+        idleWorkers_.fetch_sub(1);
+    }
+}
+
+void
+MajorCollector::scanRootSlab(Worker &worker, Slab *slab)
+{
+    uint8_t *pos = slab->headStartAlloc();
+    while (pos < slab->headEndAlloc()) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        WH_ASSERT(!hdr->isForwarded());
+        pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+
+        // Frozen slabs were swept before they were frozen.
+        if (hdr->type() == VM::HeapType::FreeSpace)
+            continue;
+
+        // The string table's tuple is never scanned.
+        if (hdr->payload() == cx_->stringTable_.tuple_)
+            continue;
+        scanHeapThing(worker, hdr->payload());
+    }
+}
+
+void
+MajorCollector::scanHeapThing(Worker &worker, VM::HeapThing *thing)
+{
+    if (thing->isTuple() && thing->toTuple()->size() > MarkChunkValues) {
+        scanLargeTuple(worker, thing->toTuple());
+        return;
+    }
+
+    switch (thing->type()) {
+#define CASE_(name) \
+      case VM::HeapType::name: \
+        scanRefs(worker, thing->to##name()); \
+        break;
+    WHISPER_DEFN_SCANNED_HEAP_TYPES(CASE_)
+#undef CASE_
+
+      default:
+        WH_UNREACHABLE("Cannot trace heap type.");
+        break;
+    }
+}
+
+void
+MajorCollector::scanLargeTuple(Worker &worker, VM::Tuple *tuple)
+{
+    // Push all but the first chunk, then scan that one, so that idle
+    // workers can steal the rest meanwhile.
+    pushChunks(worker, tuple, MarkChunkValues);
+    scanTupleChunk(worker, tuple, 0, MarkChunkValues);
+}
+
+void
+MajorCollector::scanTupleChunk(Worker &worker, VM::Tuple *tuple,
+                               uint32_t start, uint32_t end)
+{
+    RefScanner<VM::Tuple> scanner(*tuple, start, end);
+    while (scanner.hasMoreRefs())
+        markRef(worker, scanner.nextRef());
+}
+
+void
+MajorCollector::markRef(Worker &worker, const HeapRef &ref)
+{
+    // An ephemeron value is recorded, whatever it holds, until its key
+    // is marked, so that it can be cleared if the key dies.
+    if (ref.isEphemeronValue()) {
+        VM::HeapThing *key =
+            reinterpret_cast<VM::HeapThing *>(ref.ephemeronKey().read());
+        if (key && !IsLive(key)) {
+            worker.ephemerons.push_back(ref);
+            return;
+        }
+    }
+
+    VM::HeapThing *thing = reinterpret_cast<VM::HeapThing *>(ref.read());
+    if (!thing)
+        return;
+
+    if (ref.isWeak()) {
+        if (!IsLive(thing))
+            worker.weakRefs.push_back(ref);
+        return;
+    }
+
+    if (mark(thing))
+        push(worker, thing);
+}
+
+bool
+MajorCollector::mark(VM::HeapThing *thing)
+{
+    VM::HeapThingHeader *hdr = thing->header();
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    if (slab->gen() != Slab::Tenured)
+        return false;
+
+    if (!slab->tryMark(hdr))
+        return false;
+
+    return VM::IsTracedHeapType(hdr->type());
+}
+
+/*static*/ bool
+MajorCollector::IsLive(VM::HeapThing *thing)
+{
+    VM::HeapThingHeader *hdr = thing->header();
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    return slab->gen() != Slab::Tenured || slab->isMarked(hdr);
+}
+
+void
+MajorCollector::traceEphemerons()
+{
+    // Marking an ephemeron value may mark the keys of others, so this
+    // repeats until no key is newly found marked.  The recorded values
+    // of all workers are gathered on the calling thread's worker, which
+    // drains its stack alone after each round.
+    Worker &worker = workers_[0];
+    for (uint32_t i = 1; i < numWorkers_; i++) {
+        std::vector<HeapRef> &other = workers_[i].ephemerons;
+        worker.ephemerons.insert(worker.ephemerons.end(), other.begin(),
+                                 other.end());
+        other.clear();
+    }
+
+    std::vector<HeapRef> pending;
+    for (;;) {
+        pending.clear();
+        pending.swap(worker.ephemerons);
+
+        bool marked = false;
+        for (const HeapRef &ref : pending) {
+            VM::HeapThing *key =
+                reinterpret_cast<VM::HeapThing *>(ref.ephemeronKey().read());
+            if (!IsLive(key)) {
+                worker.ephemerons.push_back(ref);
+                continue;
+            }
+            markRef(worker, ref);
+            marked = true;
+        }
+
+        if (!marked)
+            break;
+
+        idleWorkers_.store(numWorkers_ - 1);
+        workerRun(worker);
+    }
+}
+
+void
+MajorCollector::sweepWeakRefs()
+{
+    // The keys of the remaining ephemerons are dead, and are among the
+    // weak refs cleared below.
+    uint32_t cleared = 0;
+    for (const HeapRef &ref : workers_[0].ephemerons)
+        ref.clear();
+    workers_[0].ephemerons.clear();
+
+    for (uint32_t i = 0; i < numWorkers_; i++) {
+        for (const HeapRef &ref : workers_[i].weakRefs) {
+            VM::HeapThing *thing =
+                reinterpret_cast<VM::HeapThing *>(ref.read());
+            if (thing && !IsLive(thing)) {
+                ref.clear();
+                cleared++;
+            }
+        }
+        workers_[i].weakRefs.clear();
+    }
+
+    if (cleared > 0)
+        SpewMemoryNote("MajorGC: cleared %u weak refs", (unsigned) cleared);
+}
+
+void
+MajorCollector::sweepStringTable()
+{
+    // Atoms are roots, so they are never removed.
+    StringTable &table = cx_->stringTable_;
+    VM::Tuple *tuple = table.tuple_;
+    if (!tuple)
+        return;
+
+    uint32_t removed = 0;
+    for (uint32_t i = 0; i < tuple->size(); i++) {
+        Handle<Value> val = tuple->get(i);
+        if (!val->isHeapString() || IsLive(val->heapStringPtr()))
+            continue;
+        table.removeString(i);
+        removed++;
+    }
+
+    if (removed > 0) {
+        SpewMemoryNote("MajorGC: removed %u dead interned strings",
+                       (unsigned) removed);
+    }
+}
+
+void
+MajorCollector::sweepExternalData()
+{
+    uint64_t released = cx_->externalData_.sweep(
+        [](VM::HeapThing *owner) -> VM::HeapThing * {
+            return IsLive(owner) ? owner : nullptr;
+        });
+    cx_->noteExternalReleased(released);
+
+    if (released > 0) {
+        SpewMemoryNote("MajorGC: released %u bytes of external data",
+                       (unsigned) released);
+    }
+}
+
+void
+MajorCollector::push(Worker &worker, VM::HeapThing *thing)
+{
+    pthread_mutex_lock(&worker.lock);
+    worker.stack.push_back({thing, 0, 0});
+    worker.stackSize.store(worker.stack.size());
+    pthread_mutex_unlock(&worker.lock);
+    worker.scannedThings++;
+}
+
+void
+MajorCollector::pushChunks(Worker &worker, VM::Tuple *tuple, uint32_t start)
+{
+    uint32_t size = tuple->size();
+    pthread_mutex_lock(&worker.lock);
+    for (uint32_t i = start; i < size; i += MarkChunkValues) {
+        uint32_t end = (size - i > MarkChunkValues) ? i + MarkChunkValues
+                                                    : size;
+        worker.stack.push_back({tuple, i, end});
+    }
+    worker.stackSize.store(worker.stack.size());
+    pthread_mutex_unlock(&worker.lock);
+}
+
+bool
+MajorCollector::pop(Worker &worker, MarkItem *itemOut)
+{
+    pthread_mutex_lock(&worker.lock);
+    bool result = !worker.stack.empty();
+    if (result) {
+        *itemOut = worker.stack.back();
+        worker.stack.pop_back();
+        worker.stackSize.store(worker.stack.size());
+    }
+    pthread_mutex_unlock(&worker.lock);
+    return result;
+}
+
+bool
+MajorCollector::steal(Worker &worker)
+{
+    std::vector<MarkItem> stolen;
+    for (uint32_t i = 1; i < numWorkers_; i++) {
+        Worker &victim = workers_[(worker.index + i) % numWorkers_];
+        if (victim.stackSize.load() == 0)
+            continue;
+
+        // Take the older half of the victim's stack.
+        pthread_mutex_lock(&victim.lock);
+        size_t count = (victim.stack.size() + 1) / 2;
+        stolen.assign(victim.stack.begin(), victim.stack.begin() + count);
+        victim.stack.erase(victim.stack.begin(), victim.stack.begin() + count);
+        victim.stackSize.store(victim.stack.size());
+        pthread_mutex_unlock(&victim.lock);
+
+        if (stolen.empty())
+            continue;
+
+        pthread_mutex_lock(&worker.lock);
+        worker.stack.insert(worker.stack.end(), stolen.begin(), stolen.end());
+        worker.stackSize.store(worker.stack.size());
+        pthread_mutex_unlock(&worker.lock);
+        worker.steals++;
+        return true;
+    }
+    return false;
+}
+
+bool
+MajorCollector::anyWorkAvailable() const
+{
+    for (uint32_t i = 0; i < numWorkers_; i++) {
+        if (workers_[i].stackSize.load() > 0)
+            return true;
+    }
+    return false;
+}
+
+void
+MajorCollector::compact()
+{
+    TraceScope trace(TraceCategory::GC, "compact");
+
+    // Find the sparse slabs.  The current tenured slab is still being
+    // allocated in, so it is left alone.
+    struct Sparse
+    {
+        Slab *slab;
+        uint32_t liveBytes;
+    };
+    std::vector<Sparse> sparse;
+    for (Slab *slab = cx_->tenuredList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        if (slab == cx_->tenured_ || !slab->isStandard() || slab->isPinned())
+            continue;
+
+        uint32_t capacity = slab->dataCards() * Slab::CardSize;
+        uint32_t liveBytes = LiveBytes(slab);
+        if (uint64_t(liveBytes) * 100 >=
+            uint64_t(capacity) * CompactLivePercent)
+        {
+            continue;
+        }
+
+        try {
+            sparse.push_back({ slab, liveBytes });
+        } catch (std::bad_alloc &err) {
+            SpewMemoryWarn("MajorGC: could not allocate compaction list.");
+            return;
+        }
+    }
+
+    // Evacuating a lone sparse slab would only move its things into
+    // another slab.
+    if (sparse.size() < 2)
+        return;
+
+    // Pack the live things of sparse slabs into fresh slabs, in order.
+    // Slabs are only evacuated whole.
+    SlabList destList;
+    Slab *dest = nullptr;
+    uint32_t evacuated = 0;
+    uint32_t movedBytes = 0;
+    for (; evacuated < sparse.size(); evacuated++) {
+        Slab *slab = sparse[evacuated].slab;
+        uint32_t liveBytes = sparse[evacuated].liveBytes;
+        if (!dest ||
+            uint32_t(dest->tailEndAlloc() - dest->headEndAlloc()) < liveBytes)
+        {
+            dest = cx_->allocateStandardSlab(Slab::Tenured);
+            if (!dest)
+                break;
+            destList.addSlab(dest);
+        }
+
+        EvacuateArea(slab, slab->headStartAlloc(), slab->headEndAlloc(),
+                     dest, true);
+        EvacuateArea(slab, slab->tailEndAlloc(), slab->tailStartAlloc(),
+                     dest, false);
+        cx_->tenuredList_.removeSlab(slab);
+        movedBytes += liveBytes;
+    }
+
+    // Update every reference to an evacuated thing.  Evacuated slabs
+    // hold nothing live any more, and dead tenured things are never
+    // scanned again, so only live things are updated.
+    forEachRoot(UpdateRef);
+    UpdateRef(HeapRef::FromHeapThing(&cx_->stringTable_.tuple_));
+    for (Slab *slab = cx_->hatcheryList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        UpdateSlab(slab, false);
+    }
+    for (Slab *slab = cx_->nurseryList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        UpdateSlab(slab, false);
+    }
+    for (Slab *slab = cx_->frozenList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        UpdateSlab(slab, false);
+    }
+    for (Slab *slab = cx_->tenuredList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        UpdateSlab(slab, true);
+    }
+    for (Slab *slab = destList.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        UpdateSlab(slab, true);
+    }
+    cx_->externalData_.sweep(
+        [](VM::HeapThing *owner) -> VM::HeapThing * {
+            if (owner->header()->isForwarded())
+                return owner->header()->forwardedTo();
+            return owner;
+        });
+
+    for (uint32_t i = 0; i < evacuated; i++)
+        cx_->releaseSlab(sparse[i].slab);
+
+    SpewMemoryNote("MajorGC: compacted %u sparse slabs into %u "
+                   "(moved=%u bytes)",
+                   (unsigned) evacuated, (unsigned) destList.numSlabs(),
+                   (unsigned) movedBytes);
+
+    while (Slab *slab = destList.firstSlab()) {
+        destList.removeSlab(slab);
+        cx_->tenuredList_.addSlab(slab);
+    }
+}
+
+/*static*/ uint32_t
+MajorCollector::LiveBytes(Slab *slab)
+{
+    uint32_t liveBytes = 0;
+    uint8_t *pos = slab->headStartAlloc();
+    while (pos < slab->headEndAlloc()) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t size = VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        if (slab->isMarked(hdr))
+            liveBytes += size;
+        pos += size;
+    }
+    pos = slab->tailEndAlloc();
+    while (pos < slab->tailStartAlloc()) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t size = VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        if (slab->isMarked(hdr))
+            liveBytes += size;
+        pos += size;
+    }
+    return liveBytes;
+}
+
+/*static*/ void
+MajorCollector::EvacuateArea(Slab *slab, uint8_t *start, uint8_t *end,
+                             Slab *dest, bool traced)
+{
+    uint8_t *pos = start;
+    while (pos < end) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t size = VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        pos += size;
+        if (!slab->isMarked(hdr))
+            continue;
+
+        uint8_t *mem = traced ? dest->allocateHead(size)
+                              : dest->allocateTail(size);
+        WH_ASSERT(mem);
+        memcpy(mem, hdr, size);
+
+        VM::HeapThingHeader *newHdr =
+            reinterpret_cast<VM::HeapThingHeader *>(mem);
+        newHdr->setCardNo(dest->calculateCardNumber(mem));
+        dest->tryMark(newHdr);
+
+        // The copy may refer to young things.
+        if (traced)
+            dest->markCardsFor(mem, size);
+
+        hdr->setForwarded(newHdr->payload());
+    }
+}
+
+/*static*/ void
+MajorCollector::UpdateSlab(Slab *slab, bool liveOnly)
+{
+    uint8_t *pos = slab->headStartAlloc();
+    while (pos < slab->headEndAlloc()) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        if (hdr->type() == VM::HeapType::FreeSpace)
+            continue;
+        if (liveOnly && !slab->isMarked(hdr))
+            continue;
+        UpdateHeapThing(hdr->payload());
+    }
+}
+
+/*static*/ void
+MajorCollector::UpdateHeapThing(VM::HeapThing *thing)
+{
+    if (thing->isEphemeronTable())
+        thing->toEphemeronTable()->noteKeysMoved();
+
+    switch (thing->type()) {
+#define CASE_(name) \
+      case VM::HeapType::name: \
+        UpdateRefs(thing->to##name()); \
+        break;
+    WHISPER_DEFN_SCANNED_HEAP_TYPES(CASE_)
+#undef CASE_
+
+      default:
+        WH_UNREACHABLE("Cannot update heap type.");
+        break;
+    }
+}
+
+/*static*/ void
+MajorCollector::UpdateRef(const HeapRef &ref)
+{
+    VM::HeapThing *thing = reinterpret_cast<VM::HeapThing *>(ref.read());
+    if (thing && thing->header()->isForwarded())
+        ref.update(thing->header()->forwardedTo());
+}
+
+
+
+//
+// Sweeping
+//
+
+static FreeSpace *
+FormatFreeSpan(Slab *slab, uint8_t *start, uint8_t *end, FreeSpace *list)
+{
+    uint32_t cardNo = slab->calculateCardNumber(start);
+    FreeSpace *space = FreeSpace::Format(start, cardNo, end - start, list);
+    return space ? space : list;
+}
+
+uint32_t
+SweepSlab(Slab *slab)
+{
+    WH_ASSERT(slab->gen() == Slab::Tenured);
+    uint32_t liveBytes = 0;
+
+    // Sweep the traced area, recording the start of every thing left.
+    slab->clearObjectStarts();
+    FreeSpace *headList = nullptr;
+    uint8_t *deadStart = nullptr;
+    uint8_t *pos = slab->headStartAlloc();
+    uint8_t *end = slab->headEndAlloc();
+    while (pos < end) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t size = VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        if (hdr->type() != VM::HeapType::FreeSpace && slab->isMarked(hdr)) {
+            if (deadStart) {
+                headList = FormatFreeSpan(slab, deadStart, pos, headList);
+                slab->noteObjectStart(deadStart);
+                deadStart = nullptr;
+            }
+            slab->noteObjectStart(pos);
+            liveBytes += size;
+        } else if (!deadStart) {
+            deadStart = pos;
+        }
+        pos += size;
+    }
+    if (deadStart)
+        slab->trimHead(deadStart);
+    slab->setFreeList(true, headList);
+
+    // Untraced things need no finalization, so when none of them is
+    // marked the whole untraced area is given back at once, without
+    // visiting them.
+    if (!slab->hasMarksBetween(slab->tailEndAlloc(),
+                               slab->tailStartAlloc()))
+    {
+        slab->trimTail(slab->tailStartAlloc());
+        slab->setFreeList(false, nullptr);
+        return liveBytes;
+    }
+
+    // Sweep the untraced area, from its lowest thing upward.
+    FreeSpace *tailList = nullptr;
+    uint8_t *newTail = nullptr;
+    bool seenLive = false;
+    deadStart = nullptr;
+    pos = slab->tailEndAlloc();
+    end = slab->tailStartAlloc();
+    while (pos < end) {
+        VM::HeapThingHeader *hdr = reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t size = VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+        if (hdr->type() != VM::HeapType::FreeSpace && slab->isMarked(hdr)) {
+            if (deadStart) {
+                if (seenLive)
+                    tailList = FormatFreeSpan(slab, deadStart, pos, tailList);
+                else
+                    newTail = pos;
+                deadStart = nullptr;
+            }
+            seenLive = true;
+            liveBytes += size;
+        } else if (!deadStart) {
+            deadStart = pos;
+        }
+        pos += size;
+    }
+    if (deadStart) {
+        if (seenLive)
+            tailList = FormatFreeSpan(slab, deadStart, end, tailList);
+        else
+            newTail = end;
+    }
+    if (newTail)
+        slab->trimTail(newTail);
+    slab->setFreeList(false, tailList);
+
+    return liveBytes;
+}
+
+bool
+CanAllocateInSlab(Slab *slab, uint32_t allocSize, bool traced)
+{
+    if (static_cast<uint32_t>(slab->tailEndAlloc() - slab->headEndAlloc()) >=
+        allocSize)
+    {
+        return true;
+    }
+
+    for (FreeSpace *space = slab->freeList(traced); space != nullptr;
+         space = space->next())
+    {
+        if (space->spanSize() >= allocSize)
+            return true;
+    }
+    return false;
+}
+
+uint8_t *
+AllocateFromFreeList(Slab *slab, uint32_t allocSize, bool traced)
+{
+    FreeSpace *prev = nullptr;
+    for (FreeSpace *space = slab->freeList(traced); space != nullptr;
+         prev = space, space = space->next())
+    {
+        uint32_t spanSize = space->spanSize();
+        if (spanSize < allocSize)
+            continue;
+
+        // Split off the rest of the span.  The start of the span is
+        // already recorded in the object start table.
+        uint8_t *mem = space->spanStart();
+        FreeSpace *next = space->next();
+        if (spanSize > allocSize) {
+            uint8_t *rest = mem + allocSize;
+            uint32_t cardNo = slab->calculateCardNumber(rest);
+            FreeSpace *restSpace = FreeSpace::Format(rest, cardNo,
+                                                     spanSize - allocSize,
+                                                     next);
+            if (restSpace)
+                next = restSpace;
+            if (traced)
+                slab->noteObjectStart(rest);
+        }
+
+        if (prev)
+            prev->setNext(next);
+        else
+            slab->setFreeList(traced, next);
+        return mem;
+    }
+    return nullptr;
+}
+
+} // namespace Whisper
@@ -0,0 +1,480 @@
+#ifndef WHISPER__GC_HPP
+#define WHISPER__GC_HPP
+
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "slab.hpp"
+#include "value.hpp"
+#include "ref_scanner.hpp"
+#include "vm/heap_thing.hpp"
+
+namespace Whisper {
+
+class ThreadContext;
+class RootBase;
+
+// Heap types traced by the collector.  Each listed type must have a
+// RefScanner specialization.
+#define WHISPER_DEFN_SCANNED_HEAP_TYPES(_) \
+    _(Tuple)                                \
+    _(EphemeronTable)                       \
+    _(ConsString)                           \
+    _(DependentString)                      \
+    _(ShapeTree)                            \
+    _(ShapeTreeChild)                       \
+    _(Shape)                                \
+    _(Script)                               \
+    _(StackFrame)                           \
+    _(HashObject)                           \
+    _(HashObject_ValueProp)                 \
+    _(Global)                               \
+    _(GlobalCell)
+
+
+//
+// ConservativeStackScanner
+//
+// Finds the slabs referred to by the native stack and registers of the
+// calling thread, for threads which opt in to conservative stack
+// scanning (see ThreadContext::enableConservativeStackScan).  This lets
+// native code hold raw heap pointers without Roots, while the heap
+// itself is still traced precisely.
+//
+// Registers are spilled to the stack with setjmp, and every aligned
+// word between there and the base of the stack is a candidate.  A
+// candidate pointing into the allocated part of one of the scanned
+// slabs may refer to a thing in that slab, and must keep it alive and
+// in place.
+//
+
+class ConservativeStackScanner
+{
+  public:
+    struct Candidate
+    {
+        Slab *slab;
+        uint8_t *ptr;
+    };
+
+  private:
+    struct SlabRange
+    {
+        uint8_t *start;
+        uint8_t *end;
+        Slab *slab;
+
+        bool operator <(const SlabRange &other) const {
+            return start < other.start;
+        }
+    };
+
+    std::vector<SlabRange> ranges_;
+
+  public:
+    ConservativeStackScanner();
+
+    void addSlabs(const SlabList &list);
+
+    // Find the candidates pointing into added slabs.  |stackBase| is
+    // the high end of the calling thread's stack.  The stack is read
+    // word by word, across the redzones ASan puts between locals.
+    WH_NO_SANITIZE_ADDRESS
+    void scan(const void *stackBase, std::vector<Candidate> &candidates);
+
+    // Find the thing in a tenured slab which contains |ptr|, using the
+    // slab's object start table.  Returns null if there is none, or if
+    // |ptr| is in free space.
+    static VM::HeapThingHeader *FindTenuredThing(Slab *slab, uint8_t *ptr);
+
+  private:
+    Slab *findSlab(uint8_t *ptr) const;
+};
+
+
+//
+// MinorCollector
+//
+// Culls the young generations (hatchery and nursery) of a ThreadContext
+// with a copying collection.
+//
+// Live hatchery objects are evacuated into fresh nursery slabs, and
+// live nursery objects are promoted into the tenured generation.  Once
+// evacuation is complete, the old nursery slabs are released, and the
+// hatchery is reset to a single empty slab.
+//
+// Liveness is traced from:
+//  - The thread's RootStack.
+//  - The top stack frame of every RunContext on the thread.
+//  - Tenured and frozen objects on marked cards.  Old objects are not
+//    collected by a minor GC, so any young objects they refer to must
+//    be kept alive.  The write barrier marks the card of every location
+//    in an old object which may hold a reference to a young object.
+//
+// A collection asked to tenure everything promotes hatchery survivors
+// straight into the tenured generation, leaving only pinned things
+// young (see ThreadContext::freezeHeap).
+//
+// With conservative stack scanning, young slabs referred to from the
+// native stack are pinned: nothing in them is moved, and every thing in
+// them is scanned as a root.  Once the collection is complete, pinned
+// slabs are kept in the nursery.
+//
+// Marked cards are cleared when scanned.  Any scanned tenured location
+// which still refers to a young object afterward (i.e. to an object
+// which was moved into the nursery) has its card marked again.
+//
+// The collection uses Cheney-style scanning: the traced area of each
+// destination slab is scanned in allocation order, and objects
+// referenced from scanned objects are evacuated behind the scan
+// cursor, until every destination slab has been fully scanned.
+//
+// Moved objects are marked with a forwarding pointer in their old
+// location (see HeapThingHeader), so that every reference to an
+// object is updated to the same new copy.
+//
+// Weak refs to young things (see RefKind) are set aside until nothing
+// is left to scan, and so are ephemeron values whose keys are young
+// and not yet known to be live.  Set-aside ephemeron values are traced
+// once their keys have been evacuated, until no more keys are found
+// live.  Then weak refs to evacuated or pinned things are updated, and
+// the others, along with the remaining ephemerons, are cleared.  The
+// external payloads of young things (see ExternalDataTable) are swept
+// the same way.  If evacuation fails, every young thing is treated as
+// live.
+//
+
+class MinorCollector
+{
+  private:
+    // A scan cursor over the traced area of a list of slabs.
+    struct ScanCursor
+    {
+        Slab *slab;
+        uint8_t *pos;
+
+        ScanCursor() : slab(nullptr), pos(nullptr) {}
+    };
+
+    ThreadContext *cx_;
+
+    // The nursery slabs being collected.
+    SlabList fromNursery_;
+
+    // Scan cursors for the nursery and tenured generations.  The tenured
+    // cursor starts at the end of the traced area of the tenured slab
+    // receiving promoted objects.
+    ScanCursor nurseryCursor_;
+    ScanCursor tenuredCursor_;
+
+    // The tenured slab holding the thing currently being scanned, if any.
+    // Young references found in it have their card re-marked.
+    Slab *holderSlab_;
+
+    // Scratch list of objects on marked cards.
+    std::vector<uint8_t *> markedThings_;
+
+    // A weak ref or ephemeron value set aside, and the tenured slab
+    // holding it, if any.
+    struct DeferredRef
+    {
+        HeapRef ref;
+        Slab *holderSlab;
+    };
+    std::vector<DeferredRef> weakRefs_;
+    std::vector<DeferredRef> ephemerons_;
+
+    // Young slabs pinned by conservative stack scanning.
+    std::vector<Slab *> pinnedSlabs_;
+
+    // Statistics.
+    uint32_t nurseryBytes_;
+    uint32_t tenuredBytes_;
+    uint32_t markedCards_;
+
+    // Set if allocation of a destination slab failed.
+    bool failed_;
+
+    // Set if hatchery survivors are promoted too.
+    bool tenureAll_;
+
+  public:
+    MinorCollector(ThreadContext *cx, bool tenureAll=false);
+
+    bool collect();
+
+    // Bytes copied into the nursery and the tenured generation.
+    uint32_t nurseryBytes() const {
+        return nurseryBytes_;
+    }
+    uint32_t tenuredBytes() const {
+        return tenuredBytes_;
+    }
+
+  private:
+    // Returns false if the hatchery could not be replaced because every
+    // hatchery slab was pinned.
+    bool pinConservativeRoots();
+    void unpinSlabs();
+
+    void scanRoots();
+    void scanRunContexts();
+    void scanPinnedSlabs();
+    void scanMarkedCards();
+    void scanMarkedCards(Slab *slab, uint8_t *limit);
+
+    // Scan objects under a cursor until it reaches the end of its
+    // slab list.  Returns true if any objects were scanned.
+    bool scanSlabs(const SlabList &list, ScanCursor &cursor);
+
+    void scanHeapThing(VM::HeapThing *thing);
+
+    template <typename T>
+    inline void scanRefs(T *thing) {
+        RefScanner<T> scanner(*thing);
+        while (scanner.hasMoreRefs())
+            updateRef(scanner.nextRef());
+    }
+
+    void updateRef(const HeapRef &ref);
+    void deferRef(std::vector<DeferredRef> &list, const HeapRef &ref);
+
+    // Trace the set-aside ephemeron values whose keys are now known to
+    // be live.  Returns true if there were any.
+    bool traceEphemerons();
+    void sweepWeakRefs();
+
+    // Release the external payloads of dead young things, and follow
+    // the evacuated ones (see ExternalDataTable).
+    void sweepExternalData();
+
+    void noteReference(void *location, VM::HeapThing *thing);
+
+    bool isYoung(VM::HeapThing *thing) const;
+
+    // Whether the young |thing| is known to be live: it has been
+    // evacuated, or is pinned.
+    bool isKnownLive(VM::HeapThing *thing) const;
+    bool isEphemeronKeyLive(const HeapRef &ref) const;
+    VM::HeapThing *evacuate(VM::HeapThing *thing);
+    uint8_t *allocateIn(Slab::Generation gen, uint32_t allocSize,
+                        bool traced, Slab **slabOut);
+    bool nurseryFull(uint32_t allocSize, bool traced) const;
+
+    void releaseFromSpace();
+};
+
+
+//
+// MajorCollector
+//
+// Marks the live things in the tenured generation of a ThreadContext,
+// marking in parallel.  The marked slabs are then swept lazily by the
+// ThreadContext (see SweepSlab).
+//
+// Marking sets bits in the mark bitmap of each tenured slab (see Slab).
+// Liveness is traced from:
+//  - The thread's RootStack.
+//  - The top stack frame of every RunContext on the thread.
+//  - The thread's atoms.
+//  - Every thing in the hatchery and nursery.  Young things are not
+//    marked: they are all treated as live, and scanned as roots.
+//  - Every thing in the frozen generation, which is never collected,
+//    and is likewise scanned without being marked.
+//  - With conservative stack scanning, tenured things referred to from
+//    the native stack.
+//
+// Marking is spread across a number of worker threads, one of which is
+// the calling thread.  Each worker first claims young slabs to scan,
+// then drains its own mark stack of grey (marked but unscanned) things.
+// A worker whose stack is empty steals half of the stack of another
+// worker.  Marking is complete once every worker is idle.  Tuples of
+// more than MarkChunkValues values are split into chunks when they are
+// scanned, and the chunks pushed onto the worker's stack, so that other
+// workers can steal and scan the chunks of one large tuple in parallel.
+//
+// Weak refs to unmarked tenured things are recorded by the worker
+// finding them, and so are ephemeron values whose keys are unmarked
+// tenured things.  Once marking is complete, the recorded ephemeron
+// values whose keys have since been marked are marked in turn, which
+// may mark more keys, until no more are.  Then the weak refs to things
+// left unmarked and the remaining ephemerons are cleared.  The string
+// table holds its strings weakly too: its tuple is marked without being
+// scanned, and strings left unmarked are removed from it.  The external
+// payloads of things left unmarked are released.
+//
+// A compacting collection then evacuates sparse tenured slabs, those
+// with less than CompactLivePercent of their capacity live, so that
+// long-lived heaps do not stay fragmented.  The live things of those
+// slabs are copied into fresh slabs, and every reference to them is
+// updated through the RefScanners of the things which hold them, and
+// the roots.  Slabs referred to from the native stack are pinned, and
+// not evacuated.  Compaction is done on the calling thread, and the
+// evacuated slabs are released.
+//
+
+class MajorCollector
+{
+  public:
+    static constexpr uint32_t MaxWorkers = 32;
+
+    // The number of workers to use by default: one per online processor.
+    static uint32_t DefaultNumWorkers();
+
+    static constexpr uint32_t CompactLivePercent = 50;
+
+    static constexpr uint32_t MarkChunkValues = 4096;
+
+  private:
+    // A grey thing, or a chunk of the values of a large tuple, which is
+    // the range [start, end).  Whole things have an empty range.
+    struct MarkItem
+    {
+        VM::HeapThing *thing;
+        uint32_t start;
+        uint32_t end;
+    };
+
+    struct Worker
+    {
+        MajorCollector *collector;
+        uint32_t index;
+        pthread_t thread;
+
+        // Grey things, guarded by |lock|.
+        pthread_mutex_t lock;
+        std::vector<MarkItem> stack;
+        std::atomic<uint32_t> stackSize;
+
+        // Weak refs and ephemeron values found before what they depend
+        // on was marked.
+        std::vector<HeapRef> weakRefs;
+        std::vector<HeapRef> ephemerons;
+
+        // Statistics.
+        uint32_t scannedThings;
+        uint32_t scannedSlabs;
+        uint32_t steals;
+
+        Worker();
+        ~Worker();
+    };
+
+    ThreadContext *cx_;
+    uint32_t numWorkers_;
+    Worker workers_[MaxWorkers];
+
+    // Young and frozen slabs scanned as roots, claimed by workers in
+    // order.
+    std::vector<Slab *> rootSlabs_;
+    std::atomic<uint32_t> nextRootSlab_;
+
+    // Number of workers which have run out of work.
+    std::atomic<uint32_t> idleWorkers_;
+
+    // Set if sparse tenured slabs are evacuated after marking.
+    bool compact_;
+
+    // Tenured slabs pinned by conservative stack roots.
+    std::vector<Slab *> pinnedSlabs_;
+
+  public:
+    MajorCollector(ThreadContext *cx, uint32_t numWorkers,
+                   bool compact=false);
+
+    bool collect();
+
+  private:
+    // Call |op| with a HeapRef for every root.
+    template <typename RefOp>
+    void forEachRoot(RefOp op);
+
+    // Mark phase.
+    void markRoots();
+    void markRootRef(const HeapRef &ref);
+    void markConservativeRoots();
+    bool runWorkers();
+    static void *WorkerMain(void *arg);
+    void workerRun(Worker &worker);
+
+    void scanRootSlab(Worker &worker, Slab *slab);
+    void scanHeapThing(Worker &worker, VM::HeapThing *thing);
+    void scanLargeTuple(Worker &worker, VM::Tuple *tuple);
+    void scanTupleChunk(Worker &worker, VM::Tuple *tuple,
+                        uint32_t start, uint32_t end);
+
+    template <typename T>
+    inline void scanRefs(Worker &worker, T *thing) {
+        RefScanner<T> scanner(*thing);
+        while (scanner.hasMoreRefs())
+            markRef(worker, scanner.nextRef());
+    }
+
+    void markRef(Worker &worker, const HeapRef &ref);
+
+    // Mark |thing| if it is tenured.  Returns true if it was newly marked
+    // and must be scanned.
+    bool mark(VM::HeapThing *thing);
+
+    // Whether |thing| is not tenured, or is marked.
+    static bool IsLive(VM::HeapThing *thing);
+
+    // Weak ref processing, once marking is complete.
+    void traceEphemerons();
+    void sweepWeakRefs();
+    void sweepStringTable();
+    void sweepExternalData();
+
+    void push(Worker &worker, VM::HeapThing *thing);
+    void pushChunks(Worker &worker, VM::Tuple *tuple, uint32_t start);
+    bool pop(Worker &worker, MarkItem *itemOut);
+    bool steal(Worker &worker);
+    bool anyWorkAvailable() const;
+
+    // Compaction phase.
+    void compact();
+    static uint32_t LiveBytes(Slab *slab);
+    static void EvacuateArea(Slab *slab, uint8_t *start, uint8_t *end,
+                             Slab *dest, bool traced);
+    static void UpdateSlab(Slab *slab, bool liveOnly);
+    static void UpdateHeapThing(VM::HeapThing *thing);
+
+    template <typename T>
+    static inline void UpdateRefs(T *thing) {
+        RefScanner<T> scanner(*thing);
+        while (scanner.hasMoreRefs())
+            UpdateRef(scanner.nextRef());
+    }
+
+    static void UpdateRef(const HeapRef &ref);
+};
+
+
+//
+// Sweeping
+//
+// SweepSlab sweeps a tenured slab whose things were marked by a major
+// collection.  Runs of dead things are coalesced into FreeSpace things.
+// Runs at the ends of the traced and untraced areas are given back to
+// the slab's bump allocator, and the others are chained into the
+// slab's free lists.  The object start table is rebuilt.  Returns the
+// number of bytes held by live things.
+//
+// AllocateFromFreeList allocates |allocSize| bytes from the first span
+// on a free list of |slab| which is large enough, splitting the span.
+// It returns null if there is no such span.
+//
+
+uint32_t SweepSlab(Slab *slab);
+
+bool CanAllocateInSlab(Slab *slab, uint32_t allocSize, bool traced);
+
+uint8_t *AllocateFromFreeList(Slab *slab, uint32_t allocSize, bool traced);
+
+
+} // namespace Whisper
+
+#endif // WHISPER__GC_HPP
@@ -0,0 +1,251 @@
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "gc_metrics.hpp"
+
+namespace Whisper {
+
+
+uint64_t
+MonotonicNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+const char *
+SlabGenerationString(Slab::Generation gen)
+{
+    switch (gen) {
+      case Slab::Hatchery:  return "hatchery";
+      case Slab::Nursery:   return "nursery";
+      case Slab::Tenured:   return "tenured";
+      case Slab::Frozen:    return "frozen";
+      case Slab::Shared:    return "shared";
+    }
+    return "unknown";
+}
+
+//
+// PauseHistogram
+//
+
+PauseHistogram::PauseHistogram()
+  : count(0),
+    totalNanos(0),
+    maxNanos(0)
+{
+    for (uint32_t i = 0; i < NumBuckets; i++)
+        buckets[i] = 0;
+}
+
+void
+PauseHistogram::add(const PauseHistogram &other)
+{
+    count += other.count;
+    totalNanos += other.totalNanos;
+    if (other.maxNanos > maxNanos)
+        maxNanos = other.maxNanos;
+    for (uint32_t i = 0; i < NumBuckets; i++)
+        buckets[i] += other.buckets[i];
+}
+
+//
+// GCMetrics
+//
+
+GCMetrics::GCMetrics()
+  : survivedBytes(0),
+    promotedBytes(0),
+    minorPauses(),
+    majorPauses(),
+    slabBytes(0),
+    externalBytes(0)
+{
+    for (uint32_t i = 0; i < NumSlabGenerations; i++) {
+        allocatedBytes[i] = 0;
+        slabs[i] = 0;
+    }
+}
+
+void
+GCMetrics::add(const GCMetrics &other)
+{
+    for (uint32_t i = 0; i < NumSlabGenerations; i++) {
+        allocatedBytes[i] += other.allocatedBytes[i];
+        slabs[i] += other.slabs[i];
+    }
+    survivedBytes += other.survivedBytes;
+    promotedBytes += other.promotedBytes;
+    minorPauses.add(other.minorPauses);
+    majorPauses.add(other.majorPauses);
+    slabBytes += other.slabBytes;
+    externalBytes += other.externalBytes;
+}
+
+//
+// RuntimeMetrics
+//
+
+RuntimeMetrics::RuntimeMetrics()
+  : numThreads(0),
+    threads(),
+    reserveMappedSlabs(0),
+    reserveFreeSlabs(0),
+    reserveMappedBytes(0)
+{}
+
+static void
+PrintPrometheusHistogram(FILE *out, const char *kind,
+                         const PauseHistogram &hist)
+{
+    uint64_t cumulative = 0;
+    for (uint32_t i = 0; i < PauseHistogram::NumBuckets - 1; i++) {
+        cumulative += hist.buckets[i];
+        fprintf(out, "whisper_gc_pause_seconds_bucket{kind=\"%s\","
+                     "le=\"%g\"} %" PRIu64 "\n",
+                kind, PauseHistogram::BucketLimitMicros(i) / 1e6,
+                cumulative);
+    }
+    fprintf(out, "whisper_gc_pause_seconds_bucket{kind=\"%s\",le=\"+Inf\"} "
+                 "%" PRIu64 "\n", kind, hist.count);
+    fprintf(out, "whisper_gc_pause_seconds_sum{kind=\"%s\"} %.9f\n",
+            kind, hist.totalNanos / 1e9);
+    fprintf(out, "whisper_gc_pause_seconds_count{kind=\"%s\"} %" PRIu64 "\n",
+            kind, hist.count);
+}
+
+void
+RuntimeMetrics::printPrometheus(FILE *out) const
+{
+    fprintf(out, "# TYPE whisper_threads gauge\n");
+    fprintf(out, "whisper_threads %u\n", (unsigned) numThreads);
+
+    fprintf(out, "# TYPE whisper_allocated_bytes_total counter\n");
+    for (uint32_t i = 0; i < NumSlabGenerations; i++) {
+        fprintf(out, "whisper_allocated_bytes_total{generation=\"%s\"} "
+                     "%" PRIu64 "\n",
+                SlabGenerationString(Slab::Generation(i)),
+                threads.allocatedBytes[i]);
+    }
+
+    fprintf(out, "# TYPE whisper_gc_survived_bytes_total counter\n");
+    fprintf(out, "whisper_gc_survived_bytes_total %" PRIu64 "\n",
+            threads.survivedBytes);
+    fprintf(out, "# TYPE whisper_gc_promoted_bytes_total counter\n");
+    fprintf(out, "whisper_gc_promoted_bytes_total %" PRIu64 "\n",
+            threads.promotedBytes);
+
+    fprintf(out, "# TYPE whisper_gc_collections_total counter\n");
+    fprintf(out, "whisper_gc_collections_total{kind=\"minor\"} %" PRIu64 "\n",
+            threads.minorPauses.count);
+    fprintf(out, "whisper_gc_collections_total{kind=\"major\"} %" PRIu64 "\n",
+            threads.majorPauses.count);
+
+    fprintf(out, "# TYPE whisper_gc_pause_seconds histogram\n");
+    PrintPrometheusHistogram(out, "minor", threads.minorPauses);
+    PrintPrometheusHistogram(out, "major", threads.majorPauses);
+
+    fprintf(out, "# TYPE whisper_gc_pause_max_seconds gauge\n");
+    fprintf(out, "whisper_gc_pause_max_seconds{kind=\"minor\"} %.9f\n",
+            threads.minorPauses.maxNanos / 1e9);
+    fprintf(out, "whisper_gc_pause_max_seconds{kind=\"major\"} %.9f\n",
+            threads.majorPauses.maxNanos / 1e9);
+
+    fprintf(out, "# TYPE whisper_slabs gauge\n");
+    for (uint32_t i = 0; i < NumSlabGenerations; i++) {
+        fprintf(out, "whisper_slabs{generation=\"%s\"} %" PRIu64 "\n",
+                SlabGenerationString(Slab::Generation(i)), threads.slabs[i]);
+    }
+    fprintf(out, "# TYPE whisper_slab_bytes gauge\n");
+    fprintf(out, "whisper_slab_bytes %" PRIu64 "\n", threads.slabBytes);
+    fprintf(out, "# TYPE whisper_external_bytes gauge\n");
+    fprintf(out, "whisper_external_bytes %" PRIu64 "\n",
+            threads.externalBytes);
+
+    fprintf(out, "# TYPE whisper_reserve_slabs gauge\n");
+    fprintf(out, "whisper_reserve_slabs{state=\"mapped\"} %" PRIu64 "\n",
+            reserveMappedSlabs);
+    fprintf(out, "whisper_reserve_slabs{state=\"free\"} %" PRIu64 "\n",
+            reserveFreeSlabs);
+    fprintf(out, "# TYPE whisper_reserve_mapped_bytes gauge\n");
+    fprintf(out, "whisper_reserve_mapped_bytes %" PRIu64 "\n",
+            reserveMappedBytes);
+}
+
+//
+// PauseCounters
+//
+
+void
+PauseCounters::note(uint64_t nanos)
+{
+    uint64_t micros = nanos / 1000;
+    uint32_t bucket = 0;
+    while (bucket < PauseHistogram::NumBuckets - 1 &&
+           micros >= PauseHistogram::BucketLimitMicros(bucket))
+    {
+        bucket++;
+    }
+
+    buckets_[bucket].add(1);
+    totalNanos_.add(nanos);
+    if (nanos > maxNanos_.get())
+        maxNanos_.set(nanos);
+    count_.add(1);
+}
+
+uint64_t
+PauseCounters::meanNanos() const
+{
+    uint64_t count = count_.get();
+    return count ? totalNanos_.get() / count : 0;
+}
+
+void
+PauseCounters::read(PauseHistogram *out) const
+{
+    out->count = count_.get();
+    out->totalNanos = totalNanos_.get();
+    out->maxNanos = maxNanos_.get();
+    for (uint32_t i = 0; i < PauseHistogram::NumBuckets; i++)
+        out->buckets[i] = buckets_[i].get();
+}
+
+//
+// GCCounters
+//
+
+void
+GCCounters::read(GCMetrics *out) const
+{
+    for (uint32_t i = 0; i < NumSlabGenerations; i++) {
+        out->allocatedBytes[i] = allocatedBytes[i].get();
+        out->slabs[i] = slabs[i].get();
+    }
+    out->survivedBytes = survivedBytes.get();
+    out->promotedBytes = promotedBytes.get();
+    minorPauses.read(&out->minorPauses);
+    majorPauses.read(&out->majorPauses);
+    out->slabBytes = slabBytes.get();
+    out->externalBytes = externalBytes.get();
+}
+
+//
+// PauseTimer
+//
+
+PauseTimer::PauseTimer(PauseCounters &counters)
+  : counters_(counters),
+    start_(MonotonicNanos())
+{}
+
+PauseTimer::~PauseTimer()
+{
+    counters_.note(MonotonicNanos() - start_);
+}
+
+
+} // namespace Whisper
@@ -0,0 +1,198 @@
+#ifndef WHISPER__GC_METRICS_HPP
+#define WHISPER__GC_METRICS_HPP
+
+#include <atomic>
+#include <stdio.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "slab.hpp"
+
+namespace Whisper {
+
+
+//
+// GC metrics
+//
+// Each ThreadContext counts its allocation and collection activity in
+// GCCounters, and a snapshot of them (GCMetrics) may be taken at any
+// time, from any thread (see ThreadContext::metrics).  The runtime sums
+// the snapshots of all of its threads (see Runtime::metrics), for an
+// embedding to poll and export, e.g. in the Prometheus text format.
+//
+// Counters only grow, so rates such as the allocation or promotion
+// rate are the differences between two snapshots, over the time
+// between them.  The counters of a thread which unregisters are kept
+// by the runtime, so the runtime's totals never go down.
+//
+// Every counter is written by the thread of its ThreadContext only, and
+// read with relaxed atomic loads, so updating one costs the same as a
+// plain add.  A snapshot is not atomic as a whole: its counters may be
+// a few updates apart.
+//
+
+static constexpr uint32_t NumSlabGenerations = Slab::Shared + 1;
+
+const char *SlabGenerationString(Slab::Generation gen);
+
+// The monotonic clock pauses are timed with, in nanoseconds.
+uint64_t MonotonicNanos();
+
+//
+// MetricCounter is a counter with a single writer and any number of
+// readers.
+//
+class MetricCounter
+{
+  private:
+    std::atomic<uint64_t> value_;
+
+  public:
+    MetricCounter() : value_(0) {}
+
+    uint64_t get() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+    // Only called by the writing thread.
+    void add(uint64_t n) {
+        value_.store(get() + n, std::memory_order_relaxed);
+    }
+    void set(uint64_t n) {
+        value_.store(n, std::memory_order_relaxed);
+    }
+};
+
+//
+// A histogram of pause times.  Bucket |i| counts the pauses shorter
+// than 2^i microseconds which are not counted in an earlier bucket, and
+// the last bucket counts all the longer ones.
+//
+struct PauseHistogram
+{
+    static constexpr uint32_t NumBuckets = 24;
+
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    uint64_t buckets[NumBuckets];
+
+    PauseHistogram();
+
+    void add(const PauseHistogram &other);
+
+    // The upper bound of bucket |i|, in microseconds.
+    static uint64_t BucketLimitMicros(uint32_t i) {
+        return uint64_t(1) << i;
+    }
+};
+
+//
+// A snapshot of the counters of a ThreadContext, or of a runtime.
+//
+struct GCMetrics
+{
+    // Bytes allocated by the mutator in each generation, including
+    // headers.  Things copied by collections are not included.
+    uint64_t allocatedBytes[NumSlabGenerations];
+
+    // Bytes copied from the hatchery into the nursery, and promoted
+    // into the tenured generation, by minor collections.
+    uint64_t survivedBytes;
+    uint64_t promotedBytes;
+
+    // Pause times of minor and major collections.  Their counts are the
+    // number of collections.  A major collection starts with a minor
+    // one, which is also counted on its own.
+    PauseHistogram minorPauses;
+    PauseHistogram majorPauses;
+
+    // Slabs in each generation, as of the last collection or slab
+    // allocation, and the bytes of slab memory currently held.
+    uint64_t slabs[NumSlabGenerations];
+    uint64_t slabBytes;
+
+    // Bytes currently held by payloads outside the heap (see
+    // ExternalDataTable).
+    uint64_t externalBytes;
+
+    GCMetrics();
+
+    void add(const GCMetrics &other);
+};
+
+//
+// A snapshot of the metrics of a runtime: the sum of those of its
+// threads, and those of its slab reserve.
+//
+struct RuntimeMetrics
+{
+    uint32_t numThreads;
+    GCMetrics threads;
+
+    // Standard slab regions mapped by the reserve, and those of them
+    // free for reuse.
+    uint64_t reserveMappedSlabs;
+    uint64_t reserveFreeSlabs;
+    uint64_t reserveMappedBytes;
+
+    RuntimeMetrics();
+
+    // Print the metrics in the Prometheus text exposition format.
+    void printPrometheus(FILE *out) const;
+};
+
+//
+// PauseCounters counts the pauses of one kind of collection.
+//
+class PauseCounters
+{
+  private:
+    MetricCounter count_;
+    MetricCounter totalNanos_;
+    MetricCounter maxNanos_;
+    MetricCounter buckets_[PauseHistogram::NumBuckets];
+
+  public:
+    void note(uint64_t nanos);
+    void read(PauseHistogram *out) const;
+
+    // The mean pause so far, or zero if there has been none.
+    uint64_t meanNanos() const;
+};
+
+//
+// GCCounters holds the counters of a ThreadContext.
+//
+struct GCCounters
+{
+    MetricCounter allocatedBytes[NumSlabGenerations];
+    MetricCounter survivedBytes;
+    MetricCounter promotedBytes;
+    PauseCounters minorPauses;
+    PauseCounters majorPauses;
+    MetricCounter slabs[NumSlabGenerations];
+    MetricCounter slabBytes;
+    MetricCounter externalBytes;
+
+    void read(GCMetrics *out) const;
+};
+
+//
+// PauseTimer times a pause from its construction to its destruction.
+//
+class PauseTimer
+{
+  private:
+    PauseCounters &counters_;
+    uint64_t start_;
+
+  public:
+    explicit PauseTimer(PauseCounters &counters);
+    ~PauseTimer();
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__GC_METRICS_HPP
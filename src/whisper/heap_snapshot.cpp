@@ -0,0 +1,172 @@
+
+#include <new>
+#include <string.h>
+
+#include "slab.hpp"
+#include "runtime.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "gc.hpp"
+#include "heap_snapshot.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/tuple.hpp"
+#include "vm/ephemeron_table.hpp"
+#include "vm/script.hpp"
+#include "vm/stack_frame.hpp"
+#include "vm/shape_tree.hpp"
+#include "vm/object.hpp"
+#include "vm/global.hpp"
+
+namespace Whisper {
+
+
+//
+// HeapSnapshot
+//
+
+HeapSnapshot::HeapSnapshot()
+  : oldStart_(nullptr),
+    oldEnd_(nullptr),
+    data_(),
+    headBytes_(0),
+    tailBytes_(0),
+    fixups_(),
+    stringTable_(),
+    spoiler_(0)
+{}
+
+static bool
+IsEmptySlab(const Slab *slab)
+{
+    return slab->headEndAlloc() == slab->headStartAlloc() &&
+           slab->tailEndAlloc() == slab->tailStartAlloc();
+}
+
+const char *
+HeapSnapshot::capture(ThreadContext *cx)
+{
+    WH_ASSERT(data_.empty());
+
+    Slab *tenured = cx->tenured();
+    if (cx->tenuredList().numSlabs() != 1 ||
+        cx->hatcheryList().numSlabs() != 1 ||
+        cx->nurseryList().numSlabs() != 0 ||
+        !IsEmptySlab(cx->hatchery()) ||
+        !tenured->isStandard() ||
+        tenured->needsSweep())
+    {
+        return "Only a new thread's heap can be captured.";
+    }
+
+    // External payloads are not copied into the snapshot.
+    if (cx->externalData_.count() > 0)
+        return "Heaps holding external data cannot be captured.";
+
+    oldStart_ = tenured->headStartAlloc();
+    oldEnd_ = tenured->tailStartAlloc();
+    headBytes_ = tenured->headEndAlloc() - tenured->headStartAlloc();
+    tailBytes_ = tenured->tailStartAlloc() - tenured->tailEndAlloc();
+
+    try {
+        data_.resize(headBytes_ + tailBytes_);
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate heap snapshot.";
+    }
+    memcpy(data_.data(), tenured->headStartAlloc(), headBytes_);
+    memcpy(data_.data() + headBytes_, tenured->tailEndAlloc(), tailBytes_);
+
+    // Record the references to fix up while the captured things are
+    // still valid.
+    try {
+        uint8_t *pos = tenured->headStartAlloc();
+        while (pos < tenured->headEndAlloc()) {
+            VM::HeapThingHeader *hdr =
+                reinterpret_cast<VM::HeapThingHeader *>(pos);
+            pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+            recordHeapThingRefs(hdr->payload());
+        }
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate heap snapshot fixups.";
+    }
+
+    stringTable_ = cx->stringTable_;
+    stringTable_.cx_ = nullptr;
+    spoiler_ = cx->spoiler_;
+    return nullptr;
+}
+
+void
+HeapSnapshot::restore(ThreadContext *cx) const
+{
+    Slab *tenured = cx->tenured();
+    WH_ASSERT(tenured->isStandard());
+    WH_ASSERT(IsEmptySlab(tenured));
+
+    // Both slabs are standard, so the traced and untraced areas are the
+    // same distance apart in each.
+    intptr_t delta = tenured->headStartAlloc() - oldStart_;
+    WH_ASSERT(tenured->tailStartAlloc() - oldEnd_ == delta);
+
+    uint8_t *head = tenured->allocateHead(headBytes_);
+    uint8_t *tail = tenured->allocateTail(tailBytes_);
+    WH_ASSERT(head && tail);
+    memcpy(head, data_.data(), headBytes_);
+    memcpy(tail, data_.data() + headBytes_, tailBytes_);
+
+    for (uint8_t *pos = head; pos < head + headBytes_;) {
+        VM::HeapThingHeader *hdr =
+            reinterpret_cast<VM::HeapThingHeader *>(pos);
+        tenured->noteObjectStart(pos);
+        pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+    }
+
+    for (const Fixup &fixup : fixups_)
+        HeapRef(fixup.kind, head + fixup.slot).update(head + fixup.target);
+
+    StringTable &table = cx->stringTable_;
+    table = stringTable_;
+    table.cx_ = cx;
+    table.tuple_ = reinterpret_cast<VM::Tuple *>(
+        relocate(reinterpret_cast<uint8_t *>(table.tuple_), delta));
+    for (VM::LinearString *&atom : table.atoms_) {
+        atom = reinterpret_cast<VM::LinearString *>(
+            relocate(reinterpret_cast<uint8_t *>(atom), delta));
+    }
+}
+
+template <typename T>
+void
+HeapSnapshot::recordRefs(T *thing)
+{
+    RefScanner<T> scanner(*thing);
+    while (scanner.hasMoreRefs()) {
+        HeapRef ref = scanner.nextRef();
+        const uint8_t *ptr = reinterpret_cast<const uint8_t *>(ref.read());
+        if (!ptr || ptr < oldStart_ || ptr >= oldEnd_)
+            continue;
+        const uint8_t *slot = reinterpret_cast<const uint8_t *>(ref.slot());
+        fixups_.push_back(Fixup(slot - oldStart_, ptr - oldStart_,
+                                ref.kind()));
+    }
+}
+
+void
+HeapSnapshot::recordHeapThingRefs(VM::HeapThing *thing)
+{
+    switch (thing->type()) {
+#define CASE_(name) \
+      case VM::HeapType::name: \
+        recordRefs(thing->to##name()); \
+        break;
+    WHISPER_DEFN_SCANNED_HEAP_TYPES(CASE_)
+#undef CASE_
+
+      default:
+        WH_UNREACHABLE("Cannot scan heap type.");
+        break;
+    }
+}
+
+
+} // namespace Whisper
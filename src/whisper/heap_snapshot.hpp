@@ -0,0 +1,100 @@
+#ifndef WHISPER__HEAP_SNAPSHOT_HPP
+#define WHISPER__HEAP_SNAPSHOT_HPP
+
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "ref_scanner.hpp"
+#include "string_table.hpp"
+
+namespace Whisper {
+
+class ThreadContext;
+
+//
+// HeapSnapshot is an image of the heap of a freshly created
+// ThreadContext, used by the runtime to start further contexts without
+// redoing their initialization (see Runtime::enableStartupSnapshot).
+//
+// A new context's heap is its string table and the interned atoms,
+// all in its first tenured slab.  The snapshot keeps a copy of the
+// traced and untraced areas of that slab, and of the string table.
+// Capturing also scans the copied things with their RefScanners, and
+// records every reference into the slab as a fixup.  Restoring copies
+// both areas into the new context's tenured slab, which has the same
+// geometry, and then applies the fixups, without scanning or reading
+// through any reference.
+//
+// Interned strings cache their hash, so restored contexts hash strings
+// with the snapshot's spoiler.  Code is not part of the snapshot: it is
+// shared between contexts through the SharedCodeHeap instead.
+//
+
+class HeapSnapshot
+{
+  private:
+    // A reference slot in the traced area, and the thing it refers to,
+    // as offsets from the start of the traced area.
+    struct Fixup
+    {
+        uint32_t slot;
+        uint32_t target;
+        RefKind kind;
+
+        Fixup(uint32_t slot, uint32_t target, RefKind kind)
+          : slot(slot), target(target), kind(kind)
+        {}
+    };
+
+    // The start of the traced area of the captured slab, and the end
+    // of its untraced area.  References between these are relocated.
+    const uint8_t *oldStart_;
+    const uint8_t *oldEnd_;
+
+    // The traced bytes, followed by the untraced bytes.
+    std::vector<uint8_t> data_;
+    uint32_t headBytes_;
+    uint32_t tailBytes_;
+
+    std::vector<Fixup> fixups_;
+
+    StringTable stringTable_;
+    uint32_t spoiler_;
+
+  public:
+    HeapSnapshot();
+
+    // Capture the heap of |cx|, which must hold nothing but its first
+    // tenured slab.  Returns an error message on failure.
+    const char *capture(ThreadContext *cx);
+
+    // Restore the snapshot into |cx|, a new context whose tenured slab
+    // is still empty.
+    void restore(ThreadContext *cx) const;
+
+    uint32_t spoiler() const {
+        return spoiler_;
+    }
+
+    // The size of the captured heap, in bytes.
+    uint32_t size() const {
+        return headBytes_ + tailBytes_;
+    }
+
+  private:
+    uint8_t *relocate(const uint8_t *ptr, intptr_t delta) const {
+        if (ptr < oldStart_ || ptr >= oldEnd_)
+            return const_cast<uint8_t *>(ptr);
+        return const_cast<uint8_t *>(ptr) + delta;
+    }
+
+    template <typename T>
+    void recordRefs(T *thing);
+    void recordHeapThingRefs(VM::HeapThing *thing);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__HEAP_SNAPSHOT_HPP
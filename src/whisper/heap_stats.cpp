@@ -0,0 +1,258 @@
+
+#include <inttypes.h>
+#include <map>
+
+#include "heap_stats.hpp"
+#include "runtime.hpp"
+#include "vm/heap_thing.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/native_stack.hpp"
+
+namespace Whisper {
+
+
+//
+// HeapStats
+//
+
+static const char *
+GenerationString(Slab::Generation gen)
+{
+    switch (gen) {
+      case Slab::Hatchery:
+        return "hatchery";
+      case Slab::Nursery:
+        return "nursery";
+      case Slab::Tenured:
+        return "tenured";
+      case Slab::Frozen:
+        return "frozen";
+      case Slab::Shared:
+        return "shared";
+    }
+    return "INVALID";
+}
+
+static void
+CollectArea(Slab *slab, uint8_t *start, uint8_t *end,
+            HeapStats::AreaStats &stats)
+{
+    bool checkMarks = slab->needsSweep();
+
+    uint8_t *pos = start;
+    while (pos < end) {
+        VM::HeapThingHeader *hdr =
+            reinterpret_cast<VM::HeapThingHeader *>(pos);
+        uint32_t allocSize = VM::HeapThingHeader::HeaderSize +
+                             hdr->reservedSpace();
+        pos += allocSize;
+        WH_ASSERT(pos <= end);
+
+        // Things left unmarked by the last major GC are dead.
+        if (hdr->type() == VM::HeapType::FreeSpace ||
+            (checkMarks && !slab->isMarked(hdr)))
+        {
+            stats.freeBytes += allocSize;
+            continue;
+        }
+
+        HeapStats::TypeCounts &counts = stats.types[uint32_t(hdr->type())];
+        counts.things++;
+        counts.bytes += allocSize;
+        stats.things++;
+        stats.bytes += allocSize;
+    }
+}
+
+void
+HeapStats::AreaStats::add(const AreaStats &other)
+{
+    for (uint32_t i = 0; i < NumHeapTypes; i++) {
+        types[i].things += other.types[i].things;
+        types[i].bytes += other.types[i].bytes;
+    }
+    things += other.things;
+    bytes += other.bytes;
+    freeBytes += other.freeBytes;
+    capacityBytes += other.capacityBytes;
+    slabs += other.slabs;
+}
+
+HeapStats::HeapStats(bool perSlab)
+  : total_(),
+    perSlab_(perSlab),
+    slabs_()
+{}
+
+bool
+HeapStats::collect(ThreadContext *cx)
+{
+    for (uint32_t i = 0; i <= Slab::Frozen; i++)
+        generations_[i] = AreaStats();
+    total_ = AreaStats();
+    slabs_.clear();
+
+    if (!collectList(cx->hatcheryList(), Slab::Hatchery))
+        return false;
+    if (!collectList(cx->nurseryList(), Slab::Nursery))
+        return false;
+    if (!collectList(cx->tenuredList(), Slab::Tenured))
+        return false;
+    if (!collectList(cx->frozenList(), Slab::Frozen))
+        return false;
+
+    for (uint32_t i = 0; i <= Slab::Frozen; i++)
+        total_.add(generations_[i]);
+    return true;
+}
+
+/*static*/ void
+HeapStats::CollectSlab(Slab *slab, AreaStats &stats)
+{
+    stats.slabs++;
+    stats.capacityBytes += slab->dataCards() * Slab::CardSize;
+
+    CollectArea(slab, slab->headStartAlloc(), slab->headEndAlloc(), stats);
+    CollectArea(slab, slab->tailEndAlloc(), slab->tailStartAlloc(), stats);
+
+    // Unallocated space between the traced and untraced areas.
+    stats.freeBytes += slab->tailEndAlloc() - slab->headEndAlloc();
+}
+
+bool
+HeapStats::collectList(const SlabList &list, Slab::Generation gen)
+{
+    AreaStats &genStats = generations_[gen];
+    for (Slab *slab : list) {
+        if (!perSlab_) {
+            CollectSlab(slab, genStats);
+            continue;
+        }
+
+        SlabStats slabStats(slab);
+        CollectSlab(slab, slabStats);
+        genStats.add(slabStats);
+        try {
+            slabs_.push_back(slabStats);
+        } catch (std::bad_alloc &err) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+PrintAreaStats(FILE *out, const char *name,
+               const HeapStats::AreaStats &stats)
+{
+    fprintf(out, "%s: %u slabs, %" PRIu64 " things, %" PRIu64 " bytes live, "
+                 "%" PRIu64 " bytes free, %" PRIu64 " bytes capacity\n",
+            name, (unsigned) stats.slabs, stats.things, stats.bytes,
+            stats.freeBytes, stats.capacityBytes);
+
+    for (uint32_t i = 1; i < HeapStats::NumHeapTypes; i++) {
+        const HeapStats::TypeCounts &counts = stats.types[i];
+        if (counts.things == 0)
+            continue;
+        fprintf(out, "    %-24s %10" PRIu64 " things %12" PRIu64 " bytes\n",
+                VM::HeapTypeString(VM::HeapType(i)),
+                counts.things, counts.bytes);
+    }
+}
+
+void
+HeapStats::print(FILE *out) const
+{
+    for (uint32_t i = 0; i <= Slab::Frozen; i++) {
+        PrintAreaStats(out, GenerationString(Slab::Generation(i)),
+                       generations_[i]);
+    }
+    PrintAreaStats(out, "total", total_);
+
+    for (const SlabStats &slabStats : slabs_) {
+        char name[64];
+        snprintf(name, sizeof(name), "slab %p (%s)",
+                 slabStats.slab, GenerationString(slabStats.gen));
+        PrintAreaStats(out, name, slabStats);
+    }
+}
+
+
+//
+// AllocationProfiler
+//
+
+AllocationProfiler::AllocationProfiler(ThreadContext *cx,
+                                       uint32_t sampleInterval)
+  : cx_(cx),
+    sampleInterval_(sampleInterval),
+    bytesUntilSample_(sampleInterval),
+    allocatedBytes_(0),
+    samples_()
+{
+    WH_ASSERT(sampleInterval > 0);
+}
+
+void
+AllocationProfiler::clear()
+{
+    samples_.clear();
+    allocatedBytes_ = 0;
+    bytesUntilSample_ = sampleInterval_;
+}
+
+void
+AllocationProfiler::recordSample(AllocSite site, VM::HeapType type,
+                                 Slab::Generation gen, uint32_t allocSize)
+{
+    Sample sample;
+    sample.site = site;
+    sample.type = type;
+    sample.gen = gen;
+    sample.size = allocSize;
+    sample.stackDepth = 0;
+
+    RunContext *runcx = cx_->activeRunContext();
+    VM::NativeFrame *frame = runcx ? runcx->nativeStack().topFrame()
+                                   : nullptr;
+    while (frame && sample.stackDepth < MaxStackDepth) {
+        sample.pcOffsets[sample.stackDepth++] = frame->pcOffset();
+        frame = frame->hasCallerFrame() ? frame->callerFrame() : nullptr;
+    }
+
+    // Samples are dropped if they cannot be stored.
+    try {
+        samples_.push_back(sample);
+    } catch (std::bad_alloc &err) {}
+}
+
+void
+AllocationProfiler::print(FILE *out) const
+{
+    typedef std::pair<uint32_t, uint32_t> Key;
+    // Each sample stands for |sampleInterval_| bytes of allocation, or
+    // for itself if it is larger.
+    std::map<Key, std::pair<uint64_t, uint64_t>> counts;
+    for (const Sample &sample : samples_) {
+        auto &entry = counts[Key(uint32_t(sample.site),
+                                 uint32_t(sample.type))];
+        entry.first++;
+        entry.second += (sample.size > sampleInterval_) ? sample.size
+                                                        : sampleInterval_;
+    }
+
+    fprintf(out, "Allocation profile: %u samples over %" PRIu64 " bytes "
+                 "(interval=%u)\n",
+            (unsigned) samples_.size(), allocatedBytes_,
+            (unsigned) sampleInterval_);
+    for (const auto &entry : counts) {
+        fprintf(out, "    %-16s %-24s %8" PRIu64 " samples "
+                     "(~%" PRIu64 " bytes)\n",
+                AllocSiteString(AllocSite(entry.first.first)),
+                VM::HeapTypeString(VM::HeapType(entry.first.second)),
+                entry.second.first, entry.second.second);
+    }
+}
+
+
+} // namespace Whisper
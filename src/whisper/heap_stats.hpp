@@ -0,0 +1,185 @@
+#ifndef WHISPER__HEAP_STATS_HPP
+#define WHISPER__HEAP_STATS_HPP
+
+#include <stdio.h>
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "slab.hpp"
+#include "runtime.hpp"
+#include "vm/heap_thing.hpp"
+
+namespace Whisper {
+
+class ThreadContext;
+
+
+//
+// HeapStats
+//
+// Counts the live things on the heap of a ThreadContext, by type, by
+// generation, and optionally by slab.  Slabs are walked using the size
+// and type fields of each thing's header.
+//
+// Things in tenured slabs awaiting a lazy sweep count as live only if
+// they were marked by the last major GC.  Free spans (FreeSpace things
+// and unallocated space) count as free space.
+//
+// Collecting stats does not allocate on the managed heap, and may be
+// done at any point outside of a collection.
+//
+
+class HeapStats
+{
+  public:
+    static constexpr uint32_t NumHeapTypes = uint32_t(VM::HeapType::LIMIT);
+
+    struct TypeCounts
+    {
+        uint64_t things;
+        uint64_t bytes;
+
+        TypeCounts() : things(0), bytes(0) {}
+    };
+
+    // Stats for a set of slabs.  |bytes| includes thing headers.
+    struct AreaStats
+    {
+        TypeCounts types[NumHeapTypes];
+        uint64_t things;
+        uint64_t bytes;
+        uint64_t freeBytes;
+        uint64_t capacityBytes;
+        uint32_t slabs;
+
+        AreaStats()
+          : things(0), bytes(0), freeBytes(0), capacityBytes(0), slabs(0)
+        {}
+
+        void add(const AreaStats &other);
+    };
+
+    struct SlabStats : public AreaStats
+    {
+        Slab *slab;
+        Slab::Generation gen;
+
+        SlabStats(Slab *slab)
+          : AreaStats(), slab(slab), gen(slab->gen())
+        {}
+    };
+
+  private:
+    AreaStats generations_[4];
+    AreaStats total_;
+
+    bool perSlab_;
+    std::vector<SlabStats> slabs_;
+
+  public:
+    HeapStats(bool perSlab=false);
+
+    // Returns false if per-slab stats could not be allocated.
+    bool collect(ThreadContext *cx);
+
+    const AreaStats &generation(Slab::Generation gen) const {
+        WH_ASSERT(gen <= Slab::Frozen);
+        return generations_[gen];
+    }
+
+    const AreaStats &total() const {
+        return total_;
+    }
+
+    const std::vector<SlabStats> &slabs() const {
+        return slabs_;
+    }
+
+    // Print the stats in a human readable form.
+    void print(FILE *out) const;
+
+    // Count the live things in a single slab.
+    static void CollectSlab(Slab *slab, AreaStats &stats);
+
+  private:
+    bool collectList(const SlabList &list, Slab::Generation gen);
+};
+
+
+//
+// AllocationProfiler
+//
+// A sampling allocation profiler.  Once started on a ThreadContext, one
+// allocation is sampled every |sampleInterval| bytes allocated on the
+// managed heap.  Each sample records the allocation's site, type, size
+// and generation, along with the pc offsets saved in the innermost
+// frames of the active RunContext's stack.
+//
+// The byte counter is checked on every allocation, so the profiler
+// costs a single branch per allocation while it is not running.
+//
+
+class AllocationProfiler
+{
+  public:
+    static constexpr uint32_t MaxStackDepth = 8;
+
+    struct Sample
+    {
+        AllocSite site;
+        VM::HeapType type;
+        Slab::Generation gen;
+        uint32_t size;
+        uint32_t stackDepth;
+        uint32_t pcOffsets[MaxStackDepth];
+    };
+
+  private:
+    ThreadContext *cx_;
+    uint32_t sampleInterval_;
+    uint32_t bytesUntilSample_;
+    uint64_t allocatedBytes_;
+    std::vector<Sample> samples_;
+
+  public:
+    AllocationProfiler(ThreadContext *cx, uint32_t sampleInterval);
+
+    uint32_t sampleInterval() const {
+        return sampleInterval_;
+    }
+
+    uint64_t allocatedBytes() const {
+        return allocatedBytes_;
+    }
+
+    const std::vector<Sample> &samples() const {
+        return samples_;
+    }
+
+    void clear();
+
+    // Print the samples, aggregated by site and type.
+    void print(FILE *out) const;
+
+    inline void noteAllocation(AllocSite site, VM::HeapType type,
+                               Slab::Generation gen, uint32_t allocSize)
+    {
+        allocatedBytes_ += allocSize;
+        if (allocSize < bytesUntilSample_) {
+            bytesUntilSample_ -= allocSize;
+            return;
+        }
+        bytesUntilSample_ = sampleInterval_;
+        recordSample(site, type, gen, allocSize);
+    }
+
+  private:
+    void recordSample(AllocSite site, VM::HeapType type,
+                      Slab::Generation gen, uint32_t allocSize);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__HEAP_STATS_HPP
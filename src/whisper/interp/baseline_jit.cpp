@@ -0,0 +1,407 @@
+
+#include <string.h>
+#include <new>
+
+#include "spew.hpp"
+#include "trace.hpp"
+#include "memalloc.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/bytecode.hpp"
+#include "interp/interpreter.hpp"
+#include "interp/baseline_jit.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// JitCode
+//
+
+bool
+JitCode::run(Interpreter *interp, uint32_t opIndex) const
+{
+    WH_ASSERT(opIndex <= numOps_);
+    EntryFn entry = reinterpret_cast<EntryFn>(const_cast<uint8_t *>(code_));
+    return entry(interp, code_ + opOffsets_[opIndex]);
+}
+
+
+//
+// JitCodePool
+//
+
+JitCodePool::JitCodePool()
+  : chunks_(),
+    cur_(nullptr),
+    end_(nullptr),
+    allocatedBytes_(0)
+{}
+
+JitCodePool::~JitCodePool()
+{
+    for (const Chunk &chunk : chunks_)
+        ReleaseMappedMemory(chunk.base, chunk.size);
+}
+
+uint8_t *
+JitCodePool::allocate(uint32_t bytes)
+{
+    bytes = AlignIntUp<uint32_t>(bytes, 16);
+
+    if (cur_ == nullptr || uint32_t(end_ - cur_) < bytes) {
+        // Requests larger than a chunk get a chunk of their own.
+        uint32_t size = (bytes > ChunkSize)
+                        ? AlignIntUp<uint32_t>(bytes, ChunkSize)
+                        : ChunkSize;
+        uint8_t *base = reinterpret_cast<uint8_t *>(
+            AllocateMappedMemory(size, /* allowExec = */ true));
+        if (!base)
+            return nullptr;
+
+        try {
+            chunks_.push_back({ base, size });
+        } catch (std::bad_alloc &err) {
+            ReleaseMappedMemory(base, size);
+            return nullptr;
+        }
+        cur_ = base;
+        end_ = base + size;
+    }
+
+    uint8_t *result = cur_;
+    cur_ += bytes;
+    allocatedBytes_ += bytes;
+    return result;
+}
+
+
+#if defined(__x86_64__)
+
+//
+// BaselineAssembler
+//
+// Emits the little x86-64 code the baseline JIT needs, using the
+// System V calling convention.
+//
+class BaselineAssembler
+{
+  private:
+    // A jump to the stub of an op, patched once every op is assembled.
+    struct OpJump
+    {
+        uint32_t offset;
+        uint32_t targetOp;
+    };
+
+    std::vector<uint8_t> code_;
+
+    // Offsets of the rel32 fields of jumps to the failure exit.
+    std::vector<uint32_t> failJumps_;
+
+    // Jumps between ops, and the offset of the stub of each op.
+    std::vector<OpJump> opJumps_;
+    std::vector<uint32_t> opOffsets_;
+
+  public:
+    BaselineAssembler() : code_(), failJumps_(), opJumps_(), opOffsets_() {}
+
+    uint32_t size() const {
+        return code_.size();
+    }
+
+    const uint8_t *data() const {
+        return code_.data();
+    }
+
+    const std::vector<uint32_t> &opOffsets() const {
+        return opOffsets_;
+    }
+
+    // push rbx; mov rbx, rdi; jmp rsi
+    //
+    // The interpreter is kept in rbx, which is callee-saved.  Pushing
+    // rbx also aligns the stack to 16 bytes for calls.  The code is
+    // entered at the stub given as the second argument.
+    void prologue() {
+        emit(0x53);
+        emit(0x48); emit(0x89); emit(0xFB);
+        emit(0xFF); emit(0xE6);
+    }
+
+    // Start the stub of the next op.
+    void bindOp() {
+        opOffsets_.push_back(size());
+    }
+
+    // Call |step(interp, dop)|, and jump to the failure exit if it
+    // returns false.
+    void callStep(Interpreter::JitStepFn step, const DecodedOp *dop) {
+        callHandler(reinterpret_cast<uintptr_t>(step), dop);
+    }
+
+    // Call |branch(interp, dop)|, jump to the failure exit if it fails,
+    // and jump to the stub of op |targetOp| if the branch is taken.
+    void callBranch(Interpreter::JitBranchFn branch, const DecodedOp *dop,
+                    uint32_t targetOp)
+    {
+        callHandler(reinterpret_cast<uintptr_t>(branch), dop);
+        // cmp al, JitBranchTaken
+        emit(0x3C); emit(Interpreter::JitBranchTaken);
+        // je target
+        emit(0x0F); emit(0x84);
+        opJumps_.push_back({ size(), targetOp });
+        emitImm32(0);
+    }
+
+    // Jump to the stub of op |targetOp|.
+    void jump(uint32_t targetOp) {
+        // jmp target
+        emit(0xE9);
+        opJumps_.push_back({ size(), targetOp });
+        emitImm32(0);
+    }
+
+    // Return true, then the failure exit returning false.  The return
+    // is the stub of the op after the last one.
+    void epilogue() {
+        bindOp();
+
+        // mov eax, 1; pop rbx; ret
+        emit(0xB8); emitImm32(1);
+        emit(0x5B);
+        emit(0xC3);
+
+        for (const OpJump &jump : opJumps_) {
+            WH_ASSERT(jump.targetOp < opOffsets_.size());
+            uint32_t rel = opOffsets_[jump.targetOp] - (jump.offset + 4);
+            memcpy(&code_[jump.offset], &rel, 4);
+        }
+
+        uint32_t failOffset = size();
+        for (uint32_t jump : failJumps_) {
+            uint32_t rel = failOffset - (jump + 4);
+            memcpy(&code_[jump], &rel, 4);
+        }
+
+        // xor eax, eax; pop rbx; ret
+        emit(0x31); emit(0xC0);
+        emit(0x5B);
+        emit(0xC3);
+    }
+
+  private:
+    // Call |handler(interp, dop)|, and jump to the failure exit if it
+    // returns zero.
+    void callHandler(uintptr_t handler, const DecodedOp *dop) {
+        // mov rdi, rbx
+        emit(0x48); emit(0x89); emit(0xDF);
+        // movabs rsi, dop
+        emit(0x48); emit(0xBE); emitImm64(reinterpret_cast<uintptr_t>(dop));
+        // movabs rax, handler
+        emit(0x48); emit(0xB8); emitImm64(handler);
+        // call rax
+        emit(0xFF); emit(0xD0);
+        // test al, al
+        emit(0x84); emit(0xC0);
+        // jz fail
+        emit(0x0F); emit(0x84);
+        failJumps_.push_back(size());
+        emitImm32(0);
+    }
+
+    void emit(uint8_t byte) {
+        code_.push_back(byte);
+    }
+
+    void emitImm32(uint32_t val) {
+        for (unsigned i = 0; i < 4; i++)
+            emit((val >> (i * 8)) & 0xFFu);
+    }
+
+    void emitImm64(uint64_t val) {
+        for (unsigned i = 0; i < 8; i++)
+            emit((val >> (i * 8)) & 0xFFu);
+    }
+};
+
+static bool
+AssembleOps(BaselineAssembler &masm, const DecodedOp *ops, uint32_t numOps)
+{
+    try {
+        masm.prologue();
+        for (uint32_t i = 0; i < numOps; i++) {
+            masm.bindOp();
+            Opcode op = ops[i].opcode;
+            if (op == Opcode::Nop)
+                continue;
+
+            if (!IsJumpOpcode(op)) {
+                masm.callStep(Interpreter::GetJitStep(op), &ops[i]);
+                continue;
+            }
+
+            uint32_t target = i + ops[i].operands[0].signedValue();
+            if (op == Opcode::Jump)
+                masm.jump(target);
+            else
+                masm.callBranch(Interpreter::GetJitBranch(op), &ops[i],
+                                target);
+        }
+        masm.epilogue();
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+bool
+BaselineJitSupported()
+{
+    return true;
+}
+
+const JitCode *
+CompileBaseline(RunContext *cx, Handle<VM::Script *> script)
+{
+    WH_ASSERT(script->hasDecoded());
+    TraceScope trace(TraceCategory::Compile, "baseline_compile");
+
+    JitCodePool *pool = cx->threadContext()->jitCodePool();
+    if (!pool)
+        return nullptr;
+
+    // Nothing below allocates on the managed heap, so the decoded ops
+    // stay put while they are compiled.
+    VM::DecodedBytecode *decoded = script->decoded();
+    uint32_t numOps = decoded->numOps();
+
+    // The code size does not depend on where the ops are, so assemble
+    // once against the heap copy of the ops to size the code.
+    BaselineAssembler sizer;
+    if (!AssembleOps(sizer, decoded->ops(), numOps))
+        return nullptr;
+
+    // Lay out the JitCode, then the copy of the ops, then the offsets of
+    // their stubs, then the code.
+    uint32_t opsOffset = AlignIntUp<uint32_t>(sizeof(JitCode),
+                                              alignof(DecodedOp));
+    uint32_t opOffsetsOffset = opsOffset + numOps * sizeof(DecodedOp);
+    uint32_t codeOffset = AlignIntUp<uint32_t>(
+        opOffsetsOffset + (numOps + 1) * sizeof(uint32_t), 16);
+
+    uint8_t *mem = pool->allocate(codeOffset + sizer.size());
+    if (!mem)
+        return nullptr;
+
+    DecodedOp *ops = reinterpret_cast<DecodedOp *>(mem + opsOffset);
+    for (uint32_t i = 0; i < numOps; i++)
+        new (&ops[i]) DecodedOp(decoded->ops()[i]);
+
+    BaselineAssembler masm;
+    if (!AssembleOps(masm, ops, numOps))
+        return nullptr;
+    WH_ASSERT(masm.size() == sizer.size());
+
+    uint32_t *opOffsets = reinterpret_cast<uint32_t *>(mem + opOffsetsOffset);
+    WH_ASSERT(masm.opOffsets().size() == numOps + 1);
+    memcpy(opOffsets, masm.opOffsets().data(),
+           (numOps + 1) * sizeof(uint32_t));
+
+    uint8_t *code = mem + codeOffset;
+    memcpy(code, masm.data(), masm.size());
+
+    SpewJitNote("Compiled script %p: %u ops, %u bytes of code at %p",
+                script.get(), (unsigned) numOps, (unsigned) masm.size(),
+                code);
+    return new (mem) JitCode(ops, numOps, code, masm.size(), opOffsets);
+}
+
+#else // !defined(__x86_64__)
+
+bool
+BaselineJitSupported()
+{
+    return false;
+}
+
+const JitCode *
+CompileBaseline(RunContext *cx, Handle<VM::Script *> script)
+{
+    return nullptr;
+}
+
+#endif // defined(__x86_64__)
+
+
+// The profilers count ops as the interpreter dispatches them, so
+// scripts stay interpreted while either is running.
+static bool
+ProfilersRunning(ThreadContext *thrcx)
+{
+    return thrcx->opProfiler() || thrcx->opPairProfiler();
+}
+
+static const JitCode *
+CompileAndAttach(RunContext *cx, Handle<VM::Script *> script)
+{
+    if (ProfilersRunning(cx->threadContext()))
+        return nullptr;
+
+    // Scripts which fail to compile keep being interpreted.
+    const JitCode *code = CompileBaseline(cx, script);
+    if (code)
+        script->setJitCode(code);
+    return code;
+}
+
+const JitCode *
+MaybeCompileBaseline(RunContext *cx, Handle<VM::Script *> script)
+{
+    if (script->hasJitCode())
+        return script->jitCode();
+
+    uint32_t uses = script->noteUse();
+    ThreadContext *thrcx = cx->threadContext();
+    uint32_t threshold = thrcx->jitThreshold();
+    if (!BaselineJitSupported() || threshold == 0 || uses < threshold)
+        return nullptr;
+
+    return CompileAndAttach(cx, script);
+}
+
+const JitCode *
+BaselineCodeForResume(RunContext *cx, Handle<VM::Script *> script)
+{
+    if (!script->hasJitCode() || ProfilersRunning(cx->threadContext()))
+        return nullptr;
+    return script->jitCode();
+}
+
+const JitCode *
+MaybeCompileBaselineForLoop(RunContext *cx, Handle<VM::Script *> script,
+                            uint32_t iterations)
+{
+    if (iterations < OsrIterations)
+        return nullptr;
+
+    ThreadContext *thrcx = cx->threadContext();
+    if (ProfilersRunning(thrcx))
+        return nullptr;
+    if (script->hasJitCode())
+        return script->jitCode();
+
+    // A loop tries to compile its script once.
+    if (!BaselineJitSupported() || thrcx->jitThreshold() == 0 ||
+        iterations > OsrIterations)
+    {
+        return nullptr;
+    }
+
+    return CompileAndAttach(cx, script);
+}
+
+
+} // namespace Interp
+} // namespace Whisper
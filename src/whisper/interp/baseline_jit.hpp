@@ -0,0 +1,167 @@
+#ifndef WHISPER__INTERP__BASELINE_JIT_HPP
+#define WHISPER__INTERP__BASELINE_JIT_HPP
+
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "runtime.hpp"
+#include "vm/script.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+class Interpreter;
+
+
+//
+// Baseline JIT
+//
+// The baseline JIT translates the decoded ops of a script into native
+// code, one stub per op.  Each stub calls the interpreter's handler
+// for its op (see Interpreter::GetJitStep), which runs the op with the
+// same Perform* helpers as the interpreter and then takes the GC
+// safepoint, and returns to the caller if the handler fails.  This
+// removes op dispatch from the execution of the script.
+//
+// Jumps are compiled to native jumps between the stubs.  The stub of a
+// conditional jump calls the interpreter's branch handler for its op
+// (see Interpreter::GetJitBranch), which says whether to take it.
+//
+// The compiled code embeds its own copy of the script's decoded ops,
+// so it does not refer to anything on the managed heap.
+//
+// A script is compiled once it has been run |jitThreshold| times (see
+// ThreadContext::setJitThreshold), or once one of its loops has run
+// OsrIterations times.  In that case the interpreter enters the code at
+// the loop's header, with the frame as it left it (on-stack
+// replacement).  Only x86-64 is supported; on other targets no script
+// is compiled.
+//
+// Handlers must not throw: the native code has no unwind information.
+//
+
+//
+// JitCode
+//
+// A compiled script.  Lives in a JitCodePool.
+//
+class JitCode
+{
+  public:
+    typedef bool (*EntryFn)(Interpreter *interp, const uint8_t *start);
+
+  private:
+    const DecodedOp *ops_;
+    uint32_t numOps_;
+    const uint8_t *code_;
+    uint32_t codeSize_;
+
+    // The offset in the code of the stub of each op, and of the exit
+    // after the last op.
+    const uint32_t *opOffsets_;
+
+  public:
+    JitCode(const DecodedOp *ops, uint32_t numOps,
+            const uint8_t *code, uint32_t codeSize,
+            const uint32_t *opOffsets)
+      : ops_(ops), numOps_(numOps), code_(code), codeSize_(codeSize),
+        opOffsets_(opOffsets)
+    {}
+
+    // The code's copy of the decoded ops.
+    const DecodedOp *ops() const {
+        return ops_;
+    }
+    uint32_t numOps() const {
+        return numOps_;
+    }
+
+    const uint8_t *code() const {
+        return code_;
+    }
+
+    uint32_t codeSize() const {
+        return codeSize_;
+    }
+
+    // Run the code from op |opIndex| to completion.  Returns false on
+    // error.
+    bool run(Interpreter *interp, uint32_t opIndex) const;
+};
+
+
+//
+// JitCodePool
+//
+// Executable memory for the compiled code of a ThreadContext.  Memory is
+// allocated from chunks mapped with execute permission, and is only
+// released with the pool.
+//
+class JitCodePool
+{
+  public:
+    static constexpr uint32_t ChunkSize = 64 * 1024;
+
+  private:
+    struct Chunk
+    {
+        uint8_t *base;
+        uint32_t size;
+    };
+
+    std::vector<Chunk> chunks_;
+    uint8_t *cur_;
+    uint8_t *end_;
+    uint64_t allocatedBytes_;
+
+  public:
+    JitCodePool();
+    ~JitCodePool();
+
+    uint64_t allocatedBytes() const {
+        return allocatedBytes_;
+    }
+
+    // Allocate |bytes| bytes of executable memory, aligned to 16 bytes.
+    // Returns null on failure.
+    uint8_t *allocate(uint32_t bytes);
+};
+
+
+// Whether the baseline JIT can compile for this target.
+bool BaselineJitSupported();
+
+// Get the compiled code of |script|, compiling it if it has been run
+// often enough.  |script| must be decoded.  Returns null if the script
+// is to be interpreted.
+const JitCode *MaybeCompileBaseline(RunContext *cx,
+                                    Handle<VM::Script *> script);
+
+// Get the compiled code to resume a suspended run of |script| in.
+// Resuming is not a new run of the script, so only code it already has
+// is used.  Returns null if the script is to be interpreted.
+const JitCode *BaselineCodeForResume(RunContext *cx,
+                                     Handle<VM::Script *> script);
+
+// Loops which have run this many times have their script compiled, and
+// are run on in the compiled code.
+static constexpr uint32_t OsrIterations = 1000;
+
+// Get the compiled code of |script|, one of whose loops has just run
+// |iterations| times, compiling it once the loop has run OsrIterations
+// times.  |script| must be decoded.  Returns null if the loop is to be
+// interpreted.
+const JitCode *MaybeCompileBaselineForLoop(RunContext *cx,
+                                           Handle<VM::Script *> script,
+                                           uint32_t iterations);
+
+// Compile |script|, which must be decoded.  Returns null on failure.
+const JitCode *CompileBaseline(RunContext *cx, Handle<VM::Script *> script);
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__BASELINE_JIT_HPP
@@ -0,0 +1,390 @@
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+#include "spew.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "string_table.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
+#include "interp/bytecode_cache.hpp"
+#include "interp/bytecode_verifier.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+static uint32_t
+ConstantsOffset(uint32_t bytecodeSize)
+{
+    return AlignIntUp<uint32_t>(sizeof(BytecodeCacheHeader) + bytecodeSize, 8);
+}
+
+uint64_t
+HashBytecodeSource(const uint8_t *data, uint32_t size)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool
+WriteBytes(FILE *fp, const void *data, size_t size)
+{
+    return size == 0 || fwrite(data, size, 1, fp) == 1;
+}
+
+// Encode |val| into |constant|, appending the chars of a string to
+// |stringData|.  Returns false if |val| cannot be cached.
+static bool
+EncodeConstant(const Value &val, BytecodeCacheConstant *constant,
+               std::vector<uint8_t> &stringData)
+{
+    memset(constant, 0, sizeof(*constant));
+
+    if (val.isInt32()) {
+        constant->kind = BytecodeCacheConstant::Int32;
+        constant->bits = ToUInt32(val.int32Value());
+        return true;
+    }
+    if (val.isNumber()) {
+        constant->kind = BytecodeCacheConstant::Double;
+        constant->bits = DoubleToInt(val.numberValue());
+        return true;
+    }
+    if (val.isImmIndexString()) {
+        constant->kind = BytecodeCacheConstant::IndexString;
+        constant->bits = ToUInt32(val.immIndexStringValue());
+        return true;
+    }
+    if (!val.isString())
+        return false;
+
+    VM::StringUnpack unpack(val);
+    if (unpack.isNonLinear())
+        return false;
+
+    uint32_t length = unpack.length();
+    uint32_t offset = stringData.size();
+    stringData.resize(offset + length);
+    uint8_t *chars = stringData.data() + offset;
+    if (unpack.hasEightBit()) {
+        memcpy(chars, unpack.eightBitData(), length);
+    } else if (!VM::NarrowChars(unpack.sixteenBitData(), length, chars)) {
+        return false;
+    }
+
+    bool interned = val.isHeapString() &&
+                    val.heapStringPtr()->isLinearString() &&
+                    val.heapStringPtr()->toLinearString()->isInterned();
+    constant->kind = interned ? BytecodeCacheConstant::InternedString
+                              : BytecodeCacheConstant::String;
+    constant->length = length;
+    constant->bits = offset;
+    return true;
+}
+
+bool
+WriteBytecodeCache(const char *path, uint64_t sourceHash, uint32_t flags,
+                   Handle<VM::Bytecode *> bytecode,
+                   Handle<VM::Tuple *> constants,
+                   uint32_t maxStackDepth, uint32_t numLocals)
+{
+    BytecodeCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BytecodeCacheHeader::Magic;
+    header.version = BytecodeCacheHeader::Version;
+    header.sourceHash = sourceHash;
+    header.flags = flags;
+    header.opcodeLayout = OpcodeLayoutHash();
+    header.maxStackDepth = maxStackDepth;
+    header.numLocals = numLocals;
+    header.bytecodeSize = bytecode->length();
+    header.numConstants = constants ? constants->size() : 0;
+
+    // Constants are encoded first, since the header holds the size of
+    // their string data.
+    std::vector<BytecodeCacheConstant> entries;
+    std::vector<uint8_t> stringData;
+    try {
+        entries.resize(header.numConstants);
+        for (uint32_t i = 0; i < header.numConstants; i++) {
+            if (!EncodeConstant(constants->get(i), &entries[i],
+                                stringData))
+            {
+                SpewBytecodeNote("Constant %u cannot be cached",
+                                 (unsigned) i);
+                return false;
+            }
+        }
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    header.stringDataSize = stringData.size();
+
+    // Write to a private name, then rename into place.
+    char tmpPath[4096];
+    int len = snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path,
+                       (int) getpid());
+    if (len < 0 || size_t(len) >= sizeof(tmpPath))
+        return false;
+
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        SpewBytecodeWarn("Could not create bytecode cache file %s", tmpPath);
+        return false;
+    }
+
+    static const uint8_t Padding[8] = { 0 };
+    uint32_t padding = ConstantsOffset(header.bytecodeSize) -
+                       (sizeof(header) + header.bytecodeSize);
+
+    bool ok = WriteBytes(fp, &header, sizeof(header)) &&
+              WriteBytes(fp, bytecode->data(), header.bytecodeSize) &&
+              WriteBytes(fp, Padding, padding) &&
+              WriteBytes(fp, entries.data(),
+                         entries.size() * sizeof(BytecodeCacheConstant)) &&
+              WriteBytes(fp, stringData.data(), stringData.size());
+
+    if (fclose(fp) != 0)
+        ok = false;
+    if (ok && rename(tmpPath, path) != 0)
+        ok = false;
+    if (!ok)
+        unlink(tmpPath);
+    return ok;
+}
+
+
+//
+// BytecodeCacheFile
+//
+
+BytecodeCacheFile::BytecodeCacheFile(const char *path)
+  : path_(path)
+{}
+
+BytecodeCacheFile::~BytecodeCacheFile()
+{
+    finalize();
+}
+
+void
+BytecodeCacheFile::finalize()
+{
+    if (data_) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+        data_ = nullptr;
+    }
+    if (fd_ != -1) {
+        close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool
+BytecodeCacheFile::initialize(uint64_t sourceHash, uint32_t flags)
+{
+    WH_ASSERT(fd_ == -1);
+
+    fd_ = open(path_, O_RDONLY);
+    if (fd_ == -1) {
+        error_ = "Could not open.";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd_, &st) == -1) {
+        finalize();
+        error_ = "Could not stat.";
+        return false;
+    }
+    if (st.st_size < off_t(sizeof(BytecodeCacheHeader)) ||
+        st.st_size > UINT32_MAX)
+    {
+        finalize();
+        error_ = "Bad file size.";
+        return false;
+    }
+    size_ = st.st_size;
+
+    void *data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (data == MAP_FAILED) {
+        finalize();
+        error_ = "Could not map.";
+        return false;
+    }
+    data_ = reinterpret_cast<const uint8_t *>(data);
+
+    const BytecodeCacheHeader *hdr = header();
+    if (hdr->magic != BytecodeCacheHeader::Magic ||
+        hdr->version != BytecodeCacheHeader::Version ||
+        hdr->opcodeLayout != OpcodeLayoutHash())
+    {
+        finalize();
+        error_ = "Written by a different build.";
+        return false;
+    }
+    if (hdr->sourceHash != sourceHash || hdr->flags != flags) {
+        finalize();
+        error_ = "Written for a different source.";
+        return false;
+    }
+
+    uint64_t expectedSize = ConstantsOffset(hdr->bytecodeSize) +
+                            uint64_t(hdr->numConstants) *
+                                sizeof(BytecodeCacheConstant) +
+                            hdr->stringDataSize;
+    if (hdr->bytecodeSize == 0 || expectedSize != size_) {
+        finalize();
+        error_ = "Truncated.";
+        return false;
+    }
+
+    // Cache files may have been corrupted or replaced, so their bytecode
+    // is not trusted until verified.
+    const char *verifyError = nullptr;
+    if (!VerifyBytecode(data_ + sizeof(BytecodeCacheHeader),
+                        hdr->bytecodeSize, hdr->numConstants,
+                        hdr->numLocals, hdr->maxStackDepth, nullptr,
+                        &verifyError))
+    {
+        SpewBytecodeWarn("Cached bytecode %s failed verification: %s",
+                         path_, verifyError);
+        finalize();
+        error_ = verifyError;
+        return false;
+    }
+
+    return true;
+}
+
+bool
+BytecodeCacheFile::hasError() const
+{
+    return error_;
+}
+
+const char *
+BytecodeCacheFile::error() const
+{
+    WH_ASSERT(hasError());
+    return error_;
+}
+
+const BytecodeCacheHeader *
+BytecodeCacheFile::header() const
+{
+    WH_ASSERT(data_);
+    return reinterpret_cast<const BytecodeCacheHeader *>(data_);
+}
+
+uint32_t
+BytecodeCacheFile::maxStackDepth() const
+{
+    return header()->maxStackDepth;
+}
+
+uint32_t
+BytecodeCacheFile::numLocals() const
+{
+    return header()->numLocals;
+}
+
+bool
+BytecodeCacheFile::load(RunContext *cx, MutHandle<VM::Bytecode *> bytecode,
+                        MutHandle<VM::Tuple *> constants)
+{
+    const BytecodeCacheHeader *hdr = header();
+
+    AllocationContext acx = cx->inHatchery(AllocSite::Bytecode);
+    bytecode = acx.createBytecode(hdr->bytecodeSize);
+    if (!bytecode)
+        return false;
+    memcpy(bytecode->writableData(), data_ + sizeof(BytecodeCacheHeader),
+           hdr->bytecodeSize);
+
+    constants = nullptr;
+    if (hdr->numConstants == 0)
+        return true;
+
+    // The constant pool is tenured, as the generator creates it.
+    const BytecodeCacheConstant *entries =
+        reinterpret_cast<const BytecodeCacheConstant *>(
+            data_ + ConstantsOffset(hdr->bytecodeSize));
+    const uint8_t *stringData =
+        reinterpret_cast<const uint8_t *>(entries + hdr->numConstants);
+
+    AllocationContext tenured = cx->inTenured();
+    VectorRoot<Value> vals(cx);
+    for (uint32_t i = 0; i < hdr->numConstants; i++) {
+        Root<Value> val(cx);
+        switch (entries[i].kind) {
+          case BytecodeCacheConstant::Int32:
+            val = Value::Int32(static_cast<int32_t>(entries[i].bits));
+            break;
+          case BytecodeCacheConstant::Double:
+            if (!tenured.createNumber(IntToDouble(entries[i].bits), val))
+                return false;
+            break;
+          case BytecodeCacheConstant::IndexString:
+            if (entries[i].bits > uint64_t(INT32_MAX)) {
+                error_ = "Bad constant.";
+                return false;
+            }
+            val = Value::ImmIndexString(
+                static_cast<int32_t>(entries[i].bits));
+            break;
+          case BytecodeCacheConstant::String:
+          case BytecodeCacheConstant::InternedString: {
+            uint32_t length = entries[i].length;
+            if (entries[i].bits > hdr->stringDataSize ||
+                length > hdr->stringDataSize - entries[i].bits)
+            {
+                error_ = "Bad constant.";
+                return false;
+            }
+
+            // Strings are recreated as the generator creates them.
+            const uint8_t *chars = stringData + entries[i].bits;
+            if (entries[i].kind == BytecodeCacheConstant::String) {
+                if (!tenured.createString(length, chars, val.get()))
+                    return false;
+                break;
+            }
+            Root<VM::LinearString *> interned(cx);
+            if (!cx->stringTable().addString(chars, length, &interned))
+                return false;
+            val = Value::HeapString(interned);
+            break;
+          }
+          default:
+            error_ = "Bad constant.";
+            return false;
+        }
+        vals.append(val);
+    }
+
+    VM::Tuple *tuple = nullptr;
+    if (!tenured.createTuple(vals, tuple))
+        return false;
+    constants = tuple;
+    return true;
+}
+
+
+} // namespace Interp
+} // namespace Whisper
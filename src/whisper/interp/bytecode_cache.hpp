@@ -0,0 +1,139 @@
+#ifndef WHISPER__INTERP__BYTECODE_CACHE_HPP
+#define WHISPER__INTERP__BYTECODE_CACHE_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "runtime.hpp"
+#include "rooting.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/tuple.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// Bytecode cache
+//
+// A cache file holds the generated code for one source: its bytecode,
+// its constant pool, and the frame sizes of its script.  Files are
+// keyed by a hash of the source and by generator flags chosen by the
+// caller, and carry a format version and a hash of the opcode layout
+// (see OpcodeLayoutHash), so that files written by other builds are
+// ignored.
+//
+// Layout, in host byte order:
+//
+//      +-----------------------+
+//      | BytecodeCacheHeader   |
+//      +-----------------------+
+//      | Bytecode              |
+//      | (padded to 8 bytes)   |
+//      +-----------------------+
+//      | BytecodeCacheConstant |
+//      | ...                   |
+//      +-----------------------+
+//      | String data           |
+//      +-----------------------+
+//
+// Numbers and strings can be cached.  The chars of string constants
+// are kept in the string data, and strings are recreated when loaded:
+// interned ones, such as property names, are interned again.  Only
+// 8-bit strings, which are all the generator creates from source text,
+// can be cached.
+//
+// Files are written to a temporary name and renamed into place, so
+// concurrent readers see either no file or a complete one.  The
+// bytecode of a cache file is verified when the file is opened (see
+// VerifyBytecode), and files which fail are ignored.
+//
+
+struct BytecodeCacheHeader
+{
+    static constexpr uint32_t Magic = 0x43424857;  // "WHBC"
+    static constexpr uint32_t Version = 6;
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t flags;
+    uint32_t opcodeLayout;
+    uint32_t maxStackDepth;
+    uint32_t numLocals;
+    uint32_t bytecodeSize;
+    uint32_t numConstants;
+    uint32_t stringDataSize;
+};
+
+struct BytecodeCacheConstant
+{
+    enum Kind : uint32_t {
+        Int32 = 1,
+        Double = 2,
+        IndexString = 3,
+        String = 4,
+        InternedString = 5
+    };
+
+    uint32_t kind;
+
+    // For strings, the length in chars, and |bits| is the offset of the
+    // chars in the string data.  For index strings, |bits| is the index.
+    uint32_t length;
+    uint64_t bits;
+};
+
+// Hash of source text, for keying cache files.
+uint64_t HashBytecodeSource(const uint8_t *data, uint32_t size);
+
+// Write a cache file to |path|.  |constants| may be null.  Returns false
+// if the file could not be written, or if a constant cannot be cached.
+bool WriteBytecodeCache(const char *path, uint64_t sourceHash,
+                        uint32_t flags, Handle<VM::Bytecode *> bytecode,
+                        Handle<VM::Tuple *> constants,
+                        uint32_t maxStackDepth, uint32_t numLocals);
+
+
+//
+// BytecodeCacheFile
+//
+// A cache file mapped into memory for loading.
+//
+class BytecodeCacheFile
+{
+  private:
+    const char *path_;
+    int fd_ = -1;
+    const uint8_t *data_ = nullptr;
+    uint32_t size_ = 0;
+    const char *error_ = nullptr;
+
+  public:
+    explicit BytecodeCacheFile(const char *path);
+    ~BytecodeCacheFile();
+
+    // Map the file, check that it was written for |sourceHash| and
+    // |flags| by this build, and verify its bytecode.
+    bool initialize(uint64_t sourceHash, uint32_t flags);
+
+    bool hasError() const;
+    const char *error() const;
+
+    uint32_t maxStackDepth() const;
+    uint32_t numLocals() const;
+
+    // Create the bytecode and the constant pool.  |constants| is set to
+    // null if the pool is empty.
+    bool load(RunContext *cx, MutHandle<VM::Bytecode *> bytecode,
+              MutHandle<VM::Tuple *> constants);
+
+  private:
+    const BytecodeCacheHeader *header() const;
+    void finalize();
+};
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__BYTECODE_CACHE_HPP
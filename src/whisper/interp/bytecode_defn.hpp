@@ -6,22 +6,73 @@ namespace Whisper {
 namespace Interp {
 
 // Macro iterating over all heap types.
-#define WHISPER_BYTECODE_SEC0_OPS(_)                                \
+//
+// Property ops take the property name as a constant operand.  NewObject
+// pushes a new object for an object literal.  InitProp pops a value and
+// defines it on the object below, which is left on the stack.  GetProp
+// and SetProp also take the index of their inline cache (see
+// VM::PropertyCache) as an immediate operand.  GetProp replaces the
+// object on top of the stack with the value of its property.  SetProp
+// pops a value and the object below it, sets the property, and pushes
+// the value.
+//
+// Object literals with distinct, non-index names are templated: their
+// NewObject takes the index of a cache holding the shape of the objects
+// the literal creates, and each InitProp takes the slot of its property
+// and the same cache index.  Once the template is cached, NewObject
+// pushes an object which already has its shape, and InitProp stores
+// straight into the slot.  Other literals have -1 for these operands.
+//
+// GetGlobal and SetGlobal take the name of a global variable and a cache
+// index, like GetProp and SetProp.  Their cache holds the global's cell
+// (see VM::GlobalCell) once it has been looked up.  GetGlobal pushes the
+// value of the global, and SetGlobal sets it to the value on top of the
+// stack, which is left there, defining the global if there is none.
+//
+// CallNative<N> calls a native function of the host (see
+// VM::NativeFunction) with N arguments.  It pops the arguments and the
+// function below them, and pushes the function's result.  Scripts
+// cannot define functions yet, so only natives can be called, with at
+// most MaxNativeCallArgs arguments.
+//
+// Jump ops take the offset of their target from the start of the op,
+// in bytes, as a fixed-width operand, so that forward jumps can be
+// patched once their target is known.  JumpIfFalse and JumpIfTrue pop
+// a value and jump if it is false or true (see VM::ToBoolean).  Once
+// decoded, the operand is an offset in ops instead (see DecodedOp).
+//
+// Every loop starts with a LoopHead, the target of its back edge.  It
+// takes the index of a cache counting the iterations of the loop, and
+// checks for interrupts (see RunContext), so that other ops need not.
+// The interpreter enters a script's baseline compiled code at the
+// header of a hot loop (see OsrIterations).
+//
+// Ops are encoded in sections.  An op in section 0 is a single byte,
+// and an op in section N is the byte N (the section's prefix, such as
+// Section1) followed by a second byte.  Each op takes the next free
+// byte of its section, in the order of this table, so opcode numbers
+// do not depend on the layout.  Section 0 holds the ops which are hot
+// in op profiles (see OpProfiler), and ops which are rarely emitted or
+// run are in section 1, so that common ops stay one byte as the number
+// of ops grows.  Jump ops, and the first op of each fused op, must be
+// in section 0.
+//
+#define WHISPER_BYTECODE_OPS(_)                                     \
 /* Name       Format  Section  PopPush          Flags             */\
 _(Section1,     E,      -1,     0,0,            OPF_SectionPrefix  )\
 \
-_(Nop,          E,      0,      0,0,            OPF_None           )\
+_(Nop,          E,      1,      0,0,            OPF_None           )\
 _(Pop,          E,      0,      1,0,            OPF_None           )\
 _(Stop,         E,      0,      0,0,            OPF_None           )\
 \
 _(PushInt8,     I1,     0,      0,1,            OPF_None           )\
 _(PushInt16,    I2,     0,      0,1,            OPF_None           )\
-_(PushInt24,    I3,     0,      0,1,            OPF_None           )\
-_(PushInt32,    I4,     0,      0,1,            OPF_None           )\
+_(PushInt24,    I3,     1,      0,1,            OPF_None           )\
+_(PushInt32,    I4,     1,      0,1,            OPF_None           )\
 _(Push,         V,      0,      0,1,            OPF_None           )\
 \
-_(Ret_S,        E,      0,      1,0,            OPF_Control        )\
-_(Ret_V,        V,      0,      0,0,            OPF_Control        )\
+_(Ret_S,        E,      1,      1,0,            OPF_Control        )\
+_(Ret_V,        V,      1,      0,0,            OPF_Control        )\
 \
 _(Add_SSS,      E,      0,      2,1,            OPF_None           )\
 _(Add_SSV,      V,      0,      2,0,            OPF_None           )\
@@ -71,7 +122,39 @@ _(Mod_VVV,      VVV,    0,      0,0,            OPF_None           )\
 _(Neg_SS,       E,      0,      1,1,            OPF_None           )\
 _(Neg_SV,       V,      0,      1,0,            OPF_None           )\
 _(Neg_VS,       V,      0,      0,1,            OPF_None           )\
-_(Neg_VV,       VV,     0,      0,0,            OPF_None           )
+_(Neg_VV,       VV,     0,      0,0,            OPF_None           )\
+\
+_(NewObject,    V,      0,      0,1,            OPF_None           )\
+_(InitProp,     VVV,    0,      2,1,            OPF_None           )\
+_(GetProp,      VV,     0,      1,1,            OPF_None           )\
+_(SetProp,      VV,     0,      2,1,            OPF_None           )\
+\
+_(GetGlobal,    VV,     0,      0,1,            OPF_None           )\
+_(SetGlobal,    VV,     0,      1,1,            OPF_None           )\
+\
+_(CallNative0,  E,      1,      1,1,            OPF_None           )\
+_(CallNative1,  E,      1,      2,1,            OPF_None           )\
+_(CallNative2,  E,      1,      3,1,            OPF_None           )\
+_(CallNative3,  E,      1,      4,1,            OPF_None           )\
+\
+_(Jump,         I4,     0,      0,0,            OPF_Jump           )\
+_(JumpIfFalse,  I4,     0,      1,0,            OPF_Jump           )\
+_(JumpIfTrue,   I4,     0,      1,0,            OPF_Jump           )\
+_(LoopHead,     V,      0,      0,0,            OPF_None           )
+
+// Fused ops (superinstructions).  Each stands for its first op followed
+// by its second, and is encoded as a single section 0 opcode followed
+// by the operands of both ops.  Its format must be the concatenation
+// of the formats of the two ops.  The bytecode generator emits a fused
+// op wherever the pair occurs.  See OpPairProfiler for choosing pairs.
+#define WHISPER_BYTECODE_FUSED_OPS(_)                               \
+/* Name               First       Second      Format              */\
+_(PushInt8_Add_SSS,   PushInt8,   Add_SSS,    I1                   )\
+_(PushInt8_Sub_SSS,   PushInt8,   Sub_SSS,    I1                   )\
+_(Add_VVS_Ret_S,      Add_VVS,    Ret_S,      VV                   )\
+_(Add_VVS_Pop,        Add_VVS,    Pop,        VV                   )\
+_(Add_SSS_Pop,        Add_SSS,    Pop,        E                    )\
+_(Mul_SSS_Pop,        Mul_SSS,    Pop,        E                    )
 
 
 #define WHISPER_BYTECODE_MAX_SECTION    (1)
@@ -1,10 +1,18 @@
 
+#include <new>
+#include <string.h>
+
 #include "interp/bytecode_generator.hpp"
 
 #include "spew.hpp"
+#include "trace.hpp"
 #include "runtime_inlines.hpp"
 #include "rooting_inlines.hpp"
 #include "vm/heap_thing_inlines.hpp"
+#include "vm/arithmetic_ops.hpp"
+#include "vm/arithmetic_ops_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/object.hpp"
 
 namespace Whisper {
 namespace Interp {
@@ -18,15 +26,30 @@ BytecodeGenerator::BytecodeGenerator(
         bool strict)
   : cx_(cx),
     allocator_(allocator),
+    pool_(allocator_.base()),
     node_(node),
     annotator_(annotator),
     strict_(strict),
     bytecode_(cx_),
-    constantPool_(cx_)
+    constantPool_(cx_),
+    numberConstants_(STLPoolAllocator<uint8_t>(pool_)),
+    otherConstants_(STLPoolAllocator<uint8_t>(pool_)),
+    buffer_(STLPoolAllocator<uint8_t>(pool_))
 {
     WH_ASSERT(node_);
 }
 
+BytecodeGenerator::BytecodeGenerator(
+        RunContext *cx,
+        CompilationArena &arena,
+        AST::ProgramNode *node,
+        AST::SyntaxAnnotator &annotator,
+        bool strict)
+  : BytecodeGenerator(
+        cx, arena.allocatorFor<uint8_t>(CompilationArenaKind::Codegen),
+        node, annotator, strict)
+{}
+
 bool
 BytecodeGenerator::hasError() const
 {
@@ -43,9 +66,9 @@ BytecodeGenerator::error() const
 VM::Bytecode *
 BytecodeGenerator::generateBytecode()
 {
-    // Scan bytecode initially to calculate info and check for errors.
+    TraceScope trace(TraceCategory::Compile, "codegen");
+    // Generate the bytecode and calculate its stack depth in one pass.
     try {
-        calculateStackDepth_ = true;
         generate();
     } catch (BytecodeGeneratorError &exc) {
         WH_ASSERT(hasError());
@@ -55,18 +78,17 @@ BytecodeGenerator::generateBytecode()
     SpewBytecodeNote("Got max stack depth: %d", (int) maxStackDepth_);
     SpewBytecodeNote("Final stack depth: %d", (int) currentStackDepth_);
 
-    WH_ASSERT(currentBytecodeSize_ > 0);
-    bytecodeSize_ = currentBytecodeSize_;
-    currentBytecodeSize_ = 0;
-
-    // Bytecode scanning worked out.  Allocate a bytecode object.
-    bytecode_ = cx_->inHatchery().createSized<VM::Bytecode>(bytecodeSize_);
-    if (!bytecode_)
-        emitError("Could not allocate bytecode object.");
+    WH_ASSERT(buffer_.size() > 0);
+    bytecodeSize_ = buffer_.size();
 
-    // Fill the bytecode object.
-    calculateStackDepth_ = false;
-    generate();
+    // Copy the bytecode into a bytecode object.
+    AllocationContext acx = cx_->inHatchery(AllocSite::Bytecode);
+    bytecode_ = acx.createBytecode(bytecodeSize_);
+    if (!bytecode_) {
+        error_ = "Could not allocate bytecode object.";
+        return nullptr;
+    }
+    memcpy(bytecode_->writableData(), buffer_.data(), bytecodeSize_);
 
     return bytecode_;
 }
@@ -80,8 +102,19 @@ BytecodeGenerator::constants(VM::Tuple *&tuple)
         return true;
     }
 
-    // Create constant pool.
-    if (!cx_->inHatchery().createTuple(constantPool_, tuple))
+    // The constant pool lives as long as the scripts sharing it, so it
+    // is created tenured, along with its heap doubles.
+    AllocationContext acx = cx_->inTenured();
+    for (uint32_t i = 0; i < constantPool_.size(); i++) {
+        if (!constantPool_[i]->isHeapDouble())
+            continue;
+        Root<Value> dval(cx_);
+        if (!acx.createNumber(constantPool_[i]->numberValue(), dval))
+            return false;
+        constantPool_[i] = dval;
+    }
+
+    if (!acx.createTuple(constantPool_, tuple))
         return false;
 
     return true;
@@ -93,42 +126,216 @@ BytecodeGenerator::maxStackDepth() const
     return maxStackDepth_;
 }
 
+uint32_t
+BytecodeGenerator::numLocals() const
+{
+    return maxTemps_;
+}
+
+void
+BytecodeGenerator::setFuseOps(bool fuseOps)
+{
+    WH_ASSERT(!bytecode_);
+    fuseOps_ = fuseOps;
+}
+
+void
+BytecodeGenerator::setFoldConstants(bool foldConstants)
+{
+    WH_ASSERT(!bytecode_);
+    foldConstants_ = foldConstants;
+}
+
+void
+BytecodeGenerator::setLocalTemps(bool localTemps)
+{
+    WH_ASSERT(!bytecode_);
+    localTemps_ = localTemps;
+}
+
 void
 BytecodeGenerator::generate()
 {
-    for (AST::SourceElementNode *elem : node_->sourceElements()) {
+    lastOp_ = Opcode::INVALID;
+    lastOpOffset_ = 0;
+    numTemps_ = 0;
+    numPropertyCaches_ = 0;
+
+    generateSourceElements(node_->sourceElements());
+
+    // Programs which generate no ops, such as empty ones, are a Nop.
+    if (buffer_.empty())
+        emitOp(Opcode::Nop);
+}
+
+void
+BytecodeGenerator::generateSourceElements(
+            const AST::SourceElementList &elems)
+{
+    for (AST::SourceElementNode *elem : elems) {
         if (elem->isFunctionDeclaration())
             emitError("Cannot handle function declarations yet.");
 
         // Otherwise, it must be a statement.
         WH_ASSERT(elem->isStatement());
-        if (elem->isExpressionStatement()) {
-            generateExpressionStatement(elem->toExpressionStatement());
-            continue;
-        }
+        generateStatement(static_cast<AST::StatementNode *>(elem));
+    }
+}
 
-        SpewBytecodeError("Cannot handle syntax node: %s", elem->typeString());
-        emitError("Cannot handle this syntax node yet.");
+void
+BytecodeGenerator::generateStatement(AST::StatementNode *stmt)
+{
+    switch (stmt->type()) {
+      case AST::ExpressionStatement:
+        generateExpressionStatement(stmt->toExpressionStatement());
+        return;
+      case AST::Block:
+        generateSourceElements(stmt->toBlock()->sourceElements());
+        return;
+      case AST::EmptyStatement:
+        return;
+      case AST::IfStatement:
+        generateIfStatement(stmt->toIfStatement());
+        return;
+      case AST::DoWhileStatement:
+        generateDoWhileStatement(stmt->toDoWhileStatement());
+        return;
+      case AST::WhileStatement:
+        generateWhileStatement(stmt->toWhileStatement());
+        return;
+      case AST::ForLoopStatement:
+        generateForLoopStatement(stmt->toForLoopStatement());
+        return;
+      default:
+        break;
     }
+
+    SpewBytecodeError("Cannot handle syntax node: %s", stmt->typeString());
+    emitError("Cannot handle this syntax node yet.");
 }
 
 void
 BytecodeGenerator::generateExpressionStatement(
             AST::ExpressionStatementNode *exprStmt)
 {
-    OperandLocation outputLocation = OperandLocation::StackTop();
+    generateEffect(exprStmt->expression());
+}
+
+void
+BytecodeGenerator::generateIfStatement(AST::IfStatementNode *ifStmt)
+{
+    uint32_t elseJump = generateConditionalJump(ifStmt->condition(), false);
+    generateStatement(ifStmt->trueBody());
+
+    if (!ifStmt->falseBody()) {
+        bindJump(elseJump);
+        return;
+    }
+
+    uint32_t endJump = emitJump(Opcode::Jump);
+    bindJump(elseJump);
+    generateStatement(ifStmt->falseBody());
+    bindJump(endJump);
+}
+
+// Loops are laid out with their condition after their body, so that
+// each iteration takes one jump, back to the loop header at the top.
+// Loops with a condition are entered by a jump to it.
+
+void
+BytecodeGenerator::generateDoWhileStatement(AST::DoWhileStatementNode *loop)
+{
+    uint32_t top = bindLabel();
+    emitLoopHead();
+    generateStatement(loop->body());
+    generateConditionalJump(loop->condition(), true, top);
+}
+
+void
+BytecodeGenerator::generateWhileStatement(AST::WhileStatementNode *loop)
+{
+    uint32_t entryJump = emitJump(Opcode::Jump);
+    uint32_t top = bindLabel();
+    emitLoopHead();
+    generateStatement(loop->body());
+    bindJump(entryJump);
+    generateConditionalJump(loop->condition(), true, top);
+}
+
+void
+BytecodeGenerator::generateForLoopStatement(AST::ForLoopStatementNode *loop)
+{
+    if (loop->initial())
+        generateEffect(loop->initial());
+
+    uint32_t entryJump = loop->condition() ? emitJump(Opcode::Jump) : NoJump;
+    uint32_t top = bindLabel();
+    emitLoopHead();
+    generateStatement(loop->body());
+    if (loop->update())
+        generateEffect(loop->update());
+
+    bindJump(entryJump);
+    if (loop->condition())
+        generateConditionalJump(loop->condition(), true, top);
+    else
+        emitJump(Opcode::Jump, top);
+}
+
+void
+BytecodeGenerator::generateEffect(AST::ExpressionNode *expr)
+{
+    uint32_t numTemps = numTemps_;
+    OperandLocation outputLocation = getTemporaryLocation(expr);
 
     // Generate the expression.
-    generateExpression(exprStmt->expression(), outputLocation);
+    generateExpression(expr, outputLocation);
 
     // Pop the value left on the stack by the expression.
-    emitPop();
+    if (outputLocation.isStackTop())
+        emitPop();
+    releaseTemporaries(numTemps);
+}
+
+uint32_t
+BytecodeGenerator::generateConditionalJump(AST::ExpressionNode *cond,
+                                           bool jumpIf, uint32_t target)
+{
+    // Constant conditions jump always, or never.
+    Root<Value> constVal(cx_);
+    if (foldConstant(cond, &constVal)) {
+        if (VM::ToBoolean(constVal) != jumpIf)
+            return NoJump;
+        return emitJump(Opcode::Jump, target);
+    }
+
+    generateExpression(cond, OperandLocation::StackTop());
+    return emitJump(jumpIf ? Opcode::JumpIfTrue : Opcode::JumpIfFalse,
+                    target);
 }
 
 void
 BytecodeGenerator::generateExpression(AST::ExpressionNode *expr,
                                       const OperandLocation &outputLocation)
 {
+    // Constant expressions are pushed as their value.
+    Root<Value> constVal(cx_);
+    if (foldConstant(expr, &constVal)) {
+        WH_ASSERT(outputLocation.isStackTop());
+
+        // PushInt ops decode to immediates, so int32s which do not fit
+        // in one are pushed from the constant pool instead.
+        if (constVal->isInt32() &&
+            constVal->int32Value() >= OperandMinSignedValue &&
+            constVal->int32Value() <= OperandMaxSignedValue)
+        {
+            emitPushInt32(constVal->int32Value());
+        } else {
+            emitPush(getConstantLocation(constVal));
+        }
+        return;
+    }
+
     // Handle binary expression.
     if (expr->isBinaryExpression()) {
         AST::BaseBinaryExpressionNode *binExpr = expr->toBinaryExpression();
@@ -136,23 +343,25 @@ BytecodeGenerator::generateExpression(AST::ExpressionNode *expr,
         // See if LHS and RHS are addressable.
         OperandLocation lhsLocation = OperandLocation::StackTop();
         OperandLocation rhsLocation = OperandLocation::StackTop();
+        uint32_t numTemps = numTemps_;
 
         // If lhs is not directly addressable, generate the code for it
-        // and deposit onto stack top.
+        // and deposit onto stack top, or into a temporary.
         if (!getAddressableLocation(binExpr->lhs(), lhsLocation)) {
-            WH_ASSERT(lhsLocation.isStackTop());
+            lhsLocation = getTemporaryLocation(binExpr->lhs());
             generateExpression(binExpr->lhs(), lhsLocation);
         }
 
         // If rhs is not directly addressable, generate the code for it
-        // and deposit onto stack top.
+        // and deposit onto stack top, or into a temporary.
         if (!getAddressableLocation(binExpr->rhs(), rhsLocation)) {
-            WH_ASSERT(rhsLocation.isStackTop());
+            rhsLocation = getTemporaryLocation(binExpr->rhs());
             generateExpression(binExpr->rhs(), rhsLocation);
         }
 
         // Now generate the binary expression.
         emitBinaryOp(binExpr, lhsLocation, rhsLocation, outputLocation);
+        releaseTemporaries(numTemps);
 
     // Handle unary expression.
     } else if (expr->isUnaryExpression()) {
@@ -160,41 +369,141 @@ BytecodeGenerator::generateExpression(AST::ExpressionNode *expr,
 
         // See if input is addressable.
         OperandLocation inputLocation = OperandLocation::StackTop();
+        uint32_t numTemps = numTemps_;
 
         // If input is not directly addressable, generate the code for it
-        // and deposit onto stack top.
+        // and deposit onto stack top, or into a temporary.
         if (!getAddressableLocation(unExpr->subexpression(), inputLocation)) {
-            WH_ASSERT(inputLocation.isStackTop());
+            inputLocation = getTemporaryLocation(unExpr->subexpression());
             generateExpression(unExpr->subexpression(), inputLocation);
         }
 
         // Now generate the unary expression.
         emitUnaryOp(unExpr, inputLocation, outputLocation);
-
-    // Handle numeric literals.
-    } else if (expr->isNumericLiteral()) {
-        AST::NumericLiteralNode *lit = expr->toNumericLiteral();
-        WH_ASSERT(lit->hasAnnotation());
-        AST::NumericLiteralAnnotation *annot = lit->annotation();
-
-        // Int32s are just always emitted inline.
-        if (annot->isInt32())
-            emitPushInt32(annot->int32Value());
-
-        WH_ASSERT(annot->isDouble());
-
-        Root<Value> dval(cx_);
-        if (!cx_->inHatchery().createNumber(annot->doubleValue(), dval))
-            emitError("Could not allocate number.");
-
-        uint32_t constIdx = addConstant(dval);
-        emitPush(OperandLocation::Constant(constIdx));
+        releaseTemporaries(numTemps);
 
     // Handle parenthesized expressions.
     } else if (expr->isParenthesizedExpression()) {
         return generateExpression(
                     expr->toParenthesizedExpression()->subexpression(),
                     outputLocation);
+
+    // Handle object literals.  Each property is defined on the new
+    // object in turn.  Literals whose names are distinct, and not
+    // indices, are templated (see the NewObject op), and each property
+    // takes the slot numbered by its position.
+    } else if (expr->isObjectLiteral()) {
+        WH_ASSERT(outputLocation.isStackTop());
+        const AST::ObjectLiteralNode::PropertyDefinitionList &defs =
+            expr->toObjectLiteral()->propertyDefinitions();
+
+        // Equal names are interned to the same constant.
+        std::vector<OperandLocation, STLPoolAllocator<OperandLocation>>
+            names{STLPoolAllocator<OperandLocation>(pool_)};
+        bool templated = defs.size() <= VM::HashObject::MaxShapedProperties;
+        for (AST::ObjectLiteralNode::PropertyDefinition *def : defs) {
+            if (!def->isValueSlot() ||
+                !(def->hasIdentifierName() || isIndexName(def->name())))
+            {
+                emitError("Cannot handle this property definition yet.");
+            }
+
+            OperandLocation name = getPropertyNameLocation(def->name());
+            if (isIndexName(def->name()))
+                templated = false;
+            for (const OperandLocation &other : names) {
+                if (other.constantIndex() == name.constantIndex())
+                    templated = false;
+            }
+            names.push_back(name);
+        }
+
+        int32_t cacheIndex = templated ? ToInt32(newPropertyCache()) : -1;
+        emitOp(Opcode::NewObject);
+        emitOperandLocation(OperandLocation::Immediate(cacheIndex));
+
+        uint32_t slot = 0;
+        for (AST::ObjectLiteralNode::PropertyDefinition *def : defs) {
+            generateExpression(def->toValueSlot()->value(),
+                               OperandLocation::StackTop());
+            emitOp(Opcode::InitProp);
+            emitOperandLocation(names[slot]);
+            emitOperandLocation(OperandLocation::Immediate(
+                templated ? ToInt32(slot) : -1));
+            emitOperandLocation(OperandLocation::Immediate(cacheIndex));
+            slot++;
+        }
+
+    // Handle global variable gets.
+    } else if (isGlobalReference(expr)) {
+        WH_ASSERT(outputLocation.isStackTop());
+        emitPropertyOp(Opcode::GetGlobal, expr->toIdentifier()->token());
+
+    // Handle property gets.
+    } else if (expr->isGetPropertyExpression()) {
+        WH_ASSERT(outputLocation.isStackTop());
+        AST::GetPropertyExpressionNode *getExpr =
+            expr->toGetPropertyExpression();
+        generateExpression(getExpr->object(), OperandLocation::StackTop());
+        emitPropertyOp(Opcode::GetProp, getExpr->property());
+
+    // Handle element gets with literal indices, which are property gets
+    // of index names.
+    } else if (expr->isGetElementExpression()) {
+        WH_ASSERT(outputLocation.isStackTop());
+        AST::GetElementExpressionNode *getExpr =
+            expr->toGetElementExpression();
+        generateExpression(getExpr->object(), OperandLocation::StackTop());
+        emitPropertyOp(Opcode::GetProp, getIndexName(getExpr->element()));
+
+    // Handle calls, which can only be of native functions.  The callee
+    // and then the arguments are pushed, and replaced by the result.
+    } else if (expr->isCallExpression()) {
+        WH_ASSERT(outputLocation.isStackTop());
+        AST::CallExpressionNode *callExpr = expr->toCallExpression();
+        const AST::ExpressionList &args = callExpr->arguments();
+        if (args.size() > MaxNativeCallArgs)
+            emitError("Cannot handle calls with this many arguments yet.");
+
+        generateExpression(callExpr->function(), OperandLocation::StackTop());
+        for (AST::ExpressionNode *arg : args)
+            generateExpression(arg, OperandLocation::StackTop());
+        emitOp(GetCallNativeOpcode(args.size()));
+
+    // Handle property and global variable sets.
+    } else if (expr->isAssignExpression()) {
+        WH_ASSERT(outputLocation.isStackTop());
+        AST::AssignExpressionNode *assignExpr = expr->toAssignExpression();
+        AST::ExpressionNode *lhs = assignExpr->lhs();
+        while (lhs->isParenthesizedExpression())
+            lhs = lhs->toParenthesizedExpression()->subexpression();
+
+        if (isGlobalReference(lhs)) {
+            generateExpression(assignExpr->rhs(), OperandLocation::StackTop());
+            emitPropertyOp(Opcode::SetGlobal, lhs->toIdentifier()->token());
+            return;
+        }
+
+        // Element targets must have literal indices, as for gets.
+        AST::ExpressionNode *object = nullptr;
+        const SyntaxToken *name = nullptr;
+        if (lhs->isGetElementExpression()) {
+            AST::GetElementExpressionNode *getExpr =
+                lhs->toGetElementExpression();
+            object = getExpr->object();
+            name = &getIndexName(getExpr->element());
+        } else if (lhs->isGetPropertyExpression()) {
+            AST::GetPropertyExpressionNode *getExpr =
+                lhs->toGetPropertyExpression();
+            object = getExpr->object();
+            name = &getExpr->property();
+        } else {
+            emitError("Cannot handle this assignment target yet.");
+        }
+
+        generateExpression(object, OperandLocation::StackTop());
+        generateExpression(assignExpr->rhs(), OperandLocation::StackTop());
+        emitPropertyOp(Opcode::SetProp, *name);
     } else {
         SpewBytecodeError("Cannot handle expr node: %s", expr->typeString());
         emitError("Cannot handle expression");
@@ -205,102 +514,276 @@ bool
 BytecodeGenerator::getAddressableLocation(AST::ExpressionNode *expr,
                                           OperandLocation &location)
 {
-    // Numeric integer literals within the appropriate range
-    // are addressable.
+    // Constant expressions are addressable, as immediates or as
+    // constants.
+    Root<Value> constVal(cx_);
+    if (foldConstant(expr, &constVal)) {
+        location = getConstantLocation(constVal);
+        return true;
+    }
+
+    // Variables which scope analysis placed in the frame are
+    // addressable as arguments or locals.  Program frames hold no
+    // variables, so their locals are all temporaries.
+    if (expr->isIdentifier()) {
+        AST::IdentifierNode *ident = expr->toIdentifier();
+        WH_ASSERT(ident->hasAnnotation());
+        AST::VariableAnnotation *annot = ident->annotation();
+        if (!annot->isBound())
+            return false;
+
+        AST::BindingAnnotation *binding = annot->binding();
+        if (binding->isArgument()) {
+            location = OperandLocation::Argument(binding->index());
+            return true;
+        }
+        if (binding->isLocal()) {
+            location = OperandLocation::Local(binding->index());
+            return true;
+        }
+        return false;
+    }
+
+    // TODO: Handle other cases.
+
+    return false;
+}
+
+bool
+BytecodeGenerator::foldConstant(AST::ExpressionNode *expr,
+                                MutHandle<Value> result)
+{
+    // Handle numeric literals.
     if (expr->isNumericLiteral()) {
         AST::NumericLiteralNode *lit = expr->toNumericLiteral();
         WH_ASSERT(lit->hasAnnotation());
         AST::NumericLiteralAnnotation *annot = lit->annotation();
 
-        bool tryInt32 = false;
-        int32_t i = 0;
-        double d = 0.0;
-
-        // Handle int32 immediates.
         if (annot->isInt32()) {
-            i = annot->int32Value();
-            d = i;
-            tryInt32 = true;
-        } else {
-            // The annotation should already have determined that the
-            // dval cannot fit in an int23.
-            d = annot->doubleValue();
-            WH_ASSERT(ToInt32(d) != d);
-            tryInt32 = false;
-        }
-
-        if (tryInt32 &&
-            (i >= OperandMinSignedValue) &&
-            (i <= OperandMaxSignedValue))
-        {
-            location = OperandLocation::Immediate(i);
+            result = Value::Int32(annot->int32Value());
             return true;
         }
 
-        // Otherwise, handle double value.
-        WH_ASSERT(annot->isDouble());
         Root<Value> dval(cx_);
-        if (!cx_->inHatchery().createNumber(d, dval))
+        AllocationContext acx = cx_->inHatchery(AllocSite::ConstantDouble);
+        if (!acx.createNumber(annot->doubleValue(), dval))
             emitError("Could not allocate number.");
+        result = dval;
+        return true;
+    }
 
-        uint32_t constIdx = addConstant(dval);
-        SpewBytecodeNote("Generating double constant: %llx", d);
-        location = OperandLocation::Constant(constIdx);
+    // Handle plain string literals, whose values are their source text.
+    // Long ones point into the source instead of copying it, if the
+    // source can share its data.
+    if (expr->isStringLiteral()) {
+        const SyntaxToken &tok = expr->toStringLiteral()->value();
+        if (!tok.hasFlag(Token::String_Plain))
+            emitError("Cannot handle escaped or non-ASCII string literals.");
+
+        const uint8_t *text = tok.text(annotator_.source()) + 1;
+        uint32_t length = tok.length() - 2;
+        SourceData *source = nullptr;
+        if (length >= VM::SourceString::MinLength)
+            source = annotator_.source().retainData();
+
+        if (source) {
+            VM::SourceString *str = cx_->inTenured().createSourceString(
+                text, length, source);
+            if (!str)
+                emitError("Could not allocate string literal.");
+            result = Value::HeapString(str);
+        } else {
+            if (!cx_->inTenured().createString(length, text, result.get()))
+                emitError("Could not allocate string literal.");
+        }
         return true;
     }
 
     // Handle parenthesized expressions.
     if (expr->isParenthesizedExpression()) {
         auto subExpr = expr->toParenthesizedExpression()->subexpression();
-        return getAddressableLocation(subExpr, location);
+        return foldConstant(subExpr, result);
     }
 
-    // Handle negative literals.
+    // Handle negation.
     if (expr->isNegativeExpression()) {
         auto subExpr = expr->toNegativeExpression()->subexpression();
-        if (!subExpr->isNumericLiteral())
+        Root<Value> input(cx_);
+        if (!foldConstant(subExpr, &input))
             return false;
 
-        if (!getAddressableLocation(subExpr, location))
+        Value negated;
+        if (VM::FastNeg(input, &negated)) {
+            result = negated;
+            return true;
+        }
+
+        if (!VM::PerformNeg(cx_, input, result))
+            emitError("Could not fold constant expression.");
+        return true;
+    }
+
+    // Handle arithmetic, evaluated as the interpreter would: the fast
+    // path, then the Perform* operation.
+    if (expr->isBinaryExpression() && foldConstants_) {
+        AST::BaseBinaryExpressionNode *binExpr = expr->toBinaryExpression();
+        VM::FastBinaryOp fast = nullptr;
+        VM::SlowBinaryOp slow = nullptr;
+        switch (expr->type()) {
+          case AST::AddExpression:
+            fast = VM::FastAdd;
+            slow = VM::PerformAdd;
+            break;
+          case AST::SubtractExpression:
+            fast = VM::FastSub;
+            slow = VM::PerformSub;
+            break;
+          case AST::MultiplyExpression:
+            fast = VM::FastMul;
+            slow = VM::PerformMul;
+            break;
+          case AST::DivideExpression:
+            fast = VM::FastDiv;
+            slow = VM::PerformDiv;
+            break;
+          case AST::ModuloExpression:
+            fast = VM::FastMod;
+            slow = VM::PerformMod;
+            break;
+          default:
+            return false;
+        }
+
+        Root<Value> lhs(cx_);
+        Root<Value> rhs(cx_);
+        if (!foldConstant(binExpr->lhs(), &lhs) ||
+            !foldConstant(binExpr->rhs(), &rhs))
+        {
             return false;
+        }
 
-        if (location.isImmediate()) {
-            if (location.signedValue() < 0)
-                return false;
+        Value fastResult;
+        if (fast(lhs, rhs, &fastResult)) {
+            result = fastResult;
+            return true;
+        }
 
-            if (-location.signedValue() < OperandMinSignedValue)
-                return false;
+        if (!slow(cx_, lhs, rhs, result))
+            emitError("Could not fold constant expression.");
+        return true;
+    }
 
-            location = OperandLocation::Immediate(-location.signedValue());
+    return false;
+}
 
-        } else if (location.isConstant()) {
-            // Negativize the constant.
-            Value constVal = getConstant(location.constantIndex());
-            WH_ASSERT(constVal.isNumber());
-            WH_ASSERT(!constVal.isInt32());
-            double dbl = -constVal.numberValue();
-            Root<Value> dval(cx_);
-            if (!cx_->inHatchery().createNumber(dbl, dval))
-                return false;
+OperandLocation
+BytecodeGenerator::getConstantLocation(Handle<Value> val)
+{
+    // Small int32s are immediates.
+    if (val->isInt32()) {
+        int32_t i = val->int32Value();
+        if (i >= OperandMinSignedValue && i <= OperandMaxSignedValue)
+            return OperandLocation::Immediate(i);
+    }
 
-            // If constant was created, it MUST have been newly added.
-            WH_ASSERT(location.constantIndex() == constantPool_.size() - 1);
+    uint32_t constIdx = addConstant(val);
+    SpewBytecodeNote("Generating constant %u", (unsigned) constIdx);
+    return OperandLocation::Constant(constIdx);
+}
 
-            replaceConstant(location.constantIndex(), dval);
-            return true;
-        }
+OperandLocation
+BytecodeGenerator::getTemporaryLocation(AST::ExpressionNode *expr)
+{
+    if (!localTemps_)
+        return OperandLocation::StackTop();
+
+    // Only operators can write their result to a local.  Anything
+    // else, including constant expressions, is pushed.
+    while (expr->isParenthesizedExpression())
+        expr = expr->toParenthesizedExpression()->subexpression();
+    if (!expr->isBinaryExpression() && !expr->isUnaryExpression())
+        return OperandLocation::StackTop();
+    Root<Value> constVal(cx_);
+    if (foldConstant(expr, &constVal))
+        return OperandLocation::StackTop();
+
+    if (numTemps_ > OperandMaxIndex)
+        emitError("Too many temporaries in expression.");
+
+    uint32_t idx = numTemps_++;
+    if (numTemps_ > maxTemps_)
+        maxTemps_ = numTemps_;
+    return OperandLocation::Local(idx);
+}
 
-        return false;
+OperandLocation
+BytecodeGenerator::getPropertyNameLocation(const SyntaxToken &name)
+{
+    const uint8_t *text = name.text(annotator_.source());
+    uint32_t length = name.length();
+
+    // Names are normalized as HashObject::defineValueProperty does, so
+    // that they can be looked up without interning.
+    Root<Value> nameVal(cx_);
+    int32_t id;
+    if (VM::IsInt32IdString(text, length, &id)) {
+        nameVal = Value::ImmIndexString(id);
+    } else {
+        Root<VM::LinearString *> interned(cx_);
+        if (!cx_->stringTable().addString(text, length, &interned))
+            emitError("Could not intern property name.");
+        nameVal = Value::HeapString(interned);
     }
 
-    // TODO: Handle other cases.
+    return OperandLocation::Constant(addConstant(nameVal));
+}
 
-    return false;
+bool
+BytecodeGenerator::isIndexName(const SyntaxToken &name)
+{
+    // Only numeric literals which spell their own property name (as "3"
+    // does, but "3.0" and "0x3" do not) can be used as index names.
+    return name.isNumericLiteral() &&
+           VM::IsInt32IdString(name.text(annotator_.source()),
+                               name.length());
+}
+
+bool
+BytecodeGenerator::isGlobalReference(AST::ExpressionNode *expr)
+{
+    if (!expr->isIdentifier())
+        return false;
+
+    AST::IdentifierNode *ident = expr->toIdentifier();
+    WH_ASSERT(ident->hasAnnotation());
+    return ident->annotation()->isGlobal();
+}
+
+const SyntaxToken &
+BytecodeGenerator::getIndexName(AST::ExpressionNode *expr)
+{
+    if (!expr->isNumericLiteral())
+        emitError("Cannot handle this element access yet.");
+
+    const SyntaxToken &name = expr->toNumericLiteral()->value();
+    if (!isIndexName(name))
+        emitError("Cannot handle this element access yet.");
+    return name;
+}
+
+void
+BytecodeGenerator::releaseTemporaries(uint32_t numTemps)
+{
+    WH_ASSERT(numTemps <= numTemps_);
+    numTemps_ = numTemps;
 }
 
 void
 BytecodeGenerator::emitPushInt32(int32_t value)
 {
+    WH_ASSERT(value >= OperandMinSignedValue &&
+              value <= OperandMaxSignedValue);
+
     if (value >= INT8_MIN && value <= INT8_MAX) {
         emitOp(Opcode::PushInt8);
         emitByte(value);
@@ -311,15 +794,17 @@ BytecodeGenerator::emitPushInt32(int32_t value)
         emitOp(Opcode::PushInt16);
         emitByte(value & 0xFF);
         emitByte((value >> 8));
+        return;
     }
 
-    constexpr int32_t INT24_MAX = 0xFFFFFFl;
+    constexpr int32_t INT24_MAX = 0x7FFFFFl;
     constexpr int32_t INT24_MIN = -INT24_MAX - 1;
     if (value >= INT24_MIN && value <= INT24_MAX) {
         emitOp(Opcode::PushInt24);
         emitByte(value & 0xFF);
         emitByte((value >> 8) & 0xFF);
         emitByte(value >> 16);
+        return;
     }
 
     emitOp(Opcode::PushInt32);
@@ -418,6 +903,26 @@ BytecodeGenerator::emitBinaryOp(AST::BaseBinaryExpressionNode *expr,
     emitOperandLocation(outputLocation);
 }
 
+void
+BytecodeGenerator::emitPropertyOp(Opcode op, const SyntaxToken &name)
+{
+    WH_ASSERT(op == Opcode::GetProp || op == Opcode::SetProp ||
+              op == Opcode::GetGlobal || op == Opcode::SetGlobal);
+
+    uint32_t cacheIndex = newPropertyCache();
+    emitOp(op);
+    emitOperandLocation(getPropertyNameLocation(name));
+    emitOperandLocation(OperandLocation::Immediate(ToInt32(cacheIndex)));
+}
+
+uint32_t
+BytecodeGenerator::newPropertyCache()
+{
+    if (numPropertyCaches_ > uint32_t(OperandMaxSignedValue))
+        emitError("Too many property accesses in script.");
+    return numPropertyCaches_++;
+}
+
 void
 BytecodeGenerator::emitPop(uint16_t num)
 {
@@ -425,6 +930,68 @@ BytecodeGenerator::emitPop(uint16_t num)
         emitOp(Opcode::Pop);
 }
 
+uint32_t
+BytecodeGenerator::emitJump(Opcode op, uint32_t target)
+{
+    WH_ASSERT(IsJumpOpcode(op));
+    WH_ASSERT(GetOpcodeFormat(op) == OpcodeFormat::I4);
+    WH_ASSERT(GetOpcodeSection(op) == 0);
+
+    // Jumps are never fused, so the op starts here, and its operand
+    // follows its one byte opcode.
+    uint32_t jump = buffer_.size();
+    emitOp(op);
+    WH_ASSERT(lastOpOffset_ == jump);
+
+    // Backward jumps are emitted with their target.
+    int32_t offset = 0;
+    if (target != NoJump) {
+        WH_ASSERT(target <= jump);
+        if (jump - target > uint32_t(OperandMaxSignedValue))
+            emitError("Jump is too long.");
+        offset = -ToInt32(jump - target);
+    }
+    emitByte(offset & 0xFF);
+    emitByte((offset >> 8) & 0xFF);
+    emitByte((offset >> 16) & 0xFF);
+    emitByte(offset >> 24);
+    return jump;
+}
+
+void
+BytecodeGenerator::bindJump(uint32_t jump)
+{
+    if (jump == NoJump)
+        return;
+
+    uint32_t target = bindLabel();
+    if (target - jump > uint32_t(OperandMaxSignedValue))
+        emitError("Jump is too long.");
+
+    int32_t offset = ToInt32(target - jump);
+    buffer_[jump + 1] = offset & 0xFF;
+    buffer_[jump + 2] = (offset >> 8) & 0xFF;
+    buffer_[jump + 3] = (offset >> 16) & 0xFF;
+    buffer_[jump + 4] = offset >> 24;
+}
+
+uint32_t
+BytecodeGenerator::bindLabel()
+{
+    // The next op must not be fused into the op before the target.
+    lastOp_ = Opcode::INVALID;
+    return buffer_.size();
+}
+
+void
+BytecodeGenerator::emitLoopHead()
+{
+    // The loop counts its iterations in an inline cache of its own.
+    emitOp(Opcode::LoopHead);
+    emitOperandLocation(OperandLocation::Immediate(
+        ToInt32(newPropertyCache())));
+}
+
 void
 BytecodeGenerator::emitOperandLocation(const OperandLocation &location)
 {
@@ -458,21 +1025,39 @@ void
 BytecodeGenerator::emitOp(Opcode op)
 {
     WH_ASSERT(IsValidOpcode(op));
-    // Ops in section 0 get emitted without prefix.
-    // Ops in other sections have section prefix.
-    WH_ASSERT(GetOpcodeSection(op) == 0);
-    emitByte(ToUInt8(op));
+    WH_ASSERT(GetOpcodeSection(op) >= 0);
+
+    // Peephole: if the previous op and this one form a fused op, rewrite
+    // the previous opcode in place.  This op's operands then follow the
+    // previous op's operands, as the fused op's format requires.  Jump
+    // targets reset |lastOp_| when bound (see bindLabel).
+    Opcode fused = Opcode::INVALID;
+    if (fuseOps_ && lastOp_ != Opcode::INVALID)
+        fused = FindFusedOpcode(lastOp_, op);
+
+    // The first op of a fused op is in section 0, as is the fused op, so
+    // the opcode is a single byte either way.
+    if (fused != Opcode::INVALID) {
+        buffer_[lastOpOffset_] = GetOpcodeEncoding(fused);
+        lastOp_ = fused;
+    } else {
+        lastOpOffset_ = buffer_.size();
+        lastOp_ = op;
+
+        // Ops in section 0 get emitted without prefix.
+        // Ops in other sections have section prefix.
+        if (GetOpcodeSection(op) > 0)
+            emitByte(ToUInt8(GetOpcodeSection(op)));
+        emitByte(GetOpcodeEncoding(op));
+    }
 
-    // Adjust stack depth calculations.  Only do this when doing
-    // bytecode generation, not scanning.
-    if (calculateStackDepth_) {
-        WH_ASSERT(GetOpcodePopped(op) <= currentStackDepth_);
+    // Adjust stack depth calculations.
+    WH_ASSERT(GetOpcodePopped(op) <= currentStackDepth_);
 
-        currentStackDepth_ -= GetOpcodePopped(op);
-        currentStackDepth_ += GetOpcodePushed(op);
-        if (currentStackDepth_ > maxStackDepth_)
-            maxStackDepth_ = currentStackDepth_;
-    }
+    currentStackDepth_ -= GetOpcodePopped(op);
+    currentStackDepth_ += GetOpcodePushed(op);
+    if (currentStackDepth_ > maxStackDepth_)
+        maxStackDepth_ = currentStackDepth_;
 }
 
 void
@@ -617,37 +1202,48 @@ BytecodeGenerator::emitIndexedOperand(OperandSpace space, uint32_t idx)
         return;
     }
 
-    WH_ASSERT(idx <= 0x0FFFFFFFu);
+    WH_ASSERT(idx <= OperandMaxIndex);
 
-    // Four-byte encoding of operand.
+    // Three-byte encoding of operand.
     // Low bits hold size (2)
     uint8_t byte = 2;
     byte |= (ToUInt8(space) << 2);
     byte |= (idx & 0xFu) << 4;
     emitByte(byte);
     emitByte((idx >> 4) & 0xFFu);
-    emitByte((idx >> 12) & 0xFFu);
-    emitByte(idx >> 20);
+    emitByte(idx >> 12);
     return;
 }
 
 void
 BytecodeGenerator::emitByte(uint8_t byte)
 {
-    WH_ASSERT_IF(bytecode_, currentBytecodeSize_ < bytecodeSize_);
-
-    if (bytecode_)
-        bytecode_->writableData()[currentBytecodeSize_] = byte;
-
-    currentBytecodeSize_++;
+    buffer_.push_back(byte);
 }
 
 uint32_t
 BytecodeGenerator::addConstant(Value val)
 {
+    ConstantMap *constants = &otherConstants_;
+    uint64_t key = val.raw();
+    if (val.isNumber() && !val.isInt32()) {
+        constants = &numberConstants_;
+        key = DoubleToInt(val.numberValue());
+    }
+
+    auto existing = constants->find(key);
+    if (existing != constants->end())
+        return existing->second;
+
     uint32_t constIdx = constantPool_.size();
     if (constIdx > OperandMaxIndex)
         emitError("Too many constant values in script.");
+
+    try {
+        constants->insert({ key, constIdx });
+    } catch (BumpAllocatorError &err) {
+        emitError("Could not allocate constant pool entry.");
+    }
     constantPool_.append(val);
     return constIdx;
 }
@@ -659,13 +1255,6 @@ BytecodeGenerator::getConstant(uint32_t idx)
     return constantPool_[idx];
 }
 
-void
-BytecodeGenerator::replaceConstant(uint32_t idx, Value val)
-{
-    WH_ASSERT(idx <= OperandMaxIndex);
-    constantPool_[idx] = val;
-}
-
 void
 BytecodeGenerator::emitError(const char *msg)
 {
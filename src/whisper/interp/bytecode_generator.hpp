@@ -1,6 +1,9 @@
 #ifndef WHISPER__INTERP__BYTECODEGEN_HPP
 #define WHISPER__INTERP__BYTECODEGEN_HPP
 
+#include <unordered_map>
+#include <vector>
+
 #include "common.hpp"
 #include "debug.hpp"
 #include "allocators.hpp"
@@ -35,6 +38,16 @@ class BytecodeGenerator
     // The allocator to use during parsing.
     STLBumpAllocator<uint8_t> allocator_;
 
+    // Pool for the generator's containers, which recycles their storage
+    // as they grow.
+    PoolAllocator pool_;
+
+    typedef std::unordered_map<
+                uint64_t, uint32_t,
+                std::hash<uint64_t>, std::equal_to<uint64_t>,
+                STLPoolAllocator<std::pair<const uint64_t, uint32_t>>>
+        ConstantMap;
+
     // The syntax tree code is being generated for.
     AST::ProgramNode *node_;
 
@@ -58,21 +71,47 @@ class BytecodeGenerator
     // The maximum stack depth.
     uint32_t maxStackDepth_ = 0;
 
+    // The maximum number of temporaries live at once.
+    uint32_t maxTemps_ = 0;
+
     // Rooted vector of all generated constants.
     VectorRoot<Value> constantPool_;
 
+    // Indices of the constants in |constantPool_|, which holds each
+    // constant once.  Numbers are keyed by their double bit pattern, and
+    // other constants, such as interned strings, by their raw value.
+    ConstantMap numberConstants_;
+    ConstantMap otherConstants_;
 
-    /// Intermediate state. ///
 
-    // Flag controlling whether stack depth should be calculated.
-    bool calculateStackDepth_ = false;
+    /// Intermediate state. ///
 
-    // The current bytecode size.
-    uint32_t currentBytecodeSize_ = 0;
+    // The bytecode emitted so far.  Code is generated in one pass into
+    // this buffer, which is then copied into |bytecode_|.
+    std::vector<uint8_t, STLPoolAllocator<uint8_t>> buffer_;
 
     // The current stack depth.
     uint32_t currentStackDepth_ = 0;
 
+    // Whether to fuse pairs of ops into fused ops.
+    bool fuseOps_ = true;
+
+    // Whether to evaluate constant expressions during generation.
+    bool foldConstants_ = true;
+
+    // Whether to give expression temporaries local slots, and the number
+    // of temporaries currently live.
+    bool localTemps_ = false;
+    uint32_t numTemps_ = 0;
+
+    // The last op emitted, and its offset, for fusing with the next op.
+    Opcode lastOp_ = Opcode::INVALID;
+    uint32_t lastOpOffset_ = 0;
+
+    // The number of property ops emitted, each of which gets its own
+    // inline cache (see VM::PropertyCache).
+    uint32_t numPropertyCaches_ = 0;
+
   public:
     BytecodeGenerator(RunContext *cx,
                       const STLBumpAllocator<uint8_t> &allocator,
@@ -80,6 +119,12 @@ class BytecodeGenerator
                       AST::SyntaxAnnotator &annotator,
                       bool strict);
 
+    // Allocate scratch state in the arena's Codegen sub-arena.
+    BytecodeGenerator(RunContext *cx, CompilationArena &arena,
+                      AST::ProgramNode *node,
+                      AST::SyntaxAnnotator &annotator,
+                      bool strict);
+
     bool hasError() const;
     const char *error() const;
 
@@ -87,15 +132,54 @@ class BytecodeGenerator
     bool constants(VM::Tuple *&tup);
 
     uint32_t maxStackDepth() const;
+    uint32_t numLocals() const;
+
+    // Fused ops are emitted by default.  Must be set before generating.
+    void setFuseOps(bool fuseOps);
+
+    // Constant arithmetic (e.g. |60 * 60 * 24|) is evaluated during
+    // generation by default, with the interpreter's semantics, and its
+    // result emitted as a push, an immediate or a constant.  Must be set
+    // before generating.
+    void setFoldConstants(bool foldConstants);
+
+    // Expression temporaries are kept on the stack by default.  With
+    // local temporaries, operator results are written to local slots and
+    // operators read their inputs from them, using the register forms of
+    // ops (e.g. Add_VVV) instead of pushes and pops.  Must be set before
+    // generating.
+    void setLocalTemps(bool localTemps);
 
   private:
+    // Offset of a jump which is never emitted, because its condition
+    // is constant (see generateConditionalJump).  Binding it does
+    // nothing.
+    static constexpr uint32_t NoJump = UINT32_MAX;
+
     void generate();
+    void generateSourceElements(const AST::SourceElementList &elems);
+    void generateStatement(AST::StatementNode *stmt);
     void generateExpressionStatement(AST::ExpressionStatementNode *exprStmt);
+    void generateIfStatement(AST::IfStatementNode *ifStmt);
+    void generateDoWhileStatement(AST::DoWhileStatementNode *loop);
+    void generateWhileStatement(AST::WhileStatementNode *loop);
+    void generateForLoopStatement(AST::ForLoopStatementNode *loop);
+    void generateEffect(AST::ExpressionNode *expr);
+    uint32_t generateConditionalJump(AST::ExpressionNode *cond, bool jumpIf,
+                                     uint32_t target=NoJump);
     void generateExpression(AST::ExpressionNode *expr,
                             const OperandLocation &outputLocation);
 
     bool getAddressableLocation(AST::ExpressionNode *expr,
                                 OperandLocation &location);
+    bool foldConstant(AST::ExpressionNode *expr, MutHandle<Value> result);
+    OperandLocation getConstantLocation(Handle<Value> val);
+    OperandLocation getTemporaryLocation(AST::ExpressionNode *expr);
+    OperandLocation getPropertyNameLocation(const SyntaxToken &name);
+    bool isIndexName(const SyntaxToken &name);
+    bool isGlobalReference(AST::ExpressionNode *expr);
+    const SyntaxToken &getIndexName(AST::ExpressionNode *expr);
+    void releaseTemporaries(uint32_t numTemps);
 
 
     void emitPushInt32(int32_t value);
@@ -109,8 +193,19 @@ class BytecodeGenerator
                       const OperandLocation &rhsLocation,
                       const OperandLocation &outputLocation);
 
+    uint32_t newPropertyCache();
+    void emitPropertyOp(Opcode op, const SyntaxToken &name);
+
     void emitPop(uint16_t num=1);
 
+    // Jumps are emitted with the offset of their target from the start
+    // of the op.  Forward jumps are emitted with no target, and bound
+    // once it is reached.  Ops are never fused across a bound target.
+    uint32_t emitJump(Opcode op, uint32_t target=NoJump);
+    void bindJump(uint32_t jump);
+    uint32_t bindLabel();
+    void emitLoopHead();
+
     void emitOperandLocation(const OperandLocation &location);
     void emitOp(Opcode op);
     void emitConstantOperand(uint32_t idx);
@@ -125,7 +220,6 @@ class BytecodeGenerator
 
     uint32_t addConstant(Value val);
     Value getConstant(uint32_t idx);
-    void replaceConstant(uint32_t idx, Value val);
     
     void emitError(const char *msg);
 };
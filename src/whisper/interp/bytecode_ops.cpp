@@ -296,14 +296,27 @@ class OpcodeTraits
     }
 };
 
-enum class Opcode_Sec0 : uint8_t
-{
-    INVALID = 0,
-#define OP_ENUM_(name, ...) name,
-    WHISPER_BYTECODE_SEC0_OPS(OP_ENUM_)
-#undef OP_ENUM_
-    LIMIT
-};
+// Section prefixes take the first bytes of section 0, and fused ops are
+// all in section 0.
+static constexpr unsigned NumSection0Opcodes = 1
+#define COUNT_SEC0_(name, fmt, section, ...) + ((section) <= 0 ? 1 : 0)
+    WHISPER_BYTECODE_OPS(COUNT_SEC0_)
+#undef COUNT_SEC0_
+#define COUNT_FUSED_(...) + 1
+    WHISPER_BYTECODE_FUSED_OPS(COUNT_FUSED_)
+#undef COUNT_FUSED_
+    ;
+
+static constexpr unsigned NumSection1Opcodes = 1
+#define COUNT_SEC1_(name, fmt, section, ...) + ((section) == 1 ? 1 : 0)
+    WHISPER_BYTECODE_OPS(COUNT_SEC1_)
+#undef COUNT_SEC1_
+    ;
+
+static_assert(NumSection0Opcodes <= 0x100,
+              "Section 0 opcodes must fit in a byte.");
+static_assert(NumSection1Opcodes <= 0x100,
+              "Section 1 opcodes must fit in a byte.");
 
 bool
 IsValidOpcode(Opcode op)
@@ -314,7 +327,7 @@ IsValidOpcode(Opcode op)
         if (flags & OPF_SectionPrefix) \
             return false;
         return true;
-    WHISPER_BYTECODE_SEC0_OPS(OP_CASE_)
+    WHISPER_BYTECODE_OPS(OP_CASE_)
 #undef OP_CASE_
       default:
         break;
@@ -336,7 +349,8 @@ OpcodeString(Opcode opcode)
         return "INVALID";
 #define OP_STR_(name, ...) \
       case Opcode::name: return #name;
-    WHISPER_BYTECODE_SEC0_OPS(OP_STR_)
+    WHISPER_BYTECODE_OPS(OP_STR_)
+    WHISPER_BYTECODE_FUSED_OPS(OP_STR_)
 #undef OP_STR_
       case Opcode::LIMIT:
         return "LIMIT";
@@ -347,6 +361,89 @@ OpcodeString(Opcode opcode)
 static bool OPCODE_TRAITS_INITIALIZED = false;
 static OpcodeTraits OPCODE_TRAITS[static_cast<unsigned>(Opcode::LIMIT)];
 
+// The opcode of each byte of each section, for decoding.
+static Opcode SECTION_OPCODES[WHISPER_BYTECODE_MAX_SECTION + 1][0x100];
+static uint32_t NEXT_SECTION_ENCODING[WHISPER_BYTECODE_MAX_SECTION + 1];
+
+// Give |opcode| the next free byte of |section|.  Section prefixes have
+// no section of their own, and take the byte of section 0 equal to the
+// section they prefix.
+static uint8_t
+AssignOpcodeEncoding(Opcode opcode, int8_t section)
+{
+    unsigned sec = section < 0 ? 0 : section;
+    WH_ASSERT(sec <= WHISPER_BYTECODE_MAX_SECTION);
+    uint32_t encoding = NEXT_SECTION_ENCODING[sec]++;
+    WH_ASSERT(encoding < 0x100);
+
+    if (section < 0)
+        WH_ASSERT(encoding <= WHISPER_BYTECODE_MAX_SECTION);
+    else
+        SECTION_OPCODES[sec][encoding] = opcode;
+    return ToUInt8(encoding);
+}
+
+struct FusedOpcodeInfo
+{
+    Opcode fused;
+    Opcode first;
+    Opcode second;
+};
+
+static const FusedOpcodeInfo FUSED_OPCODES[] = {
+#define FUSED_INFO_(name, first, second, format) \
+    { Opcode::name, Opcode::first, Opcode::second },
+    WHISPER_BYTECODE_FUSED_OPS(FUSED_INFO_)
+#undef FUSED_INFO_
+};
+
+static const FusedOpcodeInfo *
+LookupFusedOpcode(Opcode opcode)
+{
+    for (const FusedOpcodeInfo &info : FUSED_OPCODES) {
+        if (info.fused == opcode)
+            return &info;
+    }
+    return nullptr;
+}
+
+static void
+InitializeFusedOpcode(const FusedOpcodeInfo &info, OpcodeFormat format)
+{
+    const OpcodeTraits &first =
+        OPCODE_TRAITS[static_cast<unsigned>(info.first)];
+    const OpcodeTraits &second =
+        OPCODE_TRAITS[static_cast<unsigned>(info.second)];
+
+    // The fused format must be the concatenation of the component
+    // formats, so that operands decode in order.
+    WH_ASSERT(first.section() == 0 && second.section() >= 0);
+    WH_ASSERT(!(first.flags() & OPF_Control));
+    WH_ASSERT(!(first.flags() & OPF_Jump) && !(second.flags() & OPF_Jump));
+    uint8_t firstOperands = GetOpcodeOperandCount(first.format());
+    WH_ASSERT(OpcodeFormatNumber(format) ==
+              (OpcodeFormatNumber(first.format()) |
+               (OpcodeFormatNumber(second.format()) <<
+                    (firstOperands * OpcodeFormatComponentBits))));
+
+    // Net stack effect of the pair.
+    uint8_t popped = first.popped();
+    uint8_t pushed = first.pushed();
+    if (second.popped() > pushed) {
+        popped += second.popped() - pushed;
+        pushed = 0;
+    } else {
+        pushed -= second.popped();
+    }
+    pushed += second.pushed();
+
+    OpcodeFlags flags = static_cast<OpcodeFlags>(
+        OPF_Fused | (second.flags() & OPF_Control));
+    OPCODE_TRAITS[static_cast<unsigned>(info.fused)] =
+        OpcodeTraits(OpcodeString(info.fused), info.fused, format, 0, flags,
+                     popped, pushed, AssignOpcodeEncoding(info.fused, 0));
+}
+
 void
 InitializeOpcodeInfo()
 {
@@ -357,13 +454,25 @@ InitializeOpcodeInfo()
                                         /*pushed=*/0, /*popped=*/0,
                                         /*encoding=*/0);
     }
+    for (unsigned i = 0; i <= WHISPER_BYTECODE_MAX_SECTION; i++) {
+        for (unsigned j = 0; j < 0x100; j++)
+            SECTION_OPCODES[i][j] = Opcode::INVALID;
+        NEXT_SECTION_ENCODING[i] = 1;
+    }
 
 #define INIT_(op, format, section, popped, pushed, flags) \
     OPCODE_TRAITS[static_cast<unsigned>(Opcode::op)] = \
         OpcodeTraits(#op, Opcode::op, OpcodeFormat::format, section, flags, \
-                     popped, pushed, ToUInt8(Opcode_Sec0::op));
-    WHISPER_BYTECODE_SEC0_OPS(INIT_)
+                     popped, pushed, \
+                     AssignOpcodeEncoding(Opcode::op, section));
+    WHISPER_BYTECODE_OPS(INIT_)
 #undef INIT_
+
+#define INIT_FUSED_(op, first, second, format) \
+    InitializeFusedOpcode(*LookupFusedOpcode(Opcode::op), \
+                          OpcodeFormat::format);
+    WHISPER_BYTECODE_FUSED_OPS(INIT_FUSED_)
+#undef INIT_FUSED_
     OPCODE_TRAITS_INITIALIZED = true;
 }
 
@@ -373,24 +482,55 @@ ReadOpcode(const uint8_t *bytecodeData, const uint8_t *bytecodeEnd,
 {
     WH_ASSERT_IF(bytecodeEnd, bytecodeData < bytecodeEnd);
 
-    uint16_t opval = bytecodeData[0];
+    uint8_t section = 0;
+    uint8_t encoding = bytecodeData[0];
     uint32_t nread = 1;
 
-    WH_ASSERT(opval != 0);
+    WH_ASSERT(encoding != 0);
 
-    if (opval <= WHISPER_BYTECODE_MAX_SECTION) {
+    if (encoding <= WHISPER_BYTECODE_MAX_SECTION) {
         WH_ASSERT_IF(bytecodeEnd, (bytecodeData + 1) < bytecodeEnd);
-        opval <<= 8;
-        opval |= bytecodeData[1];
+        section = encoding;
+        encoding = bytecodeData[1];
         nread++;
     }
 
-    WH_ASSERT(IsValidOpcode(static_cast<Opcode>(opval)));
+    Opcode op = LookupOpcode(section, encoding);
+    WH_ASSERT(op != Opcode::INVALID);
+    WH_ASSERT(IsValidOpcode(op));
     if (opcode)
-        *opcode = static_cast<Opcode>(opval);
+        *opcode = op;
     return nread;
 }
 
+Opcode
+LookupOpcode(uint8_t section, uint8_t encoding)
+{
+    WH_ASSERT(OPCODE_TRAITS_INITIALIZED);
+    if (section > WHISPER_BYTECODE_MAX_SECTION)
+        return Opcode::INVALID;
+    return SECTION_OPCODES[section][encoding];
+}
+
+uint32_t
+OpcodeLayoutHash()
+{
+    WH_ASSERT(OPCODE_TRAITS_INITIALIZED);
+
+    // 32-bit FNV-1a.
+    uint32_t hash = 0x811c9dc5u;
+    for (unsigned i = 1; i < static_cast<unsigned>(Opcode::LIMIT); i++) {
+        const OpcodeTraits &traits = OPCODE_TRAITS[i];
+        uint8_t bytes[2] = { ToUInt8(traits.section() + 1),
+                             traits.encoding() };
+        for (uint8_t byte : bytes) {
+            hash ^= byte;
+            hash *= 0x01000193u;
+        }
+    }
+    return hash;
+}
+
 const char *
 GetOpcodeName(Opcode opcode)
 {
@@ -440,6 +580,69 @@ GetOpcodePushed(Opcode opcode)
     return OPCODE_TRAITS[static_cast<unsigned>(opcode)].pushed();
 }
 
+bool
+IsFusedOpcode(Opcode opcode)
+{
+    WH_ASSERT(IsValidOpcode(opcode));
+    return GetOpcodeFlags(opcode) & OPF_Fused;
+}
+
+Opcode
+GetFusedFirstOpcode(Opcode opcode)
+{
+    const FusedOpcodeInfo *info = LookupFusedOpcode(opcode);
+    WH_ASSERT(info);
+    return info->first;
+}
+
+Opcode
+GetFusedSecondOpcode(Opcode opcode)
+{
+    const FusedOpcodeInfo *info = LookupFusedOpcode(opcode);
+    WH_ASSERT(info);
+    return info->second;
+}
+
+Opcode
+FindFusedOpcode(Opcode first, Opcode second)
+{
+    for (const FusedOpcodeInfo &info : FUSED_OPCODES) {
+        if (info.first == first && info.second == second)
+            return info.fused;
+    }
+    return Opcode::INVALID;
+}
+
+bool
+IsJumpOpcode(Opcode opcode)
+{
+    WH_ASSERT(IsValidOpcode(opcode));
+    return GetOpcodeFlags(opcode) & OPF_Jump;
+}
+
+bool
+IsCallNativeOpcode(Opcode opcode)
+{
+    return opcode >= Opcode::CallNative0 && opcode <= Opcode::CallNative3;
+}
+
+Opcode
+GetCallNativeOpcode(uint32_t argc)
+{
+    static_assert(ToUInt32(Opcode::CallNative3) -
+                      ToUInt32(Opcode::CallNative0) == MaxNativeCallArgs,
+                  "CallNative ops must be numbered by their arguments.");
+    WH_ASSERT(argc <= MaxNativeCallArgs);
+    return static_cast<Opcode>(ToUInt32(Opcode::CallNative0) + argc);
+}
+
+uint32_t
+GetCallNativeArgc(Opcode opcode)
+{
+    WH_ASSERT(IsCallNativeOpcode(opcode));
+    return ToUInt32(opcode) - ToUInt32(Opcode::CallNative0);
+}
+
 uint8_t
 GetOpcodeOperandCount(OpcodeFormat fmt)
 {
@@ -650,6 +853,108 @@ ReadOperandLocation(const uint8_t *bytecodeData, const uint8_t *bytecodeEnd,
     return 0;
 }
 
+uint32_t
+DecodeOp(const uint8_t *bytecodeData, const uint8_t *bytecodeEnd,
+         uint32_t pcOffset, DecodedOp *decoded)
+{
+    Opcode op;
+    uint32_t nread = ReadOpcode(bytecodeData, bytecodeEnd, &op);
+
+    OpcodeFormat fmt = GetOpcodeFormat(op);
+    uint8_t numOperands = GetOpcodeOperandCount(fmt);
+    WH_ASSERT(numOperands <= DecodedOp::MaxOperands);
+
+    for (uint8_t i = 0; i < numOperands; i++) {
+        nread += ReadOperandLocation(bytecodeData + nread, bytecodeEnd,
+                                     fmt, i, &decoded->operands[i]);
+    }
+
+    WH_ASSERT(nread <= UINT8_MAX);
+    decoded->opcode = op;
+    decoded->length = nread;
+    decoded->numOperands = numOperands;
+    decoded->pcOffset = pcOffset;
+    return nread;
+}
+
+void
+SplitFusedOp(const DecodedOp &fused, DecodedOp *first, DecodedOp *second)
+{
+    const FusedOpcodeInfo *info = LookupFusedOpcode(fused.opcode);
+    WH_ASSERT(info);
+
+    first->opcode = info->first;
+    first->numOperands = GetOpcodeOperandCount(GetOpcodeFormat(info->first));
+    first->pcOffset = fused.pcOffset;
+    first->length = 0;
+
+    second->opcode = info->second;
+    second->numOperands = fused.numOperands - first->numOperands;
+    second->pcOffset = fused.pcOffset;
+    second->length = 0;
+
+    for (uint8_t i = 0; i < first->numOperands; i++)
+        first->operands[i] = fused.operands[i];
+    for (uint8_t i = 0; i < second->numOperands; i++)
+        second->operands[i] = fused.operands[first->numOperands + i];
+}
+
+void
+ReadBinaryOperandLocations(const DecodedOp &dop, Opcode baseOp,
+                           OperandLocation *lhsLoc, OperandLocation *rhsLoc,
+                           OperandLocation *outLoc)
+{
+    unsigned opcodeOffset = OpcodeNumber(dop.opcode) - OpcodeNumber(baseOp);
+    WH_ASSERT(opcodeOffset < 8);
+    bool lhsIsValue = opcodeOffset & (1 << 2);
+    bool rhsIsValue = opcodeOffset & (1 << 1);
+    bool outIsValue = opcodeOffset & (1 << 0);
+
+    // Value operands are decoded in order.
+    uint32_t operandNo = 0;
+
+    if (lhsIsValue)
+        *lhsLoc = dop.operands[operandNo++];
+    else
+        *lhsLoc = OperandLocation::StackTop();
+
+    if (rhsIsValue)
+        *rhsLoc = dop.operands[operandNo++];
+    else
+        *rhsLoc = OperandLocation::StackTop();
+
+    if (outIsValue)
+        *outLoc = dop.operands[operandNo++];
+    else
+        *outLoc = OperandLocation::StackTop();
+
+    WH_ASSERT(operandNo == dop.numOperands);
+}
+
+void
+ReadUnaryOperandLocations(const DecodedOp &dop, Opcode baseOp,
+                          OperandLocation *inLoc, OperandLocation *outLoc)
+{
+    unsigned opcodeOffset = OpcodeNumber(dop.opcode) - OpcodeNumber(baseOp);
+    WH_ASSERT(opcodeOffset < 4);
+    bool inputIsValue = opcodeOffset & (1 << 1);
+    bool outIsValue = opcodeOffset & (1 << 0);
+
+    uint32_t operandNo = 0;
+
+    if (inputIsValue)
+        *inLoc = dop.operands[operandNo++];
+    else
+        *inLoc = OperandLocation::StackTop();
+
+    if (outIsValue)
+        *outLoc = dop.operands[operandNo++];
+    else
+        *outLoc = OperandLocation::StackTop();
+
+    WH_ASSERT(operandNo == dop.numOperands);
+}
+
 
 } // namespace Interp
 } // namespace Whisper
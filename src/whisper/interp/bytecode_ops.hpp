@@ -27,7 +27,9 @@ namespace Interp {
  * Instruction Encoding
  * --------------------
  * Instructions are encoded with the first byte being an opcode, and
- * subsequent bytes encoing any operands the opcode might take.
+ * subsequent bytes encoing any operands the opcode might take.  Less
+ * common opcodes take two bytes: a section prefix, and the opcode's
+ * byte within that section (see WHISPER_BYTECODE_OPS).
  *
  * The format of the subsequent bytes can be classified into one of
  * several kinds.  Each kind is given both a short and a long name.
@@ -163,7 +165,7 @@ enum class OperandSpace : uint8_t
 const char *OperandSpaceString(OperandSpace space);
 
 constexpr unsigned OperandSignificantBits = 28;
-constexpr uint32_t OperandMaxIndex = 0x0fffffffUL;
+constexpr uint32_t OperandMaxIndex = 0x000fffffUL;
 constexpr int32_t OperandMaxUnsignedValue = 0x0fffffffUL;
 constexpr int32_t OperandMaxSignedValue = 0x07ffffffL;
 constexpr int32_t OperandMinSignedValue = -OperandMaxSignedValue - 1;
@@ -226,7 +228,9 @@ enum OpcodeFlags : uint32_t
 {
     OPF_None                = 0x0,
     OPF_SectionPrefix       = 0x1,
-    OPF_Control             = 0x2
+    OPF_Control             = 0x2,
+    OPF_Fused               = 0x4,
+    OPF_Jump                = 0x8
 };
 
 
@@ -234,7 +238,8 @@ enum class Opcode : uint16_t
 {
     INVALID = 0,
 #define OP_ENUM_(name, ...) name,
-    WHISPER_BYTECODE_SEC0_OPS(OP_ENUM_)
+    WHISPER_BYTECODE_OPS(OP_ENUM_)
+    WHISPER_BYTECODE_FUSED_OPS(OP_ENUM_)
 #undef OP_ENUM_
     LIMIT
 };
@@ -248,6 +253,15 @@ void InitializeOpcodeInfo();
 uint32_t ReadOpcode(const uint8_t *bytecodeData, const uint8_t *bytecodeEnd,
                     Opcode *opcode);
 
+// The opcode encoded as byte |encoding| of section |section|, or
+// Opcode::INVALID if there is none.
+Opcode LookupOpcode(uint8_t section, uint8_t encoding);
+
+// Hash of the section and encoding of every opcode, which changes when
+// the opcode layout does.  Bytecode stored by one build can only be
+// read by builds with the same layout.
+uint32_t OpcodeLayoutHash();
+
 const char *GetOpcodeName(Opcode opcode);
 OpcodeFormat GetOpcodeFormat(Opcode opcode);
 int8_t GetOpcodeSection(Opcode opcode);
@@ -257,12 +271,72 @@ uint8_t GetOpcodeEncoding(Opcode opcode);
 uint8_t GetOpcodePopped(Opcode opcode);
 uint8_t GetOpcodePushed(Opcode opcode);
 
+// Fused ops.  FindFusedOpcode returns the fused op standing for |first|
+// followed by |second|, or Opcode::INVALID if there is none.
+bool IsFusedOpcode(Opcode opcode);
+Opcode GetFusedFirstOpcode(Opcode opcode);
+Opcode GetFusedSecondOpcode(Opcode opcode);
+Opcode FindFusedOpcode(Opcode first, Opcode second);
+
+// Jump ops take the offset of their target as their first operand.
+bool IsJumpOpcode(Opcode opcode);
+
+// CallNative ops take their number of arguments from their opcode, from
+// CallNative0 up to MaxNativeCallArgs.
+static constexpr uint32_t MaxNativeCallArgs = 3;
+bool IsCallNativeOpcode(Opcode opcode);
+Opcode GetCallNativeOpcode(uint32_t argc);
+uint32_t GetCallNativeArgc(Opcode opcode);
+
 uint8_t GetOpcodeOperandCount(OpcodeFormat fmt);
 uint32_t ReadOperandLocation(const uint8_t *bytecodeData,
                              const uint8_t *bytecodeEnd,
                              OpcodeFormat fmt, uint8_t operandNo,
                              OperandLocation *location);
-    
+
+
+//
+// DecodedOp is the fixed-width form of a single op, with its operands
+// already unpacked.  The interpreter executes bytecode decoded into an
+// array of DecodedOps (see VM::DecodedBytecode), so that it does not
+// decode the variable-length encoding of an op each time it runs it.
+//
+// The operand of a decoded jump op is the offset of its target in the
+// array of ops, rather than in the bytecode.  A target at the end of
+// the bytecode is one past the last op.
+//
+struct DecodedOp
+{
+    static constexpr uint32_t MaxOperands = 3;
+
+    Opcode opcode;
+    uint8_t length;
+    uint8_t numOperands;
+    uint32_t pcOffset;
+    OperandLocation operands[MaxOperands];
+};
+
+// Decode the op at |bytecodeData|, which is at |pcOffset| in its
+// bytecode.  Returns the length of the op in bytes.
+uint32_t DecodeOp(const uint8_t *bytecodeData, const uint8_t *bytecodeEnd,
+                  uint32_t pcOffset, DecodedOp *decoded);
+
+// Split a decoded fused op into the two ops it stands for.  Both
+// component ops keep the pc offset of the fused op.
+void SplitFusedOp(const DecodedOp &fused, DecodedOp *first,
+                  DecodedOp *second);
+
+// Find the operand locations of a decoded arithmetic op, whose opcode
+// is |baseOp| offset by the kinds of its operands.  Operands which are
+// not values are on top of the stack.
+void ReadBinaryOperandLocations(const DecodedOp &dop, Opcode baseOp,
+                                OperandLocation *lhsLoc,
+                                OperandLocation *rhsLoc,
+                                OperandLocation *outLoc);
+void ReadUnaryOperandLocations(const DecodedOp &dop, Opcode baseOp,
+                               OperandLocation *inLoc,
+                               OperandLocation *outLoc);
+
 
 } // namespace Interp
 } // namespace Whisper
@@ -0,0 +1,302 @@
+
+#include <new>
+
+#include "interp/bytecode_verifier.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+static constexpr uint32_t NoOp = UINT32_MAX;
+static constexpr int32_t UnknownDepth = -1;
+
+//
+// BytecodeVerifier
+//
+// Decodes the ops of the bytecode, checking their encoding and
+// operands, then follows the stack depth from the first op through
+// every jump and fall-through.
+//
+class BytecodeVerifier
+{
+  private:
+    const uint8_t *data_;
+    uint32_t length_;
+    uint32_t numConstants_;
+    uint32_t numLocals_;
+    uint32_t maxStackDepth_;
+
+    std::vector<DecodedOp> ops_;
+
+    // The index of the op starting at each pc offset, and of the end.
+    std::vector<uint32_t> opAtPc_;
+
+    // The stack depth at the start of each op, and at the end.
+    std::vector<int32_t> depths_;
+    std::vector<uint32_t> worklist_;
+
+    const char *error_;
+
+  public:
+    BytecodeVerifier(const uint8_t *data, uint32_t length,
+                     uint32_t numConstants, uint32_t numLocals,
+                     uint32_t maxStackDepth)
+      : data_(data), length_(length),
+        numConstants_(numConstants), numLocals_(numLocals),
+        maxStackDepth_(maxStackDepth),
+        ops_(), opAtPc_(), depths_(), worklist_(),
+        error_(nullptr)
+    {}
+
+    const char *error() const {
+        return error_;
+    }
+
+    bool verify() {
+        if (length_ == 0)
+            return fail("Empty bytecode.");
+        if (maxStackDepth_ > UINT16_MAX)
+            return fail("Stack too deep for the stack map.");
+
+        opAtPc_.assign(length_ + 1, NoOp);
+        for (uint32_t pc = 0; pc < length_; ) {
+            opAtPc_[pc] = ops_.size();
+            uint32_t opLength;
+            if (!decodeOp(pc, &opLength))
+                return false;
+            pc += opLength;
+        }
+        opAtPc_[length_] = ops_.size();
+
+        return checkJumpTargets() && checkStack();
+    }
+
+    void fillStackMap(std::vector<uint16_t> *stackMap) const {
+        stackMap->resize(ops_.size());
+        for (uint32_t i = 0; i < ops_.size(); i++) {
+            int32_t depth = depths_[i];
+            (*stackMap)[i] = depth == UnknownDepth ? 0 : ToUInt16(depth);
+        }
+    }
+
+  private:
+    bool fail(const char *error) {
+        error_ = error;
+        return false;
+    }
+
+    // Check that the op at |pc| lies within the bytecode and has valid
+    // operands, and decode it.
+    bool decodeOp(uint32_t pc, uint32_t *opLength) {
+        uint8_t section = 0;
+        uint8_t encoding = data_[pc];
+        if (encoding != 0 && encoding <= WHISPER_BYTECODE_MAX_SECTION) {
+            if (pc + 1 >= length_)
+                return fail("Truncated opcode.");
+            section = encoding;
+            encoding = data_[pc + 1];
+        }
+
+        Opcode opcode = LookupOpcode(section, encoding);
+        if (opcode == Opcode::INVALID)
+            return fail("Invalid opcode.");
+        if (GetOpcodeFlags(opcode) & OPF_Control)
+            return fail("Control ops are not supported.");
+
+        OpcodeFormat fmt = GetOpcodeFormat(opcode);
+        uint32_t fmtNumber = OpcodeFormatNumber(fmt);
+        uint32_t nread = (section == 0) ? 1 : 2;
+        for (uint8_t i = 0; i < GetOpcodeOperandCount(fmt); i++) {
+            uint32_t part = (fmtNumber >> (i * OpcodeFormatComponentBits)) &
+                            OpcodeFormatMask;
+            uint32_t operandLength;
+            OpcodeFormat partFmt = static_cast<OpcodeFormat>(part);
+            if (!readOperandLength(pc + nread, partFmt, &operandLength)) {
+                return false;
+            }
+            nread += operandLength;
+        }
+
+        DecodedOp op;
+        uint32_t decodedLength =
+            DecodeOp(data_ + pc, data_ + length_, pc, &op);
+        WH_ASSERT(decodedLength == nread);
+
+        for (uint8_t i = 0; i < op.numOperands; i++) {
+            const OperandLocation &loc = op.operands[i];
+            if (loc.isConstant() && loc.constantIndex() >= numConstants_)
+                return fail("Constant operand out of range.");
+            if (loc.isLocal() && loc.localIndex() >= numLocals_)
+                return fail("Local operand out of range.");
+            if (loc.isArgument())
+                return fail("Argument operand in a script.");
+        }
+
+        ops_.push_back(op);
+        *opLength = decodedLength;
+        return true;
+    }
+
+    bool readOperandLength(uint32_t pc, OpcodeFormat part,
+                           uint32_t *operandLength)
+    {
+        if (pc >= length_)
+            return fail("Truncated operand.");
+
+        uint32_t bytes;
+        switch (part) {
+          case OpcodeFormat::I1:
+          case OpcodeFormat::U1:
+            bytes = 1;
+            break;
+
+          case OpcodeFormat::I2:
+          case OpcodeFormat::U2:
+            bytes = 2;
+            break;
+
+          case OpcodeFormat::I3:
+          case OpcodeFormat::U3:
+            bytes = 3;
+            break;
+
+          case OpcodeFormat::I4:
+          case OpcodeFormat::U4:
+            bytes = 4;
+            break;
+
+          case OpcodeFormat::V:
+            {
+                // Mirrors the value operand encoding in bytecode_ops.hpp.
+                uint8_t firstByte = data_[pc];
+                uint32_t idxBytes = firstByte & 0x3;
+                if (idxBytes == 0x3)
+                    idxBytes = (firstByte >> 2) & 0x3;
+                bytes = 1 + idxBytes;
+                break;
+            }
+
+          default:
+            return fail("Unsupported operand format.");
+        }
+
+        if (bytes > length_ - pc)
+            return fail("Truncated operand.");
+        *operandLength = bytes;
+        return true;
+    }
+
+    // The index of the op a jump op at |index| targets, or NoOp.
+    uint32_t jumpTarget(uint32_t index) const {
+        const DecodedOp &op = ops_[index];
+        int64_t target = int64_t(op.pcOffset) +
+                         op.operands[0].signedValue();
+        if (target < 0 || target > int64_t(length_))
+            return NoOp;
+        return opAtPc_[target];
+    }
+
+    bool checkJumpTargets() {
+        for (uint32_t i = 0; i < ops_.size(); i++) {
+            if (IsJumpOpcode(ops_[i].opcode) && jumpTarget(i) == NoOp)
+                return fail("Jump into the middle of an op.");
+        }
+        return true;
+    }
+
+    bool reach(uint32_t index, int32_t depth) {
+        if (depths_[index] == UnknownDepth) {
+            depths_[index] = depth;
+            if (index < ops_.size())
+                worklist_.push_back(index);
+            return true;
+        }
+        if (depths_[index] != depth)
+            return fail("Stack depth differs between paths to an op.");
+        return true;
+    }
+
+    // Apply the stack effect of |op|, which is not fused, to |depth|.
+    bool stepOp(const DecodedOp &op, int32_t *depth) {
+        int32_t popped = GetOpcodePopped(op.opcode);
+        int32_t pushed = GetOpcodePushed(op.opcode);
+        if (*depth < popped)
+            return fail("Stack underflow.");
+
+        // Stack operands are read after the op's pops.
+        for (uint8_t i = 0; i < op.numOperands; i++) {
+            const OperandLocation &loc = op.operands[i];
+            if (loc.isStack() &&
+                loc.stackIndex() >= ToUInt32(*depth - popped))
+            {
+                return fail("Stack operand out of range.");
+            }
+        }
+
+        if (op.opcode == Opcode::Stop && *depth != 0)
+            return fail("Stop with a non-empty stack.");
+
+        *depth += pushed - popped;
+        if (ToUInt32(*depth) > maxStackDepth_)
+            return fail("Stack overflow.");
+        return true;
+    }
+
+    bool checkStack() {
+        depths_.assign(ops_.size() + 1, UnknownDepth);
+        if (!reach(0, 0))
+            return false;
+
+        while (!worklist_.empty()) {
+            uint32_t index = worklist_.back();
+            worklist_.pop_back();
+
+            const DecodedOp &op = ops_[index];
+            int32_t depth = depths_[index];
+            if (IsFusedOpcode(op.opcode)) {
+                DecodedOp first, second;
+                SplitFusedOp(op, &first, &second);
+                if (!stepOp(first, &depth) || !stepOp(second, &depth))
+                    return false;
+            } else if (!stepOp(op, &depth)) {
+                return false;
+            }
+
+            if (IsJumpOpcode(op.opcode)) {
+                if (!reach(jumpTarget(index), depth))
+                    return false;
+                if (op.opcode == Opcode::Jump)
+                    continue;
+            }
+            if (!reach(index + 1, depth))
+                return false;
+        }
+        return true;
+    }
+};
+
+bool
+VerifyBytecode(const uint8_t *data, uint32_t length,
+               uint32_t numConstants, uint32_t numLocals,
+               uint32_t maxStackDepth,
+               std::vector<uint16_t> *stackMap, const char **error)
+{
+    try {
+        BytecodeVerifier verifier(data, length, numConstants, numLocals,
+                                  maxStackDepth);
+        if (!verifier.verify()) {
+            *error = verifier.error();
+            return false;
+        }
+        if (stackMap)
+            verifier.fillStackMap(stackMap);
+    } catch (std::bad_alloc &err) {
+        *error = "Out of memory verifying bytecode.";
+        return false;
+    }
+    return true;
+}
+
+
+} // namespace Interp
+} // namespace Whisper
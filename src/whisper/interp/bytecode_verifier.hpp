@@ -0,0 +1,55 @@
+#ifndef WHISPER__INTERP__BYTECODE_VERIFIER_HPP
+#define WHISPER__INTERP__BYTECODE_VERIFIER_HPP
+
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// Bytecode verifier
+//
+// Checks that bytecode can be run by the interpreter without checking
+// it again: every op decodes within the bytecode, has a known opcode
+// which the interpreter implements, and refers only to constants and
+// locals the script has.  Jumps must land on the start of an op, or at
+// the end of the bytecode.
+//
+// The stack depth is followed through every path from the first op,
+// using the PopPush columns of the opcode table (see bytecode_defn.hpp),
+// with fused ops checked as their two component ops.  No op may pop
+// more values than are on the stack, push past the script's maximum
+// stack depth, or read a stack operand below the values it pops.  Every
+// path reaching an op must reach it with the same depth, so that the
+// depth at each op is fixed.  Stop requires an empty stack.
+//
+// The depth at the start of each op is the script's stack map, kept by
+// its decoded bytecode (see VM::DecodedBytecode::stackDepthAt).  Ops
+// which cannot be reached have depth 0.  Scripts take no arguments, so
+// argument operands are rejected.
+//
+// Bytecode is verified when it is decoded, and bytecode cache files are
+// verified when they are opened, so that a corrupt or hostile file is
+// ignored rather than run.
+//
+
+// Verify the |length| bytes of bytecode at |data|, for a script with
+// |numConstants| constants and |numLocals| locals, and a stack of at
+// most |maxStackDepth| values.  Fills |stackMap|, if not null, with the
+// stack depth at the start of each op, in order.  Returns false and
+// sets |error| if the bytecode is invalid, or on OOM.
+bool VerifyBytecode(const uint8_t *data, uint32_t length,
+                    uint32_t numConstants, uint32_t numLocals,
+                    uint32_t maxStackDepth,
+                    std::vector<uint16_t> *stackMap, const char **error);
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__BYTECODE_VERIFIER_HPP
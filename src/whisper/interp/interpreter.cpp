@@ -1,179 +1,1016 @@
 
 #include <cmath>
+#include <algorithm>
 
 #include "common.hpp"
 #include "spew.hpp"
+#include "trace.hpp"
 #include "runtime.hpp"
 #include "runtime_inlines.hpp"
 #include "rooting_inlines.hpp"
 #include "vm/heap_thing_inlines.hpp"
+#include "vm/native_stack.hpp"
 #include "vm/stack_frame.hpp"
 #include "vm/bytecode.hpp"
+#include "vm/object.hpp"
+#include "vm/property_cache.hpp"
+#include "vm/type_feedback.hpp"
+#include "vm/global.hpp"
+#include "vm/native_function.hpp"
 #include "vm/arithmetic_ops.hpp"
+#include "vm/arithmetic_ops_inlines.hpp"
 #include "interp/interpreter.hpp"
+#include "interp/bytecode_verifier.hpp"
+#include "interp/op_pair_profiler.hpp"
+#include "interp/op_profiler.hpp"
+#include "interp/baseline_jit.hpp"
+#include "interp/optimizing_jit.hpp"
 
 namespace Whisper {
 namespace Interp {
 
+// Run the script of |frame|, the only frame on the stack, from its pc.
+static bool
+RunFrame(RunContext *cx, VM::NativeFrame *frame, const JitCode *code,
+         bool canSuspend, const MutHandle<VM::StackFrame *> &suspended)
+{
+    suspended.get() = nullptr;
+
+    bool result = false;
+    if (cx->enterScript(canSuspend)) {
+        Interpreter interp(cx, frame);
+        if (code) {
+            const DecodedOp *ops = frame->script()->decoded()->ops();
+            result = interp.interpretJit(code, interp.curOp() - ops);
+        } else {
+            result = interp.interpret();
+        }
+    } else if (!cx->suspending()) {
+        SpewInterpOpError("Script interrupted.");
+    }
+
+    bool suspending = cx->suspending();
+    cx->leaveScript();
+    if (!suspending)
+        return result;
+
+    VM::StackFrame *saved = VM::MaterializeFrame(cx->inHatchery(), frame);
+    if (!saved) {
+        SpewInterpOpError("Could not save suspended frame.");
+        return false;
+    }
+    suspended.get() = saved;
+    return true;
+}
+
+static bool
+InterpretScript(RunContext *cx, Handle<VM::Script *> script,
+                bool canSuspend,
+                const MutHandle<VM::StackFrame *> &suspended)
+{
+    TraceScope trace(TraceCategory::Interp, "interpret");
+    WH_ASSERT(script->isTopLevel());
+
+    // Ensure that no stack frames are currently pushed on the RunContext.
+    WH_ASSERT(!cx->nativeStack().hasFrames());
+
+    if (!DecodeScript(cx, script))
+        return false;
+
+    // Push a frame for this script on the native stack.
+    VM::NativeFrameHelper frameHelper(cx->nativeStack(), script, 0, 0);
+    if (!frameHelper.frame()) {
+        SpewInterpOpError("Could not push stack frame.");
+        return false;
+    }
+
+    return RunFrame(cx, frameHelper.frame(), MaybeCompileBaseline(cx, script),
+                    canSuspend, suspended);
+}
+
 bool
 InterpretScript(RunContext *cx, Handle<VM::Script *> script)
+{
+    Root<VM::StackFrame *> suspended(cx);
+    return InterpretScript(cx, script, false, &suspended);
+}
+
+bool
+InterpretScript(RunContext *cx, Handle<VM::Script *> script,
+                const MutHandle<VM::StackFrame *> &suspended)
+{
+    return InterpretScript(cx, script, true, suspended);
+}
+
+bool
+ResumeScript(RunContext *cx, Handle<VM::StackFrame *> frame,
+             const MutHandle<VM::StackFrame *> &suspended)
+{
+    TraceScope trace(TraceCategory::Interp, "resume");
+    WH_ASSERT(frame->isTopLevelFrame());
+    WH_ASSERT(!frame->hasCallerFrame());
+    WH_ASSERT(!cx->nativeStack().hasFrames());
+
+    Root<VM::Script *> script(cx, frame->script());
+    if (!DecodeScript(cx, script))
+        return false;
+
+    VM::NativeFrameHelper frameHelper(cx->nativeStack(), frame);
+    if (!frameHelper.frame()) {
+        SpewInterpOpError("Could not push stack frame.");
+        return false;
+    }
+
+    return RunFrame(cx, frameHelper.frame(), BaselineCodeForResume(cx, script),
+                    true, suspended);
+}
+
+
+//
+// PreparedScript
+//
+
+PreparedScript::PreparedScript(RunContext *cx)
+  : cx_(cx),
+    script_(cx),
+    inputName_(cx),
+    resultName_(cx),
+    inputCell_(cx),
+    resultCell_(cx)
+{}
+
+bool
+PreparedScript::prepare(Handle<VM::Script *> script, Handle<Value> inputName,
+                        Handle<Value> resultName)
 {
     WH_ASSERT(script->isTopLevel());
+    if (!DecodeScript(cx_, script))
+        return false;
 
-    // Ensure that no stack frames are currently pushed on the RunContext.
+    script_ = script;
+    inputName_ = inputName;
+    resultName_ = resultName;
+    return findCells();
+}
+
+bool
+PreparedScript::run(Handle<Value> input, MutHandle<Value> result)
+{
+    WH_ASSERT(script_.get());
+    WH_ASSERT(!cx_->nativeStack().hasFrames());
+
+    // The decoding may have been dropped since the script was prepared.
+    if (!DecodeScript(cx_, script_))
+        return false;
+    if (!setInput(input))
+        return false;
+
+    VM::NativeFrameHelper frameHelper(cx_->nativeStack(), script_, 0, 0);
+    if (!frameHelper.frame()) {
+        SpewInterpOpError("Could not push stack frame.");
+        return false;
+    }
+
+    Root<VM::StackFrame *> suspended(cx_);
+    if (!RunFrame(cx_, frameHelper.frame(),
+                  MaybeCompileBaseline(cx_, script_), false, &suspended))
+    {
+        return false;
+    }
+
+    if (!findCells())
+        return false;
+    result = resultCell_->value();
+    return true;
+}
+
+bool
+PreparedScript::runBatch(const VectorRoot<Value> &inputs,
+                         VectorRoot<Value> &results)
+{
+    WH_ASSERT(script_.get());
+    WH_ASSERT(!cx_->nativeStack().hasFrames());
+
+    if (inputs.size() == 0)
+        return true;
+    if (!DecodeScript(cx_, script_))
+        return false;
+
+    VM::NativeFrameHelper frameHelper(cx_->nativeStack(), script_, 0, 0);
+    if (!frameHelper.frame()) {
+        SpewInterpOpError("Could not push stack frame.");
+        return false;
+    }
+
+    bool ok = cx_->enterScript(false);
+    if (!ok)
+        SpewInterpOpError("Script interrupted.");
+
+    if (ok) {
+        Interpreter interp(cx_, frameHelper.frame());
+        for (uint32_t i = 0; i < inputs.size(); i++) {
+            // Each later run is an interrupt check, like an entry.
+            if (i > 0) {
+                interp.restart();
+                if (!cx_->checkInterrupt()) {
+                    SpewInterpOpError("Script interrupted.");
+                    ok = false;
+                    break;
+                }
+            }
+
+            if (!setInput(inputs.ref(i))) {
+                ok = false;
+                break;
+            }
+
+            const JitCode *code = MaybeCompileBaseline(cx_, script_);
+            ok = code ? interp.interpretJit(code) : interp.interpret();
+            if (!ok || !findCells()) {
+                ok = false;
+                break;
+            }
+            results.append(resultCell_->value());
+        }
+    }
+
+    cx_->leaveScript();
+    return ok;
+}
+
+// Find the cells of the input and result globals, defining them if
+// there are none.  Cells which are still in use are kept.
+bool
+PreparedScript::findCells()
+{
+    if (inputCell_.get() && !inputCell_->isDeleted() &&
+        resultCell_.get() && !resultCell_->isDeleted())
+    {
+        return true;
+    }
+
+    VM::Global *global = cx_->threadContext()->global();
+    if (!global)
+        return false;
+
+    Root<Value> undef(cx_, Value::Undefined());
+    inputCell_ = global->lookupCell(cx_, inputName_);
+    if (!inputCell_.get() &&
+        !global->defineGlobal(cx_, inputName_, undef, &inputCell_))
+    {
+        return false;
+    }
+
+    resultCell_ = global->lookupCell(cx_, resultName_);
+    if (!resultCell_.get() &&
+        !global->defineGlobal(cx_, resultName_, undef, &resultCell_))
+    {
+        return false;
+    }
+    return true;
+}
+
+bool
+PreparedScript::setInput(const Value &input)
+{
+    if (!findCells())
+        return false;
+    inputCell_->setValue(input);
+    return true;
+}
+
+uint32_t
+CountBytecodeOps(const VM::Bytecode *bytecode)
+{
+    uint32_t numOps = 0;
+    const uint8_t *data = bytecode->data();
+    const uint8_t *end = bytecode->dataEnd();
+    for (const uint8_t *pc = data; pc < end; numOps++) {
+        DecodedOp scratch;
+        pc += DecodeOp(pc, end, pc - data, &scratch);
+    }
+    return numOps;
+}
+
+// Rebase the operands of the jump ops in |ops| from offsets in the
+// bytecode to offsets in the ops.
+static void
+ResolveJumpTargets(DecodedOp *ops, DecodedOp *opsEnd)
+{
+    for (DecodedOp *op = ops; op < opsEnd; op++) {
+        if (!IsJumpOpcode(op->opcode))
+            continue;
+
+        uint32_t targetPc = op->pcOffset + op->operands[0].signedValue();
+        DecodedOp *target = std::lower_bound(
+            ops, opsEnd, targetPc,
+            [](const DecodedOp &dop, uint32_t offset) {
+                return dop.pcOffset < offset;
+            });
+        WH_ASSERT(target == opsEnd || target->pcOffset == targetPc);
+        op->operands[0] = OperandLocation::Immediate(ToInt32(target - op));
+    }
+}
+
+void
+DecodeBytecodeOps(const VM::Bytecode *bytecode,
+                  const std::vector<uint16_t> &stackMap,
+                  VM::DecodedBytecode *decoded)
+{
+    WH_ASSERT(stackMap.size() == decoded->numOps());
+    const uint8_t *data = bytecode->data();
+    const uint8_t *end = bytecode->dataEnd();
+    DecodedOp *ops = decoded->writableOps();
+    DecodedOp *op = ops;
+    for (const uint8_t *pc = data; pc < end; op++)
+        pc += DecodeOp(pc, end, pc - data, op);
+    ResolveJumpTargets(ops, op);
+
+    std::copy(stackMap.begin(), stackMap.end(),
+              decoded->writableStackDepths());
+}
+
+// Create the inline caches of the property ops of |decoded|, the
+// decoded bytecode of |script|, and its type feedback, and then give
+// the script all of them.
+static bool
+SetDecodedBytecode(RunContext *cx, Handle<VM::Script *> script,
+                   VM::DecodedBytecode *decoded)
+{
+    Root<VM::DecodedBytecode *> decodedRoot(cx, decoded);
+
+    uint32_t numCaches = 0;
+    bool recordsFeedback = false;
+    for (const DecodedOp *op = decoded->ops(); op < decoded->opsEnd();
+         op++)
+    {
+        if (VM::TypeFeedback::IsRecordingOpcode(op->opcode))
+            recordsFeedback = true;
+
+        int32_t cacheIndex;
+        if (op->opcode == Opcode::GetProp || op->opcode == Opcode::SetProp ||
+            op->opcode == Opcode::GetGlobal || op->opcode == Opcode::SetGlobal)
+        {
+            cacheIndex = op->operands[1].signedValue();
+        }
+        else if (op->opcode == Opcode::NewObject ||
+                 op->opcode == Opcode::LoopHead)
+        {
+            cacheIndex = op->operands[0].signedValue();
+        }
+        else
+            continue;
+        if (cacheIndex >= 0 && ToUInt32(cacheIndex) >= numCaches)
+            numCaches = ToUInt32(cacheIndex) + 1;
+    }
 
-    // Create a new stack frame for this script.
-    VM::StackFrame::Config config;
-    config.numPassedArgs = 0;
-    config.numArgs = 0;
-    config.numLocals = 0;
-    config.maxStackDepth = script->maxStackDepth();
+    if (numCaches > 0 && !script->hasPropertyCaches()) {
+        VM::Tuple *caches = nullptr;
+        if (!cx->inHatchery(AllocSite::PropertyCache).createTuple(
+                numCaches * VM::PropertyCache::CacheSize, caches))
+        {
+            return false;
+        }
+        script->setPropertyCaches(caches);
+    }
 
-    uint32_t size = VM::StackFrame::CalculateSize(config);
-    Root<VM::StackFrame *> stackFrame(cx,
-        cx->inHatchery().createSized<VM::StackFrame>(size, script, config));
-    if (!stackFrame)
+    if (recordsFeedback && !script->hasTypeFeedback()) {
+        VM::TypeFeedback *feedback =
+            cx->inHatchery(AllocSite::TypeFeedback)
+                .createSized<VM::TypeFeedback>(script->bytecode()->length());
+        if (!feedback)
+            return false;
+        script->setTypeFeedback(feedback);
+    }
+
+    script->setDecoded(decodedRoot);
+    return true;
+}
+
+bool
+DecodeScript(RunContext *cx, Handle<VM::Script *> script)
+{
+    if (script->hasDecoded())
+        return true;
+
+    TraceScope trace(TraceCategory::Interp, "decode");
+    Root<VM::Bytecode *> bytecode(cx, script->bytecode());
+
+    // Bytecode is only decoded once it has been verified.
+    std::vector<uint16_t> stackMap;
+    const char *error = nullptr;
+    uint32_t numConstants = script->constants() ? script->constants()->size()
+                                                : 0;
+    if (!VerifyBytecode(bytecode->data(), bytecode->length(), numConstants,
+                        script->numLocals(), script->maxStackDepth(),
+                        &stackMap, &error))
+    {
+        SpewBytecodeError("Script %p failed verification: %s",
+                          script.get(), error);
         return false;
+    }
+    uint32_t numOps = stackMap.size();
+    WH_ASSERT(numOps > 0);
 
-    // Register the stack frame with the runtime.
-    cx->registerTopStackFrame(stackFrame);
+    AllocationContext acx = cx->inHatchery(AllocSite::DecodedBytecode);
+    VM::DecodedBytecode *decoded = acx.createSized<VM::DecodedBytecode>(
+        VM::DecodedBytecode::CalculateSize(numOps));
+    if (!decoded)
+        return false;
 
-    Interpreter interp(cx, stackFrame);
-    return interp.interpret();
+    // Allocation does not move the bytecode.
+    DecodeBytecodeOps(bytecode, stackMap, decoded);
+    return SetDecodedBytecode(cx, script, decoded);
 }
 
-Interpreter::Interpreter(RunContext *cx, Handle<VM::StackFrame *> frame)
+bool
+AttachDecodedBytecode(RunContext *cx, Handle<VM::Script *> script,
+                      VM::DecodedBytecode *decoded)
+{
+    WH_ASSERT(!script->hasDecoded());
+    return SetDecodedBytecode(cx, script, decoded);
+}
+
+Interpreter::Interpreter(RunContext *cx, VM::NativeFrame *frame)
   : cx_(cx),
-    frame_(cx, frame),
+    frame_(frame),
     script_(cx, frame_->script()),
-    bytecode_(cx_, script_->bytecode()),
-    pc_(bytecode_->dataAt(frame_->pcOffset())),
-    pcEnd_(bytecode_->dataEnd())
-{}
+    decoded_(cx_, script_->decoded()),
+    curOp_(decoded_->opAt(frame_->pcOffset())),
+    endOp_(decoded_->opsEnd()),
+    callerInterp_(cx_->interpreter()),
+    jitCode_(nullptr),
+    jitResumeOp_(NoJitResume)
+{
+    cx_->setInterpreter(this);
+}
+
+Interpreter::~Interpreter()
+{
+    WH_ASSERT(cx_->interpreter() == this);
+    cx_->setInterpreter(callerInterp_);
+}
+
+void
+Interpreter::restart()
+{
+    frame_->reset();
+    curOp_ = decoded_->ops();
+    endOp_ = decoded_->opsEnd();
+}
+
+// With GCC and Clang, ops are dispatched with computed gotos through a
+// table of handler labels generated from WHISPER_BYTECODE_OPS, and
+// the dispatch sequence is replicated at the end of every handler so
+// that each handler's indirect branch is predicted separately.  Other
+// compilers, or builds defining WHISPER_INTERP_SWITCH_DISPATCH, fall
+// back to a switch.
+#if defined(__GNUC__) && !defined(WHISPER_INTERP_SWITCH_DISPATCH)
+# define WHISPER_INTERP_COMPUTED_GOTO
+#endif
+
+template <Opcode Op>
+inline bool
+Interpreter::interpretComponent(const DecodedOp &dop)
+{
+    // |Op| is a constant, so this switch folds away.
+    switch (Op) {
+      case Opcode::Nop:
+        return true;
+
+      case Opcode::Pop:
+        WH_ASSERT(frame_->stackDepth() > 0);
+        frame_->popStack();
+        return true;
+
+      case Opcode::Stop:
+        return interpretStop(dop);
+
+      case Opcode::PushInt8:
+      case Opcode::PushInt16:
+      case Opcode::PushInt24:
+      case Opcode::PushInt32:
+        return interpretPushInt(dop);
+
+      case Opcode::Push:
+        return interpretPush(dop);
+
+      case Opcode::Add_SSS: case Opcode::Add_SSV:
+      case Opcode::Add_SVS: case Opcode::Add_SVV:
+      case Opcode::Add_VSS: case Opcode::Add_VSV:
+      case Opcode::Add_VVS: case Opcode::Add_VVV:
+        return interpretAdd(dop);
+
+      case Opcode::Sub_SSS: case Opcode::Sub_SSV:
+      case Opcode::Sub_SVS: case Opcode::Sub_SVV:
+      case Opcode::Sub_VSS: case Opcode::Sub_VSV:
+      case Opcode::Sub_VVS: case Opcode::Sub_VVV:
+        return interpretSub(dop);
+
+      case Opcode::Mul_SSS: case Opcode::Mul_SSV:
+      case Opcode::Mul_SVS: case Opcode::Mul_SVV:
+      case Opcode::Mul_VSS: case Opcode::Mul_VSV:
+      case Opcode::Mul_VVS: case Opcode::Mul_VVV:
+        return interpretMul(dop);
+
+      case Opcode::Div_SSS: case Opcode::Div_SSV:
+      case Opcode::Div_SVS: case Opcode::Div_SVV:
+      case Opcode::Div_VSS: case Opcode::Div_VSV:
+      case Opcode::Div_VVS: case Opcode::Div_VVV:
+        return interpretDiv(dop);
+
+      case Opcode::Mod_SSS: case Opcode::Mod_SSV:
+      case Opcode::Mod_SVS: case Opcode::Mod_SVV:
+      case Opcode::Mod_VSS: case Opcode::Mod_VSV:
+      case Opcode::Mod_VVS: case Opcode::Mod_VVV:
+        return interpretMod(dop);
+
+      case Opcode::Neg_SS: case Opcode::Neg_SV:
+      case Opcode::Neg_VS: case Opcode::Neg_VV:
+        return interpretNeg(dop);
+
+      case Opcode::NewObject:
+        return interpretNewObject(dop);
+
+      case Opcode::InitProp:
+        return interpretInitProp(dop);
+
+      case Opcode::GetProp:
+        return interpretGetProp(dop);
+
+      case Opcode::SetProp:
+        return interpretSetProp(dop);
+
+      case Opcode::GetGlobal:
+        return interpretGetGlobal(dop);
+
+      case Opcode::SetGlobal:
+        return interpretSetGlobal(dop);
+
+      case Opcode::CallNative0: case Opcode::CallNative1:
+      case Opcode::CallNative2: case Opcode::CallNative3:
+        return interpretCallNative(dop);
+
+      case Opcode::LoopHead:
+        {
+            uint32_t iterations;
+            return interpretLoopHead(dop, &iterations);
+        }
+
+      default:
+        break;
+    }
+    WH_UNREACHABLE("Unhandled fused op component.");
+    return false;
+}
+
+template <Opcode First, Opcode Second>
+inline bool
+Interpreter::interpretFused(const DecodedOp &dop)
+{
+    DecodedOp first;
+    DecodedOp second;
+    SplitFusedOp(dop, &first, &second);
+    WH_ASSERT(first.opcode == First && second.opcode == Second);
+
+    // No safepoint is taken between the two component ops.
+    return interpretComponent<First>(first) &&
+           interpretComponent<Second>(second);
+}
+
+template <Opcode Op>
+/*static*/ bool
+Interpreter::JitStep(Interpreter *interp, const DecodedOp *dop)
+{
+    interp->curOp_ = dop;
+    if (!interp->interpretComponent<Op>(*dop))
+        return false;
+
+    // Compiled code holds no values outside the frame and roots, and its
+    // copy of the ops does not move.
+    ThreadContext *thrcx = interp->cx_->threadContext();
+    if (thrcx->needsGC())
+        return thrcx->performGC();
+    return true;
+}
+
+template <Opcode First, Opcode Second>
+/*static*/ bool
+Interpreter::JitFusedStep(Interpreter *interp, const DecodedOp *dop)
+{
+    interp->curOp_ = dop;
+    if (!interp->interpretFused<First, Second>(*dop))
+        return false;
+
+    ThreadContext *thrcx = interp->cx_->threadContext();
+    if (thrcx->needsGC())
+        return thrcx->performGC();
+    return true;
+}
+
+/*static*/ uint8_t
+Interpreter::JitBranch(Interpreter *interp, const DecodedOp *dop)
+{
+    interp->curOp_ = dop;
+    bool taken = interp->interpretCondition(*dop);
+
+    ThreadContext *thrcx = interp->cx_->threadContext();
+    if (thrcx->needsGC() && !thrcx->performGC())
+        return JitBranchFailed;
+    return taken ? JitBranchTaken : JitBranchNotTaken;
+}
+
+/*static*/ bool
+Interpreter::JitLoopHead(Interpreter *interp, const DecodedOp *dop)
+{
+    interp->curOp_ = dop;
+    uint32_t iterations;
+    if (!interp->interpretLoopHead(*dop, &iterations))
+        return false;
+
+    RunContext *cx = interp->cx_;
+    ThreadContext *thrcx = cx->threadContext();
+    if (thrcx->needsGC() && !thrcx->performGC())
+        return false;
+
+    const JitCode *code = interp->jitCode_;
+    OptCode *optCode = MaybeOptimizeForLoop(cx, interp->script_, code,
+                                            iterations);
+    uint32_t loopHead = dop - code->ops();
+    if (!optCode || !optCode->hasEntry(loopHead))
+        return true;
+
+    // Leave the baseline code, to go on from where the optimized code
+    // exits (see interpretJit).
+    uint32_t resumeOp;
+    if (!optCode->run(cx, interp, loopHead, &resumeOp))
+        return false;
+    interp->jitResumeOp_ = resumeOp;
+    return false;
+}
+
+/*static*/ Interpreter::JitBranchFn
+Interpreter::GetJitBranch(Opcode op)
+{
+    WH_ASSERT(op == Opcode::JumpIfFalse || op == Opcode::JumpIfTrue);
+    return &Interpreter::JitBranch;
+}
+
+/*static*/ Interpreter::JitStepFn
+Interpreter::GetJitStep(Opcode op)
+{
+    static const JitStepFn Steps[] = {
+        &Interpreter::JitStep<Opcode::INVALID>,
+#define STEP_(name, ...) &Interpreter::JitStep<Opcode::name>,
+        WHISPER_BYTECODE_OPS(STEP_)
+#undef STEP_
+#define FUSED_STEP_(name, first, second, format) \
+        &Interpreter::JitFusedStep<Opcode::first, Opcode::second>,
+        WHISPER_BYTECODE_FUSED_OPS(FUSED_STEP_)
+#undef FUSED_STEP_
+    };
+    static_assert(sizeof(Steps) / sizeof(Steps[0]) ==
+                    static_cast<unsigned>(Opcode::LIMIT),
+                  "Step table must have an entry for every op.");
+
+    WH_ASSERT(static_cast<unsigned>(op) <
+              static_cast<unsigned>(Opcode::LIMIT));
+    if (op == Opcode::LoopHead)
+        return &Interpreter::JitLoopHead;
+    return Steps[static_cast<unsigned>(op)];
+}
+
+bool
+Interpreter::interpretJit(const JitCode *code, uint32_t opIndex)
+{
+    WH_ASSERT(opIndex <= code->numOps());
+
+    ThreadContext *thrcx = cx_->threadContext();
+    jitCode_ = code;
+    for (;;) {
+        if (thrcx->needsGC() && !thrcx->performGC())
+            return false;
+
+        if (code->run(this, opIndex))
+            return true;
+
+        // The code also returns when a loop has been run in optimized
+        // code, to go on from where that exited.
+        if (jitResumeOp_ == NoJitResume)
+            return false;
+        opIndex = jitResumeOp_;
+        jitResumeOp_ = NoJitResume;
+    }
+}
 
 bool
 Interpreter::interpret()
 {
-    int32_t opBytes = 0;
+    ThreadContext *thrcx = cx_->threadContext();
+
+    // The current op is kept in a local, and stored to |curOp_| before
+    // each op.
+    const DecodedOp *dop = curOp_;
+
+    // Op pair profiler, if running.
+    OpPairProfiler *pairProfiler = thrcx->opPairProfiler();
+    if (pairProfiler)
+        pairProfiler->noteBoundary();
+
+    // Op profiler, if running.
+    OpProfiler *opProfiler = thrcx->opProfiler();
+    if (opProfiler)
+        opProfiler->enterScript(script_);
+
+#if defined(WHISPER_INTERP_COMPUTED_GOTO)
+
+    static void *const DispatchTable[] = {
+        &&Op_INVALID,
+#define OP_LABEL_(name, ...) &&Op_##name,
+        WHISPER_BYTECODE_OPS(OP_LABEL_)
+        WHISPER_BYTECODE_FUSED_OPS(OP_LABEL_)
+#undef OP_LABEL_
+    };
+    static_assert(sizeof(DispatchTable) / sizeof(DispatchTable[0]) ==
+                    static_cast<unsigned>(Opcode::LIMIT),
+                  "Dispatch table must have an entry for every op.");
+
+    // Op boundaries are GC safepoints: all live values are held
+    // in the frame or in roots.
+# define INTERP_CASE(name) Op_##name:
+# define INTERP_FETCH()                                             \
+    do {                                                            \
+        if (dop == endOp_)                                          \
+            return true;                                            \
+        SpewInterpOpNote("Op %s", OpcodeString(dop->opcode));       \
+        curOp_ = dop;                                               \
+        if (pairProfiler)                                           \
+            pairProfiler->noteOp(dop->opcode);                      \
+        if (opProfiler)                                             \
+            opProfiler->noteOp(dop->opcode, dop - decoded_->ops()); \
+        WH_ASSERT(static_cast<unsigned>(dop->opcode) <              \
+                  static_cast<unsigned>(Opcode::LIMIT));            \
+        goto *DispatchTable[static_cast<unsigned>(dop->opcode)];    \
+    } while (false)
+# define INTERP_DISPATCH()                                          \
+    do {                                                            \
+        dop++;                                                      \
+        if (thrcx->needsGC())                                       \
+            goto Safepoint;                                         \
+        INTERP_FETCH();                                             \
+    } while (false)
+# define INTERP_JUMP(target)                                        \
+    do {                                                            \
+        dop = (target);                                             \
+        if (thrcx->needsGC())                                       \
+            goto Safepoint;                                         \
+        INTERP_FETCH();                                             \
+    } while (false)
+
+    if (thrcx->needsGC())
+        goto Safepoint;
+    INTERP_FETCH();
+
+#else // !defined(WHISPER_INTERP_COMPUTED_GOTO)
+
+# define INTERP_CASE(name) case Opcode::name:
+# define INTERP_DISPATCH() { dop++; break; }
+# define INTERP_JUMP(target) { dop = (target); break; }
 
     for (;;) {
-        // Move to next op.
-        pc_ += opBytes;
-        WH_ASSERT(pc_ >= bytecode_->data());
+        // Op boundaries are GC safepoints: all live values are held
+        // in the frame or in roots.  The decoded ops may move, so the
+        // current op is rebased afterward.
+        if (thrcx->needsGC()) {
+            uint32_t opIndex = dop - decoded_->ops();
+            if (!thrcx->performGC())
+                return false;
+            dop = decoded_->ops() + opIndex;
+            endOp_ = decoded_->opsEnd();
+        }
 
         // If natural end of interpretation reached, stop.
-        if (pc_ == pcEnd_)
+        if (dop == endOp_)
             return true;
 
-        Opcode op;
-        opBytes = Interp::ReadOpcode(pc_, pcEnd_, &op);
-        SpewInterpOpNote("Op %s", OpcodeString(op));
+        SpewInterpOpNote("Op %s", OpcodeString(dop->opcode));
+        curOp_ = dop;
+        if (pairProfiler)
+            pairProfiler->noteOp(dop->opcode);
+        if (opProfiler)
+            opProfiler->noteOp(dop->opcode, dop - decoded_->ops());
+
+        switch (dop->opcode) {
+#endif // defined(WHISPER_INTERP_COMPUTED_GOTO)
 
-        switch (op) {
-          case Opcode::Nop:
-            break;
+          INTERP_CASE(Nop)
+            INTERP_DISPATCH();
 
-          case Opcode::Pop:
+          INTERP_CASE(Pop)
             WH_ASSERT(frame_->stackDepth() > 0);
             frame_->popStack();
-            break;
+            INTERP_DISPATCH();
 
-          case Opcode::Stop:
-            if (!interpretStop(op, &opBytes))
+          INTERP_CASE(Stop)
+            if (!interpretStop(*dop))
                 return false;
-            break;
+            INTERP_DISPATCH();
 
-          case Opcode::PushInt8:
-          case Opcode::PushInt16:
-          case Opcode::PushInt24:
-          case Opcode::PushInt32:
-            if (!interpretPushInt(op, &opBytes))
+          INTERP_CASE(PushInt8)
+          INTERP_CASE(PushInt16)
+          INTERP_CASE(PushInt24)
+          INTERP_CASE(PushInt32)
+            if (!interpretPushInt(*dop))
                 return false;
-            break;
+            INTERP_DISPATCH();
 
-          case Opcode::Ret_S:
+          INTERP_CASE(Push)
+            if (!interpretPush(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Ret_S)
             // TODO: implement
             WH_UNREACHABLE("Unhandled op Ret_S.");
-            break;
+            return false;
 
-          case Opcode::Ret_V:
+          INTERP_CASE(Ret_V)
             // TODO: implement
             WH_UNREACHABLE("Unhandled op Ret_V.");
-            break;
-
-          case Opcode::Add_SSS: // E
-          case Opcode::Add_SSV: // V
-          case Opcode::Add_SVS: // V
-          case Opcode::Add_SVV: // VV
-          case Opcode::Add_VSS: // V
-          case Opcode::Add_VSV: // VV
-          case Opcode::Add_VVS: // VV
-          case Opcode::Add_VVV: // VVV
-            if (!interpretAdd(op, &opBytes))
+            return false;
+
+          INTERP_CASE(Add_SSS) // E
+          INTERP_CASE(Add_SSV) // V
+          INTERP_CASE(Add_SVS) // V
+          INTERP_CASE(Add_SVV) // VV
+          INTERP_CASE(Add_VSS) // V
+          INTERP_CASE(Add_VSV) // VV
+          INTERP_CASE(Add_VVS) // VV
+          INTERP_CASE(Add_VVV) // VVV
+            if (!interpretAdd(*dop))
                 return false;
-            break;
-
-          case Opcode::Sub_SSS: // E
-          case Opcode::Sub_SSV: // V
-          case Opcode::Sub_SVS: // V
-          case Opcode::Sub_SVV: // VV
-          case Opcode::Sub_VSS: // V
-          case Opcode::Sub_VSV: // VV
-          case Opcode::Sub_VVS: // VV
-          case Opcode::Sub_VVV: // VVV
-            if (!interpretSub(op, &opBytes))
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Sub_SSS) // E
+          INTERP_CASE(Sub_SSV) // V
+          INTERP_CASE(Sub_SVS) // V
+          INTERP_CASE(Sub_SVV) // VV
+          INTERP_CASE(Sub_VSS) // V
+          INTERP_CASE(Sub_VSV) // VV
+          INTERP_CASE(Sub_VVS) // VV
+          INTERP_CASE(Sub_VVV) // VVV
+            if (!interpretSub(*dop))
                 return false;
-            break;
-
-          case Opcode::Mul_SSS: // E
-          case Opcode::Mul_SSV: // V
-          case Opcode::Mul_SVS: // V
-          case Opcode::Mul_SVV: // VV
-          case Opcode::Mul_VSS: // V
-          case Opcode::Mul_VSV: // VV
-          case Opcode::Mul_VVS: // VV
-          case Opcode::Mul_VVV: // VVV
-            if (!interpretMul(op, &opBytes))
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Mul_SSS) // E
+          INTERP_CASE(Mul_SSV) // V
+          INTERP_CASE(Mul_SVS) // V
+          INTERP_CASE(Mul_SVV) // VV
+          INTERP_CASE(Mul_VSS) // V
+          INTERP_CASE(Mul_VSV) // VV
+          INTERP_CASE(Mul_VVS) // VV
+          INTERP_CASE(Mul_VVV) // VVV
+            if (!interpretMul(*dop))
                 return false;
-            break;
-
-          case Opcode::Div_SSS: // E
-          case Opcode::Div_SSV: // V
-          case Opcode::Div_SVS: // V
-          case Opcode::Div_SVV: // VV
-          case Opcode::Div_VSS: // V
-          case Opcode::Div_VSV: // VV
-          case Opcode::Div_VVS: // VV
-          case Opcode::Div_VVV: // VVV
-            if (!interpretDiv(op, &opBytes))
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Div_SSS) // E
+          INTERP_CASE(Div_SSV) // V
+          INTERP_CASE(Div_SVS) // V
+          INTERP_CASE(Div_SVV) // VV
+          INTERP_CASE(Div_VSS) // V
+          INTERP_CASE(Div_VSV) // VV
+          INTERP_CASE(Div_VVS) // VV
+          INTERP_CASE(Div_VVV) // VVV
+            if (!interpretDiv(*dop))
                 return false;
-            break;
-
-          case Opcode::Mod_SSS: // E
-          case Opcode::Mod_SSV: // V
-          case Opcode::Mod_SVS: // V
-          case Opcode::Mod_SVV: // VV
-          case Opcode::Mod_VSS: // V
-          case Opcode::Mod_VSV: // VV
-          case Opcode::Mod_VVS: // VV
-          case Opcode::Mod_VVV: // VVV
-            if (!interpretMod(op, &opBytes))
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Mod_SSS) // E
+          INTERP_CASE(Mod_SSV) // V
+          INTERP_CASE(Mod_SVS) // V
+          INTERP_CASE(Mod_SVV) // VV
+          INTERP_CASE(Mod_VSS) // V
+          INTERP_CASE(Mod_VSV) // VV
+          INTERP_CASE(Mod_VVS) // VV
+          INTERP_CASE(Mod_VVV) // VVV
+            if (!interpretMod(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Neg_SS) // E
+          INTERP_CASE(Neg_SV) // V
+          INTERP_CASE(Neg_VS) // V
+          INTERP_CASE(Neg_VV) // VV
+            if (!interpretNeg(*dop))
                 return false;
-            break;
+            INTERP_DISPATCH();
 
-          case Opcode::Neg_SS: // E
-          case Opcode::Neg_SV: // V
-          case Opcode::Neg_VS: // V
-          case Opcode::Neg_VV: // VV
-            if (!interpretNeg(op, &opBytes))
+          INTERP_CASE(NewObject)
+            if (!interpretNewObject(*dop))
                 return false;
-            break;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(InitProp)
+            if (!interpretInitProp(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(GetProp)
+            if (!interpretGetProp(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(SetProp)
+            if (!interpretSetProp(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(GetGlobal)
+            if (!interpretGetGlobal(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(SetGlobal)
+            if (!interpretSetGlobal(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(CallNative0)
+          INTERP_CASE(CallNative1)
+          INTERP_CASE(CallNative2)
+          INTERP_CASE(CallNative3)
+            if (!interpretCallNative(*dop))
+                return false;
+            INTERP_DISPATCH();
+
+          INTERP_CASE(Jump)
+            INTERP_JUMP(dop + dop->operands[0].signedValue());
+
+          INTERP_CASE(JumpIfFalse)
+          INTERP_CASE(JumpIfTrue)
+            if (interpretCondition(*dop))
+                INTERP_JUMP(dop + dop->operands[0].signedValue());
+            INTERP_DISPATCH();
+
+          INTERP_CASE(LoopHead)
+            {
+                uint32_t iterations;
+                if (!interpretLoopHead(*dop, &iterations))
+                    return false;
+
+                // Hot loops go on in the script's compiled code, from
+                // the op after the header.
+                if (const JitCode *code =
+                        MaybeCompileBaselineForLoop(cx_, script_, iterations))
+                {
+                    return interpretJit(code, dop + 1 - decoded_->ops());
+                }
+            }
+            INTERP_DISPATCH();
+
+#define FUSED_CASE_(name, first, second, format)                    \
+          INTERP_CASE(name)                                         \
+            if (!interpretFused<Opcode::first, Opcode::second>(*dop)) \
+                return false;                                       \
+            INTERP_DISPATCH();
+          WHISPER_BYTECODE_FUSED_OPS(FUSED_CASE_)
+#undef FUSED_CASE_
+
+          INTERP_CASE(INVALID)
+          INTERP_CASE(Section1)
+            WH_UNREACHABLE("Unhandled op.");
+            return false;
+
+#if defined(WHISPER_INTERP_COMPUTED_GOTO)
+
+  Safepoint:
+    // The decoded ops may move, so the current op is rebased afterward.
+    {
+        uint32_t opIndex = dop - decoded_->ops();
+        if (!thrcx->performGC())
+            return false;
+        dop = decoded_->ops() + opIndex;
+        endOp_ = decoded_->opsEnd();
+    }
+    INTERP_FETCH();
+
+#else // !defined(WHISPER_INTERP_COMPUTED_GOTO)
 
           default:
             WH_UNREACHABLE("Unhandled op.");
+            return false;
         }
     }
 
+#endif // defined(WHISPER_INTERP_COMPUTED_GOTO)
+
+#undef INTERP_CASE
+#undef INTERP_FETCH
+#undef INTERP_DISPATCH
+#undef INTERP_JUMP
+
     return false;
 }
 
@@ -184,7 +1021,7 @@ Interpreter::readOperand(const OperandLocation &loc)
     switch (loc.space()) {
       case OperandSpace::Constant:
         WH_ASSERT(script_->constants());
-        return script_->constants()->get(0);
+        return script_->constants()->get(loc.constantIndex());
 
       case OperandSpace::Argument:
         return frame_->getArg(loc.argumentIndex());
@@ -250,7 +1087,7 @@ Interpreter::writeOperand(const OperandLocation &loc, const Value &val)
 
 
 bool
-Interpreter::interpretStop(Opcode op, int32_t *opBytes)
+Interpreter::interpretStop(const DecodedOp &)
 {
     WH_ASSERT(frame_->stackDepth() == 0);
     VM::Script::Mode mode = script_->mode();
@@ -265,34 +1102,13 @@ Interpreter::interpretStop(Opcode op, int32_t *opBytes)
 
 
 bool
-Interpreter::interpretPushInt(Opcode op, int32_t *opBytes)
+Interpreter::interpretPushInt(const DecodedOp &dop)
 {
-    OpcodeFormat fmt = OpcodeFormat::E;
-    switch (op) {
-      case Opcode::PushInt8:
-        fmt = OpcodeFormat::I1;
-        break;
-
-      case Opcode::PushInt16:
-        fmt = OpcodeFormat::I2;
-        break;
-
-      case Opcode::PushInt24:
-        fmt = OpcodeFormat::I3;
-        break;
-
-      case Opcode::PushInt32:
-        fmt = OpcodeFormat::I4;
-        break;
+    WH_ASSERT(dop.opcode >= Opcode::PushInt8 &&
+              dop.opcode <= Opcode::PushInt32);
+    WH_ASSERT(dop.numOperands == 1);
 
-      default:
-        WH_UNREACHABLE("Invalid op.");
-    }
-
-    WH_ASSERT(GetOpcodeFormat(op) == fmt);
-
-    OperandLocation oploc;
-    *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, fmt, 0, &oploc);
+    const OperandLocation &oploc = dop.operands[0];
     WH_ASSERT(oploc.isImmediate() && oploc.isSigned());
 
     frame_->pushStack(Value::Int32(oploc.signedValue()));
@@ -300,18 +1116,43 @@ Interpreter::interpretPushInt(Opcode op, int32_t *opBytes)
     return true;
 }
 
-
 bool
-Interpreter::interpretAdd(Opcode op, int32_t *opBytes)
+Interpreter::interpretPush(const DecodedOp &dop)
 {
-    Root<Value> lhs(cx_, Value::Undefined());
-    Root<Value> rhs(cx_, Value::Undefined());
-    OperandLocation outLoc;
+    WH_ASSERT(dop.opcode == Opcode::Push);
+    WH_ASSERT(dop.numOperands == 1);
 
-    readBinaryOperandValues(op, Opcode::Add_SSS, &lhs, &rhs, &outLoc, opBytes);
+    frame_->pushStack(readOperand(dop.operands[0]));
+    return true;
+}
 
+
+template <VM::FastBinaryOp Fast, VM::SlowBinaryOp Slow>
+inline bool
+Interpreter::interpretBinaryArith(const DecodedOp &dop, Opcode baseOp)
+{
+    OperandLocation lhsLoc;
+    OperandLocation rhsLoc;
+    OperandLocation outLoc;
+    ReadBinaryOperandLocations(dop, baseOp, &lhsLoc, &rhsLoc, &outLoc);
+
+    // Read the rhs first because if both lhs and rhs are read from the
+    // StackTop, then they should be popped in the right order (rhs,
+    // then lhs).  Nothing allocates until the operands are rooted.
+    Value rhs = readOperand(rhsLoc);
+    Value lhs = readOperand(lhsLoc);
+    script_->typeFeedback()->record(dop.pcOffset, lhs, rhs);
+
+    Value fastResult;
+    if (Fast(lhs, rhs, &fastResult)) {
+        writeOperand(outLoc, fastResult);
+        return true;
+    }
+
+    Root<Value> lhsRoot(cx_, lhs);
+    Root<Value> rhsRoot(cx_, rhs);
     Root<Value> result(cx_);
-    if (!VM::PerformAdd(cx_, lhs, rhs, &result))
+    if (!Slow(cx_, lhsRoot, rhsRoot, &result))
         return false;
 
     writeOperand(outLoc, result);
@@ -320,16 +1161,64 @@ Interpreter::interpretAdd(Opcode op, int32_t *opBytes)
 
 
 bool
-Interpreter::interpretSub(Opcode op, int32_t *opBytes)
+Interpreter::interpretAdd(const DecodedOp &dop)
 {
-    Root<Value> lhs(cx_, Value::Undefined());
-    Root<Value> rhs(cx_, Value::Undefined());
+    return interpretBinaryArith<VM::FastAdd, VM::PerformAdd>(
+        dop, Opcode::Add_SSS);
+}
+
+
+bool
+Interpreter::interpretSub(const DecodedOp &dop)
+{
+    return interpretBinaryArith<VM::FastSub, VM::PerformSub>(
+        dop, Opcode::Sub_SSS);
+}
+
+
+bool
+Interpreter::interpretMul(const DecodedOp &dop)
+{
+    return interpretBinaryArith<VM::FastMul, VM::PerformMul>(
+        dop, Opcode::Mul_SSS);
+}
+
+
+bool
+Interpreter::interpretDiv(const DecodedOp &dop)
+{
+    return interpretBinaryArith<VM::FastDiv, VM::PerformDiv>(
+        dop, Opcode::Div_SSS);
+}
+
+
+bool
+Interpreter::interpretMod(const DecodedOp &dop)
+{
+    return interpretBinaryArith<VM::FastMod, VM::PerformMod>(
+        dop, Opcode::Mod_SSS);
+}
+
+
+bool
+Interpreter::interpretNeg(const DecodedOp &dop)
+{
+    OperandLocation inLoc;
     OperandLocation outLoc;
+    ReadUnaryOperandLocations(dop, Opcode::Neg_SS, &inLoc, &outLoc);
 
-    readBinaryOperandValues(op, Opcode::Sub_SSS, &lhs, &rhs, &outLoc, opBytes);
+    Value input = readOperand(inLoc);
+    script_->typeFeedback()->record(dop.pcOffset, input);
 
+    Value fastResult;
+    if (VM::FastNeg(input, &fastResult)) {
+        writeOperand(outLoc, fastResult);
+        return true;
+    }
+
+    Root<Value> inputRoot(cx_, input);
     Root<Value> result(cx_);
-    if (!VM::PerformSub(cx_, lhs, rhs, &result))
+    if (!VM::PerformNeg(cx_, inputRoot, &result))
         return false;
 
     writeOperand(outLoc, result);
@@ -338,165 +1227,352 @@ Interpreter::interpretSub(Opcode op, int32_t *opBytes)
 
 
 bool
-Interpreter::interpretMul(Opcode op, int32_t *opBytes)
+Interpreter::interpretNewObject(const DecodedOp &dop)
 {
-    Root<Value> lhs(cx_, Value::Undefined());
-    Root<Value> rhs(cx_, Value::Undefined());
-    OperandLocation outLoc;
+    WH_ASSERT(dop.opcode == Opcode::NewObject);
+    WH_ASSERT(dop.numOperands == 1);
 
-    readBinaryOperandValues(op, Opcode::Mul_SSS, &lhs, &rhs, &outLoc, opBytes);
+    Root<VM::Shape *> shape(cx_, cx_->threadContext()->emptyObjectShape());
+    if (!shape)
+        return false;
 
-    Root<Value> result(cx_);
-    if (!VM::PerformMul(cx_, lhs, rhs, &result))
+    Root<VM::HashObject *> obj(cx_,
+        cx_->inHatchery(AllocSite::Object).create<VM::HashObject>(
+            static_cast<VM::Object *>(nullptr), shape.get()));
+    if (!obj)
+        return false;
+    if (!obj->initialize(cx_))
         return false;
 
-    writeOperand(outLoc, result);
+    // Templated literals create objects of their template's shape.
+    int32_t cacheIndex = dop.operands[0].signedValue();
+    if (cacheIndex >= 0) {
+        uint32_t numSlots;
+        Root<VM::Shape *> templateShape(cx_,
+            VM::PropertyCache::LookupTemplate(script_->propertyCaches(),
+                                              ToUInt32(cacheIndex),
+                                              &numSlots));
+        if (templateShape &&
+            !obj->initializeFromTemplate(cx_, templateShape, numSlots))
+        {
+            return false;
+        }
+    }
+
+    frame_->pushStack(Value::Object(obj.get()));
     return true;
 }
 
 
 bool
-Interpreter::interpretDiv(Opcode op, int32_t *opBytes)
+Interpreter::interpretInitProp(const DecodedOp &dop)
 {
-    Root<Value> lhs(cx_, Value::Undefined());
-    Root<Value> rhs(cx_, Value::Undefined());
-    OperandLocation outLoc;
-
-    readBinaryOperandValues(op, Opcode::Div_SSS, &lhs, &rhs, &outLoc, opBytes);
+    WH_ASSERT(dop.opcode == Opcode::InitProp);
+    WH_ASSERT(dop.numOperands == 3);
+    WH_ASSERT(frame_->stackDepth() >= 2);
+
+    // Literals only create HashObjects.
+    VM::HashObject *objPtr = frame_->peekStack(1).objectPtr()->toHashObject();
+
+    // Objects created from a template already have the slot, so the fast
+    // path does not allocate.
+    int32_t slot = dop.operands[1].signedValue();
+    if (slot >= 0 && ToUInt32(slot) < objPtr->numProperties()) {
+        objPtr->setSlotValue(ToUInt32(slot), frame_->peekStack(0));
+        frame_->popStack();
+        return true;
+    }
 
-    Root<Value> result(cx_);
-    if (!VM::PerformDiv(cx_, lhs, rhs, &result))
+    Root<VM::HashObject *> obj(cx_, objPtr);
+    Root<Value> name(cx_, readOperand(dop.operands[0]));
+    Root<Value> val(cx_, frame_->peekStack(0));
+    frame_->popStack();
+    if (!obj->defineValueProperty(cx_, name, val))
         return false;
 
-    writeOperand(outLoc, result);
+    // The shape after the last property is the literal's template.
+    if (slot >= 0) {
+        WH_ASSERT(obj->numProperties() == ToUInt32(slot) + 1);
+        uint32_t cacheIndex = ToUInt32(dop.operands[2].signedValue());
+        VM::PropertyCache::RecordTemplate(script_->propertyCaches(),
+                                          cacheIndex, obj->shape(),
+                                          obj->numProperties());
+    }
     return true;
 }
 
 
 bool
-Interpreter::interpretMod(Opcode op, int32_t *opBytes)
+Interpreter::readPropertyReceiver(const Value &val, VM::HashObject **obj)
 {
-    Root<Value> lhs(cx_, Value::Undefined());
-    Root<Value> rhs(cx_, Value::Undefined());
-    OperandLocation outLoc;
+    if (!val.isObject() || !val.objectPtr()->isHashObject()) {
+        SpewInterpOpError("Property access on a non-object value.");
+        return false;
+    }
+    *obj = val.objectPtr()->toHashObject();
+    return true;
+}
 
-    readBinaryOperandValues(op, Opcode::Mod_SSS, &lhs, &rhs, &outLoc, opBytes);
 
-    Root<Value> result(cx_);
-    if (!VM::PerformMod(cx_, lhs, rhs, &result))
+void
+Interpreter::recordPropertyType(const DecodedOp &dop)
+{
+    script_->typeFeedback()->record(dop.pcOffset, frame_->peekStack(0));
+}
+
+
+bool
+Interpreter::interpretGetProp(const DecodedOp &dop)
+{
+    WH_ASSERT(dop.opcode == Opcode::GetProp);
+    WH_ASSERT(dop.numOperands == 2);
+    WH_ASSERT(frame_->stackDepth() >= 1);
+
+    uint32_t cacheIndex = ToUInt32(dop.operands[1].signedValue());
+
+    VM::HashObject *objPtr;
+    if (!readPropertyReceiver(frame_->peekStack(0), &objPtr))
         return false;
 
-    writeOperand(outLoc, result);
+    // The fast path does not allocate.
+    uint32_t slot;
+    if (VM::PropertyCache::Lookup(script_->propertyCaches(), cacheIndex,
+                                  objPtr->shape(), &slot))
+    {
+        frame_->pokeStack(0, objPtr->slotValue(slot));
+        recordPropertyType(dop);
+        return true;
+    }
+
+    Root<VM::HashObject *> obj(cx_, objPtr);
+    Root<Value> name(cx_, readOperand(dop.operands[0]));
+
+    // Index names go straight to the elements, which are not cached.
+    if (name->isImmIndexString()) {
+        Root<Value> elem(cx_);
+        if (!obj->getOwnElement(cx_, name->immIndexStringValue(), &elem))
+            return false;
+        frame_->pokeStack(0, elem);
+        recordPropertyType(dop);
+        return true;
+    }
+
+    slot = obj->lookupOwnSlot(cx_, name);
+    if (slot == UINT32_MAX) {
+        // Inherited properties are cached by the thread, not the op.
+        VM::HashObject *holder = obj->lookupInheritedSlot(cx_, name, &slot);
+        frame_->pokeStack(0, holder ? holder->slotValue(slot)
+                                    : Value::Undefined());
+        recordPropertyType(dop);
+        return true;
+    }
+
+    // Dictionary objects share the empty shape, so are not cached.
+    if (!obj->isDictionary()) {
+        VM::PropertyCache::Record(script_->propertyCaches(), cacheIndex,
+                                  obj->shape(), slot);
+    }
+    frame_->pokeStack(0, obj->slotValue(slot));
+    recordPropertyType(dop);
     return true;
 }
 
 
 bool
-Interpreter::interpretNeg(Opcode op, int32_t *opBytes)
+Interpreter::interpretSetProp(const DecodedOp &dop)
 {
-    Root<Value> input(cx_, Value::Undefined());
-    OperandLocation outLoc;
+    WH_ASSERT(dop.opcode == Opcode::SetProp);
+    WH_ASSERT(dop.numOperands == 2);
+    WH_ASSERT(frame_->stackDepth() >= 2);
 
-    readUnaryOperandValues(op, Opcode::Neg_SS, &input, &outLoc, opBytes);
+    uint32_t cacheIndex = ToUInt32(dop.operands[1].signedValue());
 
-    Root<Value> result(cx_);
-    if (!VM::PerformNeg(cx_, input, &result))
+    VM::HashObject *objPtr;
+    if (!readPropertyReceiver(frame_->peekStack(1), &objPtr))
         return false;
+    recordPropertyType(dop);
+
+    // The value is left on the stack as the result.
+    uint32_t slot;
+    if (VM::PropertyCache::Lookup(script_->propertyCaches(), cacheIndex,
+                                  objPtr->shape(), &slot))
+    {
+        objPtr->setSlotValue(slot, frame_->peekStack(0));
+        frame_->pokeStack(1, frame_->peekStack(0));
+        frame_->popStack();
+        return true;
+    }
 
-    writeOperand(outLoc, result);
+    Root<VM::HashObject *> obj(cx_, objPtr);
+    Root<Value> name(cx_, readOperand(dop.operands[0]));
+    Root<Value> val(cx_, frame_->peekStack(0));
+    if (name->isImmIndexString()) {
+        if (!obj->setOwnElement(cx_, name->immIndexStringValue(), val))
+            return false;
+        frame_->pokeStack(1, val);
+        frame_->popStack();
+        return true;
+    }
+
+    slot = obj->lookupOwnSlot(cx_, name);
+    if (slot == UINT32_MAX) {
+        // Adding a property changes the shape, so adds are not cached.
+        if (!obj->defineValueProperty(cx_, name, val))
+            return false;
+    } else {
+        if (!obj->isDictionary()) {
+            VM::PropertyCache::Record(script_->propertyCaches(), cacheIndex,
+                                      obj->shape(), slot);
+        }
+        obj->setSlotValue(slot, val);
+    }
+
+    frame_->pokeStack(1, val);
+    frame_->popStack();
     return true;
 }
 
 
-void
-Interpreter::readBinaryOperandLocations(Opcode op, Opcode baseOp,
-                                        OperandLocation *lhsLoc,
-                                        OperandLocation *rhsLoc,
-                                        OperandLocation *outLoc,
-                                        int32_t *opBytes)
+bool
+Interpreter::interpretGetGlobal(const DecodedOp &dop)
 {
-    unsigned opcodeOffset = OpcodeNumber(op) - OpcodeNumber(baseOp);
-    WH_ASSERT(opcodeOffset < 8);
-    bool lhsIsValue = opcodeOffset & (1 << 2);
-    bool rhsIsValue = opcodeOffset & (1 << 1);
-    bool outIsValue = opcodeOffset & (1 << 0);
+    WH_ASSERT(dop.opcode == Opcode::GetGlobal);
+    WH_ASSERT(dop.numOperands == 2);
 
-    const OpcodeFormat V = OpcodeFormat::V;
+    uint32_t cacheIndex = ToUInt32(dop.operands[1].signedValue());
 
-    if (lhsIsValue)
-        *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, V, 0, lhsLoc);
-    else
-        *lhsLoc = OperandLocation::StackTop();
+    // The fast path reads the cached cell.
+    if (VM::GlobalCell *cell =
+            VM::PropertyCache::LookupGlobal(script_->propertyCaches(),
+                                            cacheIndex))
+    {
+        frame_->pushStack(cell->value());
+        return true;
+    }
+
+    VM::Global *global = cx_->threadContext()->global();
+    if (!global)
+        return false;
 
-    if (rhsIsValue)
-        *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, V, 0, rhsLoc);
-    else
-        *rhsLoc = OperandLocation::StackTop();
+    Root<Value> name(cx_, readOperand(dop.operands[0]));
+    VM::GlobalCell *cell = global->lookupCell(cx_, name);
+    if (!cell) {
+        SpewInterpOpError("Reference to an undefined global.");
+        return false;
+    }
 
-    if (outIsValue)
-        *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, V, 0, outLoc);
-    else
-        *outLoc = OperandLocation::StackTop();
+    VM::PropertyCache::RecordGlobal(script_->propertyCaches(), cacheIndex,
+                                    cell);
+    frame_->pushStack(cell->value());
+    return true;
 }
 
 
-void
-Interpreter::readBinaryOperandValues(Opcode op, Opcode baseOp,
-                                     MutHandle<Value> lhs,
-                                     MutHandle<Value> rhs,
-                                     OperandLocation *outLoc,
-                                     int32_t *opBytes)
+bool
+Interpreter::interpretSetGlobal(const DecodedOp &dop)
 {
-    OperandLocation lhsLoc;
-    OperandLocation rhsLoc;
-    readBinaryOperandLocations(op, baseOp, &lhsLoc, &rhsLoc, outLoc, opBytes);
+    WH_ASSERT(dop.opcode == Opcode::SetGlobal);
+    WH_ASSERT(dop.numOperands == 2);
+    WH_ASSERT(frame_->stackDepth() >= 1);
+
+    uint32_t cacheIndex = ToUInt32(dop.operands[1].signedValue());
+
+    // The value is left on the stack as the result.
+    if (VM::GlobalCell *cell =
+            VM::PropertyCache::LookupGlobal(script_->propertyCaches(),
+                                            cacheIndex))
+    {
+        cell->setValue(frame_->peekStack(0));
+        return true;
+    }
 
-    // Read the operands.  Read the rhs first because if both lhs and
-    // rhs are read from the StackTop, then they should be popped in
-    // the right order (rhs, then lhs).
-    rhs = readOperand(rhsLoc);
-    lhs = readOperand(lhsLoc);
+    VM::Global *global = cx_->threadContext()->global();
+    if (!global)
+        return false;
+
+    Root<Value> name(cx_, readOperand(dop.operands[0]));
+    Root<Value> val(cx_, frame_->peekStack(0));
+    Root<VM::GlobalCell *> cell(cx_);
+    if (!global->defineGlobal(cx_, name, val, &cell))
+        return false;
+
+    VM::PropertyCache::RecordGlobal(script_->propertyCaches(), cacheIndex,
+                                    cell);
+    return true;
 }
 
 
-void
-Interpreter::readUnaryOperandLocations(Opcode op, Opcode baseOp,
-                                       OperandLocation *inLoc,
-                                       OperandLocation *outLoc,
-                                       int32_t *opBytes)
+bool
+Interpreter::interpretCallNative(const DecodedOp &dop)
 {
-    unsigned opcodeOffset = OpcodeNumber(op) - OpcodeNumber(baseOp);
-    WH_ASSERT(opcodeOffset < 4);
-    bool inputIsValue = opcodeOffset & (1 << 2);
-    bool outIsValue = opcodeOffset & (1 << 0);
+    WH_ASSERT(IsCallNativeOpcode(dop.opcode));
+    uint32_t argc = GetCallNativeArgc(dop.opcode);
+    WH_ASSERT(frame_->stackDepth() >= argc + 1);
 
-    const OpcodeFormat V = OpcodeFormat::V;
+    const Value &callee = frame_->peekStack(argc);
+    if (!callee.isObject() || !callee.objectPtr()->isNativeFunction()) {
+        SpewInterpOpError("Call of a value which is not a function.");
+        return false;
+    }
+    VM::NativeFunction *func = callee.objectPtr()->toNativeFunction();
 
-    if (inputIsValue)
-        *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, V, 0, inLoc);
-    else
-        *inLoc = OperandLocation::StackTop();
+    // The arguments are passed in place, and nothing moves during the
+    // call (see VM::NativeFastCall), so none of them are rooted.
+    const Value *args = argc ? &frame_->peekStack(argc - 1) : nullptr;
+    Value result = Value::Undefined();
+    if (!func->call()(cx_, func->data(), args, argc, &result))
+        return false;
 
-    if (outIsValue)
-        *opBytes += ReadOperandLocation(pc_ + *opBytes, pcEnd_, V, 0, outLoc);
-    else
-        *outLoc = OperandLocation::StackTop();
+    frame_->popStack(argc);
+    frame_->pokeStack(0, result);
+    return true;
 }
 
 
-void
-Interpreter::readUnaryOperandValues(Opcode op, Opcode baseOp,
-                                    MutHandle<Value> in,
-                                    OperandLocation *outLoc,
-                                    int32_t *opBytes)
+bool
+Interpreter::interpretCondition(const DecodedOp &dop)
 {
-    OperandLocation inLoc;
-    readUnaryOperandLocations(op, baseOp, &inLoc, outLoc, opBytes);
+    WH_ASSERT(dop.opcode == Opcode::JumpIfFalse ||
+              dop.opcode == Opcode::JumpIfTrue);
+    WH_ASSERT(frame_->stackDepth() > 0);
+
+    bool cond = VM::ToBoolean(frame_->peekStack(0));
+    frame_->popStack();
+    return cond == (dop.opcode == Opcode::JumpIfTrue);
+}
+
+bool
+Interpreter::checkLoopInterrupt(const DecodedOp &dop)
+{
+    WH_ASSERT(dop.opcode == Opcode::LoopHead);
 
-    // Read the operands.  Read the rhs first because if both lhs and
-    // rhs are read from the StackTop, then they should be popped in
-    // the right order (rhs, then lhs).
-    in = readOperand(inLoc);
+    if (cx_->checkInterrupt())
+        return true;
+
+    if (cx_->suspending()) {
+        // Loops always have a body after their head, so the next op is
+        // in the same array, be it the decoded ops or a JitCode's copy
+        // of them.
+        frame_->setPcOffset((&dop + 1)->pcOffset);
+    } else {
+        SpewInterpOpError("Script interrupted.");
+    }
+    return false;
+}
+
+bool
+Interpreter::interpretLoopHead(const DecodedOp &dop, uint32_t *iterations)
+{
+    WH_ASSERT(dop.opcode == Opcode::LoopHead);
+    WH_ASSERT(dop.numOperands == 1);
+
+    if (!checkLoopInterrupt(dop))
+        return false;
+
+    uint32_t cacheIndex = ToUInt32(dop.operands[0].signedValue());
+    *iterations = VM::PropertyCache::NoteLoopIteration(
+        script_->propertyCaches(), cacheIndex);
+    return true;
 }
 
 
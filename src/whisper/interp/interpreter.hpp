@@ -1,20 +1,108 @@
 #ifndef WHISPER__INTERP__INTERPRETER_HPP
 #define WHISPER__INTERP__INTERPRETER_HPP
 
+#include <vector>
+
 #include "common.hpp"
 #include "runtime.hpp"
 #include "vm/script.hpp"
-#include "vm/stack_frame.hpp"
+#include "vm/native_stack.hpp"
+#include "vm/global.hpp"
+#include "vm/arithmetic_ops.hpp"
 #include "interp/bytecode_ops.hpp"
 
 namespace Whisper {
 namespace Interp {
 
+class JitCode;
+
 
 /**
  * Start a top-level interpretation.
+ *
+ * With |suspended|, the script may be suspended at an interrupt check
+ * (see RunContext::suspendScript).  Its frame is then saved in
+ * |suspended|, and it can be resumed with ResumeScript.  |suspended| is
+ * null if the script ran to completion.
  */
 bool InterpretScript(RunContext *cx, Handle<VM::Script *> script);
+bool InterpretScript(RunContext *cx, Handle<VM::Script *> script,
+                     const MutHandle<VM::StackFrame *> &suspended);
+
+/**
+ * Resume a top-level interpretation suspended in |frame|.  The script
+ * may be suspended again, as with InterpretScript.
+ */
+bool ResumeScript(RunContext *cx, Handle<VM::StackFrame *> frame,
+                  const MutHandle<VM::StackFrame *> &suspended);
+
+/**
+ * A top-level script prepared to be run many times by the host, such as
+ * a handler run for each of a stream of events.  The script is decoded
+ * and rooted once, and each run only pushes its frame and runs it,
+ * unless memory pressure has dropped the decoding since.
+ * Runs pass their input to the script in one global and take its result
+ * from another, whose cells are found once when the script is prepared.
+ *
+ * runBatch runs the script for a number of inputs in one entry: the
+ * frame is pushed and the interpreter set up once, and the frame is
+ * reset between inputs.
+ */
+class PreparedScript
+{
+  private:
+    RunContext *cx_;
+    Root<VM::Script *> script_;
+    Root<Value> inputName_;
+    Root<Value> resultName_;
+    Root<VM::GlobalCell *> inputCell_;
+    Root<VM::GlobalCell *> resultCell_;
+
+  public:
+    explicit PreparedScript(RunContext *cx);
+
+    // Prepare |script| to be run with its input in the global
+    // |inputName| and its result in the global |resultName|, which must
+    // be normalized property names.  The globals are defined if they
+    // are not already.
+    bool prepare(Handle<VM::Script *> script, Handle<Value> inputName,
+                 Handle<Value> resultName);
+
+    // Run the script once.
+    bool run(Handle<Value> input, MutHandle<Value> result);
+
+    // Run the script once for each of |inputs|, appending the results to
+    // |results|.  Stops at the first run which fails.
+    bool runBatch(const VectorRoot<Value> &inputs,
+                  VectorRoot<Value> &results);
+
+  private:
+    bool findCells();
+    bool setInput(const Value &input);
+};
+
+/**
+ * Decode the bytecode of a script into fixed-width ops, if it has not
+ * already been decoded.
+ */
+bool DecodeScript(RunContext *cx, Handle<VM::Script *> script);
+
+/**
+ * Give a script which has not been decoded the already decoded form of
+ * its bytecode, such as that frozen in a SharedCodeHeap.
+ */
+bool AttachDecodedBytecode(RunContext *cx, Handle<VM::Script *> script,
+                           VM::DecodedBytecode *decoded);
+
+/**
+ * Count the ops of |bytecode|, and decode them into |decoded|, which has
+ * room for that many DecodedOps, along with |stackMap|, the stack map
+ * the bytecode verifier found for them (see VerifyBytecode).
+ */
+uint32_t CountBytecodeOps(const VM::Bytecode *bytecode);
+void DecodeBytecodeOps(const VM::Bytecode *bytecode,
+                       const std::vector<uint16_t> &stackMap,
+                       VM::DecodedBytecode *decoded);
 
 
 /**
@@ -27,57 +115,136 @@ class Interpreter
     // The current execution context.
     RunContext *cx_;
 
-    // The current active stack frame.
-    Root<VM::StackFrame *> frame_;
+    // The current active stack frame, on the RunContext's native stack.
+    VM::NativeFrame *frame_;
 
-    // The script and bytecode being executed.
+    // The script and decoded ops being executed.
     Root<VM::Script *> script_;
-    Root<VM::Bytecode *> bytecode_;
+    Root<VM::DecodedBytecode *> decoded_;
+
+    // Op info.
+    const DecodedOp *curOp_;
+    const DecodedOp *endOp_;
 
-    // Pc info.
-    const uint8_t *pc_;
-    const uint8_t *pcEnd_;
+    // The interpreter this one runs inside of, if any.
+    const Interpreter *callerInterp_;
+
+    // The baseline compiled code being run, if any, and the op to go on
+    // from in it once a loop has been run in optimized code.
+    static constexpr uint32_t NoJitResume = UINT32_MAX;
+    const JitCode *jitCode_;
+    uint32_t jitResumeOp_;
 
   public:
-    Interpreter(RunContext *cx, Handle<VM::StackFrame *> frame);
+    Interpreter(RunContext *cx, VM::NativeFrame *frame);
+    ~Interpreter();
+
+    VM::NativeFrame *frame() const {
+        return frame_;
+    }
+    VM::DecodedBytecode *decoded() const {
+        return decoded_;
+    }
+
+    // Run the frame again from the start of its script, once the last
+    // run has finished (see PreparedScript::runBatch).
+    void restart();
+
+    // The op being run.  Read by the sampling profiler's signal handler,
+    // so it may be stale if the decoded ops have just moved.
+    const DecodedOp *curOp() const {
+        return curOp_;
+    }
 
     bool interpret();
 
+    // Run the frame's script with its baseline compiled code, from op
+    // |opIndex|.
+    bool interpretJit(const JitCode *code, uint32_t opIndex=0);
+
+    // The handler called by baseline compiled code for each op.  It runs
+    // the op and then takes the GC safepoint.  Returns false on error.
+    typedef bool (*JitStepFn)(Interpreter *interp, const DecodedOp *dop);
+    static JitStepFn GetJitStep(Opcode op);
+
+    // The handler called by baseline compiled code for each conditional
+    // jump.  It pops the condition and then takes the GC safepoint.
+    enum JitBranchResult : uint8_t
+    {
+        JitBranchFailed = 0,
+        JitBranchNotTaken = 1,
+        JitBranchTaken = 2
+    };
+    typedef uint8_t (*JitBranchFn)(Interpreter *interp, const DecodedOp *dop);
+    static JitBranchFn GetJitBranch(Opcode op);
+
+    // Check for interrupts at the loop header |dop|.  Returns false if
+    // the script is interrupted.  A script being suspended is left to
+    // resume at the op after the header.
+    bool checkLoopInterrupt(const DecodedOp &dop);
+
   private:
     Value readOperand(const OperandLocation &loc);
     void writeOperand(const OperandLocation &loc, const Value &val);
 
-    bool interpretStop(Opcode op, int32_t *opBytes);
-    bool interpretPushInt(Opcode op, int32_t *opBytes);
-    bool interpretAdd(Opcode op, int32_t *opBytes);
-    bool interpretSub(Opcode op, int32_t *opBytes);
-    bool interpretMul(Opcode op, int32_t *opBytes);
-    bool interpretDiv(Opcode op, int32_t *opBytes);
-    bool interpretMod(Opcode op, int32_t *opBytes);
-
-    bool interpretNeg(Opcode op, int32_t *opBytes);
-
-    void readBinaryOperandLocations(Opcode op, Opcode baseOp,
-                                    OperandLocation *lhsLoc,
-                                    OperandLocation *rhsLoc,
-                                    OperandLocation *outLoc,
-                                    int32_t *opBytes);
-
-    void readBinaryOperandValues(Opcode op, Opcode baseOp,
-                                 MutHandle<Value> lhs,
-                                 MutHandle<Value> rhs,
-                                 OperandLocation *outLoc,
-                                 int32_t *opBytes);
-
-    void readUnaryOperandLocations(Opcode op, Opcode baseOp,
-                                   OperandLocation *inLoc,
-                                   OperandLocation *outLoc,
-                                   int32_t *opBytes);
-
-    void readUnaryOperandValues(Opcode op, Opcode baseOp,
-                                 MutHandle<Value> in,
-                                 OperandLocation *outLoc,
-                                 int32_t *opBytes);
+    // Binary arithmetic ops try a fast path on unrooted values, and
+    // fall back to |Slow| on rooted values.
+    template <VM::FastBinaryOp Fast, VM::SlowBinaryOp Slow>
+    inline bool interpretBinaryArith(const DecodedOp &dop, Opcode baseOp);
+
+    template <Opcode Op>
+    static bool JitStep(Interpreter *interp, const DecodedOp *dop);
+    template <Opcode First, Opcode Second>
+    static bool JitFusedStep(Interpreter *interp, const DecodedOp *dop);
+    static uint8_t JitBranch(Interpreter *interp, const DecodedOp *dop);
+
+    // Loop headers in baseline compiled code run hot loops in the
+    // script's optimized code.  The baseline code is left for the
+    // interpreter to go on from where the optimized code exits.
+    static bool JitLoopHead(Interpreter *interp, const DecodedOp *dop);
+
+    // Fused ops run their two component ops in turn.
+    template <Opcode Op>
+    inline bool interpretComponent(const DecodedOp &dop);
+    template <Opcode First, Opcode Second>
+    inline bool interpretFused(const DecodedOp &dop);
+
+    bool interpretStop(const DecodedOp &dop);
+    bool interpretPushInt(const DecodedOp &dop);
+    bool interpretPush(const DecodedOp &dop);
+    bool interpretAdd(const DecodedOp &dop);
+    bool interpretSub(const DecodedOp &dop);
+    bool interpretMul(const DecodedOp &dop);
+    bool interpretDiv(const DecodedOp &dop);
+    bool interpretMod(const DecodedOp &dop);
+
+    bool interpretNeg(const DecodedOp &dop);
+
+    bool interpretNewObject(const DecodedOp &dop);
+    bool interpretInitProp(const DecodedOp &dop);
+    bool interpretGetProp(const DecodedOp &dop);
+    bool interpretSetProp(const DecodedOp &dop);
+    bool interpretGetGlobal(const DecodedOp &dop);
+    bool interpretSetGlobal(const DecodedOp &dop);
+    bool interpretCallNative(const DecodedOp &dop);
+
+    // Pop the condition of a conditional jump.  Returns whether the jump
+    // is taken.
+    bool interpretCondition(const DecodedOp &dop);
+
+    // Check for interrupts, and count an iteration of the loop.  Returns
+    // false if the script is interrupted.  |iterations| is set to the
+    // number of iterations so far.
+    bool interpretLoopHead(const DecodedOp &dop, uint32_t *iterations);
+
+    // Property ops only apply to HashObjects.  Reports an error for
+    // any other receiver.
+    bool readPropertyReceiver(const Value &val, VM::HashObject **obj);
+
+    // Record the type of the value on top of the stack in the type
+    // feedback of a property op: the value got by a GetProp, or the
+    // value to be set by a SetProp.
+    void recordPropertyType(const DecodedOp &dop);
 };
 
 
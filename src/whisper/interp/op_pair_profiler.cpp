@@ -0,0 +1,99 @@
+
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "interp/op_pair_profiler.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+OpPairProfiler::OpPairProfiler()
+{
+    clear();
+}
+
+void
+OpPairProfiler::clear()
+{
+    lastOp_ = Opcode::INVALID;
+    totalOps_ = 0;
+    memset(counts_, 0, sizeof(counts_));
+}
+
+void
+OpPairProfiler::print(FILE *out, uint32_t maxPairs) const
+{
+    struct Pair
+    {
+        Opcode first;
+        Opcode second;
+        uint64_t count;
+    };
+
+    // The INVALID row holds the first op of each run, which does not
+    // form a pair.
+    std::vector<Pair> pairs;
+    uint64_t totalPairs = 0;
+    for (uint32_t i = 1; i < NumOpcodes; i++) {
+        for (uint32_t j = 1; j < NumOpcodes; j++) {
+            if (counts_[i][j] == 0)
+                continue;
+            pairs.push_back({ static_cast<Opcode>(i),
+                              static_cast<Opcode>(j),
+                              counts_[i][j] });
+            totalPairs += counts_[i][j];
+        }
+    }
+
+    std::sort(pairs.begin(), pairs.end(),
+              [](const Pair &a, const Pair &b) {
+                  return a.count > b.count;
+              });
+
+    fprintf(out, "Op pair profile: %" PRIu64 " ops, %" PRIu64 " pairs\n",
+            totalOps_, totalPairs);
+    for (uint32_t i = 0; i < pairs.size() && i < maxPairs; i++) {
+        const Pair &pair = pairs[i];
+        const char *note = "";
+        if (FindFusedOpcode(pair.first, pair.second) != Opcode::INVALID)
+            note = "fused";
+        else if (IsFusable(pair.first, pair.second))
+            note = "fusable";
+
+        fprintf(out, "    %-20s %-20s %10" PRIu64 " (%5.1f%%) %s\n",
+                OpcodeString(pair.first), OpcodeString(pair.second),
+                pair.count, (100.0 * pair.count) / totalPairs, note);
+    }
+}
+
+/*static*/ bool
+OpPairProfiler::IsFusable(Opcode first, Opcode second)
+{
+    // Fused ops replace the opcode of their first op in place.
+    if (GetOpcodeSection(first) != 0 || GetOpcodeSection(second) < 0)
+        return false;
+
+    // Control ops must end their fused op.
+    if (GetOpcodeFlags(first) & OPF_Control)
+        return false;
+
+    OpcodeFormat firstFmt = GetOpcodeFormat(first);
+    OpcodeFormat secondFmt = GetOpcodeFormat(second);
+    uint8_t numOperands = GetOpcodeOperandCount(firstFmt) +
+                          GetOpcodeOperandCount(secondFmt);
+    if (numOperands > DecodedOp::MaxOperands)
+        return false;
+
+    uint32_t fmt = OpcodeFormatNumber(firstFmt) |
+                   (OpcodeFormatNumber(secondFmt) <<
+                        (GetOpcodeOperandCount(firstFmt) *
+                         OpcodeFormatComponentBits));
+    return IsValidOpcodeFormat(static_cast<OpcodeFormat>(fmt));
+}
+
+
+} // namespace Interp
+} // namespace Whisper
@@ -0,0 +1,80 @@
+#ifndef WHISPER__INTERP__OP_PAIR_PROFILER_HPP
+#define WHISPER__INTERP__OP_PAIR_PROFILER_HPP
+
+#include <stdio.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// OpPairProfiler
+//
+// Counts how often each pair of ops is executed back to back by the
+// interpreter.  Once started on a ThreadContext, every op dispatched by
+// the interpreter is noted.  Pairs never span two activations of the
+// interpreter.
+//
+// The most frequent pairs are the candidates for new fused ops (see
+// WHISPER_BYTECODE_FUSED_OPS).  To see the pairs as the bytecode
+// generator emits them before fusion, profile with fusion turned off
+// (see BytecodeGenerator::setFuseOps).
+//
+
+class OpPairProfiler
+{
+  public:
+    static constexpr uint32_t NumOpcodes =
+        static_cast<uint32_t>(Opcode::LIMIT);
+
+  private:
+    Opcode lastOp_;
+    uint64_t totalOps_;
+    uint64_t counts_[NumOpcodes][NumOpcodes];
+
+  public:
+    OpPairProfiler();
+
+    uint64_t totalOps() const {
+        return totalOps_;
+    }
+
+    uint64_t count(Opcode first, Opcode second) const {
+        return counts_[static_cast<uint32_t>(first)]
+                      [static_cast<uint32_t>(second)];
+    }
+
+    void clear();
+
+    // Print up to |maxPairs| of the most frequent pairs, noting which
+    // could be fused and which already are.
+    void print(FILE *out, uint32_t maxPairs) const;
+
+    inline void noteOp(Opcode op) {
+        WH_ASSERT(static_cast<uint32_t>(op) < NumOpcodes);
+        totalOps_++;
+        counts_[static_cast<uint32_t>(lastOp_)][static_cast<uint32_t>(op)]++;
+        lastOp_ = op;
+    }
+
+    // Start a new run of ops.  The first op noted afterward does not
+    // form a pair.
+    inline void noteBoundary() {
+        lastOp_ = Opcode::INVALID;
+    }
+
+    // Whether |first| followed by |second| could be declared as a fused
+    // op: the concatenated formats must form a valid format with at
+    // most DecodedOp::MaxOperands operands.
+    static bool IsFusable(Opcode first, Opcode second);
+};
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__OP_PAIR_PROFILER_HPP
@@ -0,0 +1,181 @@
+
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+#include "rooting_inlines.hpp"
+#include "vm/bytecode.hpp"
+#include "interp/op_profiler.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+OpProfiler::OpProfiler(bool measureCycles)
+  : measureCycles_(measureCycles && CanMeasureCycles()),
+    scripts_()
+{
+    clear();
+}
+
+/*static*/ bool
+OpProfiler::CanMeasureCycles()
+{
+#if defined(WHISPER_OP_PROFILER_CYCLES)
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+OpProfiler::clear()
+{
+    memset(counts_, 0, sizeof(counts_));
+    memset(cycles_, 0, sizeof(cycles_));
+    memset(cycleBuckets_, 0, sizeof(cycleBuckets_));
+
+    // Scripts keep their ids, so only their counts are cleared.
+    for (ScriptCounts &script : scripts_)
+        std::fill(script.counts.begin(), script.counts.end(), 0);
+
+    timedOp_ = Opcode::INVALID;
+    timedStart_ = 0;
+}
+
+void
+OpProfiler::enterScript(VM::Script *script)
+{
+    WH_ASSERT(script->hasDecoded());
+    timedOp_ = Opcode::INVALID;
+    curScriptCounts_ = nullptr;
+    curScriptOps_ = 0;
+
+    uint32_t id = script->profileId();
+    if (id == 0) {
+        VM::DecodedBytecode *decoded = script->decoded();
+        try {
+            ScriptCounts counts;
+            counts.counts.resize(decoded->numOps(), 0);
+            counts.pcOffsets.reserve(decoded->numOps());
+            counts.opcodes.reserve(decoded->numOps());
+            for (const DecodedOp *op = decoded->ops();
+                 op != decoded->opsEnd();
+                 op++)
+            {
+                counts.pcOffsets.push_back(op->pcOffset);
+                counts.opcodes.push_back(op->opcode);
+            }
+            scripts_.push_back(std::move(counts));
+        } catch (std::bad_alloc &err) {
+            return;
+        }
+        id = scripts_.size();
+        script->setProfileId(id);
+    }
+
+    WH_ASSERT(id <= scripts_.size());
+    ScriptCounts &counts = scripts_[id - 1];
+    curScriptCounts_ = counts.counts.data();
+    curScriptOps_ = counts.counts.size();
+}
+
+void
+OpProfiler::print(FILE *out, uint32_t maxPcs) const
+{
+    uint64_t totalOps = 0;
+    std::vector<uint32_t> ops;
+    for (uint32_t i = 1; i < NumOpcodes; i++) {
+        if (counts_[i] == 0)
+            continue;
+        ops.push_back(i);
+        totalOps += counts_[i];
+    }
+    std::sort(ops.begin(), ops.end(),
+              [this](uint32_t a, uint32_t b) {
+                  return counts_[a] > counts_[b];
+              });
+
+    fprintf(out, "Op profile: %" PRIu64 " ops\n", totalOps);
+    for (uint32_t op : ops) {
+        fprintf(out, "    %-20s %12" PRIu64 " (%5.1f%%)",
+                OpcodeString(static_cast<Opcode>(op)), counts_[op],
+                (100.0 * counts_[op]) / totalOps);
+
+        // Ops are timed for all but the last op of each run.
+        uint64_t timed = 0;
+        for (uint32_t b = 0; b < NumCycleBuckets; b++)
+            timed += cycleBuckets_[op][b];
+        if (measureCycles_ && timed > 0) {
+            fprintf(out, "  avg %8.1f cycles  [",
+                    double(cycles_[op]) / timed);
+            bool first = true;
+            for (uint32_t b = 0; b < NumCycleBuckets; b++) {
+                if (cycleBuckets_[op][b] == 0)
+                    continue;
+                fprintf(out, "%s2^%u:%" PRIu64, first ? "" : " ",
+                        (unsigned) b, cycleBuckets_[op][b]);
+                first = false;
+            }
+            fprintf(out, "]");
+        }
+        fprintf(out, "\n");
+    }
+
+    // Ops outside section 0 take a prefix byte.  Those which ran more
+    // often than some section 0 op are candidates for moving into
+    // section 0 (see WHISPER_BYTECODE_OPS).
+    uint32_t coldestUnprefixed = 0;
+    for (uint32_t op : ops) {
+        if (GetOpcodeSection(static_cast<Opcode>(op)) == 0)
+            coldestUnprefixed = op;
+    }
+    for (uint32_t op : ops) {
+        if (coldestUnprefixed == 0 ||
+            counts_[op] <= counts_[coldestUnprefixed])
+        {
+            break;
+        }
+        int8_t section = GetOpcodeSection(static_cast<Opcode>(op));
+        if (section > 0) {
+            fprintf(out, "    %s is in section %d, but ran more than %s\n",
+                    OpcodeString(static_cast<Opcode>(op)), (int) section,
+                    OpcodeString(static_cast<Opcode>(coldestUnprefixed)));
+        }
+    }
+
+    struct HotPc
+    {
+        uint32_t scriptId;
+        uint32_t pcOffset;
+        Opcode opcode;
+        uint64_t count;
+    };
+
+    std::vector<HotPc> hotPcs;
+    for (uint32_t s = 0; s < scripts_.size(); s++) {
+        const ScriptCounts &script = scripts_[s];
+        for (uint32_t i = 0; i < script.counts.size(); i++) {
+            if (script.counts[i] > 0)
+                hotPcs.push_back({ s + 1, script.pcOffsets[i],
+                                   script.opcodes[i], script.counts[i] });
+        }
+    }
+    std::sort(hotPcs.begin(), hotPcs.end(),
+              [](const HotPc &a, const HotPc &b) {
+                  return a.count > b.count;
+              });
+
+    fprintf(out, "Hot pcs: %u scripts\n", (unsigned) scripts_.size());
+    for (uint32_t i = 0; i < hotPcs.size() && i < maxPcs; i++) {
+        const HotPc &pc = hotPcs[i];
+        fprintf(out, "    script %-4u pc %-8u %-20s %12" PRIu64 "\n",
+                (unsigned) pc.scriptId, (unsigned) pc.pcOffset,
+                OpcodeString(pc.opcode), pc.count);
+    }
+}
+
+
+} // namespace Interp
+} // namespace Whisper
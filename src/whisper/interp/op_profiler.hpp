@@ -0,0 +1,138 @@
+#ifndef WHISPER__INTERP__OP_PROFILER_HPP
+#define WHISPER__INTERP__OP_PROFILER_HPP
+
+#include <stdio.h>
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "vm/script.hpp"
+#include "interp/bytecode_ops.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define WHISPER_OP_PROFILER_CYCLES
+#endif
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// OpProfiler
+//
+// Aggregate profile of the ops run by the interpreter.  Once started on
+// a ThreadContext, it keeps:
+//  - The number of times each opcode is executed.
+//  - Optionally, a histogram of the cycles spent in each opcode, in
+//    power of two buckets, measured with the time stamp counter.  An
+//    op's cycles run from its dispatch to the dispatch of the next op,
+//    so they include the dispatch itself and the profiler's own cost.
+//    The last op run by each activation of the interpreter is not
+//    timed.  Cycles are only available on x86.
+//  - For each script, the number of times each op of the script is
+//    executed, by pc offset.
+//
+// Scripts move under GC, so the profiler gives each script it sees an
+// id, stored in the script (see VM::Script::profileId).
+//
+// Scripts are not baseline compiled while the profiler is running, so
+// that every op is counted.
+//
+
+class OpProfiler
+{
+  public:
+    static constexpr uint32_t NumOpcodes =
+        static_cast<uint32_t>(Opcode::LIMIT);
+    static constexpr uint32_t NumCycleBuckets = 24;
+
+  private:
+    struct ScriptCounts
+    {
+        std::vector<uint32_t> pcOffsets;
+        std::vector<Opcode> opcodes;
+        std::vector<uint64_t> counts;
+    };
+
+    bool measureCycles_;
+
+    uint64_t counts_[NumOpcodes];
+    uint64_t cycles_[NumOpcodes];
+    uint64_t cycleBuckets_[NumOpcodes][NumCycleBuckets];
+
+    std::vector<ScriptCounts> scripts_;
+
+    // Per-op counts of the script being run, if any.
+    uint64_t *curScriptCounts_;
+    uint32_t curScriptOps_;
+
+    // The op being timed, and its start time.
+    Opcode timedOp_;
+    uint64_t timedStart_;
+
+  public:
+    explicit OpProfiler(bool measureCycles);
+
+    static bool CanMeasureCycles();
+
+    bool measureCycles() const {
+        return measureCycles_;
+    }
+
+    uint64_t count(Opcode op) const {
+        return counts_[static_cast<uint32_t>(op)];
+    }
+
+    void clear();
+
+    // Print the opcode counts and cycle histograms, any prefixed ops
+    // which ran more often than an unprefixed one, and up to |maxPcs|
+    // of the hottest pcs over all scripts.
+    void print(FILE *out, uint32_t maxPcs) const;
+
+    // Start counting the ops of |script|, which must be decoded.  Also
+    // starts a new run of timed ops.
+    void enterScript(VM::Script *script);
+
+    inline void noteOp(Opcode op, uint32_t opIndex) {
+        WH_ASSERT(static_cast<uint32_t>(op) < NumOpcodes);
+        counts_[static_cast<uint32_t>(op)]++;
+        if (curScriptCounts_) {
+            WH_ASSERT(opIndex < curScriptOps_);
+            curScriptCounts_[opIndex]++;
+        }
+        if (measureCycles_)
+            noteCycles(op);
+    }
+
+  private:
+    inline void noteCycles(Opcode op) {
+#if defined(WHISPER_OP_PROFILER_CYCLES)
+        uint64_t now = __rdtsc();
+        if (timedOp_ != Opcode::INVALID) {
+            uint32_t timed = static_cast<uint32_t>(timedOp_);
+            uint64_t delta = now - timedStart_;
+            cycles_[timed] += delta;
+            cycleBuckets_[timed][CycleBucket(delta)]++;
+        }
+        timedOp_ = op;
+        timedStart_ = now;
+#endif // defined(WHISPER_OP_PROFILER_CYCLES)
+    }
+
+    // Bucket |i| holds deltas in [2^i, 2^(i+1)), and the last bucket
+    // holds everything larger.
+    static inline uint32_t CycleBucket(uint64_t delta) {
+        if (delta == 0)
+            return 0;
+        uint32_t bucket = 63 - __builtin_clzll(delta);
+        return (bucket < NumCycleBuckets) ? bucket : NumCycleBuckets - 1;
+    }
+};
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__OP_PROFILER_HPP
@@ -0,0 +1,1175 @@
+
+#include <string.h>
+#include <atomic>
+#include <new>
+
+#include "spew.hpp"
+#include "trace.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "value_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/native_stack.hpp"
+#include "vm/global.hpp"
+#include "vm/property_cache.hpp"
+#include "interp/interpreter.hpp"
+#include "interp/baseline_jit.hpp"
+#include "interp/optimizing_jit.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+//
+// OptState
+//
+// The state optimized code runs with, passed to it by OptCode::run.
+// The code reads its fields at fixed offsets.
+//
+struct OptState
+{
+    static constexpr uint32_t MaxGlobalSlots = 32;
+
+    RunContext *cx;
+    VM::NativeFrame *frame;
+    const OptCode *code;
+    Value *locals;
+    const std::atomic<bool> *interruptRequested;
+    uint32_t *clockCountdown;
+
+    // The value of the cell of each global slot.
+    Value *cellValues[MaxGlobalSlots];
+};
+
+// The number of registers optimized code keeps values in, which are
+// saved by its exits.
+static constexpr uint32_t NumValueRegs = 6;
+
+
+//
+// OptCode
+//
+
+bool
+OptCode::hasEntry(uint32_t loopHead) const
+{
+    for (uint32_t i = 0; i < numEntries_; i++) {
+        if (entries_[i].loopHead == loopHead)
+            return true;
+    }
+    return false;
+}
+
+bool
+OptCode::findCells(OptState *state) const
+{
+    if (numGlobalCaches_ == 0)
+        return true;
+
+    bool found[OptState::MaxGlobalSlots] = {};
+    VM::Tuple *caches = state->frame->script()->propertyCaches();
+    for (uint32_t i = 0; i < numGlobalCaches_; i++) {
+        const SsaGlobalCache &cache = globalCaches_[i];
+        VM::GlobalCell *cell =
+            VM::PropertyCache::LookupGlobal(caches, cache.cacheIndex);
+        if (!cell)
+            return false;
+
+        Value *addr = cell->addressOfValue();
+        if (!found[cache.slot]) {
+            state->cellValues[cache.slot] = addr;
+            found[cache.slot] = true;
+        } else if (state->cellValues[cache.slot] != addr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const OptCode::Exit &
+OptCode::exitAt(const uint8_t *nativePc) const
+{
+    WH_ASSERT(nativePc > code_ && nativePc <= code_ + codeSize_);
+    uint32_t nativeOffset = nativePc - code_;
+
+    uint32_t lo = 0, hi = numDeoptPoints_;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (deoptPoints_[mid].nativeOffset < nativeOffset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    WH_ASSERT(lo < numDeoptPoints_);
+    WH_ASSERT(deoptPoints_[lo].nativeOffset == nativeOffset);
+    return exits_[deoptPoints_[lo].exit];
+}
+
+uint32_t
+OptCode::deoptimize(Interpreter *interp, const uint64_t *nativeFrame) const
+{
+    const uint8_t *nativePc =
+        reinterpret_cast<const uint8_t *>(nativeFrame[NumValueRegs]);
+    const uint64_t *slots = nativeFrame + NumValueRegs + 1;
+    const Exit &exit = exitAt(nativePc);
+
+    VM::NativeFrame *frame = interp->frame();
+    WH_ASSERT(frame->stackDepth() == 0);
+
+    // The exit restores exactly the stack the verifier found for its op.
+    WH_ASSERT(exit.numValues == interp->decoded()->stackDepthAt(
+                                    interp->decoded()->ops() + exit.resumeOp));
+    for (uint32_t i = 0; i < exit.numValues; i++) {
+        const ValueLocation &loc = locations_[exit.valuesStart + i];
+        int32_t val;
+        switch (loc.kind) {
+          case ValueLocation::Constant:
+            val = loc.value;
+            break;
+          case ValueLocation::Register:
+            WH_ASSERT(loc.value < ToInt32(NumValueRegs));
+            val = ToInt32(ToUInt32(nativeFrame[loc.value]));
+            break;
+          case ValueLocation::Slot:
+            val = ToInt32(ToUInt32(slots[loc.value]));
+            break;
+          default:
+            WH_UNREACHABLE("Bad value location.");
+            val = 0;
+        }
+        frame->pushStack(Value::Int32(val));
+    }
+    frame->setPcOffset(exit.pcOffset);
+    return &exit - exits_;
+}
+
+bool
+OptCode::run(RunContext *cx, Interpreter *interp, uint32_t loopHead,
+             uint32_t *resumeOp)
+{
+    const Entry *entry = nullptr;
+    for (uint32_t i = 0; i < numEntries_; i++) {
+        if (entries_[i].loopHead == loopHead)
+            entry = &entries_[i];
+    }
+    WH_ASSERT(entry);
+
+    VM::NativeFrame *frame = interp->frame();
+    WH_ASSERT(frame->stackDepth() == 0);
+
+    OptState state;
+    state.cx = cx;
+    state.frame = frame;
+    state.code = this;
+    state.locals = frame->addressOfLocals();
+    state.interruptRequested = cx->addressOfInterruptRequested();
+    state.clockCountdown = cx->addressOfClockCountdown();
+
+    // A loop using a global which has since been deleted goes on in the
+    // baseline code.
+    uint32_t exitIndex;
+    if (findCells(&state)) {
+        EntryFn fn = reinterpret_cast<EntryFn>(const_cast<uint8_t *>(code_));
+        uint32_t result = fn(interp, &state, code_ + entry->codeOffset);
+        if (result == 0)
+            return false;
+        exitIndex = result - 1;
+        WH_ASSERT(exitIndex < numExits_);
+
+        const Exit &exit = exits_[exitIndex];
+        *resumeOp = exit.resumeOp;
+        if (!exit.isBailout)
+            return true;
+    } else {
+        *resumeOp = loopHead + 1;
+    }
+
+    if (++bailouts_ == MaxBailouts) {
+        SpewJitNote("Script %p bailed out %u times, no longer optimized",
+                    frame->script(), (unsigned) bailouts_);
+        frame->script()->disableOpt();
+    }
+    return true;
+}
+
+
+#if defined(__x86_64__)
+
+// The common exit routine of optimized code calls here.  Returns the
+// index of the exit plus one.
+static uint32_t
+OptDeopt(Interpreter *interp, OptState *state, const uint64_t *nativeFrame)
+{
+    return state->code->deoptimize(interp, nativeFrame) + 1;
+}
+
+// The interrupt check of a loop header, called by optimized code when it
+// would handle an interrupt.  Returns 0 if the script is interrupted, 1
+// to go on, and 2 to exit if a global the code uses has been deleted.
+static uint32_t
+OptLoopHead(Interpreter *interp, const DecodedOp *dop, OptState *state)
+{
+    if (!interp->checkLoopInterrupt(*dop))
+        return 0;
+
+    // The code holds no values across the call, and the cells of its
+    // globals are found again, as they may have moved.
+    ThreadContext *thrcx = state->cx->threadContext();
+    if (thrcx->needsGC() && !thrcx->performGC())
+        return 0;
+    return state->code->findCells(state) ? 1 : 2;
+}
+
+enum Reg : uint8_t
+{
+    Rax = 0, Rcx = 1, Rdx = 2, Rbx = 3, Rsp = 4, Rbp = 5, Rsi = 6, Rdi = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13
+};
+
+enum Cond : uint8_t
+{
+    Overflow = 0x0,
+    Equal = 0x4,
+    NotEqual = 0x5,
+    Sign = 0x8,
+    LessEqual = 0xE
+};
+
+// The opcode of each ALU op taking a register and a register or memory
+// operand, and its opcode extension when it takes an immediate.
+enum class AluOp : uint8_t
+{
+    Add, Or, And, Sub, Cmp
+};
+
+struct Mem
+{
+    Reg base;
+    int32_t disp;
+};
+
+//
+// OptAssembler
+//
+// Emits the x86-64 code of the optimizing JIT.  Jumps to code which has
+// not been emitted yet return the offset of their rel32 field, to be
+// patched with bind.
+//
+class OptAssembler
+{
+  private:
+    std::vector<uint8_t> code_;
+
+  public:
+    OptAssembler() : code_() {}
+
+    uint32_t size() const {
+        return code_.size();
+    }
+    const uint8_t *data() const {
+        return code_.data();
+    }
+
+    void bind(uint32_t jump) {
+        bindTo(jump, size());
+    }
+    void bindTo(uint32_t jump, uint32_t target) {
+        uint32_t rel = target - (jump + 4);
+        memcpy(&code_[jump], &rel, 4);
+    }
+
+    uint32_t jcc(Cond cond) {
+        emit(0x0F); emit(0x80 | cond);
+        emitImm32(0);
+        return size() - 4;
+    }
+    uint32_t jmp() {
+        emit(0xE9);
+        emitImm32(0);
+        return size() - 4;
+    }
+    void jmpR(Reg reg) {
+        rex(false, 4, reg);
+        emit(0xFF); modRmReg(4, reg);
+    }
+    void callR(Reg reg) {
+        rex(false, 2, reg);
+        emit(0xFF); modRmReg(2, reg);
+    }
+    uint32_t call() {
+        emit(0xE8);
+        emitImm32(0);
+        return size() - 4;
+    }
+    void ret() {
+        emit(0xC3);
+    }
+    void push(Reg reg) {
+        rex(false, 0, reg);
+        emit(0x50 | (reg & 7));
+    }
+    void pop(Reg reg) {
+        rex(false, 0, reg);
+        emit(0x58 | (reg & 7));
+    }
+
+    void movRR32(Reg dst, Reg src) {
+        opRR(false, 0x8B, dst, src);
+    }
+    void movRR64(Reg dst, Reg src) {
+        opRR(true, 0x8B, dst, src);
+    }
+    void movRM32(Reg dst, Mem mem) {
+        opRM(false, 0x8B, dst, mem);
+    }
+    void movRM64(Reg dst, Mem mem) {
+        opRM(true, 0x8B, dst, mem);
+    }
+    void movMR32(Mem mem, Reg src) {
+        opRM(false, 0x89, src, mem);
+    }
+    void movMR64(Mem mem, Reg src) {
+        opRM(true, 0x89, src, mem);
+    }
+    void movRI32(Reg dst, int32_t imm) {
+        rex(false, 0, dst);
+        emit(0xB8 | (dst & 7));
+        emitImm32(imm);
+    }
+    void movRI64(Reg dst, uint64_t imm) {
+        rex(true, 0, dst);
+        emit(0xB8 | (dst & 7));
+        emitImm64(imm);
+    }
+
+    void aluRR32(AluOp op, Reg dst, Reg src) {
+        opRR(false, AluOpcode(op), dst, src);
+    }
+    void aluRR64(AluOp op, Reg dst, Reg src) {
+        opRR(true, AluOpcode(op), dst, src);
+    }
+    void aluRM32(AluOp op, Reg dst, Mem mem) {
+        opRM(false, AluOpcode(op), dst, mem);
+    }
+    void aluRI32(AluOp op, Reg dst, int32_t imm) {
+        aluRI(false, op, dst, imm);
+    }
+    void aluRI64(AluOp op, Reg dst, int32_t imm) {
+        aluRI(true, op, dst, imm);
+    }
+    void cmpMI32(Mem mem, int8_t imm) {
+        rex(false, 0, mem.base);
+        emit(0x83); modRmMem(7, mem);
+        emit(imm);
+    }
+    void cmpMI8(Mem mem, int8_t imm) {
+        rex(false, 0, mem.base);
+        emit(0x80); modRmMem(7, mem);
+        emit(imm);
+    }
+    void cmpAlI8(uint8_t imm) {
+        emit(0x3C); emit(imm);
+    }
+    void testRR32(Reg lhs, Reg rhs) {
+        opRR(false, 0x85, rhs, lhs);
+    }
+
+    void imulRR32(Reg dst, Reg src) {
+        rex(false, dst, src);
+        emit(0x0F); emit(0xAF); modRmReg(dst, src);
+    }
+    void imulRM32(Reg dst, Mem mem) {
+        rex(false, dst, mem.base);
+        emit(0x0F); emit(0xAF); modRmMem(dst, mem);
+    }
+    void imulRRI32(Reg dst, Reg src, int32_t imm) {
+        opRR(false, 0x69, dst, src);
+        emitImm32(imm);
+    }
+    void negR32(Reg reg) {
+        opRR(false, 0xF7, Reg(3), reg);
+    }
+    void idivR32(Reg reg) {
+        opRR(false, 0xF7, Reg(7), reg);
+    }
+    void cdq() {
+        emit(0x99);
+    }
+    void shlRI64(Reg reg, uint8_t count) {
+        opRR(true, 0xC1, Reg(4), reg);
+        emit(count);
+    }
+    void shrRI64(Reg reg, uint8_t count) {
+        opRR(true, 0xC1, Reg(5), reg);
+        emit(count);
+    }
+
+  private:
+    static uint8_t AluOpcode(AluOp op) {
+        static const uint8_t Opcodes[] = { 0x03, 0x0B, 0x23, 0x2B, 0x3B };
+        return Opcodes[static_cast<unsigned>(op)];
+    }
+    static uint8_t AluExtension(AluOp op) {
+        static const uint8_t Extensions[] = { 0, 1, 4, 5, 7 };
+        return Extensions[static_cast<unsigned>(op)];
+    }
+
+    void aluRI(bool wide, AluOp op, Reg dst, int32_t imm) {
+        rex(wide, 0, dst);
+        if (imm >= INT8_MIN && imm <= INT8_MAX) {
+            emit(0x83); modRmReg(AluExtension(op), dst);
+            emit(imm);
+        } else {
+            emit(0x81); modRmReg(AluExtension(op), dst);
+            emitImm32(imm);
+        }
+    }
+
+    void opRR(bool wide, uint8_t opcode, unsigned reg, Reg rm) {
+        rex(wide, reg, rm);
+        emit(opcode);
+        modRmReg(reg, rm);
+    }
+    void opRM(bool wide, uint8_t opcode, unsigned reg, Mem mem) {
+        rex(wide, reg, mem.base);
+        emit(opcode);
+        modRmMem(reg, mem);
+    }
+
+    void rex(bool wide, unsigned reg, unsigned rm) {
+        uint8_t bits = (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+        if (bits)
+            emit(0x40 | bits);
+    }
+    void modRmReg(unsigned reg, unsigned rm) {
+        emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+    void modRmMem(unsigned reg, Mem mem) {
+        bool shortDisp = mem.disp >= INT8_MIN && mem.disp <= INT8_MAX;
+        emit((shortDisp ? 0x40 : 0x80) | ((reg & 7) << 3) | (mem.base & 7));
+        if ((mem.base & 7) == Rsp)
+            emit(0x24);
+        if (shortDisp)
+            emit(mem.disp);
+        else
+            emitImm32(mem.disp);
+    }
+
+    void emit(uint8_t byte) {
+        code_.push_back(byte);
+    }
+    void emitImm32(uint32_t val) {
+        for (unsigned i = 0; i < 4; i++)
+            emit((val >> (i * 8)) & 0xFFu);
+    }
+    void emitImm64(uint64_t val) {
+        for (unsigned i = 0; i < 8; i++)
+            emit((val >> (i * 8)) & 0xFFu);
+    }
+};
+
+
+//
+// OptCompiler
+//
+// Allocates a register or spill slot to each value of an SsaGraph, and
+// generates the code of its blocks, in order, followed by a stub for
+// each snapshot exited at, which calls the common exit routine.  The
+// native pc of the call maps to the exit's metadata (see
+// OptCode::deoptimize).
+//
+// rbx holds the interpreter, r12 the OptState and r13 the frame's
+// locals.  rax, rdx and r11 are scratch.  Values are allocated the
+// other caller-saved registers, or else spill slots above rsp, for the
+// whole of their lives.  A value is live until the last instruction
+// using it, as an input or in its snapshot, has run, so the result of
+// an instruction never shares a register with its inputs.
+//
+class OptCompiler
+{
+  private:
+    struct Location
+    {
+        enum Kind : uint8_t { None, Imm, Register, Slot };
+        Kind kind;
+        int32_t value;
+    };
+
+    // A jump to a block or to the stub of a snapshot.
+    struct Jump
+    {
+        uint32_t offset;
+        uint32_t target;
+    };
+
+    static const Reg Regs[NumValueRegs];
+
+    const SsaGraph &graph_;
+    const JitCode *baseline_;
+    OptAssembler masm_;
+
+    std::vector<Location> locs_;
+    uint32_t numSlots_;
+    uint32_t frameSize_;
+
+    std::vector<uint32_t> blockOffsets_;
+    std::vector<Jump> blockJumps_;
+    std::vector<Jump> stubJumps_;
+    std::vector<uint32_t> exitCalls_;
+    std::vector<uint32_t> failJumps_;
+
+    std::vector<OptCode::Exit> exits_;
+    std::vector<OptCode::ValueLocation> locations_;
+    std::vector<OptCode::DeoptPoint> deoptPoints_;
+
+  public:
+    OptCompiler(const SsaGraph &graph, const JitCode *baseline)
+      : graph_(graph), baseline_(baseline), masm_(),
+        locs_(), numSlots_(0), frameSize_(0),
+        blockOffsets_(), blockJumps_(), stubJumps_(),
+        exitCalls_(), failJumps_(),
+        exits_(), locations_(), deoptPoints_()
+    {}
+
+    const OptAssembler &masm() const {
+        return masm_;
+    }
+    uint32_t blockOffset(uint32_t block) const {
+        return blockOffsets_[block];
+    }
+    const std::vector<OptCode::Exit> &exits() const {
+        return exits_;
+    }
+    const std::vector<OptCode::ValueLocation> &locations() const {
+        return locations_;
+    }
+    const std::vector<OptCode::DeoptPoint> &deoptPoints() const {
+        return deoptPoints_;
+    }
+
+    void compile() {
+        allocate();
+        frameSize_ = AlignIntUp<uint32_t>(numSlots_ * 8, 16);
+
+        // The return address and three pushes leave the stack aligned.
+        masm_.push(Rbx);
+        masm_.push(R12);
+        masm_.push(R13);
+        if (frameSize_)
+            masm_.aluRI64(AluOp::Sub, Rsp, frameSize_);
+        masm_.movRR64(Rbx, Rdi);
+        masm_.movRR64(R12, Rsi);
+        masm_.movRM64(R13, stateField(offsetof(OptState, locals)));
+        masm_.jmpR(Rdx);
+
+        for (uint32_t b = 0; b < graph_.numBlocks(); b++) {
+            blockOffsets_.push_back(masm_.size());
+            const SsaBlock &block = graph_.block(b);
+            for (uint32_t value : block.instrs)
+                compileInstr(value, b + 1);
+        }
+        for (const Jump &jump : blockJumps_)
+            masm_.bindTo(jump.offset, blockOffsets_[jump.target]);
+
+        compileStubs();
+
+        for (uint32_t jump : failJumps_)
+            masm_.bind(jump);
+        masm_.aluRR32(AluOp::Sub, Rax, Rax);
+        uint32_t failed = masm_.jmp();
+
+        // The common exit routine, called with the spill slots above the
+        // return address.  The registers holding values are saved below
+        // it, and the stack is aligned for the call.
+        for (uint32_t call : exitCalls_)
+            masm_.bind(call);
+        for (Reg reg : Regs)
+            masm_.push(reg);
+        masm_.aluRI64(AluOp::Sub, Rsp, 8);
+        masm_.movRR64(Rdi, Rbx);
+        masm_.movRR64(Rsi, R12);
+        masm_.movRR64(Rdx, Rsp);
+        masm_.aluRI64(AluOp::Add, Rdx, 8);
+        masm_.movRI64(Rax, reinterpret_cast<uintptr_t>(&OptDeopt));
+        masm_.callR(Rax);
+        masm_.aluRI64(AluOp::Add, Rsp, 8 * (NumValueRegs + 2));
+
+        masm_.bind(failed);
+        if (frameSize_)
+            masm_.aluRI64(AluOp::Add, Rsp, frameSize_);
+        masm_.pop(R13);
+        masm_.pop(R12);
+        masm_.pop(Rbx);
+        masm_.ret();
+    }
+
+  private:
+    static Mem stateField(size_t offset) {
+        return Mem { R12, static_cast<int32_t>(offset) };
+    }
+    static Mem slotMem(int32_t slot) {
+        return Mem { Rsp, slot * 8 };
+    }
+    static Mem cellMem(int32_t slot) {
+        return stateField(offsetof(OptState, cellValues) +
+                          slot * sizeof(Value *));
+    }
+
+    void allocate() {
+        locs_.assign(graph_.numInstrs(), Location { Location::None, 0 });
+        std::vector<uint32_t> lastUse(graph_.numInstrs(), 0);
+
+        for (uint32_t b = 0; b < graph_.numBlocks(); b++) {
+            const std::vector<uint32_t> &instrs = graph_.block(b).instrs;
+            for (uint32_t pos = 0; pos < instrs.size(); pos++) {
+                const SsaInstr &instr = graph_.instr(instrs[pos]);
+                lastUse[instrs[pos]] = pos;
+                for (uint32_t i = 0; i < instr.numInputs; i++)
+                    lastUse[instr.inputs[i]] = pos;
+                if (instr.snapshot == SsaInstr::NoSnapshot)
+                    continue;
+                const SsaSnapshot &snap = graph_.snapshot(instr.snapshot);
+                for (uint32_t i = 0; i < snap.numValues; i++)
+                    lastUse[graph_.snapshotValue(snap, i)] = pos;
+            }
+
+            bool regFree[NumValueRegs];
+            for (uint32_t r = 0; r < NumValueRegs; r++)
+                regFree[r] = true;
+            std::vector<bool> slotFree(numSlots_, true);
+            std::vector<uint32_t> active;
+
+            for (uint32_t pos = 0; pos < instrs.size(); pos++) {
+                uint32_t kept = 0;
+                for (uint32_t value : active) {
+                    if (lastUse[value] >= pos) {
+                        active[kept++] = value;
+                        continue;
+                    }
+                    const Location &loc = locs_[value];
+                    if (loc.kind == Location::Register)
+                        regFree[loc.value] = true;
+                    else
+                        slotFree[loc.value] = true;
+                }
+                active.resize(kept);
+
+                uint32_t value = instrs[pos];
+                const SsaInstr &instr = graph_.instr(value);
+                if (instr.op == SsaOp::Constant) {
+                    locs_[value] = Location { Location::Imm, instr.imm };
+                    continue;
+                }
+                if (!instr.definesValue())
+                    continue;
+
+                uint32_t r = 0;
+                while (r < NumValueRegs && !regFree[r])
+                    r++;
+                if (r < NumValueRegs) {
+                    regFree[r] = false;
+                    locs_[value] = Location { Location::Register,
+                                              static_cast<int32_t>(r) };
+                } else {
+                    uint32_t s = 0;
+                    while (s < slotFree.size() && !slotFree[s])
+                        s++;
+                    if (s == slotFree.size()) {
+                        slotFree.push_back(true);
+                        numSlots_ = slotFree.size();
+                    }
+                    slotFree[s] = false;
+                    locs_[value] = Location { Location::Slot,
+                                              static_cast<int32_t>(s) };
+                }
+                active.push_back(value);
+            }
+        }
+    }
+
+    const Location &loc(uint32_t value) const {
+        WH_ASSERT(locs_[value].kind != Location::None);
+        return locs_[value];
+    }
+
+    void loadValue(Reg dst, uint32_t value) {
+        const Location &src = loc(value);
+        if (src.kind == Location::Imm)
+            masm_.movRI32(dst, src.value);
+        else if (src.kind == Location::Slot)
+            masm_.movRM32(dst, slotMem(src.value));
+        else if (Regs[src.value] != dst)
+            masm_.movRR32(dst, Regs[src.value]);
+    }
+
+    void storeValue(uint32_t value, Reg src) {
+        const Location &dst = loc(value);
+        if (dst.kind == Location::Slot)
+            masm_.movMR32(slotMem(dst.value), src);
+        else if (Regs[dst.value] != src)
+            masm_.movRR32(Regs[dst.value], src);
+    }
+
+    // The register to compute |value| in: its own, or rax if it lives in
+    // a spill slot.
+    Reg resultReg(uint32_t value) {
+        const Location &dst = loc(value);
+        return dst.kind == Location::Register ? Regs[dst.value] : Rax;
+    }
+
+    void aluValue(AluOp op, Reg dst, uint32_t value) {
+        const Location &src = loc(value);
+        if (src.kind == Location::Imm)
+            masm_.aluRI32(op, dst, src.value);
+        else if (src.kind == Location::Slot)
+            masm_.aluRM32(op, dst, slotMem(src.value));
+        else
+            masm_.aluRR32(op, dst, Regs[src.value]);
+    }
+
+    void imulValue(Reg dst, uint32_t value) {
+        const Location &src = loc(value);
+        if (src.kind == Location::Imm)
+            masm_.imulRRI32(dst, dst, src.value);
+        else if (src.kind == Location::Slot)
+            masm_.imulRM32(dst, slotMem(src.value));
+        else
+            masm_.imulRR32(dst, Regs[src.value]);
+    }
+
+    // Box |value| as an int32 Value in rax.
+    void boxValue(uint32_t value) {
+        const Location &src = loc(value);
+        if (src.kind == Location::Imm) {
+            masm_.movRI64(Rax,
+                (ToUInt64(ToUInt32(src.value)) << Value::Int32Shift) |
+                Value::Int32Code);
+            return;
+        }
+        loadValue(Rax, value);
+        masm_.shlRI64(Rax, Value::Int32Shift);
+        masm_.aluRI64(AluOp::Or, Rax, Value::Int32Code);
+    }
+
+    // Bail out unless the Value in rax is an int32, and unbox it.
+    void unboxInt32(uint32_t snapshot) {
+        uint64_t mask = Value::DoubleTagMask | Value::ExtNumberMask;
+        if (mask == 0xFF) {
+            masm_.cmpAlI8(Value::Int32Code);
+        } else {
+            masm_.movRI64(R11, mask);
+            masm_.aluRR64(AluOp::And, R11, Rax);
+            masm_.aluRI64(AluOp::Cmp, R11, Value::Int32Code);
+        }
+        jumpToStub(masm_.jcc(NotEqual), snapshot);
+        masm_.shrRI64(Rax, Value::Int32Shift);
+    }
+
+    void jumpToStub(uint32_t jump, uint32_t snapshot) {
+        stubJumps_.push_back({ jump, snapshot });
+    }
+
+    void jumpToBlock(uint32_t block, uint32_t nextBlock) {
+        if (block != nextBlock)
+            blockJumps_.push_back({ masm_.jmp(), block });
+    }
+
+    void compileInstr(uint32_t value, uint32_t nextBlock) {
+        const SsaInstr &instr = graph_.instr(value);
+        switch (instr.op) {
+          case SsaOp::Constant:
+            break;
+
+          case SsaOp::LoadLocal:
+            masm_.movRM64(Rax, Mem { R13, instr.imm * 8 });
+            unboxInt32(instr.snapshot);
+            storeValue(value, Rax);
+            break;
+
+          case SsaOp::StoreLocal:
+            boxValue(instr.inputs[0]);
+            masm_.movMR64(Mem { R13, instr.imm * 8 }, Rax);
+            break;
+
+          case SsaOp::LoadGlobal:
+            masm_.movRM64(R11, cellMem(instr.imm));
+            masm_.movRM64(Rax, Mem { R11, 0 });
+            unboxInt32(instr.snapshot);
+            storeValue(value, Rax);
+            break;
+
+          case SsaOp::StoreGlobal:
+            boxValue(instr.inputs[0]);
+            masm_.movRM64(R11, cellMem(instr.imm));
+            masm_.movMR64(Mem { R11, 0 }, Rax);
+            break;
+
+          case SsaOp::AddInt32:
+          case SsaOp::SubInt32:
+            {
+                Reg dst = resultReg(value);
+                loadValue(dst, instr.inputs[0]);
+                aluValue(instr.op == SsaOp::AddInt32 ? AluOp::Add
+                                                     : AluOp::Sub,
+                         dst, instr.inputs[1]);
+                jumpToStub(masm_.jcc(Overflow), instr.snapshot);
+                storeValue(value, dst);
+                break;
+            }
+
+          case SsaOp::MulInt32:
+            {
+                // A zero product with a negative operand is -0.
+                Reg dst = resultReg(value);
+                loadValue(dst, instr.inputs[0]);
+                imulValue(dst, instr.inputs[1]);
+                jumpToStub(masm_.jcc(Overflow), instr.snapshot);
+                masm_.testRR32(dst, dst);
+                uint32_t nonZero = masm_.jcc(NotEqual);
+                loadValue(R11, instr.inputs[0]);
+                aluValue(AluOp::Or, R11, instr.inputs[1]);
+                jumpToStub(masm_.jcc(Sign), instr.snapshot);
+                masm_.bind(nonZero);
+                storeValue(value, dst);
+                break;
+            }
+
+          case SsaOp::DivInt32:
+            {
+                // Division by zero, INT32_MIN / -1, 0 divided by a
+                // negative int32 (which is -0), and inexact division
+                // bail out.
+                loadValue(R11, instr.inputs[1]);
+                masm_.testRR32(R11, R11);
+                jumpToStub(masm_.jcc(Equal), instr.snapshot);
+                loadValue(Rax, instr.inputs[0]);
+                masm_.testRR32(Rax, Rax);
+                uint32_t nonZero = masm_.jcc(NotEqual);
+                masm_.testRR32(R11, R11);
+                jumpToStub(masm_.jcc(Sign), instr.snapshot);
+                masm_.bind(nonZero);
+                masm_.aluRI32(AluOp::Cmp, Rax, INT32_MIN);
+                uint32_t notMin = masm_.jcc(NotEqual);
+                masm_.aluRI32(AluOp::Cmp, R11, -1);
+                jumpToStub(masm_.jcc(Equal), instr.snapshot);
+                masm_.bind(notMin);
+                masm_.cdq();
+                masm_.idivR32(R11);
+                masm_.testRR32(Rdx, Rdx);
+                jumpToStub(masm_.jcc(NotEqual), instr.snapshot);
+                storeValue(value, Rax);
+                break;
+            }
+
+          case SsaOp::ModInt32:
+            {
+                // Only non-negative dividends and positive divisors are
+                // handled, as in VM::FastMod.
+                loadValue(Rax, instr.inputs[0]);
+                masm_.testRR32(Rax, Rax);
+                jumpToStub(masm_.jcc(Sign), instr.snapshot);
+                loadValue(R11, instr.inputs[1]);
+                masm_.testRR32(R11, R11);
+                jumpToStub(masm_.jcc(LessEqual), instr.snapshot);
+                masm_.cdq();
+                masm_.idivR32(R11);
+                storeValue(value, Rdx);
+                break;
+            }
+
+          case SsaOp::NegInt32:
+            {
+                // -0 is not an int32, so a zero input bails out.
+                Reg dst = resultReg(value);
+                loadValue(dst, instr.inputs[0]);
+                masm_.testRR32(dst, dst);
+                jumpToStub(masm_.jcc(Equal), instr.snapshot);
+                masm_.negR32(dst);
+                jumpToStub(masm_.jcc(Overflow), instr.snapshot);
+                storeValue(value, dst);
+                break;
+            }
+
+          case SsaOp::CheckInterrupt:
+            compileCheckInterrupt(instr);
+            break;
+
+          case SsaOp::Goto:
+            jumpToBlock(instr.targets[0], nextBlock);
+            break;
+
+          case SsaOp::Branch:
+            {
+                const Location &cond = loc(instr.inputs[0]);
+                if (cond.kind == Location::Imm) {
+                    jumpToBlock(instr.targets[cond.value != 0 ? 0 : 1],
+                                nextBlock);
+                    break;
+                }
+                if (cond.kind == Location::Slot)
+                    masm_.cmpMI32(slotMem(cond.value), 0);
+                else
+                    masm_.testRR32(Regs[cond.value], Regs[cond.value]);
+
+                if (instr.targets[0] == nextBlock) {
+                    blockJumps_.push_back({ masm_.jcc(Equal),
+                                            instr.targets[1] });
+                } else {
+                    blockJumps_.push_back({ masm_.jcc(NotEqual),
+                                            instr.targets[0] });
+                    jumpToBlock(instr.targets[1], nextBlock);
+                }
+                break;
+            }
+
+          case SsaOp::Exit:
+            jumpToStub(masm_.jmp(), instr.snapshot);
+            break;
+
+          default:
+            WH_UNREACHABLE("Unhandled SSA op.");
+        }
+    }
+
+    // The fast path of RunContext::checkInterrupt, calling OptLoopHead
+    // when it would handle an interrupt.  No values are live here.
+    void compileCheckInterrupt(const SsaInstr &instr) {
+        masm_.movRM64(R11, stateField(offsetof(OptState,
+                                               interruptRequested)));
+        masm_.cmpMI8(Mem { R11, 0 }, 0);
+        uint32_t requested = masm_.jcc(NotEqual);
+
+        masm_.movRM64(R11, stateField(offsetof(OptState, clockCountdown)));
+        masm_.movRM32(Rax, Mem { R11, 0 });
+        masm_.testRR32(Rax, Rax);
+        uint32_t notCounting = masm_.jcc(Equal);
+        masm_.aluRI32(AluOp::Cmp, Rax, 1);
+        uint32_t clockDue = masm_.jcc(Equal);
+        masm_.aluRI32(AluOp::Sub, Rax, 1);
+        masm_.movMR32(Mem { R11, 0 }, Rax);
+        uint32_t counted = masm_.jmp();
+
+        masm_.bind(requested);
+        masm_.bind(clockDue);
+        const DecodedOp *dop = baseline_->ops() + instr.imm;
+        masm_.movRR64(Rdi, Rbx);
+        masm_.movRI64(Rsi, reinterpret_cast<uintptr_t>(dop));
+        masm_.movRR64(Rdx, R12);
+        masm_.movRI64(Rax, reinterpret_cast<uintptr_t>(&OptLoopHead));
+        masm_.callR(Rax);
+        masm_.testRR32(Rax, Rax);
+        failJumps_.push_back(masm_.jcc(Equal));
+        masm_.aluRI32(AluOp::Cmp, Rax, 2);
+        jumpToStub(masm_.jcc(Equal), instr.snapshot);
+
+        masm_.bind(notCounting);
+        masm_.bind(counted);
+    }
+
+    void compileStubs() {
+        std::vector<uint32_t> stubOffsets(graph_.numSnapshots(), 0);
+        std::vector<bool> used(graph_.numSnapshots(), false);
+        for (const Jump &jump : stubJumps_)
+            used[jump.target] = true;
+
+        for (uint32_t k = 0; k < graph_.numSnapshots(); k++) {
+            if (!used[k])
+                continue;
+            stubOffsets[k] = masm_.size();
+            exitCalls_.push_back(masm_.call());
+            deoptPoints_.push_back({ masm_.size(),
+                                     static_cast<uint32_t>(exits_.size()) });
+            addExit(graph_.snapshot(k));
+        }
+
+        for (const Jump &jump : stubJumps_)
+            masm_.bindTo(jump.offset, stubOffsets[jump.target]);
+    }
+
+    void addExit(const SsaSnapshot &snap) {
+        const DecodedOp *ops = baseline_->ops();
+        uint32_t numOps = baseline_->numOps();
+        uint32_t pcOffset = snap.resumeOp < numOps
+                          ? ops[snap.resumeOp].pcOffset
+                          : ops[numOps - 1].pcOffset + ops[numOps - 1].length;
+        exits_.push_back({ snap.resumeOp, pcOffset,
+                           static_cast<uint32_t>(locations_.size()),
+                           snap.numValues, snap.isBailout });
+
+        // The exit pushes the registers in order, so the last is saved
+        // lowest.
+        for (uint32_t i = 0; i < snap.numValues; i++) {
+            const Location &src = loc(graph_.snapshotValue(snap, i));
+            OptCode::ValueLocation dst;
+            if (src.kind == Location::Imm) {
+                dst = { OptCode::ValueLocation::Constant, src.value };
+            } else if (src.kind == Location::Register) {
+                dst = { OptCode::ValueLocation::Register,
+                        ToInt32(NumValueRegs - 1) - src.value };
+            } else {
+                dst = { OptCode::ValueLocation::Slot, src.value };
+            }
+            locations_.push_back(dst);
+        }
+    }
+};
+
+const Reg OptCompiler::Regs[NumValueRegs] = {
+    Rcx, Rsi, Rdi, R8, R9, R10
+};
+
+bool
+OptimizingJitSupported()
+{
+    return true;
+}
+
+template <typename T>
+static void
+CopyTable(const std::vector<T> &table, uint8_t *dst)
+{
+    if (!table.empty())
+        memcpy(dst, table.data(), table.size() * sizeof(T));
+}
+
+OptCode *
+CompileOptimized(RunContext *cx, Handle<VM::Script *> script,
+                 const JitCode *code)
+{
+    TraceScope trace(TraceCategory::Compile, "opt_compile");
+
+    JitCodePool *pool = cx->threadContext()->jitCodePool();
+    if (!pool)
+        return nullptr;
+
+    // Nothing below allocates on the managed heap.
+    SsaGraph graph;
+    OptCompiler compiler(graph, code);
+    try {
+        if (!BuildSsaGraph(script, code, &graph)) {
+            SpewJitNote("Script %p has no loop to optimize", script.get());
+            return nullptr;
+        }
+        graph.eliminateDeadCode();
+        graph.spew();
+
+        if (graph.numGlobalSlots() > OptState::MaxGlobalSlots)
+            return nullptr;
+
+        compiler.compile();
+    } catch (std::bad_alloc &err) {
+        return nullptr;
+    }
+
+    // Lay out the OptCode, then its entries, exits, value locations,
+    // deopt points and global caches, then the code.
+    uint32_t numEntries = graph.numEntries();
+    const std::vector<OptCode::Exit> &exits = compiler.exits();
+    const std::vector<OptCode::ValueLocation> &locations =
+        compiler.locations();
+    const std::vector<OptCode::DeoptPoint> &deoptPoints =
+        compiler.deoptPoints();
+    const std::vector<SsaGlobalCache> &caches = graph.globalCaches();
+
+    uint32_t entriesOffset = AlignIntUp<uint32_t>(
+        sizeof(OptCode), alignof(OptCode::Entry));
+    uint32_t exitsOffset = AlignIntUp<uint32_t>(
+        entriesOffset + numEntries * sizeof(OptCode::Entry),
+        alignof(OptCode::Exit));
+    uint32_t locationsOffset = AlignIntUp<uint32_t>(
+        exitsOffset + exits.size() * sizeof(OptCode::Exit),
+        alignof(OptCode::ValueLocation));
+    uint32_t deoptPointsOffset = AlignIntUp<uint32_t>(
+        locationsOffset + locations.size() * sizeof(OptCode::ValueLocation),
+        alignof(OptCode::DeoptPoint));
+    uint32_t cachesOffset = AlignIntUp<uint32_t>(
+        deoptPointsOffset + deoptPoints.size() * sizeof(OptCode::DeoptPoint),
+        alignof(SsaGlobalCache));
+    uint32_t codeOffset = AlignIntUp<uint32_t>(
+        cachesOffset + caches.size() * sizeof(SsaGlobalCache), 16);
+
+    const OptAssembler &masm = compiler.masm();
+    uint8_t *mem = pool->allocate(codeOffset + masm.size());
+    if (!mem)
+        return nullptr;
+
+    OptCode::Entry *entries =
+        reinterpret_cast<OptCode::Entry *>(mem + entriesOffset);
+    uint32_t entry = 0;
+    for (uint32_t b = 0; b < graph.numBlocks(); b++) {
+        const SsaBlock &block = graph.block(b);
+        if (block.isEntry)
+            entries[entry++] = { block.loopHead, compiler.blockOffset(b) };
+    }
+    WH_ASSERT(entry == numEntries);
+
+    CopyTable(exits, mem + exitsOffset);
+    CopyTable(locations, mem + locationsOffset);
+    CopyTable(deoptPoints, mem + deoptPointsOffset);
+    CopyTable(caches, mem + cachesOffset);
+
+    uint8_t *codeMem = mem + codeOffset;
+    memcpy(codeMem, masm.data(), masm.size());
+
+    SpewJitNote("Optimized script %p: %u entries, %u exits, "
+                "%u bytes of code at %p",
+                script.get(), (unsigned) numEntries, (unsigned) exits.size(),
+                (unsigned) masm.size(), codeMem);
+    return new (mem) OptCode(
+        code, entries, numEntries,
+        reinterpret_cast<OptCode::Exit *>(mem + exitsOffset), exits.size(),
+        reinterpret_cast<OptCode::ValueLocation *>(mem + locationsOffset),
+        reinterpret_cast<OptCode::DeoptPoint *>(mem + deoptPointsOffset),
+        deoptPoints.size(),
+        reinterpret_cast<SsaGlobalCache *>(mem + cachesOffset),
+        caches.size(), codeMem, masm.size());
+}
+
+#else // !defined(__x86_64__)
+
+bool
+OptimizingJitSupported()
+{
+    return false;
+}
+
+OptCode *
+CompileOptimized(RunContext *cx, Handle<VM::Script *> script,
+                 const JitCode *code)
+{
+    return nullptr;
+}
+
+#endif // defined(__x86_64__)
+
+
+OptCode *
+MaybeOptimizeForLoop(RunContext *cx, Handle<VM::Script *> script,
+                     const JitCode *code, uint32_t iterations)
+{
+    if (script->optDisabled())
+        return nullptr;
+    if (script->hasOptCode())
+        return script->optCode();
+
+    uint32_t threshold = cx->threadContext()->optIterations();
+    if (!OptimizingJitSupported() || threshold == 0 ||
+        iterations < threshold)
+    {
+        return nullptr;
+    }
+
+    // Scripts which fail to optimize keep running in their baseline
+    // code, and are not tried again.
+    OptCode *optCode = CompileOptimized(cx, script, code);
+    if (!optCode) {
+        script->disableOpt();
+        return nullptr;
+    }
+    script->setOptCode(optCode);
+    return optCode;
+}
+
+
+} // namespace Interp
+} // namespace Whisper
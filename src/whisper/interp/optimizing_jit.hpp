@@ -0,0 +1,195 @@
+#ifndef WHISPER__INTERP__OPTIMIZING_JIT_HPP
+#define WHISPER__INTERP__OPTIMIZING_JIT_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "runtime.hpp"
+#include "vm/script.hpp"
+#include "interp/bytecode_ops.hpp"
+#include "interp/ssa_ir.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+class Interpreter;
+class JitCode;
+struct OptState;
+
+
+//
+// Optimizing JIT
+//
+// The optimizing JIT compiles the hot loops of a script with baseline
+// compiled code into native code specialized on the script's type
+// feedback.  The code is generated from an SSA graph of the script (see
+// SsaGraph), which keeps every value in an int32 register or spill slot
+// instead of in the frame.  Registers are allocated by a linear scan of
+// each block.
+//
+// A script is optimized once one of its loops has run |optIterations|
+// times in its baseline code (see ThreadContext::setOptIterations).
+// The baseline code then runs each loop which the graph can be entered
+// at in the optimized code, from the op after the loop's header, and
+// goes on from the op the optimized code exits at, with the stack of
+// the exit's snapshot pushed back on the frame.  Locals and globals are
+// written through by the optimized code, so the frame is otherwise
+// already up to date.
+//
+// Loop headers in the optimized code check for interrupts inline, and
+// call out to the interpreter to handle them, which may run the GC and
+// the embedding.  The code holds no values across the call, and finds
+// the cells of the globals it uses again afterward.
+//
+// Scripts whose code bails out MaxBailouts times are not optimized
+// again (see VM::Script::disableOpt), and keep running in their
+// baseline code.  Only x86-64 is supported.
+//
+// Deoptimization
+//
+// Every exit from the code, whether a failed guard, an Exit, or an
+// interrupt check finding a global deleted, calls a common routine with
+// the native frame of the code still live.  The routine saves the
+// registers which hold values, and passes the frame to
+// OptCode::deoptimize, which finds the exit by the native pc it was
+// called from, and rebuilds the interpreter's frame from the exit's
+// metadata: the bytecode pc, and the location of each stack value.
+// Arguments and locals are written through, so they are already in
+// place.  The rebuilt frame is an ordinary interpreter frame, which
+// MaterializeFrame can copy into a StackFrame.
+//
+
+//
+// OptCode
+//
+// The optimized code of a script.  Lives in a JitCodePool, after the
+// tables of its entries and exits.
+//
+class OptCode
+{
+  public:
+    typedef uint32_t (*EntryFn)(Interpreter *interp, OptState *state,
+                                const uint8_t *start);
+
+    // A loop the code can be entered at, by the index of its header.
+    struct Entry
+    {
+        uint32_t loopHead;
+        uint32_t codeOffset;
+    };
+
+    // Where an int32 value of an exit lives when the code exits: a
+    // constant, the index of a register among those saved by the exit,
+    // or a spill slot.
+    struct ValueLocation
+    {
+        enum Kind : uint8_t { Constant, Register, Slot };
+
+        Kind kind;
+        int32_t value;
+    };
+
+    // The bytecode state an exit goes on from: the op to resume at and
+    // its pc offset, and the locations of the values on its stack,
+    // bottom first.
+    struct Exit
+    {
+        uint32_t resumeOp;
+        uint32_t pcOffset;
+        uint32_t valuesStart;
+        uint32_t numValues;
+        bool isBailout;
+    };
+
+    // The offset in the code of the native pc an exit is called from.
+    struct DeoptPoint
+    {
+        uint32_t nativeOffset;
+        uint32_t exit;
+    };
+
+    static constexpr uint32_t MaxBailouts = 64;
+
+  private:
+    const JitCode *baseline_;
+    const Entry *entries_;
+    uint32_t numEntries_;
+    const Exit *exits_;
+    uint32_t numExits_;
+    const ValueLocation *locations_;
+    const DeoptPoint *deoptPoints_;
+    uint32_t numDeoptPoints_;
+    const SsaGlobalCache *globalCaches_;
+    uint32_t numGlobalCaches_;
+    const uint8_t *code_;
+    uint32_t codeSize_;
+    uint32_t bailouts_;
+
+  public:
+    OptCode(const JitCode *baseline,
+            const Entry *entries, uint32_t numEntries,
+            const Exit *exits, uint32_t numExits,
+            const ValueLocation *locations,
+            const DeoptPoint *deoptPoints, uint32_t numDeoptPoints,
+            const SsaGlobalCache *globalCaches, uint32_t numGlobalCaches,
+            const uint8_t *code, uint32_t codeSize)
+      : baseline_(baseline),
+        entries_(entries), numEntries_(numEntries),
+        exits_(exits), numExits_(numExits),
+        locations_(locations),
+        deoptPoints_(deoptPoints), numDeoptPoints_(numDeoptPoints),
+        globalCaches_(globalCaches), numGlobalCaches_(numGlobalCaches),
+        code_(code), codeSize_(codeSize),
+        bailouts_(0)
+    {}
+
+    uint32_t codeSize() const {
+        return codeSize_;
+    }
+
+    bool hasEntry(uint32_t loopHead) const;
+
+    // Run the loop with its header at op |loopHead| in the interpreter's
+    // frame, whose stack must be empty.  Sets |resumeOp| to the op to go
+    // on from in the baseline code.  Returns false on error, or if the
+    // script is interrupted.
+    bool run(RunContext *cx, Interpreter *interp, uint32_t loopHead,
+             uint32_t *resumeOp);
+
+    // The exit called from |nativePc| in the code.
+    const Exit &exitAt(const uint8_t *nativePc) const;
+
+    // Rebuild the interpreter's frame for the exit whose native frame
+    // is at |nativeFrame|: the registers saved by the exit, then the
+    // native pc it was called from, then the spill slots of the code.
+    // Pushes the exit's stack values and sets the frame's pc.  Returns
+    // the index of the exit.
+    uint32_t deoptimize(Interpreter *interp,
+                        const uint64_t *nativeFrame) const;
+
+    // Find the cells of the globals the code uses, for the frame's
+    // script.  Returns false if any has been deleted, or if caches
+    // sharing a slot no longer hold the same cell.
+    bool findCells(OptState *state) const;
+};
+
+
+// Whether the optimizing JIT can compile for this target.
+bool OptimizingJitSupported();
+
+// Get the optimized code of |script|, whose baseline compiled code is
+// |code|, and one of whose loops has just run |iterations| times.
+// Optimizes the script once the loop has run often enough.  Returns null
+// if the loop is to be run in the baseline code.
+OptCode *MaybeOptimizeForLoop(RunContext *cx, Handle<VM::Script *> script,
+                              const JitCode *code, uint32_t iterations);
+
+// Optimize |script|, whose baseline compiled code is |code|.  Returns
+// null if the script cannot be optimized, or on failure.
+OptCode *CompileOptimized(RunContext *cx, Handle<VM::Script *> script,
+                          const JitCode *code);
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__OPTIMIZING_JIT_HPP
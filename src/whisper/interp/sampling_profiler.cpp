@@ -0,0 +1,273 @@
+
+#include <new>
+#include <algorithm>
+#include <atomic>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "runtime.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/string.hpp"
+#include "vm/native_stack.hpp"
+#include "interp/interpreter.hpp"
+#include "interp/sampling_profiler.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+// The signal handler is shared by the profilers of every thread, and
+// finds its profiler through the timer's signal value.
+static pthread_mutex_t HANDLER_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static bool HANDLER_INSTALLED = false;
+
+SamplingProfiler::SamplingProfiler(ThreadContext *cx,
+                                   uint32_t intervalMicros)
+  : cx_(cx),
+    intervalMicros_(intervalMicros),
+    timerCreated_(false),
+    timer_(),
+    samples_(),
+    frames_(),
+    numSamples_(0),
+    numFrames_(0),
+    gcSamples_(0),
+    droppedSamples_(0),
+    pauseDepth_(0),
+    stacks_(),
+    totalSamples_(0)
+{
+    WH_ASSERT(intervalMicros > 0);
+}
+
+SamplingProfiler::~SamplingProfiler()
+{
+    // A deleted timer's pending signal is discarded, so the handler
+    // does not run again for this profiler.
+    if (timerCreated_)
+        timer_delete(timer_);
+}
+
+const char *
+SamplingProfiler::start()
+{
+#if defined(__linux__)
+    WH_ASSERT(!timerCreated_);
+    try {
+        samples_.resize(MaxSamples);
+        frames_.resize(MaxFrames);
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate profiler samples.";
+    }
+
+    pthread_mutex_lock(&HANDLER_LOCK);
+    if (!HANDLER_INSTALLED) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &SamplingProfiler::HandleSignal;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        HANDLER_INSTALLED = sigaction(SIGPROF, &action, nullptr) == 0;
+    }
+    bool installed = HANDLER_INSTALLED;
+    pthread_mutex_unlock(&HANDLER_LOCK);
+    if (!installed)
+        return "Could not install profiler signal handler.";
+
+    // Signal this thread only, on its own CPU time.  glibc does not
+    // name the field holding the thread id.
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_value.sival_ptr = this;
+    event._sigev_un._tid = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer_) != 0)
+        return "Could not create profiler timer.";
+    timerCreated_ = true;
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = intervalMicros_ / 1000000;
+    spec.it_interval.tv_nsec = (intervalMicros_ % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(timer_, 0, &spec, nullptr) != 0)
+        return "Could not start profiler timer.";
+    return nullptr;
+#else
+    return "Sampling profiler is only supported on Linux.";
+#endif // defined(__linux__)
+}
+
+void
+SamplingProfiler::pause()
+{
+    pauseDepth_ = pauseDepth_ + 1;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    if (pauseDepth_ == 1)
+        aggregate();
+}
+
+void
+SamplingProfiler::resume()
+{
+    WH_ASSERT(pauseDepth_ > 0);
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    pauseDepth_ = pauseDepth_ - 1;
+}
+
+/*static*/ void
+SamplingProfiler::HandleSignal(int, siginfo_t *info, void *)
+{
+    // Other sources of SIGPROF are ignored.
+    if (info->si_code != SI_TIMER || !info->si_value.sival_ptr)
+        return;
+    reinterpret_cast<SamplingProfiler *>(info->si_value.sival_ptr)
+        ->takeSample();
+}
+
+void
+SamplingProfiler::takeSample()
+{
+    if (pauseDepth_ > 0) {
+        gcSamples_ = gcSamples_ + 1;
+        return;
+    }
+
+    uint32_t sampleIndex = numSamples_;
+    uint32_t firstFrame = numFrames_;
+    if (sampleIndex == MaxSamples) {
+        droppedSamples_ = droppedSamples_ + 1;
+        return;
+    }
+
+    uint32_t depth = 0;
+    if (RunContext *runcx = cx_->activeRunContext()) {
+        const Interpreter *interp = runcx->interpreter();
+        VM::NativeFrame *frame = runcx->nativeStack().topFrame();
+        while (frame && depth < MaxStackDepth) {
+            if (firstFrame + depth == MaxFrames) {
+                droppedSamples_ = droppedSamples_ + 1;
+                return;
+            }
+
+            RawFrame &raw = frames_[firstFrame + depth];
+            raw.script = frame->script();
+            raw.op = nullptr;
+            if (interp && interp->frame() == frame)
+                raw.op = interp->curOp();
+            raw.pcOffset = frame->pcOffset();
+            depth++;
+
+            frame = frame->hasCallerFrame() ? frame->callerFrame() : nullptr;
+        }
+    }
+
+    samples_[sampleIndex].firstFrame = firstFrame;
+    samples_[sampleIndex].depth = depth;
+    numFrames_ = firstFrame + depth;
+    numSamples_ = sampleIndex + 1;
+}
+
+void
+SamplingProfiler::aggregate()
+{
+    // Scripts do not move until the samples are aggregated, so their
+    // hashes are only cached for this pass.
+    std::map<VM::Script *, uint32_t> hashes;
+    for (uint32_t i = 0; i < numSamples_; i++) {
+        const RawSample &sample = samples_[i];
+        try {
+            std::string stack;
+            if (sample.depth == 0)
+                stack = "(native)";
+            for (uint32_t j = sample.depth; j > 0; j--) {
+                if (j < sample.depth)
+                    stack += ';';
+                stack += frameName(frames_[sample.firstFrame + j - 1],
+                                   hashes);
+            }
+            stacks_[stack]++;
+        } catch (std::bad_alloc &err) {
+            droppedSamples_ = droppedSamples_ + 1;
+            continue;
+        }
+        totalSamples_++;
+    }
+
+    numFrames_ = 0;
+    numSamples_ = 0;
+}
+
+std::string
+SamplingProfiler::frameName(const RawFrame &frame,
+                            std::map<VM::Script *, uint32_t> &hashes)
+{
+    VM::Script *script = frame.script;
+    auto iter = hashes.find(script);
+    if (iter == hashes.end()) {
+        // Only the start of long bytecode is hashed, along with its
+        // length, as samples are aggregated before every collection.
+        const VM::Bytecode *bytecode = script->bytecode();
+        uint32_t length = bytecode->length();
+        uint32_t hashBytes = (length < MaxHashBytes) ? length : MaxHashBytes;
+        uint32_t hash = VM::FNVHashString(length, bytecode->data(),
+                                          hashBytes);
+        iter = hashes.insert(std::make_pair(script, hash)).first;
+    }
+
+    // The top frame's op may be stale after a collection moved its
+    // decoded ops, so it is only used if it lies in the script's ops.
+    uint32_t pcOffset = frame.pcOffset;
+    const DecodedOp *op = nullptr;
+    if (script->hasDecoded()) {
+        const VM::DecodedBytecode *decoded = script->decoded();
+        if (frame.op >= decoded->ops() && frame.op < decoded->opsEnd()) {
+            op = frame.op;
+            pcOffset = op->pcOffset;
+        } else {
+            op = decoded->opAt(pcOffset);
+            if (op == decoded->opsEnd())
+                op = nullptr;
+        }
+    }
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "script@%08x+%u[%s]",
+             (unsigned) iter->second, (unsigned) pcOffset,
+             op ? OpcodeString(op->opcode) : "?");
+    return std::string(buf);
+}
+
+void
+SamplingProfiler::print(FILE *out)
+{
+    WH_ASSERT(pauseDepth_ == 0);
+    pause();
+
+    std::vector<std::pair<uint64_t, const std::string *>> sorted;
+    sorted.reserve(stacks_.size());
+    for (const auto &entry : stacks_)
+        sorted.push_back(std::make_pair(entry.second, &entry.first));
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<uint64_t, const std::string *> &a,
+                 const std::pair<uint64_t, const std::string *> &b) {
+                  return a.first > b.first;
+              });
+
+    fprintf(out, "Sampling profile: %" PRIu64 " samples "
+                 "(interval=%uus, gc=%u, dropped=%u)\n",
+            totalSamples_, (unsigned) intervalMicros_,
+            (unsigned) gcSamples_, (unsigned) droppedSamples_);
+    for (const auto &entry : sorted)
+        fprintf(out, "%s %" PRIu64 "\n", entry.second->c_str(), entry.first);
+
+    resume();
+}
+
+
+} // namespace Interp
+} // namespace Whisper
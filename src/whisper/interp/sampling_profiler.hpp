@@ -0,0 +1,151 @@
+#ifndef WHISPER__INTERP__SAMPLING_PROFILER_HPP
+#define WHISPER__INTERP__SAMPLING_PROFILER_HPP
+
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "vm/script.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+
+class ThreadContext;
+
+namespace Interp {
+
+
+//
+// SamplingProfiler
+//
+// A statistical profiler of the scripts run by a ThreadContext.  Once
+// started, a timer on the thread's CPU time sends the thread a SIGPROF
+// every |intervalMicros| microseconds of CPU time, and the signal
+// handler records a sample of the active RunContext's native stack:
+// the script of each frame, and its pc.  The pc of the top frame is
+// the op its Interpreter is running, and that of the other frames is
+// the pc saved in the frame.
+//
+// The handler is async-signal-safe: it only reads the native stack,
+// and copies raw Script pointers and ops into buffers allocated when
+// the profiler starts.  Samples taken once the buffers are full are
+// dropped.  Raw samples are aggregated before anything moves, at the
+// start of each collection and when the profile is printed: each
+// script is identified by a hash of its bytecode's length and leading
+// bytes, and each pc by its offset and opcode.  Samples taken during a collection are counted
+// as GC time, without a stack.
+//
+// The bytecode has no source positions, so stacks are reported as
+// bytecode pcs, not source lines.
+//
+// The profiler must be started, stopped and printed by the thread
+// whose context it profiles.  Profiling is only supported on Linux.
+//
+
+class SamplingProfiler
+{
+  public:
+    static constexpr uint32_t DefaultIntervalMicros = 1000;
+    static constexpr uint32_t MaxSamples = 8192;
+    static constexpr uint32_t MaxFrames = 1 << 16;
+    static constexpr uint32_t MaxStackDepth = 64;
+    static constexpr uint32_t MaxHashBytes = 256;
+
+  private:
+    struct RawFrame
+    {
+        VM::Script *script;
+        const DecodedOp *op;
+        uint32_t pcOffset;
+    };
+
+    struct RawSample
+    {
+        uint32_t firstFrame;
+        uint32_t depth;
+    };
+
+    ThreadContext *cx_;
+    uint32_t intervalMicros_;
+    bool timerCreated_;
+    timer_t timer_;
+
+    // Written by the signal handler.
+    std::vector<RawSample> samples_;
+    std::vector<RawFrame> frames_;
+    volatile uint32_t numSamples_;
+    volatile uint32_t numFrames_;
+    volatile uint32_t gcSamples_;
+    volatile uint32_t droppedSamples_;
+
+    // While non-zero, samples count as GC time.
+    volatile sig_atomic_t pauseDepth_;
+
+    // Sample counts by stack, in the folded format of flame graph tools:
+    // frames from outermost to innermost, separated by ';'.
+    std::map<std::string, uint64_t> stacks_;
+    uint64_t totalSamples_;
+
+  public:
+    SamplingProfiler(ThreadContext *cx, uint32_t intervalMicros);
+    ~SamplingProfiler();
+
+    // Allocate the sample buffers and start the timer.  Returns an
+    // error message on failure.
+    const char *start();
+
+    uint32_t intervalMicros() const {
+        return intervalMicros_;
+    }
+
+    // Collections call these around any work which may move scripts.
+    // Pending samples are aggregated when the outermost pause begins.
+    void pause();
+    void resume();
+
+    // Print the number of samples of each stack, in the folded format,
+    // hottest first.
+    void print(FILE *out);
+
+  private:
+    static void HandleSignal(int sig, siginfo_t *info, void *ucontext);
+    void takeSample();
+
+    void aggregate();
+    std::string frameName(const RawFrame &frame,
+                          std::map<VM::Script *, uint32_t> &hashes);
+};
+
+//
+// SamplingPauseHelper pauses a sampling profiler, if there is one, for
+// its lifetime.
+//
+class SamplingPauseHelper
+{
+  private:
+    SamplingProfiler *profiler_;
+
+  public:
+    explicit SamplingPauseHelper(SamplingProfiler *profiler)
+      : profiler_(profiler)
+    {
+        if (profiler_)
+            profiler_->pause();
+    }
+
+    ~SamplingPauseHelper() {
+        if (profiler_)
+            profiler_->resume();
+    }
+};
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__SAMPLING_PROFILER_HPP
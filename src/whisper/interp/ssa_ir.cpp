@@ -0,0 +1,757 @@
+
+#include <new>
+
+#include "spew.hpp"
+#include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/global.hpp"
+#include "vm/property_cache.hpp"
+#include "vm/type_feedback.hpp"
+#include "vm/arithmetic_ops.hpp"
+#include "vm/arithmetic_ops_inlines.hpp"
+#include "interp/baseline_jit.hpp"
+#include "interp/ssa_ir.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+
+const char *
+SsaOpString(SsaOp op)
+{
+    static const char *Names[] = {
+#define NAME_(name) #name,
+        WHISPER_DEFN_SSA_OPS(NAME_)
+#undef NAME_
+    };
+    WH_ASSERT(op < SsaOp::LIMIT);
+    return Names[static_cast<unsigned>(op)];
+}
+
+
+//
+// SsaGraph
+//
+
+SsaGraph::SsaGraph()
+  : blocks_(),
+    instrs_(),
+    snapshots_(),
+    snapshotValues_(),
+    globalCaches_(),
+    numGlobalSlots_(0)
+{}
+
+uint32_t
+SsaGraph::numEntries() const
+{
+    uint32_t count = 0;
+    for (const SsaBlock &block : blocks_) {
+        if (block.isEntry)
+            count++;
+    }
+    return count;
+}
+
+void
+SsaGraph::eliminateDeadCode()
+{
+    // Values are used after they are defined, and only in the block
+    // defining them, so one backward pass finds every live value.
+    std::vector<bool> live(instrs_.size(), false);
+    for (uint32_t i = instrs_.size(); i > 0; i--) {
+        const SsaInstr &instr = instrs_[i - 1];
+        if (!instr.definesValue())
+            live[i - 1] = true;
+        if (!live[i - 1])
+            continue;
+
+        for (uint32_t j = 0; j < instr.numInputs; j++)
+            live[instr.inputs[j]] = true;
+        if (instr.snapshot != SsaInstr::NoSnapshot) {
+            const SsaSnapshot &snap = snapshots_[instr.snapshot];
+            for (uint32_t j = 0; j < snap.numValues; j++)
+                live[snapshotValue(snap, j)] = true;
+        }
+    }
+
+    for (SsaBlock &block : blocks_) {
+        uint32_t kept = 0;
+        for (uint32_t value : block.instrs) {
+            if (live[value])
+                block.instrs[kept++] = value;
+        }
+        block.instrs.resize(kept);
+    }
+}
+
+void
+SsaGraph::spew() const
+{
+#if defined(ENABLE_SPEW)
+    for (uint32_t b = 0; b < blocks_.size(); b++) {
+        const SsaBlock &block = blocks_[b];
+        SpewJitNote("Block %u: op %u%s", (unsigned) b,
+                    (unsigned) block.startOp, block.isEntry ? " entry" : "");
+
+        for (uint32_t value : block.instrs) {
+            const SsaInstr &instr = instrs_[value];
+            char buf[128];
+            int len = snprintf(buf, sizeof(buf), "  v%u = %s %d",
+                               (unsigned) value, SsaOpString(instr.op),
+                               (int) instr.imm);
+            for (uint32_t j = 0; j < instr.numInputs; j++) {
+                len += snprintf(buf + len, sizeof(buf) - len, " v%u",
+                                (unsigned) instr.inputs[j]);
+            }
+            if (instr.op == SsaOp::Goto || instr.op == SsaOp::Branch) {
+                len += snprintf(buf + len, sizeof(buf) - len, " -> b%u",
+                                (unsigned) instr.targets[0]);
+            }
+            if (instr.op == SsaOp::Branch) {
+                len += snprintf(buf + len, sizeof(buf) - len, " b%u",
+                                (unsigned) instr.targets[1]);
+            }
+            if (instr.snapshot != SsaInstr::NoSnapshot) {
+                const SsaSnapshot &snap = snapshots_[instr.snapshot];
+                snprintf(buf + len, sizeof(buf) - len, " [op %u, %u values]",
+                         (unsigned) snap.resumeOp, (unsigned) snap.numValues);
+            }
+            SpewJitNote("%s", buf);
+        }
+    }
+#endif // defined(ENABLE_SPEW)
+}
+
+
+static constexpr uint32_t NoValue = UINT32_MAX;
+static constexpr uint32_t NoBlock = UINT32_MAX;
+static constexpr uint32_t NoSlot = UINT32_MAX;
+
+//
+// SsaBuilder
+//
+// Builds the blocks of a graph from the ops of a script, starting from
+// the op after each loop header and following jumps from there.  Code
+// outside of loops is only built where it can be reached from a loop.
+//
+class SsaBuilder
+{
+  private:
+    // How an op was built.  Ops which are Unsupported, or which have
+    // NotRun, end their block with an exit at the op.
+    enum OpResult
+    {
+        Continue,
+        Terminated,
+        Unsupported,
+        NotRun
+    };
+
+    VM::Script *script_;
+    VM::TypeFeedback *feedback_;
+    VM::Tuple *caches_;
+    VM::Tuple *constants_;
+    const DecodedOp *ops_;
+    uint32_t numOps_;
+    SsaGraph *graph_;
+
+    // Whether each op starts a block, and the block starting at each op,
+    // if one has been created.
+    std::vector<bool> isLeader_;
+    std::vector<uint32_t> blockAt_;
+    std::vector<uint32_t> worklist_;
+
+    // The cell of each global slot.
+    std::vector<VM::GlobalCell *> globalCells_;
+
+    // State of the block being built: its stack, and the values of its
+    // locals and globals, where they are known.
+    uint32_t curBlock_;
+    std::vector<uint32_t> stack_;
+    std::vector<uint32_t> knownLocals_;
+    std::vector<uint32_t> knownGlobals_;
+
+    // The op being built, its stack, and whether it has stored to a
+    // local or global.
+    uint32_t curOp_;
+    std::vector<uint32_t> opStack_;
+    bool storedInOp_;
+
+    // Set if the graph cannot be built.
+    bool failed_;
+
+  public:
+    SsaBuilder(VM::Script *script, const JitCode *code, SsaGraph *graph)
+      : script_(script),
+        feedback_(script->hasTypeFeedback() ? script->typeFeedback().get()
+                                            : nullptr),
+        caches_(script->hasPropertyCaches() ? script->propertyCaches().get()
+                                            : nullptr),
+        constants_(script->constants()),
+        ops_(code->ops()),
+        numOps_(code->numOps()),
+        graph_(graph),
+        isLeader_(),
+        blockAt_(),
+        worklist_(),
+        globalCells_(),
+        curBlock_(NoBlock),
+        stack_(),
+        knownLocals_(),
+        knownGlobals_(),
+        curOp_(0),
+        opStack_(),
+        storedInOp_(false),
+        failed_(false)
+    {}
+
+    bool build() {
+        findLeaders();
+        for (uint32_t i = 0; i < numOps_; i++) {
+            if (ops_[i].opcode == Opcode::LoopHead)
+                blockFor(i + 1);
+        }
+        while (!worklist_.empty() && !failed_) {
+            uint32_t block = worklist_.back();
+            worklist_.pop_back();
+            buildBlock(block);
+        }
+        if (failed_)
+            return false;
+
+        markEntries();
+        return graph_->numEntries() > 0;
+    }
+
+  private:
+    uint32_t jumpTarget(uint32_t opIndex) const {
+        return opIndex + ops_[opIndex].operands[0].signedValue();
+    }
+
+    void findLeaders() {
+        isLeader_.assign(numOps_ + 1, false);
+        blockAt_.assign(numOps_ + 1, NoBlock);
+        isLeader_[0] = true;
+        isLeader_[numOps_] = true;
+        for (uint32_t i = 0; i < numOps_; i++) {
+            Opcode opcode = ops_[i].opcode;
+            if (IsJumpOpcode(opcode)) {
+                isLeader_[jumpTarget(i)] = true;
+                isLeader_[i + 1] = true;
+            } else if (opcode == Opcode::LoopHead) {
+                isLeader_[i] = true;
+                isLeader_[i + 1] = true;
+            }
+        }
+    }
+
+    uint32_t blockFor(uint32_t startOp) {
+        WH_ASSERT(startOp <= numOps_);
+        if (blockAt_[startOp] != NoBlock)
+            return blockAt_[startOp];
+
+        SsaBlock block;
+        block.startOp = startOp;
+        block.loopHead = SsaBlock::NoLoopHead;
+        if (startOp > 0 && ops_[startOp - 1].opcode == Opcode::LoopHead)
+            block.loopHead = startOp - 1;
+        block.isEntry = false;
+
+        uint32_t index = graph_->blocks_.size();
+        graph_->blocks_.push_back(block);
+        blockAt_[startOp] = index;
+        worklist_.push_back(index);
+        return index;
+    }
+
+    void buildBlock(uint32_t block) {
+        curBlock_ = block;
+        stack_.clear();
+        knownLocals_.assign(script_->numLocals(), NoValue);
+        knownGlobals_.assign(globalCells_.size(), NoValue);
+
+        uint32_t startOp = graph_->blocks_[block].startOp;
+        for (uint32_t i = startOp; ; i++) {
+            if (i == numOps_ || (i != startOp && isLeader_[i])) {
+                // Fall through to the next block, if the stack allows.
+                if (i == numOps_ || !stack_.empty()) {
+                    curOp_ = i;
+                    opStack_ = stack_;
+                    storedInOp_ = false;
+                    endWithExit(false);
+                } else {
+                    jump(blockFor(i));
+                }
+                return;
+            }
+
+            curOp_ = i;
+            opStack_ = stack_;
+            storedInOp_ = false;
+
+            OpResult result;
+            if (IsFusedOpcode(ops_[i].opcode)) {
+                DecodedOp first;
+                DecodedOp second;
+                SplitFusedOp(ops_[i], &first, &second);
+                result = buildOp(first);
+                if (result == Continue)
+                    result = buildOp(second);
+            } else {
+                result = buildOp(ops_[i]);
+            }
+
+            if (result == Terminated)
+                return;
+            if (result != Continue) {
+                endWithExit(result == NotRun);
+                return;
+            }
+        }
+    }
+
+    OpResult buildOp(const DecodedOp &dop) {
+        switch (dop.opcode) {
+          case Opcode::Nop:
+            return Continue;
+
+          case Opcode::Pop:
+            if (stack_.empty())
+                return Unsupported;
+            stack_.pop_back();
+            return Continue;
+
+          case Opcode::PushInt8:
+          case Opcode::PushInt16:
+          case Opcode::PushInt24:
+          case Opcode::PushInt32:
+            stack_.push_back(constant(dop.operands[0].signedValue()));
+            return Continue;
+
+          case Opcode::Push:
+            {
+                uint32_t value;
+                if (!readOperand(dop.operands[0], &value))
+                    return Unsupported;
+                stack_.push_back(value);
+                return Continue;
+            }
+
+          case Opcode::Add_SSS: case Opcode::Add_SSV:
+          case Opcode::Add_SVS: case Opcode::Add_SVV:
+          case Opcode::Add_VSS: case Opcode::Add_VSV:
+          case Opcode::Add_VVS: case Opcode::Add_VVV:
+            return buildBinary<VM::FastAdd>(dop, Opcode::Add_SSS,
+                                            SsaOp::AddInt32);
+
+          case Opcode::Sub_SSS: case Opcode::Sub_SSV:
+          case Opcode::Sub_SVS: case Opcode::Sub_SVV:
+          case Opcode::Sub_VSS: case Opcode::Sub_VSV:
+          case Opcode::Sub_VVS: case Opcode::Sub_VVV:
+            return buildBinary<VM::FastSub>(dop, Opcode::Sub_SSS,
+                                            SsaOp::SubInt32);
+
+          case Opcode::Mul_SSS: case Opcode::Mul_SSV:
+          case Opcode::Mul_SVS: case Opcode::Mul_SVV:
+          case Opcode::Mul_VSS: case Opcode::Mul_VSV:
+          case Opcode::Mul_VVS: case Opcode::Mul_VVV:
+            return buildBinary<VM::FastMul>(dop, Opcode::Mul_SSS,
+                                            SsaOp::MulInt32);
+
+          case Opcode::Div_SSS: case Opcode::Div_SSV:
+          case Opcode::Div_SVS: case Opcode::Div_SVV:
+          case Opcode::Div_VSS: case Opcode::Div_VSV:
+          case Opcode::Div_VVS: case Opcode::Div_VVV:
+            return buildBinary<VM::FastDiv>(dop, Opcode::Div_SSS,
+                                            SsaOp::DivInt32);
+
+          case Opcode::Mod_SSS: case Opcode::Mod_SSV:
+          case Opcode::Mod_SVS: case Opcode::Mod_SVV:
+          case Opcode::Mod_VSS: case Opcode::Mod_VSV:
+          case Opcode::Mod_VVS: case Opcode::Mod_VVV:
+            return buildBinary<VM::FastMod>(dop, Opcode::Mod_SSS,
+                                            SsaOp::ModInt32);
+
+          case Opcode::Neg_SS: case Opcode::Neg_SV:
+          case Opcode::Neg_VS: case Opcode::Neg_VV:
+            return buildNeg(dop);
+
+          case Opcode::GetGlobal:
+            {
+                uint32_t slot = globalSlot(dop);
+                if (slot == NoSlot)
+                    return NotRun;
+                stack_.push_back(loadGlobal(slot));
+                return Continue;
+            }
+
+          case Opcode::SetGlobal:
+            {
+                uint32_t slot = globalSlot(dop);
+                if (slot == NoSlot)
+                    return NotRun;
+                if (stack_.empty())
+                    return Unsupported;
+                storeGlobal(slot, stack_.back());
+                return Continue;
+            }
+
+          case Opcode::Jump:
+            if (!stack_.empty())
+                return Unsupported;
+            jump(blockFor(jumpTarget(curOp_)));
+            return Terminated;
+
+          case Opcode::JumpIfFalse:
+          case Opcode::JumpIfTrue:
+            return buildBranch(dop);
+
+          case Opcode::LoopHead:
+            buildLoopHead();
+            return Terminated;
+
+          default:
+            return Unsupported;
+        }
+    }
+
+    template <VM::FastBinaryOp Fast>
+    OpResult buildBinary(const DecodedOp &dop, Opcode baseOp, SsaOp op) {
+        uint8_t types = feedback_ ? feedback_->typesAt(dop.pcOffset) : 0;
+        if (types == 0)
+            return NotRun;
+        if (types != VM::TypeFeedback::Int32)
+            return Unsupported;
+
+        OperandLocation lhsLoc;
+        OperandLocation rhsLoc;
+        OperandLocation outLoc;
+        ReadBinaryOperandLocations(dop, baseOp, &lhsLoc, &rhsLoc, &outLoc);
+        if (!outLoc.isLocal() && !outLoc.isStackTop())
+            return Unsupported;
+
+        // The rhs is popped first, as in the interpreter.
+        uint32_t rhs;
+        uint32_t lhs;
+        if (!readOperand(rhsLoc, &rhs) || !readOperand(lhsLoc, &lhs))
+            return Unsupported;
+
+        uint32_t result;
+        const SsaInstr &lhsInstr = graph_->instrs_[lhs];
+        const SsaInstr &rhsInstr = graph_->instrs_[rhs];
+        if (lhsInstr.op == SsaOp::Constant && rhsInstr.op == SsaOp::Constant) {
+            Value folded;
+            if (!Fast(Value::Int32(lhsInstr.imm), Value::Int32(rhsInstr.imm),
+                      &folded) || !folded.isInt32())
+            {
+                return Unsupported;
+            }
+            result = constant(folded.int32Value());
+        } else {
+            SsaInstr instr(op, 0);
+            instr.numInputs = 2;
+            instr.inputs[0] = lhs;
+            instr.inputs[1] = rhs;
+            instr.snapshot = bailoutSnapshot();
+            result = addInstr(instr);
+        }
+
+        writeOperand(outLoc, result);
+        return Continue;
+    }
+
+    OpResult buildNeg(const DecodedOp &dop) {
+        uint8_t types = feedback_ ? feedback_->typesAt(dop.pcOffset) : 0;
+        if (types == 0)
+            return NotRun;
+        if (types != VM::TypeFeedback::Int32)
+            return Unsupported;
+
+        OperandLocation inLoc;
+        OperandLocation outLoc;
+        ReadUnaryOperandLocations(dop, Opcode::Neg_SS, &inLoc, &outLoc);
+        if (!outLoc.isLocal() && !outLoc.isStackTop())
+            return Unsupported;
+
+        uint32_t input;
+        if (!readOperand(inLoc, &input))
+            return Unsupported;
+
+        uint32_t result;
+        const SsaInstr &inInstr = graph_->instrs_[input];
+        if (inInstr.op == SsaOp::Constant) {
+            Value folded;
+            if (!VM::FastNeg(Value::Int32(inInstr.imm), &folded) ||
+                !folded.isInt32())
+            {
+                return Unsupported;
+            }
+            result = constant(folded.int32Value());
+        } else {
+            SsaInstr instr(SsaOp::NegInt32, 0);
+            instr.numInputs = 1;
+            instr.inputs[0] = input;
+            instr.snapshot = bailoutSnapshot();
+            result = addInstr(instr);
+        }
+
+        writeOperand(outLoc, result);
+        return Continue;
+    }
+
+    OpResult buildBranch(const DecodedOp &dop) {
+        if (stack_.empty())
+            return Unsupported;
+        uint32_t cond = stack_.back();
+        stack_.pop_back();
+        if (!stack_.empty())
+            return Unsupported;
+
+        // Values are int32s, which are true if they are non-zero.
+        uint32_t target = blockFor(jumpTarget(curOp_));
+        uint32_t next = blockFor(curOp_ + 1);
+        uint32_t ifTrue = (dop.opcode == Opcode::JumpIfTrue) ? target : next;
+        uint32_t ifFalse = (dop.opcode == Opcode::JumpIfTrue) ? next : target;
+
+        const SsaInstr &condInstr = graph_->instrs_[cond];
+        if (condInstr.op == SsaOp::Constant) {
+            jump(condInstr.imm != 0 ? ifTrue : ifFalse);
+            return Terminated;
+        }
+
+        SsaInstr instr(SsaOp::Branch, 0);
+        instr.numInputs = 1;
+        instr.inputs[0] = cond;
+        instr.targets[0] = ifTrue;
+        instr.targets[1] = ifFalse;
+        addInstr(instr);
+        return Terminated;
+    }
+
+    // The header has already been run when a loop is entered, so the
+    // interrupt check resumes after it.
+    void buildLoopHead() {
+        WH_ASSERT(stack_.empty());
+        SsaInstr check(SsaOp::CheckInterrupt, ToInt32(curOp_));
+        check.snapshot = snapshot(curOp_ + 1, stack_, false);
+        addInstr(check);
+        knownGlobals_.assign(globalCells_.size(), NoValue);
+        jump(blockFor(curOp_ + 1));
+    }
+
+    bool readOperand(const OperandLocation &loc, uint32_t *value) {
+        switch (loc.space()) {
+          case OperandSpace::Immediate:
+            *value = constant(loc.isSigned() ? loc.signedValue()
+                                             : ToInt32(loc.unsignedValue()));
+            return true;
+
+          case OperandSpace::Constant:
+            {
+                if (!constants_)
+                    return false;
+                Value val = constants_->get(loc.constantIndex());
+                if (!val.isInt32())
+                    return false;
+                *value = constant(val.int32Value());
+                return true;
+            }
+
+          case OperandSpace::Local:
+            if (loc.localIndex() >= knownLocals_.size())
+                return false;
+            *value = loadLocal(loc.localIndex());
+            return true;
+
+          case OperandSpace::Stack:
+            if (loc.stackIndex() >= stack_.size())
+                return false;
+            *value = stack_[stack_.size() - (loc.stackIndex() + 1)];
+            return true;
+
+          case OperandSpace::StackTop:
+            if (stack_.empty())
+                return false;
+            *value = stack_.back();
+            stack_.pop_back();
+            return true;
+
+          default:
+            return false;
+        }
+    }
+
+    void writeOperand(const OperandLocation &loc, uint32_t value) {
+        if (loc.isLocal()) {
+            storeLocal(loc.localIndex(), value);
+            return;
+        }
+        WH_ASSERT(loc.isStackTop());
+        stack_.push_back(value);
+    }
+
+    uint32_t addInstr(const SsaInstr &instr) {
+        uint32_t value = graph_->instrs_.size();
+        graph_->instrs_.push_back(instr);
+        graph_->blocks_[curBlock_].instrs.push_back(value);
+        return value;
+    }
+
+    uint32_t constant(int32_t val) {
+        return addInstr(SsaInstr(SsaOp::Constant, val));
+    }
+
+    uint32_t loadLocal(uint32_t index) {
+        WH_ASSERT(index < knownLocals_.size());
+        if (knownLocals_[index] == NoValue) {
+            SsaInstr instr(SsaOp::LoadLocal, ToInt32(index));
+            instr.snapshot = bailoutSnapshot();
+            knownLocals_[index] = addInstr(instr);
+        }
+        return knownLocals_[index];
+    }
+
+    void storeLocal(uint32_t index, uint32_t value) {
+        if (index >= knownLocals_.size()) {
+            failed_ = true;
+            return;
+        }
+        SsaInstr instr(SsaOp::StoreLocal, ToInt32(index));
+        instr.numInputs = 1;
+        instr.inputs[0] = value;
+        addInstr(instr);
+        knownLocals_[index] = value;
+        storedInOp_ = true;
+    }
+
+    // The slot of the global of the GetGlobal or SetGlobal |dop|, or
+    // NoSlot if its cell is not cached.
+    uint32_t globalSlot(const DecodedOp &dop) {
+        uint32_t cacheIndex = ToUInt32(dop.operands[1].signedValue());
+        VM::GlobalCell *cell = caches_
+            ? VM::PropertyCache::LookupGlobal(caches_, cacheIndex)
+            : nullptr;
+        if (!cell)
+            return NoSlot;
+
+        for (const SsaGlobalCache &cache : graph_->globalCaches_) {
+            if (cache.cacheIndex == cacheIndex)
+                return cache.slot;
+        }
+
+        uint32_t slot = 0;
+        while (slot < globalCells_.size() && globalCells_[slot] != cell)
+            slot++;
+        if (slot == globalCells_.size()) {
+            globalCells_.push_back(cell);
+            knownGlobals_.push_back(NoValue);
+            graph_->numGlobalSlots_ = globalCells_.size();
+        }
+        graph_->globalCaches_.push_back({ cacheIndex, slot });
+        return slot;
+    }
+
+    uint32_t loadGlobal(uint32_t slot) {
+        if (knownGlobals_[slot] == NoValue) {
+            SsaInstr instr(SsaOp::LoadGlobal, ToInt32(slot));
+            instr.snapshot = bailoutSnapshot();
+            knownGlobals_[slot] = addInstr(instr);
+        }
+        return knownGlobals_[slot];
+    }
+
+    void storeGlobal(uint32_t slot, uint32_t value) {
+        SsaInstr instr(SsaOp::StoreGlobal, ToInt32(slot));
+        instr.numInputs = 1;
+        instr.inputs[0] = value;
+        addInstr(instr);
+        knownGlobals_[slot] = value;
+        storedInOp_ = true;
+    }
+
+    uint32_t snapshot(uint32_t resumeOp, const std::vector<uint32_t> &values,
+                      bool isBailout)
+    {
+        // Resuming at an op which has already stored would run the store
+        // twice.  No fused op stores before it can bail out.
+        if (storedInOp_)
+            failed_ = true;
+
+        SsaSnapshot snap;
+        snap.resumeOp = resumeOp;
+        snap.valuesStart = graph_->snapshotValues_.size();
+        snap.numValues = values.size();
+        snap.isBailout = isBailout;
+        graph_->snapshotValues_.insert(graph_->snapshotValues_.end(),
+                                       values.begin(), values.end());
+        graph_->snapshots_.push_back(snap);
+        return graph_->snapshots_.size() - 1;
+    }
+
+    uint32_t bailoutSnapshot() {
+        return snapshot(curOp_, opStack_, true);
+    }
+
+    void endWithExit(bool isBailout) {
+        SsaInstr instr(SsaOp::Exit, 0);
+        instr.snapshot = snapshot(curOp_, opStack_, isBailout);
+        addInstr(instr);
+    }
+
+    void jump(uint32_t block) {
+        SsaInstr instr(SsaOp::Goto, 0);
+        instr.targets[0] = block;
+        addInstr(instr);
+    }
+
+    // A loop spans its header and every op up to its last back edge.
+    void markEntries() {
+        std::vector<uint32_t> loopEnd(numOps_, 0);
+        for (uint32_t i = 0; i < numOps_; i++) {
+            if (!IsJumpOpcode(ops_[i].opcode))
+                continue;
+            uint32_t target = jumpTarget(i);
+            if (target < i && ops_[target].opcode == Opcode::LoopHead)
+                loopEnd[target] = i;
+        }
+
+        for (SsaBlock &block : graph_->blocks_) {
+            if (block.loopHead == SsaBlock::NoLoopHead)
+                continue;
+            uint32_t head = block.loopHead;
+            uint32_t end = loopEnd[head];
+            if (end == 0)
+                continue;
+
+            block.isEntry = true;
+            for (const SsaInstr &instr : graph_->instrs_) {
+                if (instr.op != SsaOp::Exit)
+                    continue;
+                const SsaSnapshot &snap = graph_->snapshots_[instr.snapshot];
+                if (!snap.isBailout && snap.resumeOp >= head &&
+                    snap.resumeOp <= end)
+                {
+                    block.isEntry = false;
+                    break;
+                }
+            }
+        }
+    }
+};
+
+bool
+BuildSsaGraph(VM::Script *script, const JitCode *code, SsaGraph *graph)
+{
+    try {
+        SsaBuilder builder(script, code, graph);
+        return builder.build();
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+}
+
+
+} // namespace Interp
+} // namespace Whisper
@@ -0,0 +1,234 @@
+#ifndef WHISPER__INTERP__SSA_IR_HPP
+#define WHISPER__INTERP__SSA_IR_HPP
+
+#include <vector>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "vm/script.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+namespace Interp {
+
+class JitCode;
+
+
+//
+// SSA IR
+//
+// The optimizing JIT (see OptCode) compiles a script from an SSA graph
+// built from the ops of its baseline compiled code.  Each instruction
+// defining a value is the only definition of that value, and values are
+// named by the index of their instruction in the graph.
+//
+// Every value is an unboxed int32.  The builder specializes ops on the
+// script's type feedback (see VM::TypeFeedback): arithmetic ops which
+// have only seen int32 operands become int32 instructions, and reads of
+// locals and globals check that they hold an int32.  These guards, and
+// arithmetic which overflows or has a result which is not an int32,
+// bail out: the baseline code goes on from the start of the op, with
+// the op's stack rebuilt in the frame from the instruction's snapshot.
+// Ops which cannot be specialized, such as property ops and arithmetic
+// which has seen other types, end their block with an Exit, which goes
+// on in the baseline code the same way.
+//
+// Locals and globals are written through to the frame and to their
+// cells by every store, so that a snapshot only holds the op's stack.
+// Within a block, loads are forwarded from earlier loads and stores,
+// except that globals are reloaded after an interrupt check, which may
+// run the embedding.  Values do not cross blocks: the bytecode
+// generator only jumps between statements, so the stack is empty at
+// jumps and jump targets, and the builder ends a block with an Exit
+// where it is not.
+//
+// Blocks start at jump targets and after jumps.  The op after each loop
+// header also starts a block, where the graph can be entered from the
+// baseline code once the header has been run.
+//
+
+#define WHISPER_DEFN_SSA_OPS(_) \
+    _(Constant)                 \
+    _(LoadLocal)                \
+    _(StoreLocal)               \
+    _(LoadGlobal)               \
+    _(StoreGlobal)              \
+    _(AddInt32)                 \
+    _(SubInt32)                 \
+    _(MulInt32)                 \
+    _(DivInt32)                 \
+    _(ModInt32)                 \
+    _(NegInt32)                 \
+    _(CheckInterrupt)           \
+    _(Goto)                     \
+    _(Branch)                   \
+    _(Exit)
+
+enum class SsaOp : uint8_t
+{
+#define ENUM_(name) name,
+    WHISPER_DEFN_SSA_OPS(ENUM_)
+#undef ENUM_
+    LIMIT
+};
+
+const char *SsaOpString(SsaOp op);
+
+
+//
+// An instruction of an SsaGraph.
+//
+// |imm| is the value of a Constant, the index of the local of a
+// LoadLocal or StoreLocal, and the global slot of a LoadGlobal or
+// StoreGlobal (see SsaGraph::globalCaches).  A CheckInterrupt holds the
+// index of its loop header op.  |targets| are the successor blocks of a
+// Goto, and of a Branch, which goes to its first target if its input is
+// non-zero.  Instructions which may bail out, interrupt checks, and
+// exits have a snapshot.
+//
+struct SsaInstr
+{
+    static constexpr uint32_t NoSnapshot = UINT32_MAX;
+
+    SsaOp op;
+    uint8_t numInputs;
+    uint32_t inputs[2];
+    int32_t imm;
+    uint32_t snapshot;
+    uint32_t targets[2];
+
+    SsaInstr(SsaOp op, int32_t imm)
+      : op(op), numInputs(0), imm(imm), snapshot(NoSnapshot)
+    {
+        inputs[0] = inputs[1] = 0;
+        targets[0] = targets[1] = 0;
+    }
+
+    // Whether the instruction defines a value.  Instructions which do
+    // not are kept even if nothing depends on them.
+    bool definesValue() const {
+        return op <= SsaOp::NegInt32 && op != SsaOp::StoreLocal &&
+               op != SsaOp::StoreGlobal;
+    }
+
+    bool isTerminator() const {
+        return op == SsaOp::Goto || op == SsaOp::Branch || op == SsaOp::Exit;
+    }
+};
+
+//
+// A snapshot is the state to go on from in the baseline code: the op to
+// resume at, and the values on the stack, bottom first.  Snapshots of
+// guards are bailouts, as are those of exits at ops which have not run
+// yet, and so have no type feedback or cached global cell.  Other exits,
+// and interrupt checks which find a global they use deleted, are not.
+// Bailouts are counted, and loops whose bodies may take other exits are
+// not entered (see SsaBlock).
+//
+struct SsaSnapshot
+{
+    uint32_t resumeOp;
+    uint32_t valuesStart;
+    uint32_t numValues;
+    bool isBailout;
+};
+
+struct SsaBlock
+{
+    static constexpr uint32_t NoLoopHead = UINT32_MAX;
+
+    // The index of the first op of the block.
+    uint32_t startOp;
+
+    // For blocks starting after a loop header, the index of the header
+    // op, and whether the graph can be entered at the block.  Loops
+    // with an exit other than a bailout in their body are not entered,
+    // as they would likely leave the optimized code on every iteration.
+    uint32_t loopHead;
+    bool isEntry;
+
+    std::vector<uint32_t> instrs;
+};
+
+// A global read or written by the graph: the inline cache of one of its
+// ops, and the slot of the global's cell.  Caches holding the same cell
+// when the graph is built share a slot.
+struct SsaGlobalCache
+{
+    uint32_t cacheIndex;
+    uint32_t slot;
+};
+
+
+class SsaGraph
+{
+  friend class SsaBuilder;
+  private:
+    std::vector<SsaBlock> blocks_;
+    std::vector<SsaInstr> instrs_;
+    std::vector<SsaSnapshot> snapshots_;
+    std::vector<uint32_t> snapshotValues_;
+
+    std::vector<SsaGlobalCache> globalCaches_;
+    uint32_t numGlobalSlots_;
+
+  public:
+    SsaGraph();
+
+    uint32_t numBlocks() const {
+        return blocks_.size();
+    }
+    const SsaBlock &block(uint32_t index) const {
+        WH_ASSERT(index < blocks_.size());
+        return blocks_[index];
+    }
+
+    uint32_t numInstrs() const {
+        return instrs_.size();
+    }
+    const SsaInstr &instr(uint32_t value) const {
+        WH_ASSERT(value < instrs_.size());
+        return instrs_[value];
+    }
+
+    uint32_t numSnapshots() const {
+        return snapshots_.size();
+    }
+    const SsaSnapshot &snapshot(uint32_t index) const {
+        WH_ASSERT(index < snapshots_.size());
+        return snapshots_[index];
+    }
+    uint32_t snapshotValue(const SsaSnapshot &snapshot, uint32_t i) const {
+        WH_ASSERT(i < snapshot.numValues);
+        return snapshotValues_[snapshot.valuesStart + i];
+    }
+
+    const std::vector<SsaGlobalCache> &globalCaches() const {
+        return globalCaches_;
+    }
+    uint32_t numGlobalSlots() const {
+        return numGlobalSlots_;
+    }
+
+    uint32_t numEntries() const;
+
+    // Remove instructions whose values are unused, and which have no
+    // effect.  Guards are removed with them: the ops they specialize
+    // have no effect either, whatever their operands.
+    void eliminateDeadCode();
+
+    void spew() const;
+};
+
+
+// Build the graph of |script|, whose baseline compiled code is |code|.
+// Returns false if none of the script's loops can be entered, or on
+// OOM.
+bool BuildSsaGraph(VM::Script *script, const JitCode *code,
+                   SsaGraph *graph);
+
+
+} // namespace Interp
+} // namespace Whisper
+
+#endif // WHISPER__INTERP__SSA_IR_HPP
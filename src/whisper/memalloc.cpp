@@ -61,5 +61,68 @@ ReleaseMappedMemory(void *ptr, size_t bytes)
     return true;
 }
 
+void *
+AllocateAlignedMappedMemory(size_t bytes, size_t align, bool hugePages)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+#ifdef MAP_HUGETLB
+    // Huge page mappings are aligned to the huge page size.
+    if (hugePages) {
+        void *result = mmap(nullptr, bytes, prot, flags | MAP_HUGETLB, -1, 0);
+        if (result != MAP_FAILED &&
+            (reinterpret_cast<uintptr_t>(result) & (align - 1)) == 0)
+        {
+            SpewMemoryNote("AllocateAlignedMappedMemory mapped %ld bytes "
+                           "at %p (hugetlb)", (long)bytes, result);
+            return result;
+        }
+        if (result != MAP_FAILED)
+            munmap(result, bytes);
+    }
+#endif
+
+    // Over-allocate, and trim the unaligned ends.
+    size_t mapSize = bytes + align;
+    void *mapped = mmap(nullptr, mapSize, prot, flags, -1, 0);
+    if (mapped == MAP_FAILED) {
+        SpewMemoryError("AllocateAlignedMappedMemory failed to map %ld bytes",
+                        (long)mapSize);
+        return nullptr;
+    }
+
+    uint8_t *base = reinterpret_cast<uint8_t *>(mapped);
+    uint8_t *result = reinterpret_cast<uint8_t *>(
+        (reinterpret_cast<uintptr_t>(base) + (align - 1)) & ~(align - 1));
+    if (result > base)
+        munmap(base, result - base);
+    if (base + mapSize > result + bytes)
+        munmap(result + bytes, (base + mapSize) - (result + bytes));
+
+#ifdef MADV_HUGEPAGE
+    if (hugePages && madvise(result, bytes, MADV_HUGEPAGE) != 0) {
+        SpewMemoryWarn("AllocateAlignedMappedMemory could not request "
+                       "huge pages at %p", result);
+    }
+#endif
+
+    SpewMemoryNote("AllocateAlignedMappedMemory mapped %ld bytes at %p "
+                   "(huge=%s)", (long)bytes, result, hugePages?"yes":"no");
+    return result;
+}
+
+bool
+DiscardMappedMemory(void *ptr, size_t bytes)
+{
+    SpewMemoryNote("DiscardMappedMemory discarding %ld bytes at %p",
+                   (long)bytes, ptr);
+    if (madvise(ptr, bytes, MADV_DONTNEED) != 0) {
+        SpewMemoryError("DiscardMappedMemory failed to discard %p.", ptr);
+        return false;
+    }
+    return true;
+}
+
 
 } // namespace Whisper
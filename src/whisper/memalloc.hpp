@@ -23,6 +23,21 @@ void ReleaseMemory(void *ptr);
 void *AllocateMappedMemory(size_t bytes, bool allowExec=false);
 bool ReleaseMappedMemory(void *ptr, size_t bytes);
 
+// Allocates an amount of mmap-ed memory aligned to |align|, which must
+// be a power of two multiple of the page size.  If |hugePages| is set,
+// the memory is backed by huge pages where the system allows it: with
+// MAP_HUGETLB if huge pages are reserved, or else by asking for
+// transparent huge pages.  The memory is released with
+// ReleaseMappedMemory(ptr, bytes).
+//
+// Returns NULL on failure.
+void *AllocateAlignedMappedMemory(size_t bytes, size_t align,
+                                  bool hugePages=false);
+
+// Gives the pages of a range of mmap-ed memory back to the system,
+// leaving the range mapped.  The range reads as zeroes afterward.
+bool DiscardMappedMemory(void *ptr, size_t bytes);
+
 
 
 } // namespace Whisper
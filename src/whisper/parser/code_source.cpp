@@ -4,14 +4,50 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <fstream>
 #include <algorithm>
+#include <new>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+# define WHISPER_SOURCE_SCAN_SSE2 1
+# include <emmintrin.h>
+#endif
+
+#include "helpers.hpp"
 #include "code_source.hpp"
 
 namespace Whisper {
 
 
+//
+// SourceData
+//
+
+SourceData::SourceData(void *base, uint32_t size)
+  : base_(base),
+    size_(size),
+    refs_(1)
+{}
+
+SourceData::~SourceData()
+{
+    munmap(base_, size_);
+}
+
+void
+SourceData::retain()
+{
+    refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+SourceData::release()
+{
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
+
 //
 // CodeSource
 //
@@ -47,6 +83,18 @@ CodeSource::dataEnd() const
     return dataEnd_;
 }
 
+SourceData *
+CodeSource::retainData() const
+{
+    return nullptr;
+}
+
+bool
+CodeSource::readMore()
+{
+    return false;
+}
+
 //
 // FileCodeSource
 //
@@ -67,9 +115,11 @@ FileCodeSource::finalize()
     if (fd_ == -1)
         return;
 
-    // unmap the file if needed.
-    if (data_ != nullptr)
-        munmap(const_cast<uint8_t *>(data_), dataSize_);
+    // unmap the file if needed.  Strings may still hold the mapping.
+    if (mapping_ != nullptr) {
+        mapping_->release();
+        mapping_ = nullptr;
+    }
 
     close(fd_);
 #if defined(ENABLE_DEBUG)
@@ -119,12 +169,28 @@ FileCodeSource::initialize()
         error_ = "Could not mmap.";
         return false;
     }
+    try {
+        mapping_ = new SourceData(data, dataSize_);
+    } catch (std::bad_alloc &err) {
+        munmap(data, dataSize_);
+        finalize();
+        error_ = "Could not allocate source mapping.";
+        return false;
+    }
     data_ = reinterpret_cast<uint8_t *>(data);
     dataEnd_ = data_ + dataSize_;
 
     return true;
 }
 
+SourceData *
+FileCodeSource::retainData() const
+{
+    if (mapping_ != nullptr)
+        mapping_->retain();
+    return mapping_;
+}
+
 bool
 FileCodeSource::hasError() const
 {
@@ -138,6 +204,112 @@ FileCodeSource::error() const
     return error_;
 }
 
+//
+// StreamCodeSource
+//
+
+StreamCodeSource::StreamCodeSource(const char *name, int fd,
+                                   uint32_t maxSize)
+  : CodeSource(name),
+    fd_(fd),
+    maxSize_(maxSize)
+{
+    data_ = dataEnd_ = nullptr;
+    dataSize_ = 0;
+}
+
+StreamCodeSource::~StreamCodeSource()
+{
+    if (data_ != nullptr)
+        munmap(const_cast<uint8_t *>(data_), mapped_);
+}
+
+bool
+StreamCodeSource::initialize()
+{
+    WH_ASSERT(data_ == nullptr);
+
+    // Reserve the address space without backing it.  Pages are made
+    // accessible as they are read into.
+    mapped_ = AlignIntUp<uint32_t>(maxSize_, sysconf(_SC_PAGESIZE));
+    void *data = mmap(NULL, mapped_, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+        error_ = "Could not reserve memory.";
+        return false;
+    }
+    data_ = dataEnd_ = reinterpret_cast<uint8_t *>(data);
+    return true;
+}
+
+bool
+StreamCodeSource::readMore()
+{
+    WH_ASSERT(data_ != nullptr);
+    if (atEof_)
+        return false;
+
+    if (dataSize_ == accessible_) {
+        if (accessible_ == mapped_) {
+            atEof_ = true;
+            error_ = "Input too large.";
+            return false;
+        }
+
+        uint32_t size = Min<uint32_t>(ChunkSize, mapped_ - accessible_);
+        uint8_t *chunk = const_cast<uint8_t *>(data_) + accessible_;
+        if (mprotect(chunk, size, PROT_READ | PROT_WRITE) != 0) {
+            atEof_ = true;
+            error_ = "Could not commit memory.";
+            return false;
+        }
+        accessible_ += size;
+    }
+
+    ssize_t count;
+    do {
+        count = read(fd_, const_cast<uint8_t *>(dataEnd_),
+                     accessible_ - dataSize_);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        atEof_ = true;
+        if (count < 0)
+            error_ = "Could not read.";
+        return false;
+    }
+
+    dataSize_ += count;
+    dataEnd_ += count;
+    return true;
+}
+
+bool
+StreamCodeSource::hasError() const
+{
+    return error_;
+}
+
+const char *
+StreamCodeSource::error() const
+{
+    WH_ASSERT(hasError());
+    return error_;
+}
+
+//
+// MemoryCodeSource
+//
+
+MemoryCodeSource::MemoryCodeSource(const char *name, const uint8_t *text,
+                                   uint32_t size)
+  : CodeSource(name)
+{
+    data_ = text;
+    dataSize_ = size;
+    dataEnd_ = text + size;
+}
+
 //
 // SourceStream
 //
@@ -173,9 +345,9 @@ SourceStream::position() const
 }
 
 bool
-SourceStream::atEnd() const
+SourceStream::atEnd()
 {
-    return cursor_ == source_.dataEnd();
+    return cursor_ == source_.dataEnd() && !source_.readMore();
 }
 
 uint8_t
@@ -197,6 +369,7 @@ void
 SourceStream::advanceTo(uint32_t pos)
 {
     WH_ASSERT(pos >= position());
+    WH_ASSERT(pos <= source_.dataSize());
     cursor_ = source_.data() + pos;
 }
 
@@ -206,5 +379,254 @@ SourceStream::rewindBy(uint32_t count) {
     cursor_ -= count;
 }
 
+//
+// Byte scanners.  Each byte class gives the bytes which stop a scan,
+// both for one byte, and for a block of 16 bytes as a bitmask.  Bytes
+// of 0x80 and up stop every scan, so the tokenizer decodes non-ASCII
+// chars itself.
+//
+
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+static inline uint32_t
+StopMask(__m128i stops)
+{
+    return _mm_movemask_epi8(stops);
+}
+
+static inline __m128i
+ByteEq(__m128i block, char ch)
+{
+    return _mm_cmpeq_epi8(block, _mm_set1_epi8(ch));
+}
+
+static inline __m128i
+ByteInRange(__m128i block, char from, char to)
+{
+    // Bytes of 0x80 and up are negative, so never in an ASCII range.
+    return _mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8(from - 1)),
+                         _mm_cmplt_epi8(block, _mm_set1_epi8(to + 1)));
+}
+
+static inline __m128i
+ByteNonAsciiOrLineTerminator(__m128i block)
+{
+    __m128i nonAscii = _mm_cmplt_epi8(block, _mm_setzero_si128());
+    return _mm_or_si128(nonAscii, _mm_or_si128(ByteEq(block, '\n'),
+                                               ByteEq(block, '\r')));
+}
+#endif // defined(WHISPER_SOURCE_SCAN_SSE2)
+
+struct InlineWhitespaceBytes
+{
+    bool stops(uint8_t b) const {
+        return b != ' ' && b != '\t';
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        __m128i goes = _mm_or_si128(ByteEq(block, ' '), ByteEq(block, '\t'));
+        return StopMask(goes) ^ 0xFFFFu;
+    }
+#endif
+};
+
+struct SimpleIdentifierBytes
+{
+    bool stops(uint8_t b) const {
+        uint8_t lower = b | 0x20;
+        return !((lower >= 'a' && lower <= 'z') ||
+                 (b >= '0' && b <= '9') || b == '$' || b == '_');
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i goes = _mm_or_si128(
+            _mm_or_si128(ByteInRange(lower, 'a', 'z'),
+                         ByteInRange(block, '0', '9')),
+            _mm_or_si128(ByteEq(block, '$'), ByteEq(block, '_')));
+        return StopMask(goes) ^ 0xFFFFu;
+    }
+#endif
+};
+
+struct MultiLineCommentBytes
+{
+    bool stops(uint8_t b) const {
+        return b >= 0x80 || b == '\n' || b == '\r' || b == '*';
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        return StopMask(_mm_or_si128(ByteNonAsciiOrLineTerminator(block),
+                                     ByteEq(block, '*')));
+    }
+#endif
+};
+
+struct SingleLineCommentBytes
+{
+    bool stops(uint8_t b) const {
+        return b >= 0x80 || b == '\n' || b == '\r';
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        return StopMask(ByteNonAsciiOrLineTerminator(block));
+    }
+#endif
+};
+
+struct StringLiteralBytes
+{
+    uint8_t quote;
+
+    bool stops(uint8_t b) const {
+        return b >= 0x80 || b == '\n' || b == '\r' ||
+               b == quote || b == '\\';
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        __m128i special = _mm_or_si128(ByteEq(block, quote),
+                                       ByteEq(block, '\\'));
+        return StopMask(_mm_or_si128(ByteNonAsciiOrLineTerminator(block),
+                                     special));
+    }
+#endif
+};
+
+template <typename ByteClass>
+static inline const uint8_t *
+ScanBytes(const uint8_t *pos, const uint8_t *end, const ByteClass &bytes)
+{
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    while (end - pos >= 16) {
+        __m128i block =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(pos));
+        uint32_t stops = bytes.stops(block);
+        if (stops)
+            return pos + __builtin_ctz(stops);
+        pos += 16;
+    }
+#endif
+    while (pos < end && !bytes.stops(*pos))
+        pos++;
+    return pos;
+}
+
+// Scan as ScanBytes does, reading more of the source in whenever the
+// scan reaches the end of what has been read.
+template <typename ByteClass>
+static inline const uint8_t *
+ScanSource(const uint8_t *pos, CodeSource &source, const ByteClass &bytes)
+{
+    do {
+        pos = ScanBytes(pos, source.dataEnd(), bytes);
+    } while (pos == source.dataEnd() && source.readMore());
+    return pos;
+}
+
+void
+SourceStream::skipInlineWhitespace()
+{
+    cursor_ = ScanSource(cursor_, source_, InlineWhitespaceBytes());
+}
+
+void
+SourceStream::skipSimpleIdentifierChars()
+{
+    cursor_ = ScanSource(cursor_, source_, SimpleIdentifierBytes());
+}
+
+void
+SourceStream::skipMultiLineCommentChars()
+{
+    cursor_ = ScanSource(cursor_, source_, MultiLineCommentBytes());
+}
+
+void
+SourceStream::skipSingleLineCommentChars()
+{
+    cursor_ = ScanSource(cursor_, source_, SingleLineCommentBytes());
+}
+
+void
+SourceStream::skipStringLiteralChars(uint8_t quote)
+{
+    StringLiteralBytes bytes;
+    bytes.quote = quote;
+    cursor_ = ScanSource(cursor_, source_, bytes);
+}
+
+//
+// LineIndex
+//
+
+struct LineTerminatorBytes
+{
+    // 0xE2 starts the encodings of U+2028 and U+2029.
+    bool stops(uint8_t b) const {
+        return b == '\n' || b == '\r' || b == 0xE2;
+    }
+#if defined(WHISPER_SOURCE_SCAN_SSE2)
+    uint32_t stops(__m128i block) const {
+        __m128i stops = _mm_or_si128(ByteEq(block, '\n'),
+                                     ByteEq(block, '\r'));
+        return StopMask(_mm_or_si128(stops, ByteEq(block, '\xE2')));
+    }
+#endif
+};
+
+LineIndex::LineIndex(const CodeSource &source)
+  : source_(source),
+    lineStarts_(1, 0),
+    scanned_(0)
+{}
+
+uint32_t
+LineIndex::line(uint32_t offset)
+{
+    WH_ASSERT(offset <= source_.dataSize());
+    scanTo(offset);
+    auto next = std::upper_bound(lineStarts_.begin(), lineStarts_.end(),
+                                 offset);
+    return (next - lineStarts_.begin()) - 1;
+}
+
+uint32_t
+LineIndex::column(uint32_t offset)
+{
+    return offset - lineStarts_[line(offset)];
+}
+
+void
+LineIndex::scanTo(uint32_t offset)
+{
+    if (offset <= scanned_)
+        return;
+
+    // Find every line terminator starting before |offset|.  A CR LF may
+    // end past it.
+    const uint8_t *data = source_.data();
+    const uint8_t *end = source_.dataEnd();
+    const uint8_t *limit = data + offset;
+    const uint8_t *pos = data + scanned_;
+    for (;;) {
+        pos = ScanBytes(pos, limit, LineTerminatorBytes());
+        if (pos >= limit)
+            break;
+
+        uint8_t b = *pos++;
+        if (b == 0xE2) {
+            if (end - pos < 2 || pos[0] != 0x80 ||
+                (pos[1] != 0xA8 && pos[1] != 0xA9))
+            {
+                continue;
+            }
+            pos += 2;
+        } else if (b == '\r' && pos < end && *pos == '\n') {
+            pos++;
+        }
+        lineStarts_.push_back(pos - data);
+    }
+    scanned_ = pos - data;
+}
+
 
 } // namespace Whisper
@@ -1,7 +1,9 @@
 #ifndef WHISPER__PARSER__CODE_SOURCE_HPP
 #define WHISPER__PARSER__CODE_SOURCE_HPP
 
+#include <atomic>
 #include <limits>
+#include <vector>
 #include "common.hpp"
 #include "debug.hpp"
 
@@ -13,6 +15,31 @@
 namespace Whisper {
 
 
+//
+// SourceData
+//
+// A mapping of source text shared by its code source and anything which
+// keeps pointing into it after the source is gone, such as the strings
+// of literals (see VM::SourceString).  It is unmapped once every holder
+// has released it.
+//
+class SourceData
+{
+  private:
+    void *base_;
+    uint32_t size_;
+    std::atomic<uint32_t> refs_;
+
+    ~SourceData();
+
+  public:
+    // Takes over the mapping, with a single reference held.
+    SourceData(void *base, uint32_t size);
+
+    void retain();
+    void release();
+};
+
 //
 // CodeSource
 //
@@ -35,7 +62,7 @@ class CodeSource
     uint32_t dataSize_;
 
     CodeSource(const char *name);
-    ~CodeSource();
+    virtual ~CodeSource();
 
   public:
     const char *name() const;
@@ -45,6 +72,17 @@ class CodeSource
     uint32_t dataSize() const;
 
     const uint8_t *dataEnd() const;
+
+    // Get a reference to the source's data which stays valid after the
+    // source is destroyed, to be released with SourceData::release().
+    // Returns null if the source cannot share its data.
+    virtual SourceData *retainData() const;
+
+    // Read more of the source in after dataEnd().  Data already read
+    // never moves, so pointers and offsets into it stay valid.  Returns
+    // false if there is no more to read.  Sources which are read in
+    // whole up front never have more.
+    virtual bool readMore();
 };
 
 //
@@ -56,6 +94,7 @@ class FileCodeSource : public CodeSource
 {
   private:
     int fd_ = -1;
+    SourceData *mapping_ = nullptr;
     const char *error_ = nullptr;
 
   public:
@@ -68,10 +107,100 @@ class FileCodeSource : public CodeSource
   public:
     bool initialize();
 
+    virtual SourceData *retainData() const override;
+
+    bool hasError() const;
+    const char *error() const;
+};
+
+//
+// StreamCodeSource
+//
+// Code source that reads from a pipe, socket or other file descriptor
+// as the tokenizer gets to the end of what has been read so far, so
+// parsing overlaps with reading and the input's size need not be known.
+//
+// Address space for |maxSize| bytes is reserved up front, and pages are
+// made accessible as chunks are read into them.  Everything read stays
+// in place, since tokens refer to source text by offset until bytecode
+// is generated.
+//
+// The descriptor is not closed by the source.  A read error ends the
+// input early; hasError() should be checked once parsing is done.
+//
+class StreamCodeSource : public CodeSource
+{
+  public:
+    static constexpr uint32_t DefaultMaxSize = 1u << 30;
+    static constexpr uint32_t ChunkSize = 64 * 1024;
+
+  private:
+    int fd_;
+    uint32_t maxSize_;
+    uint32_t mapped_ = 0;
+    uint32_t accessible_ = 0;
+    bool atEof_ = false;
+    const char *error_ = nullptr;
+
+  public:
+    StreamCodeSource(const char *name, int fd,
+                     uint32_t maxSize = DefaultMaxSize);
+
+    ~StreamCodeSource();
+
+    bool initialize();
+
+    virtual bool readMore() override;
+
     bool hasError() const;
     const char *error() const;
 };
 
+//
+// MemoryCodeSource
+//
+// Code source over text which the caller holds in memory, such as a
+// script received by a host.  The text must outlive the source, but
+// nothing compiled from it points into it.
+//
+class MemoryCodeSource : public CodeSource
+{
+  public:
+    MemoryCodeSource(const char *name, const uint8_t *text, uint32_t size);
+};
+
+//
+// LineIndex
+//
+// Finds the line and column of offsets into a code source.  Tokens and
+// syntax trees only keep offsets, and few of them are ever needed as
+// lines, so the tokenizer does not count lines.  Instead the source is
+// scanned for line terminators the first time an offset past the end
+// of the scanned part is looked up.
+//
+// Lines and columns count from 0, and columns count bytes.  Line
+// terminators are those of the tokenizer: LF, CR, CR LF, and the UTF-8
+// encodings of U+2028 and U+2029.
+//
+class LineIndex
+{
+  private:
+    const CodeSource &source_;
+
+    // The offset of the start of each line scanned so far.
+    std::vector<uint32_t> lineStarts_;
+    uint32_t scanned_;
+
+  public:
+    explicit LineIndex(const CodeSource &source);
+
+    uint32_t line(uint32_t offset);
+    uint32_t column(uint32_t offset);
+
+  private:
+    void scanTo(uint32_t offset);
+};
+
 //
 // SourceStream
 //
@@ -95,7 +224,9 @@ class SourceStream
     uint32_t positionOf(const uint8_t *ptr) const;
     uint32_t position() const;
 
-    bool atEnd() const;
+    // Reads more of the source in when the cursor reaches the end of
+    // what has been read so far.
+    bool atEnd();
 
     uint8_t readByte();
 
@@ -104,6 +235,26 @@ class SourceStream
     void advanceTo(uint32_t pos);
 
     void rewindBy(uint32_t count);
+
+    // Skip runs of ASCII bytes that the tokenizer would otherwise read
+    // one at a time.  Each stops at the first byte outside its set, at
+    // any non-ASCII byte, or at the end of the stream.  Blocks of 16
+    // bytes are checked at once where SSE2 is available.
+
+    // Spaces and tabs.
+    void skipInlineWhitespace();
+
+    // Letters, digits, '$' and '_'.
+    void skipSimpleIdentifierChars();
+
+    // Anything but '*' and line terminators.
+    void skipMultiLineCommentChars();
+
+    // Anything but line terminators.
+    void skipSingleLineCommentChars();
+
+    // Anything but |quote|, backslash and line terminators.
+    void skipStringLiteralChars(uint8_t quote);
 };
 
 
@@ -0,0 +1,126 @@
+
+#include <new>
+#include <unistd.h>
+
+#include "parser/parallel_parser.hpp"
+#include "parser/tokenizer.hpp"
+#include "parser/parser.hpp"
+
+namespace Whisper {
+
+
+//
+// ParallelParser
+//
+
+/*static*/ uint32_t
+ParallelParser::DefaultNumThreads()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > static_cast<long>(MaxThreads))
+        return MaxThreads;
+    return cpus;
+}
+
+ParallelParser::Task::Task(CodeSource *source)
+  : source(source),
+    allocator(nullptr),
+    program(nullptr),
+    error(nullptr),
+    errorPosition(0)
+{}
+
+ParallelParser::ParallelParser(uint32_t numThreads)
+  : numThreads_(numThreads),
+    lazyFunctions_(false),
+    tasks_(),
+    nextTask_(0)
+{
+    WH_ASSERT(numThreads_ >= 1 && numThreads_ <= MaxThreads);
+}
+
+ParallelParser::~ParallelParser()
+{
+    for (Task &task : tasks_)
+        delete task.allocator;
+}
+
+uint32_t
+ParallelParser::addSource(CodeSource *source)
+{
+    tasks_.push_back(Task(source));
+    return tasks_.size() - 1;
+}
+
+bool
+ParallelParser::parse()
+{
+    nextTask_.store(0);
+
+    uint32_t numThreads = Min<uint32_t>(numThreads_, tasks_.size());
+    pthread_t threads[MaxThreads];
+    uint32_t started = 1;
+    for (; started < numThreads; started++) {
+        if (pthread_create(&threads[started], nullptr, ThreadMain, this) != 0)
+            break;
+    }
+
+    // Threads which could not be started leave their tasks to the
+    // others.
+    threadRun();
+
+    for (uint32_t i = 1; i < started; i++)
+        pthread_join(threads[i], nullptr);
+
+    for (Task &task : tasks_) {
+        if (task.error)
+            return false;
+    }
+    return true;
+}
+
+/*static*/ void *
+ParallelParser::ThreadMain(void *arg)
+{
+    ParallelParser *parser = reinterpret_cast<ParallelParser *>(arg);
+    parser->threadRun();
+    return nullptr;
+}
+
+void
+ParallelParser::threadRun()
+{
+    for (;;) {
+        uint32_t idx = nextTask_.fetch_add(1);
+        if (idx >= tasks_.size())
+            break;
+        runTask(tasks_[idx]);
+    }
+}
+
+void
+ParallelParser::runTask(Task &task)
+{
+    try {
+        task.allocator = new BumpAllocator();
+        STLBumpAllocator<uint8_t> allocator(*task.allocator);
+        Tokenizer tokenizer(allocator, *task.source);
+        Parser parser(tokenizer);
+        parser.setLazyFunctions(lazyFunctions_);
+
+        task.program = parser.parseProgram();
+        if (!task.program) {
+            task.error = parser.error();
+            task.errorPosition = tokenizer.position();
+        }
+    } catch (BumpAllocatorError &err) {
+        task.error = "Out of memory.";
+    } catch (std::bad_alloc &err) {
+        task.error = "Out of memory.";
+    }
+}
+
+
+} // namespace Whisper
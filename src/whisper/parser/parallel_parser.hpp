@@ -0,0 +1,108 @@
+#ifndef WHISPER__PARSER__PARALLEL_PARSER_HPP
+#define WHISPER__PARSER__PARALLEL_PARSER_HPP
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "allocators.hpp"
+#include "parser/code_source.hpp"
+#include "parser/syntax_tree.hpp"
+
+namespace Whisper {
+
+using namespace AST;
+
+
+//
+// ParallelParser
+//
+// Parses a batch of code sources on a number of threads, one of which
+// is the calling thread.  Each task gets a BumpAllocator of its own,
+// which holds the syntax tree it builds and lives as long as the
+// ParallelParser.  CompileScripts uses it to compile the sources of a
+// multi-file program.
+//
+// Threads claim tasks in the order they were added, and program() is
+// the ProgramNode of each source.  Tokens are offsets into their own
+// source, so each program is annotated against it.  Nothing is shared
+// between tasks, so the results do not depend on which thread ran which
+// task.
+//
+// The keyword and quick token tables must be initialized beforehand.
+//
+
+class ParallelParser
+{
+  public:
+    static constexpr uint32_t MaxThreads = 32;
+
+    // The number of threads to use by default: one per online processor.
+    static uint32_t DefaultNumThreads();
+
+  private:
+    struct Task
+    {
+        CodeSource *source;
+        BumpAllocator *allocator;
+        ProgramNode *program;
+        const char *error;
+        uint32_t errorPosition;
+
+        explicit Task(CodeSource *source);
+    };
+
+    uint32_t numThreads_;
+    bool lazyFunctions_;
+
+    std::vector<Task> tasks_;
+    std::atomic<uint32_t> nextTask_;
+
+  public:
+    explicit ParallelParser(uint32_t numThreads);
+    ~ParallelParser();
+
+    void setLazyFunctions(bool lazyFunctions) {
+        lazyFunctions_ = lazyFunctions;
+    }
+
+    // Add a task parsing |source|, which must be fully read.  Returns
+    // its index.
+    uint32_t addSource(CodeSource *source);
+
+    // Run every task.  Returns false if any of them failed.
+    bool parse();
+
+    uint32_t numTasks() const {
+        return tasks_.size();
+    }
+
+    ProgramNode *program(uint32_t index) const {
+        WH_ASSERT(index < tasks_.size());
+        return tasks_[index].program;
+    }
+
+    const char *error(uint32_t index) const {
+        WH_ASSERT(index < tasks_.size());
+        return tasks_[index].error;
+    }
+
+    // The offset in the source the parser reached, for a task which
+    // failed.
+    uint32_t errorPosition(uint32_t index) const {
+        WH_ASSERT(index < tasks_.size());
+        return tasks_[index].errorPosition;
+    }
+
+  private:
+    static void *ThreadMain(void *arg);
+    void threadRun();
+    void runTask(Task &task);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__PARSER__PARALLEL_PARSER_HPP
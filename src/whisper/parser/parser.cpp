@@ -1,5 +1,8 @@
 
+#include <string.h>
+
 #include "spew.hpp"
+#include "trace.hpp"
 #include "parser/parser.hpp"
 #include "parser/parser_inlines.hpp"
 
@@ -24,27 +27,112 @@ Parser::~Parser() {}
 ProgramNode *
 Parser::parseProgram()
 {
+    TraceScope trace(TraceCategory::Parse, "parse");
     try {
         SourceElementList sourceElements(allocatorFor<SourceElementNode *>());
+        SourceElementExtentList extents(allocatorFor<SourceElementExtent>());
+        parseSourceElements(sourceElements, extents);
+        return make<ProgramNode>(std::move(sourceElements),
+                                 std::move(extents));
+    } catch (ParserError err) {
+        return nullptr;
+    }
+}
 
-        // Read zero or more source elements.
-        for (;;) {
-            SourceElementNode *sourceElem = tryParseSourceElement();
-            if (!sourceElem)
-                break;
-            sourceElements.push_back(sourceElem);
+ProgramNode *
+Parser::reparseProgram(ProgramNode *previous, uint32_t editStart,
+                       uint32_t *numReused)
+{
+    try {
+        SourceElementList sourceElements(allocatorFor<SourceElementNode *>());
+        SourceElementExtentList extents(allocatorFor<SourceElementExtent>());
+
+        // Keep the source elements whose parse read nothing at or past
+        // the edit.  Read extents only grow, so they are a prefix.
+        const SourceElementList &prevElems = previous->sourceElements();
+        const SourceElementExtentList &prevExtents =
+            previous->sourceElementExtents();
+        uint32_t reused = 0;
+        while (reused < prevElems.size() &&
+               prevExtents[reused].readExtent < editStart)
+        {
+            sourceElements.push_back(prevElems[reused]);
+            extents.push_back(prevExtents[reused]);
+            reused++;
         }
 
-        // Next token must be end of input.
-        if (!checkNextToken<Token::End>())
-            emitError("Invalid source element.");
+        if (reused > 0) {
+            const SourceElementExtent &last = prevExtents[reused - 1];
+            tokenizer_.startAt(last.end, last.newlineSinceToken);
+            if (last.automaticSemicolon)
+                pushBackAutomaticSemicolon();
+        }
 
-        return make<ProgramNode>(std::move(sourceElements));
+        parseSourceElements(sourceElements, extents);
+        *numReused = reused;
+        return make<ProgramNode>(std::move(sourceElements),
+                                 std::move(extents));
     } catch (ParserError err) {
         return nullptr;
     }
 }
 
+void
+Parser::parseSourceElements(SourceElementList &sourceElements,
+                            SourceElementExtentList &extents)
+{
+    // Read zero or more source elements.
+    for (;;) {
+        SourceElementNode *sourceElem = tryParseSourceElement();
+        if (!sourceElem)
+            break;
+        sourceElements.push_back(sourceElem);
+
+        // A token pushed back after the element is read again from its
+        // end, so it needs no saving.
+        extents.push_back(SourceElementExtent(tokenizer_.position(),
+                                              tokenizer_.readExtent(),
+                                              tokenizer_.newlineSinceToken(),
+                                              hasAutomaticSemicolon_));
+    }
+
+    // Next token must be end of input.
+    if (!checkNextToken<Token::End>())
+        emitError("Invalid source element.");
+}
+
+bool
+Parser::parseLazyFunctionBody(FunctionExpressionNode *func)
+{
+    WH_ASSERT(func->isLazy());
+
+    SourceElementList body(allocatorFor<SourceElementNode *>());
+    if (!parseLazyFunctionBody(func->lazyBody(), body))
+        return false;
+
+    func->setFunctionBody(std::move(body));
+    return true;
+}
+
+bool
+Parser::parseLazyFunctionBody(const LazyFunctionBody &lazyBody,
+                              SourceElementList &body)
+{
+    WH_ASSERT(!error_);
+
+    try {
+        hasAutomaticSemicolon_ = false;
+        justReadAutomaticSemicolon_ = false;
+        tokenizer_.gotoMark(lazyBody.start());
+
+        parseFunctionBody(body);
+        WH_ASSERT(tokenizer_.mark().position() == lazyBody.endOffset());
+        return true;
+    } catch (ParserError err) {
+        return false;
+    }
+}
+
 bool
 Parser::hasError() const
 {
@@ -232,7 +320,7 @@ Parser::parseVariableStatement()
         tok->debug_markUsed();
     }
 
-    return make<VariableStatementNode>(declarations);
+    return make<VariableStatementNode>(std::move(declarations));
 }
 
 VariableDeclaration
@@ -241,7 +329,7 @@ Parser::parseVariableDeclaration()
     const Token *tok0 = checkGetNextToken<Token::IdentifierName>(true);
     if (!tok0)
         emitError("Expected identifier in variable declaration.");
-    IdentifierNameToken name(*tok0);
+    Token name(*tok0);
 
     const Token &tok1 = nextToken();
     if (tok1.isAssign()) {
@@ -262,7 +350,7 @@ Parser::parseVariableDeclaration()
 
     // Otherwise, if next token is on different line from current one, insert
     // automatic semicolon.
-    if (name.newlineOccursBefore(tok1)) {
+    if (tok1.newlineBefore()) {
         pushBackLastToken();
         pushBackAutomaticSemicolon();
         return VariableDeclaration(IdentifierNameToken(name), nullptr);
@@ -466,8 +554,8 @@ Parser::parseForStatement()
         if (!body)
             emitError("Invalid for loop body.");
 
-        return make<ForLoopVarStatementNode>(declarations, condition, update,
-                                             body);
+        return make<ForLoopVarStatementNode>(std::move(declarations),
+                                             condition, update, body);
     }
 
     // Handle regular for loop.
@@ -599,7 +687,7 @@ Parser::parseDoWhileStatement()
     if (!body)
         emitError("Invalid do-while loop body.");
 
-    if (!checkNextToken<Token::WhileKeyword>())
+    if (!checkNextToken<Token::WhileKeyword>(/*checkKw=*/true))
         emitError("Expected while keyword after do-while loop body.");
 
     if (!checkNextToken<Token::OpenParen>())
@@ -616,12 +704,12 @@ Parser::parseDoWhileStatement()
 }
 
 ReturnStatementNode *
-Parser::parseReturnStatement(const Token &retToken)
+Parser::parseReturnStatement(const Token &)
 {
     // Return keyword already encountered.
     const Token &tok = nextToken();
 
-    if (tok.isEnd() || retToken.newlineOccursBefore(tok)) {
+    if (tok.isEnd() || tok.newlineBefore()) {
         // Implicit semicolon.
         pushBackLastToken();
         return make<ReturnStatementNode>(nullptr);
@@ -646,12 +734,12 @@ Parser::parseReturnStatement(const Token &retToken)
 }
 
 BreakStatementNode *
-Parser::parseBreakStatement(const Token &breakToken)
+Parser::parseBreakStatement(const Token &)
 {
     // Break keyword already encountered.
     const Token &tok = nextToken();
 
-    if (tok.isEnd() || breakToken.newlineOccursBefore(tok)) {
+    if (tok.isEnd() || tok.newlineBefore()) {
         // Implicit semicolon.
         pushBackLastToken();
         return make<BreakStatementNode>();
@@ -663,16 +751,16 @@ Parser::parseBreakStatement(const Token &breakToken)
     }
 
     if (tok.isIdentifierName()) {
-        IdentifierNameToken ident(tok);
+        Token ident(tok);
         const Token &tok2 = nextToken();
-        if (tok2.isEnd() || ident.newlineOccursBefore(tok2)) {
+        if (tok2.isEnd() || tok2.newlineBefore()) {
             pushBackLastToken();
-            return make<BreakStatementNode>(ident);
+            return make<BreakStatementNode>(IdentifierNameToken(ident));
         }
 
         if (tok2.isSemicolon()) {
             tok2.debug_markUsed();
-            return make<BreakStatementNode>(ident);
+            return make<BreakStatementNode>(IdentifierNameToken(ident));
         }
     }
 
@@ -680,12 +768,12 @@ Parser::parseBreakStatement(const Token &breakToken)
 }
 
 ContinueStatementNode *
-Parser::parseContinueStatement(const Token &continueToken)
+Parser::parseContinueStatement(const Token &)
 {
     // Continue keyword already encountered.
     const Token &tok = nextToken();
 
-    if (tok.isEnd() || continueToken.newlineOccursBefore(tok)) {
+    if (tok.isEnd() || tok.newlineBefore()) {
         // Implicit semicolon.
         pushBackLastToken();
         return make<ContinueStatementNode>();
@@ -697,16 +785,16 @@ Parser::parseContinueStatement(const Token &continueToken)
     }
 
     if (tok.isIdentifierName()) {
-        IdentifierNameToken ident(tok);
+        Token ident(tok);
         const Token &tok2 = nextToken();
-        if (tok2.isEnd() || ident.newlineOccursBefore(tok2)) {
+        if (tok2.isEnd() || tok2.newlineBefore()) {
             pushBackLastToken();
-            return make<ContinueStatementNode>(ident);
+            return make<ContinueStatementNode>(IdentifierNameToken(ident));
         }
 
         if (tok2.isSemicolon()) {
             tok2.debug_markUsed();
-            return make<ContinueStatementNode>(ident);
+            return make<ContinueStatementNode>(IdentifierNameToken(ident));
         }
     }
 
@@ -860,7 +948,7 @@ Parser::parseThrowStatement()
     if (tok.isEnd())
         emitError("Invalid throw statement.");
 
-    if (tok.newlineOccursBefore(tok))
+    if (tok.newlineBefore())
         emitError("Newline not allowed between throw and expression.");
 
     // Parse throw expression.
@@ -904,7 +992,7 @@ Parser::parseDebuggerStatement()
     // Debugger keyword already encountered.
     const Token &tok = nextToken();
 
-    if (tok.isEnd() || tok.newlineOccursBefore(tok)) {
+    if (tok.isEnd() || tok.newlineBefore()) {
         // Implicit semicolon.
         pushBackLastToken();
         return make<DebuggerStatementNode>();
@@ -986,6 +1074,15 @@ Parser::tryParseExpression(bool forbidIn, Precedence prec,
     if (tok.isIdentifierName()) {
         curExpr = make<IdentifierNode>(IdentifierNameToken(tok));
 
+        // Note uses of arguments and eval in pre-parsed bodies.
+        if (preParseDepth_ > 0) {
+            const uint8_t *text = tok.text(tokenizer_.source());
+            if (tok.length() == 9 && memcmp(text, "arguments", 9) == 0)
+                preParseFlags_ |= LazyFunctionBody::UsesArguments;
+            else if (tok.length() == 4 && memcmp(text, "eval", 4) == 0)
+                preParseFlags_ |= LazyFunctionBody::UsesEval;
+        }
+
     } else if (tok.isNumericLiteral()) {
         curExpr = make<NumericLiteralNode>(NumericLiteralToken(tok));
 
@@ -1047,7 +1144,7 @@ Parser::tryParseExpression(bool forbidIn, Precedence prec,
         if (checkNextToken<Token::OpenParen>())
             parseArguments(args);
 
-        curExpr = make<NewExpressionNode>(cons, args);
+        curExpr = make<NewExpressionNode>(cons, std::move(args));
 
     } else if (tok.isLogicalNot()) {
         ExpressionNode *expr = tryParseExpression(forbidIn, Prec_Unary);
@@ -1129,8 +1226,8 @@ Parser::tryParseExpression(bool forbidIn, Precedence prec,
 
     // Read and fold operators while within precedence scope.
     for (;;) {
-        // Note the current line.
-        uint32_t preOperatorLine = tokenizer_.line();
+        // Note whether a newline has been read since the last token.
+        bool preOperatorNewline = tokenizer_.newlineSinceToken();
 
         // Check next token.
         const Token &tok2 = nextToken(Tokenizer::InputElement_Div, true);
@@ -1178,7 +1275,7 @@ Parser::tryParseExpression(bool forbidIn, Precedence prec,
             ExpressionList args(allocatorFor<ExpressionNode *>());
             parseArguments(args);
 
-            curExpr = make<CallExpressionNode>(curExpr, args);
+            curExpr = make<CallExpressionNode>(curExpr, std::move(args));
             continue;
         }
 
@@ -1580,7 +1677,7 @@ Parser::tryParseExpression(bool forbidIn, Precedence prec,
             break;
 
         if (tok2.isEnd() || tok2.isCloseBrace() ||
-            tok2.startLine() > preOperatorLine)
+            (tok2.newlineBefore() && !preOperatorNewline))
         {
             pushBackAutomaticSemicolon();
             break;
@@ -1649,7 +1746,7 @@ Parser::tryParseArrayLiteral()
         tok->debug_markUsed();
     }
 
-    return make<ArrayLiteralNode>(exprList);
+    return make<ArrayLiteralNode>(std::move(exprList));
 }
 
 ObjectLiteralNode *
@@ -1779,7 +1876,7 @@ Parser::tryParseObjectLiteral()
         close->debug_markUsed();
     }
 
-    return make<ObjectLiteralNode>(props);
+    return make<ObjectLiteralNode>(std::move(props));
 }
 
 FunctionExpressionNode *
@@ -1843,17 +1940,53 @@ Parser::tryParseFunction()
     if (!checkNextToken<Token::OpenBrace>())
         emitError("No open brace after function signature.");
 
-    // Now parse function body.
+    // Now parse function body, or only check it.
+    const LazyFunctionBody *lazyBody = nullptr;
     SourceElementList body(allocatorFor<SourceElementNode *>());
-    parseFunctionBody(body);
+    if (lazyFunctions_)
+        lazyBody = preParseFunctionBody();
+    else
+        parseFunctionBody(body);
 
+    FunctionExpressionNode *func;
     if (name) {
-        return make<FunctionExpressionNode>(*name,
+        func = make<FunctionExpressionNode>(*name,
                                             std::move(params),
                                             std::move(body));
+    } else {
+        func = make<FunctionExpressionNode>(std::move(params),
+                                            std::move(body));
+    }
+
+    if (lazyBody)
+        func->setLazyBody(lazyBody);
+    return func;
+}
+
+const LazyFunctionBody *
+Parser::preParseFunctionBody()
+{
+    // The body is parsed in full, so that syntax errors are reported
+    // now, but the nodes built are thrown away: everything allocated
+    // from the mark on is released.
+    TokenizerMark start = tokenizer_.mark();
+    BumpAllocator &allocator = tokenizer_.allocator().base();
+    BumpAllocator::Mark allocMark = allocator.mark();
+
+    uint32_t outerFlags = preParseFlags_;
+    preParseFlags_ = 0;
+    preParseDepth_++;
+    {
+        SourceElementList body(allocatorFor<SourceElementNode *>());
+        parseFunctionBody(body);
     }
+    preParseDepth_--;
+    uint32_t flags = preParseFlags_;
+    preParseFlags_ = outerFlags | LazyFunctionBody::ContainsFunctions;
 
-    return make<FunctionExpressionNode>(std::move(params), std::move(body));
+    allocator.release(allocMark);
+    return make<LazyFunctionBody>(start, tokenizer_.mark().position(),
+                                  flags);
 }
 
 void
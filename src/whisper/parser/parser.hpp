@@ -38,18 +38,54 @@ class Parser
     bool hasAutomaticSemicolon_ = false;
     bool justReadAutomaticSemicolon_ = false;
 
+    // Pre-parse function bodies instead of building them.
+    bool lazyFunctions_ = false;
+
+    // LazyFunctionBody flags of the body being pre-parsed.
+    uint32_t preParseFlags_ = 0;
+    uint32_t preParseDepth_ = 0;
+
   public:
     Parser(Tokenizer &tokenizer);
 
     ~Parser();
 
+    bool lazyFunctions() const {
+        return lazyFunctions_;
+    }
+    void setLazyFunctions(bool lazyFunctions) {
+        lazyFunctions_ = lazyFunctions;
+    }
+
     ProgramNode *parseProgram();
 
+    // Parse an edited source again, reusing the leading source elements
+    // of |previous| which were parsed from text before |editStart|, the
+    // offset of the first changed byte.  The source is parsed again from
+    // the first element whose parse read up to the edit, so the cost
+    // depends on how far into the source the edit is, not on its size.
+    //
+    // The tokenizer must be fresh, over the edited source, and allocate
+    // from the allocator |previous| was built in, which must outlive the
+    // new program.  The number of reused elements is stored in
+    // |numReused|; the rest must be annotated again.
+    ProgramNode *reparseProgram(ProgramNode *previous, uint32_t editStart,
+                                uint32_t *numReused);
+
+    // Build the body of a function which was pre-parsed from this
+    // parser's source.  The functions nested in it are pre-parsed in
+    // turn.
+    bool parseLazyFunctionBody(FunctionExpressionNode *func);
+    bool parseLazyFunctionBody(const LazyFunctionBody &lazyBody,
+                               SourceElementList &body);
+
     bool hasError() const;
     const char *error() const;
         
 
   private:
+    void parseSourceElements(SourceElementList &sourceElements,
+                             SourceElementExtentList &extents);
     SourceElementNode *tryParseSourceElement();
     StatementNode *tryParseStatement(bool *isNamedFunction = nullptr);
 
@@ -112,6 +148,7 @@ class Parser
     ObjectLiteralNode *tryParseObjectLiteral();
     FunctionExpressionNode *tryParseFunction();
     void parseFunctionBody(SourceElementList &body);
+    const LazyFunctionBody *preParseFunctionBody();
 
     void parseArguments(ExpressionList &list);
 
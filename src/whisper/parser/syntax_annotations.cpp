@@ -2,16 +2,56 @@
 #include "parser/syntax_annotations.hpp"
 #include "parser/syntax_tree.hpp"
 #include "parser/syntax_tree_inlines.hpp"
+#include "trace.hpp"
 
 #include <stdlib.h>
+#include <string.h>
 
 namespace Whisper {
 namespace AST {
 
 
+//
+// ScopeAnnotation
+//
+
+ScopeAnnotation *
+ScopeAnnotation::frameScope()
+{
+    ScopeAnnotation *scope = this;
+    while (scope && !scope->isFunction())
+        scope = scope->enclosing();
+    return scope;
+}
+
+//
+// VariableAnnotation
+//
+
+uint32_t
+VariableAnnotation::hops() const
+{
+    WH_ASSERT(isBound() && binding_->isScopeSlot());
+    uint32_t hops = 0;
+    for (ScopeAnnotation *scope = scope_; scope != binding_->scope();
+         scope = scope->enclosing())
+    {
+        WH_ASSERT(scope);
+        if (scope->needsScopeObject())
+            hops++;
+    }
+    return hops;
+}
+
+//
+// SyntaxAnnotator
+//
+
 bool
 SyntaxAnnotator::annotate()
 {
+    TraceScope trace(TraceCategory::Parse, "annotate");
+    scopeState_ = nullptr;
     try {
         annotate(root_, nullptr);
         return true;
@@ -21,6 +61,38 @@ SyntaxAnnotator::annotate()
     }
 }
 
+bool
+SyntaxAnnotator::annotateFunctionBody(FunctionExpressionNode *func)
+{
+    WH_ASSERT(!func->isLazy());
+    WH_ASSERT(func->hasAnnotation());
+    scopeState_ = nullptr;
+    try {
+        annotateFunctionScope(func->annotation(), func->functionBody(), func);
+        return true;
+    } catch (SyntaxAnnotatorError &err) {
+        WH_ASSERT(hasError());
+        return false;
+    }
+}
+
+bool
+SyntaxAnnotator::annotateReparsedProgram(uint32_t numReused)
+{
+    ProgramNode *program = root_->toProgram();
+    const SourceElementList &sourceElems = program->sourceElements();
+    WH_ASSERT(numReused <= sourceElems.size());
+    scopeState_ = nullptr;
+    try {
+        for (uint32_t i = numReused; i < sourceElems.size(); i++)
+            annotate(sourceElems[i], program);
+        return true;
+    } catch (SyntaxAnnotatorError &err) {
+        WH_ASSERT(hasError());
+        return false;
+    }
+}
+
 void
 SyntaxAnnotator::annotate(BaseNode *node, BaseNode *parent)
 {
@@ -45,6 +117,7 @@ SyntaxAnnotator::annotateThis(ThisNode *node, BaseNode *parent)
 void
 SyntaxAnnotator::annotateIdentifier(IdentifierNode *node, BaseNode *parent)
 {
+    addReference(node->token(), node);
 }
 
 void
@@ -92,7 +165,7 @@ SyntaxAnnotator::annotateNumericLiteral(NumericLiteralNode *node,
     bool failed = false;
     int32_t accum = 0;
     while (cur < text + length) {
-        uint8_t digit = *cur;
+        uint8_t digit = *cur++;
         accum *= 10;
         accum += (digit - '0');
         if (accum > LIMIT) {
@@ -146,7 +219,27 @@ void
 SyntaxAnnotator::annotateObjectLiteral(ObjectLiteralNode *node,
                                        BaseNode *parent)
 {
-    emitError("Cannot handle object literal yet!");
+    for (ObjectLiteralNode::PropertyDefinition *def :
+            node->propertyDefinitions())
+    {
+        if (def->isValueSlot()) {
+            annotate(def->toValueSlot()->value(), node);
+            continue;
+        }
+
+        // Getters and setters are annotated like function bodies.
+        ObjectLiteralNode::AccessorDefinition *accessor =
+            def->toAccessorSlot();
+        ScopeAnnotation *scope = make<ScopeAnnotation>(
+            ScopeAnnotation::Function, currentScope(),
+            allocatorFor<BindingAnnotation *>());
+        if (def->isSetterSlot()) {
+            declare(scope, def->toSetterSlot()->parameter(),
+                    BindingAnnotation::Parameter);
+        }
+        accessor->setAnnotation(scope);
+        annotateFunctionScope(scope, accessor->body(), node);
+    }
 }
 
 void
@@ -160,10 +253,13 @@ void
 SyntaxAnnotator::annotateFunctionExpression(
         FunctionExpressionNode *node, BaseNode *parent)
 {
-    for (SourceElementNode *sourceElem : node->functionBody()) {
-        WH_ASSERT(sourceElem != nullptr);
-        annotate(sourceElem, node);
+    ScopeAnnotation *scope = makeFunctionScope(node, /*isExpression=*/true);
+    if (node->isLazy()) {
+        noteLazyFunction();
+        return;
     }
+
+    annotateFunctionScope(scope, node->functionBody(), node);
 }
 
 void
@@ -196,7 +292,16 @@ void
 SyntaxAnnotator::annotateCallExpression(
         CallExpressionNode *node, BaseNode *parent)
 {
-    annotate(node->function(), node);
+    // A direct call to |eval| runs code in this scope which is not known
+    // until runtime.
+    ExpressionNode *func = node->function();
+    if (func->isIdentifier() &&
+        isNamed(func->toIdentifier()->token(), "eval"))
+    {
+        noteDirectEval();
+    }
+
+    annotate(func, node);
     for (ExpressionNode *arg : node->arguments()) {
         WH_ASSERT(arg != nullptr);
         annotate(arg, node);
@@ -306,7 +411,8 @@ void
 SyntaxAnnotator::annotateVariableStatement(
         VariableStatementNode *node, BaseNode *parent)
 {
-    for (const VariableDeclaration &decl : node->declarations()) {
+    for (VariableDeclaration &decl : node->declarations()) {
+        addReference(decl.name(), &decl);
         if (decl.initialiser())
             annotate(decl.initialiser(), node);
     }
@@ -330,7 +436,8 @@ SyntaxAnnotator::annotateIfStatement(IfStatementNode *node, BaseNode *parent)
 {
     annotate(node->condition(), node);
     annotate(node->trueBody(), node);
-    annotate(node->falseBody(), node);
+    if (node->falseBody())
+        annotate(node->falseBody(), node);
 }
 
 void
@@ -369,7 +476,8 @@ void
 SyntaxAnnotator::annotateForLoopVarStatement(
         ForLoopVarStatementNode *node, BaseNode *parent)
 {
-    for (const VariableDeclaration &decl : node->initial()) {
+    for (VariableDeclaration &decl : node->initial()) {
+        addReference(decl.name(), &decl);
         if (decl.initialiser())
             annotate(decl.initialiser(), node);
     }
@@ -396,6 +504,7 @@ void
 SyntaxAnnotator::annotateForInVarStatement(
         ForInVarStatementNode *node, BaseNode *parent)
 {
+    addReference(node->name(), node);
     annotate(node->object(), node);
     annotate(node->body(), node);
 }
@@ -425,7 +534,12 @@ SyntaxAnnotator::annotateWithStatement(
         WithStatementNode *node, BaseNode *parent)
 {
     annotate(node->value(), node);
-    annotate(node->body(), node);
+
+    ScopeAnnotation *scope = make<ScopeAnnotation>(
+        ScopeAnnotation::With, currentScope(),
+        allocatorFor<BindingAnnotation *>());
+    node->setAnnotation(scope);
+    annotateInScope(scope, node->body(), node);
 }
 
 void
@@ -460,7 +574,13 @@ SyntaxAnnotator::annotateTryCatchStatement(
         TryCatchStatementNode *node, BaseNode *parent)
 {
     annotate(node->tryBlock(), node);
-    annotate(node->catchBlock(), node);
+
+    ScopeAnnotation *scope = make<ScopeAnnotation>(
+        ScopeAnnotation::Catch, currentScope(),
+        allocatorFor<BindingAnnotation *>());
+    declare(scope, node->catchName(), BindingAnnotation::CatchParameter);
+    node->setAnnotation(scope);
+    annotateInScope(scope, node->catchBlock(), node);
 }
 
 void
@@ -476,7 +596,14 @@ SyntaxAnnotator::annotateTryCatchFinallyStatement(
         TryCatchFinallyStatementNode *node, BaseNode *parent)
 {
     annotate(node->tryBlock(), node);
-    annotate(node->catchBlock(), node);
+
+    ScopeAnnotation *scope = make<ScopeAnnotation>(
+        ScopeAnnotation::Catch, currentScope(),
+        allocatorFor<BindingAnnotation *>());
+    declare(scope, node->catchName(), BindingAnnotation::CatchParameter);
+    node->setAnnotation(scope);
+    annotateInScope(scope, node->catchBlock(), node);
+
     annotate(node->finallyBlock(), node);
 }
 
@@ -504,8 +631,379 @@ SyntaxAnnotator::annotateFunctionDeclaration(FunctionDeclarationNode *node,
     // Visit the FunctionExpression body source elems, but with the
     // declaration node as parent.
     FunctionExpressionNode *func = node->func();
-    for (SourceElementNode *sourceElem : func->functionBody()) {
-        annotate(sourceElem, node);
+    ScopeAnnotation *scope = makeFunctionScope(func, /*isExpression=*/false);
+    if (func->isLazy()) {
+        noteLazyFunction();
+        return;
+    }
+
+    annotateFunctionScope(scope, func->functionBody(), node);
+}
+
+ScopeAnnotation *
+SyntaxAnnotator::currentScope() const
+{
+    return scopeState_ ? scopeState_->scope : nullptr;
+}
+
+ScopeAnnotation *
+SyntaxAnnotator::makeFunctionScope(FunctionExpressionNode *func,
+                                   bool isExpression)
+{
+    ScopeAnnotation *scope = make<ScopeAnnotation>(
+        ScopeAnnotation::Function, currentScope(),
+        allocatorFor<BindingAnnotation *>());
+
+    uint32_t argumentIndex = 0;
+    for (const IdentifierNameToken &param : func->formalParameters()) {
+        BindingAnnotation *binding =
+            declare(scope, param, BindingAnnotation::Parameter);
+        binding->argumentIndex_ = argumentIndex++;
+    }
+
+    // The callee is declared before the body's declarations, which
+    // replace it (see declare).
+    if (isExpression && func->name())
+        declare(scope, *func->name(), BindingAnnotation::Callee);
+
+    func->setAnnotation(scope);
+    return scope;
+}
+
+void
+SyntaxAnnotator::annotateFunctionScope(ScopeAnnotation *scope,
+                                       const SourceElementList &body,
+                                       BaseNode *parent)
+{
+    WH_ASSERT(scope->isFunction());
+    for (SourceElementNode *sourceElem : body)
+        declareVariables(sourceElem, scope);
+
+    ScopeState state(scope, scopeState_,
+                     poolAllocatorFor<PendingReference>());
+    enterScope(state);
+    for (SourceElementNode *sourceElem : body) {
+        WH_ASSERT(sourceElem != nullptr);
+        annotate(sourceElem, parent);
+    }
+    exitScope(state);
+}
+
+void
+SyntaxAnnotator::annotateInScope(ScopeAnnotation *scope, BaseNode *node,
+                                 BaseNode *parent)
+{
+    ScopeState state(scope, scopeState_,
+                     poolAllocatorFor<PendingReference>());
+    enterScope(state);
+    annotate(node, parent);
+    exitScope(state);
+}
+
+void
+SyntaxAnnotator::enterScope(ScopeState &state)
+{
+    WH_ASSERT(state.enclosing == scopeState_);
+    WH_ASSERT(state.scope->enclosing() == currentScope() || !scopeState_);
+    scopeState_ = &state;
+}
+
+void
+SyntaxAnnotator::exitScope(ScopeState &state)
+{
+    WH_ASSERT(scopeState_ == &state);
+    scopeState_ = state.enclosing;
+
+    ScopeAnnotation *scope = state.scope;
+    bool usesArguments = false;
+    for (PendingReference &ref : state.pending) {
+        BindingAnnotation *binding = findBinding(scope, ref.name);
+        if (!binding && scope->isFunction() &&
+            isNamed(ref.name, "arguments"))
+        {
+            binding = declare(scope, ref.name, BindingAnnotation::Arguments);
+        }
+
+        if (binding) {
+            if (binding->kind() == BindingAnnotation::Arguments)
+                usesArguments = true;
+            bindReference(ref, binding);
+            continue;
+        }
+
+        if (scope->isFunction())
+            ref.crossesFunction = true;
+        if (scope->isWith() || scope->hasDirectEval())
+            ref.isDynamic = true;
+        resolveReference(ref, scope->enclosing(), state.enclosing);
+    }
+
+    if (state.capturesAll) {
+        for (BindingAnnotation *binding : scope->bindings_)
+            binding->isCaptured_ = true;
+        if (state.enclosing)
+            state.enclosing->capturesAll = true;
+    }
+
+    // The arguments object aliases the parameters, so they are kept
+    // where it can reach them.  Code run by |eval| may use the arguments
+    // object too, but captures every binding anyway.
+    if (usesArguments) {
+        for (BindingAnnotation *binding : scope->bindings_) {
+            if (binding->isParameter())
+                binding->isCaptured_ = true;
+        }
+    }
+
+    assignSlots(scope);
+}
+
+void
+SyntaxAnnotator::declareVariables(BaseNode *node, ScopeAnnotation *scope)
+{
+    // Declarations are hoisted to the top of their function, out of
+    // any statements they are nested in, but not out of functions.
+    switch (node->type()) {
+      case VariableStatement:
+        for (const VariableDeclaration &decl :
+                node->toVariableStatement()->declarations())
+        {
+            declare(scope, decl.name(), BindingAnnotation::Variable);
+        }
+        break;
+      case Block:
+        for (SourceElementNode *sourceElem :
+                node->toBlock()->sourceElements())
+        {
+            declareVariables(sourceElem, scope);
+        }
+        break;
+      case IfStatement: {
+        IfStatementNode *ifStmt = node->toIfStatement();
+        declareVariables(ifStmt->trueBody(), scope);
+        if (ifStmt->falseBody())
+            declareVariables(ifStmt->falseBody(), scope);
+        break;
+      }
+      case DoWhileStatement:
+        declareVariables(node->toDoWhileStatement()->body(), scope);
+        break;
+      case WhileStatement:
+        declareVariables(node->toWhileStatement()->body(), scope);
+        break;
+      case ForLoopStatement:
+        declareVariables(node->toForLoopStatement()->body(), scope);
+        break;
+      case ForLoopVarStatement:
+        for (const VariableDeclaration &decl :
+                node->toForLoopVarStatement()->initial())
+        {
+            declare(scope, decl.name(), BindingAnnotation::Variable);
+        }
+        declareVariables(node->toForLoopVarStatement()->body(), scope);
+        break;
+      case ForInStatement:
+        declareVariables(node->toForInStatement()->body(), scope);
+        break;
+      case ForInVarStatement:
+        declare(scope, node->toForInVarStatement()->name(),
+                BindingAnnotation::Variable);
+        declareVariables(node->toForInVarStatement()->body(), scope);
+        break;
+      case WithStatement:
+        declareVariables(node->toWithStatement()->body(), scope);
+        break;
+      case SwitchStatement:
+        for (const SwitchStatementNode::CaseClause &clause :
+                node->toSwitchStatement()->caseClauses())
+        {
+            for (StatementNode *stmt : clause.statements())
+                declareVariables(stmt, scope);
+        }
+        break;
+      case LabelledStatement:
+        declareVariables(node->toLabelledStatement()->statement(), scope);
+        break;
+      case TryCatchStatement:
+        declareVariables(node->toTryCatchStatement()->tryBlock(), scope);
+        declareVariables(node->toTryCatchStatement()->catchBlock(), scope);
+        break;
+      case TryFinallyStatement:
+        declareVariables(node->toTryFinallyStatement()->tryBlock(), scope);
+        declareVariables(node->toTryFinallyStatement()->finallyBlock(),
+                         scope);
+        break;
+      case TryCatchFinallyStatement: {
+        TryCatchFinallyStatementNode *tryStmt =
+            node->toTryCatchFinallyStatement();
+        declareVariables(tryStmt->tryBlock(), scope);
+        declareVariables(tryStmt->catchBlock(), scope);
+        declareVariables(tryStmt->finallyBlock(), scope);
+        break;
+      }
+      case FunctionDeclaration:
+        declare(scope, *node->toFunctionDeclaration()->func()->name(),
+                BindingAnnotation::Function);
+        break;
+      default:
+        break;
+    }
+}
+
+BindingAnnotation *
+SyntaxAnnotator::declare(ScopeAnnotation *scope,
+                         const IdentifierNameToken &name,
+                         BindingAnnotation::Kind kind)
+{
+    // Declaring a name again names the same binding.  A function
+    // declaration takes over the binding, as the function is what it
+    // holds on entry, and any declaration takes over the callee's name.
+    BindingAnnotation *binding = findBinding(scope, name);
+    if (binding) {
+        if (kind == BindingAnnotation::Function ||
+            binding->kind_ == BindingAnnotation::Callee)
+        {
+            binding->kind_ = kind;
+        }
+        return binding;
+    }
+
+    binding = make<BindingAnnotation>(name, scope, kind);
+    scope->bindings_.push_back(binding);
+    return binding;
+}
+
+BindingAnnotation *
+SyntaxAnnotator::findBinding(ScopeAnnotation *scope,
+                             const IdentifierNameToken &name) const
+{
+    const uint8_t *text = name.text(source_);
+    uint32_t length = name.length();
+    for (BindingAnnotation *binding : scope->bindings()) {
+        if (binding->name().length() == length &&
+            memcmp(binding->name().text(source_), text, length) == 0)
+        {
+            return binding;
+        }
+    }
+    return nullptr;
+}
+
+bool
+SyntaxAnnotator::isNamed(const IdentifierNameToken &name,
+                         const char *str) const
+{
+    return name.length() == strlen(str) &&
+           memcmp(name.text(source_), str, name.length()) == 0;
+}
+
+void
+SyntaxAnnotator::addReference(const IdentifierNameToken &name,
+                              Annotated<VariableAnnotation> *target)
+{
+    PendingReference ref = { name, target, currentScope(), false, false };
+    resolveReference(ref, currentScope(), scopeState_);
+}
+
+void
+SyntaxAnnotator::resolveReference(PendingReference &ref,
+                                  ScopeAnnotation *scope, ScopeState *state)
+{
+    for (;;) {
+        if (!scope) {
+            VariableAnnotation::Kind kind = ref.isDynamic
+                                            ? VariableAnnotation::Dynamic
+                                            : VariableAnnotation::Global;
+            ref.target->setAnnotation(
+                make<VariableAnnotation>(kind, ref.scope, nullptr));
+            return;
+        }
+
+        // A scope still being annotated resolves the reference when it
+        // is done.
+        if (state) {
+            WH_ASSERT(state->scope == scope);
+            state->pending.push_back(ref);
+            return;
+        }
+
+        // The scopes around a lazy function body were analyzed when the
+        // tree around it was.  Since they capture every binding they
+        // hold, their slots are already assigned.
+        BindingAnnotation *binding = findBinding(scope, ref.name);
+        if (binding) {
+            WH_ASSERT(binding->isCaptured());
+            bindReference(ref, binding);
+            return;
+        }
+
+        if (scope->isFunction())
+            ref.crossesFunction = true;
+        if (scope->isWith() || scope->hasDirectEval())
+            ref.isDynamic = true;
+        scope = scope->enclosing();
+    }
+}
+
+void
+SyntaxAnnotator::bindReference(PendingReference &ref,
+                               BindingAnnotation *binding)
+{
+    // Bindings used from inner functions, or looked up by name, are kept
+    // in scope objects.
+    if (ref.crossesFunction || ref.isDynamic)
+        binding->isCaptured_ = true;
+
+    if (ref.isDynamic) {
+        ref.target->setAnnotation(make<VariableAnnotation>(
+            VariableAnnotation::Dynamic, ref.scope, nullptr));
+        return;
+    }
+    ref.target->setAnnotation(make<VariableAnnotation>(
+        VariableAnnotation::Bound, ref.scope, binding));
+}
+
+void
+SyntaxAnnotator::noteDirectEval()
+{
+    // At the top level, |eval| can only add global bindings.
+    if (!scopeState_)
+        return;
+
+    scopeState_->capturesAll = true;
+    ScopeAnnotation *frame = scopeState_->scope->frameScope();
+    if (frame)
+        frame->hasDirectEval_ = true;
+}
+
+void
+SyntaxAnnotator::noteLazyFunction()
+{
+    // The body of a lazy function is not seen until later, so it may
+    // refer to any binding around it.
+    if (scopeState_)
+        scopeState_->capturesAll = true;
+}
+
+void
+SyntaxAnnotator::assignSlots(ScopeAnnotation *scope)
+{
+    ScopeAnnotation *frame = scope->frameScope();
+    for (BindingAnnotation *binding : scope->bindings_) {
+        // Outside of any function there is no frame to hold locals.
+        if (!frame)
+            binding->isCaptured_ = true;
+
+        if (binding->isCaptured_) {
+            binding->location_ = BindingAnnotation::ScopeSlot;
+            binding->index_ = scope->numScopeSlots_++;
+        } else if (binding->isParameter()) {
+            binding->location_ = BindingAnnotation::Argument;
+            binding->index_ = binding->argumentIndex_;
+        } else {
+            binding->location_ = BindingAnnotation::Local;
+            binding->index_ = frame->numLocals_++;
+        }
     }
 }
 
@@ -2,6 +2,7 @@
 #define WHISPER__PARSER__SYNTAX_ANNOTATIONS_HPP
 
 #include <list>
+#include <vector>
 #include "allocators.hpp"
 #include "parser/tokenizer.hpp"
 #include "parser/syntax_defn.hpp"
@@ -11,11 +12,253 @@ namespace Whisper {
 namespace AST {
 
 class BaseNode;
+class BindingAnnotation;
+
+//
+// Annotates a function, catch or with scope with the bindings it
+// holds, and with how they are stored:
+//
+//  - A function's frame holds its parameters (as its arguments) and
+//    every binding which is not captured, in locals numbered from zero.
+//    Catch bindings which are not captured take locals in the frame of
+//    the function they occur in.
+//
+//  - Captured bindings, which inner functions or code looked up by name
+//    may use, are held in fixed slots of a DeclarativeScope created for
+//    the scope.  Captured parameters are copied into theirs on entry.
+//
+//  - A with scope holds no bindings, but always has a scope object
+//    (an ObjectScope), as does a function which calls |eval| directly
+//    and so may have bindings added to it at runtime.
+//
+// Top-level bindings are properties of the global object, so the
+// program itself has no scope annotation, and catch bindings outside of
+// any function are always captured.
+//
+class ScopeAnnotation
+{
+  friend class SyntaxAnnotator;
+  public:
+    enum Kind : uint8_t { Function, Catch, With };
+    typedef BaseNode::List<BindingAnnotation *> BindingList;
+
+  private:
+    Kind kind_;
+    bool hasDirectEval_ = false;
+
+    // The scope enclosing this one, or null for the global scope.
+    ScopeAnnotation *enclosing_;
+
+    BindingList bindings_;
+
+    // Function scopes only: the number of frame locals used by bindings
+    // of this scope and of the catch scopes within it.
+    uint32_t numLocals_ = 0;
+
+    uint32_t numScopeSlots_ = 0;
+
+    ScopeAnnotation(Kind kind, ScopeAnnotation *enclosing,
+                    const STLBumpAllocator<BindingAnnotation *> &allocator)
+      : kind_(kind), enclosing_(enclosing), bindings_(allocator)
+    {}
+
+  public:
+    Kind kind() const {
+        return kind_;
+    }
+    bool isFunction() const {
+        return kind_ == Function;
+    }
+    bool isCatch() const {
+        return kind_ == Catch;
+    }
+    bool isWith() const {
+        return kind_ == With;
+    }
+
+    ScopeAnnotation *enclosing() const {
+        return enclosing_;
+    }
+
+    // The function scope whose frame holds this scope's locals, or null
+    // outside of any function.
+    ScopeAnnotation *frameScope();
+
+    bool hasDirectEval() const {
+        return hasDirectEval_;
+    }
+
+    const BindingList &bindings() const {
+        return bindings_;
+    }
+
+    uint32_t numLocals() const {
+        WH_ASSERT(isFunction());
+        return numLocals_;
+    }
+
+    uint32_t numScopeSlots() const {
+        return numScopeSlots_;
+    }
+
+    bool needsScopeObject() const {
+        return isWith() || hasDirectEval_ || numScopeSlots_ > 0;
+    }
+};
+
+//
+// A binding held by a ScopeAnnotation.
+//
+class BindingAnnotation
+{
+  friend class SyntaxAnnotator;
+  public:
+    enum Kind : uint8_t {
+        Parameter,
+        Variable,
+        Function,
+        CatchParameter,
+
+        // The name of a named function expression, bound to the function
+        // within itself.
+        Callee,
+
+        // The implicit |arguments| of a function which refers to it.
+        Arguments
+    };
+
+    enum Location : uint8_t { Argument, Local, ScopeSlot };
+
+  private:
+    IdentifierNameToken name_;
+    ScopeAnnotation *scope_;
+    Kind kind_;
+    Location location_ = Local;
+    bool isCaptured_ = false;
+
+    // Parameters only: the index of the argument the binding is
+    // initialized from.
+    uint32_t argumentIndex_ = 0;
+
+    // The index of the binding's argument, local or scope slot.
+    uint32_t index_ = 0;
+
+    BindingAnnotation(const IdentifierNameToken &name, ScopeAnnotation *scope,
+                      Kind kind)
+      : name_(name), scope_(scope), kind_(kind)
+    {}
+
+  public:
+    const IdentifierNameToken &name() const {
+        return name_;
+    }
+    ScopeAnnotation *scope() const {
+        return scope_;
+    }
+    Kind kind() const {
+        return kind_;
+    }
+    bool isParameter() const {
+        return kind_ == Parameter;
+    }
+    bool isCaptured() const {
+        return isCaptured_;
+    }
+
+    uint32_t argumentIndex() const {
+        WH_ASSERT(isParameter());
+        return argumentIndex_;
+    }
+
+    Location location() const {
+        return location_;
+    }
+    bool isArgument() const {
+        return location_ == Argument;
+    }
+    bool isLocal() const {
+        return location_ == Local;
+    }
+    bool isScopeSlot() const {
+        return location_ == ScopeSlot;
+    }
+    uint32_t index() const {
+        return index_;
+    }
+};
+
+//
+// Annotates a variable reference (an IdentifierNode, or the name of a
+// variable declaration) with how to find the variable it names:
+//
+//  - A bound reference names a binding known before running the code.
+//    If the binding is in a scope slot, it is |hops()| scope objects
+//    out from the scope of the reference.
+//
+//  - A global reference names a property of the global object.
+//
+//  - A dynamic reference may be redirected at runtime by a |with|
+//    statement or a direct call to |eval|, and is looked up by name
+//    along the scope chain.
+//
+class VariableAnnotation
+{
+  friend class SyntaxAnnotator;
+  public:
+    enum Kind : uint8_t { Bound, Global, Dynamic };
+
+  private:
+    Kind kind_;
+    ScopeAnnotation *scope_;
+    BindingAnnotation *binding_;
+
+    VariableAnnotation(Kind kind, ScopeAnnotation *scope,
+                       BindingAnnotation *binding)
+      : kind_(kind), scope_(scope), binding_(binding)
+    {
+        WH_ASSERT((kind_ == Bound) == (binding_ != nullptr));
+    }
+
+  public:
+    Kind kind() const {
+        return kind_;
+    }
+    bool isBound() const {
+        return kind_ == Bound;
+    }
+    bool isGlobal() const {
+        return kind_ == Global;
+    }
+    bool isDynamic() const {
+        return kind_ == Dynamic;
+    }
+
+    // The scope the reference occurs in, or null at the top level.
+    ScopeAnnotation *scope() const {
+        return scope_;
+    }
+
+    BindingAnnotation *binding() const {
+        WH_ASSERT(isBound());
+        return binding_;
+    }
+
+    uint32_t hops() const;
+};
+
 
 //
 // The syntax annotator applies annotations to syntax trees.
 // It uses a visitor pattern to implement the annotation process.
 //
+// Along the way it analyzes scopes, resolving every variable reference
+// to the binding it names where that can be known before running the
+// code.  Bindings which no inner function refers to are given slots in
+// their function's frame (see BindingAnnotation), and the rest fixed
+// slots in a scope object.  Only references which a |with| statement
+// or a direct call to |eval| may redirect are left to be looked up by
+// name.
+//
 
 class SyntaxAnnotatorError
 {
@@ -30,15 +273,69 @@ class SyntaxAnnotator
 {
   private:
     STLBumpAllocator<uint8_t> allocator_;
+
+    // Pool for the scratch vectors of the analysis, which recycles
+    // their storage as scopes are entered and left.
+    PoolAllocator pool_;
+
     BaseNode *root_;
     const CodeSource &source_;
 
     const char *error_ = nullptr;
 
+    // A reference which has not been resolved to a binding yet.
+    struct PendingReference
+    {
+        IdentifierNameToken name;
+        Annotated<VariableAnnotation> *target;
+
+        // The scope the reference occurs in.
+        ScopeAnnotation *scope;
+
+        // Whether the reference has been passed out of a function scope,
+        // and whether a scope it has been passed out of could hold
+        // bindings which are not known until runtime.
+        bool crossesFunction;
+        bool isDynamic;
+    };
+
+    // The analysis state of a scope whose code is being annotated.
+    // References are resolved once the whole scope has been seen, since
+    // declarations are hoisted and a later |eval| affects earlier code.
+    struct ScopeState
+    {
+        ScopeAnnotation *scope;
+        ScopeState *enclosing;
+        std::vector<PendingReference, STLPoolAllocator<PendingReference>>
+            pending;
+
+        // Whether code which the analysis cannot see (a direct |eval|,
+        // or the body of a lazy function) may refer to any binding in
+        // this scope.
+        bool capturesAll;
+
+        ScopeState(ScopeAnnotation *scope, ScopeState *enclosing,
+                   const STLPoolAllocator<PendingReference> &allocator)
+          : scope(scope), enclosing(enclosing), pending(allocator),
+            capturesAll(false)
+        {}
+    };
+
+    ScopeState *scopeState_ = nullptr;
+
   public:
     SyntaxAnnotator(STLBumpAllocator<uint8_t> allocator,
                     BaseNode *root, const CodeSource &source)
-      : allocator_(allocator), root_(root), source_(source)
+      : allocator_(allocator), pool_(allocator_.base()), root_(root),
+        source_(source)
+    {}
+
+    // Allocate annotations in the arena's Annotations sub-arena.
+    SyntaxAnnotator(CompilationArena &arena, BaseNode *root,
+                    const CodeSource &source)
+      : SyntaxAnnotator(
+            arena.allocatorFor<uint8_t>(CompilationArenaKind::Annotations),
+            root, source)
     {}
 
     bool hasError() const {
@@ -49,8 +346,22 @@ class SyntaxAnnotator
         return error_;
     }
 
+    const CodeSource &source() const {
+        return source_;
+    }
+
     bool annotate();
 
+    // Annotate the body of a lazy function once it has been parsed.
+    // Lazy bodies are skipped when the tree around them is annotated,
+    // which must have happened first.
+    bool annotateFunctionBody(FunctionExpressionNode *func);
+
+    // Annotate a program built by Parser::reparseProgram.  Its first
+    // |numReused| source elements were kept, annotations and all, from
+    // the program it replaces.
+    bool annotateReparsedProgram(uint32_t numReused);
+
   private:
     void annotate(BaseNode *node, BaseNode *parent);
 
@@ -59,6 +370,34 @@ class SyntaxAnnotator
       WHISPER_DEFN_SYNTAX_NODES(DEF_ANNOT_);
 #undef DEF_ANNOT_
 
+    ScopeAnnotation *currentScope() const;
+    ScopeAnnotation *makeFunctionScope(FunctionExpressionNode *func,
+                                       bool isExpression);
+    void annotateFunctionScope(ScopeAnnotation *scope,
+                               const SourceElementList &body,
+                               BaseNode *parent);
+    void annotateInScope(ScopeAnnotation *scope, BaseNode *node,
+                         BaseNode *parent);
+    void enterScope(ScopeState &state);
+    void exitScope(ScopeState &state);
+
+    void declareVariables(BaseNode *node, ScopeAnnotation *scope);
+    BindingAnnotation *declare(ScopeAnnotation *scope,
+                               const IdentifierNameToken &name,
+                               BindingAnnotation::Kind kind);
+    BindingAnnotation *findBinding(ScopeAnnotation *scope,
+                                   const IdentifierNameToken &name) const;
+    bool isNamed(const IdentifierNameToken &name, const char *str) const;
+
+    void addReference(const IdentifierNameToken &name,
+                      Annotated<VariableAnnotation> *target);
+    void resolveReference(PendingReference &ref, ScopeAnnotation *scope,
+                          ScopeState *state);
+    void bindReference(PendingReference &ref, BindingAnnotation *binding);
+    void noteDirectEval();
+    void noteLazyFunction();
+    void assignSlots(ScopeAnnotation *scope);
+
     void emitError(const char *msg);
 
     template <typename T>
@@ -66,6 +405,11 @@ class SyntaxAnnotator
         return STLBumpAllocator<T>(allocator_);
     }
 
+    template <typename T>
+    inline STLPoolAllocator<T> poolAllocatorFor() {
+        return STLPoolAllocator<T>(pool_);
+    }
+
     template <typename T, typename... ARGS>
     inline T *make(ARGS... args)
     {
@@ -1,7 +1,7 @@
 #ifndef WHISPER__PARSER__SYNTAX_TREE_HPP
 #define WHISPER__PARSER__SYNTAX_TREE_HPP
 
-#include <list>
+#include <new>
 #include "parser/tokenizer.hpp"
 #include "parser/syntax_defn.hpp"
 
@@ -12,6 +12,8 @@ namespace AST {
 // Annotation forward declarations.
 //
 class NumericLiteralAnnotation;
+class VariableAnnotation;
+class ScopeAnnotation;
 
 //
 // Mixin class for syntax tree nodes which are annotated.
@@ -223,6 +225,105 @@ class DebuggerStatementNode;
 class FunctionDeclarationNode;
 class ProgramNode;
 
+//
+// NodeList
+//
+// The lists held by syntax nodes.  Elements are kept in one contiguous
+// array in the parse's bump allocator, so walking a list reads a single
+// block of memory.  The parser appends to a list as it goes, then moves
+// it into its node.  Lists can only be moved, never copied.
+//
+template <typename T>
+class NodeList
+{
+  private:
+    STLBumpAllocator<T> allocator_;
+    T *data_;
+    uint32_t size_;
+    uint32_t capacity_;
+
+    static constexpr uint32_t InitialCapacity = 4;
+
+  public:
+    explicit inline NodeList(const STLBumpAllocator<T> &allocator)
+      : allocator_(allocator),
+        data_(nullptr),
+        size_(0),
+        capacity_(0)
+    {}
+
+    inline NodeList(NodeList &&other)
+      : allocator_(other.allocator_),
+        data_(other.data_),
+        size_(other.size_),
+        capacity_(other.capacity_)
+    {
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+
+    NodeList(const NodeList &other) = delete;
+
+    // The elements stay in the allocator they were added from.
+    inline NodeList &operator =(NodeList &&other) {
+        data_ = other.data_;
+        size_ = other.size_;
+        capacity_ = other.capacity_;
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+        return *this;
+    }
+
+    inline void push_back(const T &elem) {
+        if (size_ == capacity_)
+            grow();
+        new (&data_[size_++]) T(elem);
+    }
+    inline void push_back(T &&elem) {
+        if (size_ == capacity_)
+            grow();
+        new (&data_[size_++]) T(std::move(elem));
+    }
+
+    inline uint32_t size() const {
+        return size_;
+    }
+    inline bool empty() const {
+        return size_ == 0;
+    }
+
+    inline const T &operator [](uint32_t idx) const {
+        WH_ASSERT(idx < size_);
+        return data_[idx];
+    }
+
+    inline T *begin() {
+        return data_;
+    }
+    inline T *end() {
+        return data_ + size_;
+    }
+    inline const T *begin() const {
+        return data_;
+    }
+    inline const T *end() const {
+        return data_ + size_;
+    }
+
+  private:
+    void grow() {
+        // The old array is left behind in the allocator.
+        uint32_t capacity = capacity_ ? capacity_ * 2 : InitialCapacity;
+        T *data = allocator_.allocate(capacity);
+        for (uint32_t i = 0; i < size_; i++)
+            new (&data[i]) T(std::move(data_[i]));
+        data_ = data;
+        capacity_ = capacity;
+    }
+};
+
 //
 // Base syntax element.
 //
@@ -235,7 +336,7 @@ class BaseNode
     typedef Allocator<uint8_t> StdAllocator;
 
     template <typename T>
-    using List = std::list<T, Allocator<T>>;
+    using List = NodeList<T>;
 
   protected:
     NodeType type_;
@@ -349,7 +450,7 @@ class LiteralExpressionNode : public ExpressionNode
     LiteralExpressionNode(NodeType type) : ExpressionNode(type) {}
 };
 
-class VariableDeclaration
+class VariableDeclaration : public Annotated<VariableAnnotation>
 {
   public:
     IdentifierNameToken name_;
@@ -403,7 +504,8 @@ class ThisNode : public ExpressionNode
 //
 // IdentifierNode syntax element
 //
-class IdentifierNode : public ExpressionNode
+class IdentifierNode : public ExpressionNode,
+                       public Annotated<VariableAnnotation>
 {
   private:
     IdentifierNameToken token_;
@@ -536,7 +638,7 @@ class ArrayLiteralNode : public LiteralExpressionNode
   public:
     explicit inline ArrayLiteralNode(ExpressionList &&elements)
       : LiteralExpressionNode(ArrayLiteral),
-        elements_(elements)
+        elements_(std::move(elements))
     {}
 
     inline const ExpressionList &elements() const {
@@ -553,6 +655,7 @@ class ObjectLiteralNode : public LiteralExpressionNode
     enum SlotKind { Value, Getter, Setter };
 
     class ValueDefinition;
+    class AccessorDefinition;
     class GetterDefinition;
     class SetterDefinition;
 
@@ -560,12 +663,13 @@ class ObjectLiteralNode : public LiteralExpressionNode
     {
       private:
         SlotKind kind_;
-        Token name_;
+        SyntaxToken name_;
 
       public:
         inline PropertyDefinition(SlotKind kind, const Token &name)
           : kind_(kind), name_(name)
         {
+            name.debug_markUsed();
             WH_ASSERT(name_.isIdentifierName() ||
                       name_.isStringLiteral() ||
                       name_.isNumericLiteral());
@@ -597,6 +701,15 @@ class ObjectLiteralNode : public LiteralExpressionNode
             return kind_ == Setter;
         }
 
+        inline bool isAccessorSlot() const {
+            return kind_ == Getter || kind_ == Setter;
+        }
+
+        inline AccessorDefinition *toAccessorSlot() {
+            WH_ASSERT(isAccessorSlot());
+            return reinterpret_cast<AccessorDefinition *>(this);
+        }
+
         inline const SetterDefinition *toSetterSlot() const {
             WH_ASSERT(isSetterSlot());
             return reinterpret_cast<const SetterDefinition *>(this);
@@ -629,7 +742,7 @@ class ObjectLiteralNode : public LiteralExpressionNode
             return reinterpret_cast<const NumericLiteralToken &>(name_);
         }
 
-        inline const Token &name() const {
+        inline const SyntaxToken &name() const {
             return name_;
         }
     };
@@ -650,7 +763,8 @@ class ObjectLiteralNode : public LiteralExpressionNode
         }
     };
 
-    class AccessorDefinition : public PropertyDefinition
+    class AccessorDefinition : public PropertyDefinition,
+                               public Annotated<ScopeAnnotation>
     {
       protected:
         SourceElementList body_;
@@ -658,7 +772,7 @@ class ObjectLiteralNode : public LiteralExpressionNode
       public:
         inline AccessorDefinition(SlotKind kind, const Token &name,
                                   SourceElementList &&body)
-          : PropertyDefinition(kind, name), body_(body)
+          : PropertyDefinition(kind, name), body_(std::move(body))
         {}
 
         inline const SourceElementList &body() const {
@@ -701,7 +815,7 @@ class ObjectLiteralNode : public LiteralExpressionNode
     explicit inline ObjectLiteralNode(
             PropertyDefinitionList &&propertyDefinitions)
       : LiteralExpressionNode(ObjectLiteral),
-        propertyDefinitions_(propertyDefinitions)
+        propertyDefinitions_(std::move(propertyDefinitions))
     {}
 
     inline const PropertyDefinitionList &propertyDefinitions() const {
@@ -728,10 +842,65 @@ class ParenthesizedExpressionNode : public ExpressionNode
     }
 };
 
+//
+// The source range of a function body which was only pre-parsed, and
+// what the pre-parse saw in it.  The range starts after the body's open
+// brace and ends after its close brace.
+//
+class LazyFunctionBody
+{
+  public:
+    enum Flags : uint32_t
+    {
+        ContainsFunctions   = 0x01,
+        UsesArguments       = 0x02,
+        UsesEval            = 0x04
+    };
+
+  private:
+    TokenizerMark start_;
+    uint32_t endOffset_;
+    uint32_t flags_;
+
+  public:
+    inline LazyFunctionBody(const TokenizerMark &start, uint32_t endOffset,
+                            uint32_t flags)
+      : start_(start),
+        endOffset_(endOffset),
+        flags_(flags)
+    {}
+
+    inline const TokenizerMark &start() const {
+        return start_;
+    }
+
+    inline uint32_t startOffset() const {
+        return start_.position();
+    }
+
+    inline uint32_t endOffset() const {
+        return endOffset_;
+    }
+
+    inline uint32_t flags() const {
+        return flags_;
+    }
+
+    inline bool hasFlag(Flags flag) const {
+        return flags_ & flag;
+    }
+};
+
 //
 // FunctionExpression syntax element
 //
-class FunctionExpressionNode : public ExpressionNode
+// When the parser pre-parses function bodies, a function starts out
+// lazy: its body is empty, and lazyBody() records where to find it.
+// Parser::parseLazyFunctionBody fills in the body when it is first
+// needed, and SyntaxAnnotator::annotateFunctionBody annotates it.
+//
+class FunctionExpressionNode : public ExpressionNode,
+                               public Annotated<ScopeAnnotation>
 {
   public:
     typedef BaseNode::List<IdentifierNameToken> FormalParameterList;
@@ -740,14 +909,15 @@ class FunctionExpressionNode : public ExpressionNode
     Maybe<IdentifierNameToken> name_;
     FormalParameterList formalParameters_;
     SourceElementList functionBody_;
+    const LazyFunctionBody *lazyBody_ = nullptr;
 
   public:
     inline FunctionExpressionNode(FormalParameterList &&formalParameters,
                                   SourceElementList &&functionBody)
       : ExpressionNode(FunctionExpression),
         name_(),
-        formalParameters_(formalParameters),
-        functionBody_(functionBody)
+        formalParameters_(std::move(formalParameters)),
+        functionBody_(std::move(functionBody))
     {}
 
     inline FunctionExpressionNode(const IdentifierNameToken &name,
@@ -755,8 +925,8 @@ class FunctionExpressionNode : public ExpressionNode
                                   SourceElementList &&functionBody)
       : ExpressionNode(FunctionExpression),
         name_(name),
-        formalParameters_(formalParameters),
-        functionBody_(functionBody)
+        formalParameters_(std::move(formalParameters)),
+        functionBody_(std::move(functionBody))
     {}
 
     inline const Maybe<IdentifierNameToken> &name() const {
@@ -768,8 +938,29 @@ class FunctionExpressionNode : public ExpressionNode
     }
 
     inline const SourceElementList &functionBody() const {
+        WH_ASSERT(!isLazy());
         return functionBody_;
     }
+
+    inline bool isLazy() const {
+        return lazyBody_ != nullptr;
+    }
+
+    inline const LazyFunctionBody &lazyBody() const {
+        WH_ASSERT(isLazy());
+        return *lazyBody_;
+    }
+
+    inline void setLazyBody(const LazyFunctionBody *lazyBody) {
+        WH_ASSERT(functionBody_.empty());
+        lazyBody_ = lazyBody;
+    }
+
+    inline void setFunctionBody(SourceElementList &&functionBody) {
+        WH_ASSERT(isLazy());
+        functionBody_ = std::move(functionBody);
+        lazyBody_ = nullptr;
+    }
 };
 
 //
@@ -838,7 +1029,7 @@ class NewExpressionNode : public ExpressionNode
                              ExpressionList &&arguments)
       : ExpressionNode(NewExpression),
         constructor_(constructor),
-        arguments_(arguments)
+        arguments_(std::move(arguments))
     {}
 
     inline ExpressionNode *constructor() const {
@@ -864,7 +1055,7 @@ class CallExpressionNode : public ExpressionNode
                               ExpressionList &&arguments)
       : ExpressionNode(CallExpression),
         function_(function),
-        arguments_(arguments)
+        arguments_(std::move(arguments))
     {}
 
     inline ExpressionNode *function() const {
@@ -1128,7 +1319,7 @@ class BlockNode : public StatementNode
   public:
     explicit inline BlockNode(SourceElementList &&sourceElements)
       : StatementNode(Block),
-        sourceElements_(sourceElements)
+        sourceElements_(std::move(sourceElements))
     {}
 
     inline const SourceElementList &sourceElements() const {
@@ -1147,12 +1338,15 @@ class VariableStatementNode : public StatementNode
   public:
     explicit inline VariableStatementNode(DeclarationList &&declarations)
       : StatementNode(VariableStatement),
-        declarations_(declarations)
+        declarations_(std::move(declarations))
     {}
 
     inline const DeclarationList &declarations() const {
         return declarations_;
     }
+    inline DeclarationList &declarations() {
+        return declarations_;
+    }
 };
 
 //
@@ -1334,7 +1528,7 @@ class ForLoopVarStatementNode : public IterationStatementNode
                                    ExpressionNode *update,
                                    StatementNode *body)
       : IterationStatementNode(ForLoopVarStatement),
-        initial_(initial),
+        initial_(std::move(initial)),
         condition_(condition),
         update_(update),
         body_(body)
@@ -1396,7 +1590,8 @@ class ForInStatementNode : public IterationStatementNode
 //
 // ForInVarStatement syntax element
 //
-class ForInVarStatementNode : public IterationStatementNode
+class ForInVarStatementNode : public IterationStatementNode,
+                              public Annotated<VariableAnnotation>
 {
   private:
     IdentifierNameToken name_;
@@ -1496,7 +1691,8 @@ class ReturnStatementNode : public StatementNode
 //
 // WithStatement syntax element
 //
-class WithStatementNode : public StatementNode
+class WithStatementNode : public StatementNode,
+                          public Annotated<ScopeAnnotation>
 {
   private:
     ExpressionNode *value_;
@@ -1534,12 +1730,7 @@ class SwitchStatementNode : public StatementNode
         inline CaseClause(ExpressionNode *expression,
                           StatementList &&statements)
           : expression_(expression),
-            statements_(statements)
-        {}
-
-        inline CaseClause(const CaseClause &other)
-          : expression_(other.expression_),
-            statements_(other.statements_)
+            statements_(std::move(statements))
         {}
 
         inline CaseClause(CaseClause &&other)
@@ -1566,7 +1757,7 @@ class SwitchStatementNode : public StatementNode
                                CaseClauseList &&caseClauses)
       : StatementNode(SwitchStatement),
         value_(value),
-        caseClauses_(caseClauses)
+        caseClauses_(std::move(caseClauses))
     {}
 
     inline ExpressionNode *value() const {
@@ -1637,7 +1828,8 @@ class TryStatementNode : public StatementNode
 //
 // TryCatchStatement syntax element
 //
-class TryCatchStatementNode : public TryStatementNode
+class TryCatchStatementNode : public TryStatementNode,
+                              public Annotated<ScopeAnnotation>
 {
   private:
     BlockNode *tryBlock_;
@@ -1696,7 +1888,8 @@ class TryFinallyStatementNode : public TryStatementNode
 //
 // TryCatchFinallyStatement syntax element
 //
-class TryCatchFinallyStatementNode : public TryStatementNode
+class TryCatchFinallyStatementNode : public TryStatementNode,
+                                     public Annotated<ScopeAnnotation>
 {
   private:
     BlockNode *tryBlock_;
@@ -1774,20 +1967,62 @@ class FunctionDeclarationNode : public SourceElementNode
 //
 // Program syntax element
 //
+//
+// SourceElementExtent
+//
+// Where parsing a top-level source element left the tokenizer, so an
+// edited source can be parsed again from the first source element the
+// edit could change (see Parser::reparseProgram).
+//
+struct SourceElementExtent
+{
+    // The tokenizer position after the element.
+    uint32_t end;
+
+    // The furthest position read by the time the element was parsed.
+    uint32_t readExtent;
+
+    // Whether a line terminator had been read since the element's last
+    // token, and whether the parser had an automatic semicolon pushed
+    // back after it.
+    bool newlineSinceToken;
+    bool automaticSemicolon;
+
+    inline SourceElementExtent(uint32_t end, uint32_t readExtent,
+                               bool newlineSinceToken,
+                               bool automaticSemicolon)
+      : end(end),
+        readExtent(readExtent),
+        newlineSinceToken(newlineSinceToken),
+        automaticSemicolon(automaticSemicolon)
+    {}
+};
+
+typedef BaseNode::List<SourceElementExtent> SourceElementExtentList;
+
 class ProgramNode : public BaseNode
 {
   private:
     SourceElementList sourceElements_;
+    SourceElementExtentList extents_;
 
   public:
-    explicit inline ProgramNode(SourceElementList &&sourceElements)
+    inline ProgramNode(SourceElementList &&sourceElements,
+                       SourceElementExtentList &&extents)
       : BaseNode(Program),
-        sourceElements_(sourceElements)
-    {}
+        sourceElements_(std::move(sourceElements)),
+        extents_(std::move(extents))
+    {
+        WH_ASSERT(extents_.size() == sourceElements_.size());
+    }
 
     inline const SourceElementList &sourceElements() const {
         return sourceElements_;
     }
+
+    inline const SourceElementExtentList &sourceElementExtents() const {
+        return extents_;
+    }
 };
 
 
@@ -39,7 +39,7 @@ PrintNode(const CodeSource &src, const BaseNode *node, Printer pr,
 
 template <typename Printer>
 void
-PrintToken(const CodeSource &src, const Token &token, Printer pr)
+PrintToken(const CodeSource &src, const SyntaxToken &token, Printer pr)
 {
     pr(token.text(src), token.length());
 }
@@ -265,7 +265,12 @@ PrintFunctionExpression(const CodeSource &src,
         first = false;
     }
     pr(") {\n");
-    PrintSourceElementList(src, node->functionBody(), pr, tabDepth+1);
+    if (node->isLazy()) {
+        PrintTabDepth(tabDepth+1, pr);
+        pr("/* not yet parsed */\n");
+    } else {
+        PrintSourceElementList(src, node->functionBody(), pr, tabDepth+1);
+    }
     PrintTabDepth(tabDepth, pr);
     pr("}");
 }
@@ -1031,7 +1036,7 @@ PrintSwitchStatement(const CodeSource &src, const SwitchStatementNode *node,
     pr("switch (");
     PrintNode(src, node->value(), pr, tabDepth);
     pr(") {\n");
-    for (auto switchCase : node->caseClauses()) {
+    for (const auto &switchCase : node->caseClauses()) {
         PrintTabDepth(tabDepth, pr);
         if (switchCase.expression()) {
             pr("case ");
@@ -1,7 +1,6 @@
 
 #include <unictype.h>
 #include <string.h>
-#include <algorithm>
 
 #include "spew.hpp"
 #include "parser/tokenizer.hpp"
@@ -12,174 +11,66 @@ namespace Whisper {
 
 //
 // KeywordTable implementation.
-// 
-struct KeywordTableEntry
-{
-    Token::Type token;
-    const char *keywordString;
-    uint32_t lastBytesPacked;
-    uint8_t priority;
-    uint8_t length;
-    bool futureReserved;
-    bool strictFutureReserved;
-};
-#define KW_TABSZ_(tokId,name,prio) +1
-static constexpr unsigned KEYWORD_TABLE_SIZE = 0
-        WHISPER_DEFN_KEYWORDS(KW_TABSZ_);
-#undef KW_TABSZ_
-
-static KeywordTableEntry KEYWORD_TABLE[KEYWORD_TABLE_SIZE];
-static bool KEYWORD_TABLE_INITIALIZED = false;
-
-// Array storing ofsets into keyword table for keywords of particular
-// lengths.  Max keyword length is 10.  There are 12 entries in the
-// array to allow for a "zero" entry for length 0, and
-// "final" entry that points to the end of the keyword list.
-static constexpr unsigned KEYWORD_MAX_LENGTH = 10;
-static unsigned KEYWORD_TABLE_SECTIONS[KEYWORD_MAX_LENGTH+2];
-
-static uint32_t
-ComputeLastBytesPacked(const char *str, uint8_t length)
-{
-    if (length == 2) {
-        return (ToUInt32(str[0]) << 8)
-             | (ToUInt32(str[1]) << 0);
-    }
-
-    if (length == 3) {
-        return (ToUInt32(str[0]) << 16)
-             | (ToUInt32(str[1]) << 8)
-             | (ToUInt32(str[2]) << 0);
-    }
-
-
-    str += length - 4;
-    return (ToUInt32(str[0]) << 24)
-         | (ToUInt32(str[1]) << 16)
-         | (ToUInt32(str[2]) << 8)
-         | (ToUInt32(str[3]) << 0);
-}
+//
+// Keywords are recognized with a perfect hash of an identifier's
+// length, its first two bytes and its last byte.  Each keyword is a
+// case of a switch on the hash, so the compiler builds the table and
+// rejects any collision between keywords as a duplicate case, and an
+// identifier is checked against the one keyword of its hash.  The
+// second byte tells "package" from "private".
+//
 
-unsigned InitializeKeywordSection(unsigned len, unsigned start)
-{
-    for (unsigned i = start; i < KEYWORD_TABLE_SIZE; i++) {
-        if (KEYWORD_TABLE[i].length >= len) {
-            KEYWORD_TABLE_SECTIONS[len] = i;
-            return i;
-        }
-    }
-    WH_UNREACHABLE("Unreachable.");
-    return 0;
-}
+static constexpr unsigned KEYWORD_MIN_LENGTH = 2;
+static constexpr unsigned KEYWORD_MAX_LENGTH = 10;
+static constexpr unsigned KEYWORD_HASH_BITS = 7;
 
-void InitializeKeywordTable()
+static constexpr uint32_t
+KeywordHash(uint32_t length, uint8_t first, uint8_t second, uint8_t last)
 {
-    WH_ASSERT(!KEYWORD_TABLE_INITIALIZED);
-
-    // Write out the keyword table entries in order.
-    // Initially, use lastBytesPacked to store priority.
-    // Later overwrite it with the actual packed last bytes of the keyword.
-    unsigned idx = 0;
-#define KW_ADDENT_(tokId,name,prio) \
-    KEYWORD_TABLE[idx].token = Token::tokId; \
-    KEYWORD_TABLE[idx].keywordString = name; \
-    KEYWORD_TABLE[idx].priority = prio; \
-    KEYWORD_TABLE[idx].length = strlen(name); \
-    KEYWORD_TABLE[idx].lastBytesPacked = \
-        ComputeLastBytesPacked(name, KEYWORD_TABLE[idx].length); \
-    KEYWORD_TABLE[idx].futureReserved = \
-        (prio == WHISPER_KEYWORD_FUTURE_RESERVED_PRIO); \
-    KEYWORD_TABLE[idx].strictFutureReserved = \
-        (prio == WHISPER_KEYWORD_STRICT_FUTURE_RESERVED_PRIO); \
-    idx += 1;
-    WHISPER_DEFN_KEYWORDS(KW_ADDENT_);
-#undef KW_ADDENT_
-
-    // Sort the table for easy lookup.
-    // Keywords are sorted by (length, priority)
-    struct Less {
-        inline Less() {}
-        inline bool operator ()(const KeywordTableEntry &a,
-                                const KeywordTableEntry &b)
-        {
-            if (a.length < b.length)
-                return true;
-            if (a.length > b.length)
-                return false;
-            return a.priority < b.priority;
-        }
-    };
-    std::sort(&KEYWORD_TABLE[0], &KEYWORD_TABLE[KEYWORD_TABLE_SIZE], Less());
-
-    // Scan and store the section offests.
-    unsigned offset = 0;
-    for (unsigned i = 0; i <= KEYWORD_MAX_LENGTH; i++)
-        offset = InitializeKeywordSection(i, offset);
-
-    KEYWORD_TABLE_SECTIONS[KEYWORD_MAX_LENGTH+1] = KEYWORD_TABLE_SIZE;
-    KEYWORD_TABLE_INITIALIZED = true;
+    return (((length << 24) | (ToUInt32(first) << 16) |
+             (ToUInt32(second) << 8) | ToUInt32(last)) * 0x11363u)
+                >> (32 - KEYWORD_HASH_BITS);
 }
 
-Token::Type
-CheckKeywordTable(const uint8_t *text, unsigned length,
-                  uint32_t lastBytesPacked, bool strict)
+static Token::Type
+CheckKeywordTable(const uint8_t *text, unsigned length, bool strict)
 {
-    WH_ASSERT(KEYWORD_TABLE_INITIALIZED);
     WH_ASSERT(length >= 1);
 
     // Single letter identifiers are common, and can't be keywords.
     // Very long identifiers also can't be keywords
-    if (length < 2 || length > KEYWORD_MAX_LENGTH)
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
         return Token::INVALID;
 
-    unsigned startIdx = KEYWORD_TABLE_SECTIONS[length];
-    unsigned endIdx = KEYWORD_TABLE_SECTIONS[length+1];
-
-    // Check for keyword by scanning keyword table by length.
-    for (unsigned i = startIdx; i < endIdx; i++) {
-        KeywordTableEntry &ent = KEYWORD_TABLE[i];
-        WH_ASSERT(ent.length == length);
-
-        if (!strict && ent.strictFutureReserved)
-            continue;
-
-        if (ent.lastBytesPacked == lastBytesPacked) {
-            if (length <= 4)
-                return ent.token;
-
-            if (memcmp(ent.keywordString, text, length-4) == 0)
-                return ent.token;
-        }
+    switch (KeywordHash(length, text[0], text[1], text[length - 1])) {
+#define KW_CASE_(tokId,name,prio) \
+      case KeywordHash(sizeof(name) - 1, name[0], name[1], \
+                       name[sizeof(name) - 2]): \
+        if (length != sizeof(name) - 1 || memcmp(name, text, length) != 0) \
+            return Token::INVALID; \
+        if (!strict && prio == WHISPER_KEYWORD_STRICT_FUTURE_RESERVED_PRIO) \
+            return Token::INVALID; \
+        return Token::tokId;
+      WHISPER_DEFN_KEYWORDS(KW_CASE_)
+#undef KW_CASE_
+      default:
+        return Token::INVALID;
     }
-    return Token::INVALID;
 }
 
-Token::Type
-CheckKeywordTable(const uint8_t *text, unsigned length, bool strict)
+void InitializeKeywordTable()
 {
-    WH_ASSERT(KEYWORD_TABLE_INITIALIZED);
-    WH_ASSERT(length >= 1);
-
-    // Single letter identifiers are common, and can't be keywords.
-    // Very long identifiers also can't be keywords
-    if (length < 2 || length > KEYWORD_MAX_LENGTH)
-        return Token::INVALID;
-
-    unsigned startIdx = KEYWORD_TABLE_SECTIONS[length];
-    unsigned endIdx = KEYWORD_TABLE_SECTIONS[length+1];
-
-    // Check for keyword by scanning keyword table by length.
-    for (unsigned i = startIdx; i < endIdx; i++) {
-        KeywordTableEntry &ent = KEYWORD_TABLE[i];
-        WH_ASSERT(ent.length == length);
-
-        if (!strict && ent.strictFutureReserved)
-            continue;
-
-        if (memcmp(ent.keywordString, text, length) == 0)
-            return ent.token;
-    }
-    return Token::INVALID;
+    // The table is built at compile time.  Check that every keyword
+    // is found by its own text.
+#if defined(ENABLE_DEBUG)
+#define KW_CHECK_(tokId,name,prio) \
+    WH_ASSERT(sizeof(name) - 1 >= KEYWORD_MIN_LENGTH && \
+              sizeof(name) - 1 <= KEYWORD_MAX_LENGTH); \
+    WH_ASSERT(CheckKeywordTable(reinterpret_cast<const uint8_t *>(name), \
+                                sizeof(name) - 1, true) == Token::tokId);
+    WHISPER_DEFN_KEYWORDS(KW_CHECK_)
+#undef KW_CHECK_
+#endif
 }
 
 
@@ -234,11 +125,11 @@ LookupQuickToken(unic_t ch)
 
 
 //
-// Token implementation.
+// SyntaxToken and Token implementation.
 //
 
 const char *
-Token::TypeString(Type type)
+SyntaxToken::TypeString(Type type)
 {
     switch (type) {
 #define DEF_CASE_(tok) \
@@ -277,8 +168,7 @@ TokenizerMark
 Tokenizer::mark() const
 {
     return TokenizerMark(stream_.position(),
-                         line_,
-                         stream_.cursor() - lineStart_,
+                         newlineSinceToken_,
                          strict_,
                          pushedBackToken_,
                          tok_);
@@ -287,21 +177,36 @@ Tokenizer::mark() const
 void
 Tokenizer::gotoMark(const TokenizerMark &mark)
 {
-    stream_.rewindTo(mark.position());
-    line_ = mark.line();
-    lineStart_ = stream_.cursor() - mark.lineOffset();
+    // Marks taken by another tokenizer over the same source may be
+    // ahead of this one.
+    if (mark.position() <= stream_.position()) {
+        readExtent_ = readExtent();
+        stream_.rewindTo(mark.position());
+    } else {
+        stream_.advanceTo(mark.position());
+    }
+    newlineSinceToken_ = mark.newlineSinceToken();
     WH_ASSERT(strict_ == mark.strict());
     WH_ASSERT(mark.pushedBackToken() == mark.token().debug_isPushedBack());
     pushedBackToken_ = mark.pushedBackToken();
     tok_ = mark.token();
 }
 
+void
+Tokenizer::startAt(uint32_t position, bool newlineSinceToken)
+{
+    WH_ASSERT(stream_.position() == 0);
+    WH_ASSERT(!pushedBackToken_);
+    stream_.advanceTo(position);
+    newlineSinceToken_ = newlineSinceToken;
+    readExtent_ = position;
+}
+
 Token
 Tokenizer::getAutomaticSemicolon() const
 {
-    uint32_t lineOffset = stream_.cursor() - lineStart_;
     return Token(Token::Semicolon, stream_.position(), 0,
-                 line_, lineOffset, line_, lineOffset);
+                 newlineSinceToken_);
 }
 
 void
@@ -587,9 +492,9 @@ void
 Tokenizer::rewindToToken(const Token &tok)
 {
     // Find the stream position to rewind to.
+    readExtent_ = readExtent();
     stream_.rewindTo(tok.offset());
-    line_ = tok.startLine();
-    lineStart_ = stream_.cursor() - tok.startLineOffset();
+    newlineSinceToken_ = tok.newlineBefore();
 }
 
 void
@@ -597,14 +502,14 @@ Tokenizer::advancePastToken(const Token &tok)
 {
     // Find the stream position to advance to.
     stream_.advanceTo(tok.endOffset());
-    line_ = tok.endLine();
-    lineStart_ = stream_.cursor() - tok.endLineOffset();
+    newlineSinceToken_ = tok.newlineBefore() && tok.isSkipped();
 }
 
 const Token &
 Tokenizer::readWhitespace()
 {
     for (;;) {
+        stream_.skipInlineWhitespace();
         unic_t ch = readChar();
         if (IsWhitespace(ch))
             continue;
@@ -629,6 +534,9 @@ Tokenizer::readMultiLineComment()
 {
     bool sawStar = false;
     for (;;) {
+        // A '/' only ends the comment right after a '*'.
+        if (!sawStar)
+            stream_.skipMultiLineCommentChars();
         unic_t ch = readNonEndChar();
 
         if (sawStar && (ch == '/'))
@@ -648,6 +556,7 @@ const Token &
 Tokenizer::readSingleLineComment()
 {
     for (;;) {
+        stream_.skipSingleLineCommentChars();
         unic_t ch = readChar();
 
         if (IsLineTerminator(ch) || ch == End) {
@@ -722,6 +631,7 @@ const Token &
 Tokenizer::readIdentifierName()
 {
     for (;;) {
+        stream_.skipSimpleIdentifierChars();
         unic_t ch = readChar();
 
         // Common case: simple identifier continuation.
@@ -759,16 +669,12 @@ const Token &
 Tokenizer::readIdentifier(unic_t firstChar)
 {
     WH_ASSERT(IsKeywordChar(firstChar));
-    uint32_t lastBytesPacked = firstChar;
 
     for (;;) {
         unic_t ch = readChar();
 
-        if (IsKeywordChar(ch)) {
-            lastBytesPacked <<= 8;
-            lastBytesPacked |= ch;
+        if (IsKeywordChar(ch))
             continue;
-        }
 
         // Common case: simple identifier continuation.
         if (IsNonKeywordSimpleIdentifierContinue(ch))
@@ -804,8 +710,7 @@ Tokenizer::readIdentifier(unic_t firstChar)
     }
 
     unsigned tokenLength = stream_.cursor() - tokStart_;
-    Token::Type kwType = CheckKeywordTable(tokStart_, tokenLength,
-                                           lastBytesPacked, strict_);
+    Token::Type kwType = CheckKeywordTable(tokStart_, tokenLength, strict_);
     if (kwType == Token::INVALID)
         return emitIdentifier();
 
@@ -944,20 +849,26 @@ Tokenizer::readHexIntegerLiteral()
 const Token &
 Tokenizer::readStringLiteral(unic_t quoteChar)
 {
+    bool plain = true;
     for (;;) {
+        stream_.skipStringLiteralChars(quoteChar);
         unic_t ch = readNonEndChar();
 
         if (ch == quoteChar)
             break;
 
-        if (ch == '\\')
+        if (ch == '\\') {
             consumeStringEscapeSequence();
+            plain = false;
+        } else if (ch >= 0x80) {
+            plain = false;
+        }
 
         if (IsLineTerminator(ch))
             emitError("Unescaped line terminator in string.");
     }
 
-    return emitToken(Token::StringLiteral);
+    return emitToken(Token::StringLiteral, plain ? Token::String_Plain : 0);
 }
 
 void
@@ -1014,8 +925,9 @@ Tokenizer::emitToken(Token::Type type, uint16_t flags)
     tok_ = Token(type, flags,
                  stream_.positionOf(tokStart_),
                  stream_.cursor() - tokStart_,
-                 tokStartLine_, tokStartLineOffset_,
-                 line_, stream_.cursor() - lineStart_);
+                 newlineSinceToken_);
+    if (!Token::IsSkippedType(type))
+        newlineSinceToken_ = false;
     return tok_;
 }
 
@@ -7,6 +7,7 @@
 #include "parser/code_source.hpp"
 #include "parser/token_defn.hpp"
 #include "allocators.hpp"
+#include "compilation_arena.hpp"
 
 //
 // The tokenizer parses a code source into a series of tokens.
@@ -18,8 +19,9 @@ namespace Whisper {
 //
 // KeywordTable
 //
-// Keeps an ordered table of keywords which can be used to do quick
-// lookups of identifiers which may be keywords.
+// Identifiers which may be keywords are looked up in a perfect hash
+// table built at compile time.  Initializing it only checks it, in
+// debug builds.
 //
 void InitializeKeywordTable();
 
@@ -33,11 +35,13 @@ void InitializeQuickTokenTable();
 
 
 //
-// Token
+// SyntaxToken
 //
-// Represents a token.
+// The part of a token which syntax trees keep: its type and flags, and
+// its (offset, length) in the code source.  Lines and columns are not
+// kept; a LineIndex over the code source finds them when needed.
 //
-class Token
+class SyntaxToken
 {
   public:
     enum Type : uint8_t
@@ -63,6 +67,13 @@ class Token
                (type <= WHISPER_LAST_STRICT_KEYWORD_TOKEN);
     }
 
+    // Whitespace, comments and line terminators, which the parser
+    // skips.
+    inline static bool IsSkippedType(Type type) {
+        return (type >= LineTerminatorSequence) &&
+               (type <= MultiLineComment);
+    }
+
     static const char *TypeString(Type type);
 
     // The flags enum allows annotating a token with
@@ -71,15 +82,77 @@ class Token
     // must use different bits.
     constexpr static uint16_t Numeric_Double = 0x0001u;
 
+    // A string literal of only ASCII chars and no escapes, whose value
+    // is its source text between the quotes.
+    constexpr static uint16_t String_Plain = 0x0001u;
+
   protected:
     Type type_ = INVALID;
     uint16_t flags_ = 0;
     uint32_t offset_ = 0;
     uint32_t length_ = 0;
-    uint32_t startLine_ = 0;
-    uint32_t startLineOffset_ = 0;
-    uint32_t endLine_ = 0;
-    uint32_t endLineOffset_ = 0;
+
+  public:
+    SyntaxToken() {}
+
+    SyntaxToken(Type type, uint16_t flags, uint32_t offset, uint32_t length)
+      : type_(type), flags_(flags), offset_(offset), length_(length)
+    {}
+
+    inline Type type() const {
+        return type_;
+    }
+
+    inline uint16_t flags() const {
+        return flags_;
+    }
+    inline bool hasFlag(uint16_t flag) const {
+        return flags_ & flag;
+    }
+
+    inline const char *typeString() const {
+        return TypeString(type_);
+    }
+
+    inline uint32_t offset() const {
+        return offset_;
+    }
+    inline uint32_t length() const {
+        return length_;
+    }
+    inline uint32_t endOffset() const {
+        return offset_ + length_;
+    }
+
+    inline const uint8_t *text(const CodeSource &src) const {
+        return src.data() + offset_;
+    }
+
+    // Define type check methods
+#define DEF_CHECKER_(tok) \
+    inline bool is##tok() const { \
+        return type_ == tok; \
+    }
+    WHISPER_DEFN_TOKENS(DEF_CHECKER_)
+#undef DEF_CHECKER_
+
+    inline bool isKeyword(bool strict) const {
+        return strict ? IsKeywordType(type_) : IsStrictKeywordType(type_);
+    }
+};
+
+
+//
+// Token
+//
+// Represents a token.
+//
+class Token : public SyntaxToken
+{
+  protected:
+    // Whether a line terminator occurs between this token and the
+    // last token before it which is not skipped.
+    bool newlineBefore_ = false;
     bool maybeKeyword_ = false;
 
     // Tokens returned from the tokenizer are actually references to
@@ -95,28 +168,21 @@ class Token
     Token() : debug_used_(true), debug_pushedBack_(false) {}
 
     Token(Type type, uint16_t flags, uint32_t offset, uint32_t length,
-          uint32_t startLine, uint32_t startLineOffset,
-          uint32_t endLine, uint32_t endLineOffset)
-      : type_(type), flags_(flags), offset_(offset), length_(length),
-        startLine_(startLine), startLineOffset_(startLineOffset),
-        endLine_(endLine), endLineOffset_(endLineOffset),
+          bool newlineBefore)
+      : SyntaxToken(type, flags, offset, length),
+        newlineBefore_(newlineBefore),
         debug_used_(false), debug_pushedBack_(false)
     {}
 
-    Token(Type type, uint32_t offset, uint32_t length,
-          uint32_t startLine, uint32_t startLineOffset,
-          uint32_t endLine, uint32_t endLineOffset)
-      : type_(type), flags_(0), offset_(offset), length_(length),
-        startLine_(startLine), startLineOffset_(startLineOffset),
-        endLine_(endLine), endLineOffset_(endLineOffset),
+    Token(Type type, uint32_t offset, uint32_t length, bool newlineBefore)
+      : SyntaxToken(type, 0, offset, length),
+        newlineBefore_(newlineBefore),
         debug_used_(false), debug_pushedBack_(false)
     {}
 
     Token(const Token &other)
-      : type_(other.type_), flags_(other.flags_),
-        offset_(other.offset_), length_(other.length_),
-        startLine_(other.startLine_), startLineOffset_(other.startLineOffset_),
-        endLine_(other.endLine_), endLineOffset_(other.endLineOffset_),
+      : SyntaxToken(other),
+        newlineBefore_(other.newlineBefore_),
         debug_used_(false), debug_pushedBack_(false)
     {
         WH_ASSERT(other.debug_pushedBack_ == false);
@@ -127,10 +193,8 @@ class Token
         Preserve
     };
     Token(const Token &other, PreserveDebugUsed preserve)
-      : type_(other.type_), flags_(other.flags_),
-        offset_(other.offset_), length_(other.length_),
-        startLine_(other.startLine_), startLineOffset_(other.startLineOffset_),
-        endLine_(other.endLine_), endLineOffset_(other.endLineOffset_),
+      : SyntaxToken(other),
+        newlineBefore_(other.newlineBefore_),
         debug_used_(other.debug_used_),
         debug_pushedBack_(other.debug_pushedBack_)
     {
@@ -138,14 +202,8 @@ class Token
 
     Token &operator =(const Token &other)
     {
-        type_ = other.type_;
-        offset_ = other.offset_;
-        flags_ = other.flags_;
-        length_ = other.length_;
-        startLine_ = other.startLine_;
-        startLineOffset_ = other.startLineOffset_;
-        endLine_ = other.endLine_;
-        endLineOffset_ = other.endLineOffset_;
+        SyntaxToken::operator =(other);
+        newlineBefore_ = other.newlineBefore_;
         maybeKeyword_ = other.maybeKeyword_;
         debug_used_ = other.debug_used_;
         debug_pushedBack_ = other.debug_pushedBack_;
@@ -153,43 +211,12 @@ class Token
         return *this;
     }
 
-    inline Type type() const {
-        return type_;
-    }
-
-    inline uint16_t flags() const {
-        return flags_;
-    }
-    inline bool hasFlag(uint16_t flag) const {
-        return flags_ & flag;
-    }
-
-    inline const char *typeString() const {
-        return TypeString(type_);
-    }
-
-    inline uint32_t offset() const {
-        return offset_;
-    }
-    inline uint32_t length() const {
-        return length_;
-    }
-    inline uint32_t endOffset() const {
-        return offset_ + length_;
+    inline bool isSkipped() const {
+        return IsSkippedType(type_);
     }
 
-    inline uint32_t startLine() const {
-        return startLine_;
-    }
-    inline uint32_t startLineOffset() const {
-        return startLineOffset_;
-    }
-
-    inline uint32_t endLine() const {
-        return endLine_;
-    }
-    inline uint32_t endLineOffset() const {
-        return endLineOffset_;
+    inline bool newlineBefore() const {
+        return newlineBefore_;
     }
 
     inline bool maybeKeyword() const {
@@ -199,26 +226,6 @@ class Token
         maybeKeyword_ = b;
     }
 
-    inline const uint8_t *text(const CodeSource &src) const {
-        return src.data() + offset_;
-    }
-
-    inline bool newlineOccursBefore(const Token &other) const {
-        return endLine_ < other.startLine_;
-    }
-
-    // Define type check methods
-#define DEF_CHECKER_(tok) \
-    inline bool is##tok() const { \
-        return type_ == tok; \
-    }
-    WHISPER_DEFN_TOKENS(DEF_CHECKER_)
-#undef DEF_CHECKER_
-
-    inline bool isKeyword(bool strict) const {
-        return strict ? IsKeywordType(type_) : IsStrictKeywordType(type_);
-    }
-
     void maybeConvertKeyword(const CodeSource &src, bool strict);
 
     // explicitly mark this token as being used.
@@ -252,7 +259,7 @@ class Token
 // matching type.
 //
 template <Token::Type... TYPES>
-class TypedToken : public Token
+class TypedToken : public SyntaxToken
 {
   private:
     template <Token::Type TP>
@@ -266,12 +273,13 @@ class TypedToken : public Token
 
   public:
     explicit TypedToken(const Token &token)
-      : Token(token)
+      : SyntaxToken(token)
     {
         WH_ASSERT(CheckType<TYPES...>(type_));
+        token.debug_markUsed();
     }
 
-    TypedToken() : Token() {}
+    TypedToken() : SyntaxToken() {}
 };
 
 #define DEF_TYPEDEF_(tok)   typedef TypedToken<Token::tok> tok##Token;
@@ -292,37 +300,39 @@ class TokenizerError {
 class TokenizerMark {
   private:
     uint32_t position_;
-    uint32_t line_;
-    uint32_t lineOffset_;
+    bool newlineSinceToken_;
     bool strict_;
     bool pushedBackToken_;
     Token tok_;
 
   public:
     inline TokenizerMark(uint32_t position,
-                         uint32_t line,
-                         uint32_t lineOffset,
+                         bool newlineSinceToken,
                          bool strict,
                          bool pushedBackToken,
                          const Token &tok)
       : position_(position),
-        line_(line),
-        lineOffset_(lineOffset),
+        newlineSinceToken_(newlineSinceToken),
         strict_(strict),
         pushedBackToken_(pushedBackToken),
         tok_(tok, Token::Preserve)
     {}
 
+    // Copies keep the token's debug state, so marks can be stored.
+    inline TokenizerMark(const TokenizerMark &other)
+      : position_(other.position_),
+        newlineSinceToken_(other.newlineSinceToken_),
+        strict_(other.strict_),
+        pushedBackToken_(other.pushedBackToken_),
+        tok_(other.tok_, Token::Preserve)
+    {}
+
     inline uint32_t position() const {
         return position_;
     }
 
-    inline uint32_t line() const {
-        return line_;
-    }
-
-    inline uint32_t lineOffset() const {
-        return lineOffset_;
+    inline bool newlineSinceToken() const {
+        return newlineSinceToken_;
     }
 
     inline bool strict() const {
@@ -346,14 +356,15 @@ class Tokenizer
     SourceStream stream_;
     Token tok_;
 
-    // Parsing state.
-    uint32_t line_ = 0;
-    const uint8_t *lineStart_ = 0;
+    // Whether a line terminator has been read since the last token
+    // which is not skipped.
+    bool newlineSinceToken_ = false;
+
+    // The furthest stream position reached before the last rewind.
+    uint32_t readExtent_ = 0;
 
     // Current token state.
     const uint8_t *tokStart_ = nullptr;
-    uint32_t tokStartLine_ = 0;
-    uint32_t tokStartLineOffset_ = 0;
 
     // Error message.
     const char *error_ = nullptr;
@@ -375,6 +386,13 @@ class Tokenizer
         tok_.debug_markUsed();
     }
 
+    // Allocate tokens and the syntax tree in the arena's Syntax
+    // sub-arena.
+    Tokenizer(CompilationArena &arena, CodeSource &source)
+      : Tokenizer(arena.allocatorFor<uint8_t>(CompilationArenaKind::Syntax),
+                  source)
+    {}
+
     inline ~Tokenizer() {}
 
     const STLBumpAllocator<uint8_t> &allocator() const {
@@ -385,10 +403,24 @@ class Tokenizer
         return source_;
     }
 
-    inline uint32_t line() const {
-        return line_;
+    inline uint32_t position() const {
+        return stream_.position();
+    }
+
+    inline bool newlineSinceToken() const {
+        return newlineSinceToken_;
     }
 
+    // The furthest stream position reached so far.  The byte at it may
+    // have been looked at, but none after it.
+    inline uint32_t readExtent() const {
+        return Max(readExtent_, stream_.position());
+    }
+
+    // Start a fresh tokenizer at |position|, as though the tokens before
+    // it had been read.
+    void startAt(uint32_t position, bool newlineSinceToken);
+
     TokenizerMark mark() const;
     void gotoMark(const TokenizerMark &mark);
     Token getAutomaticSemicolon() const;
@@ -461,13 +493,10 @@ class Tokenizer
     // Token tracking during parsing.
     inline void startToken() {
         tokStart_ = stream_.cursor();
-        tokStartLine_ = line_;
-        tokStartLineOffset_ = tokStart_ - lineStart_;
     }
 
     inline void startNewLine() {
-        line_++;
-        lineStart_ = stream_.cursor();
+        newlineSinceToken_ = true;
     }
 
     // Character reading.
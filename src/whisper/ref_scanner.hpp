@@ -3,13 +3,20 @@
 
 #include "common.hpp"
 #include "debug.hpp"
+#include "value.hpp"
+#include "rooting.hpp"
+#include "vm/heap_thing.hpp"
 
 namespace Whisper {
 
-enum RefKind
+enum class RefKind : uint8_t
 {
     INVALID = 0,
     HeapThing,
+    Value,
+    WeakHeapThing,
+    WeakValue,
+    EphemeronValue,
     LIMIT
 };
 
@@ -39,9 +46,225 @@ enum RefKind
 //      void *read();
 //      void update(void *);
 //
+// Weak refs (WeakHeapThing and WeakValue) do not keep what they refer
+// to alive.  Once a collection finds that dead, it clears the ref.
+//
+// An EphemeronValue ref is the value half of an ephemeron: a Value slot
+// which directly follows a WeakValue slot holding its key.  The value
+// is kept alive only while the key is alive, however the key is
+// reached.  When the key dies, the collector clears the key to
+// undefined and the value to false, which marks the pair deleted.
+//
+// Specializations for heap thing types live alongside the type's
+// definition.  The primary template is left undefined, so scanning
+// a type without a specialization fails to compile.
+//
 template <typename T>
-class RefScanner
+class RefScanner;
+
+
+//
+// HeapRef
+//
+// A Ref to a single reference slot within a heap thing, which holds
+// either a heap thing pointer or a Value.
+//
+// |read()| returns the heap thing referenced by the slot, or nullptr if
+// the slot does not refer to a heap thing.  |update()| replaces the
+// referenced heap thing, preserving the kind of value held in the slot.
+// |clear()| empties a weak or ephemeron slot whose referent is dead.
+//
+class HeapRef
+{
+  private:
+    RefKind kind_;
+    void *slot_;
+
+  public:
+    inline HeapRef() : kind_(RefKind::INVALID), slot_(nullptr) {}
+    inline HeapRef(RefKind kind, void *slot) : kind_(kind), slot_(slot) {}
+
+    static inline HeapRef FromValue(Value *val) {
+        return HeapRef(RefKind::Value, val);
+    }
+
+    template <typename T>
+    static inline HeapRef FromHeapThing(T **thingp) {
+        return HeapRef(RefKind::HeapThing, thingp);
+    }
+
+    static inline HeapRef FromWeakValue(Value *val) {
+        return HeapRef(RefKind::WeakValue, val);
+    }
+
+    template <typename T>
+    static inline HeapRef FromWeakHeapThing(T **thingp) {
+        return HeapRef(RefKind::WeakHeapThing, thingp);
+    }
+
+    static inline HeapRef FromEphemeronValue(Value *val) {
+        return HeapRef(RefKind::EphemeronValue, val);
+    }
+
+    inline RefKind kind() const {
+        return kind_;
+    }
+
+    inline void *slot() const {
+        return slot_;
+    }
+
+    inline bool isWeak() const {
+        return kind_ == RefKind::WeakHeapThing ||
+               kind_ == RefKind::WeakValue;
+    }
+
+    inline bool isEphemeronValue() const {
+        return kind_ == RefKind::EphemeronValue;
+    }
+
+    // The key slot of an ephemeron value.
+    inline HeapRef ephemeronKey() const {
+        WH_ASSERT(isEphemeronValue());
+        return FromWeakValue(reinterpret_cast<Value *>(slot_) - 1);
+    }
+
+    inline void *read() const;
+    inline void update(void *ptr) const;
+    inline void clear() const;
+
+  private:
+    inline bool holdsHeapThing() const {
+        return kind_ == RefKind::HeapThing ||
+               kind_ == RefKind::WeakHeapThing;
+    }
+};
+
+inline void *
+HeapRef::read() const
+{
+    WH_ASSERT(kind_ != RefKind::INVALID && kind_ < RefKind::LIMIT);
+
+    if (holdsHeapThing())
+        return *reinterpret_cast<VM::HeapThing **>(slot_);
+
+    const Value *val = reinterpret_cast<const Value *>(slot_);
+    if (val->raw() == Value::Invalid || !val->isHeapThing())
+        return nullptr;
+
+    if (val->isObject())
+        return val->objectPtr();
+
+    if (val->isHeapString())
+        return val->heapStringPtr();
+
+    WH_ASSERT(val->isHeapDouble());
+    return val->heapDoublePtr();
+}
+
+inline void
+HeapRef::update(void *ptr) const
+{
+    WH_ASSERT(kind_ != RefKind::INVALID && kind_ < RefKind::LIMIT);
+
+    if (holdsHeapThing()) {
+        *reinterpret_cast<VM::HeapThing **>(slot_) =
+            reinterpret_cast<VM::HeapThing *>(ptr);
+        return;
+    }
+
+    Value *val = reinterpret_cast<Value *>(slot_);
+    WH_ASSERT(val->isHeapThing());
+
+    if (val->isObject())
+        *val = Value::Object(reinterpret_cast<VM::HeapThing *>(ptr));
+    else if (val->isHeapString())
+        *val = Value::HeapString(reinterpret_cast<VM::HeapString *>(ptr));
+    else
+        *val = Value::HeapDouble(reinterpret_cast<VM::HeapDouble *>(ptr));
+}
+
+inline void
+HeapRef::clear() const
 {
+    WH_ASSERT(isWeak() || isEphemeronValue());
+
+    if (holdsHeapThing())
+        *reinterpret_cast<VM::HeapThing **>(slot_) = nullptr;
+    else if (isEphemeronValue())
+        *reinterpret_cast<Value *>(slot_) = Value::False();
+    else
+        *reinterpret_cast<Value *>(slot_) = Value::Undefined();
+}
+
+//
+// FieldRefScanner
+//
+// Base class for RefScanners of heap things with a fixed set of
+// reference fields, optionally followed by a contiguous array of
+// Values.
+//
+// Specializations register their fields from their constructor, with
+// at most |MaxFields| fields.  Scanning then walks a small inline array
+// and a pointer range, with no per-type dispatch.
+//
+template <uint32_t MaxFields>
+class FieldRefScanner
+{
+  public:
+    typedef HeapRef Ref;
+
+  private:
+    HeapRef fields_[MaxFields > 0 ? MaxFields : 1];
+    uint32_t numFields_;
+    uint32_t curField_;
+
+    Value *curValue_;
+    Value *endValue_;
+
+  protected:
+    inline FieldRefScanner()
+      : numFields_(0), curField_(0), curValue_(nullptr), endValue_(nullptr)
+    {}
+
+    inline void addField(Heap<Value> &field) {
+        WH_ASSERT(numFields_ < MaxFields);
+        fields_[numFields_++] = HeapRef::FromValue(field.addr());
+    }
+
+    template <typename T>
+    inline void addField(Heap<T *> &field) {
+        WH_ASSERT(numFields_ < MaxFields);
+        fields_[numFields_++] = HeapRef::FromHeapThing(field.addr());
+    }
+
+    inline void addWeakField(WeakHeap<Value> &field) {
+        WH_ASSERT(numFields_ < MaxFields);
+        fields_[numFields_++] = HeapRef::FromWeakValue(field.addr());
+    }
+
+    template <typename T>
+    inline void addWeakField(WeakHeap<T *> &field) {
+        WH_ASSERT(numFields_ < MaxFields);
+        fields_[numFields_++] = HeapRef::FromWeakHeapThing(field.addr());
+    }
+
+    inline void setValueRange(Value *start, uint32_t count) {
+        curValue_ = start;
+        endValue_ = start + count;
+    }
+
+  public:
+    inline bool hasMoreRefs() const {
+        return curField_ < numFields_ || curValue_ < endValue_;
+    }
+
+    inline HeapRef nextRef() {
+        WH_ASSERT(hasMoreRefs());
+        if (curField_ < numFields_)
+            return fields_[curField_++];
+        return HeapRef::FromValue(curValue_++);
+    }
 };
 
 
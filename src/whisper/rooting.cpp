@@ -1,40 +1,49 @@
+#include "memalloc.hpp"
 #include "rooting.hpp"
 #include "rooting_inlines.hpp"
 
 namespace Whisper {
 
 //
-// RootBase
+// RootStack
 //
 
-RootBase::RootBase(ThreadContext *threadContext, RootKind kind)
-  : threadContext_(threadContext),
-    next_(threadContext->roots()),
-    kind_(kind)
+RootStack::RootStack(uint32_t maxEntries)
+  : maxEntries_(maxEntries),
+    base_(nullptr),
+    top_(nullptr),
+    limit_(nullptr)
 {}
 
-void
-RootBase::postInit()
+RootStack::~RootStack()
 {
-    threadContext_->roots_ = this;
+    WH_ASSERT(top_ == base_);
+    if (base_)
+        ReleaseMappedMemory(base_, maxEntries_ * sizeof(Entry));
 }
 
-ThreadContext *
-RootBase::threadContext() const
+bool
+RootStack::reserve()
 {
-    return threadContext_;
+    WH_ASSERT(!base_);
+    void *mem = AllocateMappedMemory(maxEntries_ * sizeof(Entry));
+    if (!mem)
+        return false;
+
+    base_ = reinterpret_cast<Entry *>(mem);
+    top_ = base_;
+    limit_ = base_ + maxEntries_;
+    return true;
 }
 
-RootBase *
-RootBase::next() const
-{
-    return next_;
-}
+//
+// RootBase
+//
 
 RootKind
 RootBase::kind() const
 {
-    return kind_;
+    return entry_->kind;
 }
 
 //
@@ -60,13 +69,13 @@ Root<Value>::Root(ThreadContext *cx, const Value &val)
 const Value *
 Root<Value>::operator ->() const
 {
-    return &thing_;
+    return thing_;
 }
 
 Value *
 Root<Value>::operator ->()
 {
-    return &thing_;
+    return thing_;
 }
 
 Root<Value> &
@@ -102,6 +111,31 @@ Heap<Value>::operator ->()
 }
 
 
+//
+// WeakHeap<Value>
+//
+
+WeakHeap<Value>::WeakHeap()
+  : TypedHeapBase<Value>(Value::Undefined())
+{}
+
+WeakHeap<Value>::WeakHeap(const Value &val)
+  : TypedHeapBase<Value>(val)
+{}
+
+const Value *
+WeakHeap<Value>::operator ->() const
+{
+    return &val_;
+}
+
+Value *
+WeakHeap<Value>::operator ->()
+{
+    return &val_;
+}
+
+
 //
 // Handle<Value>
 //
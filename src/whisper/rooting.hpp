@@ -29,27 +29,91 @@ enum class RootKind : uint8_t
     LIMIT
 };
 
+//
+// RootStack
+//
+// A per-thread stack of root entries.  Each entry holds a rooted value
+// or pointer inline, along with its kind.  Vector roots keep their
+// contents out of line, and their entries hold the vector root itself.
+//
+// Since roots are stack-allocated, they are always created and
+// destroyed in LIFO order.  Creating a root takes the entry at the top
+// of the stack, and destroying it gives the entry back, so the GC finds
+// all of a thread's roots by scanning the entries below the top.
+//
+// Address space for the whole stack is reserved when the thread
+// context is created, and the system commits its pages as they are
+// touched.
+//
+class RootStack
+{
+  friend class RootBase;
+  public:
+    // The default size of the stack, in entries.  Every root also takes
+    // up space on the native stack, so this is never reached in practice.
+    static constexpr uint32_t DefaultMaxEntries = 1 << 20;
+
+    struct Entry
+    {
+        // The rooted thing, accessed as the type it was rooted as.
+        uint64_t thing;
+        RootKind kind;
+
+        template <typename T>
+        T *thingAddr() {
+            static_assert(sizeof(T) <= sizeof(thing),
+                          "Rooted thing must fit in a root entry.");
+            return reinterpret_cast<T *>(&thing);
+        }
+    };
+
+  private:
+    uint32_t maxEntries_;
+    Entry *base_;
+    Entry *top_;
+    Entry *limit_;
+
+  public:
+    explicit RootStack(uint32_t maxEntries = DefaultMaxEntries);
+    ~RootStack();
+
+    RootStack(const RootStack &other) = delete;
+    RootStack &operator =(const RootStack &other) = delete;
+
+    bool reserve();
+
+    Entry *base() const {
+        return base_;
+    }
+
+    // The top of the stack marks the roots live at a point in time.
+    // Once all the roots created after that point are destroyed, the
+    // top is back at the mark.
+    Entry *top() const {
+        return top_;
+    }
+};
+
 //
 // RootBase
 //
-// Base class for stack-rooted references to things.
+// Base class for stack-rooted references to things.  The rooted thing
+// lives in the root's entry on its thread's RootStack.
 //
 class RootBase
 {
   protected:
-    ThreadContext *threadContext_;
-    RootBase *next_;
-    RootKind kind_;
+    RootStack &rootStack_;
+    RootStack::Entry *entry_;
 
-    RootBase(ThreadContext *threadContext, RootKind kind);
+    inline RootBase(ThreadContext *threadContext, RootKind kind);
+    inline ~RootBase();
 
-    void postInit();
+    // Roots are bound to an entry in the root stack, and cannot be
+    // copied.
+    RootBase(const RootBase &other) = delete;
 
   public:
-    ThreadContext *threadContext() const;
-
-    RootBase *next() const;
-
     RootKind kind() const;
 };
 
@@ -63,7 +127,7 @@ template <typename T>
 class TypedRootBase : public RootBase
 {
   protected:
-    T thing_;
+    T *thing_;
 
     inline TypedRootBase(ThreadContext *threadContext, RootKind kind,
                          const T &thing);
@@ -319,6 +383,41 @@ class Heap<T *> : public PointerHeapBase<T>
 };
 
 
+//
+// Weak Heap Value and Pointer
+//
+// A weak reference from one heap thing to another.  It does not keep
+// what it refers to alive: once that is found dead by a collection, the
+// slot is cleared, to undefined or null.  Heap things report weak slots
+// with FieldRefScanner::addWeakField.
+//
+
+template <typename T>
+class WeakHeap
+{
+    WeakHeap(const WeakHeap<T> &other) = delete;
+    WeakHeap(WeakHeap<T> &&other) = delete;
+};
+
+template <>
+class WeakHeap<Value> : public TypedHeapBase<Value>
+{
+  public:
+    WeakHeap();
+    WeakHeap(const Value &val);
+
+    const Value *operator ->() const;
+    Value *operator ->();
+};
+
+template <typename T>
+class WeakHeap<T *> : public PointerHeapBase<T>
+{
+  public:
+    inline WeakHeap(T *ptr);
+};
+
+
 //
 // Handle Value
 //
@@ -426,6 +525,7 @@ class VectorRootBase : public RootBase
 
     inline uint32_t size() const;
     inline void append(const T &val);
+    inline void clear();
 };
 
 template <typename T>
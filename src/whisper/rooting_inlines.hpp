@@ -4,10 +4,50 @@
 #include "rooting.hpp"
 #include "runtime.hpp"
 #include "vm/heap_thing.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include <new>
 #include <type_traits>
 
 namespace Whisper {
 
+//
+// Helpers to check whether a stored value needs a write barrier.
+//
+
+inline bool
+IsBarrieredValue(const Value &val)
+{
+    return val.isHeapThing();
+}
+
+template <typename T>
+inline bool
+IsBarrieredValue(T *ptr)
+{
+    return ptr != nullptr;
+}
+
+//
+// RootBase
+//
+
+inline
+RootBase::RootBase(ThreadContext *threadContext, RootKind kind)
+  : rootStack_(threadContext->rootStack_),
+    entry_(rootStack_.top_)
+{
+    WH_ASSERT(entry_ < rootStack_.limit_);
+    entry_->kind = kind;
+    rootStack_.top_ = entry_ + 1;
+}
+
+inline
+RootBase::~RootBase()
+{
+    WH_ASSERT(rootStack_.top_ == entry_ + 1);
+    rootStack_.top_ = entry_;
+}
+
 //
 // TypedRootBase<typename T>
 //
@@ -17,18 +57,18 @@ inline
 TypedRootBase<T>::TypedRootBase(ThreadContext *threadContext, RootKind kind,
                                 const T &thing)
   : RootBase(threadContext, kind),
-    thing_(thing)
+    thing_(entry_->thingAddr<T>())
 {
-    postInit();
+    new (thing_) T(thing);
 }
 
 template <typename T>
 inline
 TypedRootBase<T>::TypedRootBase(ThreadContext *threadContext, RootKind kind)
   : RootBase(threadContext, kind),
-    thing_()
+    thing_(entry_->thingAddr<T>())
 {
-    postInit();
+    new (thing_) T();
 }
 
 template <typename T>
@@ -48,91 +88,91 @@ template <typename T>
 inline const T &
 TypedRootBase<T>::get() const
 {
-    return thing_;
+    return *thing_;
 }
 
 template <typename T>
 inline T &
 TypedRootBase<T>::get()
 {
-    return thing_;
+    return *thing_;
 }
 
 template <typename T>
 inline const T *
 TypedRootBase<T>::addr() const
 {
-    return &thing_;
+    return thing_;
 }
 
 template <typename T>
 inline T *
 TypedRootBase<T>::addr()
 {
-    return &thing_;
+    return thing_;
 }
 
 template <typename T>
 void
 TypedRootBase<T>::set(const T &val)
 {
-    thing_ = val;
+    *thing_ = val;
 }
 
 template <typename T>
 inline
 TypedRootBase<T>::operator const T &() const
 {
-    return thing_;
+    return *thing_;
 }
 
 template <typename T>
 inline
 TypedRootBase<T>::operator T &()
 {
-    return thing_;
+    return *thing_;
 }
 
 template <typename T>
 inline bool
 TypedRootBase<T>::operator == (const T &other) const
 {
-    return thing_ == other;
+    return *thing_ == other;
 }
 
 template <typename T>
 inline bool
 TypedRootBase<T>::operator == (const TypedRootBase<T> &other) const
 {
-    return thing_ == other.thing_;
+    return *thing_ == other.get();
 }
 
 template <typename T>
 inline bool
 TypedRootBase<T>::operator == (const TypedHeapBase<T> &other) const
 {
-    return thing_ == other.get();
+    return *thing_ == other.get();
 }
 
 template <typename T>
 inline bool
 TypedRootBase<T>::operator == (const TypedHandleBase<T> &other) const
 {
-    return thing_ == other.get();
+    return *thing_ == other.get();
 }
 
 template <typename T>
 inline bool
 TypedRootBase<T>::operator == (const TypedMutHandleBase<T> &other) const
 {
-    return thing_ == other.get();
+    return *thing_ == other.get();
 }
 
 template <typename T>
 inline TypedRootBase<T> &
 TypedRootBase<T>::operator =(const T &other)
 {
-    thing_ = other;
+    *thing_ = other;
     return *this;
 }
 
@@ -171,14 +211,14 @@ template <typename T>
 inline T *
 PointerRootBase<T>::operator ->() const
 {
-    return this->thing_;
+    return *this->thing_;
 }
 
 template <typename T>
 inline
 PointerRootBase<T>::operator bool() const
 {
-    return this->thing_ != nullptr;
+    return *this->thing_ != nullptr;
 }
 
 //
@@ -223,8 +263,9 @@ template <typename T>
 inline void 
 TypedHeapBase<T>::set(const T &t, VM::HeapThing *holder)
 {
-    // TODO: mark write barriers if needed.
     val_ = t;
+    if (IsBarrieredValue(t))
+        holder->noteWrite(&val_);
 }
 
 template <typename T>
@@ -583,6 +624,17 @@ Heap<T *>::Heap(T *ptr)
 {}
 
 
+//
+// WeakHeap<T *>
+//
+
+template <typename T>
+inline
+WeakHeap<T *>::WeakHeap(T *ptr)
+  : PointerHeapBase<T>(ptr)
+{}
+
+
 //
 // Handle<T *>
 //
@@ -702,13 +754,14 @@ inline
 VectorRootBase<T>::VectorRootBase(ThreadContext *threadContext, RootKind kind)
   : RootBase(threadContext, kind),
     things_()
-{}
+{
+    *entry_->thingAddr<RootBase *>() = this;
+}
 
 template <typename T>
 inline
 VectorRootBase<T>::VectorRootBase(RunContext *runContext, RootKind kind)
-  : RootBase(runContext->threadContext(), kind),
-    things_()
+  : VectorRootBase(runContext->threadContext(), kind)
 {}
 
 template <typename T>
@@ -771,6 +824,13 @@ VectorRootBase<T>::append(const T &val)
     things_.push_back(val);
 }
 
+template <typename T>
+inline void
+VectorRootBase<T>::clear()
+{
+    things_.clear();
+}
+
 
 //
 // VectorRoot<T *>
@@ -1,17 +1,38 @@
 
+#include <algorithm>
+#include <new>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 
+#include "spew.hpp"
+#include "trace.hpp"
 #include "slab.hpp"
 #include "runtime.hpp"
 #include "runtime_inlines.hpp"
 #include "rooting_inlines.hpp"
+#include "gc.hpp"
+#include "heap_stats.hpp"
+#include "shared_string_table.hpp"
+#include "shared_code_heap.hpp"
+#include "heap_snapshot.hpp"
+#include "parser/code_source.hpp"
+#include "interp/op_pair_profiler.hpp"
+#include "interp/op_profiler.hpp"
+#include "interp/sampling_profiler.hpp"
+#include "interp/baseline_jit.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/stack_frame.hpp"
 #include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/script.hpp"
 #include "vm/double.hpp"
 #include "vm/tuple.hpp"
+#include "vm/shape_tree.hpp"
+#include "vm/object.hpp"
+#include "vm/global.hpp"
 
 namespace Whisper {
 
@@ -20,17 +41,38 @@ namespace Whisper {
 //
 
 Runtime::Runtime()
-  : threadContexts_()
-{}
+  : threadContexts_(),
+    retiredMetrics_(),
+    slabReserve_(),
+    config_(),
+    heapBytes_(0)
+{
+    pthread_mutex_init(&threadLock_, nullptr);
+}
 
 Runtime::~Runtime()
-{}
+{
+    // Threads which never unregistered have finished with their
+    // contexts by now.
+    for (ThreadContext *ctx : threadContexts_)
+        delete ctx;
+    pthread_mutex_destroy(&threadLock_);
+    delete startupSnapshot_;
+    delete sharedCodeHeap_;
+    delete sharedStringTable_;
+}
 
 bool
-Runtime::initialize()
+Runtime::initialize(const RuntimeConfig &config)
 {
     WH_ASSERT(!initialized_);
 
+    if (const char *configError = config.check()) {
+        error_ = configError;
+        return false;
+    }
+    config_ = config;
+
     int error = pthread_key_create(&threadKey_, nullptr);
     if (error) {
         error_ = strerror_r(error, errorBuffer_, ErrorBufferSize);
@@ -38,6 +80,10 @@ Runtime::initialize()
         return false;
     }
 
+    // Compute the slab geometry now, rather than on first use by
+    // threads registering concurrently.
+    Slab::StandardSlabCards();
+
     initialized_ = true;
     return true;
 }
@@ -61,36 +107,248 @@ Runtime::registerThread()
     WH_ASSERT(initialized_);
     WH_ASSERT(pthread_getspecific(threadKey_) == nullptr);
 
+    ThreadContext *ctx;
+    if (const char *error = createThreadContext(&ctx))
+        return error;
+
+    pthread_mutex_lock(&threadLock_);
+    try {
+        threadContexts_.push_back(ctx);
+    } catch (std::bad_alloc &err) {
+        pthread_mutex_unlock(&threadLock_);
+        delete ctx;
+        return "Could not allocate ThreadContext.";
+    }
+    pthread_mutex_unlock(&threadLock_);
+
+    // Associate the thread context with the thread.
+    int error = pthread_setspecific(threadKey_, ctx);
+    if (error) {
+        removeThreadContext(ctx);
+        delete ctx;
+        return "pthread_setspecific failed to set ThreadContext.";
+    }
+
+    return nullptr;
+}
+
+void
+Runtime::unregisterThread()
+{
+    WH_ASSERT(initialized_);
+
+    ThreadContext *ctx = threadContext();
+    pthread_setspecific(threadKey_, nullptr);
+
+    // Keep the thread's counters, but not its slabs.
+    GCMetrics retired;
+    ctx->metrics(&retired);
+    for (uint32_t i = 0; i < NumSlabGenerations; i++)
+        retired.slabs[i] = 0;
+    retired.slabBytes = 0;
+    retired.externalBytes = 0;
+
+    pthread_mutex_lock(&threadLock_);
+    retiredMetrics_.add(retired);
+    pthread_mutex_unlock(&threadLock_);
+
+    removeThreadContext(ctx);
+    delete ctx;
+}
+
+const char *
+Runtime::createThreadContext(ThreadContext **ctxOut)
+{
     // Create a new nursery slab.
-    Slab *hatchery = Slab::AllocateStandard(Slab::Hatchery);
+    Slab *hatchery = slabReserve_.allocateStandard(Slab::Hatchery);
     if (!hatchery)
         return "Could not allocate hatchery slab.";
 
     // Create initial tenured space slab.
-    Slab *tenured = Slab::AllocateStandard(Slab::Tenured);
-    if (!tenured)
+    Slab *tenured = slabReserve_.allocateStandard(Slab::Tenured);
+    if (!tenured) {
+        slabReserve_.release(hatchery);
         return "Could not allocate tenured slab.";
+    }
+
+    size_t bytes = hatchery->regionSize() + tenured->regionSize();
+    if (!reserveHeapBytes(bytes)) {
+        slabReserve_.release(hatchery);
+        slabReserve_.release(tenured);
+        return "Heap limit reached.";
+    }
 
     // Allocate the ThreadContext
-    ThreadContext *ctx;
     try {
-        ctx = new ThreadContext(this, hatchery, tenured);
-        threadContexts_.push_back(ctx);
+        *ctxOut = new ThreadContext(this, hatchery, tenured);
     } catch (std::bad_alloc &err) {
+        releaseHeapBytes(bytes);
         return "Could not allocate ThreadContext.";
     }
+    return nullptr;
+}
 
-    // Associate the thread context with the thread.
-    int error = pthread_setspecific(threadKey_, ctx);
-    if (error) {
+void
+Runtime::removeThreadContext(ThreadContext *ctx)
+{
+    pthread_mutex_lock(&threadLock_);
+    auto iter = std::find(threadContexts_.begin(), threadContexts_.end(),
+                          ctx);
+    WH_ASSERT(iter != threadContexts_.end());
+    threadContexts_.erase(iter);
+    pthread_mutex_unlock(&threadLock_);
+}
+
+bool
+Runtime::reserveHeapBytes(size_t bytes)
+{
+    size_t heapBytes = heapBytes_.load(std::memory_order_relaxed);
+    do {
+        if (config_.maxHeapBytes && heapBytes + bytes > config_.maxHeapBytes)
+            return false;
+    } while (!heapBytes_.compare_exchange_weak(heapBytes, heapBytes + bytes,
+                                               std::memory_order_relaxed));
+    return true;
+}
+
+void
+Runtime::releaseHeapBytes(size_t bytes)
+{
+    WH_ASSERT(heapBytes_.load(std::memory_order_relaxed) >= bytes);
+    heapBytes_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+SlabReserve &
+Runtime::slabReserve()
+{
+    return slabReserve_;
+}
+
+const RuntimeConfig &
+Runtime::config() const
+{
+    return config_;
+}
+
+size_t
+Runtime::heapBytes() const
+{
+    return heapBytes_.load(std::memory_order_relaxed);
+}
+
+void
+Runtime::metrics(RuntimeMetrics *out)
+{
+    pthread_mutex_lock(&threadLock_);
+    out->numThreads = threadContexts_.size();
+    out->threads = retiredMetrics_;
+    for (ThreadContext *ctx : threadContexts_) {
+        GCMetrics metrics;
+        ctx->metrics(&metrics);
+        out->threads.add(metrics);
+    }
+    pthread_mutex_unlock(&threadLock_);
+
+    uint32_t mappedSlabs = 0;
+    uint32_t freeSlabs = 0;
+    slabReserve_.countSlabs(&mappedSlabs, &freeSlabs);
+    out->reserveMappedSlabs = mappedSlabs;
+    out->reserveFreeSlabs = freeSlabs;
+    out->reserveMappedBytes = uint64_t(mappedSlabs) * SlabReserve::RegionSize();
+}
+
+const char *
+Runtime::enableSharedStringTable()
+{
+    WH_ASSERT(initialized_);
+    WH_ASSERT(threadContexts_.empty());
+    WH_ASSERT(sharedStringTable_ == nullptr);
+
+    // All threads hash strings with the shared table's spoiler.
+    unsigned int seed = ThreadContext::NewRandSeed();
+    uint32_t spoiler = (rand_r(&seed) & 0xffffU) |
+                       ((rand_r(&seed) & 0xffffU) << 16);
+
+    SharedStringTable *table;
+    try {
+        table = new SharedStringTable(this, spoiler);
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate SharedStringTable.";
+    }
+
+    if (!table->initialize()) {
+        delete table;
+        return "Could not initialize SharedStringTable.";
+    }
+
+    sharedStringTable_ = table;
+    return nullptr;
+}
+
+SharedStringTable *
+Runtime::maybeSharedStringTable() const
+{
+    return sharedStringTable_;
+}
+
+const char *
+Runtime::enableSharedCodeHeap()
+{
+    WH_ASSERT(initialized_);
+    WH_ASSERT(threadContexts_.empty());
+    WH_ASSERT(sharedCodeHeap_ == nullptr);
+
+    try {
+        sharedCodeHeap_ = new SharedCodeHeap(this);
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate SharedCodeHeap.";
+    }
+    return nullptr;
+}
+
+SharedCodeHeap *
+Runtime::maybeSharedCodeHeap() const
+{
+    return sharedCodeHeap_;
+}
+
+const char *
+Runtime::enableStartupSnapshot()
+{
+    WH_ASSERT(initialized_);
+    WH_ASSERT(threadContexts_.empty());
+    WH_ASSERT(startupSnapshot_ == nullptr);
+
+    // The snapshot is taken of a context which is never registered.
+    ThreadContext *ctx;
+    if (const char *error = createThreadContext(&ctx))
+        return error;
+
+    HeapSnapshot *snapshot;
+    try {
+        snapshot = new HeapSnapshot();
+    } catch (std::bad_alloc &err) {
         delete ctx;
-        Slab::Destroy(hatchery);
-        return "pthread_setspecific failed to set ThreadContext.";
+        return "Could not allocate HeapSnapshot.";
+    }
+
+    const char *error = snapshot->capture(ctx);
+    delete ctx;
+    if (error) {
+        delete snapshot;
+        return error;
     }
 
+    startupSnapshot_ = snapshot;
     return nullptr;
 }
 
+const HeapSnapshot *
+Runtime::maybeStartupSnapshot() const
+{
+    return startupSnapshot_;
+}
+
 ThreadContext *
 Runtime::maybeThreadContext()
 {
@@ -122,10 +380,88 @@ Runtime::threadContext()
 // AllocationContext
 //
 
-AllocationContext::AllocationContext(ThreadContext *cx, Slab *slab)
-  : cx_(cx), slab_(slab)
+//
+// Allocation sites
+//
+
+const char *
+AllocSiteString(AllocSite site)
+{
+    switch (site) {
+      case AllocSite::None:
+        return "None";
+#define CASE_(s) \
+      case AllocSite::s: \
+        return #s;
+      WHISPER_DEFN_ALLOC_SITES(CASE_)
+#undef CASE_
+      default:
+        return "INVALID";
+    }
+}
+
+//
+// RuntimeConfig
+//
+
+const char *
+RuntimeConfig::check() const
+{
+    if (hatcherySlabs == 0)
+        return "Hatchery must have at least one slab.";
+
+    // The tenured generation must be able to grow between major GCs.
+    if (tenuredGrowthPercent <= 100)
+        return "Tenured growth must be over 100 percent.";
+
+    // A thread context starts with a hatchery and a tenured slab.
+    if (maxHeapBytes && maxHeapBytes < 2 * SlabReserve::RegionSize())
+        return "Heap limit is smaller than two slabs.";
+
+    return nullptr;
+}
+
+
+//
+// AllocationContext
+//
+
+AllocationContext::AllocationContext(ThreadContext *cx, Slab **slabp,
+                                     AllocSite site)
+  : cx_(cx), slabp_(slabp), site_(site)
 {}
 
+uint8_t *
+AllocationContext::allocateSlow(uint32_t allocSize, bool traced,
+                                Slab **slabOut)
+{
+    Slab *slab = *slabp_;
+
+    // Swept tenured slabs may have room on their free lists.
+    if (slab->freeList(traced)) {
+        if (uint8_t *mem = AllocateFromFreeList(slab, allocSize, traced)) {
+            *slabOut = slab;
+            return mem;
+        }
+    }
+
+    // Continue in a fresh slab.  This updates the current slab, except
+    // for singleton slabs holding large allocations.
+    slab = cx_->growGeneration(slab->gen(), allocSize, traced);
+    if (!slab)
+        return nullptr;
+
+    uint8_t *mem = traced ? slab->allocateHead(allocSize)
+                          : slab->allocateTail(allocSize);
+    if (!mem && slab->freeList(traced))
+        mem = AllocateFromFreeList(slab, allocSize, traced);
+    if (!mem)
+        return nullptr;
+
+    *slabOut = slab;
+    return mem;
+}
+
 
 bool
 AllocationContext::createString(uint32_t length, const uint8_t *bytes,
@@ -144,7 +480,7 @@ AllocationContext::createString(uint32_t length, const uint8_t *bytes,
         return true;
     }
 
-    VM::LinearString *str = createSized<VM::LinearString>(length, bytes);
+    VM::LinearString *str = createLinearString(length, bytes);
     if (!str)
         return false;
 
@@ -165,17 +501,8 @@ AllocationContext::createString(uint32_t length, const uint16_t *bytes,
 
     // Check if this is really an 8-bit immediate string in 16-bit clothes.
     if (length <= Value::ImmString8MaxLength) {
-        bool isEightBit = true;
-        for (unsigned i = 0; i < length; i++) {
-            if (bytes[i] >= 0xFFu) {
-                isEightBit = false;
-                break;
-            }
-        }
-        if (isEightBit) {
-            uint8_t buf[Value::ImmString8MaxLength];
-            for (unsigned i = 0; i < length; i++)
-                buf[i] = bytes[i];
+        uint8_t buf[Value::ImmString8MaxLength];
+        if (VM::NarrowChars(bytes, length, buf)) {
             output = Value::ImmString8(length, buf);
             return true;
         }
@@ -187,7 +514,7 @@ AllocationContext::createString(uint32_t length, const uint16_t *bytes,
         return true;
     }
 
-    VM::LinearString *str = createSized<VM::LinearString>(length, bytes);
+    VM::LinearString *str = createLinearString(length, bytes);
     if (!str)
         return false;
         
@@ -195,6 +522,128 @@ AllocationContext::createString(uint32_t length, const uint16_t *bytes,
     return true;
 }
 
+VM::LinearString *
+AllocationContext::createLinearString(uint32_t length, const uint8_t *chars,
+                                      bool interned)
+{
+    if (!ExternalDataTable::IsExternalSize(length * 2)) {
+        return createSized<VM::LinearString>(
+            VM::LinearString::AllocSize(length, interned), chars, interned);
+    }
+
+    void *data = allocateExternal(length * 2);
+    if (!data)
+        return nullptr;
+    VM::WidenChars(chars, length, static_cast<uint16_t *>(data));
+    return createExternalString(static_cast<uint16_t *>(data), length,
+                                interned);
+}
+
+VM::LinearString *
+AllocationContext::createLinearString(uint32_t length, const uint16_t *chars,
+                                      bool interned)
+{
+    if (!ExternalDataTable::IsExternalSize(length * 2)) {
+        return createSized<VM::LinearString>(
+            VM::LinearString::AllocSize(length, interned), chars, interned);
+    }
+
+    void *data = allocateExternal(length * 2);
+    if (!data)
+        return nullptr;
+    memcpy(data, chars, length * 2);
+    return createExternalString(static_cast<uint16_t *>(data), length,
+                                interned);
+}
+
+VM::LinearString *
+AllocationContext::createLinearString(const VM::HeapString *str,
+                                      bool interned)
+{
+    uint32_t length = str->length();
+    if (!ExternalDataTable::IsExternalSize(length * 2)) {
+        return createSized<VM::LinearString>(
+            VM::LinearString::AllocSize(length, interned), str, interned);
+    }
+
+    void *data = allocateExternal(length * 2);
+    if (!data)
+        return nullptr;
+    str->extract(length, static_cast<uint16_t *>(data));
+    return createExternalString(static_cast<uint16_t *>(data), length,
+                                interned);
+}
+
+VM::Bytecode *
+AllocationContext::createBytecode(uint32_t length)
+{
+    if (!ExternalDataTable::IsExternalSize(length))
+        return createSized<VM::Bytecode>(length);
+
+    void *data = allocateExternal(length);
+    if (!data)
+        return nullptr;
+
+    VM::Bytecode::ExternalData ext;
+    ext.data = static_cast<uint8_t *>(data);
+    ext.length = length;
+    VM::Bytecode *bytecode = createSized<VM::Bytecode>(sizeof(ext), ext);
+    if (!adoptExternal(bytecode, data, length))
+        return nullptr;
+    return bytecode;
+}
+
+VM::SourceString *
+AllocationContext::createSourceString(const uint8_t *chars, uint32_t length,
+                                      SourceData *source)
+{
+    VM::SourceString *str = create<VM::SourceString>(chars, length);
+    if (!str || !cx_->externalData_.addSource(str, source)) {
+        source->release();
+        return nullptr;
+    }
+    return str;
+}
+
+void *
+AllocationContext::allocateExternal(uint32_t size)
+{
+    if (!cx_->noteExternalAcquired(size))
+        return nullptr;
+
+    void *data = ExternalDataTable::Allocate(size);
+    if (!data)
+        cx_->noteExternalReleased(size);
+    return data;
+}
+
+bool
+AllocationContext::adoptExternal(VM::HeapThing *owner, void *data,
+                                 uint32_t size)
+{
+    if (owner && cx_->externalData_.add(owner, data, size))
+        return true;
+
+    ExternalDataTable::Release(data, size);
+    cx_->noteExternalReleased(size);
+    return false;
+}
+
+VM::LinearString *
+AllocationContext::createExternalString(uint16_t *chars, uint32_t length,
+                                        bool interned)
+{
+    VM::LinearString::ExternalChars ext;
+    ext.chars = chars;
+    ext.length = length;
+    ext.hash = 0;
+    VM::LinearString *str =
+        createSized<VM::LinearString>(sizeof(ext), ext, interned);
+    if (!adoptExternal(str, chars, length * 2))
+        return nullptr;
+    return str;
+}
+
 bool
 AllocationContext::createNumber(double d, Value &value)
 {
@@ -203,10 +652,24 @@ AllocationContext::createNumber(double d, Value &value)
         return true;
     }
 
+    // HeapDoubles are immutable, so one with the same bits can be
+    // shared.  Only hatchery doubles are cached, so that tenured things
+    // never get a young double from the cache.
+    VM::HeapDouble **entry = nullptr;
+    if ((*slabp_)->gen() == Slab::Hatchery) {
+        entry = &cx_->doubleCacheEntry(d);
+        if (*entry && DoubleToInt((*entry)->value()) == DoubleToInt(d)) {
+            value = Value::HeapDouble(*entry);
+            return true;
+        }
+    }
+
     VM::HeapDouble *heapDouble = create<VM::HeapDouble>(d);
     if (!heapDouble)
         return false;
 
+    if (entry)
+        *entry = heapDouble;
     value = Value::HeapDouble(heapDouble);
     return true;
 }
@@ -257,13 +720,38 @@ ThreadContext::NewRandSeed()
 ThreadContext::ThreadContext(Runtime *runtime, Slab *hatchery, Slab *tenured)
   : runtime_(runtime),
     hatchery_(hatchery),
+    hatcheryList_(),
     nursery_(nullptr),
+    nurseryList_(),
     tenured_(tenured),
     tenuredList_(),
+    frozenList_(),
     activeRunContext_(nullptr),
     runContextList_(nullptr),
-    roots_(nullptr),
+    rootStack_(),
     suppressGC_(false),
+    minorGCRequested_(false),
+    majorGCRequested_(false),
+    majorGCSlabs_(MajorGCMinSlabs),
+    hitHeapLimit_(false),
+    freeSlabs_(),
+    slabBytes_(hatchery->regionSize() + tenured->regionSize()),
+    peakSlabBytes_(slabBytes_),
+    externalData_(),
+    majorGCExternalBytes_(MajorGCExternalBytes),
+    gcCounters_(),
+    sweepCursor_(nullptr),
+    allocProfiler_(nullptr),
+    opPairProfiler_(nullptr),
+    opProfiler_(nullptr),
+    samplingProfiler_(nullptr),
+    jitCodePool_(nullptr),
+    jitThreshold_(DefaultJitThreshold),
+    optIterations_(DefaultOptIterations),
+    conservativeStackBase_(nullptr),
+    compactTenured_(false),
+    emptyObjectShape_(nullptr),
+    global_(nullptr),
     randSeed_(NewRandSeed()),
     stringTable_(),
     spoiler_((randInt() & 0xffffU) | ((randInt() & 0xffffU) << 16))
@@ -272,8 +760,64 @@ ThreadContext::ThreadContext(Runtime *runtime, Slab *hatchery, Slab *tenured)
     WH_ASSERT(hatchery != nullptr);
     WH_ASSERT(tenured != nullptr);
 
+    hatcheryList_.addSlab(hatchery);
     tenuredList_.addSlab(tenured);
-    stringTable_.initialize(this);
+    gcCounters_.slabBytes.set(slabBytes_);
+    noteSlabCounts();
+    clearDoubleCache();
+    clearProtoLookupCache();
+
+    // Interning the atoms below creates roots.
+    if (!rootStack_.reserve())
+        throw std::bad_alloc();
+
+    if (SharedStringTable *shared = runtime->maybeSharedStringTable())
+        spoiler_ = shared->spoiler();
+
+    // Start from the runtime's snapshot, if it has one, rather than
+    // interning the atoms again.
+    if (const HeapSnapshot *snapshot = runtime->maybeStartupSnapshot()) {
+        spoiler_ = snapshot->spoiler();
+        snapshot->restore(this);
+    } else {
+        stringTable_.initialize(this);
+    }
+}
+
+// Return the slabs of |list| to |reserve|, and unmap singleton slabs.
+static void
+ReleaseSlabList(SlabList &list, SlabReserve &reserve)
+{
+    while (Slab *slab = list.firstSlab()) {
+        list.removeSlab(slab);
+        if (slab->isStandard())
+            reserve.release(slab);
+        else
+            Slab::Destroy(slab);
+    }
+}
+
+ThreadContext::~ThreadContext()
+{
+    WH_ASSERT(activeRunContext_ == nullptr);
+    WH_ASSERT(runContextList_ == nullptr);
+
+    stopAllocationProfiler();
+    stopOpPairProfiler();
+    stopOpProfiler();
+    stopSamplingProfiler();
+    delete jitCodePool_;
+
+    SlabReserve &reserve = runtime_->slabReserve();
+    ReleaseSlabList(hatcheryList_, reserve);
+    ReleaseSlabList(nurseryList_, reserve);
+    ReleaseSlabList(tenuredList_, reserve);
+    ReleaseSlabList(frozenList_, reserve);
+    ReleaseSlabList(freeSlabs_, reserve);
+    runtime_->releaseHeapBytes(slabBytes_);
+
+    // The payloads themselves are unmapped by externalData_.
+    runtime_->releaseHeapBytes(externalData_.bytes());
 }
 
 Runtime *
@@ -300,6 +844,18 @@ ThreadContext::tenured() const
     return tenured_;
 }
 
+const SlabList &
+ThreadContext::hatcheryList() const
+{
+    return hatcheryList_;
+}
+
+const SlabList &
+ThreadContext::nurseryList() const
+{
+    return nurseryList_;
+}
+
 const SlabList &
 ThreadContext::tenuredList() const
 {
@@ -312,10 +868,16 @@ ThreadContext::tenuredList()
     return tenuredList_;
 }
 
-RootBase *
-ThreadContext::roots() const
+const SlabList &
+ThreadContext::frozenList() const
+{
+    return frozenList_;
+}
+
+RootStack &
+ThreadContext::rootStack()
 {
-    return roots_;
+    return rootStack_;
 }
 
 bool
@@ -324,45 +886,566 @@ ThreadContext::suppressGC() const
     return suppressGC_;
 }
 
-void
-ThreadContext::addRunContext(RunContext *runcx)
+Slab *
+ThreadContext::growGeneration(Slab::Generation gen, uint32_t allocSize,
+                              bool traced)
 {
-    WH_ASSERT(runcx->threadContext() == this);
-    WH_ASSERT(runcx->next_ == nullptr);
-    runcx->next_ = runContextList_;
-    runContextList_ = runcx;
-}
+    // Large allocations go directly into a tenured singleton slab.
+    if (allocSize > Slab::StandardSlabMaxObjectSize()) {
+        Slab *slab = Slab::AllocateSingleton(allocSize, Slab::Tenured);
+        if (!slab)
+            return nullptr;
+        if (!noteSlabAcquired(slab)) {
+            Slab::Destroy(slab);
+            return nullptr;
+        }
+        tenuredList_.addSlab(slab);
+        noteSlabCounts();
+        return slab;
+    }
 
-void
-ThreadContext::removeRunContext(RunContext *runcx)
-{
-    WH_ASSERT(runcx->threadContext() == this);
-    WH_ASSERT(runcx->next_ == nullptr);
-    bool found = false;
-    RunContext *prevCx = nullptr;
-    for (RunContext *cx = runContextList_; cx != nullptr; cx = cx->next_) {
-        if (cx == runcx) {
-            found = true;
-            if (prevCx) {
-                WH_ASSERT(prevCx->next_ == cx);
-                prevCx->next_ = cx->next_;
-                cx->next_ = nullptr;
+    if (gen == Slab::Tenured) {
+        if (Slab *slab = sweepForAllocation(allocSize, traced)) {
+            tenured_ = slab;
+            return slab;
+        }
+    }
 
-            } else {
-                runContextList_ = cx->next_;
-                cx->next_ = nullptr;
-            }
+    Slab *slab = allocateStandardSlab(gen);
+    if (!slab)
+        return nullptr;
+
+    switch (gen) {
+      case Slab::Hatchery:
+        hatcheryList_.addSlab(slab);
+        hatchery_ = slab;
+        if (activeRunContext_)
+            activeRunContext_->hatchery_ = slab;
+        if (hatcheryList_.numSlabs() > runtime_->config().hatcherySlabs)
+            minorGCRequested_ = true;
+        break;
+
+      case Slab::Nursery:
+        nurseryList_.addSlab(slab);
+        nursery_ = slab;
+        break;
+
+      case Slab::Tenured:
+        tenuredList_.addSlab(slab);
+        tenured_ = slab;
+        break;
+
+      case Slab::Frozen:
+        WH_UNREACHABLE("Nothing is allocated in the frozen generation.");
+        break;
+
+      case Slab::Shared:
+        WH_UNREACHABLE("Threads do not grow the shared generation.");
+        break;
+    }
 
-            break;
-        }
+    noteSlabCounts();
+    return slab;
+}
+
+Slab *
+ThreadContext::allocateStandardSlab(Slab::Generation gen)
+{
+    if (Slab *slab = freeSlabs_.firstSlab()) {
+        freeSlabs_.removeSlab(slab);
+        return Slab::Recycle(slab, gen);
     }
-    WH_ASSERT(found);
+    SlabReserve &reserve = runtime_->slabReserve();
+    Slab *slab = reserve.allocateStandard(gen);
+    if (slab && !noteSlabAcquired(slab)) {
+        reserve.release(slab);
+        return nullptr;
+    }
+    return slab;
 }
 
 void
-ThreadContext::activate(RunContext *cx)
+ThreadContext::releaseSlab(Slab *slab)
 {
-    WH_ASSERT(cx);
+    if (slab->isStandard() && freeSlabs_.numSlabs() < MaxFreeSlabs) {
+        freeSlabs_.addSlab(slab);
+        return;
+    }
+
+    WH_ASSERT(slabBytes_ >= slab->regionSize());
+    slabBytes_ -= slab->regionSize();
+    runtime_->releaseHeapBytes(slab->regionSize());
+    gcCounters_.slabBytes.set(slabBytes_);
+    noteSlabCounts();
+    if (!slab->isStandard()) {
+        Slab::Destroy(slab);
+        return;
+    }
+    runtime_->slabReserve().release(slab);
+}
+
+void
+ThreadContext::releaseFreeSlabs()
+{
+    while (Slab *free = freeSlabs_.firstSlab()) {
+        freeSlabs_.removeSlab(free);
+        slabBytes_ -= free->regionSize();
+        runtime_->releaseHeapBytes(free->regionSize());
+        runtime_->slabReserve().release(free);
+    }
+    gcCounters_.slabBytes.set(slabBytes_);
+}
+
+bool
+ThreadContext::noteSlabAcquired(Slab *slab)
+{
+    if (!runtime_->reserveHeapBytes(slab->regionSize())) {
+        // Give the free slabs back to the reserve, and try again.
+        releaseFreeSlabs();
+
+        if (!runtime_->reserveHeapBytes(slab->regionSize())) {
+            SpewMemoryError("Heap limit reached (%u bytes held)",
+                            (unsigned) runtime_->heapBytes());
+            hitHeapLimit_ = true;
+            majorGCRequested_ = true;
+            return false;
+        }
+    }
+
+    // Collect early when close to the limit.
+    size_t maxHeapBytes = runtime_->config().maxHeapBytes;
+    if (maxHeapBytes && runtime_->heapBytes() >=
+                            maxHeapBytes / 100 *
+                            RuntimeConfig::HeapLimitGCPercent)
+    {
+        majorGCRequested_ = true;
+    }
+
+    slabBytes_ += slab->regionSize();
+    if (slabBytes_ > peakSlabBytes_)
+        peakSlabBytes_ = slabBytes_;
+    gcCounters_.slabBytes.set(slabBytes_);
+    return true;
+}
+
+bool
+ThreadContext::noteExternalAcquired(uint32_t bytes)
+{
+    if (!runtime_->reserveHeapBytes(bytes)) {
+        SpewMemoryError("Heap limit reached (%u bytes held)",
+                        (unsigned) runtime_->heapBytes());
+        hitHeapLimit_ = true;
+        majorGCRequested_ = true;
+        return false;
+    }
+
+    if (externalData_.bytes() + bytes >= majorGCExternalBytes_)
+        majorGCRequested_ = true;
+    gcCounters_.externalBytes.set(externalData_.bytes() + bytes);
+    return true;
+}
+
+void
+ThreadContext::noteExternalReleased(uint64_t bytes)
+{
+    runtime_->releaseHeapBytes(bytes);
+    gcCounters_.externalBytes.set(externalData_.bytes());
+}
+
+void
+ThreadContext::noteSlabCounts()
+{
+    gcCounters_.slabs[Slab::Hatchery].set(hatcheryList_.numSlabs());
+    gcCounters_.slabs[Slab::Nursery].set(nurseryList_.numSlabs());
+    gcCounters_.slabs[Slab::Tenured].set(tenuredList_.numSlabs());
+    gcCounters_.slabs[Slab::Frozen].set(frozenList_.numSlabs());
+}
+
+uint32_t
+ThreadContext::startSweeping()
+{
+    TraceScope trace(TraceCategory::GC, "start_sweeping");
+    WH_ASSERT(sweepCursor_ == nullptr);
+
+    uint32_t liveSlabs = 0;
+    for (Slab *slab = tenuredList_.firstSlab(); slab != nullptr;
+         slab = slab->next())
+    {
+        slab->setNeedsSweep(true);
+        if (slab->hasMarks())
+            liveSlabs++;
+    }
+    sweepCursor_ = tenuredList_.firstSlab();
+
+    // The current tenured slab keeps receiving allocations, so it
+    // must be swept right away.
+    sweepSlab(tenured_);
+    return liveSlabs;
+}
+
+void
+ThreadContext::finishSweeping()
+{
+    TraceScope trace(TraceCategory::GC, "finish_sweeping");
+
+    // The cursor is cleared first, as the slab it points to may be
+    // released.
+    sweepCursor_ = nullptr;
+    Slab *slab = tenuredList_.firstSlab();
+    while (slab != nullptr) {
+        Slab *next = slab->next();
+        if (slab->needsSweep())
+            sweepSlab(slab);
+        slab = next;
+    }
+}
+
+bool
+ThreadContext::sweepSlab(Slab *slab)
+{
+    WH_ASSERT(slab->needsSweep());
+    slab->setNeedsSweep(false);
+
+    uint32_t liveBytes = SweepSlab(slab);
+    SpewMemoryNote("Swept tenured slab %p (live=%u bytes)",
+                   slab, (unsigned) liveBytes);
+    if (liveBytes > 0)
+        return false;
+
+    // The current tenured slab is kept, even if empty.
+    if (slab == tenured_) {
+        slab->resetAllocation();
+        return false;
+    }
+
+    WH_ASSERT(slab != sweepCursor_);
+    tenuredList_.removeSlab(slab);
+    releaseSlab(slab);
+    return true;
+}
+
+Slab *
+ThreadContext::sweepForAllocation(uint32_t allocSize, bool traced)
+{
+    while (Slab *slab = sweepCursor_) {
+        sweepCursor_ = slab->next();
+        if (!slab->needsSweep())
+            continue;
+
+        if (sweepSlab(slab))
+            continue;
+
+        // Singleton slabs hold one large thing.  Small things allocated
+        // past their first cards would have card numbers out of range.
+        if (slab->isStandard() && CanAllocateInSlab(slab, allocSize, traced))
+            return slab;
+    }
+    return nullptr;
+}
+
+bool
+ThreadContext::performMinorGC(bool tenureAll)
+{
+    WH_ASSERT(!suppressGC_);
+    TraceScope trace(TraceCategory::GC, "minor_gc");
+    Interp::SamplingPauseHelper pauseSampling(samplingProfiler_);
+    PauseTimer pauseTimer(gcCounters_.minorPauses);
+
+    clearDoubleCache();
+    clearProtoLookupCache();
+    MinorCollector collector(this, tenureAll);
+    bool result = collector.collect();
+    gcCounters_.survivedBytes.add(collector.nurseryBytes());
+    gcCounters_.promotedBytes.add(collector.tenuredBytes());
+    noteSlabCounts();
+    if (!result)
+        return false;
+
+    updateAllocSites();
+    minorGCRequested_ = false;
+    return true;
+}
+
+VM::HeapDouble *&
+ThreadContext::doubleCacheEntry(double d)
+{
+    uint64_t hash = DoubleToInt(d) * 0x9E3779B97F4A7C15ULL;
+    return doubleCache_[hash >> (64 - DoubleCacheBits)];
+}
+
+void
+ThreadContext::clearDoubleCache()
+{
+    for (uint32_t i = 0; i < DoubleCacheSize; i++)
+        doubleCache_[i] = nullptr;
+}
+
+ThreadContext::ProtoLookupEntry &
+ThreadContext::protoLookupCacheEntry(VM::Shape *shape, const Value &name)
+{
+    uint64_t hash = (reinterpret_cast<uintptr_t>(shape) ^ name.raw()) *
+                    0x9E3779B97F4A7C15ULL;
+    return protoLookupCache_[hash >> (64 - ProtoLookupCacheBits)];
+}
+
+void
+ThreadContext::clearProtoLookupCache()
+{
+    for (uint32_t i = 0; i < ProtoLookupCacheSize; i++)
+        protoLookupCache_[i].shape = nullptr;
+}
+
+void
+ThreadContext::updateAllocSites()
+{
+    for (uint32_t i = 1; i < uint32_t(AllocSite::LIMIT); i++) {
+        AllocSiteInfo &info = allocSites_[i];
+        info.totalAllocated += info.allocated;
+        info.totalSurvived += info.survived;
+        info.allocated = 0;
+        info.survived = 0;
+
+        if (info.pretenured || info.totalAllocated < PretenureMinAllocs)
+            continue;
+
+        if (info.totalSurvived * 100 >= info.totalAllocated * PretenurePercent)
+        {
+            info.pretenured = true;
+            SpewMemoryNote("Pretenuring allocation site %s "
+                           "(survived %u of %u)",
+                           AllocSiteString(AllocSite(i)),
+                           (unsigned) info.totalSurvived,
+                           (unsigned) info.totalAllocated);
+        }
+    }
+}
+
+bool
+ThreadContext::performMajorGC()
+{
+    WH_ASSERT(!suppressGC_);
+    TraceScope trace(TraceCategory::GC, "major_gc");
+    Interp::SamplingPauseHelper pauseSampling(samplingProfiler_);
+    PauseTimer pauseTimer(gcCounters_.majorPauses);
+
+    majorGCRequested_ = false;
+
+    // Marks are only meaningful until the slabs of the last major GC
+    // have been swept.
+    finishSweeping();
+
+    // Cull the young generations first, so that dead young things do
+    // not keep tenured things alive.
+    if (!performMinorGC())
+        return false;
+
+    MajorCollector collector(this, MajorCollector::DefaultNumWorkers(),
+                             compactTenured_);
+    if (!collector.collect())
+        return false;
+
+    uint64_t liveSlabs = startSweeping();
+    majorGCSlabs_ = liveSlabs * runtime_->config().tenuredGrowthPercent / 100;
+    if (majorGCSlabs_ < MajorGCMinSlabs)
+        majorGCSlabs_ = MajorGCMinSlabs;
+    majorGCExternalBytes_ = externalData_.bytes() + MajorGCExternalBytes;
+    noteSlabCounts();
+    return true;
+}
+
+bool
+ThreadContext::performGC()
+{
+    if (needsMajorGC())
+        return performMajorGC();
+    return performMinorGC();
+}
+
+bool
+ThreadContext::freezeHeap()
+{
+    WH_ASSERT(!suppressGC_);
+    TraceScope trace(TraceCategory::GC, "freeze_heap");
+
+    // Sweep right away, so that frozen slabs hold only live things and
+    // free space.
+    if (!performMajorGC())
+        return false;
+    finishSweeping();
+
+    // Then promote everything left young.
+    if (!performMinorGC(true))
+        return false;
+
+    Slab *slab = allocateStandardSlab(Slab::Tenured);
+    if (!slab)
+        return false;
+
+    while (Slab *frozen = tenuredList_.firstSlab()) {
+        tenuredList_.removeSlab(frozen);
+        frozen->moveToFrozen();
+        frozenList_.addSlab(frozen);
+    }
+    SpewMemoryNote("Froze %u tenured slabs",
+                   (unsigned) frozenList_.numSlabs());
+
+    tenuredList_.addSlab(slab);
+    tenured_ = slab;
+    majorGCSlabs_ = MajorGCMinSlabs;
+    noteSlabCounts();
+    return true;
+}
+
+bool
+ThreadContext::notifyIdle(uint64_t deadline)
+{
+    WH_ASSERT(!suppressGC_);
+    TraceScope trace(TraceCategory::GC, "idle");
+
+    // Sweeping is done a slab at a time, so it can stop at the deadline.
+    while (Slab *slab = sweepCursor_) {
+        if (MonotonicNanos() >= deadline)
+            return true;
+        sweepCursor_ = slab->next();
+        if (slab->needsSweep())
+            sweepSlab(slab);
+    }
+
+    uint64_t now = MonotonicNanos();
+    if (now >= deadline)
+        return true;
+    uint64_t timeLeft = deadline - now;
+
+    bool majorDue = majorGCRequested_ ||
+        uint64_t(tenuredList_.numSlabs()) * 100 >=
+            uint64_t(majorGCSlabs_) * IdleMajorGCPercent;
+    if (majorDue && gcCounters_.majorPauses.meanNanos() <= timeLeft)
+        return performMajorGC();
+
+    bool hatcheryUsed = false;
+    for (Slab *slab : hatcheryList_) {
+        if (slab->headEndAlloc() != slab->headStartAlloc() ||
+            slab->tailEndAlloc() != slab->tailStartAlloc())
+        {
+            hatcheryUsed = true;
+            break;
+        }
+    }
+    if (hatcheryUsed && gcCounters_.minorPauses.meanNanos() <= timeLeft)
+        return performMinorGC();
+    return true;
+}
+
+bool
+ThreadContext::notifyMemoryPressure(MemoryPressure level)
+{
+    WH_ASSERT(!suppressGC_);
+    TraceScope trace(TraceCategory::GC, "memory_pressure");
+
+    finishSweeping();
+    if (level == MemoryPressure::Critical) {
+        dropDecodedBytecode();
+
+        bool compact = compactTenured_;
+        compactTenured_ = true;
+        bool result = performMajorGC();
+        compactTenured_ = compact;
+        if (!result)
+            return false;
+        finishSweeping();
+    }
+
+    releaseFreeSlabs();
+    noteSlabCounts();
+    runtime_->slabReserve().trim();
+    return true;
+}
+
+void
+ThreadContext::dropDecodedBytecode()
+{
+#if defined(ENABLE_DEBUG)
+    for (RunContext *cx = runContextList_; cx != nullptr; cx = cx->next_)
+        WH_ASSERT(!cx->interpreter());
+#endif
+
+    // Every thing in the young slabs, and every thing in the swept
+    // tenured slabs which is not free space, is walked.  Dead scripts
+    // still point to valid decodings, which they may as well drop.
+    const SlabList *lists[] = { &hatcheryList_, &nurseryList_,
+                                &tenuredList_ };
+    uint32_t dropped = 0;
+    for (const SlabList *list : lists) {
+        for (Slab *slab : *list) {
+            WH_ASSERT(!slab->needsSweep());
+            uint8_t *pos = slab->headStartAlloc();
+            uint8_t *end = slab->headEndAlloc();
+            while (pos < end) {
+                VM::HeapThingHeader *hdr =
+                    reinterpret_cast<VM::HeapThingHeader *>(pos);
+                pos += VM::HeapThingHeader::HeaderSize + hdr->reservedSpace();
+                if (hdr->type() != VM::HeapType::Script)
+                    continue;
+
+                VM::Script *script = reinterpret_cast<VM::Script *>(hdr + 1);
+                if (!script->hasDecoded())
+                    continue;
+
+                VM::DecodedBytecode *decoded = script->decoded();
+                const VM::HeapThingHeader *decodedHdr =
+                    reinterpret_cast<const VM::HeapThingHeader *>(decoded) - 1;
+                Slab::Generation gen =
+                    Slab::FromAllocation(decodedHdr, decoded->cardNo())->gen();
+                if (gen == Slab::Frozen || gen == Slab::Shared)
+                    continue;
+
+                script->setDecoded(nullptr);
+                dropped++;
+            }
+        }
+    }
+    SpewMemoryNote("Dropped the decoded bytecode of %u scripts",
+                   (unsigned) dropped);
+}
+
+void
+ThreadContext::addRunContext(RunContext *runcx)
+{
+    WH_ASSERT(runcx->threadContext() == this);
+    WH_ASSERT(runcx->next_ == nullptr);
+    runcx->next_ = runContextList_;
+    runContextList_ = runcx;
+}
+
+void
+ThreadContext::removeRunContext(RunContext *runcx)
+{
+    WH_ASSERT(runcx->threadContext() == this);
+    bool found = false;
+    RunContext *prevCx = nullptr;
+    for (RunContext *cx = runContextList_; cx != nullptr; cx = cx->next_) {
+        if (cx == runcx) {
+            found = true;
+            if (prevCx) {
+                WH_ASSERT(prevCx->next_ == cx);
+                prevCx->next_ = cx->next_;
+                cx->next_ = nullptr;
+
+            } else {
+                runContextList_ = cx->next_;
+                cx->next_ = nullptr;
+            }
+
+            break;
+        }
+    }
+    WH_ASSERT(found);
+}
+
+void
+ThreadContext::activate(RunContext *cx)
+{
+    WH_ASSERT(cx);
     WH_ASSERT_IF(activeRunContext_ == cx, hatchery_ == cx->hatchery_);
     if (activeRunContext_ != cx) {
         activeRunContext_ = cx;
@@ -391,14 +1474,280 @@ ThreadContext::activeRunContext() const
 AllocationContext
 ThreadContext::inHatchery()
 {
-    return AllocationContext(this, hatchery_);
+    return AllocationContext(this, &hatchery_);
 }
 
 
 AllocationContext
 ThreadContext::inTenured()
 {
-    return AllocationContext(this, tenured_);
+    return AllocationContext(this, &tenured_);
+}
+
+AllocationContext
+ThreadContext::inHatchery(AllocSite site)
+{
+    WH_ASSERT(site > AllocSite::None && site < AllocSite::LIMIT);
+    if (allocSites_[uint32_t(site)].pretenured)
+        return AllocationContext(this, &tenured_, site);
+    return AllocationContext(this, &hatchery_, site);
+}
+
+const ThreadContext::AllocSiteInfo &
+ThreadContext::allocSiteInfo(AllocSite site) const
+{
+    WH_ASSERT(site > AllocSite::None && site < AllocSite::LIMIT);
+    return allocSites_[uint32_t(site)];
+}
+
+bool
+ThreadContext::startAllocationProfiler(uint32_t sampleInterval)
+{
+    stopAllocationProfiler();
+    try {
+        allocProfiler_ = new AllocationProfiler(this, sampleInterval);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+void
+ThreadContext::stopAllocationProfiler()
+{
+    delete allocProfiler_;
+    allocProfiler_ = nullptr;
+}
+
+AllocationProfiler *
+ThreadContext::allocationProfiler() const
+{
+    return allocProfiler_;
+}
+
+bool
+ThreadContext::startOpPairProfiler()
+{
+    stopOpPairProfiler();
+    try {
+        opPairProfiler_ = new Interp::OpPairProfiler();
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+void
+ThreadContext::stopOpPairProfiler()
+{
+    delete opPairProfiler_;
+    opPairProfiler_ = nullptr;
+}
+
+Interp::OpPairProfiler *
+ThreadContext::opPairProfiler() const
+{
+    return opPairProfiler_;
+}
+
+bool
+ThreadContext::startOpProfiler(bool measureCycles)
+{
+    stopOpProfiler();
+    try {
+        opProfiler_ = new Interp::OpProfiler(measureCycles);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+void
+ThreadContext::stopOpProfiler()
+{
+    delete opProfiler_;
+    opProfiler_ = nullptr;
+}
+
+Interp::OpProfiler *
+ThreadContext::opProfiler() const
+{
+    return opProfiler_;
+}
+
+const char *
+ThreadContext::startSamplingProfiler(uint32_t intervalMicros)
+{
+    stopSamplingProfiler();
+    try {
+        samplingProfiler_ = new Interp::SamplingProfiler(this,
+                                                         intervalMicros);
+    } catch (std::bad_alloc &err) {
+        return "Could not allocate sampling profiler.";
+    }
+    if (const char *error = samplingProfiler_->start()) {
+        stopSamplingProfiler();
+        return error;
+    }
+    return nullptr;
+}
+
+void
+ThreadContext::stopSamplingProfiler()
+{
+    delete samplingProfiler_;
+    samplingProfiler_ = nullptr;
+}
+
+Interp::SamplingProfiler *
+ThreadContext::samplingProfiler() const
+{
+    return samplingProfiler_;
+}
+
+uint32_t
+ThreadContext::jitThreshold() const
+{
+    return jitThreshold_;
+}
+
+void
+ThreadContext::setJitThreshold(uint32_t threshold)
+{
+    jitThreshold_ = threshold;
+}
+
+uint32_t
+ThreadContext::optIterations() const
+{
+    return optIterations_;
+}
+
+void
+ThreadContext::setOptIterations(uint32_t iterations)
+{
+    optIterations_ = iterations;
+}
+
+bool
+ThreadContext::enableConservativeStackScan()
+{
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return false;
+
+    void *stackAddr = nullptr;
+    size_t stackSize = 0;
+    int error = pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+    pthread_attr_destroy(&attr);
+    if (error)
+        return false;
+
+    conservativeStackBase_ = reinterpret_cast<uint8_t *>(stackAddr) +
+                             stackSize;
+    return true;
+}
+
+bool
+ThreadContext::conservativeStackScan() const
+{
+    return conservativeStackBase_ != nullptr;
+}
+
+size_t
+ThreadContext::slabBytes() const
+{
+    return slabBytes_;
+}
+
+size_t
+ThreadContext::peakSlabBytes() const
+{
+    return peakSlabBytes_;
+}
+
+void
+ThreadContext::resetPeakSlabBytes()
+{
+    peakSlabBytes_ = slabBytes_;
+}
+
+bool
+ThreadContext::hitHeapLimit() const
+{
+    return hitHeapLimit_;
+}
+
+void
+ThreadContext::metrics(GCMetrics *out) const
+{
+    gcCounters_.read(out);
+}
+
+bool
+ThreadContext::compactTenured() const
+{
+    return compactTenured_;
+}
+
+void
+ThreadContext::setCompactTenured(bool compact)
+{
+    compactTenured_ = compact;
+}
+
+Interp::JitCodePool *
+ThreadContext::jitCodePool()
+{
+    if (!jitCodePool_) {
+        try {
+            jitCodePool_ = new Interp::JitCodePool();
+        } catch (std::bad_alloc &err) {
+            return nullptr;
+        }
+    }
+    return jitCodePool_;
+}
+
+VM::Shape *
+ThreadContext::emptyObjectShape()
+{
+    if (!emptyObjectShape_) {
+        AllocationContext acx = inTenured();
+        VM::ShapeTree::Config config;
+        config.numFixedSlots = VM::HashObject::NumFixedSlots;
+        config.version = 0;
+        VM::ShapeTree *tree = acx.create<VM::ShapeTree>(nullptr, nullptr,
+                                                        config);
+        if (!tree)
+            return nullptr;
+
+        VM::EmptyShape *shape = acx.create<VM::EmptyShape>(tree);
+        if (!shape)
+            return nullptr;
+        tree->setFirstRoot(shape);
+        emptyObjectShape_ = shape;
+    }
+    return emptyObjectShape_;
+}
+
+VM::Global *
+ThreadContext::global()
+{
+    if (!global_) {
+        VM::Shape *shape = emptyObjectShape();
+        if (!shape)
+            return nullptr;
+
+        AllocationContext acx = inTenured();
+        VM::HashObject *cells = acx.create<VM::HashObject>(
+            static_cast<VM::Object *>(nullptr), shape);
+        if (!cells)
+            return nullptr;
+
+        global_ = acx.create<VM::Global>(cells);
+    }
+    return global_;
 }
 
 int
@@ -434,12 +1783,30 @@ RunContext::RunContext(ThreadContext *threadContext)
   : threadContext_(threadContext),
     next_(nullptr),
     hatchery_(threadContext_->hatchery()),
-    topStackFrame_(nullptr),
-    suppressGC_(threadContext_->suppressGC())
+    nativeStack_(),
+    interpreter_(nullptr),
+    suppressGC_(threadContext_->suppressGC()),
+    interruptRequested_(false),
+    schedulerHook_(nullptr),
+    schedulerData_(nullptr),
+    clockCountdown_(0),
+    lastClock_(0),
+    cpuUsed_(0),
+    cpuBudget_(0),
+    timeSlice_(0),
+    sliceUsed_(0),
+    canSuspend_(false),
+    suspending_(false)
 {
     threadContext_->addRunContext(this);
 }
 
+RunContext::~RunContext()
+{
+    WH_ASSERT(threadContext_->activeRunContext() != this);
+    threadContext_->removeRunContext(this);
+}
+
 ThreadContext *
 RunContext::threadContext() const
 {
@@ -465,24 +1832,48 @@ RunContext::suppressGC() const
     return suppressGC_;
 }
 
+VM::NativeStack &
+RunContext::nativeStack()
+{
+    return nativeStack_;
+}
+
+const VM::NativeStack &
+RunContext::nativeStack() const
+{
+    return nativeStack_;
+}
+
+const Interp::Interpreter *
+RunContext::interpreter() const
+{
+    return interpreter_;
+}
+
 void
-RunContext::registerTopStackFrame(VM::StackFrame *topStackFrame)
+RunContext::setInterpreter(const Interp::Interpreter *interp)
 {
-    // No stack frame should have been registered yet.
-    WH_ASSERT(topStackFrame_ == nullptr);
-    topStackFrame_ = topStackFrame;
+    interpreter_ = interp;
 }
 
 AllocationContext
 RunContext::inHatchery()
 {
-    return AllocationContext(threadContext_, hatchery_);
+    WH_ASSERT(hatchery_ == threadContext_->hatchery());
+    return threadContext_->inHatchery();
 }
 
 AllocationContext
 RunContext::inTenured()
 {
-    return AllocationContext(threadContext_, threadContext_->tenured());
+    return threadContext_->inTenured();
+}
+
+AllocationContext
+RunContext::inHatchery(AllocSite site)
+{
+    WH_ASSERT(hatchery_ == threadContext_->hatchery());
+    return threadContext_->inHatchery(site);
 }
 
 StringTable &
@@ -497,6 +1888,169 @@ RunContext::stringTable() const
     return threadContext_->stringTable();
 }
 
+static uint64_t
+ThreadCpuNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void
+RunContext::requestInterrupt()
+{
+    interruptRequested_.store(true, std::memory_order_relaxed);
+}
+
+const std::atomic<bool> *
+RunContext::addressOfInterruptRequested() const
+{
+    return &interruptRequested_;
+}
+
+uint32_t *
+RunContext::addressOfClockCountdown()
+{
+    return &clockCountdown_;
+}
+
+void
+RunContext::setSchedulerHook(SchedulerHook hook, void *data)
+{
+    schedulerHook_ = hook;
+    schedulerData_ = data;
+}
+
+void
+RunContext::setTimeSlice(uint64_t nanos)
+{
+    timeSlice_ = nanos;
+    sliceUsed_ = 0;
+    startClock();
+}
+
+void
+RunContext::setCpuBudget(uint64_t nanos)
+{
+    cpuBudget_ = nanos;
+    startClock();
+}
+
+uint64_t
+RunContext::cpuBudget() const
+{
+    return cpuBudget_;
+}
+
+uint64_t
+RunContext::cpuUsed() const
+{
+    return cpuUsed_;
+}
+
+bool
+RunContext::suspendScript()
+{
+    if (!canSuspend_)
+        return false;
+    suspending_ = true;
+    return true;
+}
+
+bool
+RunContext::suspending() const
+{
+    return suspending_;
+}
+
+bool
+RunContext::enterScript(bool canSuspend)
+{
+    canSuspend_ = canSuspend;
+    suspending_ = false;
+    startClock();
+    return checkInterrupt() && checkCpuTime();
+}
+
+void
+RunContext::leaveScript()
+{
+    chargeClock();
+    canSuspend_ = false;
+    suspending_ = false;
+}
+
+bool
+RunContext::handleInterrupt()
+{
+    if (interruptRequested_.exchange(false, std::memory_order_relaxed) &&
+        !runSchedulerHook(InterruptReason::Requested))
+    {
+        return false;
+    }
+
+    // Interrupts requested between clock reads leave the countdown
+    // running.
+    if (clockCountdown_ != 0 || (timeSlice_ == 0 && cpuBudget_ == 0))
+        return true;
+
+    clockCountdown_ = ClockCheckInterval;
+    chargeClock();
+    return checkCpuTime();
+}
+
+bool
+RunContext::checkCpuTime()
+{
+    if (timeSlice_ != 0 && sliceUsed_ >= timeSlice_) {
+        sliceUsed_ = 0;
+        if (!runSchedulerHook(InterruptReason::TimeSlice))
+            return false;
+    }
+
+    if (cpuBudget_ != 0 && cpuUsed_ >= cpuBudget_) {
+        if (!runSchedulerHook(InterruptReason::CpuBudget))
+            return false;
+        if (cpuBudget_ != 0 && cpuUsed_ >= cpuBudget_)
+            return false;
+    }
+    return true;
+}
+
+bool
+RunContext::runSchedulerHook(InterruptReason reason)
+{
+    // Without a hook, scripts only go on past the end of a time slice.
+    if (!schedulerHook_)
+        return reason == InterruptReason::TimeSlice;
+
+    bool result = schedulerHook_(this, reason, schedulerData_);
+    startClock();
+    return result && !suspending_;
+}
+
+void
+RunContext::startClock()
+{
+    if (timeSlice_ == 0 && cpuBudget_ == 0) {
+        clockCountdown_ = 0;
+        return;
+    }
+    clockCountdown_ = ClockCheckInterval;
+    lastClock_ = ThreadCpuNanos();
+}
+
+void
+RunContext::chargeClock()
+{
+    if (timeSlice_ == 0 && cpuBudget_ == 0)
+        return;
+    uint64_t now = ThreadCpuNanos();
+    cpuUsed_ += now - lastClock_;
+    sliceUsed_ += now - lastClock_;
+    lastClock_ = now;
+}
+
 //
 // RunActivationHelper
 //
@@ -506,7 +2060,7 @@ RunActivationHelper::RunActivationHelper(RunContext &cx)
     oldRunCx_(cx.threadContext()->activeRunContext())
 #if defined(ENABLE_DEBUG)
     ,
-    oldRoot_(threadCx_->roots()),
+    oldRootTop_(threadCx_->rootStack().top()),
     runCx_(&cx)
 #endif
 {
@@ -516,7 +2070,7 @@ RunActivationHelper::RunActivationHelper(RunContext &cx)
 RunActivationHelper::~RunActivationHelper()
 {
 #if defined(ENABLE_DEBUG)
-    WH_ASSERT(threadCx_->roots() == oldRoot_);
+    WH_ASSERT(threadCx_->rootStack().top() == oldRootTop_);
     WH_ASSERT(threadCx_->activeRunContext() == runCx_);
 #endif
     if (oldRunCx_)
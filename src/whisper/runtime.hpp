@@ -1,6 +1,7 @@
 #ifndef WHISPER__RUNTIME_HPP
 #define WHISPER__RUNTIME_HPP
 
+#include <atomic>
 #include <vector>
 #include <unordered_set>
 #include <pthread.h>
@@ -8,8 +9,12 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "slab.hpp"
+#include "external_data.hpp"
+#include "gc_metrics.hpp"
 #include "value.hpp"
+#include "rooting.hpp"
 #include "string_table.hpp"
+#include "vm/native_stack.hpp"
 
 namespace Whisper {
 
@@ -20,13 +25,103 @@ class Slab;
 class ThreadContext;
 class RunContext;
 class RunActivationHelper;
+class AllocationProfiler;
+class SharedCodeHeap;
+class HeapSnapshot;
+
+namespace Interp {
+    class Interpreter;
+    class OpPairProfiler;
+    class OpProfiler;
+    class SamplingProfiler;
+    class JitCodePool;
+}
 
 namespace VM {
     class StackFrame;
     class HeapString;
+    class LinearString;
+    class SourceString;
+    struct Bytecode;
     class Tuple;
+    class Shape;
+    class HashObject;
+    class Global;
+    class HeapDouble;
 }
 
+//
+// Allocation sites
+//
+// Allocation sites tracked for pretenuring.  Objects allocated in the
+// hatchery at a tracked site record the site in their header.  Each
+// minor GC counts the objects from each site which survive it, and a
+// site is pretenured once most of its objects survive: its later
+// allocations go directly into the tenured generation, instead of being
+// copied through the nursery.
+//
+#define WHISPER_DEFN_ALLOC_SITES(_) \
+    _(Bytecode)                     \
+    _(DecodedBytecode)              \
+    _(ConstantPool)                 \
+    _(ConstantDouble)               \
+    _(Script)                       \
+    _(Object)                       \
+    _(PropertyCache)                \
+    _(TypeFeedback)
+
+enum class AllocSite : uint8_t
+{
+    None = 0,
+
+#define ENUM_(s) s,
+    WHISPER_DEFN_ALLOC_SITES(ENUM_)
+#undef ENUM_
+
+    LIMIT
+};
+
+const char *AllocSiteString(AllocSite site);
+
+//
+// RuntimeConfig
+//
+// The heap sizing policy of a runtime, applied to each of its threads.
+// Slab counts are in standard slabs (see Slab::StandardSlabCards).
+//
+// With a heap limit, every slab a thread maps counts against the limit,
+// including the empty slabs it keeps for reuse.  Once the runtime's
+// threads hold HeapLimitGCPercent percent of the limit, a thread taking
+// a new slab requests a major GC at its next safepoint.  An allocation
+// which would exceed the limit fails instead, which fails the running
+// script, or the collection which needed the slab; the thread's
+// hitHeapLimit() is then set.
+//
+struct RuntimeConfig
+{
+    static constexpr uint32_t HeapLimitGCPercent = 75;
+
+    // A minor GC is requested once the hatchery grows past this many
+    // slabs.
+    uint32_t hatcherySlabs = 1;
+
+    // Survivors of the hatchery are copied into at most this many
+    // nursery slabs, and the rest are promoted.  Zero means no limit.
+    uint32_t nurserySlabs = 0;
+
+    // A major GC is requested once the tenured generation grows to
+    // this percentage of the slabs live after the last major GC, or to
+    // ThreadContext::MajorGCMinSlabs, whichever is larger.
+    uint32_t tenuredGrowthPercent = 200;
+
+    // The most slab memory the runtime's threads may hold together, in
+    // bytes.  Zero means no limit.
+    size_t maxHeapBytes = 0;
+
+    // Return an error message if the config is invalid.
+    const char *check() const;
+};
+
 //
 // Runtime
 //
@@ -38,16 +133,47 @@ namespace VM {
 // but every thread which wishes to interact with the runtime
 // in a subtantial way must have an associated one.
 //
+// Each thread context has its own heap, and runs independently of the
+// others: threads may register, run scripts and unregister
+// concurrently.  Only the slab reserve, the shared string table, the
+// shared code heap and the startup snapshot, which are synchronized or
+// immutable, are used by several threads.  Other heap things must not
+// be passed from one thread context to another.
+//
 
 class Runtime
 {
   friend class ThreadContext;
   friend class RunContext;
   private:
-    // Every running thread uses a thread context.
+    // Every running thread uses a thread context.  The list is
+    // guarded by threadLock_.
+    pthread_mutex_t threadLock_;
     std::vector<ThreadContext *> threadContexts_;
     pthread_key_t threadKey_;
 
+    // Counters of the threads which have unregistered, also guarded by
+    // threadLock_.
+    GCMetrics retiredMetrics_;
+
+    // Standard slabs for every thread are drawn from a shared reserve.
+    SlabReserve slabReserve_;
+
+    RuntimeConfig config_;
+
+    // Bytes of slab memory held by all threads, limited by the config's
+    // maxHeapBytes.
+    std::atomic<size_t> heapBytes_;
+
+    // Intern table shared by all threads, if enabled.
+    SharedStringTable *sharedStringTable_ = nullptr;
+
+    // Compiled code shared by all threads, if enabled.
+    SharedCodeHeap *sharedCodeHeap_ = nullptr;
+
+    // Heap image new thread contexts start from, if enabled.
+    HeapSnapshot *startupSnapshot_ = nullptr;
+
     // initialized flag.
     bool initialized_ = false;
 
@@ -59,16 +185,58 @@ class Runtime
     Runtime();
     ~Runtime();
 
-    bool initialize();
+    bool initialize(const RuntimeConfig &config = RuntimeConfig());
 
     bool hasError() const;
     const char *error() const;
 
+    // Create a thread context for the calling thread.  Returns an
+    // error message on failure.
     const char *registerThread();
 
+    // Destroy the calling thread's thread context, which must have no
+    // run contexts left, and release its slabs to the reserve.
+    void unregisterThread();
+
+    SlabReserve &slabReserve();
+
+    const RuntimeConfig &config() const;
+    size_t heapBytes() const;
+
+    // Take a snapshot of the metrics of every thread, and of the slab
+    // reserve.  May be called from any thread.
+    void metrics(RuntimeMetrics *out);
+
+
+    // Intern strings in one table for all threads, instead of one table
+    // per thread.  Must be called before any thread is registered.
+    const char *enableSharedStringTable();
+    SharedStringTable *maybeSharedStringTable() const;
+
+    // Let threads share frozen compiled code (see SharedCodeHeap).
+    // Must be called before any thread is registered.
+    const char *enableSharedCodeHeap();
+    SharedCodeHeap *maybeSharedCodeHeap() const;
+
+    // Start thread contexts from a snapshot of the heap of a new
+    // context, instead of initializing each one (see HeapSnapshot).
+    // Must be called before any thread is registered, and after the
+    // shared string table is enabled, if it is.
+    const char *enableStartupSnapshot();
+    const HeapSnapshot *maybeStartupSnapshot() const;
+
     ThreadContext *maybeThreadContext();
     bool hasThreadContext();
     ThreadContext *threadContext();
+
+  private:
+    const char *createThreadContext(ThreadContext **ctxOut);
+    void removeThreadContext(ThreadContext *ctx);
+
+    // Count slab memory taken or given back by a thread.  Reserving
+    // fails if it would exceed the heap limit.
+    bool reserveHeapBytes(size_t bytes);
+    void releaseHeapBytes(size_t bytes);
 };
 
 
@@ -78,15 +246,25 @@ class Runtime
 // An allocation context encapsulates the notion of a particular
 // memory space as well as set of allocation criteria.
 //
+// Allocations bump-allocate from the current slab of the context's
+// generation, which is read from the ThreadContext on each allocation.
+// Only once that slab is full is the out-of-line slow path taken.
+//
 
 class AllocationContext
 {
   private:
     ThreadContext *cx_;
-    Slab *slab_;
+
+    // The ThreadContext's current slab for the generation.
+    Slab **slabp_;
+
+    // The allocation site, recorded in hatchery allocations.
+    AllocSite site_;
 
   public:
-    AllocationContext(ThreadContext *cx, Slab *slab);
+    AllocationContext(ThreadContext *cx, Slab **slabp,
+                      AllocSite site=AllocSite::None);
 
     template <typename ObjT, typename... Args>
     inline ObjT *create(Args... args);
@@ -97,6 +275,26 @@ class AllocationContext
     bool createString(uint32_t length, const uint8_t *bytes, Value &output);
     bool createString(uint32_t length, const uint16_t *bytes, Value &output);
 
+    // Create linear strings and bytecode.  Large ones keep their payload
+    // outside the heap (see ExternalDataTable), so these must be used
+    // instead of createSized.  The bytecode is left to be filled in.
+    VM::LinearString *createLinearString(uint32_t length,
+                                         const uint8_t *chars,
+                                         bool interned=false);
+    VM::LinearString *createLinearString(uint32_t length,
+                                         const uint16_t *chars,
+                                         bool interned=false);
+    VM::LinearString *createLinearString(const VM::HeapString *str,
+                                         bool interned=false);
+    VM::Bytecode *createBytecode(uint32_t length);
+
+    // Create a string of the |length| 8-bit chars at |chars|, in the
+    // data of |source|.  The reference to |source| is taken over, and
+    // released once the string is collected, or right away on failure.
+    VM::SourceString *createSourceString(const uint8_t *chars,
+                                         uint32_t length,
+                                         SourceData *source);
+
     bool createNumber(double d, Value &output);
 
     bool createTuple(const VectorRoot<Value> &vals, VM::Tuple *&output);
@@ -104,10 +302,30 @@ class AllocationContext
 
   private:
     // Allocate an object.  This takes an explicit size because some
-    // objects are variable sized.  Return null if not enough space
-    // in hatchery.
+    // objects are variable sized.  The slab allocated in is returned
+    // in |slabOut|.  Return null if no space could be found.
     template <typename ObjT>
-    inline uint8_t *allocate(uint32_t size);
+    inline uint8_t *allocate(uint32_t size, Slab **slabOut);
+
+    // Slow path of allocate, taken when the current slab is full.  Uses
+    // the slab's free lists if it has been swept, or else continues in a
+    // fresh slab.  If the hatchery grows, a minor GC is performed at the
+    // next safepoint.  |allocSize| includes the header.
+    uint8_t *allocateSlow(uint32_t allocSize, bool traced, Slab **slabOut);
+
+    // Map a payload of |size| bytes outside the heap, counted against
+    // the heap limit.  Returns null on OOM.
+    void *allocateExternal(uint32_t size);
+
+    // Hand a payload over to its owner, or unmap it if there is none.
+    // Returns false if |owner| is null, or the payload could not be
+    // recorded.
+    bool adoptExternal(VM::HeapThing *owner, void *data, uint32_t size);
+
+    // Create an external string of the |length| chars in |chars|, a
+    // payload from allocateExternal.
+    VM::LinearString *createExternalString(uint16_t *chars, uint32_t length,
+                                           bool interned);
 };
 
 
@@ -125,16 +343,165 @@ class ThreadContext
   friend class RunContext;
   friend class RootBase;
   friend class RunActivationHelper;
+  friend class AllocationContext;
+  friend class MinorCollector;
+  friend class MajorCollector;
+  friend class HeapSnapshot;
+  public:
+    // A major GC is requested once the tenured generation grows to this
+    // many slabs, or by the runtime's tenuredGrowthPercent over the
+    // number of slabs live after the last major GC, whichever is larger.
+    static constexpr uint32_t MajorGCMinSlabs = 64;
+
+    // A major GC is also requested once payloads outside the heap grow
+    // by this many bytes over what was live after the last major GC.
+    static constexpr uint64_t MajorGCExternalBytes = 32 << 20;
+
+    // Maximum number of empty standard slabs kept for reuse by the
+    // thread.  Further slabs go back to the runtime's SlabReserve.
+    static constexpr uint32_t MaxFreeSlabs = 16;
+
+    // When idle, a major GC is performed early once the tenured
+    // generation has grown to this percentage of the size which would
+    // request one.
+    static constexpr uint32_t IdleMajorGCPercent = 75;
+
+    // How short of memory the embedding says the system is (see
+    // notifyMemoryPressure).
+    enum class MemoryPressure : uint8_t
+    {
+        Moderate,
+        Critical
+    };
+
+    // A site is pretenured once at least PretenureMinAllocs of its
+    // objects have been through a minor GC, and at least PretenurePercent
+    // percent of them survived.
+    static constexpr uint32_t PretenureMinAllocs = 100;
+    static constexpr uint32_t PretenurePercent = 85;
+
+    // Number of recently created HeapDoubles remembered for reuse.
+    static constexpr unsigned DoubleCacheBits = 6;
+    static constexpr uint32_t DoubleCacheSize = 1 << DoubleCacheBits;
+
+    // Number of prototype chain lookups remembered, for any receiver
+    // shape and property name.
+    static constexpr unsigned ProtoLookupCacheBits = 8;
+    static constexpr uint32_t ProtoLookupCacheSize = 1 << ProtoLookupCacheBits;
+
+    // The result of looking up the property |name| on the prototype
+    // chain of objects of shape |shape|: the prototype holding it in
+    // |slot|, or null if none does.  Valid while the epoch of the
+    // shape's tree is |epoch| (see VM::ShapeTree).
+    struct ProtoLookupEntry
+    {
+        VM::Shape *shape;
+        Value name;
+        VM::HashObject *holder;
+        uint32_t slot;
+        uint32_t epoch;
+    };
+
+    // Allocation counters of an allocation site.  |allocated| counts the
+    // hatchery allocations since the last minor GC, and |survived| the
+    // ones which survived it.  The totals accumulate the counts of past
+    // minor GCs.
+    struct AllocSiteInfo
+    {
+        uint32_t allocated;
+        uint32_t survived;
+        uint64_t totalAllocated;
+        uint64_t totalSurvived;
+        bool pretenured;
+
+        AllocSiteInfo()
+          : allocated(0), survived(0),
+            totalAllocated(0), totalSurvived(0),
+            pretenured(false)
+        {}
+    };
+
   private:
     Runtime *runtime_;
     Slab *hatchery_;
+    SlabList hatcheryList_;
     Slab *nursery_;
+    SlabList nurseryList_;
     Slab *tenured_;
     SlabList tenuredList_;
+    SlabList frozenList_;
     RunContext *activeRunContext_;
     RunContext *runContextList_;
-    RootBase *roots_;
+    RootStack rootStack_;
     bool suppressGC_;
+    bool minorGCRequested_;
+    bool majorGCRequested_;
+    uint32_t majorGCSlabs_;
+
+    // Set once a slab could not be taken within the heap limit.
+    bool hitHeapLimit_;
+
+    // Empty standard slabs kept for reuse.
+    SlabList freeSlabs_;
+
+    // Bytes of slab memory held by the thread, and the most held since
+    // the peak was last reset.
+    size_t slabBytes_;
+    size_t peakSlabBytes_;
+
+    // Payloads of things kept outside the heap, and the bytes they may
+    // reach before a major GC is requested.
+    ExternalDataTable externalData_;
+    uint64_t majorGCExternalBytes_;
+
+    // Allocation and collection counters.
+    GCCounters gcCounters_;
+
+    // Next tenured slab to check for a lazy sweep.
+    Slab *sweepCursor_;
+
+    AllocSiteInfo allocSites_[uint32_t(AllocSite::LIMIT)];
+
+    // Sampling allocation profiler, if running.
+    AllocationProfiler *allocProfiler_;
+
+    // Interpreter op pair profiler, if running.
+    Interp::OpPairProfiler *opPairProfiler_;
+
+    // Interpreter op profiler, if running.
+    Interp::OpProfiler *opProfiler_;
+
+    // Sampling script profiler, if running.
+    Interp::SamplingProfiler *samplingProfiler_;
+
+    // Executable memory for compiled scripts, created on first use, the
+    // number of runs after which a script is baseline compiled, and the
+    // number of iterations of a loop after which it is optimized.
+    Interp::JitCodePool *jitCodePool_;
+    uint32_t jitThreshold_;
+    uint32_t optIterations_;
+
+    // High end of the thread's native stack, if the stack is scanned
+    // conservatively by collections.
+    void *conservativeStackBase_;
+
+    // Set if major collections compact the tenured generation.
+    bool compactTenured_;
+
+    // Root of the shape tree of HashObjects, created on first use.
+    VM::Shape *emptyObjectShape_;
+
+    // Global variables of the thread, created on first use.
+    VM::Global *global_;
+
+    // Recently created hatchery HeapDoubles, indexed by a hash of their
+    // bits.  Every minor GC moves or frees them, and empties the cache.
+    VM::HeapDouble *doubleCache_[DoubleCacheSize];
+
+    // Prototype chain lookups, indexed by a hash of the receiver shape
+    // and property name.  The entries hold raw pointers, so every minor
+    // GC empties the cache.
+    ProtoLookupEntry protoLookupCache_[ProtoLookupCacheSize];
 
     unsigned int randSeed_;
     StringTable stringTable_;
@@ -144,17 +511,103 @@ class ThreadContext
 
   public:
     ThreadContext(Runtime *runtime, Slab *hatchery, Slab *tenured);
+    ~ThreadContext();
 
     Runtime *runtime() const;
     Slab *hatchery() const;
     Slab *nursery() const;
     Slab *tenured() const;
+    const SlabList &hatcheryList() const;
+    const SlabList &nurseryList() const;
     const SlabList &tenuredList() const;
     SlabList &tenuredList();
+    const SlabList &frozenList() const;
     RunContext *activeRunContext() const;
-    RootBase *roots() const;
+    RootStack &rootStack();
     bool suppressGC() const;
 
+    // Add a fresh slab to a generation, for an allocation of |allocSize|
+    // bytes (including the header) which did not fit in the generation's
+    // current slab.  Allocations too large for a standard slab get a
+    // tenured singleton slab.  Growing the hatchery requests a minor GC.
+    //
+    // The tenured generation first sweeps slabs left unswept by the last
+    // major GC, and switches to the first one which has room.
+    Slab *growGeneration(Slab::Generation gen, uint32_t allocSize,
+                         bool traced);
+
+    // Get an empty standard slab, reusing a free slab if possible, or
+    // else taking one from the runtime's SlabReserve.
+    Slab *allocateStandardSlab(Slab::Generation gen);
+
+    // Release a slab which has been removed from its generation.  Empty
+    // standard slabs are kept for reuse, up to MaxFreeSlabs, and the
+    // rest are returned to the runtime's SlabReserve.
+    void releaseSlab(Slab *slab);
+
+    // Count a slab newly taken from the runtime's SlabReserve, or newly
+    // mapped, in slabBytes().  Returns false, and counts nothing, if the
+    // slab would exceed the heap limit even once the free slabs are
+    // returned; the caller then gives the slab back.
+    bool noteSlabAcquired(Slab *slab);
+    void noteSlabCounts();
+
+    // Count |bytes| of payloads newly mapped outside the heap, against
+    // the heap limit, requesting a major GC when they have grown enough.
+    // Returns false, and counts nothing, if the limit would be exceeded.
+    bool noteExternalAcquired(uint32_t bytes);
+
+    // Called by the collectors after sweeping externalData_, which
+    // released |bytes| of payloads.
+    void noteExternalReleased(uint64_t bytes);
+
+    // Lazy sweeping of the tenured generation after a major GC.
+    // Returns the number of slabs holding live things.
+    uint32_t startSweeping();
+    void finishSweeping();
+
+    // Collections are only performed at safepoints, where every
+    // live heap reference is reachable from a root or a stack frame.
+    inline bool needsMinorGC() const;
+    bool performMinorGC(bool tenureAll=false);
+
+    // A major GC first performs a minor GC.
+    inline bool needsMajorGC() const;
+    bool performMajorGC();
+
+    // Perform whichever collection is needed.
+    inline bool needsGC() const;
+    bool performGC();
+
+    // Collect the whole heap, tenure everything left alive, and freeze
+    // the tenured slabs in place (see Slab::Frozen).  Later allocations
+    // go to new slabs, and collections neither mark, sweep nor reuse
+    // the frozen ones, so pages holding things which are not written
+    // stay clean, e.g. to be shared by processes forked afterwards.
+    // Frozen things are never freed.
+    bool freezeHeap();
+
+    // Called by the embedding while the thread is idle, between scripts,
+    // with the time it may take, as a |deadline| on the monotonic clock
+    // (see MonotonicNanos).  Collection work is done then, instead of at
+    // a safepoint of the next script.  Tenured slabs left unswept by the
+    // last major GC are swept one at a time until the deadline.  Then a
+    // collection is performed if its mean pause so far fits in the time
+    // left: a major GC if one is due or nearly due (see
+    // IdleMajorGCPercent), or else a minor GC if the hatchery is not
+    // empty.  Returns false if a collection failed.
+    bool notifyIdle(uint64_t deadline);
+
+    // Called by the embedding, between scripts, when the system is
+    // short of memory.  Moderate pressure finishes sweeping, and gives
+    // the empty slabs kept by the thread back to the runtime's
+    // SlabReserve, which gives the pages of its free regions back to
+    // the system.  Critical pressure first drops the pre-decoded
+    // bytecode of scripts, which are decoded again when next run, and
+    // performs a compacting major GC.  Returns false if the collection
+    // failed.
+    bool notifyMemoryPressure(MemoryPressure level);
+
     void addRunContext(RunContext *cx);
     void removeRunContext(RunContext *cx);
 
@@ -164,8 +617,122 @@ class ThreadContext
     AllocationContext inHatchery();
     AllocationContext inTenured();
 
+    // Allocate in the hatchery on behalf of a tracked allocation site,
+    // or in the tenured generation if the site is pretenured.
+    AllocationContext inHatchery(AllocSite site);
+
+    const AllocSiteInfo &allocSiteInfo(AllocSite site) const;
+
+    // Start sampling one allocation every |sampleInterval| bytes.
+    // Restarting the profiler discards its samples.  Returns false if
+    // the profiler could not be allocated.
+    bool startAllocationProfiler(uint32_t sampleInterval);
+    void stopAllocationProfiler();
+    AllocationProfiler *allocationProfiler() const;
+
+    // Start counting the pairs of ops executed by the interpreter.
+    // Returns false if the profiler could not be allocated.
+    bool startOpPairProfiler();
+    void stopOpPairProfiler();
+    Interp::OpPairProfiler *opPairProfiler() const;
+
+    // Start counting the ops executed by the interpreter, optionally
+    // with cycle histograms.  Returns false if the profiler could not be
+    // allocated.
+    bool startOpProfiler(bool measureCycles);
+    void stopOpProfiler();
+    Interp::OpProfiler *opProfiler() const;
+
+    // Start sampling the stack of the thread's scripts every
+    // |intervalMicros| microseconds of CPU time.  Must be called by the
+    // thread itself.  Restarting the profiler discards its samples.
+    // Returns an error message on failure.
+    const char *startSamplingProfiler(uint32_t intervalMicros);
+    void stopSamplingProfiler();
+    Interp::SamplingProfiler *samplingProfiler() const;
+
+    // Scripts are baseline compiled once they have run |jitThreshold|
+    // times.  A threshold of 0 disables the baseline JIT.
+    static constexpr uint32_t DefaultJitThreshold = 10;
+    uint32_t jitThreshold() const;
+    void setJitThreshold(uint32_t threshold);
+
+    // Scripts with baseline compiled code are optimized once one of
+    // their loops has run |optIterations| times (see Interp::OptCode).
+    // Zero disables the optimizing JIT.
+    static constexpr uint32_t DefaultOptIterations = 10000;
+    uint32_t optIterations() const;
+    void setOptIterations(uint32_t iterations);
+
+    // Have collections scan the native stack of the thread, which must
+    // be the calling thread, for raw pointers to heap things.  Things
+    // found are kept alive, and young ones are not moved.  Returns false
+    // if the bounds of the stack could not be found.
+    bool enableConservativeStackScan();
+    bool conservativeStackScan() const;
+
+    // Have major collections evacuate sparse tenured slabs into fresh
+    // ones, so that the tenured generation stays close to the size of
+    // its live things (see MajorCollector).
+    bool compactTenured() const;
+    void setCompactTenured(bool compact);
+
+    // Slab memory held by the thread, in every generation, including
+    // empty slabs kept for reuse.  Frees to the runtime's SlabReserve
+    // count as releases.
+    size_t slabBytes() const;
+    size_t peakSlabBytes() const;
+    void resetPeakSlabBytes();
+    bool hitHeapLimit() const;
+
+    // Take a snapshot of the thread's allocation and collection counters
+    // (see GCMetrics).  May be called from any thread.
+    void metrics(GCMetrics *out) const;
+
+    // Returns null if the pool could not be allocated.
+    Interp::JitCodePool *jitCodePool();
+
+    // The shape of HashObjects with no properties.  Shapes of objects
+    // live as long as the thread, so the tree is tenured.  Returns null
+    // if the shape could not be allocated.
+    VM::Shape *emptyObjectShape();
+
+    // The global variables of the thread, which live as long as it, so
+    // are tenured.  Returns null if they could not be allocated.
+    VM::Global *global();
+
+    // The cache entry for doubles with the bits of |d|.  It is null, or
+    // holds a hatchery HeapDouble which may have some other value.
+    VM::HeapDouble *&doubleCacheEntry(double d);
+
+    // The cache entry for lookups of |name| on the prototype chain of
+    // objects of shape |shape|.  It may hold some other lookup.
+    ProtoLookupEntry &protoLookupCacheEntry(VM::Shape *shape,
+                                            const Value &name);
+
     int randInt();
 
+  private:
+    // Fold the counts of the last minor GC into the site totals, and
+    // pretenure sites whose objects mostly survive.
+    void updateAllocSites();
+
+    void clearDoubleCache();
+    void clearProtoLookupCache();
+
+    bool sweepSlab(Slab *slab);
+    Slab *sweepForAllocation(uint32_t allocSize, bool traced);
+
+    // Give the empty slabs kept for reuse back to the SlabReserve.
+    void releaseFreeSlabs();
+
+    // Drop the decoded bytecode of every script, except decodings
+    // frozen or shared with other threads.  Must be called with no
+    // script running, and no slab awaiting a sweep.
+    void dropDecodedBytecode();
+
+  public:
+
     StringTable &stringTable();
     const StringTable &stringTable() const;
 
@@ -188,34 +755,147 @@ class ThreadContext
 // All RunContexts for a given thread are linked together with an
 // embedded singly linked list.
 //
+// Scripts running on a RunContext check for interrupts only at script
+// entry and at loop headers, so that runaway scripts can be stopped
+// without a check in every op.  An interrupt is raised by
+// requestInterrupt, which may be called from any thread or from a
+// signal handler, or by the context's CPU accounting: when its time
+// slice ends, or when its CPU budget is spent.  Each interrupt runs
+// the context's scheduler hook, which decides whether the script goes
+// on.  A host time-slicing several scripts on one thread can run the
+// other contexts' scripts from the hook.
+//
+// The hook may also suspend the script (see suspendScript), if it was
+// run with Interp::InterpretScript or Interp::ResumeScript asking for
+// its frame to be saved.  The script then returns to the host, which
+// can resume it later from the saved frame, e.g. once the I/O it is
+// waiting for completes.
+//
+// CPU time is the thread's CPU clock, read every ClockCheckInterval
+// interrupt checks while a time slice or a budget is set.  Time spent
+// in the scheduler hook is not charged to the context.
+//
 
 class RunContext
 {
   friend class Runtime;
   friend class ThreadContext;
+  friend class MinorCollector;
+  friend class MajorCollector;
+
+  public:
+    enum class InterruptReason : uint8_t
+    {
+        Requested,
+        TimeSlice,
+        CpuBudget
+    };
+
+    // Called at an interrupt check when an interrupt is raised.
+    // Returns false to terminate the script.  A CpuBudget interrupt
+    // terminates the script unless the hook raises the budget.
+    typedef bool (*SchedulerHook)(RunContext *cx, InterruptReason reason,
+                                  void *data);
+
+    static constexpr uint32_t ClockCheckInterval = 1024;
 
   private:
     ThreadContext *threadContext_;
     RunContext *next_;
     Slab *hatchery_;
-    VM::StackFrame *topStackFrame_;
+    VM::NativeStack nativeStack_;
+    const Interp::Interpreter *interpreter_;
     bool suppressGC_;
 
+    // Set by requestInterrupt, and cleared when the interrupt is handled.
+    std::atomic<bool> interruptRequested_;
+
+    SchedulerHook schedulerHook_;
+    void *schedulerData_;
+
+    // Interrupt checks left until the CPU clock is next read, or zero
+    // if CPU time is not being counted.
+    uint32_t clockCountdown_;
+
+    // CPU accounting, in nanoseconds.  Zero budgets and slices are
+    // unlimited.
+    uint64_t lastClock_;
+    uint64_t cpuUsed_;
+    uint64_t cpuBudget_;
+    uint64_t timeSlice_;
+    uint64_t sliceUsed_;
+
+    // Whether the running script may be suspended, and whether it is
+    // being suspended.
+    bool canSuspend_;
+    bool suspending_;
+
   public:
     RunContext(ThreadContext *threadContext);
+    ~RunContext();
 
     ThreadContext *threadContext() const;
     Runtime *runtime() const;
     Slab *hatchery() const;
     bool suppressGC() const;
 
-    void registerTopStackFrame(VM::StackFrame *topStackFrame);
+    // The stack the frames of code running in this context are pushed
+    // on.
+    VM::NativeStack &nativeStack();
+    const VM::NativeStack &nativeStack() const;
+
+    // The innermost interpreter running on this context, if any.
+    const Interp::Interpreter *interpreter() const;
+    void setInterpreter(const Interp::Interpreter *interp);
 
     AllocationContext inHatchery();
     AllocationContext inTenured();
+    AllocationContext inHatchery(AllocSite site);
 
     StringTable &stringTable();
     const StringTable &stringTable() const;
+
+    // Ask the script running on this context to stop at its next
+    // interrupt check.
+    void requestInterrupt();
+
+    void setSchedulerHook(SchedulerHook hook, void *data);
+
+    // Interrupt the script every |nanos| of CPU time, so the scheduler
+    // hook can run other work.
+    void setTimeSlice(uint64_t nanos);
+
+    // Limit the CPU time scripts on this context may use in total.
+    void setCpuBudget(uint64_t nanos);
+    uint64_t cpuBudget() const;
+    uint64_t cpuUsed() const;
+
+    // An interrupt check at a loop header.  Returns false if the
+    // script is to be terminated.
+    inline bool checkInterrupt();
+
+    // Optimized code inlines the fast path of checkInterrupt, and calls
+    // out to it only when it would handle an interrupt.
+    const std::atomic<bool> *addressOfInterruptRequested() const;
+    uint32_t *addressOfClockCountdown();
+
+    // Suspend the running script once the scheduler hook calling this
+    // returns.  Returns false if the script cannot be suspended.
+    bool suspendScript();
+    bool suspending() const;
+
+    // The interrupt checks on entering and leaving a script.  Time
+    // outside of scripts is not charged to the context.  Only scripts
+    // entered with |canSuspend| may be suspended.
+    bool enterScript(bool canSuspend);
+    void leaveScript();
+
+  private:
+    bool handleInterrupt();
+    bool checkCpuTime();
+    bool runSchedulerHook(InterruptReason reason);
+    void startClock();
+    void chargeClock();
 };
 
 
@@ -234,7 +914,7 @@ class RunActivationHelper
     ThreadContext *threadCx_;
     RunContext *oldRunCx_;
 #if defined(ENABLE_DEBUG)
-    RootBase *oldRoot_;
+    RootStack::Entry *oldRootTop_;
     RunContext *runCx_;
 #endif
 
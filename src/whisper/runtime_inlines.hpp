@@ -2,6 +2,7 @@
 #define WHISPER__RUNTIME_INLINES_HPP
 
 #include "runtime.hpp"
+#include "heap_stats.hpp"
 #include "vm/heap_thing.hpp"
 
 namespace Whisper {
@@ -13,7 +14,7 @@ namespace Whisper {
 
 template <typename ObjT>
 inline uint8_t *
-AllocationContext::allocate(uint32_t size)
+AllocationContext::allocate(uint32_t size, Slab **slabOut)
 {
     WH_ASSERT(size >= sizeof(ObjT));
 
@@ -24,9 +25,16 @@ AllocationContext::allocate(uint32_t size)
     // Track whether to allocate from top or bottom.
     bool headAlloc = VM::HeapTypeTraits<ObjT::Type>::Traced;
 
-    // Allocate the space.
-    return headAlloc ? slab_->allocateHead(allocSize)
-                     : slab_->allocateTail(allocSize);
+    // Bump-allocate in the current slab.
+    Slab *slab = *slabp_;
+    uint8_t *mem = headAlloc ? slab->allocateHead(allocSize)
+                             : slab->allocateTail(allocSize);
+    if (mem) {
+        *slabOut = slab;
+        return mem;
+    }
+
+    return allocateSlow(allocSize, headAlloc, slabOut);
 }
 
 template <typename ObjT, typename... Args>
@@ -41,26 +49,80 @@ inline ObjT *
 AllocationContext::createSized(uint32_t size, Args... args)
 {
     // Allocate the space for the object.
-    uint8_t *mem = allocate<ObjT>(size);
-    if (!mem) {
-        if (cx_->suppressGC())
-            return nullptr;
-
-        WH_ASSERT(!"GC infrastructure.");
+    Slab *slab;
+    uint8_t *mem = allocate<ObjT>(size, &slab);
+    if (!mem)
         return nullptr;
-    }
 
     // Figure out the card number.
-    uint32_t cardNo = slab_->calculateCardNumber(mem);
+    uint32_t cardNo = slab->calculateCardNumber(mem);
 
-    // Initialize the object using HeapThingWrapper, and
-    // return it.
+    // Initialize the object using HeapThingWrapper.
     typedef VM::HeapThingWrapper<ObjT> WrappedType;
     WrappedType *wrapped = new (mem) WrappedType(cardNo, size, args...);
+
+    cx_->gcCounters_.allocatedBytes[slab->gen()].add(
+        size + VM::HeapThingHeader::HeaderSize);
+
+    if (cx_->allocProfiler_) {
+        cx_->allocProfiler_->noteAllocation(
+            site_, ObjT::Type, slab->gen(),
+            size + VM::HeapThingHeader::HeaderSize);
+    }
+
+    // Record the site of young things for the minor GC's survival counts.
+    if (site_ != AllocSite::None && slab->gen() == Slab::Hatchery) {
+        wrapped->header().setAllocSite(uint32_t(site_));
+        cx_->allocSites_[uint32_t(site_)].allocated++;
+    }
+
+    // Fields are initialized without write barriers, so conservatively
+    // mark the cards of traced things created directly in tenured space.
+    if (VM::HeapTypeTraits<ObjT::Type>::Traced &&
+        slab->gen() == Slab::Tenured)
+    {
+        slab->markCardsFor(mem, size + VM::HeapThingHeader::HeaderSize);
+    }
+
     return wrapped->payloadPointer();
 }
 
 
+//
+// ThreadContext
+//
+
+inline bool
+ThreadContext::needsMinorGC() const
+{
+    return minorGCRequested_ && !suppressGC_;
+}
+
+inline bool
+ThreadContext::needsMajorGC() const
+{
+    return (tenuredList_.numSlabs() >= majorGCSlabs_ || majorGCRequested_) &&
+           !suppressGC_;
+}
+
+inline bool
+ThreadContext::needsGC() const
+{
+    return needsMajorGC() || needsMinorGC();
+}
+
+inline bool
+RunContext::checkInterrupt()
+{
+    if (!interruptRequested_.load(std::memory_order_relaxed) &&
+        (clockCountdown_ == 0 || --clockCountdown_ != 0))
+    {
+        return true;
+    }
+    return handleInterrupt();
+}
+
+
 } // namespace Whisper
 
 #endif // WHISPER__RUNTIME_INLINES_HPP
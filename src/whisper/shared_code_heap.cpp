@@ -0,0 +1,260 @@
+
+#include <new>
+#include <string.h>
+
+#include "slab.hpp"
+#include "rooting_inlines.hpp"
+#include "runtime.hpp"
+#include "shared_code_heap.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/double.hpp"
+#include "vm/string.hpp"
+#include "vm/tuple.hpp"
+#include "interp/interpreter.hpp"
+#include "interp/bytecode_verifier.hpp"
+
+namespace Whisper {
+
+
+//
+// SharedCodeHeap
+//
+
+SharedCodeHeap::SharedCodeHeap(Runtime *runtime)
+  : runtime_(runtime),
+    slab_(nullptr),
+    slabs_(),
+    scripts_()
+{
+    WH_ASSERT(runtime_ != nullptr);
+    pthread_mutex_init(&lock_, nullptr);
+}
+
+SharedCodeHeap::~SharedCodeHeap()
+{
+    for (Slab *slab : slabs_) {
+        if (slab->isStandard())
+            runtime_->slabReserve().release(slab);
+        else
+            Slab::Destroy(slab);
+    }
+    pthread_mutex_destroy(&lock_);
+}
+
+bool
+SharedCodeHeap::lookup(const Key &key, SharedScriptCode *code)
+{
+    pthread_mutex_lock(&lock_);
+    auto existing = scripts_.find(key);
+    bool found = existing != scripts_.end();
+    if (found)
+        *code = existing->second;
+    pthread_mutex_unlock(&lock_);
+    return found;
+}
+
+const char *
+SharedCodeHeap::freeze(RunContext *cx, const Key &key,
+                       Handle<VM::Bytecode *> bytecode,
+                       Handle<VM::Tuple *> constants,
+                       uint32_t maxStackDepth, uint32_t numLocals,
+                       SharedScriptCode *code)
+{
+    pthread_mutex_lock(&lock_);
+
+    auto existing = scripts_.find(key);
+    if (existing != scripts_.end()) {
+        *code = existing->second;
+        pthread_mutex_unlock(&lock_);
+        return nullptr;
+    }
+
+    SharedScriptCode frozen;
+    frozen.bytecode = nullptr;
+    frozen.decoded = nullptr;
+    frozen.constants = nullptr;
+    frozen.maxStackDepth = maxStackDepth;
+    frozen.numLocals = numLocals;
+
+    // Frozen constants are shared things or immediates, which are never
+    // moved, so they need no rooting.
+    uint32_t numConstants = constants.get() ? constants->size() : 0;
+    std::vector<Value> vals;
+    const char *error = nullptr;
+    try {
+        vals.resize(numConstants);
+    } catch (std::bad_alloc &err) {
+        error = "Could not allocate frozen constants.";
+    }
+    for (uint32_t i = 0; !error && i < numConstants; i++)
+        error = freezeConstant(cx, constants->get(i), &vals[i]);
+
+    if (!error && numConstants > 0) {
+        frozen.constants = createSized<VM::Tuple>(
+            numConstants * sizeof(Value), vals.data());
+        if (!frozen.constants)
+            error = "Could not allocate frozen constant pool.";
+    }
+
+    if (!error) {
+        uint32_t length = bytecode->length();
+        frozen.bytecode = createSized<VM::Bytecode>(length);
+        if (frozen.bytecode)
+            memcpy(frozen.bytecode->writableData(), bytecode->data(), length);
+        else
+            error = "Could not allocate frozen bytecode.";
+    }
+
+    // The bytecode is verified before it is decoded, which also finds
+    // its stack map.
+    std::vector<uint16_t> stackMap;
+    if (!error) {
+        const char *verifyError = nullptr;
+        if (!Interp::VerifyBytecode(frozen.bytecode->data(),
+                                    frozen.bytecode->length(), numConstants,
+                                    numLocals, maxStackDepth, &stackMap,
+                                    &verifyError))
+        {
+            error = verifyError;
+        }
+    }
+
+    if (!error) {
+        frozen.decoded = createSized<VM::DecodedBytecode>(
+            VM::DecodedBytecode::CalculateSize(stackMap.size()));
+        if (frozen.decoded)
+            Interp::DecodeBytecodeOps(frozen.bytecode, stackMap,
+                                      frozen.decoded);
+        else
+            error = "Could not allocate frozen decoded bytecode.";
+    }
+
+    if (!error) {
+        try {
+            scripts_.insert({ key, frozen });
+        } catch (std::bad_alloc &err) {
+            error = "Could not allocate frozen script entry.";
+        }
+    }
+
+    // Things allocated before a failure are left in the heap.
+    pthread_mutex_unlock(&lock_);
+    if (error)
+        return error;
+
+    *code = frozen;
+    return nullptr;
+}
+
+uint8_t *
+SharedCodeHeap::allocate(uint32_t allocSize, bool traced, Slab **slabOut)
+{
+    uint8_t *mem = nullptr;
+    if (slab_)
+        mem = traced ? slab_->allocateHead(allocSize)
+                     : slab_->allocateTail(allocSize);
+    if (mem) {
+        *slabOut = slab_;
+        return mem;
+    }
+
+    bool singleton = allocSize > Slab::StandardSlabMaxObjectSize();
+    Slab *slab = singleton
+            ? Slab::AllocateSingleton(allocSize, Slab::Shared)
+            : runtime_->slabReserve().allocateStandard(Slab::Shared);
+    if (!slab)
+        return nullptr;
+
+    try {
+        slabs_.push_back(slab);
+    } catch (std::bad_alloc &err) {
+        if (singleton)
+            Slab::Destroy(slab);
+        else
+            runtime_->slabReserve().release(slab);
+        return nullptr;
+    }
+
+    if (!singleton)
+        slab_ = slab;
+    mem = traced ? slab->allocateHead(allocSize)
+                 : slab->allocateTail(allocSize);
+    WH_ASSERT(mem);
+
+    *slabOut = slab;
+    return mem;
+}
+
+template <typename ObjT, typename... Args>
+ObjT *
+SharedCodeHeap::createSized(uint32_t size, Args... args)
+{
+    WH_ASSERT(size >= sizeof(ObjT));
+
+    uint32_t allocSize = AlignIntUp<uint32_t>(
+        size + VM::HeapThingHeader::HeaderSize, Slab::AllocAlign);
+    bool traced = VM::HeapTypeTraits<ObjT::Type>::Traced;
+
+    Slab *slab;
+    uint8_t *mem = allocate(allocSize, traced, &slab);
+    if (!mem)
+        return nullptr;
+
+    // Shared things are never scanned, so their cards need no marks.
+    uint32_t cardNo = slab->calculateCardNumber(mem);
+    typedef VM::HeapThingWrapper<ObjT> WrappedType;
+    WrappedType *wrapped = new (mem) WrappedType(cardNo, size, args...);
+    return wrapped->payloadPointer();
+}
+
+static bool
+IsSharedThing(const VM::HeapThing *thing)
+{
+    const VM::HeapThingHeader *hdr =
+        reinterpret_cast<const VM::HeapThingHeader *>(thing) - 1;
+    return Slab::FromAllocation(hdr, thing->cardNo())->gen() == Slab::Shared;
+}
+
+const char *
+SharedCodeHeap::freezeConstant(RunContext *cx, Handle<Value> val,
+                               Value *out)
+{
+    if (val->isImmediate()) {
+        *out = val;
+        return nullptr;
+    }
+
+    if (val->isHeapDouble()) {
+        double d = val->heapDoublePtr()->value();
+        VM::HeapDouble *dbl = createSized<VM::HeapDouble>(
+            sizeof(VM::HeapDouble), d);
+        if (!dbl)
+            return "Could not allocate frozen number constant.";
+        *out = Value::HeapDouble(dbl);
+        return nullptr;
+    }
+
+    if (val->isHeapString()) {
+        if (IsSharedThing(val->heapStringPtr())) {
+            *out = val;
+            return nullptr;
+        }
+
+        // Interning a string in the thread's table gives a shared
+        // string if the runtime has a SharedStringTable.
+        if (!runtime_->maybeSharedStringTable())
+            return "Freezing strings requires a shared string table.";
+        Root<VM::LinearString *> interned(cx);
+        if (!cx->threadContext()->stringTable().addString(val, &interned))
+            return "Could not intern frozen string constant.";
+        WH_ASSERT(IsSharedThing(interned));
+        *out = Value::HeapString(interned);
+        return nullptr;
+    }
+
+    return "Object constants cannot be frozen.";
+}
+
+
+} // namespace Whisper
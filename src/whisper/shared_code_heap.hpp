@@ -0,0 +1,103 @@
+#ifndef WHISPER__SHARED_CODE_HEAP_HPP
+#define WHISPER__SHARED_CODE_HEAP_HPP
+
+#include <map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "rooting.hpp"
+
+namespace Whisper {
+
+class Runtime;
+class RunContext;
+class Slab;
+
+namespace VM {
+    class Bytecode;
+    class DecodedBytecode;
+    class Tuple;
+}
+
+//
+// SharedCodeHeap is an optional heap of compiled code shared by all the
+// ThreadContexts of a runtime (see Runtime::enableSharedCodeHeap).
+//
+// A script's bytecode, its decoded form and its constant pool are
+// immutable once generated, so they are frozen into the heap once,
+// under a key chosen by the caller, and then used by the Scripts of any
+// number of threads without copying.  Scripts themselves are not
+// shared: their inline caches, use counts and compiled code belong to
+// one thread, so each thread creates its own Script over the frozen
+// code (see Interp::AttachDecodedBytecode).
+//
+// Frozen code is allocated in slabs of the Shared generation, like the
+// strings of the SharedStringTable, and lives as long as the runtime.
+// Number constants are copied into the heap.  String constants must be
+// shared strings, so they can only be frozen if the runtime also has a
+// SharedStringTable, which they are interned in.
+//
+// Freezing and lookups take the heap's lock.  Frozen code is read
+// without locks.
+//
+
+struct SharedScriptCode
+{
+    VM::Bytecode *bytecode;
+    VM::DecodedBytecode *decoded;
+    VM::Tuple *constants;
+    uint32_t maxStackDepth;
+    uint32_t numLocals;
+};
+
+class SharedCodeHeap
+{
+  public:
+    // Frozen code is keyed by a hash of its source, and the flags the
+    // source was compiled with.
+    typedef std::pair<uint64_t, uint32_t> Key;
+
+  private:
+    Runtime *runtime_;
+    pthread_mutex_t lock_;
+    Slab *slab_;
+    std::vector<Slab *> slabs_;
+    std::map<Key, SharedScriptCode> scripts_;
+
+  public:
+    explicit SharedCodeHeap(Runtime *runtime);
+    ~SharedCodeHeap();
+
+    // Find the code frozen under |key|.  Returns false if there is none.
+    bool lookup(const Key &key, SharedScriptCode *code);
+
+    // Freeze |bytecode|, its decoded ops and |constants| under |key|,
+    // and return the frozen code in |code|.  If some other thread froze
+    // code under |key| first, that code is returned instead.  Returns an
+    // error message on failure.
+    const char *freeze(RunContext *cx, const Key &key,
+                       Handle<VM::Bytecode *> bytecode,
+                       Handle<VM::Tuple *> constants,
+                       uint32_t maxStackDepth, uint32_t numLocals,
+                       SharedScriptCode *code);
+
+  private:
+    // Allocate |allocSize| bytes, including the header.  Called with
+    // the lock held.
+    uint8_t *allocate(uint32_t allocSize, bool traced, Slab **slabOut);
+
+    template <typename ObjT, typename... Args>
+    ObjT *createSized(uint32_t size, Args... args);
+
+    const char *freezeConstant(RunContext *cx, Handle<Value> val,
+                               Value *out);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__SHARED_CODE_HEAP_HPP
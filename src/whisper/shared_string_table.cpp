@@ -0,0 +1,277 @@
+
+#include <new>
+
+#include "slab.hpp"
+#include "rooting_inlines.hpp"
+#include "runtime.hpp"
+#include "shared_string_table.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+
+namespace Whisper {
+
+
+//
+// SharedStringTable
+//
+
+SharedStringTable::Table::Table(uint32_t size)
+  : size(size),
+    entries(new std::atomic<VM::LinearString *>[size])
+{
+    WH_ASSERT(IsPowerOfTwo(size));
+    for (uint32_t i = 0; i < size; i++)
+        entries[i].store(nullptr, std::memory_order_relaxed);
+}
+
+SharedStringTable::Table::~Table()
+{
+    delete[] entries;
+}
+
+SharedStringTable::SharedStringTable(Runtime *runtime, uint32_t spoiler)
+  : runtime_(runtime),
+    spoiler_(spoiler),
+    table_(nullptr),
+    entries_(0),
+    retiredTables_()
+{
+    WH_ASSERT(runtime_ != nullptr);
+
+    for (uint32_t i = 0; i < NumShards; i++) {
+        pthread_mutex_init(&shards_[i].lock, nullptr);
+        shards_[i].slab = nullptr;
+    }
+}
+
+SharedStringTable::~SharedStringTable()
+{
+    delete table_.load(std::memory_order_relaxed);
+    for (Table *table : retiredTables_)
+        delete table;
+
+    for (uint32_t i = 0; i < NumShards; i++) {
+        for (Slab *slab : shards_[i].slabs) {
+            if (slab->isStandard())
+                runtime_->slabReserve().release(slab);
+            else
+                Slab::Destroy(slab);
+        }
+        pthread_mutex_destroy(&shards_[i].lock);
+    }
+}
+
+bool
+SharedStringTable::initialize()
+{
+    WH_ASSERT(table_.load(std::memory_order_relaxed) == nullptr);
+
+    try {
+        table_.store(new Table(InitialSize), std::memory_order_release);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+    return true;
+}
+
+VM::LinearString *
+SharedStringTable::lookup(const StringTable::StringOrQuery &str,
+                          uint32_t hash)
+{
+    return Probe(table_.load(std::memory_order_acquire), str, hash);
+}
+
+bool
+SharedStringTable::intern(const StringTable::StringOrQuery &str,
+                          uint32_t hash, VM::LinearString **result)
+{
+    // Most strings are already interned, and found without locking.
+    *result = lookup(str, hash);
+    if (*result)
+        return true;
+
+    Shard &shard = shards_[hash >> (32 - ShardBits)];
+    pthread_mutex_lock(&shard.lock);
+
+    // Check again under the lock, in the current table.  Only this
+    // shard inserts strings with this hash, and the table cannot grow
+    // while the lock is held.
+    Table *table;
+    for (;;) {
+        table = table_.load(std::memory_order_acquire);
+        *result = Probe(table, str, hash);
+        if (*result) {
+            pthread_mutex_unlock(&shard.lock);
+            return true;
+        }
+
+        if (entries_.load(std::memory_order_relaxed) <
+                table->size * MaxFillRatio)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&shard.lock);
+        bool grown = grow(table);
+        pthread_mutex_lock(&shard.lock);
+        if (!grown) {
+            pthread_mutex_unlock(&shard.lock);
+            return false;
+        }
+    }
+
+    VM::LinearString *linStr = createString(shard, str, hash);
+    if (!linStr) {
+        pthread_mutex_unlock(&shard.lock);
+        return false;
+    }
+
+    // Other shards may be filling slots of the same probe sequence, so
+    // claim a slot with a compare-and-swap.  The release ordering
+    // publishes the string's contents along with it.
+    uint32_t mask = table->size - 1;
+    for (uint32_t i = 0; ; i++) {
+        WH_ASSERT(i < table->size);
+        VM::LinearString *expected = nullptr;
+        if (table->entries[(hash + i) & mask].compare_exchange_strong(
+                expected, linStr,
+                std::memory_order_release, std::memory_order_relaxed))
+        {
+            break;
+        }
+    }
+    entries_.fetch_add(1, std::memory_order_relaxed);
+
+    pthread_mutex_unlock(&shard.lock);
+    *result = linStr;
+    return true;
+}
+
+/*static*/ VM::LinearString *
+SharedStringTable::Probe(Table *table, const StringTable::StringOrQuery &str,
+                         uint32_t hash)
+{
+    uint32_t mask = table->size - 1;
+    for (uint32_t i = 0; i < table->size; i++) {
+        VM::LinearString *entry =
+            table->entries[(hash + i) & mask].load(std::memory_order_acquire);
+        if (!entry)
+            return nullptr;
+
+        if (entry->hash() == hash &&
+            StringTable::compareStrings(entry, str) == 0)
+        {
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+VM::LinearString *
+SharedStringTable::createString(Shard &shard,
+                                const StringTable::StringOrQuery &str,
+                                uint32_t hash)
+{
+    uint32_t length = str.isQuery() ? str.toQuery()->length
+                                    : str.toHeapString()->length();
+    uint32_t size = VM::LinearString::AllocSize(length, /*interned=*/true);
+    uint32_t allocSize = AlignIntUp<uint32_t>(
+        size + VM::HeapThingHeader::HeaderSize, Slab::AllocAlign);
+
+    // Strings are untraced, so they are allocated from the tail.
+    Slab *slab = shard.slab;
+    uint8_t *mem = slab ? slab->allocateTail(allocSize) : nullptr;
+    if (!mem) {
+        bool singleton = allocSize > Slab::StandardSlabMaxObjectSize();
+        slab = singleton
+                ? Slab::AllocateSingleton(allocSize, Slab::Shared)
+                : runtime_->slabReserve().allocateStandard(Slab::Shared);
+        if (!slab)
+            return nullptr;
+
+        try {
+            shard.slabs.push_back(slab);
+        } catch (std::bad_alloc &err) {
+            if (singleton)
+                Slab::Destroy(slab);
+            else
+                runtime_->slabReserve().release(slab);
+            return nullptr;
+        }
+
+        if (!singleton)
+            shard.slab = slab;
+        mem = slab->allocateTail(allocSize);
+        WH_ASSERT(mem);
+    }
+
+    uint32_t cardNo = slab->calculateCardNumber(mem);
+    typedef VM::HeapThingWrapper<VM::LinearString> WrappedType;
+    WrappedType *wrapped;
+    if (str.isQuery()) {
+        const StringTable::Query *query = str.toQuery();
+        if (query->isEightBit) {
+            wrapped = new (mem) WrappedType(cardNo, size,
+                                            query->eightBitData(),
+                                            /*interned=*/true);
+        } else {
+            wrapped = new (mem) WrappedType(cardNo, size,
+                                            query->sixteenBitData(),
+                                            /*interned=*/true);
+        }
+    } else {
+        wrapped = new (mem) WrappedType(cardNo, size, str.toHeapString(),
+                                        /*interned=*/true);
+    }
+
+    VM::LinearString *linStr = wrapped->payloadPointer();
+    linStr->initHash(hash);
+    return linStr;
+}
+
+bool
+SharedStringTable::grow(Table *oldTable)
+{
+    for (uint32_t i = 0; i < NumShards; i++)
+        pthread_mutex_lock(&shards_[i].lock);
+
+    // Another thread may have grown the table first.
+    bool result = true;
+    if (table_.load(std::memory_order_relaxed) == oldTable) {
+        Table *newTable = nullptr;
+        try {
+            newTable = new Table(oldTable->size * 2);
+            retiredTables_.push_back(oldTable);
+        } catch (std::bad_alloc &err) {
+            delete newTable;
+            result = false;
+        }
+
+        if (result) {
+            uint32_t mask = newTable->size - 1;
+            for (uint32_t i = 0; i < oldTable->size; i++) {
+                VM::LinearString *entry =
+                    oldTable->entries[i].load(std::memory_order_relaxed);
+                if (!entry)
+                    continue;
+
+                uint32_t slot = entry->hash() & mask;
+                while (newTable->entries[slot].load(std::memory_order_relaxed))
+                    slot = (slot + 1) & mask;
+                newTable->entries[slot].store(entry,
+                                              std::memory_order_relaxed);
+            }
+
+            // Lookups still on the old table find every string it held.
+            table_.store(newTable, std::memory_order_release);
+        }
+    }
+
+    for (uint32_t i = NumShards; i > 0; i--)
+        pthread_mutex_unlock(&shards_[i - 1].lock);
+
+    return result;
+}
+
+
+} // namespace Whisper
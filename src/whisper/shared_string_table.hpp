@@ -0,0 +1,110 @@
+#ifndef WHISPER__SHARED_STRING_TABLE_HPP
+#define WHISPER__SHARED_STRING_TABLE_HPP
+
+#include <atomic>
+#include <vector>
+#include <pthread.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "string_table.hpp"
+
+namespace Whisper {
+
+class Runtime;
+class Slab;
+
+//
+// SharedStringTable is an optional intern table shared by all the
+// ThreadContexts of a runtime (see Runtime::enableSharedStringTable).
+// When it is enabled, each thread's StringTable forwards to it, so
+// every thread gets the same LinearString for the same chars, and
+// interned pointers can be compared across threads.
+//
+// Interned strings are allocated in slabs of the Shared generation,
+// which belong to no thread and are never collected: the collectors
+// treat shared strings like old things which are never marked.  All
+// threads hash with the table's spoiler.
+//
+// Lookups take no locks.  The table is open-addressed with linear
+// probing, and slots are filled once and never cleared, so a reader
+// only needs the table pointer and acquire loads of slots.
+//
+// Inserts are sharded by hash.  An insert takes the lock of its shard,
+// checks the current table again, then allocates the string from the
+// shard's slab and claims an empty slot with a compare-and-swap.  Equal
+// strings have equal hashes, so they are always inserted under the same
+// lock.  Growing the table takes every shard lock; the old table stays
+// readable for lookups that started on it, and is freed only with the
+// SharedStringTable itself.
+//
+
+class SharedStringTable
+{
+  public:
+    static constexpr uint32_t ShardBits = 4;
+    static constexpr uint32_t NumShards = 1 << ShardBits;
+    static constexpr uint32_t InitialSize = 1024;
+    static constexpr float MaxFillRatio = 0.75;
+
+  private:
+    struct Table
+    {
+        uint32_t size;
+        std::atomic<VM::LinearString *> *entries;
+
+        explicit Table(uint32_t size);
+        ~Table();
+    };
+
+    struct Shard
+    {
+        pthread_mutex_t lock;
+        Slab *slab;
+        std::vector<Slab *> slabs;
+    };
+
+    Runtime *runtime_;
+    uint32_t spoiler_;
+    std::atomic<Table *> table_;
+    std::atomic<uint32_t> entries_;
+    Shard shards_[NumShards];
+
+    // Tables replaced by larger ones.
+    std::vector<Table *> retiredTables_;
+
+  public:
+    SharedStringTable(Runtime *runtime, uint32_t spoiler);
+    ~SharedStringTable();
+
+    bool initialize();
+
+    uint32_t spoiler() const {
+        return spoiler_;
+    }
+
+    // Find the interned string equal to |str|, which has hash |hash|.
+    VM::LinearString *lookup(const StringTable::StringOrQuery &str,
+                             uint32_t hash);
+
+    // Find or create the interned string equal to |str|.  Returns
+    // false if a new string could not be allocated.
+    bool intern(const StringTable::StringOrQuery &str, uint32_t hash,
+                VM::LinearString **result);
+
+  private:
+    static VM::LinearString *Probe(Table *table,
+                                   const StringTable::StringOrQuery &str,
+                                   uint32_t hash);
+
+    VM::LinearString *createString(Shard &shard,
+                                   const StringTable::StringOrQuery &str,
+                                   uint32_t hash);
+
+    bool grow(Table *oldTable);
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__SHARED_STRING_TABLE_HPP
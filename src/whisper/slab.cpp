@@ -1,8 +1,10 @@
 
 #include <unistd.h>
+#include <string.h>
 #include <new>
 
 #include "spew.hpp"
+#include "trace.hpp"
 #include "memalloc.hpp"
 #include "slab.hpp"
 
@@ -27,17 +29,19 @@ InitializeStandardSlabInfo()
 
     uint32_t maxObjectSize = pageSize / 2;
 
-    // If page is larger than 64 cards, a standard slab is a single page,
-    // and the maximum sized object in a standard slab is half the size of
-    // of the page.  Otherwise, a slab is 64 cards.
+    // If page is larger than 32 cards, a standard slab is two pages, one
+    // for the header and one for data, and the maximum sized object in a
+    // standard slab is half the size of of the page.  Otherwise, a slab
+    // is 64 cards.
     uint32_t slabCards = 64;
-    if (pageCards > slabCards)
-        slabCards = pageCards;
+    if (pageCards * 2 > slabCards)
+        slabCards = pageCards * 2;
 
     // Figure out the number of data cards.
-    uint32_t dataCards = slabCards - 1;
+    uint32_t dataCards = slabCards;
     uint32_t headerCards;
     do {
+        dataCards--;
         headerCards = Slab::NumHeaderCardsForDataCards(dataCards);
     } while (headerCards + dataCards > slabCards);
 
@@ -132,24 +136,30 @@ Slab::NumHeaderCardsForDataCards(uint32_t dataCards)
     // Add space for alien refs.
     headerMinimum += AlienRefSpaceSize;
 
-    // Add 1 byte for every data card, aligned up to natural alignment.
-    headerMinimum += AlignIntUp<uint32_t>(dataCards, AllocAlign);
+    // Add 1 byte for every data card, aligned up to natural alignment,
+    // for each of the card table and the object start table.
+    headerMinimum += 2 * AlignIntUp<uint32_t>(dataCards, AllocAlign);
 
-    // Align final amount up to CardSize
-    return AlignIntUp<uint32_t>(headerMinimum, CardSize) / CardSize;
+    // Add space for the mark bitmap.
+    headerMinimum += AlignIntUp<uint32_t>(dataCards * MarkBytesPerCard,
+                                          AllocAlign);
+
+    // Align final amount up to a whole page, which is a whole number of
+    // cards.
+    return AlignIntUp<uint32_t>(headerMinimum, PageSize()) / CardSize;
 }
 
 /*static*/ Slab *
 Slab::AllocateStandard(Generation gen)
 {
-    size_t size = AlignIntUp<size_t>(StandardSlabCards() * CardSize,
-                                     PageSize());
+    size_t size = SlabReserve::RegionSize();
     void *result = AllocateMappedMemory(size);
     if (!result)
         return nullptr;
 
     WH_ASSERT(IsPtrAligned(result, CardSize));
     SpewSlabNote("Allocated std slab at %p", result);
+    TraceInstant(TraceCategory::Slab, "allocate_standard", size);
 
     return new (result) Slab(result, size,
                              StandardSlabHeaderCards(),
@@ -172,21 +182,39 @@ Slab::AllocateSingleton(uint32_t objectSize, Generation gen)
     WH_ASSERT(IsPtrAligned(result, CardSize));
 
     SpewSlabNote("Allocated singleton slab at %p (hdr=%d, data=%d)",
-                 result, dataCards, headerCards);
+                 result, headerCards, dataCards);
+    TraceInstant(TraceCategory::Slab, "allocate_singleton", size);
 
-    return new (result) Slab(result, size, dataCards, headerCards, gen);
+    return new (result) Slab(result, size, headerCards, dataCards, gen);
 }
 
 /*static*/ void
 Slab::Destroy(Slab *slab)
 {
     SpewSlabNote("Destroying slab at %p", slab);
+    TraceInstant(TraceCategory::Slab, "destroy", slab->regionSize_);
     DebugVal<bool> r = ReleaseMappedMemory(slab->region_, slab->regionSize_);
     if (!r)
         SpewSlabError("Failed to destroy slab at %p");
     WH_ASSERT(r);
 }
 
+/*static*/ Slab *
+Slab::Recycle(Slab *slab, Generation gen)
+{
+    WH_ASSERT(slab->isStandard());
+    WH_ASSERT(slab->next_ == nullptr && slab->previous_ == nullptr);
+    SpewSlabNote("Recycling std slab at %p", slab);
+
+    void *region = slab->region_;
+    uint32_t regionSize = slab->regionSize_;
+    slab->~Slab();
+    return new (region) Slab(region, regionSize,
+                             StandardSlabHeaderCards(),
+                             StandardSlabDataCards(),
+                             gen);
+}
+
 Slab::Slab(void *region, uint32_t regionSize,
            uint32_t headerCards, uint32_t dataCards,
            Generation gen)
@@ -201,9 +229,288 @@ Slab::Slab(void *region, uint32_t regionSize,
 
     allocTop_ = dataSpace;
     allocBottom_ = dataSpace + (CardSize * dataCards_);
-    
+
+    // Store a pointer to the slab at the start of the allocation area,
+    // so that the slab for any object can be found from its card number.
+    *reinterpret_cast<Slab **>(allocTop_) = this;
+
+    // Locate the card table, object start table, and mark bitmap.
+    uint32_t tableSize = AlignIntUp<uint32_t>(dataCards_, AllocAlign);
+    cardTable_ = slabBase + AlignIntUp<uint32_t>(sizeof(Slab), AllocAlign) +
+                 AlienRefSpaceSize;
+    objectStartTable_ = cardTable_ + tableSize;
+    markBits_ = objectStartTable_ + tableSize;
+    WH_ASSERT(markBits_ + (dataCards_ * MarkBytesPerCard) <= dataSpace);
+
+    resetAllocation();
+    clearMarks();
+}
+
+void
+Slab::resetAllocation()
+{
     headAlloc_ = headStartAlloc();
     tailAlloc_ = tailStartAlloc();
+    needsSweep_ = false;
+    headFreeList_ = nullptr;
+    tailFreeList_ = nullptr;
+
+    memset(cardTable_, 0, dataCards_);
+    clearObjectStarts();
+}
+
+void
+Slab::clearObjectStarts()
+{
+    memset(objectStartTable_, NoObjectStart, dataCards_);
+}
+
+void
+Slab::markCardsFor(const void *ptr, uint32_t size)
+{
+    WH_ASSERT(size > 0);
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(ptr);
+    WH_ASSERT(p >= allocTop_ && p + size <= allocBottom_);
+
+    uint32_t firstCard = (p - allocTop_) >> CardSizeLog2;
+    uint32_t lastCard = ((p + size - 1) - allocTop_) >> CardSizeLog2;
+    memset(cardTable_ + firstCard, 1, lastCard - firstCard + 1);
+}
+
+bool
+Slab::hasMarks() const
+{
+    uint32_t size = dataCards_ * MarkBytesPerCard;
+    for (uint32_t i = 0; i < size; i++) {
+        if (markBits_[i])
+            return true;
+    }
+    return false;
+}
+
+bool
+Slab::hasMarksBetween(const uint8_t *start, const uint8_t *end) const
+{
+    WH_ASSERT(start <= end);
+    if (start == end)
+        return false;
+
+    uint32_t idx = markIndex(start);
+    uint32_t endIdx = markIndex(end - 1) + 1;
+
+    // Check single bits up to a byte boundary, then whole bytes.
+    for (; idx < endIdx && (idx & 7); idx++) {
+        if (markBits_[idx >> 3] & (1 << (idx & 7)))
+            return true;
+    }
+    for (; idx + 8 <= endIdx; idx += 8) {
+        if (markBits_[idx >> 3])
+            return true;
+    }
+    for (; idx < endIdx; idx++) {
+        if (markBits_[idx >> 3] & (1 << (idx & 7)))
+            return true;
+    }
+    return false;
+}
+
+void
+Slab::clearMarks()
+{
+    memset(markBits_, 0, dataCards_ * MarkBytesPerCard);
+}
+
+uint8_t *
+Slab::objectStartBefore(uint32_t cardNo) const
+{
+    WH_ASSERT(cardNo < dataCards_);
+    for (uint32_t i = cardNo + 1; i > 0; i--) {
+        uint8_t start = objectStartTable_[i - 1];
+        if (start != NoObjectStart)
+            return cardStart(i - 1) + (start * AllocAlign);
+    }
+    return nullptr;
+}
+
+
+//
+// SlabReserve
+//
+
+SlabReserve::SlabReserve()
+  : chunks_(),
+    numMappedSlabs_(0),
+    resident_(),
+    discarded_(),
+    highWater_(DefaultHighWater),
+    useHugePages_(false)
+{
+    pthread_mutex_init(&lock_, nullptr);
+}
+
+SlabReserve::~SlabReserve()
+{
+    for (const Chunk &chunk : chunks_)
+        ReleaseMappedMemory(chunk.base, chunk.size);
+    pthread_mutex_destroy(&lock_);
+}
+
+void
+SlabReserve::setHighWater(uint32_t highWater)
+{
+    pthread_mutex_lock(&lock_);
+    highWater_ = highWater;
+    discardAbove(highWater);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+SlabReserve::trim()
+{
+    pthread_mutex_lock(&lock_);
+    discardAbove(0);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+SlabReserve::setUseHugePages(bool useHugePages)
+{
+    pthread_mutex_lock(&lock_);
+    useHugePages_ = useHugePages;
+    pthread_mutex_unlock(&lock_);
+}
+
+Slab *
+SlabReserve::allocateStandard(Slab::Generation gen)
+{
+    pthread_mutex_lock(&lock_);
+
+    // Prefer regions whose pages are still resident.
+    std::vector<void *> *list = &resident_;
+    if (list->empty())
+        list = &discarded_;
+    if (list->empty() && mapChunk())
+        list = &discarded_;
+
+    if (list->empty()) {
+        pthread_mutex_unlock(&lock_);
+        return nullptr;
+    }
+
+    void *region = list->back();
+    list->pop_back();
+    pthread_mutex_unlock(&lock_);
+
+    WH_ASSERT(IsPtrAligned(region, Slab::CardSize));
+    SpewSlabNote("Allocated std slab at %p from reserve", region);
+    TraceInstant(TraceCategory::Slab, "allocate_from_reserve", RegionSize());
+
+    return new (region) Slab(region, RegionSize(),
+                             Slab::StandardSlabHeaderCards(),
+                             Slab::StandardSlabDataCards(),
+                             gen);
+}
+
+void
+SlabReserve::release(Slab *slab)
+{
+    WH_ASSERT(slab->isStandard());
+    WH_ASSERT(slab->next_ == nullptr && slab->previous_ == nullptr);
+    SpewSlabNote("Releasing std slab at %p to reserve", slab);
+
+    void *region = slab->region_;
+    slab->~Slab();
+
+    pthread_mutex_lock(&lock_);
+    bool keep = useHugePages_ || resident_.size() < highWater_;
+    if (keep)
+        resident_.push_back(region);
+    pthread_mutex_unlock(&lock_);
+    if (keep)
+        return;
+
+    // Give the pages back outside the lock.
+    DiscardMappedMemory(region, RegionSize());
+
+    pthread_mutex_lock(&lock_);
+    discarded_.push_back(region);
+    pthread_mutex_unlock(&lock_);
+}
+
+void
+SlabReserve::countSlabs(uint32_t *mapped, uint32_t *free)
+{
+    pthread_mutex_lock(&lock_);
+    *mapped = numMappedSlabs_;
+    *free = resident_.size() + discarded_.size();
+    pthread_mutex_unlock(&lock_);
+}
+
+/*static*/ size_t
+SlabReserve::RegionSize()
+{
+    return AlignIntUp<size_t>(Slab::StandardSlabCards() * Slab::CardSize,
+                              Slab::PageSize());
+}
+
+bool
+SlabReserve::mapChunk()
+{
+    size_t regionSize = RegionSize();
+    uint32_t numSlabs = ChunkSlabs;
+    if (useHugePages_) {
+        numSlabs = (HugePageSize * HugeArenaPages) / regionSize;
+        WH_ASSERT(numSlabs > 0);
+    }
+
+    // Make room in the free lists for every region up front, so that
+    // releasing a region never needs to allocate.
+    size_t total = numMappedSlabs_ + numSlabs;
+    try {
+        chunks_.reserve(chunks_.size() + 1);
+        resident_.reserve(total);
+        discarded_.reserve(total);
+    } catch (std::bad_alloc &err) {
+        return false;
+    }
+
+    size_t chunkSize = regionSize * numSlabs;
+    void *mem;
+    if (useHugePages_)
+        mem = AllocateAlignedMappedMemory(chunkSize, HugePageSize, true);
+    else
+        mem = AllocateMappedMemory(chunkSize);
+    if (!mem)
+        return false;
+
+    uint8_t *chunk = reinterpret_cast<uint8_t *>(mem);
+    SpewSlabNote("Mapped reserve chunk of %u slabs at %p (huge=%s)",
+                 (unsigned) numSlabs, chunk, useHugePages_ ? "yes" : "no");
+    TraceInstant(TraceCategory::Slab, "map_reserve_chunk", chunkSize);
+
+    Chunk entry;
+    entry.base = chunk;
+    entry.size = chunkSize;
+    chunks_.push_back(entry);
+    numMappedSlabs_ += numSlabs;
+
+    for (uint32_t i = numSlabs; i > 0; i--)
+        discarded_.push_back(chunk + ((i - 1) * regionSize));
+    return true;
+}
+
+void
+SlabReserve::discardAbove(uint32_t limit)
+{
+    if (useHugePages_)
+        return;
+
+    while (resident_.size() > limit) {
+        void *region = resident_.back();
+        resident_.pop_back();
+        DiscardMappedMemory(region, RegionSize());
+        discarded_.push_back(region);
+    }
 }
 
 
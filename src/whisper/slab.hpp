@@ -1,12 +1,19 @@
 #ifndef WHISPER__SLAB_HPP
 #define WHISPER__SLAB_HPP
 
+#include <vector>
+#include <pthread.h>
+
 #include "common.hpp"
 #include "helpers.hpp"
 #include "debug.hpp"
 
 namespace Whisper {
 
+namespace VM {
+    class FreeSpace;
+}
+
 
 //
 // Slabs
@@ -59,15 +66,47 @@ namespace Whisper {
 // NOTE: The first 8 bytes of the allocation area are a pointer to the
 // slab structure.
 //
+// The header holds, after the slab structure and the alien ref space,
+// two tables with one byte per data card, followed by the mark bitmap:
+//
+//  Card table - A nonzero byte marks a card which may contain
+//      references to young objects.  Cards are marked by the write
+//      barrier on writes into tenured things, and are scanned and
+//      cleared by minor collections.
+//
+//  Object start table - For tenured slabs, the offset (in words) of the
+//      first traced object starting on each card, or NoObjectStart.
+//      This allows the objects on a marked card to be found without
+//      walking the slab from the beginning.
+//
+//  Mark bitmap - One bit per allocation word of the data space, set
+//      on the header word of each thing found live by a major
+//      collection.  Bits are set atomically, so that marking can
+//      proceed on several threads at once.
+//
+// The header is a whole number of pages, so that these tables, which
+// the collectors write, never share a page with things.  A page of
+// things which the mutator leaves alone is never written by the GC,
+// and stays shared with any process forked after it was filled.
+//
+// Tenured slabs are swept lazily after a major collection.  Until a
+// slab is swept, its mark bits tell live things from dead ones, and
+// nothing is allocated in it.  Sweeping turns runs of dead things into
+// FreeSpace things, chained into one free list for the traced area and
+// one for the untraced area.
+//
 
 class Slab
 {
   friend class SlabList;
+  friend class SlabReserve;
   public:
     static constexpr uint32_t AllocAlign = sizeof(void *);
     static constexpr uint32_t CardSizeLog2 = 10;
     static constexpr uint32_t CardSize = 1 << CardSizeLog2;
     static constexpr uint32_t AlienRefSpaceSize = 512;
+    static constexpr uint8_t NoObjectStart = 0xFF;
+    static constexpr uint32_t MarkBytesPerCard = CardSize / AllocAlign / 8;
 
     enum Generation : uint8_t
     {
@@ -75,15 +114,27 @@ class Slab
         // only standard sized slabs and has a fixed maximum size.
         Hatchery,
 
-        // Nursery is where recently created slabs are stored until
-        // a subsequent cull.  The nursery never "grows".  Whenever
-        // the hatchery becomes full, the nursery (if it contains
-        // slabs) is garbage-collected and cleared, and then the hatchery
-        // pages moved directly into it.
+        // Nursery is where objects which survived a single cull of the
+        // hatchery are stored until a subsequent cull.  Whenever the
+        // hatchery becomes full, a minor collection evacuates live
+        // hatchery objects into fresh nursery slabs, and live nursery
+        // objects into the tenured generation.  The old nursery slabs
+        // are released, and the hatchery is reset for reuse.
         Nursery,
 
         // Tenured generation is the oldest generation of objects.
-        Tenured
+        Tenured,
+
+        // Frozen generation holds the tenured slabs frozen in place by
+        // ThreadContext::freezeHeap.  Frozen things are never collected
+        // or moved, and nothing is allocated among them, so their pages
+        // are only ever written by the mutator.
+        Frozen,
+
+        // Shared generation holds things used by all the threads of a
+        // runtime, such as the strings of its SharedStringTable.  Its
+        // slabs belong to no thread, and are never collected.
+        Shared
     };
 
     static uint32_t PageSize();
@@ -98,7 +149,8 @@ class Slab
     static uint32_t NumDataCardsForObjectSize(uint32_t objectSize);
 
     // Calculate the number of header cards required in a chunk with the
-    // given number of data cards.
+    // given number of data cards.  The header is rounded up to a whole
+    // number of pages.
     static uint32_t NumHeaderCardsForDataCards(uint32_t dataCards);
 
     // Allocate/destroy slabs.
@@ -106,6 +158,19 @@ class Slab
     static Slab *AllocateSingleton(uint32_t objectSize, Generation gen);
     static void Destroy(Slab *slab);
 
+    // Reinitialize an unused standard slab for a new generation.
+    static Slab *Recycle(Slab *slab, Generation gen);
+
+    // Find the slab containing an allocation, given the card number
+    // the allocation starts on.  This relies on the first word of
+    // the allocation area pointing back to the slab.
+    static Slab *FromAllocation(const void *ptr, uint32_t cardNo) {
+        uintptr_t word = reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t cardBase = AlignIntDown<uintptr_t>(word, CardSize);
+        uintptr_t dataBase = cardBase - (ToUInt64(cardNo) << CardSizeLog2);
+        return *reinterpret_cast<Slab **>(dataBase);
+    }
+
   private:
     // Pointer to the actual system-allocated memory region containing
     // the slab.
@@ -133,6 +198,24 @@ class Slab
     // Slab generation.
     Generation gen_;
 
+    // Card table and object start table, in the header.
+    uint8_t *cardTable_ = nullptr;
+    uint8_t *objectStartTable_ = nullptr;
+
+    // Mark bitmap, in the header.
+    uint8_t *markBits_ = nullptr;
+
+    // Set on tenured slabs awaiting a lazy sweep.
+    bool needsSweep_ = false;
+
+    // Set on young slabs pinned by a minor GC, and on tenured slabs
+    // pinned by a compacting major GC.
+    bool pinned_ = false;
+
+    // Free lists of the traced and untraced areas.
+    VM::FreeSpace *headFreeList_ = nullptr;
+    VM::FreeSpace *tailFreeList_ = nullptr;
+
     Slab(void *region, uint32_t regionSize,
          uint32_t headerCards, uint32_t dataCards,
          Generation gen);
@@ -157,6 +240,10 @@ class Slab
         return previous_;
     }
 
+    uint32_t regionSize() const {
+        return regionSize_;
+    }
+
     uint32_t headerCards() const {
         return headerCards_;
     }
@@ -169,6 +256,24 @@ class Slab
         return gen_;
     }
 
+    // Move a hatchery slab into the nursery in place.
+    void moveToNursery() {
+        WH_ASSERT(gen_ == Hatchery);
+        gen_ = Nursery;
+    }
+
+    // Freeze a swept tenured slab in place.
+    void moveToFrozen() {
+        WH_ASSERT(gen_ == Tenured);
+        WH_ASSERT(!needsSweep_);
+        gen_ = Frozen;
+    }
+
+    bool isStandard() const {
+        return headerCards_ == StandardSlabHeaderCards() &&
+               dataCards_ == StandardSlabDataCards();
+    }
+
     uint8_t *headEndAlloc() const {
         return headAlloc_;
     }
@@ -176,16 +281,60 @@ class Slab
         return tailAlloc_;
     }
 
+    // Discard all allocations in the slab, making the entire data
+    // space available again.
+    void resetAllocation();
+
+    // Give back the space at the end of the traced area from |newHead|,
+    // or at the end of the untraced area up to |newTail|.
+    void trimHead(uint8_t *newHead) {
+        WH_ASSERT(newHead >= headStartAlloc() && newHead <= headAlloc_);
+        headAlloc_ = newHead;
+    }
+    void trimTail(uint8_t *newTail) {
+        WH_ASSERT(newTail <= tailStartAlloc() && newTail >= tailAlloc_);
+        tailAlloc_ = newTail;
+    }
+
+    // Sweeping state.
+    bool needsSweep() const {
+        return needsSweep_;
+    }
+    void setNeedsSweep(bool needsSweep) {
+        needsSweep_ = needsSweep;
+    }
+
+    // Pinning.  The things in a pinned slab are not moved by a
+    // collection, since the native stack may refer to them.
+    bool isPinned() const {
+        return pinned_;
+    }
+    void setPinned(bool pinned) {
+        pinned_ = pinned;
+    }
+
+    VM::FreeSpace *freeList(bool traced) const {
+        return traced ? headFreeList_ : tailFreeList_;
+    }
+    void setFreeList(bool traced, VM::FreeSpace *list) {
+        if (traced)
+            headFreeList_ = list;
+        else
+            tailFreeList_ = list;
+    }
+
     // Allocate memory from Top
     uint8_t *allocateHead(uint32_t amount) {
         WH_ASSERT(IsIntAligned(amount, AllocAlign));
 
         uint8_t *oldTop = headAlloc_;
         uint8_t *newTop = oldTop + amount;
-        if (newTop > allocBottom_)
+        if (newTop > tailAlloc_)
             return nullptr;
 
         headAlloc_ = newTop;
+        if (gen_ == Tenured)
+            noteObjectStart(oldTop);
         return oldTop;
     }
 
@@ -194,7 +343,7 @@ class Slab
         WH_ASSERT(IsIntAligned(amount, AllocAlign));
 
         uint8_t *newBot = tailAlloc_ - amount;
-        if (newBot < allocTop_)
+        if (newBot < headAlloc_)
             return nullptr;
 
         tailAlloc_ = newBot;
@@ -207,6 +356,80 @@ class Slab
         uint32_t diff = ptr - allocTop_;
         return diff >> CardSizeLog2;
     }
+
+    uint8_t *cardStart(uint32_t cardNo) const {
+        WH_ASSERT(cardNo < dataCards_);
+        return allocTop_ + (cardNo << CardSizeLog2);
+    }
+
+    // Card marking.
+    void markCardFor(const void *ptr) {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(ptr);
+        WH_ASSERT(p >= allocTop_ && p < allocBottom_);
+        cardTable_[(p - allocTop_) >> CardSizeLog2] = 1;
+    }
+
+    void markCardsFor(const void *ptr, uint32_t size);
+
+    bool isCardMarked(uint32_t cardNo) const {
+        WH_ASSERT(cardNo < dataCards_);
+        return cardTable_[cardNo] != 0;
+    }
+
+    void clearCard(uint32_t cardNo) {
+        WH_ASSERT(cardNo < dataCards_);
+        cardTable_[cardNo] = 0;
+    }
+
+    // Return the first traced object starting at or before the given
+    // card, or nullptr if there is none.
+    uint8_t *objectStartBefore(uint32_t cardNo) const;
+
+    // Mark bits.  |ptr| is the header address of a thing in the slab.
+    // Mark workers set bits in the same bytes concurrently, so bytes are
+    // read with relaxed atomic loads.
+    bool isMarked(const void *ptr) const {
+        uint32_t idx = markIndex(ptr);
+        uint8_t byte = __atomic_load_n(&markBits_[idx >> 3],
+                                       __ATOMIC_RELAXED);
+        return byte & (1 << (idx & 7));
+    }
+
+    // Atomically set the mark bit for a thing.  Returns true if the
+    // bit was previously clear.
+    bool tryMark(const void *ptr) {
+        uint32_t idx = markIndex(ptr);
+        uint8_t bit = 1 << (idx & 7);
+        uint8_t *byte = &markBits_[idx >> 3];
+        if (__atomic_load_n(byte, __ATOMIC_RELAXED) & bit)
+            return false;
+        return !(__sync_fetch_and_or(byte, bit) & bit);
+    }
+
+    bool hasMarks() const;
+    void clearMarks();
+
+    // Whether any thing with its header in [start, end) is marked.
+    bool hasMarksBetween(const uint8_t *start, const uint8_t *end) const;
+
+    // Record a traced thing starting at |ptr|.  Each card keeps the
+    // lowest recorded start.
+    void noteObjectStart(uint8_t *ptr) {
+        uint32_t offset = ptr - allocTop_;
+        uint32_t cardNo = offset >> CardSizeLog2;
+        uint8_t start = (offset & (CardSize - 1)) / AllocAlign;
+        if (start < objectStartTable_[cardNo])
+            objectStartTable_[cardNo] = start;
+    }
+
+    void clearObjectStarts();
+
+  private:
+    uint32_t markIndex(const void *ptr) const {
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(ptr);
+        WH_ASSERT(p >= allocTop_ && p < allocBottom_);
+        return (p - allocTop_) / AllocAlign;
+    }
 };
 
 
@@ -233,6 +456,14 @@ class SlabList
         return numSlabs_;
     }
 
+    Slab *firstSlab() const {
+        return firstSlab_;
+    }
+
+    Slab *lastSlab() const {
+        return lastSlab_;
+    }
+
     void addSlab(Slab *slab) {
         WH_ASSERT(slab->next_ == nullptr);
         WH_ASSERT(slab->previous_ == nullptr);
@@ -247,6 +478,24 @@ class SlabList
         numSlabs_++;
     }
 
+    void removeSlab(Slab *slab) {
+        WH_ASSERT(numSlabs_ > 0);
+
+        if (slab->previous_)
+            slab->previous_->next_ = slab->next_;
+        else
+            firstSlab_ = slab->next_;
+
+        if (slab->next_)
+            slab->next_->previous_ = slab->previous_;
+        else
+            lastSlab_ = slab->previous_;
+
+        slab->next_ = nullptr;
+        slab->previous_ = nullptr;
+        numSlabs_--;
+    }
+
     class Iterator
     {
       friend class SlabList;
@@ -287,11 +536,100 @@ class SlabList
         return Iterator(*this, firstSlab_);
     }
     Iterator end() const {
-        return Iterator(*this, lastSlab_);
+        return Iterator(*this, nullptr);
     }
 };
 
 
+//
+// SlabReserve
+//
+// A reserve of standard slab regions, shared by the threads of a runtime.
+//
+// Regions are mapped ChunkSlabs at a time, and handed out to threads
+// without further system calls.  Released regions are kept for reuse
+// instead of being unmapped.  Up to |highWater| released regions are
+// kept as they are; the pages of any released beyond that are given back
+// to the system with madvise(MADV_DONTNEED), keeping the address range
+// mapped for later reuse.
+//
+// In huge page mode, which is opt-in, regions are instead carved out of
+// arenas of HugeArenaPages huge pages, aligned to HugePageSize.  Since
+// giving back part of a huge page would split it, released regions are
+// never discarded in this mode.  Singleton slabs are not affected.
+//
+class SlabReserve
+{
+  public:
+    static constexpr uint32_t ChunkSlabs = 16;
+    static constexpr uint32_t DefaultHighWater = 64;
+
+    static constexpr size_t HugePageSize = 2 << 20;
+    static constexpr uint32_t HugeArenaPages = 8;
+
+  private:
+    struct Chunk
+    {
+        void *base;
+        size_t size;
+    };
+
+    pthread_mutex_t lock_;
+
+    // Mapped chunks and arenas.
+    std::vector<Chunk> chunks_;
+    uint32_t numMappedSlabs_;
+
+    // Free regions, with or without their pages.
+    std::vector<void *> resident_;
+    std::vector<void *> discarded_;
+
+    uint32_t highWater_;
+    bool useHugePages_;
+
+  public:
+    SlabReserve();
+    ~SlabReserve();
+
+    uint32_t highWater() const {
+        return highWater_;
+    }
+
+    // Changing the high-water mark discards free regions above it.
+    void setHighWater(uint32_t highWater);
+
+    // Discard every free region, keeping the high-water mark, e.g. when
+    // the system is short of memory.
+    void trim();
+
+    bool useHugePages() const {
+        return useHugePages_;
+    }
+
+    // Only affects regions mapped afterward.
+    void setUseHugePages(bool useHugePages);
+
+    uint32_t numMappedSlabs() const {
+        return numMappedSlabs_;
+    }
+
+    // Count the mapped regions, and the free ones among them, under the
+    // reserve's lock.
+    void countSlabs(uint32_t *mapped, uint32_t *free);
+
+    // Returns null on failure.
+    Slab *allocateStandard(Slab::Generation gen);
+
+    void release(Slab *slab);
+
+    static size_t RegionSize();
+
+  private:
+    bool mapChunk();
+    void discardAbove(uint32_t limit);
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__SLAB_HPP
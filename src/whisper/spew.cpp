@@ -15,7 +15,7 @@ namespace Whisper {
 
 static bool SPEW_INITIALIZED = false;
 static const unsigned SPEW_NUM_CHANNELS = static_cast<int>(SpewChannel::LIMIT);
-static SpewLevel SPEW_LEVELS[SPEW_NUM_CHANNELS];
+std::atomic<SpewLevel> SpewLevels[SPEW_NUM_CHANNELS];
 
 struct LevelInfo {
     const char *str;
@@ -74,7 +74,7 @@ CheckChannelName(const char *s, const char *name, SpewChannel chan)
     if (gotEquals)
         level = ParseSpewLevel(&s[i+1]);
 
-    SPEW_LEVELS[static_cast<int>(chan)] = level;
+    SetChannelSpewLevel(chan, level);
     return true;
 }
 
@@ -111,21 +111,32 @@ InitializeSpew()
     WH_ASSERT(!SPEW_INITIALIZED);
 
     for (unsigned i = 0; i < SPEW_NUM_CHANNELS; i++)
-        SPEW_LEVELS[i] = SpewLevel::Warn;
+        SpewLevels[i].store(SpewLevel::Warn, std::memory_order_relaxed);
 
     // Get environment variable WHSPEW
     const char *whspew = getenv("WHSPEW");
+    if (whspew)
+        ConfigureSpew(whspew);
 
-    if (whspew) {
-
-        // Check spew each channel.
-#define CHECK_(n)    CheckSpewChannel(whspew, #n, SpewChannel::n);
-        WHISPER_DEFN_SPEW_CHANNELS(CHECK_)
-#undef CHECK_
+    SPEW_INITIALIZED = 1;
+}
 
-    }
+void
+SetChannelSpewLevel(SpewChannel chan, SpewLevel level)
+{
+    WH_ASSERT(chan > SpewChannel::INVALID);
+    WH_ASSERT(chan < SpewChannel::LIMIT);
+    SpewLevels[static_cast<int>(chan)].store(level,
+                                             std::memory_order_relaxed);
+}
 
-    SPEW_INITIALIZED = 1;
+void
+ConfigureSpew(const char *spec)
+{
+    // Check spew each channel.
+#define CHECK_(n)    CheckSpewChannel(spec, #n, SpewChannel::n);
+    WHISPER_DEFN_SPEW_CHANNELS(CHECK_)
+#undef CHECK_
 }
 
 
@@ -149,7 +160,7 @@ Spew(SpewChannel chan, SpewLevel level, const char *fmt, ...)
     WH_ASSERT(SPEW_INITIALIZED);
     WH_ASSERT(chan > SpewChannel::INVALID);
     WH_ASSERT(chan < SpewChannel::LIMIT);
-    if (SPEW_LEVELS[static_cast<int>(chan)] > level)
+    if (!SpewEnabled(chan, level))
         return;
 
     const char *levelName = nullptr;
@@ -169,12 +180,6 @@ Spew(SpewChannel chan, SpewLevel level, const char *fmt, ...)
     fprintf(stderr, "[%s] %s: %s\n", levelName, SpewChannelString(chan), buf);
 }
 
-SpewLevel
-ChannelSpewLevel(SpewChannel chan)
-{
-    return SPEW_LEVELS[static_cast<int>(chan)];
-}
-
 
 #endif // defined(ENABLE_SPEW)
 
@@ -1,6 +1,8 @@
 #ifndef WHISPER__SPEW_HPP
 #define WHISPER__SPEW_HPP
 
+#include <atomic>
+
 #include "common.hpp"
 
 namespace Whisper {
@@ -15,7 +17,8 @@ namespace Whisper {
     _(Memory)       \
     _(Slab)         \
     _(Bytecode)     \
-    _(InterpOp)
+    _(InterpOp)     \
+    _(Jit)
 
 enum class SpewChannel
 {
@@ -37,25 +40,71 @@ enum class SpewLevel
 
 #if defined(ENABLE_SPEW)
 
+//
+// The level of each channel is read with a relaxed atomic load, and may
+// be changed at any time, from any thread (see SetChannelSpewLevel and
+// ConfigureSpew), so that spew can be turned on in a running process.
+//
+// The Spew<Channel><Level> macros check the level inline, before their
+// arguments are evaluated.  A disabled spew costs one load and a
+// branch, and does no formatting.
+//
+
+extern std::atomic<SpewLevel>
+    SpewLevels[static_cast<unsigned>(SpewChannel::LIMIT)];
+
 void InitializeSpew();
 void Spew(SpewChannel chan, SpewLevel level, const char *fmt, ...);
-SpewLevel ChannelSpewLevel(SpewChannel channel);
-
-#define DEFSPEW_(n) \
-    template <typename... Args> \
-    void Spew##n##Note(const char *fmt, Args... args) {\
-        Spew(SpewChannel::n, SpewLevel::Note, fmt, args...); \
-    } \
-    template <typename... Args> \
-    void Spew##n##Warn(const char *fmt, Args... args) {\
-        Spew(SpewChannel::n, SpewLevel::Warn, fmt, args...); \
-    } \
-    template <typename... Args> \
-    void Spew##n##Error(const char *fmt, Args... args) {\
-        Spew(SpewChannel::n, SpewLevel::Error, fmt, args...); \
-    }
-    WHISPER_DEFN_SPEW_CHANNELS(DEFSPEW_)
-#undef DEFSPEW_
+
+inline SpewLevel ChannelSpewLevel(SpewChannel channel) {
+    return SpewLevels[static_cast<unsigned>(channel)].load(
+                std::memory_order_relaxed);
+}
+
+inline bool SpewEnabled(SpewChannel channel, SpewLevel level) {
+    return ChannelSpewLevel(channel) <= level;
+}
+
+void SetChannelSpewLevel(SpewChannel channel, SpewLevel level);
+
+// Set the levels of the channels named in |spec|, which has the syntax
+// of the WHSPEW environment variable (e.g. "Memory=note,Slab=warn").
+// Channels not named in |spec| are left as they are.
+void ConfigureSpew(const char *spec);
+
+#define WHISPER_SPEW_(chan, level, ...) \
+    do { \
+        if (SpewEnabled(SpewChannel::chan, SpewLevel::level)) \
+            Spew(SpewChannel::chan, SpewLevel::level, __VA_ARGS__); \
+    } while (false)
+
+#define SpewDebugNote(...)      WHISPER_SPEW_(Debug, Note, __VA_ARGS__)
+#define SpewDebugWarn(...)      WHISPER_SPEW_(Debug, Warn, __VA_ARGS__)
+#define SpewDebugError(...)     WHISPER_SPEW_(Debug, Error, __VA_ARGS__)
+
+#define SpewParserNote(...)     WHISPER_SPEW_(Parser, Note, __VA_ARGS__)
+#define SpewParserWarn(...)     WHISPER_SPEW_(Parser, Warn, __VA_ARGS__)
+#define SpewParserError(...)    WHISPER_SPEW_(Parser, Error, __VA_ARGS__)
+
+#define SpewMemoryNote(...)     WHISPER_SPEW_(Memory, Note, __VA_ARGS__)
+#define SpewMemoryWarn(...)     WHISPER_SPEW_(Memory, Warn, __VA_ARGS__)
+#define SpewMemoryError(...)    WHISPER_SPEW_(Memory, Error, __VA_ARGS__)
+
+#define SpewSlabNote(...)       WHISPER_SPEW_(Slab, Note, __VA_ARGS__)
+#define SpewSlabWarn(...)       WHISPER_SPEW_(Slab, Warn, __VA_ARGS__)
+#define SpewSlabError(...)      WHISPER_SPEW_(Slab, Error, __VA_ARGS__)
+
+#define SpewBytecodeNote(...)   WHISPER_SPEW_(Bytecode, Note, __VA_ARGS__)
+#define SpewBytecodeWarn(...)   WHISPER_SPEW_(Bytecode, Warn, __VA_ARGS__)
+#define SpewBytecodeError(...)  WHISPER_SPEW_(Bytecode, Error, __VA_ARGS__)
+
+#define SpewInterpOpNote(...)   WHISPER_SPEW_(InterpOp, Note, __VA_ARGS__)
+#define SpewInterpOpWarn(...)   WHISPER_SPEW_(InterpOp, Warn, __VA_ARGS__)
+#define SpewInterpOpError(...)  WHISPER_SPEW_(InterpOp, Error, __VA_ARGS__)
+
+#define SpewJitNote(...)        WHISPER_SPEW_(Jit, Note, __VA_ARGS__)
+#define SpewJitWarn(...)        WHISPER_SPEW_(Jit, Warn, __VA_ARGS__)
+#define SpewJitError(...)       WHISPER_SPEW_(Jit, Error, __VA_ARGS__)
 
 
 #else // !defined(ENABLE_SPEW)
@@ -64,6 +113,11 @@ inline void InitializeSpew() {}
 inline SpewLevel ChannelSpewLevel(SpewChannel channel) {
     return SpewLevel::None;
 }
+inline bool SpewEnabled(SpewChannel channel, SpewLevel level) {
+    return false;
+}
+inline void SetChannelSpewLevel(SpewChannel channel, SpewLevel level) {}
+inline void ConfigureSpew(const char *spec) {}
 
 #define SpewDebugNote(...)
 #define SpewDebugWarn(...)
@@ -89,6 +143,10 @@ inline SpewLevel ChannelSpewLevel(SpewChannel channel) {
 #define SpewInterpOpWarn(...)
 #define SpewInterpOpError(...)
 
+#define SpewJitNote(...)
+#define SpewJitWarn(...)
+#define SpewJitError(...)
+
 
 #endif // defined(ENABLE_SPEW)
 
@@ -1,9 +1,11 @@
+#include <string.h>
 
 #include "rooting_inlines.hpp"
 #include "runtime_inlines.hpp"
 #include "value_inlines.hpp"
 #include "runtime.hpp"
 #include "string_table.hpp"
+#include "shared_string_table.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/string.hpp"
 #include "vm/tuple.hpp"
@@ -68,14 +70,20 @@ const StringTable::Query *
 StringTable::StringOrQuery::toQuery() const
 {
     WH_ASSERT(isQuery());
-    return reinterpret_cast<const Query *>(ptr);
+    uintptr_t queryPtr = ptr & ~static_cast<uintptr_t>(1);
+    return reinterpret_cast<const Query *>(queryPtr);
 }
 
 StringTable::StringTable()
   : cx_(nullptr),
+    shared_(nullptr),
     entries_(0),
+    deleted_(0),
     tuple_(nullptr)
-{}
+{
+    for (uint32_t i = 0; i < uint32_t(Atom::LIMIT); i++)
+        atoms_[i] = nullptr;
+}
 
 
 bool
@@ -86,13 +94,47 @@ StringTable::initialize(ThreadContext *cx)
 
     cx_ = cx;
 
+    // Interned strings are kept in the runtime's table, if it has one.
+    shared_ = cx->runtime()->maybeSharedStringTable();
+
     // Allocate a new tuple with reasonable capacity in tenured space.
-    if (!cx->inTenured().createTuple(INITIAL_TUPLE_SIZE, tuple_))
+    if (!shared_ && !cx->inTenured().createTuple(INITIAL_TUPLE_SIZE, tuple_))
         return false;
 
+    return internAtoms();
+}
+
+bool
+StringTable::internAtoms()
+{
+    static const char * const AtomStrings[uint32_t(Atom::LIMIT)] = {
+#define STRING_(name, str) str,
+        WHISPER_DEFN_ATOMS(STRING_)
+#undef STRING_
+#define STRING_(name, str, prio) str,
+        WHISPER_DEFN_KEYWORDS(STRING_)
+#undef STRING_
+    };
+
+    Root<VM::LinearString *> interned(cx_);
+    for (uint32_t i = 0; i < uint32_t(Atom::LIMIT); i++) {
+        const uint8_t *str = reinterpret_cast<const uint8_t *>(AtomStrings[i]);
+        if (!addString(str, strlen(AtomStrings[i]), &interned))
+            return false;
+        atoms_[i] = interned;
+    }
     return true;
 }
 
+Handle<VM::LinearString *>
+StringTable::atom(Atom atom) const
+{
+    WH_ASSERT(atom < Atom::LIMIT);
+    WH_ASSERT(atoms_[uint32_t(atom)]);
+    return Handle<VM::LinearString *>::FromTracedLocation(
+                atoms_[uint32_t(atom)]);
+}
+
 VM::LinearString *
 StringTable::lookupString(const Value &strval)
 {
@@ -120,27 +162,24 @@ StringTable::lookupString(VM::HeapString *str)
         return lookupString(linStr->data(), linStr->length());
     }
 
-    VM::LinearString *result;
-    lookupSlot(StringOrQuery(str), &result);
-    return result;
+    StringOrQuery soq(str);
+    return lookup(soq, hashString(soq));
 }
 
 VM::LinearString *
 StringTable::lookupString(const uint8_t *str, uint32_t length)
 {
     Query q(str, length);
-    VM::LinearString *result;
-    lookupSlot(StringOrQuery(&q), &result);
-    return result;
+    StringOrQuery soq(&q);
+    return lookup(soq, hashString(soq));
 }
 
 VM::LinearString *
 StringTable::lookupString(const uint16_t *str, uint32_t length)
 {
     Query q(str, length);
-    VM::LinearString *result;
-    lookupSlot(StringOrQuery(&q), &result);
-    return result;
+    StringOrQuery soq(&q);
+    return lookup(soq, hashString(soq));
 }
 
 bool
@@ -151,15 +190,21 @@ StringTable::addString(const uint8_t *str, uint32_t length,
 
     // Check for existing interned string in table.
     Query q(str, length);
-    uint32_t slot = lookupSlot(StringOrQuery(&q), &result.get());
+    StringOrQuery soq(&q);
+    uint32_t hash = hashString(soq);
+    if (shared_)
+        return shared_->intern(soq, hash, &result.get());
+
+    uint32_t slot = lookupSlot(soq, hash, &result.get());
     if (result)
         return true;
 
     // Allocate tenured LinearString copy (marked interned).
-    result = cx_->inTenured().createSized<VM::LinearString>(
-                            length * 2, str, /*interned=*/true);
+    result = cx_->inTenured().createLinearString(length, str,
+                                                 /*interned=*/true);
     if (!result)
         return false;
+    result->initHash(hash);
 
     return insertString(result, slot);
 }
@@ -172,15 +217,21 @@ StringTable::addString(const uint16_t *str, uint32_t length,
 
     // Check for existing interned string in table.
     Query q(str, length);
-    uint32_t slot = lookupSlot(StringOrQuery(&q), &result.get());
+    StringOrQuery soq(&q);
+    uint32_t hash = hashString(soq);
+    if (shared_)
+        return shared_->intern(soq, hash, &result.get());
+
+    uint32_t slot = lookupSlot(soq, hash, &result.get());
     if (result)
         return true;
 
     // Allocate tenured LinearString copy (marked interned).
-    result = cx_->inTenured().createSized<VM::LinearString>(
-                            length * 2, str, /*interned=*/true);
+    result = cx_->inTenured().createLinearString(length, str,
+                                                 /*interned=*/true);
     if (!result)
         return false;
+    result->initHash(hash);
 
     return insertString(result, slot);
 }
@@ -198,16 +249,21 @@ StringTable::addString(Handle<VM::HeapString *> string,
     }
 
     // Check for existing interned string in table.
-    uint32_t slot = lookupSlot(StringOrQuery(string), &result.get());
+    StringOrQuery soq(string);
+    uint32_t hash = hashString(soq);
+    if (shared_)
+        return shared_->intern(soq, hash, &result.get());
+
+    uint32_t slot = lookupSlot(soq, hash, &result.get());
     if (result)
         return true;
 
     // Allocate tenured LinearString copy (marked interned).
-    uint32_t size = string->length() * 2;
-    result = cx_->inTenured().createSized<VM::LinearString>(
-                            size, string, /*interned=*/true);
+    result = cx_->inTenured().createLinearString(string,
+                                                 /*interned=*/true);
     if (!result)
         return false;
+    result->initHash(hash);
 
     return insertString(result, slot);
 }
@@ -231,36 +287,63 @@ StringTable::addString(Handle<Value> strval,
 }
 
 
+VM::LinearString *
+StringTable::lookup(const StringOrQuery &str, uint32_t hash)
+{
+    if (shared_)
+        return shared_->lookup(str, hash);
+
+    VM::LinearString *result;
+    lookupSlot(str, hash, &result);
+    return result;
+}
+
 uint32_t
-StringTable::lookupSlot(const StringOrQuery &str, VM::LinearString **result)
+StringTable::lookupSlot(const StringOrQuery &str, uint32_t hash,
+                        VM::LinearString **result)
 {
-    uint32_t hash = hashString(str);
     uint32_t slotCount = tuple_->size();
+    uint32_t mask = slotCount - 1;
 
     *result = nullptr;
 
+    // A string which is not found is added in the first deleted slot
+    // probed, if any.
+    uint32_t deletedSlot = UINT32_MAX;
+
     WH_ASSERT(tuple_);
+    WH_ASSERT((slotCount & mask) == 0);
     for (uint32_t i = 0; i < slotCount; i++) {
-        uint32_t slot = (hash + i) % slotCount;
+        uint32_t slot = (hash + i) & mask;
         Handle<Value> slotVal = tuple_->get(slot);
         if (slotVal->isUndefined())
-            return slot;
+            return (deletedSlot != UINT32_MAX) ? deletedSlot : slot;
 
         if (slotVal->isHeapString()) {
             VM::HeapString *heapStr = slotVal->heapStringPtr();
             WH_ASSERT(heapStr->isLinearString());
             VM::LinearString *linearStr = heapStr->toLinearString();
 
-            if (compareStrings(linearStr, str) == 0) {
+            // Interned strings carry their hash, so most mismatches
+            // are found without comparing characters.
+            if (linearStr->hash() == hash &&
+                compareStrings(linearStr, str) == 0)
+            {
                 *result = linearStr;
                 return slot;
             }
+            continue;
         }
 
         // Only other option is deleted slot.
         WH_ASSERT(slotVal->isFalse());
+        if (deletedSlot == UINT32_MAX)
+            deletedSlot = slot;
     }
 
+    if (deletedSlot != UINT32_MAX)
+        return deletedSlot;
+
     WH_UNREACHABLE("Completely full StringTable should not ever happen!");
     return UINT32_MAX;
 }
@@ -273,12 +356,12 @@ StringTable::hashString(const StringOrQuery &str)
     if (str.isQuery()) {
         const Query *query = str.toQuery();
         if (query->isEightBit) {
-            return VM::FNVHashString(spoiler, query->eightBitData(),
-                                     query->length);
+            return VM::HashString(spoiler, query->eightBitData(),
+                                  query->length);
         }
 
-        return VM::FNVHashString(spoiler, query->sixteenBitData(),
-                                 query->length);
+        return VM::HashString(spoiler, query->sixteenBitData(),
+                              query->length);
     }
 
     WH_ASSERT(str.isHeapString());
@@ -286,10 +369,12 @@ StringTable::hashString(const StringOrQuery &str)
 
     if (heapStr->isLinearString()) {
         const VM::LinearString *linStr = heapStr->toLinearString();
-        return VM::FNVHashString(spoiler, linStr->data(), linStr->length());
+        if (linStr->isInterned())
+            return linStr->hash();
+        return VM::HashString(spoiler, linStr->data(), linStr->length());
     }
 
-    return VM::FNVHashString(spoiler, heapStr);
+    return VM::HashString(spoiler, heapStr);
 }
 
 int
@@ -320,38 +405,48 @@ StringTable::compareStrings(VM::LinearString *a,
 bool
 StringTable::insertString(Handle<VM::LinearString *> str, uint32_t slot)
 {
-    WH_ASSERT(tuple_->get(slot)->isUndefined());
+    WH_ASSERT(tuple_->get(slot)->isUndefined() ||
+              tuple_->get(slot)->isFalse());
     WH_ASSERT(str->isInterned());
 
-    // Resize table if necessary.
-    if (entries_ >= tuple_->size() * MAX_FILL_RATIO) {
-        if (!enlarge())
+    // Resize table if necessary.  Deleted slots count against the fill
+    // ratio, since they lengthen probes as much as live ones.
+    if (entries_ + deleted_ >= tuple_->size() * MAX_FILL_RATIO) {
+        if (!resize())
             return false;
 
         VM::LinearString *exist;
-        slot = lookupSlot(StringOrQuery(str), &exist);
+        slot = lookupSlot(StringOrQuery(str), str->hash(), &exist);
         WH_ASSERT(!exist);
     }
 
     // Store interned string.
+    if (tuple_->get(slot)->isFalse())
+        deleted_--;
     tuple_->set(slot, Value::HeapString(str));
     entries_++;
     return true;
 }
 
 bool
-StringTable::enlarge()
+StringTable::resize()
 {
     Root<VM::Tuple *> oldTuple(cx_, tuple_);
     uint32_t curSize = tuple_->size();
-    
-    // Allocate a new tuple with double capacity.
-    if (!cx_->inTenured().createTuple(curSize * 2, tuple_))
+
+    // Double the capacity, unless enough of the table is deleted slots
+    // that dropping them leaves it half full at most.
+    uint32_t newSize = curSize;
+    if (entries_ >= curSize * MAX_FILL_RATIO / 2)
+        newSize = curSize * 2;
+
+    if (!cx_->inTenured().createTuple(newSize, tuple_))
         return false;
+    deleted_ = 0;
 
     // Add old strings to table.
     for (uint32_t i = 0; i < curSize; i++) {
-        Handle<Value> oldVal = tuple_->get(i);
+        Handle<Value> oldVal = oldTuple->get(i);
         WH_ASSERT(oldVal->isUndefined() || oldVal->isFalse() ||
                   oldVal->isHeapString());
         if (!oldVal->isHeapString())
@@ -363,7 +458,8 @@ StringTable::enlarge()
 
         // Check for existing interned string in table.
         VM::LinearString *dummy;
-        uint32_t slot = lookupSlot(StringOrQuery(oldStr), &dummy);
+        uint32_t slot = lookupSlot(StringOrQuery(oldStr), oldStr->hash(),
+                                   &dummy);
         WH_ASSERT(dummy == nullptr);
 
         tuple_->set(slot, Value::HeapString(oldStr));
@@ -372,5 +468,14 @@ StringTable::enlarge()
     return true;
 }
 
+void
+StringTable::removeString(uint32_t slot)
+{
+    WH_ASSERT(tuple_->get(slot)->isHeapString());
+    tuple_->set(slot, Value::False());
+    entries_--;
+    deleted_++;
+}
+
 
 } // namespace Whisper
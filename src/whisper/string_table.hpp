@@ -6,11 +6,13 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "rooting.hpp"
+#include "atom_defn.hpp"
 
 namespace Whisper {
 
 class RunContext;
 class ThreadContext;
+class SharedStringTable;
 
 namespace VM
 {
@@ -19,6 +21,20 @@ namespace VM
     class Tuple;
 }
 
+//
+// Atoms name the strings of WHISPER_DEFN_ATOMS and of the keywords.
+//
+enum class Atom : uint16_t
+{
+#define ENUM_(name, str) name,
+    WHISPER_DEFN_ATOMS(ENUM_)
+#undef ENUM_
+#define ENUM_(name, str, prio) name,
+    WHISPER_DEFN_KEYWORDS(ENUM_)
+#undef ENUM_
+    LIMIT
+};
+
 //
 // StringTable keeps a table of interned strings.
 //
@@ -34,9 +50,29 @@ namespace VM
 // to GC pressure, and the query string can be garbage collected
 // earlier (e.g. from the nursery).
 //
+// The table is open-addressed with linear probing, and its size is
+// always a power of two, so probes wrap with a mask.  Interned strings
+// cache their hash (see LinearString::hash), so growing the table
+// never rehashes string contents.
+//
+// Every atom is interned when the table is initialized, and the
+// table keeps the interned strings, so that code can compare property
+// names against them without any lookup.
+//
+// Other interned strings are held weakly: a major collection removes
+// those which nothing else refers to (see MajorCollector).  Removed
+// strings leave deleted slots, which are reused by later additions,
+// and dropped when the table is resized.
+//
+// If the runtime has a SharedStringTable, the thread's table keeps no
+// strings of its own, and forwards lookups and additions to it.
+//
 
 class StringTable
 {
+  friend class MajorCollector;
+  friend class SharedStringTable;
+  friend class HeapSnapshot;
   private:
     // Query is a stack-allocated structure used represent
     // a length and a string pointer.
@@ -72,8 +108,11 @@ class StringTable
     static constexpr float MAX_FILL_RATIO = 0.75;
 
     ThreadContext *cx_;
+    SharedStringTable *shared_;
     uint32_t entries_;
+    uint32_t deleted_;
     VM::Tuple *tuple_;
+    VM::LinearString *atoms_[uint32_t(Atom::LIMIT)];
 
   public:
     StringTable();
@@ -95,14 +134,23 @@ class StringTable
     bool addString(Handle<Value> strval,
                    MutHandle<VM::LinearString *> result);
 
+    Handle<VM::LinearString *> atom(Atom atom) const;
+
   private:
-    uint32_t lookupSlot(const StringOrQuery &str, VM::LinearString **result);
+    bool internAtoms();
+
+    VM::LinearString *lookup(const StringOrQuery &str, uint32_t hash);
+    uint32_t lookupSlot(const StringOrQuery &str, uint32_t hash,
+                        VM::LinearString **result);
 
     uint32_t hashString(const StringOrQuery &str);
-    int compareStrings(VM::LinearString *a, const StringOrQuery &b);
+    static int compareStrings(VM::LinearString *a, const StringOrQuery &b);
 
     bool insertString(Handle<VM::LinearString *> str, uint32_t slot);
-    bool enlarge();
+    bool resize();
+
+    // Remove the dead string in |slot|, during a major collection.
+    void removeString(uint32_t slot);
 };
 
 
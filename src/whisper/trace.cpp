@@ -0,0 +1,188 @@
+
+#include <new>
+#include <vector>
+#include <inttypes.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "trace.hpp"
+#include "debug.hpp"
+
+namespace Whisper {
+
+
+std::atomic<bool> TracingEnabledFlag(false);
+
+static const char *TRACE_CATEGORY_NAMES[] = {
+#define NAME_(n)    #n,
+    WHISPER_DEFN_TRACE_CATEGORIES(NAME_)
+#undef NAME_
+    nullptr
+};
+
+//
+// TraceBuffer
+//
+// The ring of events recorded by one thread.  Buffers are never freed,
+// so that the events of threads which have exited can still be written.
+// The buffer of an exited thread is handed to the next new thread
+// instead, which keeps short-lived threads such as mark workers from
+// adding a buffer each.
+//
+
+struct TraceBuffer
+{
+    static constexpr uint32_t NumEvents = 1 << 16;
+
+    uint32_t tid;
+    uint64_t count;
+    TraceEvent events[NumEvents];
+
+    explicit TraceBuffer(uint32_t tid) : tid(tid), count(0) {}
+};
+
+static pthread_key_t TRACE_KEY;
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceBuffer *> TRACE_BUFFERS;
+static std::vector<TraceBuffer *> TRACE_FREE_BUFFERS;
+static uint64_t TRACE_START_NANOS = 0;
+
+static uint64_t
+TraceNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void
+ReleaseTraceBuffer(void *buffer)
+{
+    pthread_mutex_lock(&TRACE_LOCK);
+    TRACE_FREE_BUFFERS.push_back(reinterpret_cast<TraceBuffer *>(buffer));
+    pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+static TraceBuffer *
+AcquireTraceBuffer()
+{
+    pthread_mutex_lock(&TRACE_LOCK);
+    TraceBuffer *buffer = nullptr;
+    if (!TRACE_FREE_BUFFERS.empty()) {
+        buffer = TRACE_FREE_BUFFERS.back();
+        TRACE_FREE_BUFFERS.pop_back();
+    } else {
+        // Reserve the free list too, so that releasing never allocates.
+        try {
+            TRACE_BUFFERS.reserve(TRACE_BUFFERS.size() + 1);
+            TRACE_FREE_BUFFERS.reserve(TRACE_BUFFERS.size() + 1);
+            buffer = new TraceBuffer(TRACE_BUFFERS.size() + 1);
+            TRACE_BUFFERS.push_back(buffer);
+        } catch (std::bad_alloc &err) {
+            buffer = nullptr;
+        }
+    }
+    pthread_mutex_unlock(&TRACE_LOCK);
+
+    if (buffer)
+        pthread_setspecific(TRACE_KEY, buffer);
+    return buffer;
+}
+
+bool
+EnableTracing()
+{
+    if (TracingEnabled())
+        return true;
+    if (pthread_key_create(&TRACE_KEY, ReleaseTraceBuffer) != 0)
+        return false;
+    TRACE_START_NANOS = TraceNanos();
+    TracingEnabledFlag.store(true, std::memory_order_release);
+    return true;
+}
+
+void
+RecordTraceEvent(TraceCategory category, TraceEvent::Kind kind,
+                 const char *name, uint64_t arg)
+{
+    TraceBuffer *buffer =
+        reinterpret_cast<TraceBuffer *>(pthread_getspecific(TRACE_KEY));
+    if (!buffer && !(buffer = AcquireTraceBuffer()))
+        return;
+
+    TraceEvent &event =
+        buffer->events[buffer->count & (TraceBuffer::NumEvents - 1)];
+    event.nanos = TraceNanos();
+    event.name = name;
+    event.arg = arg;
+    event.category = category;
+    event.kind = kind;
+    buffer->count++;
+}
+
+static void
+WriteTraceBuffer(FILE *out, const TraceBuffer *buffer, bool *first)
+{
+    uint64_t start = 0;
+    if (buffer->count > TraceBuffer::NumEvents)
+        start = buffer->count - TraceBuffer::NumEvents;
+
+    // Once a buffer has wrapped, its oldest end events may have lost
+    // their begin events.  Viewers reject those, so skip them.
+    uint32_t depth = 0;
+    for (uint64_t i = start; i < buffer->count; i++) {
+        const TraceEvent &event =
+            buffer->events[i & (TraceBuffer::NumEvents - 1)];
+        if (event.kind == TraceEvent::Begin) {
+            depth++;
+        } else if (event.kind == TraceEvent::End) {
+            if (depth == 0)
+                continue;
+            depth--;
+        }
+
+        uint64_t nanos = event.nanos - TRACE_START_NANOS;
+        const char *phase = "i";
+        if (event.kind == TraceEvent::Begin)
+            phase = "B";
+        else if (event.kind == TraceEvent::End)
+            phase = "E";
+
+        fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\","
+                     "\"ts\":%" PRIu64 ".%03u,\"pid\":1,\"tid\":%u",
+                *first ? "" : ",", event.name,
+                TRACE_CATEGORY_NAMES[static_cast<int>(event.category)],
+                phase, nanos / 1000, static_cast<unsigned>(nanos % 1000),
+                buffer->tid);
+        if (event.kind == TraceEvent::Instant) {
+            fprintf(out, ",\"s\":\"t\",\"args\":{\"arg\":%" PRIu64 "}",
+                    event.arg);
+        }
+        fputs("}", out);
+        *first = false;
+    }
+}
+
+const char *
+WriteChromeTrace(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return "Could not open trace file.";
+
+    fputs("{\"traceEvents\":[", out);
+    bool first = true;
+    pthread_mutex_lock(&TRACE_LOCK);
+    for (const TraceBuffer *buffer : TRACE_BUFFERS)
+        WriteTraceBuffer(out, buffer, &first);
+    pthread_mutex_unlock(&TRACE_LOCK);
+    fputs("\n],\"displayTimeUnit\":\"ns\"}\n", out);
+
+    if (fclose(out) != 0)
+        return "Could not write trace file.";
+    return nullptr;
+}
+
+
+} // namespace Whisper
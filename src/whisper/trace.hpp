@@ -0,0 +1,113 @@
+#ifndef WHISPER__TRACE_HPP
+#define WHISPER__TRACE_HPP
+
+#include <atomic>
+
+#include "common.hpp"
+
+namespace Whisper {
+
+
+//
+// Tracing
+//
+// The tracer records timed events into a ring buffer per thread, as
+// fixed-size binary records.  Unlike spew, it is compiled into every
+// build, and costs a single branch per hook while it is disabled.
+// Recording an event takes no locks and formats nothing: event names
+// are static strings, and the buffer of a thread is only found through
+// a thread-specific key.
+//
+// Scopes (see TraceScope) record begin and end events.  Instant events
+// mark points in time, and carry one integer argument.  A buffer which
+// fills up overwrites its oldest events.
+//
+// Recorded events are written out in the Chrome trace event format,
+// which chrome://tracing and Perfetto both load (see WriteChromeTrace).
+// Writing is not synchronized with recording, so it should be done
+// once the traced threads have stopped.
+//
+
+#define WHISPER_DEFN_TRACE_CATEGORIES(_) \
+    _(Parse)        \
+    _(Compile)      \
+    _(Interp)       \
+    _(Slab)         \
+    _(GC)
+
+enum class TraceCategory : uint8_t
+{
+#define ENUM_(n)    n,
+    WHISPER_DEFN_TRACE_CATEGORIES(ENUM_)
+#undef ENUM_
+    LIMIT
+};
+
+struct TraceEvent
+{
+    enum Kind : uint8_t { Begin, End, Instant };
+
+    uint64_t nanos;
+    const char *name;
+    uint64_t arg;
+    TraceCategory category;
+    Kind kind;
+};
+
+extern std::atomic<bool> TracingEnabledFlag;
+
+inline bool TracingEnabled() {
+    return TracingEnabledFlag.load(std::memory_order_relaxed);
+}
+
+// Start recording events.  Returns false if tracing could not be set
+// up.
+bool EnableTracing();
+
+// Record an event on the calling thread.  These are only called while
+// tracing is enabled.
+void RecordTraceEvent(TraceCategory category, TraceEvent::Kind kind,
+                      const char *name, uint64_t arg);
+
+inline void TraceInstant(TraceCategory category, const char *name,
+                         uint64_t arg=0)
+{
+    if (TracingEnabled())
+        RecordTraceEvent(category, TraceEvent::Instant, name, arg);
+}
+
+// Write the events of every thread to |path|.  Returns an error
+// message on failure.
+const char *WriteChromeTrace(const char *path);
+
+//
+// TraceScope records a begin event when constructed, and the matching
+// end event when destroyed, if tracing was enabled at construction.
+//
+class TraceScope
+{
+  private:
+    TraceCategory category_;
+    const char *name_;
+    bool active_;
+
+  public:
+    TraceScope(TraceCategory category, const char *name)
+      : category_(category),
+        name_(name),
+        active_(TracingEnabled())
+    {
+        if (active_)
+            RecordTraceEvent(category_, TraceEvent::Begin, name_, 0);
+    }
+
+    ~TraceScope() {
+        if (active_)
+            RecordTraceEvent(category_, TraceEvent::End, name_, 0);
+    }
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__TRACE_HPP
@@ -5,6 +5,7 @@
 #include "helpers.hpp"
 #include "value.hpp"
 #include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
 #include "vm/string.hpp"
 #include "vm/double.hpp"
 
@@ -19,7 +20,8 @@ IsValidValueTag(ValueTag tag)
            tag == ValueTag::ImmDoubleLow        ||
            tag == ValueTag::ImmDoubleHigh       ||
            tag == ValueTag::ExtNumber           ||
-           tag == ValueTag::StringAndRest;
+           tag == ValueTag::StringAndRest       ||
+           tag == ValueTag::ImmDoubleShifted;
 }
 
 unsigned
@@ -32,6 +34,11 @@ ValueTagNumber(ValueTag tag)
 /*static*/ bool
 Value::IsImmediateNumber(double dval)
 {
+#if defined(ENABLE_NAN_BOXING)
+    // Every double is stored in the value itself.
+    return true;
+#endif
+
     // Int32s are representable.
     if (ToInt32(dval) == dval)
         return true;
@@ -48,9 +55,9 @@ Value::IsImmediateNumber(double dval)
     if (dval == 0)
         return true;
 
-    // Look for exponents with high bits 100 or 011
+    // Look for exponents with high bits 011, 100 or 101.
     unsigned exponent = GetDoubleExponentField(dval);
-    if (exponent >= 0x300 && exponent <= 0x4FF)
+    if (exponent >= 0x300 && exponent <= 0x5FF)
         return true;
 
     return false;
@@ -115,19 +122,13 @@ Value::IsImmediateIndexString(uint32_t length, const uint16_t *str)
     return ImmediateIndexValue(length, str) == -1;
 }
 
-Value::Value() : tagged_(Invalid) {}
-
-// Raw uint64_t constructor is private.
-Value::Value(uint64_t tagged) : tagged_(tagged)
-{
-#if defined(ENABLE_DEBUG)
-    WH_ASSERT(isValid());
-#endif // defined(ENABLE_DEBUG)
-}
-
 ValueTag
 Value::getTag() const
 {
+#if defined(ENABLE_NAN_BOXING)
+    if (tagged_ & DoubleTagMask)
+        return ValueTag::ImmDoubleLow;
+#endif
     ValueTag tag = static_cast<ValueTag>(tagged_ & TagMask);
     WH_ASSERT(IsValidValueTag(tag));
     return tag;
@@ -140,12 +141,6 @@ Value::checkTag(ValueTag tag) const
 }
 
 
-uint64_t
-Value::raw() const
-{
-    return tagged_;
-}
-
 bool
 Value::operator ==(const Value &val) const
 {
@@ -160,9 +155,21 @@ Value::Undefined()
 }
 
 /*static*/ Value
-Value::Int32(int32_t value)
+Value::Null()
 {
-    return Value((ToUInt64(value) << Int32Shift) | Int32Code);
+    return Value(NullVal);
+}
+
+/*static*/ Value
+Value::False()
+{
+    return Value(FalseVal);
+}
+
+/*static*/ Value
+Value::True()
+{
+    return Value(TrueVal);
 }
 
 /*static*/ Value
@@ -174,6 +181,10 @@ Value::Double(double dval)
     if (dval != dval)
         return NaN();
 
+#if defined(ENABLE_NAN_BOXING)
+    return Value(DoubleToInt(dval) + DoubleOffset);
+#endif
+
     if (dval == std::numeric_limits<double>::infinity())
         return PosInf();
 
@@ -183,9 +194,13 @@ Value::Double(double dval)
     if (dval == 0 && GetDoubleSign(dval))
         return NegZero();
 
-    // Otherwise, rotate the double value.
-    Value result = Value(RotateLeft(DoubleToInt(dval), 4));
-    WH_ASSERT(result.isImmDoubleLow() || result.isImmDoubleHigh());
+    // Otherwise, rotate the double value, first moving exponents with
+    // high bits 101 up to 111.
+    uint64_t bits = DoubleToInt(dval);
+    if (GetDoubleExponentField(dval) >= 0x500)
+        bits += ImmDoubleShiftedBias;
+    Value result = Value(RotateLeft(bits, 4));
+    WH_ASSERT(result.isImmDouble());
     return result;
 }
 
@@ -194,7 +209,8 @@ Value::Number(double dval)
 {
     WH_ASSERT(IsImmediateNumber(dval));
 
-    if (ToInt32(dval) == dval)
+    // -0 compares equal to 0, but is not an int32.
+    if (ToInt32(dval) == dval && !DoubleIsNegZero(dval))
         return Int32(dval);
 
     return Double(dval);
@@ -205,31 +221,48 @@ Value::HeapDouble(VM::HeapDouble *dbl)
 {
     WH_ASSERT(dbl != nullptr);
     WH_ASSERT(IsPtrAligned(dbl, 1u << TagBits));
+    WH_ASSERT((PtrToWord(dbl) & DoubleTagMask) == 0);
     return Value(PtrToWord(dbl) | ValueTagNumber(ValueTag::HeapDouble));
 }
 
 /*static*/ Value
 Value::NaN()
 {
+#if defined(ENABLE_NAN_BOXING)
+    return Value(CanonicalNaNBits + DoubleOffset);
+#else
     return Value(NaNVal);
+#endif
 }
 
 /*static*/ Value
 Value::PosInf()
 {
+#if defined(ENABLE_NAN_BOXING)
+    return Value(PosInfBits + DoubleOffset);
+#else
     return Value(PosInfVal);
+#endif
 }
 
 /*static*/ Value
 Value::NegInf()
 {
+#if defined(ENABLE_NAN_BOXING)
+    return Value(NegInfBits + DoubleOffset);
+#else
     return Value(NegInfVal);
+#endif
 }
 
 /*static*/ Value
 Value::NegZero()
 {
+#if defined(ENABLE_NAN_BOXING)
+    return Value(NegZeroBits + DoubleOffset);
+#else
     return Value(NegZeroVal);
+#endif
 }
 
 /*static*/ Value
@@ -238,7 +271,7 @@ Value::ImmString8(unsigned length, const uint8_t *data)
     WH_ASSERT(length <= ImmString8MaxLength);
     uint64_t val = ImmString8Code | (length << ImmString8LengthShift);
     for (unsigned i = 0; i < length; i++)
-        val |= data[i] << (ImmString8DataShift + (i*8));
+        val |= uint64_t(data[i]) << (ImmString8DataShift + (i*8));
     return Value(val);
 }
 
@@ -248,7 +281,7 @@ Value::ImmString16(unsigned length, const uint16_t *data)
     WH_ASSERT(length <= ImmString16MaxLength);
     uint64_t val = ImmString16Code | (length << ImmString16LengthShift);
     for (unsigned i = 0; i < length; i++)
-        val |= data[i] << (ImmString16DataShift + (i*16));
+        val |= uint64_t(data[i]) << (ImmString16DataShift + (i*16));
     return Value(val);
 }
 
@@ -266,6 +299,7 @@ Value::HeapString(VM::HeapString *str)
 {
     WH_ASSERT(str != nullptr);
     WH_ASSERT(IsPtrAligned(str, 1u << TagBits));
+    WH_ASSERT((PtrToWord(str) & DoubleTagMask) == 0);
     return Value(PtrToWord(str) | ValueTagNumber(ValueTag::HeapString));
 }
 
@@ -274,6 +308,7 @@ Value::Object(VM::HeapThing *thing)
 {
     WH_ASSERT(thing != nullptr);
     WH_ASSERT(IsPtrAligned(thing, 1u << TagBits));
+    WH_ASSERT((PtrToWord(thing) & DoubleTagMask) == 0);
     return Value(PtrToWord(thing) | ValueTagNumber(ValueTag::Object));
 }
 
@@ -293,10 +328,19 @@ Value::isValid() const
       case ValueTag::ImmDoubleHigh:
         return true;
 
+      case ValueTag::ImmDoubleShifted:
+#if defined(ENABLE_NAN_BOXING)
+        return false;
+#endif
+        return true;
+
       case ValueTag::ExtNumber:
         if ((tagged_ & Int32Mask) == Int32Code)
             return true;
 
+#if defined(ENABLE_NAN_BOXING)
+        return false;
+#endif
         return tagged_ == NaNVal || tagged_ == NegInfVal ||
                tagged_ == PosInfVal || tagged_ == NegZeroVal;
 
@@ -332,6 +376,7 @@ Value::type() const
       case ValueTag::HeapDouble:
       case ValueTag::ImmDoubleLow:
       case ValueTag::ImmDoubleHigh:
+      case ValueTag::ImmDoubleShifted:
       case ValueTag::ExtNumber:
         return ValueType::Number;
 
@@ -379,6 +424,53 @@ Value::isHeapDouble() const
     return checkTag(ValueTag::HeapDouble);
 }
 
+#if defined(ENABLE_NAN_BOXING)
+
+bool
+Value::isImmDoubleLow() const
+{
+    return isImmDouble() && !isNaN() && !isNegInf() && !isPosInf() &&
+           !isNegZero();
+}
+
+bool
+Value::isImmDoubleHigh() const
+{
+    return false;
+}
+
+bool
+Value::isImmDoubleShifted() const
+{
+    return false;
+}
+
+bool
+Value::isNaN() const
+{
+    return tagged_ == CanonicalNaNBits + DoubleOffset;
+}
+
+bool
+Value::isNegInf() const
+{
+    return tagged_ == NegInfBits + DoubleOffset;
+}
+
+bool
+Value::isPosInf() const
+{
+    return tagged_ == PosInfBits + DoubleOffset;
+}
+
+bool
+Value::isNegZero() const
+{
+    return tagged_ == NegZeroBits + DoubleOffset;
+}
+
+#else // !defined(ENABLE_NAN_BOXING)
+
 bool
 Value::isImmDoubleLow() const
 {
@@ -391,6 +483,12 @@ Value::isImmDoubleHigh() const
     return checkTag(ValueTag::ImmDoubleHigh);
 }
 
+bool
+Value::isImmDoubleShifted() const
+{
+    return checkTag(ValueTag::ImmDoubleShifted);
+}
+
 bool
 Value::isNaN() const
 {
@@ -415,52 +513,49 @@ Value::isNegZero() const
     return (tagged_ & ExtNumberMask) == NegZeroVal;
 }
 
-bool
-Value::isInt32() const
-{
-    return (tagged_ & ExtNumberMask) == Int32Code;
-}
+#endif // defined(ENABLE_NAN_BOXING)
 
 bool
 Value::isImmString8() const
 {
-    return (tagged_ & ImmString8Mask) == ImmString8Code;
+    return (tagged_ & (DoubleTagMask | ImmString8Mask)) == ImmString8Code;
 }
 
 bool
 Value::isImmString16() const
 {
-    return (tagged_ & ImmString16Mask) == ImmString16Code;
+    return (tagged_ & (DoubleTagMask | ImmString16Mask)) == ImmString16Code;
 }
 
 bool
 Value::isImmIndexString() const
 {
-    return (tagged_ & ImmIndexStringMask) == ImmIndexStringCode;
+    return (tagged_ & (DoubleTagMask | ImmIndexStringMask)) ==
+           ImmIndexStringCode;
 }
 
 bool
 Value::isUndefined() const
 {
-    return (tagged_ & RestMask) == UndefinedVal;
+    return (tagged_ & (DoubleTagMask | RestMask)) == UndefinedVal;
 }
 
 bool
 Value::isNull() const
 {
-    return (tagged_ & RestMask) == NullVal;
+    return (tagged_ & (DoubleTagMask | RestMask)) == NullVal;
 }
 
 bool
 Value::isFalse() const
 {
-    return (tagged_ & RestMask) == FalseVal;
+    return (tagged_ & (DoubleTagMask | RestMask)) == FalseVal;
 }
 
 bool
 Value::isTrue() const
 {
-    return (tagged_ & RestMask) == TrueVal;
+    return (tagged_ & (DoubleTagMask | RestMask)) == TrueVal;
 }
 
 
@@ -488,14 +583,15 @@ Value::isImmediate() const
 bool
 Value::isNumber() const
 {
-    return getTag() >= ValueTag::HeapDouble &&
-           getTag() <= ValueTag::ExtNumber;
+    ValueTag tag = getTag();
+    return (tag >= ValueTag::HeapDouble && tag <= ValueTag::ExtNumber) ||
+           tag == ValueTag::ImmDoubleShifted;
 }
 
 bool
 Value::isBoolean() const
 {
-    return (tagged_ & BoolMask) == BoolCode;
+    return (tagged_ & (DoubleTagMask | BoolMask)) == BoolCode;
 }
 
 bool
@@ -539,13 +635,6 @@ Value::heapDoublePtr() const
     return s;
 }
 
-int32_t
-Value::int32Value() const
-{
-    WH_ASSERT(isInt32());
-    return ToInt32(tagged_ >> Int32Shift);
-}
-
 double
 Value::numberValue() const
 {
@@ -554,6 +643,11 @@ Value::numberValue() const
     if (isInt32())
         return int32Value();
 
+#if defined(ENABLE_NAN_BOXING)
+    if (isImmDouble())
+        return immDoubleValue();
+#endif
+
     if (isNaN())
         return std::numeric_limits<double>::quiet_NaN();
 
@@ -566,8 +660,8 @@ Value::numberValue() const
     if (isNegZero())
         return -static_cast<double>(0.0);
 
-    if (isImmDoubleLow() || isImmDoubleHigh())
-        return IntToDouble(RotateRight<uint64_t>(tagged_, 4));
+    if (isImmDouble())
+        return immDoubleValue();
 
     WH_ASSERT(isHeapDouble());
     return heapDoublePtr()->value();
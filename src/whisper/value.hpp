@@ -4,6 +4,7 @@
 #include <limits>
 #include "common.hpp"
 #include "debug.hpp"
+#include "helpers.hpp"
 
 namespace Whisper {
 
@@ -21,6 +22,13 @@ namespace Whisper {
 // can represent a range of common double values as immediates.  Other
 // double values must be heap allocated.
 //
+// Immediate doubles are stored rotated left by 4 bits, so that the sign
+// and the high 3 bits of the exponent land in the low 4 bits.  Exponents
+// with high bits 011 and 100 (magnitudes from 2^-255 up to 2^257) are
+// their own tags.  Exponents with high bits 101 (up to 2^513) have
+// ImmDoubleShiftedBias added to the double's bits first, which moves
+// their high bits to 111.
+//
 //    000 - Object
 //    001 - String
 //    010 - HeapDouble
@@ -46,13 +54,14 @@ namespace Whisper {
 //      10111 - UNUSED
 //      11111 - UNUSED
 //
-//    111 - UNUSED
+//    111 - ImmDoubleShifted
 //
 //  PPPP-PPPP PPPP-PPPP ... PPPP-PPPP PPPP-PPPP PPPP-P000 - Object ptr.
 //  PPPP-PPPP PPPP-PPPP ... PPPP-PPPP PPPP-PPPP PPPP-P001 - Heap string ptr.
 //  PPPP-PPPP PPPP-PPPP ... PPPP-PPPP PPPP-PPPP PPPP-P010 - Heap double ptr
 //  EEEE-EEEE MMMM-MMMM ... MMMM-MMMM MMMM-MMMM MMMM-S011 - ImmDoubleLo
 //  EEEE-EEEE MMMM-MMMM ... MMMM-MMMM MMMM-MMMM MMMM-S100 - ImmDoubleHigh
+//  EEEE-EEEE MMMM-MMMM ... MMMM-MMMM MMMM-MMMM MMMM-S111 - ImmDoubleShifted
 //  0000-0000 0000-0000 ... 0000-0000 0000-0000 0000-0101 - NaN
 //  0000-0000 0000-0000 ... 0000-0000 0000-0000 0000-1101 - NegInf
 //  0000-0000 0000-0000 ... 0000-0000 0000-0000 0001-0101 - PosInf
@@ -66,6 +75,30 @@ namespace Whisper {
 //  0000-0000 0000-0000 ... 0000-0000 0000-0000 0011-1110 - False
 //  0000-0000 0000-0000 ... 0000-0000 0000-0000 0111-1110 - True
 //
+// NaN boxing
+// ----------
+//
+// When ENABLE_NAN_BOXING is defined (configure --enable-nan-boxing),
+// doubles are never heap allocated.  Every double is stored in the value
+// itself, with DoubleOffset added to its bits, so that the high 16 bits
+// of a double value are never zero:
+//
+//  0000-0000 0000-0000 ... PPPP-PPPP PPPP-PPPP PPPP-PTTT - Tagged
+//  (double bits + 0001-0000 0000-0000 ... 0000-0000)     - Double
+//
+// NaNs are canonicalized first, so no double has its high 16 bits all
+// set before the offset is added.
+//
+// Values whose high 16 bits are zero use the tagged format above, in 48
+// bits.  Pointers are user space addresses, which fit.  Immediate
+// strings hold up to 5 8-bit chars or 2 16-bit chars.  NaN, the
+// infinities and negative zero are doubles like any other, so the
+// ExtNumber tag only holds Int32s.
+//
+// Doubles have the ImmDoubleLow tag, and ImmDoubleHigh and
+// ImmDoubleShifted are unused.  As in
+// the default format, isImmDoubleLow() does not hold for NaN, the
+// infinities or negative zero.
 //
 
 namespace VM {
@@ -97,6 +130,7 @@ enum class ValueRepr : uint8_t
     HeapDouble,
     ImmDoubleLow,
     ImmDoubleHigh,
+    ImmDoubleShifted,
     NaN,
     NegInf,
     PosInf,
@@ -122,7 +156,8 @@ enum class ValueTag : uint8_t
     ImmDoubleLow        = 0x03, // MMMMM-011
     ImmDoubleHigh       = 0x04, // MMMMM-100
     ExtNumber           = 0x05, // ?????-101 - Integer and special doubles
-    StringAndRest       = 0x06  // ?????-110 - immstring, undef, null, bool
+    StringAndRest       = 0x06, // ?????-110 - immstring, undef, null, bool
+    ImmDoubleShifted    = 0x07  // MMMMM-111
 };
 
 bool IsValidValueTag(ValueTag tag);
@@ -134,6 +169,25 @@ class Value
     static constexpr unsigned TagBits = 3;
     static constexpr uint64_t TagMask = (1u << TagBits) - 1;
 
+#if defined(ENABLE_NAN_BOXING)
+    // Nonzero high bits mark a double.  Tagged values are compared
+    // under DoubleTagMask as well as their own masks, so that no double
+    // is mistaken for one.
+    static constexpr unsigned DoubleTagShift = 48;
+    static constexpr uint64_t DoubleTagMask = 0xffffULL << DoubleTagShift;
+    static constexpr uint64_t DoubleOffset = 1ULL << DoubleTagShift;
+    static constexpr uint64_t CanonicalNaNBits = 0x7ff8000000000000ULL;
+    static constexpr uint64_t PosInfBits = 0x7ff0000000000000ULL;
+    static constexpr uint64_t NegInfBits = 0xfff0000000000000ULL;
+    static constexpr uint64_t NegZeroBits = 0x8000000000000000ULL;
+#else
+    static constexpr uint64_t DoubleTagMask = 0;
+#endif
+
+    // Added to the bits of doubles whose exponent's high bits are 101,
+    // to give ImmDoubleShifted values.
+    static constexpr uint64_t ImmDoubleShiftedBias = 0x200ULL << 52;
+
 
     static constexpr uint64_t ExtNumberMask = 0xff;
 
@@ -151,14 +205,22 @@ class Value
     static constexpr unsigned ImmString8Code = 0x00 | 0x6;
     static constexpr unsigned ImmString8LengthMask = 0x07;
     static constexpr unsigned ImmString8LengthShift = 5;
+#if defined(ENABLE_NAN_BOXING)
+    static constexpr unsigned ImmString8MaxLength = 5;
+#else
     static constexpr unsigned ImmString8MaxLength = 7;
+#endif
     static constexpr unsigned ImmString8DataShift = 8;
 
     static constexpr unsigned ImmString16Mask = 0x3f;
     static constexpr unsigned ImmString16Code = 0x10 | 0x6;
     static constexpr unsigned ImmString16LengthMask = 0x03;
     static constexpr unsigned ImmString16LengthShift = 6;
+#if defined(ENABLE_NAN_BOXING)
+    static constexpr unsigned ImmString16MaxLength = 2;
+#else
     static constexpr unsigned ImmString16MaxLength = 3;
+#endif
     static constexpr unsigned ImmString16DataShift = 16;
 
     static constexpr unsigned ImmIndexStringMask = 0x3f;
@@ -193,18 +255,18 @@ class Value
     uint64_t tagged_;
 
   public:
-    Value();
+    inline Value();
 
   protected:
     // Raw uint64_t constructor is private.
-    explicit Value(uint64_t tagged);
+    inline explicit Value(uint64_t tagged);
 
     ValueTag getTag() const;
     bool checkTag(ValueTag tag) const;
 
   public:
 
-    uint64_t raw() const;
+    inline uint64_t raw() const;
 
     bool operator ==(const Value &val) const;
 
@@ -212,7 +274,10 @@ class Value
     // Constructors.
     //
     static Value Undefined();
-    static Value Int32(int32_t value);
+    static Value Null();
+    static Value False();
+    static Value True();
+    static inline Value Int32(int32_t value);
     static Value Double(double dval);
     static Value Number(double dval);
     static Value HeapDouble(VM::HeapDouble *dbl);
@@ -251,13 +316,19 @@ class Value
 
     bool isImmDoubleLow() const;
     bool isImmDoubleHigh() const;
+    bool isImmDoubleShifted() const;
 
     bool isNaN() const;
     bool isNegInf() const;
     bool isPosInf() const;
     bool isNegZero() const;
 
-    bool isInt32() const;
+    inline bool isInt32() const;
+
+    // Doubles read straight from the value's bits: ImmDoubleLow,
+    // ImmDoubleHigh and ImmDoubleShifted values, or with NaN boxing,
+    // every double.
+    inline bool isImmDouble() const;
 
     bool isImmString8() const;
     bool isImmString16() const;
@@ -289,7 +360,8 @@ class Value
     VM::HeapString *heapStringPtr() const;
     VM::HeapDouble *heapDoublePtr() const;
 
-    int32_t int32Value() const;
+    inline int32_t int32Value() const;
+    inline double immDoubleValue() const;
     double numberValue() const;
 
     unsigned immString8Length() const;
@@ -319,6 +391,75 @@ class Value
 };
 
 
+//
+// Word-level accessors are defined inline, for the interpreter's
+// arithmetic fast paths.
+//
+
+inline
+Value::Value() : tagged_(Invalid) {}
+
+inline
+Value::Value(uint64_t tagged) : tagged_(tagged)
+{
+#if defined(ENABLE_DEBUG)
+    WH_ASSERT(isValid());
+#endif // defined(ENABLE_DEBUG)
+}
+
+inline uint64_t
+Value::raw() const
+{
+    return tagged_;
+}
+
+/*static*/ inline Value
+Value::Int32(int32_t value)
+{
+    return Value((ToUInt64(ToUInt32(value)) << Int32Shift) | Int32Code);
+}
+
+inline bool
+Value::isInt32() const
+{
+    return (tagged_ & (DoubleTagMask | ExtNumberMask)) == Int32Code;
+}
+
+inline int32_t
+Value::int32Value() const
+{
+    WH_ASSERT(isInt32());
+    return ToInt32(tagged_ >> Int32Shift);
+}
+
+inline bool
+Value::isImmDouble() const
+{
+#if defined(ENABLE_NAN_BOXING)
+    return (tagged_ & DoubleTagMask) != 0;
+#else
+    uint64_t tag = tagged_ & TagMask;
+    return tag == ToUInt8(ValueTag::ImmDoubleLow) ||
+           tag == ToUInt8(ValueTag::ImmDoubleHigh) ||
+           tag == ToUInt8(ValueTag::ImmDoubleShifted);
+#endif
+}
+
+inline double
+Value::immDoubleValue() const
+{
+    WH_ASSERT(isImmDouble());
+#if defined(ENABLE_NAN_BOXING)
+    return IntToDouble(tagged_ - DoubleOffset);
+#else
+    uint64_t bits = RotateRight<uint64_t>(tagged_, 4);
+    if ((tagged_ & TagMask) == ToUInt8(ValueTag::ImmDoubleShifted))
+        bits -= ImmDoubleShiftedBias;
+    return IntToDouble(bits);
+#endif
+}
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VALUE_HPP
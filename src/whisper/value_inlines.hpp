@@ -50,6 +50,13 @@ Value::readImmIndexString(CharT *buf) const
         len++;
     } while (val > 0);
     WH_ASSERT(len <= ImmIndexStringMaxLength);
+
+    // Digits were produced least significant first.
+    for (unsigned i = 0; i < len / 2; i++) {
+        CharT tmp = buf[i];
+        buf[i] = buf[len - 1 - i];
+        buf[len - 1 - i] = tmp;
+    }
     return len;
 }
 
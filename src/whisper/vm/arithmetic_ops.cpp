@@ -8,6 +8,7 @@
 #include "rooting_inlines.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/stack_frame.hpp"
+#include "vm/string.hpp"
 #include "vm/arithmetic_ops.hpp"
 
 namespace Whisper {
@@ -58,6 +59,9 @@ PerformAdd(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
         return SetOutputAndReturn(out, result.get());
     }
 
+    if (lhs->isString() && rhs->isString())
+        return ConcatStrings(cx, lhs, rhs, out);
+
     WH_UNREACHABLE("Non-int32 add not implemented yet!");
     return false;
 }
@@ -135,9 +139,13 @@ PerformMul(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
         unsigned lhsBits = NumSignificantBits(lhsVal);
         unsigned rhsBits = NumSignificantBits(rhsVal);
 
-        // Do int32 multiply only if overflow not possible.
-        if (lhsBits + rhsBits < 31)
+        // Do int32 multiply only if overflow not possible, and the
+        // result is not -0.
+        if (lhsBits + rhsBits < 31 &&
+            (lhsVal * rhsVal != 0 || (lhsVal >= 0 && rhsVal >= 0)))
+        {
             return SetOutputAndReturn(out, Value::Int32(lhsVal * rhsVal));
+        }
     }
 
     if (lhs->isNumber() && rhs->isNumber()) {
@@ -180,7 +188,11 @@ PerformDiv(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
             return SetOutputAndReturn(out, Value::NaN());
         }
 
-        if (lhsVal % rhsVal == 0)
+        // INT32_MIN / -1 overflows, and 0 divided by a negative int32
+        // is -0.  Both are computed as doubles below.
+        bool exact = !(lhsVal == INT32_MIN && rhsVal == -1) &&
+                     lhsVal % rhsVal == 0;
+        if (exact && (lhsVal != 0 || rhsVal > 0))
             return SetOutputAndReturn(out, Value::Int32(lhsVal / rhsVal));
     }
 
@@ -229,13 +241,14 @@ PerformMod(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
     if (lhs->isInt32() && rhs->isInt32()) {
         int32_t lhsVal = lhs->int32Value();
         int32_t rhsVal = rhs->int32Value();
-        if (lhsVal >= 0 && rhsVal >= 0)
+        // N % 0 is NaN, computed as a double below.
+        if (lhsVal >= 0 && rhsVal > 0)
             return SetOutputAndReturn(out, Value::Int32(lhsVal % rhsVal));
     }
 
     if (lhs->isNumber() && rhs->isNumber()) {
-        int32_t lhsVal = lhs->numberValue();
-        int32_t rhsVal = rhs->numberValue();
+        double lhsVal = lhs->numberValue();
+        double rhsVal = rhs->numberValue();
 
         Root<Value> result(cx);
         if (!cx->inHatchery().createNumber(fmod(lhsVal, rhsVal), result))
@@ -255,15 +268,52 @@ PerformNeg(RunContext *cx, Handle<Value> in, MutHandle<Value> out)
     if (in->isInt32()) {
         int32_t inVal = in->int32Value();
 
+        // -INT32_MIN overflows, and -0 is not an int32.
         bool overflow = (inVal == INT32_MIN);
-        if (!overflow)
+        if (!overflow && inVal != 0)
             return SetOutputAndReturn(out, Value::Int32(-inVal));
     }
 
-    WH_UNREACHABLE("Non-int32 negate not implemented yet!");
+    if (in->isNumber()) {
+        Root<Value> result(cx);
+        if (!cx->inHatchery().createNumber(-in->numberValue(), result))
+            return false;
+
+        return SetOutputAndReturn(out, result.get());
+    }
+
+    WH_UNREACHABLE("Non-number negate not implemented yet!");
     return false;
 }
 
 
+bool
+ToBoolean(const Value &val)
+{
+    if (val.isInt32())
+        return val.int32Value() != 0;
+
+    if (val.isBoolean())
+        return val.isTrue();
+
+    if (val.isUndefined() || val.isNull())
+        return false;
+
+    // Zeros and NaN are false.
+    if (val.isNumber()) {
+        double d = val.numberValue();
+        return d == d && d != 0;
+    }
+
+    // Empty strings are false.
+    if (val.isHeapString())
+        return val.heapStringPtr()->length() != 0;
+    if (val.isImmString())
+        return val.immStringLength() != 0;
+
+    return true;
+}
+
+
 } // namespace VM
 } // namespace Whisper
@@ -10,6 +10,12 @@ namespace Whisper {
 namespace VM {
 
 
+// A binary arithmetic fast path (see arithmetic_ops_inlines.hpp), and
+// the general operation it falls back to.
+typedef bool (*FastBinaryOp)(const Value &lhs, const Value &rhs, Value *out);
+typedef bool (*SlowBinaryOp)(RunContext *cx, Handle<Value> lhs,
+                             Handle<Value> rhs, MutHandle<Value> out);
+
 bool PerformAdd(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
                 MutHandle<Value> out);
 
@@ -27,6 +33,10 @@ bool PerformMod(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
 
 bool PerformNeg(RunContext *cx, Handle<Value> in, MutHandle<Value> out);
 
+// The truth value of |val|, as tested by conditional jumps.  Never
+// allocates.
+bool ToBoolean(const Value &val);
+
 
 } // namespace VM
 } // namespace Whisper
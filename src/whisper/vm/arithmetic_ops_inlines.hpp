@@ -0,0 +1,180 @@
+#ifndef WHISPER__VM__ARITHMETIC_OPS_INLINES_HPP
+#define WHISPER__VM__ARITHMETIC_OPS_INLINES_HPP
+
+#include "common.hpp"
+#include "helpers.hpp"
+#include "value.hpp"
+#include "vm/arithmetic_ops.hpp"
+
+namespace Whisper {
+namespace VM {
+
+//
+// Arithmetic fast paths.
+//
+// These operate on unrooted values, and handle the int32 x int32 case
+// and the immediate double x immediate double case.  They never
+// allocate.  If a fast path does not apply (mixed or heap-allocated
+// operands, int32 overflow, or a double result which is not
+// immediately representable), it returns false and the caller must
+// fall back to the corresponding Perform* operation.
+//
+
+namespace FastArith {
+
+// Read an int32 or immediate double as a double.  Without NaN boxing,
+// special doubles (NaN, infinities, negative zero) are not immediate
+// doubles, so operands holding them are left to the slow path.  With
+// NaN boxing, they are read here like any other double.
+inline bool
+ReadDouble(const Value &val, double *out)
+{
+    if (val.isInt32()) {
+        *out = val.int32Value();
+        return true;
+    }
+    if (val.isImmDouble()) {
+        *out = val.immDoubleValue();
+        return true;
+    }
+    return false;
+}
+
+// Box a double result if it can be represented without allocating.
+// A -0 result is boxed as -0, not as the int32 0.
+inline bool
+WriteDouble(double dval, Value *out)
+{
+    if (!Value::IsImmediateNumber(dval))
+        return false;
+    *out = Value::Number(dval);
+    return true;
+}
+
+inline bool
+ReadDoubles(const Value &lhs, const Value &rhs,
+            double *lhsOut, double *rhsOut)
+{
+    return ReadDouble(lhs, lhsOut) && ReadDouble(rhs, rhsOut);
+}
+
+} // namespace FastArith
+
+
+inline bool
+FastAdd(const Value &lhs, const Value &rhs, Value *out)
+{
+    if (lhs.isInt32() && rhs.isInt32()) {
+        int64_t result = ToInt64(lhs.int32Value()) + rhs.int32Value();
+        if (result >= INT32_MIN && result <= INT32_MAX) {
+            *out = Value::Int32(static_cast<int32_t>(result));
+            return true;
+        }
+    }
+
+    double lhsVal, rhsVal;
+    if (FastArith::ReadDoubles(lhs, rhs, &lhsVal, &rhsVal))
+        return FastArith::WriteDouble(lhsVal + rhsVal, out);
+
+    return false;
+}
+
+inline bool
+FastSub(const Value &lhs, const Value &rhs, Value *out)
+{
+    if (lhs.isInt32() && rhs.isInt32()) {
+        int64_t result = ToInt64(lhs.int32Value()) - rhs.int32Value();
+        if (result >= INT32_MIN && result <= INT32_MAX) {
+            *out = Value::Int32(static_cast<int32_t>(result));
+            return true;
+        }
+    }
+
+    double lhsVal, rhsVal;
+    if (FastArith::ReadDoubles(lhs, rhs, &lhsVal, &rhsVal))
+        return FastArith::WriteDouble(lhsVal - rhsVal, out);
+
+    return false;
+}
+
+inline bool
+FastMul(const Value &lhs, const Value &rhs, Value *out)
+{
+    if (lhs.isInt32() && rhs.isInt32()) {
+        // A zero product with a negative operand is -0, which is not
+        // an int32.
+        int64_t result = ToInt64(lhs.int32Value()) * rhs.int32Value();
+        if (result >= INT32_MIN && result <= INT32_MAX &&
+            (result != 0 || (lhs.int32Value() >= 0 && rhs.int32Value() >= 0)))
+        {
+            *out = Value::Int32(static_cast<int32_t>(result));
+            return true;
+        }
+    }
+
+    double lhsVal, rhsVal;
+    if (FastArith::ReadDoubles(lhs, rhs, &lhsVal, &rhsVal))
+        return FastArith::WriteDouble(lhsVal * rhsVal, out);
+
+    return false;
+}
+
+inline bool
+FastDiv(const Value &lhs, const Value &rhs, Value *out)
+{
+    if (lhs.isInt32() && rhs.isInt32()) {
+        int32_t lhsVal = lhs.int32Value();
+        int32_t rhsVal = rhs.int32Value();
+
+        // Division by zero and INT32_MIN / -1 take the slow path.
+        if (rhsVal == 0 || (lhsVal == INT32_MIN && rhsVal == -1))
+            return false;
+
+        // 0 divided by a negative int32 is -0, computed as a double
+        // below.
+        if (lhsVal % rhsVal == 0 && (lhsVal != 0 || rhsVal > 0)) {
+            *out = Value::Int32(lhsVal / rhsVal);
+            return true;
+        }
+    }
+
+    double lhsVal, rhsVal;
+    if (FastArith::ReadDoubles(lhs, rhs, &lhsVal, &rhsVal) && rhsVal != 0)
+        return FastArith::WriteDouble(lhsVal / rhsVal, out);
+
+    return false;
+}
+
+inline bool
+FastMod(const Value &lhs, const Value &rhs, Value *out)
+{
+    if (lhs.isInt32() && rhs.isInt32()) {
+        int32_t lhsVal = lhs.int32Value();
+        int32_t rhsVal = rhs.int32Value();
+        if (lhsVal >= 0 && rhsVal > 0) {
+            *out = Value::Int32(lhsVal % rhsVal);
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool
+FastNeg(const Value &in, Value *out)
+{
+    if (in.isInt32() && in.int32Value() == 0) {
+        *out = Value::NegZero();
+        return true;
+    }
+    if (in.isInt32() && in.int32Value() != INT32_MIN) {
+        *out = Value::Int32(-in.int32Value());
+        return true;
+    }
+    return false;
+}
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__ARITHMETIC_OPS_INLINES_HPP
@@ -14,9 +14,31 @@ namespace VM {
 Bytecode::Bytecode()
 {}
 
+Bytecode::Bytecode(const ExternalData &ext)
+{
+    WH_ASSERT(objectSize() == sizeof(ExternalData));
+    initFlags(ExternalFlagMask);
+    *recastThis<ExternalData>() = ext;
+}
+
+const Bytecode::ExternalData &
+Bytecode::externalData() const
+{
+    WH_ASSERT(isExternal());
+    return *recastThis<ExternalData>();
+}
+
+bool
+Bytecode::isExternal() const
+{
+    return flags() & ExternalFlagMask;
+}
+
 const uint8_t *
 Bytecode::data() const
 {
+    if (isExternal())
+        return externalData().data;
     return recastThis<uint8_t>();
 }
 
@@ -36,19 +58,85 @@ Bytecode::dataEnd() const
 uint8_t *
 Bytecode::writableData()
 {
+    if (isExternal())
+        return externalData().data;
     return recastThis<uint8_t>();
 }
 
 uint32_t
 Bytecode::length() const
 {
+    if (isExternal())
+        return externalData().length;
     return objectSize();
 }
 
+
+DecodedBytecode::DecodedBytecode()
+{}
+
+/*static*/ uint32_t
+DecodedBytecode::CalculateSize(uint32_t numOps)
+{
+    return numOps * (sizeof(Interp::DecodedOp) + sizeof(uint16_t));
+}
+
+uint32_t
+DecodedBytecode::numOps() const
+{
+    WH_ASSERT(objectSize() % (sizeof(Interp::DecodedOp) +
+                              sizeof(uint16_t)) == 0);
+    return objectSize() / (sizeof(Interp::DecodedOp) + sizeof(uint16_t));
+}
+
+const Interp::DecodedOp *
+DecodedBytecode::ops() const
+{
+    return recastThis<Interp::DecodedOp>();
+}
+
+const Interp::DecodedOp *
+DecodedBytecode::opsEnd() const
+{
+    return ops() + numOps();
+}
+
+Interp::DecodedOp *
+DecodedBytecode::writableOps()
+{
+    return recastThis<Interp::DecodedOp>();
+}
+
+const Interp::DecodedOp *
+DecodedBytecode::opAt(uint32_t pcOffset) const
+{
+    const Interp::DecodedOp *op = std::lower_bound(
+        ops(), opsEnd(), pcOffset,
+        [](const Interp::DecodedOp &dop, uint32_t offset) {
+            return dop.pcOffset < offset;
+        });
+    WH_ASSERT(op == opsEnd() || op->pcOffset == pcOffset);
+    return op;
+}
+
+uint32_t
+DecodedBytecode::stackDepthAt(const Interp::DecodedOp *op) const
+{
+    WH_ASSERT(op >= ops() && op < opsEnd());
+    const uint16_t *depths = reinterpret_cast<const uint16_t *>(opsEnd());
+    return depths[op - ops()];
+}
+
+uint16_t *
+DecodedBytecode::writableStackDepths()
+{
+    return reinterpret_cast<uint16_t *>(writableOps() + numOps());
+}
+
 void
 SpewBytecodeObject(Bytecode *bc)
 {
-    if (ChannelSpewLevel(SpewChannel::Bytecode) > SpewLevel::Note)
+    if (!SpewEnabled(SpewChannel::Bytecode, SpewLevel::Note))
         return;
 
     const uint8_t *data = bc->data();
@@ -6,6 +6,7 @@
 #include "vm/heap_type_defn.hpp"
 #include "vm/heap_thing.hpp"
 #include "rooting.hpp"
+#include "interp/bytecode_ops.hpp"
 
 namespace Whisper {
 namespace VM {
@@ -14,10 +15,33 @@ namespace VM {
 //
 // Bytecode objects store the raw interpreter bytecode for scripts.
 //
+// Large bytecode is kept outside the heap, in a payload owned by the
+// thread (see ExternalDataTable), and the object holds only a pointer
+// to it and its length.
+//
+//  Flags
+//      External - indicates if the bytecode is outside the heap.
+//
 struct Bytecode : public HeapThing, public TypedHeapThing<HeapType::Bytecode>
 {
+  public:
+    static constexpr uint32_t ExternalFlagMask = 0x1;
+
+    // The body of external bytecode.
+    struct ExternalData
+    {
+        uint8_t *data;
+        uint32_t length;
+    };
+
+  private:
+    const ExternalData &externalData() const;
+
   public:
     Bytecode();
+    Bytecode(const ExternalData &ext);
+
+    bool isExternal() const;
 
     const uint8_t *data() const;
     const uint8_t *dataAt(uint32_t pcOffset) const;
@@ -27,6 +51,35 @@ struct Bytecode : public HeapThing, public TypedHeapThing<HeapType::Bytecode>
     uint32_t length() const;
 };
 
+
+//
+// DecodedBytecode objects hold the bytecode of a script decoded into
+// fixed-width ops, one per op of the bytecode, in bytecode order,
+// followed by the script's stack map: the stack depth at the start of
+// each op, as found by the bytecode verifier (see VerifyBytecode).
+//
+struct DecodedBytecode : public HeapThing,
+                         public TypedHeapThing<HeapType::DecodedBytecode>
+{
+  public:
+    DecodedBytecode();
+
+    static uint32_t CalculateSize(uint32_t numOps);
+
+    uint32_t numOps() const;
+
+    const Interp::DecodedOp *ops() const;
+    const Interp::DecodedOp *opsEnd() const;
+    Interp::DecodedOp *writableOps();
+
+    // Find the op starting at |pcOffset| in the bytecode.
+    const Interp::DecodedOp *opAt(uint32_t pcOffset) const;
+
+    // The number of values on the stack when |op| starts.
+    uint32_t stackDepthAt(const Interp::DecodedOp *op) const;
+    uint16_t *writableStackDepths();
+};
+
 void SpewBytecodeObject(Bytecode *bc);
 
 
@@ -0,0 +1,243 @@
+
+#include <stddef.h>
+
+#include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "runtime_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/ephemeron_table.hpp"
+
+namespace Whisper {
+namespace VM {
+
+
+// The collector finds the key of an ephemeron value in the slot just
+// before it.
+static_assert(offsetof(EphemeronTable::Entry, value) ==
+                  offsetof(EphemeronTable::Entry, key) + sizeof(Value),
+              "Ephemeron value must directly follow its key.");
+
+static constexpr uint32_t NoEntry = UINT32_MAX;
+
+static uint32_t
+EntriesOffset()
+{
+    return AlignIntUp<uint32_t>(sizeof(EphemeronTable), sizeof(Value));
+}
+
+EphemeronTable::EphemeronTable()
+  : used_(0),
+    keysMoved_(false)
+{
+    WH_ASSERT(IsPowerOfTwo(capacity()));
+
+    Entry *ents = entries();
+    for (uint32_t i = 0; i < capacity(); i++) {
+        ents[i].key.set(Value::Undefined(), this);
+        ents[i].value.set(Value::Undefined(), this);
+    }
+}
+
+/*static*/ uint32_t
+EphemeronTable::CalculateSize(uint32_t capacity)
+{
+    WH_ASSERT(IsPowerOfTwo(capacity));
+    return EntriesOffset() + capacity * sizeof(Entry);
+}
+
+uint32_t
+EphemeronTable::capacity() const
+{
+    WH_ASSERT((objectSize() - EntriesOffset()) % sizeof(Entry) == 0);
+    return (objectSize() - EntriesOffset()) / sizeof(Entry);
+}
+
+uint32_t
+EphemeronTable::count() const
+{
+    const Entry *ents = entries();
+    uint32_t result = 0;
+    for (uint32_t i = 0; i < capacity(); i++) {
+        if (!ents[i].key->isUndefined())
+            result++;
+    }
+    return result;
+}
+
+bool
+EphemeronTable::lookup(const Value &key, Value *valueOut)
+{
+    if (!key.isObject())
+        return false;
+    if (keysMoved_)
+        rehash();
+
+    uint32_t idx = findEntry(key);
+    if (idx == NoEntry || entries()[idx].key->isUndefined())
+        return false;
+
+    *valueOut = entries()[idx].value;
+    return true;
+}
+
+bool
+EphemeronTable::put(const Value &key, const Value &val)
+{
+    WH_ASSERT(key.isObject());
+    if (keysMoved_)
+        rehash();
+
+    uint32_t idx = findEntry(key);
+    if (idx == NoEntry)
+        return false;
+
+    Entry &ent = entries()[idx];
+    if (ent.key->isUndefined()) {
+        // Deleted entries are reused, and count as used already.
+        if (ent.value->isUndefined()) {
+            if ((used_ + 1) * 100 > capacity() * MaxFillPercent)
+                return false;
+            used_++;
+        }
+        ent.key.set(key, this);
+    }
+    ent.value.set(val, this);
+    return true;
+}
+
+bool
+EphemeronTable::remove(const Value &key)
+{
+    if (!key.isObject())
+        return false;
+    if (keysMoved_)
+        rehash();
+
+    uint32_t idx = findEntry(key);
+    if (idx == NoEntry || entries()[idx].key->isUndefined())
+        return false;
+
+    Entry &ent = entries()[idx];
+    ent.key.set(Value::Undefined(), this);
+    ent.value.set(Value::False(), this);
+    return true;
+}
+
+/*static*/ EphemeronTable *
+EphemeronTable::Grow(AllocationContext acx, Handle<EphemeronTable *> table)
+{
+    uint32_t capacity = table->capacity() * 2;
+    EphemeronTable *result =
+        acx.createSized<EphemeronTable>(CalculateSize(capacity));
+    if (!result)
+        return nullptr;
+
+    // Allocation may have moved the keys of |table|, but the new table
+    // hashes them where they are now.
+    const Entry *ents = table->entries();
+    for (uint32_t i = 0; i < table->capacity(); i++) {
+        if (ents[i].key->isUndefined())
+            continue;
+        DebugVal<bool> added = result->put(ents[i].key, ents[i].value);
+        WH_ASSERT(added);
+    }
+    return result;
+}
+
+void
+EphemeronTable::noteKeysMoved()
+{
+    keysMoved_ = true;
+}
+
+EphemeronTable::Entry *
+EphemeronTable::entries()
+{
+    return reinterpret_cast<Entry *>(
+        recastThis<uint8_t>() + EntriesOffset());
+}
+
+const EphemeronTable::Entry *
+EphemeronTable::entries() const
+{
+    return reinterpret_cast<const Entry *>(
+        recastThis<uint8_t>() + EntriesOffset());
+}
+
+uint32_t
+EphemeronTable::hashKey(const Value &key) const
+{
+    uint64_t bits = reinterpret_cast<uintptr_t>(key.objectPtr());
+    return ((bits >> 3) * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+uint32_t
+EphemeronTable::findEntry(const Value &key) const
+{
+    const Entry *ents = entries();
+    uint32_t mask = capacity() - 1;
+    uint32_t hash = hashKey(key);
+    uint32_t deleted = NoEntry;
+    for (uint32_t i = 0; i < capacity(); i++) {
+        uint32_t idx = (hash + i) & mask;
+        const Entry &ent = ents[idx];
+        if (ent.key->isUndefined()) {
+            if (ent.value->isUndefined())
+                return (deleted != NoEntry) ? deleted : idx;
+            if (deleted == NoEntry)
+                deleted = idx;
+            continue;
+        }
+        if (ent.key.get() == key)
+            return idx;
+    }
+    return deleted;
+}
+
+void
+EphemeronTable::rehash()
+{
+    Entry *ents = entries();
+    uint32_t mask = capacity() - 1;
+
+    // Drop deleted entries, including those of keys the collector found
+    // dead.
+    used_ = 0;
+    for (uint32_t i = 0; i < capacity(); i++) {
+        if (ents[i].key->isUndefined())
+            ents[i].value.set(Value::Undefined(), this);
+        else
+            used_++;
+    }
+
+    // Move each entry back to the first empty entry along its probe
+    // sequence, until none can move.  Each move brings an entry closer
+    // to its hash, so this ends, and then no entry has an empty entry
+    // before it in its probe sequence.
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (uint32_t i = 0; i < capacity(); i++) {
+            if (ents[i].key->isUndefined())
+                continue;
+
+            uint32_t idx = hashKey(ents[i].key) & mask;
+            while (idx != i && !ents[idx].key->isUndefined())
+                idx = (idx + 1) & mask;
+            if (idx == i)
+                continue;
+
+            ents[idx].key.set(ents[i].key, this);
+            ents[idx].value.set(ents[i].value, this);
+            ents[i].key.set(Value::Undefined(), this);
+            ents[i].value.set(Value::Undefined(), this);
+            moved = true;
+        }
+    }
+
+    keysMoved_ = false;
+}
+
+
+} // namespace VM
+} // namespace Whisper
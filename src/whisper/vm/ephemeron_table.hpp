@@ -0,0 +1,138 @@
+#ifndef WHISPER__VM__EPHEMERON_TABLE_HPP
+#define WHISPER__VM__EPHEMERON_TABLE_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "rooting.hpp"
+#include "ref_scanner.hpp"
+#include "vm/heap_thing.hpp"
+
+namespace Whisper {
+
+class AllocationContext;
+
+namespace VM {
+
+
+//
+// An EphemeronTable maps objects to values without keeping the objects
+// alive, like a WeakMap.  Each entry is an ephemeron: its value is kept
+// alive only while its key is, so an entry whose value refers back to
+// its own key does not keep either alive.  Once the key is collected,
+// the collector deletes the entry (see RefKind::EphemeronValue).
+//
+// The table is open-addressed with linear probing over a fixed number
+// of entries, chosen when it is created.  An entry with an undefined
+// key is empty if its value is undefined, and deleted if its value is
+// false.  A table which is too full to add an entry must be replaced
+// with a larger copy (see put and Grow).
+//
+// Keys are hashed by address, so any collection which may move keys
+// flags the table (see noteKeysMoved), and the next access rehashes it
+// in place.
+//
+class EphemeronTable : public HeapThing,
+                       public TypedHeapThing<HeapType::EphemeronTable>
+{
+  friend class Whisper::RefScanner<EphemeronTable>;
+  public:
+    struct Entry
+    {
+        WeakHeap<Value> key;
+        Heap<Value> value;
+    };
+
+    static constexpr uint32_t MaxFillPercent = 75;
+
+  private:
+    // Live and deleted entries.
+    uint32_t used_;
+    bool keysMoved_;
+
+  public:
+    EphemeronTable();
+
+    // The allocation size of a table of |capacity| entries.
+    static uint32_t CalculateSize(uint32_t capacity);
+
+    uint32_t capacity() const;
+
+    // The number of live entries.
+    uint32_t count() const;
+
+    // Find the value of |key|.  Returns false if there is none.
+    bool lookup(const Value &key, Value *valueOut);
+
+    // Set the value of |key|.  Returns false if the table is too full to
+    // add |key|.
+    bool put(const Value &key, const Value &val);
+
+    // Remove |key|.  Returns false if there was no such key.
+    bool remove(const Value &key);
+
+    // Create a table with twice the capacity of |table|, holding its
+    // entries.  Returns null on OOM.
+    static EphemeronTable *Grow(AllocationContext acx,
+                                Handle<EphemeronTable *> table);
+
+    // Called by the collector after it may have moved keys.
+    void noteKeysMoved();
+
+  private:
+    Entry *entries();
+    const Entry *entries() const;
+
+    uint32_t hashKey(const Value &key) const;
+
+    // The index of the entry of |key|, or of the entry where |key|
+    // would be added, or UINT32_MAX if it is neither there nor can be
+    // added.
+    uint32_t findEntry(const Value &key) const;
+
+    void rehash();
+};
+
+
+} // namespace VM
+
+
+template <>
+class RefScanner<VM::EphemeronTable>
+{
+  public:
+    typedef HeapRef Ref;
+
+  private:
+    VM::EphemeronTable::Entry *cur_;
+    VM::EphemeronTable::Entry *end_;
+    bool atValue_;
+
+  public:
+    inline RefScanner(VM::EphemeronTable &table)
+      : cur_(table.entries()),
+        end_(table.entries() + table.capacity()),
+        atValue_(false)
+    {}
+
+    inline bool hasMoreRefs() const {
+        return cur_ < end_;
+    }
+
+    // Each key is reported before its value, so that a collector sees
+    // the key slot first.
+    inline HeapRef nextRef() {
+        WH_ASSERT(hasMoreRefs());
+        if (!atValue_) {
+            atValue_ = true;
+            return HeapRef::FromWeakValue(cur_->key.addr());
+        }
+        atValue_ = false;
+        return HeapRef::FromEphemeronValue((cur_++)->value.addr());
+    }
+};
+
+
+} // namespace Whisper
+
+#endif // WHISPER__VM__EPHEMERON_TABLE_HPP
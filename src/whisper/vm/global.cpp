@@ -1,17 +1,99 @@
 
-#include "vm/global.hpp"
 #include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "runtime_inlines.hpp"
 #include "vm/heap_thing_inlines.hpp"
-#include "vm/shape_tree_inlines.hpp"
-#include <algorithm>
+#include "vm/object.hpp"
+#include "vm/global.hpp"
 
 namespace Whisper {
 namespace VM {
 
 
-Global::Global(Shape *shape)
-  : ObjectImpl(shape)
+GlobalCell::GlobalCell(const Value &val)
+  : value_(val)
+{}
+
+bool
+GlobalCell::isDeleted() const
+{
+    return flags() & DeletedFlag;
+}
+
+void
+GlobalCell::markDeleted()
+{
+    addFlags(DeletedFlag);
+    value_.set(Value::Undefined(), this);
+}
+
+Handle<Value>
+GlobalCell::value() const
+{
+    return value_;
+}
+
+void
+GlobalCell::setValue(const Value &val)
+{
+    WH_ASSERT(!isDeleted());
+    value_.set(val, this);
+}
+
+Value *
+GlobalCell::addressOfValue()
 {
+    return value_.addr();
+}
+
+
+Global::Global(HashObject *cells)
+  : cells_(cells)
+{
+    WH_ASSERT(cells);
+}
+
+GlobalCell *
+Global::lookupCell(RunContext *cx, Handle<Value> name) const
+{
+    uint32_t slot = cells_->lookupOwnSlot(cx, name);
+    if (slot == UINT32_MAX)
+        return nullptr;
+    return cells_->slotValue(slot).objectPtr()->toGlobalCell();
+}
+
+bool
+Global::defineGlobal(RunContext *cx, Handle<Value> name, Handle<Value> val,
+                     MutHandle<GlobalCell *> cellOut)
+{
+    if (GlobalCell *cell = lookupCell(cx, name)) {
+        cell->setValue(val);
+        cellOut = cell;
+        return true;
+    }
+
+    Root<GlobalCell *> cell(cx, cx->inHatchery().create<GlobalCell>(val));
+    if (!cell)
+        return false;
+
+    Root<HashObject *> cells(cx, cells_);
+    Root<Value> cellVal(cx, Value::Object(cell.get()));
+    if (!cells->defineValueProperty(cx, name, cellVal))
+        return false;
+    cellOut = cell;
+    return true;
+}
+
+bool
+Global::deleteGlobal(RunContext *cx, Handle<Value> name)
+{
+    GlobalCell *cell = lookupCell(cx, name);
+    if (!cell)
+        return true;
+
+    cell->markDeleted();
+    Root<HashObject *> cells(cx, cells_);
+    return cells->deleteProperty(cx, name);
 }
 
 
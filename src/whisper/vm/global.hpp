@@ -5,28 +5,100 @@
 #include "debug.hpp"
 #include "value.hpp"
 #include "rooting.hpp"
-#include "vm/object.hpp"
+#include "ref_scanner.hpp"
+#include "vm/heap_thing.hpp"
 
 namespace Whisper {
 namespace VM {
 
-template <>
-struct PropertyMapTypeTraits<HeapType::Global>
+class HashObject;
+
+
+//
+// A GlobalCell holds the value of a global variable.  Ops naming a
+// global keep its cell once they have looked it up (see GetGlobal), so
+// that later reads and writes go straight to the cell instead of
+// looking up the name.
+//
+// Deleting a global marks its cell deleted, for good.  Ops holding a
+// deleted cell look the name up again, and find a new cell if the
+// global has been defined again.
+//
+class GlobalCell : public HeapThing,
+                   public TypedHeapThing<HeapType::GlobalCell>
 {
-    static constexpr uint32_t NumInternalSlots = 0;
+  friend class Whisper::RefScanner<GlobalCell>;
+  private:
+    static constexpr uint32_t DeletedFlag = 0x1;
+
+    Heap<Value> value_;
+
+  public:
+    explicit GlobalCell(const Value &val);
+
+    bool isDeleted() const;
+    void markDeleted();
+
+    Handle<Value> value() const;
+    void setValue(const Value &val);
+
+    // Optimized code reads and writes int32 values in place, which
+    // need no write barrier (see Interp::OptCode).
+    Value *addressOfValue();
 };
 
-class Global : public ObjectImpl,
+
+//
+// The Global holds the global variables of a thread, in a HashObject
+// mapping their names to their cells.  Globals are defined by code
+// assigning to them, or by the embedding.
+//
+class Global : public HeapThing,
                public TypedHeapThing<HeapType::Global>
 {
+  friend class Whisper::RefScanner<Global>;
+  private:
+    Heap<HashObject *> cells_;
+
   public:
-    Global(Shape *shape);
-};
+    explicit Global(HashObject *cells);
+
+    // Find the cell of the global |name|, which must be a normalized
+    // property name.  Returns null if there is no such global.
+    GlobalCell *lookupCell(RunContext *cx, Handle<Value> name) const;
+
+    // Set the global |name| to |val|, defining it if there is no such
+    // global.
+    bool defineGlobal(RunContext *cx, Handle<Value> name, Handle<Value> val,
+                      MutHandle<GlobalCell *> cellOut);
 
-typedef HeapThingWrapper<Global> WrappedGlobal;
+    // Delete the global |name|, if there is one.
+    bool deleteGlobal(RunContext *cx, Handle<Value> name);
+};
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::GlobalCell> : public FieldRefScanner<1>
+{
+  public:
+    inline RefScanner(VM::GlobalCell &cell) {
+        addField(cell.value_);
+    }
+};
+
+template <>
+class RefScanner<VM::Global> : public FieldRefScanner<1>
+{
+  public:
+    inline RefScanner(VM::Global &global) {
+        addField(global.cells_);
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__GLOBAL_HPP
@@ -1,5 +1,7 @@
 
 #define __STDC_FORMAT_MACROS
+#include <new>
+
 #include "spew.hpp"
 #include "vm/heap_thing.hpp"
 #include "vm/heap_thing_inlines.hpp"
@@ -21,6 +23,19 @@ HeapTypeString(HeapType ht)
     }
 }
 
+bool
+IsTracedHeapType(HeapType ht)
+{
+    switch (ht) {
+#define CASE_(t, traced) case HeapType::t: return traced;
+    WHISPER_DEFN_HEAP_TYPES(CASE_)
+#undef CASE_
+      default:
+        WH_UNREACHABLE("Invalid heap type.");
+        return false;
+    }
+}
+
 void
 SpewHeapThingArea(const uint8_t *startu8, const uint8_t *endu8)
 {
@@ -52,7 +67,7 @@ SpewHeapThingArea(const uint8_t *startu8, const uint8_t *endu8)
 void
 SpewHeapThingSlab(Slab *slab)
 {
-    if (ChannelSpewLevel(SpewChannel::Slab) > SpewLevel::Note)
+    if (!SpewEnabled(SpewChannel::Slab, SpewLevel::Note))
         return;
 
     uint8_t *headStart = slab->headStartAlloc();
@@ -83,6 +98,20 @@ HeapThingHeader::HeapThingHeader(HeapType type, uint32_t cardNo, uint32_t size)
     header_ |= ToUInt64(cardNo) << CardNoShift;
 }
 
+uint32_t
+HeapThingHeader::allocSite() const
+{
+    return (header_ >> AllocSiteShift) & AllocSiteMask;
+}
+
+void
+HeapThingHeader::setAllocSite(uint32_t site)
+{
+    WH_ASSERT(site <= AllocSiteMask);
+    header_ &= ~(AllocSiteMask << AllocSiteShift);
+    header_ |= ToUInt64(site) << AllocSiteShift;
+}
+
 
 uint32_t
 HeapThingHeader::cardNo() const
@@ -108,6 +137,54 @@ HeapThingHeader::flags() const
     return (header_ >> FlagsShift) & FlagsMask;
 }
 
+HeapThing *
+HeapThingHeader::payload()
+{
+    return reinterpret_cast<HeapThing *>(this + 1);
+}
+
+const HeapThing *
+HeapThingHeader::payload() const
+{
+    return reinterpret_cast<const HeapThing *>(this + 1);
+}
+
+uint32_t
+HeapThingHeader::reservedSpace() const
+{
+    return AlignIntUp<uint32_t>(size(), Slab::AllocAlign);
+}
+
+bool
+HeapThingHeader::isForwarded() const
+{
+    return header_ & ForwardedBit;
+}
+
+HeapThing *
+HeapThingHeader::forwardedTo() const
+{
+    WH_ASSERT(isForwarded());
+    return *reinterpret_cast<HeapThing * const *>(payload());
+}
+
+void
+HeapThingHeader::setForwarded(HeapThing *newThing)
+{
+    WH_ASSERT(!isForwarded());
+    WH_ASSERT(reservedSpace() >= sizeof(HeapThing *));
+    *reinterpret_cast<HeapThing **>(payload()) = newThing;
+    header_ |= ForwardedBit;
+}
+
+void
+HeapThingHeader::setCardNo(uint32_t cardNo)
+{
+    WH_ASSERT(cardNo <= CardNoMask);
+    header_ &= ~(CardNoMask << CardNoShift);
+    header_ |= ToUInt64(cardNo) << CardNoShift;
+}
+
 void
 HeapThingHeader::initFlags(uint32_t fl)
 {
@@ -156,12 +233,6 @@ HeapThing::addFlags(uint32_t flags)
     header()->addFlags(flags);
 }
 
-void 
-HeapThing::noteWrite(void *ptr)
-{
-    // TODO: Add write barrier.
-}
-
 uint32_t 
 HeapThing::cardNo() const
 {
@@ -193,5 +264,52 @@ HeapThing::reservedSpace() const
 }
 
 
+//
+// FreeSpace
+//
+
+/*static*/ FreeSpace *
+FreeSpace::Format(uint8_t *mem, uint32_t cardNo, uint32_t spanSize,
+                  FreeSpace *next)
+{
+    WH_ASSERT(IsIntAligned<uint32_t>(spanSize, Slab::AllocAlign));
+    WH_ASSERT(spanSize >= HeapThingHeader::HeaderSize);
+
+    uint32_t size = spanSize - HeapThingHeader::HeaderSize;
+    HeapThingHeader *hdr = new (mem) HeapThingHeader(HeapType::FreeSpace,
+                                                     cardNo, size);
+    if (spanSize < MinListedSpan)
+        return nullptr;
+
+    FreeSpace *space = reinterpret_cast<FreeSpace *>(hdr->payload());
+    space->next_ = next;
+    return space;
+}
+
+FreeSpace *
+FreeSpace::next() const
+{
+    return next_;
+}
+
+void
+FreeSpace::setNext(FreeSpace *next)
+{
+    next_ = next;
+}
+
+uint8_t *
+FreeSpace::spanStart()
+{
+    return reinterpret_cast<uint8_t *>(header());
+}
+
+uint32_t
+FreeSpace::spanSize() const
+{
+    return HeapThingHeader::HeaderSize + header()->reservedSpace();
+}
+
+
 } // namespace VM
 } // namespace Whisper
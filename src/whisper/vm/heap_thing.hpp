@@ -8,6 +8,10 @@
 #include "vm/heap_type_defn.hpp"
 
 namespace Whisper {
+
+class MinorCollector;
+class MajorCollector;
+
 namespace VM {
 
 //
@@ -39,6 +43,9 @@ IsValidHeapType(HeapType ht) {
 
 const char *HeapTypeString(HeapType ht);
 
+// Check whether things of a given type may contain references.
+bool IsTracedHeapType(HeapType ht);
+
 void SpewHeapThingSlab(Slab *slab);
 
 template <HeapType HT> struct HeapTypeTraits {};
@@ -64,10 +71,10 @@ template <HeapType HT> struct HeapTypeTraits {};
 // A heap thing header word has the following structure:
 //
 // 64        56        48        40
-// 0000-FFFF FFFF-SSSS SSSS-SSSS SSSS-SSSS
+// AAAA-FFFF FFFF-SSSS SSSS-SSSS SSSS-SSSS
 //
 // 32        24        16        08
-// SSSS-SSSS SSSS-TTTT TTTT-00CC CCCC-CCCC
+// SSSS-SSSS SSSS-TTTT TTTT-0XCC CCCC-CCCC
 //
 // The bitfields are as follows:
 //
@@ -80,6 +87,12 @@ template <HeapType HT> struct HeapTypeTraits {};
 //      It is used to quickly calculate the address of a barrier byte
 //      corresponding to a particular word within the object's payload.
 //
+//  X
+//      The forwarded bit.  This is set by the garbage collector on the
+//      original copy of an object that has been moved.  The first payload
+//      word of a forwarded object holds the address of the new copy.
+//      All other fields of a forwarded header are left intact.
+//
 //  TTTT-TTTT
 //      The object's type.  Up to 256 types should be good enough for now,
 //      but we have 4 unused bits if we need more.
@@ -99,10 +112,17 @@ template <HeapType HT> struct HeapTypeTraits {};
 //      It's basically a small number of "free" bits which a type can
 //      use to track information about an object.
 //
+//  AAAA
+//      The allocation site of the object (see AllocSite), or 0 if it
+//      was not allocated at a tracked site.  Only recorded for objects
+//      allocated in the hatchery, where the minor GC uses it to count
+//      survivors per site.
+//
 
 class HeapThingHeader
 {
   friend class HeapThing;
+  friend class FreeSpace;
 
   template <typename T>
   friend class HeapThingWrapper;
@@ -129,6 +149,12 @@ class HeapThingHeader
     static constexpr uint64_t FlagsMask = (1ULL << FlagsBits) - 1;
     static constexpr unsigned FlagsShift = 52;
 
+    static constexpr uint64_t AllocSiteBits = 4;
+    static constexpr uint64_t AllocSiteMask = (1ULL << AllocSiteBits) - 1;
+    static constexpr unsigned AllocSiteShift = 60;
+
+    static constexpr uint64_t ForwardedBit = 1ULL << 10;
+
   protected:
     HeapThingHeader(HeapType type, uint32_t cardNo, uint32_t size);
 
@@ -142,6 +168,21 @@ class HeapThingHeader
 
     uint32_t flags() const;
 
+    // Garbage collector helpers.
+    HeapThing *payload();
+    const HeapThing *payload() const;
+
+    uint32_t reservedSpace() const;
+
+    bool isForwarded() const;
+    HeapThing *forwardedTo() const;
+    void setForwarded(HeapThing *newThing);
+
+    void setCardNo(uint32_t cardNo);
+
+    uint32_t allocSite() const;
+    void setAllocSite(uint32_t site);
+
   protected:
     void initFlags(uint32_t fl);
     void addFlags(uint32_t fl);
@@ -185,6 +226,8 @@ class HeapThingWrapper
 //
 class HeapThing
 {
+  friend class Whisper::MinorCollector;
+  friend class Whisper::MajorCollector;
   protected:
     HeapThing();
     ~HeapThing();
@@ -202,10 +245,16 @@ class HeapThing
     void initFlags(uint32_t flags);
     void addFlags(uint32_t flags);
 
-    // Write barrier helper
-    void noteWrite(void *ptr);
-
   public:
+    // Write barrier.  Must be called after a reference to a heap thing
+    // is stored into |ptr|, a location within this thing.  Marks the
+    // card holding |ptr| if this thing is tenured.
+    inline void noteWrite(void *ptr);
+
+    // Write barrier for a bulk store of |size| bytes at |ptr|, such as a
+    // range of values.  Marks every card the range covers at once.
+    inline void noteWrites(void *ptr, uint32_t size);
+
     uint32_t cardNo() const;
 
     HeapType type() const;
@@ -247,6 +296,40 @@ class TypedHeapThing
     inline ~TypedHeapThing() {}
 };
 
+//
+// FreeSpace
+//
+// A span of free memory within a tenured slab, left behind by sweeping.
+// Free spans are formatted as heap things, so that slabs can still be
+// walked thing by thing.
+//
+// Spans large enough to hold a link are chained into the free lists
+// of their slab.  Spans holding only a header are not reusable until
+// they are coalesced by a later sweep.
+//
+class FreeSpace : public HeapThing, public TypedHeapThing<HeapType::FreeSpace>
+{
+  private:
+    FreeSpace *next_;
+
+  public:
+    // The smallest span which can be chained into a free list.
+    static constexpr uint32_t MinListedSpan =
+        HeapThingHeader::HeaderSize + sizeof(FreeSpace *);
+
+    // Format |spanSize| bytes at |mem| as free space.  Returns the
+    // formatted span if it is large enough to be listed, otherwise null.
+    static FreeSpace *Format(uint8_t *mem, uint32_t cardNo, uint32_t spanSize,
+                             FreeSpace *next);
+
+    FreeSpace *next() const;
+    void setNext(FreeSpace *next);
+
+    // The start and size of the span, including the header.
+    uint8_t *spanStart();
+    uint32_t spanSize() const;
+};
+
 // A Value subclass that allows heap things or undefined.
 template <typename T, bool Null=false> class HeapThingValue {};
 
@@ -94,6 +94,24 @@ HeapThing::recastThis() const
     return reinterpret_cast<const PtrT *>(this);
 }
 
+inline void
+HeapThing::noteWrite(void *ptr)
+{
+    const HeapThingHeader *hdr = recastThis<HeapThingHeader>() - 1;
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    if (slab->gen() == Slab::Tenured || slab->gen() == Slab::Frozen)
+        slab->markCardFor(ptr);
+}
+
+inline void
+HeapThing::noteWrites(void *ptr, uint32_t size)
+{
+    const HeapThingHeader *hdr = recastThis<HeapThingHeader>() - 1;
+    Slab *slab = Slab::FromAllocation(hdr, hdr->cardNo());
+    if (slab->gen() == Slab::Tenured || slab->gen() == Slab::Frozen)
+        slab->markCardsFor(ptr, size);
+}
+
 
 } // namespace VM
 } // namespace Whisper
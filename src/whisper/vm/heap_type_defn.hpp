@@ -6,11 +6,20 @@
 #define WHISPER_DEFN_HEAP_TYPES(_)                              \
     /* Name                             Traced */               \
     \
+    _(FreeSpace,                        false)                  \
+    \
     _(HeapDouble,                       false)                  \
     _(LinearString,                     false)                  \
+    _(SourceString,                     false)                  \
     _(Bytecode,                         false)                  \
+    _(DecodedBytecode,                  false)                  \
+    _(TypeFeedback,                     false)                  \
+    _(NativeFunction,                   false)                  \
     \
     _(Tuple,                            true)                   \
+    _(EphemeronTable,                   true)                   \
+    _(ConsString,                       true)                   \
+    _(DependentString,                  true)                   \
     \
     _(ShapeTree,                        true)                   \
     _(ShapeTreeChild,                   true)                   \
@@ -29,8 +38,10 @@
     \
     _(HashObject,                       true)                   \
     _(HashObject_ValueProp,             true)                   \
+    _(HashObject_PackedElements,        false)                  \
     _(HashObjectAccessorProperty,       true)                   \
     _(Global,                           true)                   \
+    _(GlobalCell,                       true)                   \
     \
     _(ConstantPool,                     true)                   \
 
@@ -0,0 +1,30 @@
+
+#include "vm/native_function.hpp"
+#include "vm/heap_thing_inlines.hpp"
+
+namespace Whisper {
+namespace VM {
+
+
+NativeFunction::NativeFunction(NativeFastCall call, void *data)
+  : call_(call),
+    data_(data)
+{
+    WH_ASSERT(call_);
+}
+
+NativeFastCall
+NativeFunction::call() const
+{
+    return call_;
+}
+
+void *
+NativeFunction::data() const
+{
+    return data_;
+}
+
+
+} // namespace VM
+} // namespace Whisper
@@ -0,0 +1,67 @@
+#ifndef WHISPER__VM__NATIVE_FUNCTION_HPP
+#define WHISPER__VM__NATIVE_FUNCTION_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "vm/heap_type_defn.hpp"
+#include "vm/heap_thing.hpp"
+
+namespace Whisper {
+
+class RunContext;
+
+namespace VM {
+
+
+//
+// The fast-call ABI of native functions.  The arguments are passed as
+// raw Values, in place on the caller's operand stack, and the result is
+// stored as a raw Value.  No roots are created for the call.
+//
+// This is safe because collections only happen at safepoints, between
+// ops, and never inside an allocation: nothing moves while the function
+// runs, even if it allocates, so |args| and any values it reads from
+// them stay valid until it returns.  Functions must not run scripts or
+// collect the heap themselves.
+//
+// Strings are passed as they are, and can be read without allocating
+// with StringUnpack, unless they are ropes.  |data| is the pointer the
+// function was created with.  Returns false on error.
+//
+typedef bool (*NativeFastCall)(RunContext *cx, void *data,
+                               const Value *args, uint32_t argc,
+                               Value *result);
+
+//
+// A NativeFunction is a function of the host, which scripts call with
+// the CallNative ops.  It is held in a global (see DefineNativeFunction)
+// and called through a plain function pointer.
+//
+//      +-----------------------+
+//      | Header                |
+//      +-----------------------+
+//      | Call                  |
+//      +-----------------------+
+//      | Data                  |
+//      +-----------------------+
+//
+class NativeFunction : public HeapThing,
+                       public TypedHeapThing<HeapType::NativeFunction>
+{
+  private:
+    NativeFastCall call_;
+    void *data_;
+
+  public:
+    NativeFunction(NativeFastCall call, void *data);
+
+    NativeFastCall call() const;
+    void *data() const;
+};
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__NATIVE_FUNCTION_HPP
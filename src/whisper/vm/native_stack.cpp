@@ -0,0 +1,202 @@
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#include "memalloc.hpp"
+#include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "runtime.hpp"
+#include "runtime_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/script.hpp"
+#include "vm/stack_frame.hpp"
+#include "vm/native_stack.hpp"
+
+namespace Whisper {
+namespace VM {
+
+
+//
+// NativeFrame
+//
+
+NativeFrame::NativeFrame(NativeFrame *callerFrame, Script *script,
+                         uint32_t numPassedArgs, uint32_t numArgs,
+                         uint32_t numLocals, uint32_t maxStackDepth)
+  : callerFrame_(callerFrame),
+    script_(script),
+    pcOffset_(0),
+    numPassedArgs_(numPassedArgs),
+    numArgs_(numArgs),
+    numLocals_(numLocals),
+    maxStackDepth_(maxStackDepth),
+    stackDepth_(0)
+{
+    WH_ASSERT(numArgs_ >= numPassedArgs_);
+
+    // Locals are scanned by the GC, so must start out valid.
+    Value *locals = localStart();
+    std::fill(locals, locals + numLocals_, Value::Undefined());
+}
+
+/*static*/ uint32_t
+NativeFrame::CalculateWords(uint32_t numArgs, uint32_t numLocals,
+                            uint32_t maxStackDepth)
+{
+    return sizeof(NativeFrame) / sizeof(Value) +
+           numArgs + numLocals + maxStackDepth;
+}
+
+
+//
+// NativeStack
+//
+
+NativeStack::NativeStack(uint32_t maxValues)
+  : maxValues_(maxValues),
+    base_(nullptr),
+    top_(nullptr),
+    limit_(nullptr),
+    topFrame_(nullptr)
+{}
+
+NativeStack::~NativeStack()
+{
+    WH_ASSERT(!topFrame_);
+    if (base_)
+        ReleaseMappedMemory(base_, maxValues_ * sizeof(Value));
+}
+
+bool
+NativeStack::reserve()
+{
+    WH_ASSERT(!base_);
+    void *mem = AllocateMappedMemory(maxValues_ * sizeof(Value));
+    if (!mem)
+        return false;
+
+    base_ = reinterpret_cast<Value *>(mem);
+    top_ = base_;
+    limit_ = base_ + maxValues_;
+    return true;
+}
+
+NativeFrame *
+NativeStack::pushFrame(Script *script, uint32_t numPassedArgs,
+                       uint32_t numArgs)
+{
+    if (!base_ && !reserve())
+        return nullptr;
+
+    uint32_t numLocals = script->numLocals();
+    uint32_t maxStackDepth = script->maxStackDepth();
+    uint32_t words = NativeFrame::CalculateWords(numArgs, numLocals,
+                                                 maxStackDepth);
+    if (words > static_cast<uint32_t>(limit_ - top_))
+        return nullptr;
+
+    NativeFrame *frame = new (top_) NativeFrame(topFrame_, script,
+                                                numPassedArgs, numArgs,
+                                                numLocals, maxStackDepth);
+    top_ += words;
+
+    // Signal handlers may walk the stack (see Interp::SamplingProfiler),
+    // so the frame is filled in before it is made the top frame.
+    std::atomic_signal_fence(std::memory_order_release);
+    topFrame_ = frame;
+    return frame;
+}
+
+NativeFrame *
+NativeStack::pushFrame(StackFrame *saved)
+{
+    WH_ASSERT(saved->isScriptFrame());
+    NativeFrame *frame = pushFrame(saved->script(), saved->numPassedArgs(),
+                                   saved->numArgs());
+    if (!frame)
+        return nullptr;
+
+    frame->setPcOffset(saved->pcOffset());
+    for (uint32_t i = 0; i < saved->numArgs(); i++)
+        frame->setArg(i, saved->getArg(i));
+    for (uint32_t i = 0; i < saved->numLocals(); i++)
+        frame->setLocal(i, saved->getLocal(i));
+    for (uint32_t i = 0; i < saved->stackDepth(); i++)
+        frame->pushStack(saved->getStack(i));
+    return frame;
+}
+
+NativeFrame *
+NativeStack::pushCallFrame(Script *callee, uint32_t numPassedArgs,
+                           uint32_t numFormals)
+{
+    NativeFrame *caller = topFrame_;
+    WH_ASSERT(caller);
+    WH_ASSERT(caller->stackDepth() >= FrameHeaderWords + numPassedArgs);
+
+    uint32_t numArgs = std::max(numPassedArgs, numFormals);
+    uint32_t numLocals = callee->numLocals();
+    uint32_t maxStackDepth = callee->maxStackDepth();
+    uint32_t words = NativeFrame::CalculateWords(numArgs, numLocals,
+                                                 maxStackDepth);
+    Value *start = caller->stackStart() + caller->stackDepth() -
+                   (FrameHeaderWords + numPassedArgs);
+    if (words > static_cast<uint32_t>(limit_ - start))
+        return nullptr;
+
+    caller->popStack(FrameHeaderWords + numPassedArgs);
+    NativeFrame *frame = new (start) NativeFrame(caller, callee,
+                                                 numPassedArgs, numArgs,
+                                                 numLocals, maxStackDepth);
+    if (numPassedArgs < numFormals) {
+        Value *args = frame->argStart();
+        std::fill(args + numPassedArgs, args + numArgs, Value::Undefined());
+    }
+
+    // The frame may end below its caller's, whose end is restored when
+    // the frame is popped.
+    top_ = start + words;
+
+    std::atomic_signal_fence(std::memory_order_release);
+    topFrame_ = frame;
+    return frame;
+}
+
+void
+NativeStack::popFrame(NativeFrame *frame)
+{
+    WH_ASSERT(frame == topFrame_);
+    topFrame_ = frame->callerFrame_;
+    top_ = topFrame_ ? topFrame_->end() : base_;
+}
+
+
+StackFrame *
+MaterializeFrame(AllocationContext acx, NativeFrame *frame)
+{
+    StackFrame::Config config;
+    config.numPassedArgs = frame->numPassedArgs();
+    config.numArgs = frame->numArgs();
+    config.numLocals = frame->numLocals();
+    config.maxStackDepth = frame->maxStackDepth();
+
+    uint32_t size = StackFrame::CalculateSize(config);
+    StackFrame *heapFrame = acx.createSized<StackFrame>(size, frame->script(),
+                                                        config);
+    if (!heapFrame)
+        return nullptr;
+
+    heapFrame->setPcOffset(frame->pcOffset());
+    for (uint32_t i = 0; i < frame->numArgs(); i++)
+        heapFrame->setArg(i, frame->getArg(i));
+    for (uint32_t i = 0; i < frame->numLocals(); i++)
+        heapFrame->setLocal(i, frame->getLocal(i));
+    for (uint32_t i = frame->stackDepth(); i > 0; i--)
+        heapFrame->pushStack(frame->peekStack(i - 1));
+    return heapFrame;
+}
+
+
+} // namespace VM
+} // namespace Whisper
@@ -0,0 +1,329 @@
+#ifndef WHISPER__VM__NATIVE_STACK_HPP
+#define WHISPER__VM__NATIVE_STACK_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+
+namespace Whisper {
+
+class AllocationContext;
+
+namespace VM {
+
+class Script;
+class StackFrame;
+
+
+//
+// A NativeFrame is the window of a NativeStack used by one activation
+// of a script.  The header is followed by the frame's values, which
+// are laid out like those of a StackFrame:
+//
+//      +-----------------------+
+//      | CallerFrame           |
+//      | Script                |
+//      | PcOffset              |
+//      | NumPassedArgs         |
+//      | NumArgs               |
+//      | NumLocals             |
+//      | MaxStackDepth         |
+//      | StackDepth            |
+//      +-----------------------+
+//      | ArgVal                |
+//      | ...                   |
+//      +-----------------------+
+//      | LocalVal              |
+//      | ...                   |
+//      +-----------------------+
+//      | StackVal              |
+//      | ...                   |
+//      +-----------------------+
+//
+// Native frames are not heap things.  The GC finds them through their
+// RunContext's NativeStack and treats their values as roots, so values
+// are written without barriers.
+//
+// A call frame is built in place over the top of its caller's stack
+// (see NativeStack::pushCallFrame): its header goes in slots the caller
+// reserved below the arguments it pushed, which become the callee's
+// arguments without being copied.
+//
+class NativeFrame
+{
+  friend class NativeStack;
+  private:
+    NativeFrame *callerFrame_;
+    Script *script_;
+    uint32_t pcOffset_;
+    uint32_t numPassedArgs_;
+    uint32_t numArgs_;
+    uint32_t numLocals_;
+    uint32_t maxStackDepth_;
+    uint32_t stackDepth_;
+
+    NativeFrame(NativeFrame *callerFrame, Script *script,
+                uint32_t numPassedArgs, uint32_t numArgs,
+                uint32_t numLocals, uint32_t maxStackDepth);
+
+  public:
+    // The number of Value-sized words of stack a frame takes up.
+    static uint32_t CalculateWords(uint32_t numArgs, uint32_t numLocals,
+                                   uint32_t maxStackDepth);
+
+    bool hasCallerFrame() const {
+        return callerFrame_ != nullptr;
+    }
+    NativeFrame *callerFrame() const {
+        WH_ASSERT(hasCallerFrame());
+        return callerFrame_;
+    }
+
+    Script *script() const {
+        return script_;
+    }
+    Script **addressOfScript() {
+        return &script_;
+    }
+
+    uint32_t pcOffset() const {
+        return pcOffset_;
+    }
+    void setPcOffset(uint32_t newPcOffset) {
+        pcOffset_ = newPcOffset;
+    }
+
+    uint32_t numPassedArgs() const {
+        return numPassedArgs_;
+    }
+    uint32_t numArgs() const {
+        return numArgs_;
+    }
+    uint32_t numLocals() const {
+        return numLocals_;
+    }
+    uint32_t stackDepth() const {
+        return stackDepth_;
+    }
+    uint32_t maxStackDepth() const {
+        return maxStackDepth_;
+    }
+
+    const Value &getArg(uint32_t idx) const {
+        WH_ASSERT(idx < numArgs_);
+        return argStart()[idx];
+    }
+    void setArg(uint32_t idx, const Value &val) {
+        WH_ASSERT(idx < numArgs_);
+        argStart()[idx] = val;
+    }
+
+    const Value &getLocal(uint32_t idx) const {
+        WH_ASSERT(idx < numLocals_);
+        return localStart()[idx];
+    }
+    void setLocal(uint32_t idx, const Value &val) {
+        WH_ASSERT(idx < numLocals_);
+        localStart()[idx] = val;
+    }
+
+    // Popped values are left in place, as only the live part of the
+    // stack is scanned.
+    void popStack(uint32_t count = 1) {
+        WH_ASSERT(count <= stackDepth_);
+        stackDepth_ -= count;
+    }
+    void pushStack(const Value &val) {
+        WH_ASSERT(stackDepth_ < maxStackDepth_);
+        stackStart()[stackDepth_++] = val;
+    }
+
+    const Value &peekStack(uint32_t offset) const {
+        WH_ASSERT(offset < stackDepth_);
+        return stackStart()[stackDepth_ - (offset + 1)];
+    }
+    void pokeStack(uint32_t offset, const Value &val) {
+        WH_ASSERT(offset < stackDepth_);
+        stackStart()[stackDepth_ - (offset + 1)] = val;
+    }
+
+    // Start the frame over: back at the start of its script, with its
+    // locals undefined and its stack empty.  Arguments are kept.
+    void reset() {
+        pcOffset_ = 0;
+        stackDepth_ = 0;
+        Value *locals = localStart();
+        for (uint32_t i = 0; i < numLocals_; i++)
+            locals[i] = Value::Undefined();
+    }
+
+    // The locals are written in place by optimized code (see
+    // Interp::OptCode).
+    Value *addressOfLocals() {
+        return localStart();
+    }
+
+    // The arguments, locals and live stack values, which are contiguous.
+    Value *valuesStart() {
+        return argStart();
+    }
+    uint32_t numLiveValues() const {
+        return numArgs_ + numLocals_ + stackDepth_;
+    }
+
+  private:
+    Value *end() {
+        return reinterpret_cast<Value *>(this) +
+               CalculateWords(numArgs_, numLocals_, maxStackDepth_);
+    }
+
+    const Value *argStart() const {
+        return reinterpret_cast<const Value *>(this + 1);
+    }
+    Value *argStart() {
+        return reinterpret_cast<Value *>(this + 1);
+    }
+
+    const Value *localStart() const {
+        return argStart() + numArgs_;
+    }
+    Value *localStart() {
+        return argStart() + numArgs_;
+    }
+
+    const Value *stackStart() const {
+        return localStart() + numLocals_;
+    }
+    Value *stackStart() {
+        return localStart() + numLocals_;
+    }
+};
+
+static_assert(sizeof(NativeFrame) % sizeof(Value) == 0,
+              "NativeFrame header must be a whole number of values.");
+
+
+//
+// NativeStack
+//
+// The contiguous stack of values on which a RunContext's frames are
+// pushed.  Pushing and popping a frame moves the top of the stack, and
+// allocates nothing: address space for the whole stack is reserved
+// the first time a frame is pushed, and the system commits its pages
+// as they are touched.
+//
+// A frame which has to outlive its activation, or be inspected as an
+// object, is copied into a heap StackFrame with MaterializeFrame.  The
+// frame of a suspended script is saved this way, and pushed again
+// when the script is resumed.
+//
+class NativeStack
+{
+  public:
+    // The default size of the stack, in values.
+    static constexpr uint32_t DefaultMaxValues = 1 << 20;
+
+    // The number of stack slots a caller reserves below the arguments
+    // of a call, for the header of the callee's frame.
+    static constexpr uint32_t FrameHeaderWords =
+        sizeof(NativeFrame) / sizeof(Value);
+
+  private:
+    uint32_t maxValues_;
+    Value *base_;
+    Value *top_;
+    Value *limit_;
+    NativeFrame *topFrame_;
+
+  public:
+    explicit NativeStack(uint32_t maxValues = DefaultMaxValues);
+    ~NativeStack();
+
+    NativeStack(const NativeStack &other) = delete;
+    NativeStack &operator =(const NativeStack &other) = delete;
+
+    // Push a frame for |script|, with its locals undefined and its
+    // stack empty.  The caller fills in the |numArgs| arguments.
+    // Returns null if the stack could not be reserved, or is full.
+    NativeFrame *pushFrame(Script *script, uint32_t numPassedArgs,
+                           uint32_t numArgs);
+
+    // Push a frame for the script of |saved|, with the pc and values
+    // saved in it by MaterializeFrame.  Returns null if the stack could
+    // not be reserved, or is full.
+    NativeFrame *pushFrame(StackFrame *saved);
+
+    // Push a frame for a call of |callee| by the top frame, whose stack
+    // ends with FrameHeaderWords reserved slots and then the
+    // |numPassedArgs| arguments.  These are popped from the caller, and
+    // the arguments become the callee's in place.  A call passing
+    // exactly |numFormals| arguments needs nothing more; other calls
+    // are adapted, with missing arguments undefined.  Returns null if
+    // the stack is full.
+    NativeFrame *pushCallFrame(Script *callee, uint32_t numPassedArgs,
+                               uint32_t numFormals);
+
+    // Pop |frame|, which must be the top frame.
+    void popFrame(NativeFrame *frame);
+
+    bool hasFrames() const {
+        return topFrame_ != nullptr;
+    }
+    NativeFrame *topFrame() const {
+        return topFrame_;
+    }
+
+    // The number of values in use, including frame headers.
+    uint32_t usedValues() const {
+        return top_ - base_;
+    }
+
+  private:
+    bool reserve();
+};
+
+
+//
+// Copy |frame| into a new heap StackFrame.  The copy has no caller
+// frame.  Returns null if it could not be allocated.
+//
+StackFrame *MaterializeFrame(AllocationContext acx, NativeFrame *frame);
+
+
+//
+// An RAII helper which pushes a frame on construction, and pops it on
+// destruction.  frame() is null if the push failed.
+//
+class NativeFrameHelper
+{
+  private:
+    NativeStack &stack_;
+    NativeFrame *frame_;
+
+  public:
+    NativeFrameHelper(NativeStack &stack, Script *script,
+                      uint32_t numPassedArgs, uint32_t numArgs)
+      : stack_(stack),
+        frame_(stack.pushFrame(script, numPassedArgs, numArgs))
+    {}
+
+    NativeFrameHelper(NativeStack &stack, StackFrame *saved)
+      : stack_(stack),
+        frame_(stack.pushFrame(saved))
+    {}
+
+    ~NativeFrameHelper() {
+        if (frame_)
+            stack_.popFrame(frame_);
+    }
+
+    NativeFrame *frame() const {
+        return frame_;
+    }
+};
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__NATIVE_STACK_HPP
@@ -1,5 +1,7 @@
 
 #include <algorithm>
+#include <cmath>
+#include <string.h>
 
 #include "value_inlines.hpp"
 #include "rooting_inlines.hpp"
@@ -7,6 +9,7 @@
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/string.hpp"
 #include "vm/object.hpp"
+#include "vm/vm_helpers.hpp"
 
 namespace Whisper {
 namespace VM {
@@ -41,43 +44,88 @@ HashObject::PropConfig::setWritable(bool w)
 
 
 
-HashObject::HashObject(Handle<Object *> prototype)
-  : prototype_(prototype),  mappings_(nullptr), entries_(0)
-{}
+HashObject::HashObject(Object *prototype, Shape *emptyShape)
+  : ShapedHeapThing(emptyShape),
+    prototype_(prototype),
+    inheritorShape_(nullptr),
+    dynamicSlots_(nullptr),
+    mappings_(nullptr),
+    elements_(nullptr),
+    entries_(0),
+    deletes_(0),
+    elementsLength_(0),
+    sparseElements_(0)
+{
+    WH_ASSERT(emptyShape && !emptyShape->hasParent());
+    WH_ASSERT(emptyShape->tree()->numFixedSlots() == NumFixedSlots);
+    WH_ASSERT_IF(prototype, emptyShape ==
+                 prototype->toHashObject()->inheritorShape_.get());
+}
 
 bool
-HashObject::initialize(RunContext *cx)
+HashObject::initialize(RunContext *)
 {
-    WH_ASSERT(!mappings_);
+    // Shaped objects need no storage beyond their fixed slots until
+    // they grow.
+    return true;
+}
 
-    Tuple *tup;
-    if (!cx->inHatchery().createTuple(INITIAL_ENTRIES * 2, tup))
-        return false;
+bool
+HashObject::initializeFromTemplate(RunContext *cx, Handle<Shape *> shape,
+                                   uint32_t numSlots)
+{
+    WH_ASSERT(entries_ == 0 && !isDictionary());
+    WH_ASSERT(numSlots > 0 && numSlots <= MaxShapedProperties);
+    WH_ASSERT(shape->toValueShape()->slotIndex() == numSlots - 1);
 
-    mappings_.set(tup, this);
-    if (!mappings_)
+    if (!ensureSlots(cx, numSlots))
         return false;
-
+    setShape(shape);
+    entries_ = numSlots;
     return true;
 }
 
-Handle<Object *>
-HashObject::prototype() const
+/*static*/ Shape *
+HashObject::EmptyShapeFor(RunContext *cx, Handle<Object *> proto)
 {
-    return prototype_;
+    if (!proto)
+        return cx->threadContext()->emptyObjectShape();
+
+    HashObject *protoObj = proto->toHashObject();
+    if (!protoObj->inheritorShape_) {
+        // The tree of the prototype's inheritors is a child of its own,
+        // and shares its epoch bumps.  Shapes of objects live as long as
+        // the thread, so the tree is tenured.
+        AllocationContext acx = cx->inTenured();
+        ShapeTree *parentTree = protoObj->shape()->tree();
+        ShapeTree::Config config;
+        config.numFixedSlots = NumFixedSlots;
+        config.version = 0;
+        ShapeTree *tree = acx.create<ShapeTree>(parentTree, nullptr, config);
+        if (!tree)
+            return nullptr;
+
+        EmptyShape *shape = acx.create<EmptyShape>(tree);
+        if (!shape)
+            return nullptr;
+        tree->setFirstRoot(shape);
+        if (!parentTree->addChildTree(cx, tree))
+            return nullptr;
+        protoObj->inheritorShape_.set(shape, protoObj);
+    }
+    return protoObj->inheritorShape_;
 }
 
-Handle<Tuple *>
-HashObject::mappings() const
+Handle<Object *>
+HashObject::prototype() const
 {
-    return mappings_;
+    return prototype_;
 }
 
-uint32_t
-HashObject::propertyCapacity() const
+bool
+HashObject::isDictionary() const
 {
-    WH_ASSERT(mappings_->size() % 2 == 0);
-    return mappings_->size() / 2;
+    return mappings_.get() != nullptr;
 }
 
 uint32_t
@@ -86,53 +134,949 @@ HashObject::numProperties() const
     return entries_;
 }
 
-void
-HashObject::setPrototype(Handle<Object *> newProto)
+bool
+HashObject::setPrototype(RunContext *cx, Handle<Object *> newProto)
 {
+#if defined(ENABLE_DEBUG)
+    for (Object *proto = newProto; proto;
+         proto = proto->toHashObject()->prototype_.get())
+    {
+        WH_ASSERT(static_cast<HeapThing *>(proto) != this);
+    }
+#endif
+
+    if (newProto.get() == prototype_.get())
+        return true;
+
+    Root<Shape *> emptyShape(cx, EmptyShapeFor(cx, newProto));
+    if (!emptyShape)
+        return false;
+
+    // Inheritors now also depend on the new prototype chain.
+    if (inheritorShape_) {
+        ShapeTree *inheritors = inheritorShape_->tree();
+        if (!emptyShape->tree()->addChildTree(cx, inheritors))
+            return false;
+        inheritors->bumpEpoch();
+    }
+
     prototype_.set(newProto, this);
+    if (isDictionary()) {
+        setShape(emptyShape);
+        return true;
+    }
+    return reshape(cx, emptyShape, Value());
 }
 
 bool
 HashObject::defineValueProperty(RunContext *cx, Handle<Value> keyString,
                                 Handle<Value> val)
 {
-    uint32_t entry = lookupOwnProperty(cx, keyString, /*forAdd=*/true);
-    WH_ASSERT(entry != UINT32_MAX);
+    Root<Value> key(cx);
+    if (!normalizeKey(cx, keyString, &key))
+        return false;
 
-    Handle<Value> entryKey = getEntryKey(entry);
+    if (key->isImmIndexString())
+        return setOwnElement(cx, key->immIndexStringValue(), val);
+    return defineNamedProperty(cx, key, val);
+}
 
-    if (entryKey->isString()) {
-        Handle<Value> entryValue = getEntryValue(entry);
-        WH_ASSERT(entryValue->isHeapThing() &&
-                  entryValue->objectPtr()->isHashObject_ValueProp());
+bool
+HashObject::deleteProperty(RunContext *cx, Handle<Value> keyString)
+{
+    Root<Value> key(cx);
+    if (!normalizeKey(cx, keyString, &key))
+        return false;
+
+    if (key->isImmIndexString())
+        return deleteOwnElement(cx, key->immIndexStringValue());
+    return deleteNamedProperty(cx, key);
+}
+
+uint32_t
+HashObject::lookupOwnSlot(RunContext *cx, Handle<Value> key) const
+{
+    WH_ASSERT(IsNormalizedPropertyId(key) && !key->isImmIndexString());
+    return findSlot(cx, key);
+}
+
+HashObject *
+HashObject::lookupInheritedSlot(RunContext *cx, Handle<Value> key,
+                                uint32_t *slotOut) const
+{
+    WH_ASSERT(IsNormalizedPropertyId(key) && !key->isImmIndexString());
+    WH_ASSERT(findSlot(cx, key) == UINT32_MAX);
+
+    if (!prototype_)
+        return nullptr;
+
+    // Dictionary objects share the empty shape, which does not tell
+    // which properties they have, so their lookups are not cached.
+    ThreadContext::ProtoLookupEntry *entry = nullptr;
+    if (!isDictionary()) {
+        entry = &cx->threadContext()->protoLookupCacheEntry(shape_, key);
+        if (entry->shape == shape_.get() && entry->name == key.get() &&
+            entry->epoch == shape_->tree()->epoch())
+        {
+            *slotOut = entry->slot;
+            return entry->holder;
+        }
+    }
 
-        entryValue->objectPtr()->toHashObject_ValueProp()->setValue(val);
+    HashObject *holder = prototype_->toHashObject();
+    uint32_t slot = holder->findSlot(cx, key);
+    while (slot == UINT32_MAX && holder->prototype_) {
+        holder = holder->prototype_->toHashObject();
+        slot = holder->findSlot(cx, key);
+    }
+    if (slot == UINT32_MAX)
+        holder = nullptr;
+
+    // Slots of dictionary objects move as their tables grow.
+    if (entry && !(holder && holder->isDictionary())) {
+        entry->shape = shape_;
+        entry->name = key;
+        entry->holder = holder;
+        entry->slot = slot;
+        entry->epoch = shape_->tree()->epoch();
+    }
+
+    *slotOut = slot;
+    return holder;
+}
+
+uint32_t
+HashObject::elementsLength() const
+{
+    return elementsLength_;
+}
+
+HashObject::ElementsKind
+HashObject::elementsKind() const
+{
+    uint32_t fl = flags();
+    if (fl & ElementsNotNumberFlag)
+        return ElementsKind::Generic;
+    if (fl & ElementsNotInt32Flag)
+        return ElementsKind::Double;
+    return ElementsKind::Int32;
+}
+
+bool
+HashObject::getOwnElement(RunContext *cx, uint32_t index,
+                          MutHandle<Value> valOut) const
+{
+    if (hasDenseElement(index))
+        return getDenseElement(cx, index, valOut);
+
+    // Most objects have no sparse elements, so holes need no lookup.
+    uint32_t slot = UINT32_MAX;
+    if (sparseElements_ > 0)
+        slot = findSlot(cx, Value::ImmIndexString(index));
+
+    valOut = (slot == UINT32_MAX) ? Value::Undefined() : slotValue(slot);
+    return true;
+}
+
+bool
+HashObject::setOwnElement(RunContext *cx, uint32_t index, Handle<Value> val)
+{
+    WH_ASSERT(index <= ToUInt32(INT32_MAX));
+
+    if (hasDenseElement(index)) {
+        if (!ensureElementsKindFor(cx, val))
+            return false;
+        setDenseElement(index, val);
         return true;
     }
 
-    WH_ASSERT(getEntryKey(entry)->isUndefined() ||
-              getEntryKey(entry)->isFalse());
+    if (sparseElements_ > 0) {
+        uint32_t slot = findSlot(cx, Value::ImmIndexString(index));
+        if (slot != UINT32_MAX) {
+            setSlotValue(slot, val);
+            return true;
+        }
+    }
+
+    if (!isDenseIndex(index)) {
+        Root<Value> key(cx, Value::ImmIndexString(index));
+        if (!defineNamedProperty(cx, key, val))
+            return false;
+        sparseElements_++;
+        return true;
+    }
+
+    // Packed elements have no holes, so skipping past the end makes
+    // them generic.
+    if (index > elementsLength_ && elementsKind() != ElementsKind::Generic) {
+        if (!convertElements(cx, ElementsKind::Generic))
+            return false;
+    }
+    if (!ensureElementsKindFor(cx, val))
+        return false;
+    if (!ensureElements(cx, index + 1))
+        return false;
+
+    setDenseElement(index, val);
+    if (index >= elementsLength_)
+        elementsLength_ = index + 1;
+    return true;
+}
+
+bool
+HashObject::deleteOwnElement(RunContext *cx, uint32_t index)
+{
+    WH_ASSERT(index <= ToUInt32(INT32_MAX));
+
+    if (hasDenseElement(index)) {
+        // Deleting the last element leaves no hole.
+        if (elementsKind() != ElementsKind::Generic) {
+            if (index == elementsLength_ - 1) {
+                elementsLength_--;
+                return true;
+            }
+            if (!convertElements(cx, ElementsKind::Generic))
+                return false;
+        }
+
+        // Trailing holes are trimmed, so the length stays one past the
+        // highest element.
+        Tuple *elements = genericElements();
+        elements->set(index, Value());
+        while (elementsLength_ > 0 &&
+               IsHole(elements->get(elementsLength_ - 1)))
+        {
+            elementsLength_--;
+        }
+        return true;
+    }
+
+    if (sparseElements_ == 0)
+        return true;
+
+    Root<Value> key(cx, Value::ImmIndexString(index));
+    if (findSlot(cx, key) == UINT32_MAX)
+        return true;
+    if (!deleteNamedProperty(cx, key))
+        return false;
+    sparseElements_--;
+    return true;
+}
 
+bool
+HashObject::initializeElements(RunContext *cx, const int32_t *vals,
+                               uint32_t length)
+{
+    WH_ASSERT(elementsLength_ == 0 && !elements_);
+    WH_ASSERT(elementsKind() == ElementsKind::Int32);
+    if (length == 0)
+        return true;
+    if (length > UINT32_MAX / sizeof(double))
+        return false;
+
+    HashObject_PackedElements *elements =
+        cx->inHatchery().createSized<HashObject_PackedElements>(
+            length * sizeof(int32_t));
+    if (!elements)
+        return false;
+    memcpy(elements->int32s(), vals, length * sizeof(int32_t));
+    elements_.set(elements, this);
+    elementsLength_ = length;
+    return true;
+}
+
+bool
+HashObject::initializeElements(RunContext *cx, const double *vals,
+                               uint32_t length)
+{
+    WH_ASSERT(elementsLength_ == 0 && !elements_);
+    WH_ASSERT(elementsKind() == ElementsKind::Int32);
+    addFlags(ElementsNotInt32Flag);
+    if (length == 0)
+        return true;
+    if (length > UINT32_MAX / sizeof(double))
+        return false;
+
+    HashObject_PackedElements *elements =
+        cx->inHatchery().createSized<HashObject_PackedElements>(
+            length * sizeof(double));
+    if (!elements)
+        return false;
+    memcpy(elements->doubles(), vals, length * sizeof(double));
+    elements_.set(elements, this);
+    elementsLength_ = length;
+    return true;
+}
+
+void
+HashObject::initializeElements(Tuple *values)
+{
+    WH_ASSERT(elementsLength_ == 0 && !elements_);
+    WH_ASSERT(elementsKind() == ElementsKind::Int32);
+    addFlags(ElementsNotInt32Flag | ElementsNotNumberFlag);
+    elements_.set(values, this);
+    elementsLength_ = values->size();
+}
+
+// The int32 |d| holds exactly, if there is one.
+static bool
+ExactInt32(double d, int32_t *result)
+{
+    if (!(d >= INT32_MIN && d <= INT32_MAX))
+        return false;
+    int32_t i = static_cast<int32_t>(d);
+    if (i != d || (i == 0 && std::signbit(d)))
+        return false;
+    *result = i;
+    return true;
+}
+
+bool
+HashObject::readElements(int32_t *vals, uint32_t length) const
+{
+    if (length > elementsLength_)
+        return false;
+
+    switch (elementsKind()) {
+      case ElementsKind::Int32:
+        if (length > 0)
+            memcpy(vals, packedElements()->int32s(), length * sizeof(int32_t));
+        return true;
+      case ElementsKind::Double: {
+        const double *doubles = packedElements()->doubles();
+        for (uint32_t i = 0; i < length; i++) {
+            if (!ExactInt32(doubles[i], &vals[i]))
+                return false;
+        }
+        return true;
+      }
+      case ElementsKind::Generic: {
+        const Tuple *elements = genericElements();
+        for (uint32_t i = 0; i < length; i++) {
+            Value val = elements->get(i);
+            if (!val.isInt32())
+                return false;
+            vals[i] = val.int32Value();
+        }
+        return true;
+      }
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+    return false;
+}
+
+bool
+HashObject::readElements(double *vals, uint32_t length) const
+{
+    if (length > elementsLength_)
+        return false;
+
+    switch (elementsKind()) {
+      case ElementsKind::Int32: {
+        const int32_t *int32s = packedElements()->int32s();
+        for (uint32_t i = 0; i < length; i++)
+            vals[i] = int32s[i];
+        return true;
+      }
+      case ElementsKind::Double:
+        if (length > 0)
+            memcpy(vals, packedElements()->doubles(), length * sizeof(double));
+        return true;
+      case ElementsKind::Generic: {
+        const Tuple *elements = genericElements();
+        for (uint32_t i = 0; i < length; i++) {
+            Value val = elements->get(i);
+            if (!val.isNumber())
+                return false;
+            vals[i] = val.numberValue();
+        }
+        return true;
+      }
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+    return false;
+}
+
+Value
+HashObject::slotValue(uint32_t slot) const
+{
+    if (!isDictionary())
+        return getSlot(slot);
+
+    Handle<Value> entryValue = getEntryValue(slot);
+    WH_ASSERT(entryValue->isHeapThing() &&
+              entryValue->objectPtr()->isHashObject_ValueProp());
+    return entryValue->objectPtr()->toHashObject_ValueProp()->value();
+}
+
+void
+HashObject::setSlotValue(uint32_t slot, const Value &val)
+{
+    if (!isDictionary()) {
+        setSlot(slot, val);
+        return;
+    }
+
+    Handle<Value> entryValue = getEntryValue(slot);
+    WH_ASSERT(entryValue->isHeapThing() &&
+              entryValue->objectPtr()->isHashObject_ValueProp());
+    entryValue->objectPtr()->toHashObject_ValueProp()->setValue(val);
+}
+
+bool
+HashObject::normalizeKey(RunContext *cx, Handle<Value> keyString,
+                         MutHandle<Value> key)
+{
     // Key needs to be interned before being used as a property name,
     // but only if it's not an indexed string.
-    Root<Value> keyval(cx);
     int32_t id;
     if (IsInt32IdString(keyString, &id)) {
-        keyval = Value::ImmIndexString(id);
-    } else {
-        Root<LinearString *> internedKey(cx);
-        if (!cx->stringTable().addString(keyString, &internedKey))
+        key = Value::ImmIndexString(id);
+        return true;
+    }
+
+    Root<LinearString *> internedKey(cx);
+    if (!cx->stringTable().addString(keyString, &internedKey))
+        return false;
+    key = Value::HeapString(internedKey);
+    return true;
+}
+
+
+uint32_t
+HashObject::findSlot(RunContext *cx, const Value &key) const
+{
+    if (!isDictionary()) {
+        const ValueShape *shape = findShapedSlot(cx, key);
+        return shape ? shape->slotIndex() : UINT32_MAX;
+    }
+
+    uint32_t entry = findEntry(cx, key, /*forAdd=*/false);
+    if (entry == UINT32_MAX || !getEntryKey(entry)->isString())
+        return UINT32_MAX;
+    return entry;
+}
+
+bool
+HashObject::defineNamedProperty(RunContext *cx, Handle<Value> key,
+                                Handle<Value> val)
+{
+    if (isDictionary()) {
+        uint32_t numEntries = entries_;
+        if (!addDictionaryProperty(cx, key, val))
             return false;
-        keyval = Value::HeapString(internedKey);
+        if (entries_ != numEntries)
+            invalidateInheritedLookups();
+        return true;
+    }
+
+    if (const ValueShape *shape = findShapedSlot(cx, key)) {
+        setSlot(shape->slotIndex(), val);
+        return true;
+    }
+
+    invalidateInheritedLookups();
+    if (entries_ >= MaxShapedProperties) {
+        if (!makeDictionary(cx))
+            return false;
+        return addDictionaryProperty(cx, key, val);
     }
 
+    return addShapedProperty(cx, key, val);
+}
+
+bool
+HashObject::deleteNamedProperty(RunContext *cx, Handle<Value> key)
+{
+    if (!isDictionary()) {
+        const ValueShape *shape = findShapedSlot(cx, key);
+        if (!shape)
+            return true;
+
+        invalidateInheritedLookups();
+        if (deletes_ < MaxShapedDeletes)
+            return deleteShapedProperty(cx, shape);
+
+        if (!makeDictionary(cx))
+            return false;
+    }
+
+    uint32_t entry = findEntry(cx, key, /*forAdd=*/false);
+    if (entry == UINT32_MAX || !getEntryKey(entry)->isString())
+        return true;
+
+    // Deleted entries are marked with false.
+    invalidateInheritedLookups();
+    setEntryKey(entry, Value::False());
+    setEntryValue(entry, Value::Undefined());
+    entries_--;
+    return true;
+}
+
+void
+HashObject::invalidateInheritedLookups()
+{
+    if (inheritorShape_)
+        inheritorShape_->tree()->bumpEpoch();
+}
+
+
+//
+// Dense elements.
+//
+
+Tuple *
+HashObject::genericElements() const
+{
+    WH_ASSERT(elementsKind() == ElementsKind::Generic);
+    HeapThing *elements = elements_;
+    return elements ? elements->toTuple() : nullptr;
+}
+
+HashObject_PackedElements *
+HashObject::packedElements() const
+{
+    WH_ASSERT(elementsKind() != ElementsKind::Generic);
+    HeapThing *elements = elements_;
+    return elements ? elements->toHashObject_PackedElements() : nullptr;
+}
+
+uint32_t
+HashObject::elementsCapacity() const
+{
+    if (!elements_)
+        return 0;
+
+    switch (elementsKind()) {
+      case ElementsKind::Int32:
+        return packedElements()->int32Capacity();
+      case ElementsKind::Double:
+        return packedElements()->doubleCapacity();
+      case ElementsKind::Generic:
+        return genericElements()->size();
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+    return 0;
+}
+
+bool
+HashObject::isDenseIndex(uint32_t index) const
+{
+    return index < elementsCapacity() ||
+           index < elementsLength_ + MaxElementsGap;
+}
+
+bool
+HashObject::hasDenseElement(uint32_t index) const
+{
+    if (index >= elementsLength_)
+        return false;
+    if (elementsKind() != ElementsKind::Generic)
+        return true;
+    return !IsHole(genericElements()->get(index));
+}
+
+bool
+HashObject::getDenseElement(RunContext *cx, uint32_t index,
+                            MutHandle<Value> valOut) const
+{
+    WH_ASSERT(hasDenseElement(index));
+
+    switch (elementsKind()) {
+      case ElementsKind::Int32:
+        valOut = Value::Int32(packedElements()->int32s()[index]);
+        return true;
+      case ElementsKind::Double: {
+        Value val;
+        if (!cx->inHatchery().createNumber(packedElements()->doubles()[index],
+                                           val))
+        {
+            return false;
+        }
+        valOut = val;
+        return true;
+      }
+      case ElementsKind::Generic:
+        valOut = genericElements()->get(index);
+        return true;
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+    return false;
+}
+
+void
+HashObject::setDenseElement(uint32_t index, const Value &val)
+{
+    WH_ASSERT(index < elementsCapacity());
+
+    switch (elementsKind()) {
+      case ElementsKind::Int32:
+        packedElements()->int32s()[index] = val.int32Value();
+        return;
+      case ElementsKind::Double:
+        packedElements()->doubles()[index] = val.numberValue();
+        return;
+      case ElementsKind::Generic:
+        genericElements()->set(index, val);
+        return;
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+}
+
+bool
+HashObject::ensureElements(RunContext *cx, uint32_t length)
+{
+    uint32_t capacity = elementsCapacity();
+    if (length <= capacity)
+        return true;
+
+    // Grow the elements geometrically.
+    uint32_t newCapacity = std::max(capacity * 2, INITIAL_ELEMENTS);
+    while (newCapacity < length)
+        newCapacity *= 2;
+
+    ElementsKind kind = elementsKind();
+    if (kind != ElementsKind::Generic) {
+        uint32_t elemSize = (kind == ElementsKind::Int32) ? sizeof(int32_t)
+                                                          : sizeof(double);
+        Root<HashObject_PackedElements *> oldElements(cx, packedElements());
+        HashObject_PackedElements *newElements =
+            cx->inHatchery().createSized<HashObject_PackedElements>(
+                newCapacity * elemSize);
+        if (!newElements)
+            return false;
+        if (elementsLength_ > 0) {
+            memcpy(newElements->int32s(), oldElements->int32s(),
+                   elementsLength_ * elemSize);
+        }
+        elements_.set(newElements, this);
+        return true;
+    }
+
+    Root<Tuple *> oldElements(cx, genericElements());
+    Root<Tuple *> newElements(cx);
+    if (!cx->inHatchery().createTuple(newCapacity, newElements))
+        return false;
+    if (elementsLength_ > 0)
+        newElements->copyFrom(0, oldElements.get(), 0, elementsLength_);
+    newElements->fill(elementsLength_, newCapacity - elementsLength_,
+                      Value());
+
+    elements_.set(newElements.get(), this);
+    return true;
+}
+
+bool
+HashObject::ensureElementsKindFor(RunContext *cx, const Value &val)
+{
+    switch (elementsKind()) {
+      case ElementsKind::Int32:
+        if (val.isInt32())
+            return true;
+        return convertElements(cx, val.isNumber() ? ElementsKind::Double
+                                                  : ElementsKind::Generic);
+      case ElementsKind::Double:
+        if (val.isNumber())
+            return true;
+        return convertElements(cx, ElementsKind::Generic);
+      case ElementsKind::Generic:
+        return true;
+    }
+    WH_UNREACHABLE("Bad elements kind.");
+    return false;
+}
+
+bool
+HashObject::convertElements(RunContext *cx, ElementsKind kind)
+{
+    ElementsKind oldKind = elementsKind();
+    WH_ASSERT(kind > oldKind);
+
+    // Elements are converted into storage of the same capacity.
+    uint32_t capacity = elementsCapacity();
+    Root<HashObject_PackedElements *> oldElements(cx, packedElements());
+    HeapThing *newElements = nullptr;
+
+    if (kind == ElementsKind::Double) {
+        WH_ASSERT(oldKind == ElementsKind::Int32);
+        if (capacity > 0) {
+            HashObject_PackedElements *doubles =
+                cx->inHatchery().createSized<HashObject_PackedElements>(
+                    capacity * sizeof(double));
+            if (!doubles)
+                return false;
+            for (uint32_t i = 0; i < elementsLength_; i++)
+                doubles->doubles()[i] = oldElements->int32s()[i];
+            newElements = doubles;
+        }
+        elements_.set(newElements, this);
+        addFlags(ElementsNotInt32Flag);
+        return true;
+    }
+
+    WH_ASSERT(kind == ElementsKind::Generic);
+    if (capacity > 0) {
+        Root<Tuple *> values(cx);
+        if (!cx->inHatchery().createTuple(capacity, values))
+            return false;
+        for (uint32_t i = 0; i < elementsLength_; i++) {
+            Value val;
+            if (oldKind == ElementsKind::Int32) {
+                val = Value::Int32(oldElements->int32s()[i]);
+            } else if (!cx->inHatchery().createNumber(
+                            oldElements->doubles()[i], val))
+            {
+                return false;
+            }
+            values->set(i, val);
+        }
+        values->fill(elementsLength_, capacity - elementsLength_, Value());
+        newElements = values.get();
+    }
+    elements_.set(newElements, this);
+    addFlags(ElementsNotInt32Flag | ElementsNotNumberFlag);
+    return true;
+}
+
+/*static*/ bool
+HashObject::IsHole(const Value &val)
+{
+    return val.raw() == Value::Invalid;
+}
+
+
+//
+// Shaped representation.
+//
+
+uint32_t
+HashObject::numSlotsCapacity() const
+{
+    uint32_t numDynamic = dynamicSlots_ ? dynamicSlots_->size() : 0;
+    return NumFixedSlots + numDynamic;
+}
+
+const ValueShape *
+HashObject::findShapedSlot(RunContext *cx, const Value &key) const
+{
+    WH_ASSERT(!isDictionary());
+
+    Shape *shape = shape_->lookupProperty(cx, key);
+    if (!shape)
+        return nullptr;
+    WH_ASSERT(shape->hasValue() && shape->isWritable());
+    return shape->toValueShape();
+}
+
+bool
+HashObject::addShapedProperty(RunContext *cx, Handle<Value> key,
+                              Handle<Value> val)
+{
+    WH_ASSERT(!isDictionary());
+    WH_ASSERT(!findShapedSlot(cx, key));
+
+    // Slots are dense, so the new property takes the next slot.
+    uint32_t slot = entries_;
+    if (!ensureSlots(cx, slot + 1))
+        return false;
+    if (!addShapeSlot(cx, key, slot))
+        return false;
+
+    setSlot(slot, val);
+    entries_++;
+    return true;
+}
+
+bool
+HashObject::deleteShapedProperty(RunContext *cx, const ValueShape *shape)
+{
+    WH_ASSERT(!isDictionary());
+    deletes_++;
+
+    // Deleting the newest property just moves back to its parent.
+    if (shape == shape_.get()) {
+        setShape(shape_->parent());
+        entries_--;
+        setSlot(entries_, Value::Undefined());
+        return true;
+    }
+
+    // Otherwise, re-add the remaining properties to the empty shape.
+    Root<Value> deletedKey(cx, shape->name());
+    Shape *root = shape_;
+    while (root->hasParent())
+        root = root->parent();
+    return reshape(cx, root, deletedKey);
+}
+
+bool
+HashObject::reshape(RunContext *cx, Shape *root, const Value &deletedKey)
+{
+    WH_ASSERT(!isDictionary() && !root->hasParent());
+
+    VectorRoot<Value> keys(cx);
+    VectorRoot<Value> vals(cx);
+    collectShapedProperties(keys, vals);
+
+    setShape(root);
+    for (uint32_t i = 0; i < entries_; i++)
+        setSlot(i, Value::Undefined());
+    entries_ = 0;
+
+    for (uint32_t i = 0; i < keys.size(); i++) {
+        if (keys[i] == deletedKey)
+            continue;
+        if (!addShapedProperty(cx, keys[i], vals[i]))
+            return false;
+    }
+    return true;
+}
+
+bool
+HashObject::ensureSlots(RunContext *cx, uint32_t numSlots)
+{
+    uint32_t capacity = numSlotsCapacity();
+    if (numSlots <= capacity)
+        return true;
+
+    // Grow the dynamic slots geometrically.
+    uint32_t numDynamic = capacity - NumFixedSlots;
+    uint32_t newDynamic = std::max(numDynamic * 2, INITIAL_DYNAMIC_SLOTS);
+    while (NumFixedSlots + newDynamic < numSlots)
+        newDynamic *= 2;
+
+    Root<Tuple *> oldSlots(cx, dynamicSlots_);
+    Root<Tuple *> newSlots(cx);
+    if (!cx->inHatchery().createTuple(newDynamic, newSlots))
+        return false;
+    if (numDynamic > 0)
+        newSlots->copyFrom(0, oldSlots.get(), 0, numDynamic);
+
+    dynamicSlots_.set(newSlots, this);
+    return true;
+}
+
+Handle<Value>
+HashObject::getSlot(uint32_t slot) const
+{
+    WH_ASSERT(slot < entries_);
+    if (slot < NumFixedSlots)
+        return fixedSlots_[slot];
+    return dynamicSlots_->get(slot - NumFixedSlots);
+}
+
+void
+HashObject::setSlot(uint32_t slot, const Value &val)
+{
+    WH_ASSERT(slot < numSlotsCapacity());
+    if (slot < NumFixedSlots) {
+        fixedSlots_[slot].set(val, this);
+        return;
+    }
+    dynamicSlots_->set(slot - NumFixedSlots, val);
+}
+
+bool
+HashObject::addShapeSlot(RunContext *cx, const Value &key, uint32_t slot)
+{
+    Root<Shape *> parent(cx, shape_);
+    Shape *child = parent->findValueChild(cx, key, slot);
+    if (!child) {
+        // Shapes are kept for the life of the thread, so they are
+        // created tenured.
+        child = cx->inTenured().create<ValueShape>(
+            parent->tree().get(), parent.get(), key, slot,
+            /* isConfigurable = */ true, /* isEnumerable = */ true);
+        if (!child)
+            return false;
+        parent->addChild(cx, child);
+    }
+
+    setShape(child);
+    return true;
+}
+
+void
+HashObject::collectShapedProperties(VectorRoot<Value> &keys,
+                                    VectorRoot<Value> &vals) const
+{
+    WH_ASSERT(!isDictionary());
+
+    // Slots are numbered in add order.
+    for (uint32_t i = 0; i < entries_; i++) {
+        keys.append(Value::Undefined());
+        vals.append(getSlot(i));
+    }
+    for (Shape *shape = shape_; shape->hasParent(); shape = shape->parent())
+        keys[shape->toValueShape()->slotIndex()] = shape->name();
+}
+
+
+//
+// Dictionary representation.
+//
+
+bool
+HashObject::makeDictionary(RunContext *cx)
+{
+    WH_ASSERT(!isDictionary());
+
+    VectorRoot<Value> keys(cx);
+    VectorRoot<Value> vals(cx);
+    collectShapedProperties(keys, vals);
+
+    uint32_t capacity = INITIAL_ENTRIES;
+    while (keys.size() >= capacity * MAX_FILL_RATIO)
+        capacity *= 2;
+
+    Root<Tuple *> mappings(cx);
+    if (!cx->inHatchery().createTuple(capacity * 2, mappings))
+        return false;
+
+    // Drop the slots, and take the empty shape.
+    Shape *root = shape_;
+    while (root->hasParent())
+        root = root->parent();
+    setShape(root);
+    for (uint32_t i = 0; i < NumFixedSlots; i++)
+        fixedSlots_[i].set(Value::Undefined(), this);
+    dynamicSlots_.set(nullptr, this);
+    mappings_.set(mappings, this);
+    entries_ = 0;
+
+    for (uint32_t i = 0; i < keys.size(); i++) {
+        if (!addDictionaryProperty(cx, keys[i], vals[i]))
+            return false;
+    }
+    return true;
+}
+
+bool
+HashObject::addDictionaryProperty(RunContext *cx, Handle<Value> key,
+                                  Handle<Value> val)
+{
+    WH_ASSERT(isDictionary());
+
+    uint32_t entry = findEntry(cx, key, /*forAdd=*/true);
+    WH_ASSERT(entry != UINT32_MAX);
+
+    Handle<Value> entryKey = getEntryKey(entry);
+
+    if (entryKey->isString()) {
+        setSlotValue(entry, val);
+        return true;
+    }
+
+    WH_ASSERT(getEntryKey(entry)->isUndefined() ||
+              getEntryKey(entry)->isFalse());
+
     // Otherwise, number of entries is about to grow.  Check to see
     // if mapping should be enlarged.
     if (entries_ >= propertyCapacity() * MAX_FILL_RATIO) {
         if (!enlarge(cx))
             return false;
 
-        entry = lookupOwnProperty(cx, keyString, /*forAdd=*/true);
+        entry = findEntry(cx, key, /*forAdd=*/true);
         WH_ASSERT(entry != UINT32_MAX);
 
         // All deleted entries will have been reset during the enlarge.
@@ -141,41 +1085,37 @@ HashObject::defineValueProperty(RunContext *cx, Handle<Value> keyString,
 
     // Make an property object for the value.
     PropConfig conf;
+    conf.setConfigurable(true).setEnumerable(true).setWritable(true);
     HashObject_ValueProp *valProp =
         cx->inHatchery().create<HashObject_ValueProp>(conf, val);
     if (!valProp)
         return false;
 
-    setEntryKey(entry, keyval);
+    setEntryKey(entry, key);
     setEntryValue(entry, Value::Object(valProp));
+    entries_++;
     return true;
 }
 
 uint32_t
-HashObject::lookupOwnProperty(RunContext *cx, Handle<Value> keyString,
-                              bool forAdd)
+HashObject::propertyCapacity() const
 {
-    Root<Value> key(cx);
-
-    // Normalize key value.
-    int32_t id;
-    if (IsInt32IdString(keyString, &id)) {
-        key = Value::ImmIndexString(id);
-    } else {
-        LinearString *linstr = cx->stringTable().lookupString(keyString);
-        if (!linstr)
-            return false;
-        WH_ASSERT(linstr->isInterned());
-        key = Value::HeapString(linstr);
-    }
+    WH_ASSERT(mappings_->size() % 2 == 0);
+    return mappings_->size() / 2;
+}
 
+uint32_t
+HashObject::findEntry(RunContext *cx, const Value &key, bool forAdd) const
+{
     uint32_t entryCount = propertyCapacity();
+    uint32_t mask = entryCount - 1;
     uint32_t addEntry = UINT32_MAX;
-    uint32_t hash = hashValue(cx, keyString);
+    uint32_t hash = hashValue(cx, key);
 
     WH_ASSERT(mappings_);
+    WH_ASSERT((entryCount & mask) == 0);
     for (uint32_t i = 0; i < entryCount; i++) {
-        uint32_t entry = (hash + i) % entryCount;
+        uint32_t entry = (hash + i) & mask;
         Handle<Value> entryKey = getEntryKey(entry);
 
         if (entryKey->isUndefined()) {
@@ -212,7 +1152,8 @@ HashObject::hashValue(RunContext *cx, const Value &key) const
         return idx ^ cx->threadContext()->spoiler();
     }
 
-    return FNVHashString(cx->threadContext()->spoiler(), key.heapStringPtr());
+    // Interned strings cache their hash.
+    return key.heapStringPtr()->toLinearString()->hash();
 }
 
 /*static*/ uint32_t
@@ -274,7 +1215,7 @@ HashObject::enlarge(RunContext *cx)
         if (!oldKey->isString())
             continue;
 
-        uint32_t entry = lookupOwnProperty(cx, oldKey, /*forAdd=*/true);
+        uint32_t entry = findEntry(cx, oldKey, /*forAdd=*/true);
         WH_ASSERT(entry != UINT32_MAX);
 
         WH_ASSERT(getEntryKey(entry)->isUndefined());
@@ -287,6 +1228,50 @@ HashObject::enlarge(RunContext *cx)
 }
 
 
+//
+// HashObject_PackedElements
+//
+
+HashObject_PackedElements::HashObject_PackedElements()
+{}
+
+uint32_t
+HashObject_PackedElements::int32Capacity() const
+{
+    return objectSize() / sizeof(int32_t);
+}
+
+uint32_t
+HashObject_PackedElements::doubleCapacity() const
+{
+    return objectSize() / sizeof(double);
+}
+
+const int32_t *
+HashObject_PackedElements::int32s() const
+{
+    return recastThis<int32_t>();
+}
+
+int32_t *
+HashObject_PackedElements::int32s()
+{
+    return recastThis<int32_t>();
+}
+
+const double *
+HashObject_PackedElements::doubles() const
+{
+    return recastThis<double>();
+}
+
+double *
+HashObject_PackedElements::doubles()
+{
+    return recastThis<double>();
+}
+
+
 //
 // HashObject_ValueProp
 //
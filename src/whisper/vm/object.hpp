@@ -5,7 +5,9 @@
 #include "debug.hpp"
 #include "value.hpp"
 #include "rooting.hpp"
+#include "ref_scanner.hpp"
 #include "tuple.hpp"
+#include "vm/shape_tree.hpp"
 
 namespace Whisper {
 namespace VM {
@@ -28,12 +30,57 @@ class Object : public HeapThing
 
 
 //
-// A HashObject is a simple native object format which stores its property
-// mappings as a hash table.
+// A HashObject is a simple native object format.  Its properties are
+// kept in one of two representations.
 //
-class HashObject : public HeapThing,
+// Shaped objects, the default, keep property values in slots: the first
+// NumFixedSlots slots are stored inline, and the rest in a dynamic slot
+// tuple which grows as properties are added.  The shape of a shaped
+// object maps its property names to slots: each ValueShape in its
+// lineage names a property and its slot, and slots are numbered densely
+// in the order the properties were added.  Objects built by adding the
+// same properties in the same order share their shapes, so a slot looked
+// up for one object can be reused for every object with the same shape
+// (see PropertyCache).  All shapes descend from the thread's empty
+// object shape (see ThreadContext::emptyObjectShape).
+//
+// Deleting a property re-derives the shape of the remaining properties.
+// Objects which grow past MaxShapedProperties, or see more than
+// MaxShapedDeletes deletes, switch to dictionary mode: their properties
+// move to an open-addressed hash table of names to property boxes, and
+// they take the empty shape, which no cache records, for good.  The
+// table's capacity is a power of two, so probes wrap with a mask.
+//
+// Index properties (those named by ImmIndexStrings) are kept apart from
+// the named properties, in dense elements indexed directly by the
+// property's index, so that array-like objects are neither hashed nor
+// shaped.  An index which would leave the elements more than
+// MaxElementsGap past their length is sparse, and is kept with the
+// named properties instead, under its ImmIndexString name.
+//
+// The dense elements have one of three kinds (see ElementsKind).  While
+// every element is an int32, or every element is a number, they are
+// packed unboxed into an array of int32s or doubles, which has no
+// holes.  Otherwise, they are Values in a tuple, where elements past
+// the highest index, and deleted elements, are holes marked with the
+// invalid value.  Storing an element which does not fit the kind, or
+// making a hole in packed elements, moves the object to a more general
+// kind, for good.  The kind is kept in the object's header flags.
+//
+// Objects with a prototype take their shapes from a shape tree of the
+// prototype's, which is created the first time it is needed (see
+// EmptyShapeFor), so that the shape of an object also determines its
+// prototype.  Named properties an object does not have itself are
+// looked up on its prototype chain, and the results are cached by the
+// thread, keyed by the object's shape and the property name (see
+// lookupInheritedSlot).  Adding or deleting a property of a prototype,
+// or giving it a new prototype, bumps the epoch of the tree of its
+// inheritors, which drops their cached lookups.
+//
+class HashObject : public ShapedHeapThing,
                    public TypedHeapThing<HeapType::HashObject>
 {
+  friend class Whisper::RefScanner<HashObject>;
   public:
     struct PropConfig {
         bool configurable;
@@ -47,33 +94,172 @@ class HashObject : public HeapThing,
         PropConfig &setWritable(bool w);
     };
 
+    static constexpr uint32_t NumFixedSlots = 4;
+    static constexpr uint32_t MaxShapedProperties = 64;
+    static constexpr uint32_t MaxShapedDeletes = 8;
+    static constexpr uint32_t MaxElementsGap = 8;
+
+    // Kinds of dense elements, from most to least specialized.
+    enum class ElementsKind : uint8_t
+    {
+        Int32,
+        Double,
+        Generic
+    };
+
   private:
+    static constexpr uint32_t ElementsNotInt32Flag = 0x1;
+    static constexpr uint32_t ElementsNotNumberFlag = 0x2;
+
     Heap<Object *> prototype_;
+    Heap<Shape *> inheritorShape_;
+    Heap<Tuple *> dynamicSlots_;
     Heap<Tuple *> mappings_;
+    Heap<HeapThing *> elements_;
     uint32_t entries_;
+    uint32_t deletes_;
+    uint32_t elementsLength_;
+    uint32_t sparseElements_;
+    Heap<Value> fixedSlots_[NumFixedSlots];
 
     static constexpr uint32_t INITIAL_ENTRIES = 4;
+    static constexpr uint32_t INITIAL_DYNAMIC_SLOTS = 4;
+    static constexpr uint32_t INITIAL_ELEMENTS = 8;
     static constexpr float MAX_FILL_RATIO = 0.75;
 
   public:
-    HashObject(Handle<Object *> prototype);
+    HashObject(Object *prototype, Shape *emptyShape);
     bool initialize(RunContext *cx);
 
+    // Give a new object |shape|, a shape of |numSlots| properties derived
+    // from its empty shape, as object literal templates do.  The slots
+    // are allocated, and are undefined until set.
+    bool initializeFromTemplate(RunContext *cx, Handle<Shape *> shape,
+                                uint32_t numSlots);
+
+    // The empty shape of objects whose prototype is |proto|, which may
+    // be null.  Returns null if the shape could not be allocated.
+    static Shape *EmptyShapeFor(RunContext *cx, Handle<Object *> proto);
+
     Handle<Object *> prototype() const;
-    Handle<Tuple *> mappings() const;
 
-    uint32_t propertyCapacity() const;
+    bool isDictionary() const;
     uint32_t numProperties() const;
 
-    void setPrototype(Handle<Object *> newProto);
+    // Give the object a new prototype, which must not have the object on
+    // its own prototype chain.  The object moves to a shape derived from
+    // the new prototype's empty shape for inheritors.
+    bool setPrototype(RunContext *cx, Handle<Object *> newProto);
 
     bool defineValueProperty(RunContext *cx,
                              Handle<Value> key,
                              Handle<Value> val);
 
+    // Delete the own property |key|, if there is one.
+    bool deleteProperty(RunContext *cx, Handle<Value> key);
+
+    // Find the slot holding the own property |key|, which must be a
+    // normalized property name other than an index string.  Returns
+    // UINT32_MAX if the object has no such property.  The slots of
+    // dictionary objects are table entries, which move as the table
+    // grows, and must not be cached.
+    uint32_t lookupOwnSlot(RunContext *cx, Handle<Value> key) const;
+
+    // Find the prototype holding the property |key|, which the object
+    // does not have itself, and the slot holding it.  Returns null if no
+    // prototype has the property.
+    HashObject *lookupInheritedSlot(RunContext *cx, Handle<Value> key,
+                                    uint32_t *slotOut) const;
+
+    // One past the highest dense element.
+    uint32_t elementsLength() const;
+    ElementsKind elementsKind() const;
+
+    // Get the own element |index|, dense or sparse, or undefined if the
+    // object has no such element.  Packed doubles are boxed, which may
+    // allocate.
+    bool getOwnElement(RunContext *cx, uint32_t index,
+                       MutHandle<Value> valOut) const;
+
+    // Set the own element |index|, defining it if there is none.
+    bool setOwnElement(RunContext *cx, uint32_t index, Handle<Value> val);
+
+    // Delete the own element |index|, if there is one.
+    bool deleteOwnElement(RunContext *cx, uint32_t index);
+
+    // Give an object with no elements the |length| dense elements of
+    // |vals|, packed unboxed with a single copy.
+    bool initializeElements(RunContext *cx, const int32_t *vals,
+                            uint32_t length);
+    bool initializeElements(RunContext *cx, const double *vals,
+                            uint32_t length);
+
+    // Give an object with no elements the values of |values| as generic
+    // dense elements.  The tuple is taken as it is, not copied, so it
+    // must have no holes and must not be used elsewhere.
+    void initializeElements(Tuple *values);
+
+    // Copy the first |length| dense elements into |vals|.  Returns false
+    // if there are fewer, or if any of them is not an int32, or not a
+    // number.  Packed elements of the same kind are copied in one go.
+    bool readElements(int32_t *vals, uint32_t length) const;
+    bool readElements(double *vals, uint32_t length) const;
+
+    // Get and set the value of the property held in |slot|.
+    Value slotValue(uint32_t slot) const;
+    void setSlotValue(uint32_t slot, const Value &val);
+
   private:
-    uint32_t lookupOwnProperty(RunContext *cx, Handle<Value> keyString,
-                               bool forAdd=false);
+    bool normalizeKey(RunContext *cx, Handle<Value> keyString,
+                      MutHandle<Value> key);
+
+    // Named properties, including sparse elements.
+    uint32_t findSlot(RunContext *cx, const Value &key) const;
+    bool defineNamedProperty(RunContext *cx, Handle<Value> key,
+                             Handle<Value> val);
+    bool deleteNamedProperty(RunContext *cx, Handle<Value> key);
+
+    // Drop the cached prototype chain lookups of the objects inheriting
+    // from this one, if any.
+    void invalidateInheritedLookups();
+
+    // Dense elements.
+    Tuple *genericElements() const;
+    HashObject_PackedElements *packedElements() const;
+    uint32_t elementsCapacity() const;
+    bool isDenseIndex(uint32_t index) const;
+    bool hasDenseElement(uint32_t index) const;
+    bool getDenseElement(RunContext *cx, uint32_t index,
+                         MutHandle<Value> valOut) const;
+    void setDenseElement(uint32_t index, const Value &val);
+    bool ensureElements(RunContext *cx, uint32_t length);
+    bool ensureElementsKindFor(RunContext *cx, const Value &val);
+    bool convertElements(RunContext *cx, ElementsKind kind);
+    static bool IsHole(const Value &val);
+
+    // Shaped representation.
+    uint32_t numSlotsCapacity() const;
+    const ValueShape *findShapedSlot(RunContext *cx, const Value &key) const;
+    bool addShapedProperty(RunContext *cx, Handle<Value> key,
+                           Handle<Value> val);
+    bool deleteShapedProperty(RunContext *cx, const ValueShape *shape);
+
+    // Re-add the properties other than |deletedKey| to the empty shape
+    // |root|, so that the slots are dense.
+    bool reshape(RunContext *cx, Shape *root, const Value &deletedKey);
+    bool ensureSlots(RunContext *cx, uint32_t numSlots);
+    Handle<Value> getSlot(uint32_t slot) const;
+    void setSlot(uint32_t slot, const Value &val);
+
+    // Move to the shape adding |key| in |slot| to the current shape.
+    bool addShapeSlot(RunContext *cx, const Value &key, uint32_t slot);
+
+    // Dictionary representation.
+    bool makeDictionary(RunContext *cx);
+    bool addDictionaryProperty(RunContext *cx, Handle<Value> key,
+                               Handle<Value> val);
+    uint32_t propertyCapacity() const;
+    uint32_t findEntry(RunContext *cx, const Value &key, bool forAdd) const;
 
     uint32_t hashValue(RunContext *cx, const Value &key) const;
 
@@ -86,6 +272,34 @@ class HashObject : public HeapThing,
     void setEntryValue(uint32_t entry, const Value &val);
 
     bool enlarge(RunContext *cx);
+
+    // Collect the names and values of the properties of a shaped object,
+    // in the order they were added.
+    void collectShapedProperties(VectorRoot<Value> &keys,
+                                 VectorRoot<Value> &vals) const;
+};
+
+
+//
+// HashObject_PackedElements holds the dense elements of a HashObject
+// whose elements are packed int32s or doubles.  It is untraced, and its
+// capacity depends on the kind of element it is read as.
+//
+class HashObject_PackedElements
+  : public HeapThing,
+    public TypedHeapThing<HeapType::HashObject_PackedElements>
+{
+  public:
+    HashObject_PackedElements();
+
+    uint32_t int32Capacity() const;
+    uint32_t doubleCapacity() const;
+
+    const int32_t *int32s() const;
+    int32_t *int32s();
+
+    const double *doubles() const;
+    double *doubles();
 };
 
 
@@ -96,6 +310,7 @@ class HashObject_ValueProp
   : public HeapThing,
     public TypedHeapThing<HeapType::HashObject_ValueProp>
 {
+  friend class Whisper::RefScanner<HashObject_ValueProp>;
   private:
     static constexpr uint32_t ConfigurableFlag = 0x1;
     static constexpr uint32_t EnumerableFlag = 0x2;
@@ -122,6 +337,35 @@ class HashObject_ValueProp
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::HashObject>
+  : public FieldRefScanner<6 + VM::HashObject::NumFixedSlots>
+{
+  public:
+    inline RefScanner(VM::HashObject &obj) {
+        addField(obj.shape_);
+        addField(obj.prototype_);
+        addField(obj.inheritorShape_);
+        addField(obj.dynamicSlots_);
+        addField(obj.mappings_);
+        addField(obj.elements_);
+        for (uint32_t i = 0; i < VM::HashObject::NumFixedSlots; i++)
+            addField(obj.fixedSlots_[i]);
+    }
+};
+
+template <>
+class RefScanner<VM::HashObject_ValueProp> : public FieldRefScanner<1>
+{
+  public:
+    inline RefScanner(VM::HashObject_ValueProp &prop) {
+        addField(prop.value_);
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__OBJECT_HPP
@@ -0,0 +1,64 @@
+
+#include "spew.hpp"
+#include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/property_cache.hpp"
+
+namespace Whisper {
+namespace VM {
+
+
+/*static*/ void
+PropertyCache::Record(Tuple *caches, uint32_t cacheIndex, Shape *shape,
+                      uint32_t slotIndex)
+{
+    WH_ASSERT(slotIndex <= INT32_MAX);
+
+    uint32_t pos = cacheIndex * CacheSize;
+    for (uint32_t i = 0; i < NumEntries; i++, pos += 2) {
+        if (!caches->get(pos)->isUndefined())
+            continue;
+
+        caches->set(pos, Value::Object(shape));
+        caches->set(pos + 1, Value::Int32(slotIndex));
+        return;
+    }
+
+    SpewInterpOpNote("Property cache %u is megamorphic",
+                     (unsigned) cacheIndex);
+}
+
+/*static*/ uint32_t
+PropertyCache::NumShapes(Tuple *caches, uint32_t cacheIndex)
+{
+    uint32_t pos = cacheIndex * CacheSize;
+    uint32_t numShapes = 0;
+    while (numShapes < NumEntries && !caches->get(pos)->isUndefined()) {
+        numShapes++;
+        pos += 2;
+    }
+    return numShapes;
+}
+
+/*static*/ void
+PropertyCache::RecordTemplate(Tuple *caches, uint32_t cacheIndex,
+                              Shape *shape, uint32_t numSlots)
+{
+    WH_ASSERT(numSlots <= INT32_MAX);
+
+    uint32_t pos = cacheIndex * CacheSize;
+    caches->set(pos, Value::Object(shape));
+    caches->set(pos + 1, Value::Int32(numSlots));
+}
+
+/*static*/ void
+PropertyCache::RecordGlobal(Tuple *caches, uint32_t cacheIndex,
+                            GlobalCell *cell)
+{
+    caches->set(cacheIndex * CacheSize, Value::Object(cell));
+}
+
+
+} // namespace VM
+} // namespace Whisper
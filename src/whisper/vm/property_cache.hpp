@@ -0,0 +1,124 @@
+#ifndef WHISPER__VM__PROPERTY_CACHE_HPP
+#define WHISPER__VM__PROPERTY_CACHE_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "vm/tuple.hpp"
+#include "vm/shape_tree.hpp"
+#include "vm/global.hpp"
+
+namespace Whisper {
+namespace VM {
+
+
+//
+// PropertyCache
+//
+// Inline caches for the property access ops of a script.  Each GetProp
+// and SetProp op names its own cache by index, and all the caches of a
+// script are held in one tuple (see Script::propertyCaches).
+//
+// A cache holds up to NumEntries pairs of (Shape, slot index): objects
+// with the shape hold the op's property in the slot.  A cache with one
+// pair is monomorphic, and one with more is polymorphic.  Once all its
+// pairs are used, a cache is megamorphic: its pairs are kept, and other
+// shapes always take the slow path.  Unused pairs are undefined.
+//
+// Shapes are stored as values, so the caches are traced, and updated
+// when shapes move, like any other tuple.
+//
+// The cache of a templated object literal (see NewObject) holds the
+// literal's template in its first pair instead: the shape of the
+// objects the literal creates, and their number of slots.  The cache of
+// a GetGlobal or SetGlobal op holds the cell of its global in the first
+// value of its first pair.  The cache of a LoopHead op counts the
+// iterations of its loop, as an int32 in the same place.
+//
+class PropertyCache
+{
+  public:
+    static constexpr uint32_t NumEntries = 4;
+    static constexpr uint32_t CacheSize = NumEntries * 2;
+
+    // Look up |shape| in cache |cacheIndex|.  Returns false on a miss.
+    static inline bool Lookup(Tuple *caches, uint32_t cacheIndex,
+                              Shape *shape, uint32_t *slotIndex)
+    {
+        Value shapeVal = Value::Object(shape);
+        uint32_t pos = cacheIndex * CacheSize;
+        for (uint32_t i = 0; i < NumEntries; i++, pos += 2) {
+            Handle<Value> cached = caches->get(pos);
+            if (cached->isUndefined())
+                return false;
+            if (cached == shapeVal) {
+                *slotIndex = ToUInt32(caches->get(pos + 1)->int32Value());
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Record that objects with |shape| hold the property in |slotIndex|.
+    // Does nothing if the cache is megamorphic.
+    static void Record(Tuple *caches, uint32_t cacheIndex, Shape *shape,
+                       uint32_t slotIndex);
+
+    // The number of shapes in cache |cacheIndex|.  A cache holding
+    // NumEntries shapes is megamorphic.
+    static uint32_t NumShapes(Tuple *caches, uint32_t cacheIndex);
+
+    // Look up the template in cache |cacheIndex|.  Returns null if there
+    // is none.
+    static inline Shape *LookupTemplate(Tuple *caches, uint32_t cacheIndex,
+                                        uint32_t *numSlots)
+    {
+        uint32_t pos = cacheIndex * CacheSize;
+        Handle<Value> cached = caches->get(pos);
+        if (cached->isUndefined())
+            return nullptr;
+        *numSlots = ToUInt32(caches->get(pos + 1)->int32Value());
+        return cached->objectPtr()->toShape();
+    }
+
+    // Record the template of cache |cacheIndex|, replacing any other.
+    static void RecordTemplate(Tuple *caches, uint32_t cacheIndex,
+                               Shape *shape, uint32_t numSlots);
+
+    // Look up the global cell in cache |cacheIndex|.  Returns null if
+    // there is none, or if the global has since been deleted.
+    static inline GlobalCell *LookupGlobal(Tuple *caches,
+                                           uint32_t cacheIndex)
+    {
+        Handle<Value> cached = caches->get(cacheIndex * CacheSize);
+        if (cached->isUndefined())
+            return nullptr;
+        GlobalCell *cell = cached->objectPtr()->toGlobalCell();
+        return cell->isDeleted() ? nullptr : cell;
+    }
+
+    // Record the global cell of cache |cacheIndex|, replacing any other.
+    static void RecordGlobal(Tuple *caches, uint32_t cacheIndex,
+                             GlobalCell *cell);
+
+    // Count an iteration of the loop of cache |cacheIndex|.  Returns the
+    // number of iterations so far, which saturates at INT32_MAX.
+    static inline uint32_t NoteLoopIteration(Tuple *caches,
+                                             uint32_t cacheIndex)
+    {
+        uint32_t pos = cacheIndex * CacheSize;
+        Handle<Value> cached = caches->get(pos);
+        int32_t count = cached->isUndefined() ? 0 : cached->int32Value();
+        if (count < INT32_MAX) {
+            count++;
+            caches->set(pos, Value::Int32(count));
+        }
+        return ToUInt32(count);
+    }
+};
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__PROPERTY_CACHE_HPP
@@ -23,7 +23,15 @@ Script::initialize(const Config &config)
 Script::Script(Bytecode *bytecode, Tuple *constants, const Config &config)
   : bytecode_(bytecode),
     constants_(constants),
-    maxStackDepth_(config.maxStackDepth)
+    decoded_(nullptr),
+    propertyCaches_(nullptr),
+    typeFeedback_(nullptr),
+    jitCode_(nullptr),
+    optCode_(nullptr),
+    maxStackDepth_(config.maxStackDepth),
+    numLocals_(config.numLocals),
+    useCount_(0),
+    profileId_(0)
 {
     initialize(config);
 }
@@ -70,12 +78,150 @@ Script::constants() const
     return constants_;
 }
 
+bool
+Script::hasDecoded() const
+{
+    return decoded_.get() != nullptr;
+}
+
+Handle<DecodedBytecode *>
+Script::decoded() const
+{
+    WH_ASSERT(hasDecoded());
+    return decoded_;
+}
+
+void
+Script::setDecoded(DecodedBytecode *decoded)
+{
+    decoded_.set(decoded, this);
+}
+
+bool
+Script::hasPropertyCaches() const
+{
+    return propertyCaches_.get() != nullptr;
+}
+
+Handle<Tuple *>
+Script::propertyCaches() const
+{
+    WH_ASSERT(hasPropertyCaches());
+    return propertyCaches_;
+}
+
+void
+Script::setPropertyCaches(Tuple *caches)
+{
+    WH_ASSERT(!hasPropertyCaches());
+    propertyCaches_.set(caches, this);
+}
+
+bool
+Script::hasTypeFeedback() const
+{
+    return typeFeedback_.get() != nullptr;
+}
+
+Handle<TypeFeedback *>
+Script::typeFeedback() const
+{
+    WH_ASSERT(hasTypeFeedback());
+    return typeFeedback_;
+}
+
+void
+Script::setTypeFeedback(TypeFeedback *feedback)
+{
+    WH_ASSERT(!hasTypeFeedback());
+    typeFeedback_.set(feedback, this);
+}
+
+uint32_t
+Script::noteUse()
+{
+    if (useCount_ < UINT32_MAX)
+        useCount_++;
+    return useCount_;
+}
+
+bool
+Script::hasJitCode() const
+{
+    return jitCode_ != nullptr;
+}
+
+const Interp::JitCode *
+Script::jitCode() const
+{
+    WH_ASSERT(hasJitCode());
+    return jitCode_;
+}
+
+void
+Script::setJitCode(const Interp::JitCode *jitCode)
+{
+    WH_ASSERT(!hasJitCode());
+    jitCode_ = jitCode;
+}
+
+bool
+Script::hasOptCode() const
+{
+    return optCode_ != nullptr;
+}
+
+Interp::OptCode *
+Script::optCode() const
+{
+    WH_ASSERT(hasOptCode());
+    return optCode_;
+}
+
+void
+Script::setOptCode(Interp::OptCode *optCode)
+{
+    WH_ASSERT(!hasOptCode());
+    optCode_ = optCode;
+}
+
+bool
+Script::optDisabled() const
+{
+    return flags() & OptDisabled;
+}
+
+void
+Script::disableOpt()
+{
+    addFlags(OptDisabled);
+}
+
+uint32_t
+Script::profileId() const
+{
+    return profileId_;
+}
+
+void
+Script::setProfileId(uint32_t profileId)
+{
+    WH_ASSERT(profileId_ == 0);
+    profileId_ = profileId;
+}
+
 uint32_t
 Script::maxStackDepth() const
 {
     return maxStackDepth_;
 }
 
+uint32_t
+Script::numLocals() const
+{
+    return numLocals_;
+}
+
 
 } // namespace VM
 } // namespace Whisper
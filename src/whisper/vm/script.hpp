@@ -4,14 +4,22 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "value.hpp"
+#include "ref_scanner.hpp"
 #include "vm/heap_thing.hpp"
 #include "vm/bytecode.hpp"
 #include "vm/tuple.hpp"
+#include "vm/type_feedback.hpp"
 
 #include <limits>
 #include <algorithm>
 
 namespace Whisper {
+
+namespace Interp {
+    class JitCode;
+    class OptCode;
+}
+
 namespace VM {
 
 
@@ -23,14 +31,32 @@ namespace VM {
 // information:
 //  strict - whether the script executes in strict mode.
 //  mode - one of {TopLevel, Function, Eval}
+//  optDisabled - whether the script is no longer optimized.
+//
+// A script may also hold its bytecode pre-decoded for the interpreter
+// (see DecodedBytecode).  Scripts are decoded once, when first
+// interpreted if not before.  The decoding may be dropped when memory is
+// short (see ThreadContext::notifyMemoryPressure), and is then redone
+// when the script next runs.
 //
+// Decoding also creates the inline caches of the script's property
+// access ops (see PropertyCache), if it has any, and the type feedback
+// of its arithmetic and property access ops (see TypeFeedback).
+//
+// Scripts count how many times they are run, and hold their baseline
+// compiled code once they have run often enough (see Interp::JitCode),
+// and their optimized code once one of their loops has run often
+// enough (see Interp::OptCode).  Compiled code is not on the managed
+// heap.
 //
 struct Script : public HeapThing, public TypedHeapThing<HeapType::Script>
 {
+  friend class Whisper::RefScanner<Script>;
   public:
     enum Flags : uint32_t
     {
-        IsStrict    = 0x01
+        IsStrict    = 0x01,
+        OptDisabled = 0x08
     };
 
     enum Mode : uint32_t
@@ -49,16 +75,27 @@ struct Script : public HeapThing, public TypedHeapThing<HeapType::Script>
         bool isStrict;
         Mode mode;
         uint32_t maxStackDepth;
+        uint32_t numLocals;
 
-        Config(bool isStrict, Mode mode, uint32_t maxStackDepth)
-          : isStrict(isStrict), mode(mode), maxStackDepth(maxStackDepth)
+        Config(bool isStrict, Mode mode, uint32_t maxStackDepth,
+               uint32_t numLocals)
+          : isStrict(isStrict), mode(mode), maxStackDepth(maxStackDepth),
+            numLocals(numLocals)
         {}
     };
 
   private:
     Heap<Bytecode *> bytecode_;
     Heap<Tuple *> constants_;
+    Heap<DecodedBytecode *> decoded_;
+    Heap<Tuple *> propertyCaches_;
+    Heap<TypeFeedback *> typeFeedback_;
+    const Interp::JitCode *jitCode_;
+    Interp::OptCode *optCode_;
     uint32_t maxStackDepth_;
+    uint32_t numLocals_;
+    uint32_t useCount_;
+    uint32_t profileId_;
 
     void initialize(const Config &config);
 
@@ -76,11 +113,60 @@ struct Script : public HeapThing, public TypedHeapThing<HeapType::Script>
     Handle<Bytecode *> bytecode() const;
     Handle<Tuple *> constants() const;
 
+    bool hasDecoded() const;
+    Handle<DecodedBytecode *> decoded() const;
+    void setDecoded(DecodedBytecode *decoded);
+
+    bool hasPropertyCaches() const;
+    Handle<Tuple *> propertyCaches() const;
+    void setPropertyCaches(Tuple *caches);
+
+    bool hasTypeFeedback() const;
+    Handle<TypeFeedback *> typeFeedback() const;
+    void setTypeFeedback(TypeFeedback *feedback);
+
+    // Note a run of the script.  Returns the number of runs.
+    uint32_t noteUse();
+
+    bool hasJitCode() const;
+    const Interp::JitCode *jitCode() const;
+    void setJitCode(const Interp::JitCode *jitCode);
+
+    bool hasOptCode() const;
+    Interp::OptCode *optCode() const;
+    void setOptCode(Interp::OptCode *optCode);
+
+    // Scripts whose optimized code bails out too often, or which fail to
+    // optimize, are not optimized again.
+    bool optDisabled() const;
+    void disableOpt();
+
+    // Id given to the script by the op profiler, or 0 if it has none.
+    uint32_t profileId() const;
+    void setProfileId(uint32_t profileId);
+
     uint32_t maxStackDepth() const;
+    uint32_t numLocals() const;
 };
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::Script> : public FieldRefScanner<5>
+{
+  public:
+    inline RefScanner(VM::Script &script) {
+        addField(script.bytecode_);
+        addField(script.constants_);
+        addField(script.decoded_);
+        addField(script.propertyCaches_);
+        addField(script.typeFeedback_);
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__SCRIPT_HPP
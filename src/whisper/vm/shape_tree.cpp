@@ -1,10 +1,13 @@
 
 #include "value_inlines.hpp"
 #include "rooting_inlines.hpp"
+#include "runtime_inlines.hpp"
 #include "vm/shape_tree.hpp"
 #include "vm/shape_tree_inlines.hpp"
 #include "vm/vm_helpers.hpp"
 #include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/tuple.hpp"
 
 namespace Whisper {
 namespace VM {
@@ -19,12 +22,21 @@ ShapeTree::ShapeTree(ShapeTree *parentTree, Shape *firstRoot,
     firstRoot_(firstRoot),
     childTrees_(nullptr),
     numFixedSlots_(config.numFixedSlots),
-    version_(config.version)
+    version_(config.version),
+    epoch_(0)
 {
     WH_ASSERT(config.numFixedSlots < NumFixedSlotsMax);
     WH_ASSERT(config.version < VersionMax);
 }
 
+void
+ShapeTree::setFirstRoot(Shape *root)
+{
+    WH_ASSERT(!firstRoot_);
+    WH_ASSERT(root->tree() == this && !root->hasParent());
+    firstRoot_.set(root, this);
+}
+
 bool
 ShapeTree::hasParentTree() const
 {
@@ -56,6 +68,35 @@ ShapeTree::version() const
     return version_;
 }
 
+bool
+ShapeTree::addChildTree(RunContext *cx, ShapeTree *child)
+{
+    // Trees live as long as the thread, so the links are tenured.
+    ShapeTreeChild *link = cx->inTenured().create<ShapeTreeChild>(
+        childTrees_.get(), child);
+    if (!link)
+        return false;
+    childTrees_.set(link, this);
+    return true;
+}
+
+uint32_t
+ShapeTree::epoch() const
+{
+    return epoch_;
+}
+
+void
+ShapeTree::bumpEpoch()
+{
+    epoch_++;
+    for (ShapeTreeChild *link = childTrees_.get(); link;
+         link = link->next_.get())
+    {
+        link->child_->bumpEpoch();
+    }
+}
+
 //
 // ShapeTreeChild
 //
@@ -141,10 +182,15 @@ Shape::Shape(ShapeTree *tree, Shape *parent, const Value &name,
     parent_(parent),
     name_(name),
     firstChild_(nullptr),
-    nextSibling_(nullptr)
+    nextSibling_(nullptr),
+    childTable_(nullptr),
+    propertyTable_(nullptr),
+    depth_(parent ? parent->depth_ + 1 : 0),
+    numChildren_(0)
 {
     WH_ASSERT(tree);
-    WH_ASSERT(IsNormalizedPropertyId(name));
+    WH_ASSERT_IF(parent, IsNormalizedPropertyId(name));
+    WH_ASSERT_IF(!parent, name.isNull());
     WH_ASSERT_IF(config.hasValue, !config.hasGetter && !config.hasSetter);
     WH_ASSERT_IF(!config.hasValue, !config.isWritable);
     uint32_t flags = 0;
@@ -194,6 +240,12 @@ Shape::name() const
     return name_;
 }
 
+uint32_t
+Shape::depth() const
+{
+    return depth_;
+}
+
 bool
 Shape::hasFirstChild() const
 {
@@ -233,14 +285,152 @@ Shape::nextSibling() const
 }
 
 void
-Shape::addChild(Shape *child)
+Shape::addChild(RunContext *cx, Shape *child)
 {
-    WH_ASSERT(child->nextSibling() == nullptr);
-    WH_ASSERT(child->firstChild() == nullptr);
+    WH_ASSERT(!child->hasNextSibling());
+    WH_ASSERT(!child->hasFirstChild());
     WH_ASSERT(child->parent() == this);
     WH_ASSERT(!child->name()->isNull());
-    child->setNextSibling(firstChild());
+    if (hasFirstChild())
+        child->setNextSibling(firstChild());
     setFirstChild(child);
+    numChildren_++;
+
+    if (numChildren_ <= ChildTableThreshold)
+        return;
+
+    // Keep the child table at most half full.
+    if (childTable_ && numChildren_ * 2 <= childTable_->size()) {
+        InsertIntoTable(cx, childTable_, child);
+        return;
+    }
+
+    // If the table can't be built, the list is searched instead.
+    if (!buildChildTable(cx, numChildren_ * 2))
+        childTable_.set(nullptr, this);
+}
+
+ValueShape *
+Shape::findValueChild(RunContext *cx, const Value &name,
+                      uint32_t slotIndex) const
+{
+    if (childTable_) {
+        // Several children may add the same name, so probe until an
+        // empty entry.
+        uint32_t mask = childTable_->size() - 1;
+        for (uint32_t i = HashName(cx, name) & mask; ; i = (i + 1) & mask) {
+            Handle<Value> entry = childTable_->get(i);
+            if (entry->isUndefined())
+                return nullptr;
+
+            Shape *child = entry->objectPtr()->toShape();
+            if (!(child->name_ == name))
+                continue;
+            if (!child->hasValue() || !child->isWritable())
+                continue;
+
+            ValueShape *valueShape = child->toValueShape();
+            if (valueShape->slotIndex() == slotIndex)
+                return valueShape;
+        }
+    }
+
+    for (Shape *child = firstChild_; child; child = child->nextSibling_) {
+        if (!child->hasValue() || !child->isWritable())
+            continue;
+        if (!(child->name_ == name))
+            continue;
+
+        ValueShape *valueShape = child->toValueShape();
+        if (valueShape->slotIndex() == slotIndex)
+            return valueShape;
+    }
+    return nullptr;
+}
+
+Shape *
+Shape::lookupProperty(RunContext *cx, const Value &name)
+{
+    if (!propertyTable_ && depth_ >= PropertyTableMinDepth)
+        buildPropertyTable(cx);
+
+    if (propertyTable_) {
+        uint32_t mask = propertyTable_->size() - 1;
+        for (uint32_t i = HashName(cx, name) & mask; ; i = (i + 1) & mask) {
+            Handle<Value> entry = propertyTable_->get(i);
+            if (entry->isUndefined())
+                return nullptr;
+
+            Shape *shape = entry->objectPtr()->toShape();
+            if (shape->name_ == name)
+                return shape;
+        }
+    }
+
+    for (Shape *shape = this; shape->hasParent(); shape = shape->parent_) {
+        if (shape->name_ == name)
+            return shape;
+    }
+    return nullptr;
+}
+
+/*static*/ uint32_t
+Shape::HashName(RunContext *cx, const Value &name)
+{
+    WH_ASSERT(IsNormalizedPropertyId(name) || name.isImmIndexString());
+
+    if (name.isImmIndexString())
+        return name.immIndexStringValue() ^ cx->threadContext()->spoiler();
+    return name.heapStringPtr()->toLinearString()->hash();
+}
+
+/*static*/ bool
+Shape::CreateTable(RunContext *cx, uint32_t minEntries, Tuple *&table)
+{
+    // Tables are a power of two in size, and are held by tenured
+    // shapes, so are created tenured too.
+    uint32_t size = 16;
+    while (size < minEntries)
+        size *= 2;
+    return cx->inTenured().createTuple(size, table);
+}
+
+/*static*/ void
+Shape::InsertIntoTable(RunContext *cx, Tuple *table, Shape *shape)
+{
+    uint32_t mask = table->size() - 1;
+    uint32_t i = HashName(cx, shape->name_) & mask;
+    while (!table->get(i)->isUndefined())
+        i = (i + 1) & mask;
+    table->set(i, Value::Object(shape));
+}
+
+bool
+Shape::buildChildTable(RunContext *cx, uint32_t minEntries)
+{
+    Root<Shape *> self(cx, this);
+    Root<Tuple *> table(cx);
+    if (!CreateTable(cx, minEntries, table))
+        return false;
+
+    for (Shape *child = firstChild_; child; child = child->nextSibling_)
+        InsertIntoTable(cx, table, child);
+    childTable_.set(table, this);
+    return true;
+}
+
+bool
+Shape::buildPropertyTable(RunContext *cx)
+{
+    Root<Shape *> self(cx, this);
+    Root<Tuple *> table(cx);
+    if (!CreateTable(cx, depth_ * 2, table))
+        return false;
+
+    for (Shape *shape = this; shape->hasParent(); shape = shape->parent_)
+        InsertIntoTable(cx, table, shape);
+    propertyTable_.set(table, this);
+    return true;
 }
 
 bool
@@ -387,9 +577,17 @@ ValueShape::slotIndex() const
 bool
 ValueShape::isDynamicSlot() const
 {
-    return slotIndex_ < tree_->numFixedSlots();
+    return slotIndex_ >= tree_->numFixedSlots();
 }
 
+//
+// EmptyShape
+//
+
+EmptyShape::EmptyShape(ShapeTree *tree)
+  : Shape(tree, nullptr, Value::Null(), Shape::Config())
+{}
+
 //
 // ConstantShape
 //
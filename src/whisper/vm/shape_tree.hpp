@@ -5,6 +5,7 @@
 #include "debug.hpp"
 #include "value.hpp"
 #include "rooting.hpp"
+#include "ref_scanner.hpp"
 #include "vm/heap_thing.hpp"
 
 #include <type_traits>
@@ -55,6 +56,14 @@
 // the same number of fixed slots.  The ShapeTree object holds this
 // number.
 //
+// Each ShapeTree also holds an epoch, which is bumped whenever the
+// prototype chain of the objects it describes may have changed: when a
+// property is added to or deleted from one of the prototypes, or one of
+// them is given a new prototype.  Lookups through the prototype chain
+// are cached by shape, and only valid in the epoch they were made in
+// (see HashObject::lookupInheritedSlot).  Bumping the epoch of a tree
+// bumps the epochs of its child trees too.
+//
 //                               +---------------+
 //                               |               |
 //                               |   ShapeTree   |
@@ -86,10 +95,12 @@ namespace VM {
 
 class Object;
 class Class;
+class Tuple;
 
 class ShapeTreeChild;
 
 class Shape;
+class EmptyShape;
 class ValueShape;
 class ConstantShape;
 class GetterShape;
@@ -99,6 +110,7 @@ class AccessorShape;
 class ShapeTree : public HeapThing, public TypedHeapThing<HeapType::ShapeTree>
 {
   friend class Shape;
+  friend class Whisper::RefScanner<ShapeTree>;
   public:
     struct Config
     {
@@ -116,6 +128,7 @@ class ShapeTree : public HeapThing, public TypedHeapThing<HeapType::ShapeTree>
 
     uint32_t numFixedSlots_ : 7;
     uint32_t version_ : 25;
+    uint32_t epoch_;
 
     void initialize(const Config &config);
 
@@ -126,9 +139,17 @@ class ShapeTree : public HeapThing, public TypedHeapThing<HeapType::ShapeTree>
     Handle<ShapeTree *> parentTree() const;
 
     Handle<Shape *> firstRoot() const;
+    void setFirstRoot(Shape *root);
 
     uint32_t numFixedSlots() const;
     uint32_t version() const;
+
+    // Link |child| to this tree, so that it shares its epoch bumps.  A
+    // tree may be linked to more than one parent.
+    bool addChildTree(RunContext *cx, ShapeTree *child);
+
+    uint32_t epoch() const;
+    void bumpEpoch();
 };
 
 //
@@ -140,6 +161,7 @@ class ShapeTreeChild : public HeapThing,
 {
   friend class Shape;
   friend class ShapeTree;
+  friend class Whisper::RefScanner<ShapeTreeChild>;
   private:
     Heap<ShapeTreeChild *> next_;
     Heap<ShapeTree *> child_;
@@ -179,9 +201,19 @@ class ShapeTreeChild : public HeapThing,
 //
 // The root shape for a shape tree is always an empty shape.
 //
+// Finding a child in the sibling list, or a property by walking the
+// parent chain, is linear.  Shapes with more than ChildTableThreshold
+// children keep a hash table of them as well (|childTable|), and shapes
+// at least PropertyTableMinDepth deep build a hash table of the
+// properties in their lineage (|propertyTable|) the first time one is
+// looked up.  Both tables are open-addressed tuples of shapes, keyed by
+// property name, and are only caches: the lists remain authoritative, and
+// a table which cannot be allocated is simply not used.
+//
 class Shape : public HeapThing, public TypedHeapThing<HeapType::Shape>
 {
   friend class ShapeTree;
+  friend class Whisper::RefScanner<Shape>;
   public:
     enum Flags : uint32_t
     {
@@ -212,12 +244,19 @@ class Shape : public HeapThing, public TypedHeapThing<HeapType::Shape>
         Config &setIsWritable(bool isWritable);
     };
 
+    static constexpr uint32_t ChildTableThreshold = 8;
+    static constexpr uint32_t PropertyTableMinDepth = 8;
+
   protected:
     Heap<ShapeTree *> tree_;
     Heap<Shape *> parent_;
     Heap<Value> name_;
     Heap<Shape *> firstChild_;
     Heap<Shape *> nextSibling_;
+    Heap<Tuple *> childTable_;
+    Heap<Tuple *> propertyTable_;
+    uint32_t depth_;
+    uint32_t numChildren_;
 
     Shape(ShapeTree *tree, Shape *parent, const Value &name,
           const Config &config);
@@ -231,6 +270,9 @@ class Shape : public HeapThing, public TypedHeapThing<HeapType::Shape>
 
     Handle<Value> name() const;
 
+    // The number of shapes between this one and the root.
+    uint32_t depth() const;
+
     bool hasFirstChild() const;
     Handle<Shape *> maybeFirstChild() const;
     Handle<Shape *> firstChild() const;
@@ -239,7 +281,16 @@ class Shape : public HeapThing, public TypedHeapThing<HeapType::Shape>
     Handle<Shape *> maybeNextSibling() const;
     Handle<Shape *> nextSibling() const;
 
-    void addChild(Shape *child);
+    void addChild(RunContext *cx, Shape *child);
+
+    // Find the child value shape adding |name| in slot |slotIndex|, or
+    // null if there is none.
+    ValueShape *findValueChild(RunContext *cx, const Value &name,
+                               uint32_t slotIndex) const;
+
+    // Find the shape in this shape's lineage which adds |name|, or null
+    // if there is none.
+    Shape *lookupProperty(RunContext *cx, const Value &name);
 
     bool hasValue() const;
     bool hasGetter() const;
@@ -267,6 +318,25 @@ class Shape : public HeapThing, public TypedHeapThing<HeapType::Shape>
     void setNextSibling(Shape *sibling);
 
     void setFirstChild(Shape *child);
+
+  private:
+    static uint32_t HashName(RunContext *cx, const Value &name);
+    static bool CreateTable(RunContext *cx, uint32_t minEntries,
+                            Tuple *&table);
+    static void InsertIntoTable(RunContext *cx, Tuple *table, Shape *shape);
+
+    bool buildChildTable(RunContext *cx, uint32_t minEntries);
+    bool buildPropertyTable(RunContext *cx);
+};
+
+//
+// An EmptyShape is the root shape of a shape tree, describing no
+// properties.  Its name is null.
+//
+class EmptyShape : public Shape
+{
+  public:
+    explicit EmptyShape(ShapeTree *tree);
 };
 
 class ValueShape : public Shape
@@ -287,6 +357,7 @@ class ValueShape : public Shape
 class ConstantShape : public Shape
 {
   friend class ShapeTree;
+  friend class Whisper::RefScanner<Shape>;
   protected:
     Heap<Value> constant_;
 
@@ -301,6 +372,7 @@ class ConstantShape : public Shape
 class GetterShape : public Shape
 {
   friend class ShapeTree;
+  friend class Whisper::RefScanner<Shape>;
   protected:
     Heap<Value> getter_;
 
@@ -315,6 +387,7 @@ class GetterShape : public Shape
 class SetterShape : public Shape
 {
   friend class ShapeTree;
+  friend class Whisper::RefScanner<Shape>;
   protected:
     Heap<Value> setter_;
 
@@ -329,6 +402,7 @@ class SetterShape : public Shape
 class AccessorShape : public Shape
 {
   friend class ShapeTree;
+  friend class Whisper::RefScanner<Shape>;
   protected:
     Heap<Value> getter_;
     Heap<Value> setter_;
@@ -360,6 +434,64 @@ class ShapedHeapThing : public HeapThing
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::ShapeTree> : public FieldRefScanner<3>
+{
+  public:
+    inline RefScanner(VM::ShapeTree &tree) {
+        addField(tree.parentTree_);
+        addField(tree.firstRoot_);
+        addField(tree.childTrees_);
+    }
+};
+
+template <>
+class RefScanner<VM::ShapeTreeChild> : public FieldRefScanner<2>
+{
+  public:
+    inline RefScanner(VM::ShapeTreeChild &child) {
+        addField(child.next_);
+        addField(child.child_);
+    }
+};
+
+// The extra fields of a shape depend on the kind of property it
+// describes, which is recorded in its header flags.
+template <>
+class RefScanner<VM::Shape> : public FieldRefScanner<9>
+{
+  public:
+    inline RefScanner(VM::Shape &shape) {
+        addField(shape.tree_);
+        addField(shape.parent_);
+        addField(shape.name_);
+        addField(shape.firstChild_);
+        addField(shape.nextSibling_);
+        addField(shape.childTable_);
+        addField(shape.propertyTable_);
+
+        uint32_t flags = shape.flags();
+        bool hasGetter = flags & VM::Shape::HasGetter;
+        bool hasSetter = flags & VM::Shape::HasSetter;
+        if (flags & VM::Shape::HasValue) {
+            if (!(flags & VM::Shape::IsWritable))
+                addField(static_cast<VM::ConstantShape &>(shape).constant_);
+        } else if (hasGetter && hasSetter) {
+            VM::AccessorShape &accessor =
+                static_cast<VM::AccessorShape &>(shape);
+            addField(accessor.getter_);
+            addField(accessor.setter_);
+        } else if (hasGetter) {
+            addField(static_cast<VM::GetterShape &>(shape).getter_);
+        } else if (hasSetter) {
+            addField(static_cast<VM::SetterShape &>(shape).setter_);
+        }
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__SHAPE_TREE_HPP
@@ -19,7 +19,7 @@ StackFrame::CalculateSize(const Config &config)
     WH_ASSERT(config.numArgs >= config.numPassedArgs);
 
     uint32_t size = AlignIntUp<uint32_t>(sizeof(StackFrame), sizeof(Value));
-    size += config.numPassedArgs * sizeof(Value);
+    size += config.numArgs * sizeof(Value);
     size += config.numLocals * sizeof(Value);
     size += config.maxStackDepth * sizeof(Value);
     return size;
@@ -35,6 +35,10 @@ StackFrame::StackFrame(Script *script, const Config &config)
     stackDepth_(0)
 {
     WH_ASSERT(config.numPassedArgs == numPassedArgs_);
+
+    // Locals are scanned by the GC, so must start out valid.
+    Value *locals = localStart();
+    std::fill(locals, locals + numLocals_, Value::Undefined());
 }
 
 bool
@@ -135,7 +139,7 @@ StackFrame::getLocal(uint32_t idx) const
 void
 StackFrame::setLocal(uint32_t idx, const Value &val)
 {
-    WH_ASSERT(idx < numArgs());
+    WH_ASSERT(idx < numLocals());
     localRef(idx).set(val, this);
 }
 
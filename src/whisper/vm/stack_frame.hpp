@@ -4,6 +4,7 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "value.hpp"
+#include "ref_scanner.hpp"
 #include "vm/heap_thing.hpp"
 #include "vm/script.hpp"
 
@@ -47,6 +48,7 @@ namespace VM {
 struct StackFrame : public HeapThing,
                     public TypedHeapThing<HeapType::StackFrame>
 {
+  friend class Whisper::RefScanner<StackFrame>;
   public:
     struct Config
     {
@@ -145,6 +147,23 @@ struct StackFrame : public HeapThing,
 
 
 } // namespace VM
+
+
+// Arguments, locals, and the live portion of the stack are laid out
+// contiguously, and are scanned as a single range.
+template <>
+class RefScanner<VM::StackFrame> : public FieldRefScanner<2>
+{
+  public:
+    inline RefScanner(VM::StackFrame &frame) {
+        addField(frame.callerFrame_);
+        addField(frame.callee_);
+        setValueRange(frame.argStart(), frame.numArgs() + frame.numLocals() +
+                                        frame.stackDepth());
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__STACK_FRAME_HPP
@@ -1,11 +1,14 @@
 
 #include "value_inlines.hpp"
 #include "rooting_inlines.hpp"
+#include "runtime_inlines.hpp"
 #include "string_table.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
 
 #include <algorithm>
+#include <vector>
 
 namespace Whisper {
 namespace VM {
@@ -34,7 +37,8 @@ HeapString::toHeapThing()
 bool
 HeapString::isValidString() const
 {
-    return isLinearString();
+    return isLinearString() || isConsString() || isDependentString() ||
+           isSourceString();
 }
 #endif
 
@@ -58,18 +62,88 @@ HeapString::toLinearString()
     return reinterpret_cast<LinearString *>(this);
 }
 
+bool
+HeapString::isConsString() const
+{
+    return toHeapThing()->type() == HeapType::ConsString;
+}
+
+const ConsString *
+HeapString::toConsString() const
+{
+    WH_ASSERT(isConsString());
+    return reinterpret_cast<const ConsString *>(this);
+}
+
+ConsString *
+HeapString::toConsString()
+{
+    WH_ASSERT(isConsString());
+    return reinterpret_cast<ConsString *>(this);
+}
+
+bool
+HeapString::isDependentString() const
+{
+    return toHeapThing()->type() == HeapType::DependentString;
+}
+
+const DependentString *
+HeapString::toDependentString() const
+{
+    WH_ASSERT(isDependentString());
+    return reinterpret_cast<const DependentString *>(this);
+}
+
+DependentString *
+HeapString::toDependentString()
+{
+    WH_ASSERT(isDependentString());
+    return reinterpret_cast<DependentString *>(this);
+}
+
+bool
+HeapString::isSourceString() const
+{
+    return toHeapThing()->type() == HeapType::SourceString;
+}
+
+const SourceString *
+HeapString::toSourceString() const
+{
+    WH_ASSERT(isSourceString());
+    return reinterpret_cast<const SourceString *>(this);
+}
+
+SourceString *
+HeapString::toSourceString()
+{
+    WH_ASSERT(isSourceString());
+    return reinterpret_cast<SourceString *>(this);
+}
+
 uint32_t
 HeapString::length() const
 {
-    WH_ASSERT(isLinearString());
-    return toLinearString()->length();
+    if (isLinearString())
+        return toLinearString()->length();
+    if (isDependentString())
+        return toDependentString()->length();
+    if (isSourceString())
+        return toSourceString()->length();
+    return toConsString()->length();
 }
 
 uint16_t
 HeapString::getChar(uint32_t idx) const
 {
-    WH_ASSERT(isLinearString());
-    return toLinearString()->getChar(idx);
+    if (isLinearString())
+        return toLinearString()->getChar(idx);
+    if (isDependentString())
+        return toDependentString()->getChar(idx);
+    if (isSourceString())
+        return toSourceString()->getChar(idx);
+    return toConsString()->getChar(idx);
 }
 
 bool
@@ -95,19 +169,27 @@ HeapString::fitsImmediate() const
 }
 
 uint32_t
-HeapString::extract(uint32_t buflen, uint16_t *buf)
+HeapString::extract(uint32_t buflen, uint16_t *buf) const
 {
     if (isLinearString())
         return toLinearString()->extract(buflen, buf);
-
-    WH_UNREACHABLE("Only linearstrings should exist!");
-    return UINT32_MAX;
+    if (isDependentString())
+        return toDependentString()->extract(buflen, buf);
+    if (isSourceString())
+        return toSourceString()->extract(buflen, buf);
+    return toConsString()->extract(buflen, buf);
 }
 
 //
 // LinearString
 //
 
+/*static*/ uint32_t
+LinearString::AllocSize(uint32_t length, bool interned)
+{
+    return (interned ? InternedHashSize : 0) + (length * 2);
+}
+
 void
 LinearString::initializeFlags(bool interned)
 {
@@ -117,31 +199,45 @@ LinearString::initializeFlags(bool interned)
     initFlags(flags);
 }
 
+uint32_t
+LinearString::dataOffset() const
+{
+    return isInterned() ? InternedHashSize : 0;
+}
+
 uint16_t *
 LinearString::writableData()
 {
-    return recastThis<uint16_t>();
+    WH_ASSERT(!isExternal());
+    return recastThis<uint16_t>() + (dataOffset() / 2);
 }
 
-LinearString::LinearString(const HeapString *str, bool interned)
+const LinearString::ExternalChars &
+LinearString::externalChars() const
 {
-    WH_ASSERT(length() == str->length());
-
-    initializeFlags(interned);
+    WH_ASSERT(isExternal());
+    return *recastThis<ExternalChars>();
+}
 
-    // Only LinearString possible for now.
-    WH_ASSERT(str->isLinearString());
-    const LinearString *linStr = str->toLinearString();
+LinearString::ExternalChars &
+LinearString::externalChars()
+{
+    WH_ASSERT(isExternal());
+    return *recastThis<ExternalChars>();
+}
 
-    const uint16_t *data = linStr->data();
-    std::copy(data, data + length(), writableData());
+LinearString::LinearString(const HeapString *str, bool interned)
+{
+    initializeFlags(interned);
 
+    WH_ASSERT(length() == str->length());
+    str->extract(length(), writableData());
 }
 
 LinearString::LinearString(const uint8_t *data, bool interned)
 {
     initializeFlags(interned);
-    std::copy(data, data + length(), writableData());
+    WidenChars(data, length(), writableData());
 }
 
 LinearString::LinearString(const uint16_t *data, bool interned)
@@ -150,10 +246,19 @@ LinearString::LinearString(const uint16_t *data, bool interned)
     std::copy(data, data + length(), writableData());
 }
 
+LinearString::LinearString(const ExternalChars &ext, bool interned)
+{
+    WH_ASSERT(objectSize() == sizeof(ExternalChars));
+    initFlags((interned ? InternedFlagMask : 0) | ExternalFlagMask);
+    externalChars() = ext;
+}
+
 const uint16_t *
 LinearString::data() const
 {
-    return recastThis<uint16_t>();
+    if (isExternal())
+        return externalChars().chars;
+    return recastThis<uint16_t>() + (dataOffset() / 2);
 }
 
 bool
@@ -162,11 +267,40 @@ LinearString::isInterned() const
     return flags() & InternedFlagMask;
 }
 
+bool
+LinearString::isExternal() const
+{
+    return flags() & ExternalFlagMask;
+}
+
+uint32_t
+LinearString::hash() const
+{
+    WH_ASSERT(isInterned());
+    if (isExternal())
+        return externalChars().hash;
+    return *recastThis<uint32_t>();
+}
+
+void
+LinearString::initHash(uint32_t hash)
+{
+    WH_ASSERT(isInterned());
+    if (isExternal())
+        externalChars().hash = hash;
+    else
+        *recastThis<uint32_t>() = hash;
+}
+
 uint32_t
 LinearString::length() const
 {
-    WH_ASSERT(objectSize() % 2 == 0);
-    return objectSize() / 2;
+    if (isExternal())
+        return externalChars().length;
+
+    uint32_t size = objectSize() - dataOffset();
+    WH_ASSERT(size % 2 == 0);
+    return size / 2;
 }
 
 uint16_t
@@ -177,7 +311,7 @@ LinearString::getChar(uint32_t idx) const
 }
 
 uint32_t
-LinearString::extract(uint32_t buflen, uint16_t *buf)
+LinearString::extract(uint32_t buflen, uint16_t *buf) const
 {
     uint32_t len = length();
     if (len > buflen)
@@ -188,6 +322,202 @@ LinearString::extract(uint32_t buflen, uint16_t *buf)
     return len;
 }
 
+//
+// ConsString
+//
+
+ConsString::ConsString(HeapString *left, HeapString *right)
+  : left_(left),
+    right_(right),
+    length_(left->length() + right->length())
+{
+    WH_ASSERT(left->length() > 0 && right->length() > 0);
+}
+
+uint32_t
+ConsString::length() const
+{
+    return length_;
+}
+
+bool
+ConsString::isFlat() const
+{
+    return !right_;
+}
+
+Handle<HeapString *>
+ConsString::left() const
+{
+    WH_ASSERT(!isFlat());
+    return left_;
+}
+
+Handle<HeapString *>
+ConsString::right() const
+{
+    WH_ASSERT(!isFlat());
+    return right_;
+}
+
+LinearString *
+ConsString::flatString() const
+{
+    WH_ASSERT(isFlat());
+    return left_->toLinearString();
+}
+
+void
+ConsString::setFlatString(LinearString *flat)
+{
+    WH_ASSERT(!isFlat());
+    WH_ASSERT(flat->length() == length_);
+    left_.set(flat, this);
+    right_.set(nullptr, this);
+}
+
+uint16_t
+ConsString::getChar(uint32_t idx) const
+{
+    WH_ASSERT(idx < length_);
+
+    // Walk down to the leaf holding the char.
+    const HeapString *str = this;
+    while (str->isConsString()) {
+        const ConsString *cons = str->toConsString();
+        if (cons->isFlat())
+            return cons->flatString()->getChar(idx);
+
+        const HeapString *left = cons->left_;
+        uint32_t leftLength = left->length();
+        if (idx < leftLength) {
+            str = left;
+        } else {
+            str = cons->right_;
+            idx -= leftLength;
+        }
+    }
+    return str->getChar(idx);
+}
+
+uint32_t
+ConsString::extract(uint32_t buflen, uint16_t *buf) const
+{
+    uint32_t len = std::min(length_, buflen);
+
+    // Ropes built by repeated concatenation are deep, so walk the
+    // leaves in order with an explicit stack rather than recursing.
+    std::vector<const HeapString *> stack;
+    stack.push_back(this);
+    uint32_t pos = 0;
+    while (pos < len) {
+        WH_ASSERT(!stack.empty());
+        const HeapString *str = stack.back();
+        stack.pop_back();
+
+        if (str->isConsString() && !str->toConsString()->isFlat()) {
+            stack.push_back(str->toConsString()->right_);
+            stack.push_back(str->toConsString()->left_);
+            continue;
+        }
+
+        if (str->isConsString())
+            str = str->toConsString()->flatString();
+        pos += str->extract(len - pos, buf + pos);
+    }
+    return len;
+}
+
+//
+// DependentString
+//
+
+DependentString::DependentString(LinearString *base, uint32_t offset,
+                                 uint32_t length)
+  : base_(base),
+    offset_(offset),
+    length_(length)
+{
+    WH_ASSERT(offset <= base->length());
+    WH_ASSERT(length <= base->length() - offset);
+}
+
+Handle<LinearString *>
+DependentString::base() const
+{
+    return base_;
+}
+
+uint32_t
+DependentString::offset() const
+{
+    return offset_;
+}
+
+uint32_t
+DependentString::length() const
+{
+    return length_;
+}
+
+const uint16_t *
+DependentString::data() const
+{
+    return base_->data() + offset_;
+}
+
+uint16_t
+DependentString::getChar(uint32_t idx) const
+{
+    WH_ASSERT(idx < length_);
+    return data()[idx];
+}
+
+uint32_t
+DependentString::extract(uint32_t buflen, uint16_t *buf) const
+{
+    uint32_t len = std::min(length_, buflen);
+    const uint16_t *d = data();
+    std::copy(d, d + len, buf);
+    return len;
+}
+
+//
+// SourceString
+//
+
+SourceString::SourceString(const uint8_t *chars, uint32_t length)
+  : chars_(chars),
+    length_(length)
+{}
+
+const uint8_t *
+SourceString::chars() const
+{
+    return chars_;
+}
+
+uint32_t
+SourceString::length() const
+{
+    return length_;
+}
+
+uint16_t
+SourceString::getChar(uint32_t idx) const
+{
+    WH_ASSERT(idx < length_);
+    return chars_[idx];
+}
+
+uint32_t
+SourceString::extract(uint32_t buflen, uint16_t *buf) const
+{
+    uint32_t len = std::min(length_, buflen);
+    WidenChars(chars_, len, buf);
+    return len;
+}
+
 //
 // Helper class to unpack strings.
 //
@@ -204,14 +534,14 @@ StringUnpack::StringUnpack(const Value &val)
     }
 
     if (val.isImmString8()) {
-        length_ = val.readImmIndexString(immData_.str8.data);
+        length_ = val.readImmString8(immData_.str8.data);
         flags_ = IS_LINEAR | IS_EIGHT_BIT;
         charData_ = immData_.str8.data;
         return;
     }
 
     if (val.isImmString16()) {
-        length_ = val.readImmIndexString(immData_.str16.data);
+        length_ = val.readImmString16(immData_.str16.data);
         flags_ = IS_LINEAR;
         charData_ = immData_.str16.data;
         return;
@@ -230,6 +560,9 @@ StringUnpack::StringUnpack(HeapString *heapStr)
 void
 StringUnpack::init(HeapString *heapStr)
 {
+    if (heapStr->isConsString() && heapStr->toConsString()->isFlat())
+        heapStr = heapStr->toConsString()->flatString();
+
     if (heapStr->isLinearString()) {
         flags_ = IS_LINEAR;
         charData_ = heapStr->toLinearString()->data();
@@ -237,6 +570,20 @@ StringUnpack::init(HeapString *heapStr)
         return;
     }
 
+    if (heapStr->isDependentString()) {
+        flags_ = IS_LINEAR;
+        charData_ = heapStr->toDependentString()->data();
+        length_ = heapStr->toDependentString()->length();
+        return;
+    }
+
+    if (heapStr->isSourceString()) {
+        flags_ = IS_LINEAR | IS_EIGHT_BIT;
+        charData_ = heapStr->toSourceString()->chars();
+        length_ = heapStr->toSourceString()->length();
+        return;
+    }
+
     flags_ = 0;
     heapStr_ = heapStr;
     length_ = heapStr->length();
@@ -289,16 +636,38 @@ StringUnpack::heapString() const
 
 //
 // Helper struct that makes an arbitrary HeapString behave like
-// an array of chars.
+// an array of chars.  Linear and dependent strings, and flattened
+// ropes, are read in place, and other ropes are copied out once rather
+// than walked for every char.
 //
 
 struct StrWrap
 {
-    const HeapString *str;
-    StrWrap(const HeapString *str) : str(str) {}
+    const uint16_t *data;
+    std::vector<uint16_t> copy;
+
+    StrWrap(const HeapString *str) {
+        if (str->isConsString() && str->toConsString()->isFlat())
+            str = str->toConsString()->flatString();
+
+        if (str->isLinearString()) {
+            data = str->toLinearString()->data();
+            return;
+        }
+
+        if (str->isDependentString()) {
+            data = str->toDependentString()->data();
+            return;
+        }
+
+        copy.resize(str->length());
+        str->extract(copy.size(), copy.data());
+        data = copy.data();
+    }
+    StrWrap(const StrWrap &other) = delete;
 
     uint16_t operator[](uint32_t idx) const {
-        return str->getChar(idx);
+        return data[idx];
     }
 };
 
@@ -311,7 +680,7 @@ static constexpr uint32_t FNV_OFFSET_BASIS = 2166136261UL;
 
 template <typename StrT>
 static inline uint32_t
-FNVHashString(uint32_t spoiler, const StrT &data, uint32_t length)
+FNVHashStringImpl(uint32_t spoiler, const StrT &data, uint32_t length)
 {
     // Start with spoiler.
     uint32_t perturb = spoiler;
@@ -349,7 +718,7 @@ FNVHashString(uint32_t spoiler, const Value &strVal)
     if (strVal.isImmString()) {
         uint16_t buf[Value::ImmStringMaxLength];
         uint32_t length = strVal.readImmString(buf);
-        return FNVHashString(spoiler, buf, length);
+        return FNVHashStringImpl(spoiler, buf, length);
     }
 
     WH_ASSERT(strVal.isHeapString());
@@ -359,49 +728,115 @@ FNVHashString(uint32_t spoiler, const Value &strVal)
 uint32_t
 FNVHashString(uint32_t spoiler, const HeapString *heapStr)
 {
-    return FNVHashString(spoiler, StrWrap(heapStr), heapStr->length());
+    return FNVHashStringImpl(spoiler, StrWrap(heapStr), heapStr->length());
 }
 
 uint32_t
 FNVHashString(uint32_t spoiler, const uint8_t *str, uint32_t length)
 {
-    return FNVHashString(spoiler, str, length);
+    return FNVHashStringImpl(spoiler, str, length);
 }
 
 uint32_t
 FNVHashString(uint32_t spoiler, const uint16_t *str, uint32_t length)
 {
-    return FNVHashString(spoiler, str, length);
+    return FNVHashStringImpl(spoiler, str, length);
+}
+
+static constexpr uint64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+
+static inline uint64_t
+HashMix(uint64_t hash, uint64_t word)
+{
+    return (((hash << 5) | (hash >> 59)) ^ word) * HASH_MULTIPLIER;
+}
+
+template <typename StrT>
+static inline uint32_t
+HashStringImpl(uint32_t spoiler, const StrT &data, uint32_t length)
+{
+    // Start with spoiler and length.
+    uint64_t hash = (static_cast<uint64_t>(spoiler) << 32) ^ length;
+
+    // Mix in four chars at a time.  Chars are widened to 16 bits, so
+    // 8-bit and 16-bit copies of a string hash the same.
+    uint32_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        uint64_t word = static_cast<uint64_t>(data[i]) |
+                        (static_cast<uint64_t>(data[i + 1]) << 16) |
+                        (static_cast<uint64_t>(data[i + 2]) << 32) |
+                        (static_cast<uint64_t>(data[i + 3]) << 48);
+        hash = HashMix(hash, word);
+    }
+
+    uint64_t tail = 0;
+    for (unsigned shift = 0; i < length; i++, shift += 16)
+        tail |= static_cast<uint64_t>(data[i]) << shift;
+    hash = HashMix(hash, tail);
+
+    // The high bits are the best mixed.
+    hash ^= hash >> 29;
+    hash *= HASH_MULTIPLIER;
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+uint32_t
+HashString(uint32_t spoiler, const Value &strVal)
+{
+    WH_ASSERT(strVal.isString());
+
+    if (strVal.isImmString()) {
+        uint16_t buf[Value::ImmStringMaxLength];
+        uint32_t length = strVal.readImmString(buf);
+        return HashStringImpl(spoiler, buf, length);
+    }
+
+    WH_ASSERT(strVal.isHeapString());
+    return HashString(spoiler, strVal.heapStringPtr());
+}
+
+uint32_t
+HashString(uint32_t spoiler, const HeapString *heapStr)
+{
+    if (heapStr->isLinearString()) {
+        const LinearString *linStr = heapStr->toLinearString();
+        return HashStringImpl(spoiler, linStr->data(), linStr->length());
+    }
+    return HashStringImpl(spoiler, StrWrap(heapStr), heapStr->length());
+}
+
+uint32_t
+HashString(uint32_t spoiler, const uint8_t *str, uint32_t length)
+{
+    return HashStringImpl(spoiler, str, length);
+}
+
+uint32_t
+HashString(uint32_t spoiler, const uint16_t *str, uint32_t length)
+{
+    return HashStringImpl(spoiler, str, length);
 }
 
 //
 // String comparison.
 //
 
-template <typename StrT1, typename StrT2>
+template <typename CharT1, typename CharT2>
 static int
-CompareStringsImpl(const StrT1 &str1, uint32_t len1,
-                   const StrT2 &str2, uint32_t len2)
+CompareStringsImpl(const CharT1 *str1, uint32_t len1,
+                   const CharT2 *str2, uint32_t len2)
 {
-    for (uint32_t i = 0; i < len1; i++) {
-        // Check if str2 is prefix of str1.
-        if (i >= len2)
-            return 1;
-
-        // Check characters.
-        uint16_t ch1 = str1[i];
-        uint16_t ch2 = str2[i];
-        if (ch1 < ch2)
-            return -1;
-        if (ch1 > ch2)
-            return 1;
-    }
+    uint32_t len = std::min(len1, len2);
 
-    // Check if str1 is a prefix of str2
-    if (len2 > len1)
-        return -1;
+    // Check characters.
+    uint32_t i = MismatchChars(str1, str2, len);
+    if (i < len)
+        return (str1[i] < str2[i]) ? -1 : 1;
 
-    return 0;
+    // Check if either string is a prefix of the other.
+    if (len1 == len2)
+        return 0;
+    return (len1 < len2) ? -1 : 1;
 }
 
 int
@@ -450,7 +885,8 @@ int
 CompareStrings(const HeapString *strA,
                const uint8_t *strB, uint32_t lengthB)
 {
-    return CompareStringsImpl(StrWrap(strA), strA->length(), strB, lengthB);
+    return CompareStringsImpl(StrWrap(strA).data, strA->length(),
+                              strB, lengthB);
 }
 
 int
@@ -464,7 +900,8 @@ int
 CompareStrings(const HeapString *strA,
                const uint16_t *strB, uint32_t lengthB)
 {
-    return CompareStringsImpl(StrWrap(strA), strA->length(), strB, lengthB);
+    return CompareStringsImpl(StrWrap(strA).data, strA->length(),
+                              strB, lengthB);
 }
 
 int
@@ -483,7 +920,7 @@ CompareStrings(const Value &strA, const HeapString *strB)
         uint16_t bufA[Value::ImmStringMaxLength];
         uint32_t lengthA = strA.readImmString(bufA);
         return CompareStringsImpl(bufA, lengthA,
-                                  StrWrap(strB), strB->length());
+                                  StrWrap(strB).data, strB->length());
     }
 
     WH_ASSERT(strA.isHeapString());
@@ -515,8 +952,8 @@ CompareStrings(const Value &strA, const Value &strB)
 int
 CompareStrings(const HeapString *strA, const HeapString *strB)
 {
-    return CompareStringsImpl(StrWrap(strA), strA->length(),
-                              StrWrap(strB), strB->length());
+    return CompareStringsImpl(StrWrap(strA).data, strA->length(),
+                              StrWrap(strB).data, strB->length());
 }
 
 int
@@ -559,16 +996,11 @@ IsInt32IdStringImpl(const StrT &str, uint32_t length, int32_t *val)
         return false;
 
     uint16_t firstCh = str[0];
-
-    if (length == 1)
-        return firstCh == '0';
-
-    // Only id that can start with '0' is '0' itself.
-    if (firstCh == '0')
+    if (!isdigit(firstCh))
         return false;
 
-    // Consume first digit (must not be 0)
-    if (!isdigit(firstCh))
+    // Only id that can start with '0' is '0' itself.
+    if (firstCh == '0' && length > 1)
         return false;
 
     // Initialize accumulator, accumulate number.
@@ -592,7 +1024,8 @@ IsInt32IdStringImpl(const StrT &str, uint32_t length, int32_t *val)
         accum += digit;
     }
 
-    *val = accum;
+    if (val)
+        *val = accum;
     return true;
 }
 
@@ -628,7 +1061,8 @@ IsInt32IdString(const Value &strval, int32_t *val)
         int32_t ival = strval.immIndexStringValue();
         if (ival < 0)
             return false;
-        *val = ival;
+        if (val)
+            *val = ival;
         return true;
     }
 
@@ -651,6 +1085,169 @@ IsInt32IdString(const Value &strval, int32_t *val)
 }
 
 
+//
+// Concatenation and flattening.
+//
+
+// Get a string value as a heap string, copying immediate strings into
+// new linear strings.
+static bool
+ToHeapString(RunContext *cx, Handle<Value> strval,
+             MutHandle<HeapString *> result)
+{
+    if (strval->isHeapString()) {
+        result = strval->heapStringPtr();
+        return true;
+    }
+
+    uint16_t buf[Value::ImmStringMaxLength];
+    uint32_t length = strval->readImmString(buf);
+    result = cx->inHatchery().createSized<LinearString>(
+                LinearString::AllocSize(length, /*interned=*/false), buf);
+    return result.get() != nullptr;
+}
+
+static uint32_t
+StringLength(const Value &strval)
+{
+    if (strval.isHeapString())
+        return strval.heapStringPtr()->length();
+
+    uint16_t buf[Value::ImmStringMaxLength];
+    return strval.readImmString(buf);
+}
+
+static uint32_t
+ExtractString(const Value &strval, uint32_t buflen, uint16_t *buf)
+{
+    if (strval.isHeapString())
+        return strval.heapStringPtr()->extract(buflen, buf);
+
+    uint16_t immBuf[Value::ImmStringMaxLength];
+    uint32_t length = std::min(strval.readImmString(immBuf), buflen);
+    std::copy(immBuf, immBuf + length, buf);
+    return length;
+}
+
+bool
+ConcatStrings(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
+              MutHandle<Value> result)
+{
+    WH_ASSERT(lhs->isString() && rhs->isString());
+
+    uint32_t lhsLength = StringLength(lhs);
+    uint32_t rhsLength = StringLength(rhs);
+    if (lhsLength == 0) {
+        result = rhs;
+        return true;
+    }
+    if (rhsLength == 0) {
+        result = lhs;
+        return true;
+    }
+
+    uint32_t length = lhsLength + rhsLength;
+    if (length < lhsLength || length > (UINT32_MAX / 2))
+        return false;
+
+    // Short results are cheaper to copy than to keep as ropes.
+    if (length < ConsString::MinLength) {
+        uint16_t buf[ConsString::MinLength];
+        ExtractString(lhs, lhsLength, buf);
+        ExtractString(rhs, rhsLength, buf + lhsLength);
+        return cx->inHatchery().createString(length, buf, result.get());
+    }
+
+    Root<HeapString *> lhsStr(cx);
+    if (!ToHeapString(cx, lhs, &lhsStr))
+        return false;
+
+    Root<HeapString *> rhsStr(cx);
+    if (!ToHeapString(cx, rhs, &rhsStr))
+        return false;
+
+    Handle<HeapString *> lhsHandle(lhsStr);
+    Handle<HeapString *> rhsHandle(rhsStr);
+    ConsString *cons = cx->inHatchery().create<ConsString>(lhsHandle,
+                                                           rhsHandle);
+    if (!cons)
+        return false;
+
+    result = Value::HeapString(cons);
+    return true;
+}
+
+bool
+Substring(RunContext *cx, Handle<Value> str, uint32_t start,
+          uint32_t length, MutHandle<Value> result)
+{
+    WH_ASSERT(str->isString());
+    WH_ASSERT(start <= StringLength(str));
+    WH_ASSERT(length <= StringLength(str) - start);
+
+    // Short substrings are copied.  Immediate strings are all short.
+    if (length < DependentString::MinLength) {
+        uint16_t buf[DependentString::MinLength];
+        if (str->isHeapString()) {
+            for (uint32_t i = 0; i < length; i++)
+                buf[i] = str->heapStringPtr()->getChar(start + i);
+        } else {
+            uint16_t immBuf[Value::ImmStringMaxLength];
+            str->readImmString(immBuf);
+            std::copy(immBuf + start, immBuf + start + length, buf);
+        }
+        return cx->inHatchery().createString(length, buf, result.get());
+    }
+    WH_ASSERT(str->isHeapString());
+
+    // Slice the linear string holding the chars.
+    Root<HeapString *> heapStr(cx, str->heapStringPtr());
+    if (heapStr->isDependentString()) {
+        start += heapStr->toDependentString()->offset();
+        heapStr = heapStr->toDependentString()->base().get();
+    }
+
+    Root<LinearString *> base(cx);
+    if (!FlattenString(cx, heapStr, &base))
+        return false;
+
+    Handle<LinearString *> baseHandle(base);
+    DependentString *dep = cx->inHatchery().create<DependentString>(
+        baseHandle, start, length);
+    if (!dep)
+        return false;
+
+    result = Value::HeapString(dep);
+    return true;
+}
+
+bool
+FlattenString(RunContext *cx, Handle<HeapString *> str,
+              MutHandle<LinearString *> result)
+{
+    if (str->isLinearString()) {
+        result = str->toLinearString();
+        return true;
+    }
+
+    if (str->isDependentString() || str->isSourceString()) {
+        result = cx->inHatchery().createLinearString(str);
+        return result.get() != nullptr;
+    }
+
+    Root<ConsString *> cons(cx, str->toConsString());
+    if (!cons->isFlat()) {
+        LinearString *flat = cx->inHatchery().createLinearString(str);
+        if (!flat)
+            return false;
+        cons->setFlatString(flat);
+    }
+
+    result = cons->flatString();
+    return true;
+}
+
+
 bool
 NormalizeString(RunContext *cx, const uint8_t *str, uint32_t length,
                 MutHandle<Value> result)
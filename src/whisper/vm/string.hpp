@@ -4,6 +4,7 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "rooting.hpp"
+#include "ref_scanner.hpp"
 #include "vm/heap_type_defn.hpp"
 #include "vm/heap_thing.hpp"
 
@@ -36,9 +37,21 @@ struct HeapString : public HeapThing
     const LinearString *toLinearString() const;
     LinearString *toLinearString();
 
+    bool isConsString() const;
+    const ConsString *toConsString() const;
+    ConsString *toConsString();
+
+    bool isDependentString() const;
+    const DependentString *toDependentString() const;
+    DependentString *toDependentString();
+
+    bool isSourceString() const;
+    const SourceString *toSourceString() const;
+    SourceString *toSourceString();
+
     uint32_t length() const;
     uint16_t getChar(uint32_t idx) const;
-    uint32_t extract(uint32_t buflen, uint16_t *buf);
+    uint32_t extract(uint32_t buflen, uint16_t *buf) const;
 
     bool fitsImmediate() const;
 };
@@ -51,13 +64,24 @@ struct HeapString : public HeapThing
 //      +-----------------------+
 //      | Header                |
 //      +-----------------------+
+//      | Hash (interned only)  |
+//      +-----------------------+
 //      | String Data           |
 //      | ...                   |
 //      | ...                   |
 //      +-----------------------+
 //
+// Interned strings are hashed whenever they are used as a property
+// name, so they keep their hash (seeded with the thread's spoiler, as
+// computed by HashString) in a word before the character data.
+//
+// Long strings keep their characters outside the heap, in a payload
+// owned by the thread (see ExternalDataTable), and hold only a pointer
+// to them, their length and their hash.
+//
 //  Flags
 //      Interned - indicates if string is interned in the string table.
+//      External - indicates if the characters are outside the heap.
 //
 class LinearString : public HeapString,
                      public TypedHeapThing<HeapType::LinearString>
@@ -65,23 +89,150 @@ class LinearString : public HeapString,
   friend class HeapString;
   public:
     static constexpr uint32_t InternedFlagMask = 0x1;
+    static constexpr uint32_t ExternalFlagMask = 0x2;
+    static constexpr uint32_t InternedHashSize = sizeof(uint32_t);
+
+    // The body of an external string.
+    struct ExternalChars
+    {
+        uint16_t *chars;
+        uint32_t length;
+        uint32_t hash;
+    };
+
+    // The size of a linear string of |length| chars, kept in the heap.
+    static uint32_t AllocSize(uint32_t length, bool interned);
 
   private:
     void initializeFlags(bool interned);
+    uint32_t dataOffset() const;
     uint16_t *writableData();
+    const ExternalChars &externalChars() const;
+    ExternalChars &externalChars();
     
   public:
     LinearString(const HeapString *str, bool interned = false);
     LinearString(const uint8_t *data, bool interned = false);
     LinearString(const uint16_t *data, bool interned = false);
+    LinearString(const ExternalChars &ext, bool interned = false);
 
     const uint16_t *data() const;
 
     bool isInterned() const;
+    bool isExternal() const;
+
+    // The cached hash of an interned string.
+    uint32_t hash() const;
+    void initHash(uint32_t hash);
 
     uint32_t length() const;
     uint16_t getChar(uint32_t idx) const;
-    uint32_t extract(uint32_t buflen, uint16_t *buf);
+    uint32_t extract(uint32_t buflen, uint16_t *buf) const;
+};
+
+
+//
+// ConsString is a rope: the concatenation of two strings, whose
+// characters are only copied out when they are needed.  Building a
+// string by repeated concatenation is then linear, not quadratic.
+//
+// Flattening a ConsString (see FlattenString) creates a LinearString
+// holding its characters, and keeps it as the left child, with no right
+// child, so that the rope is flattened at most once and its old
+// children can be collected.
+//
+class ConsString : public HeapString,
+                   public TypedHeapThing<HeapType::ConsString>
+{
+  friend class HeapString;
+  friend class Whisper::RefScanner<ConsString>;
+  public:
+    // Shorter concatenations are copied into linear strings.
+    static constexpr uint32_t MinLength = 24;
+
+  private:
+    Heap<HeapString *> left_;
+    Heap<HeapString *> right_;
+    uint32_t length_;
+
+  public:
+    ConsString(HeapString *left, HeapString *right);
+
+    uint32_t length() const;
+
+    bool isFlat() const;
+    Handle<HeapString *> left() const;
+    Handle<HeapString *> right() const;
+    LinearString *flatString() const;
+    void setFlatString(LinearString *flat);
+
+    uint16_t getChar(uint32_t idx) const;
+    uint32_t extract(uint32_t buflen, uint16_t *buf) const;
+};
+
+
+//
+// DependentString is a slice of a LinearString (its base): it holds no
+// characters of its own, and reads those of its base in place.  Taking
+// a substring then allocates only a small fixed-size object.
+//
+// A slice of a slice refers to the original base, so a dependent
+// string's base is always linear.  A dependent string keeps its whole
+// base alive.
+//
+class DependentString : public HeapString,
+                        public TypedHeapThing<HeapType::DependentString>
+{
+  friend class HeapString;
+  friend class Whisper::RefScanner<DependentString>;
+  public:
+    // Shorter substrings take no more space copied into linear strings.
+    static constexpr uint32_t MinLength = 8;
+
+  private:
+    Heap<LinearString *> base_;
+    uint32_t offset_;
+    uint32_t length_;
+
+  public:
+    DependentString(LinearString *base, uint32_t offset, uint32_t length);
+
+    Handle<LinearString *> base() const;
+    uint32_t offset() const;
+    uint32_t length() const;
+
+    const uint16_t *data() const;
+    uint16_t getChar(uint32_t idx) const;
+    uint32_t extract(uint32_t buflen, uint16_t *buf) const;
+};
+
+
+//
+// SourceString is the value of a plain string literal (see
+// Token::String_Plain): it reads its 8-bit chars in place in the source
+// text of its script.  Its thread holds a reference to the source's
+// data for as long as the string is alive (see ExternalDataTable), so
+// long literals are never copied into the heap.
+//
+class SourceString : public HeapString,
+                     public TypedHeapThing<HeapType::SourceString>
+{
+  friend class HeapString;
+  public:
+    // Shorter literals are copied into linear strings.
+    static constexpr uint32_t MinLength = 64;
+
+  private:
+    const uint8_t *chars_;
+    uint32_t length_;
+
+  public:
+    SourceString(const uint8_t *chars, uint32_t length);
+
+    const uint8_t *chars() const;
+    uint32_t length() const;
+    uint16_t getChar(uint32_t idx) const;
+    uint32_t extract(uint32_t buflen, uint16_t *buf) const;
 };
 
 
@@ -119,6 +270,8 @@ class StringUnpack
     void init(HeapString *heapStr);
 
   public:
+    // Dependent and source strings, and ropes which have been flattened,
+    // unpack as linear strings.
     StringUnpack(const Value &val);
     StringUnpack(HeapString *heapStr);
 
@@ -143,6 +296,14 @@ uint32_t FNVHashString(uint32_t spoiler, const HeapString *heapStr);
 uint32_t FNVHashString(uint32_t spoiler, const uint8_t *str, uint32_t length);
 uint32_t FNVHashString(uint32_t spoiler, const uint16_t *str, uint32_t length);
 
+// HashString mixes in four chars per step, and is the hash used for
+// interned strings and the string table.  Both hashes are seeded with
+// the thread's spoiler, so that tables resist hash flooding.
+uint32_t HashString(uint32_t spoiler, const Value &strVal);
+uint32_t HashString(uint32_t spoiler, const HeapString *heapStr);
+uint32_t HashString(uint32_t spoiler, const uint8_t *str, uint32_t length);
+uint32_t HashString(uint32_t spoiler, const uint16_t *str, uint32_t length);
+
 //
 // String comparison.
 //
@@ -194,6 +355,27 @@ bool IsInt32IdString(HeapString *str, int32_t *val=nullptr);
 bool IsInt32IdString(const Value &strval, int32_t *val=nullptr);
 
 
+//
+// Concatenate two strings.  Long results are ropes (see ConsString).
+//
+bool ConcatStrings(RunContext *cx, Handle<Value> lhs, Handle<Value> rhs,
+                   MutHandle<Value> result);
+
+//
+// Get the |length| chars of a string starting at |start|.  Long
+// results are dependent strings (see DependentString).
+//
+bool Substring(RunContext *cx, Handle<Value> str, uint32_t start,
+               uint32_t length, MutHandle<Value> result);
+
+//
+// Get the characters of a string as a LinearString, flattening it if
+// it is a rope, and copying it if it is a dependent string.
+//
+bool FlattenString(RunContext *cx, Handle<HeapString *> str,
+                   MutHandle<LinearString *> result);
+
+
 //
 // Normalize a string.  Return either an immediate index string, or
 // an interned linear property name string.
@@ -209,6 +391,28 @@ bool NormalizeString(RunContext *cx, Handle<Value> strval,
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::ConsString> : public FieldRefScanner<2>
+{
+  public:
+    inline RefScanner(VM::ConsString &str) {
+        addField(str.left_);
+        addField(str.right_);
+    }
+};
+
+template <>
+class RefScanner<VM::DependentString> : public FieldRefScanner<1>
+{
+  public:
+    inline RefScanner(VM::DependentString &str) {
+        addField(str.base_);
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__STRING_HPP
@@ -0,0 +1,400 @@
+
+#include "spew.hpp"
+#include "vm/string_kernels.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define WHISPER_STRING_KERNELS_X86 1
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define WHISPER_STRING_KERNELS_NEON 1
+# include <arm_neon.h>
+#endif
+
+namespace Whisper {
+namespace VM {
+
+
+//
+// Scalar kernels, which also handle the chars left over at the end
+// of the vector loops.
+//
+
+template <typename CharA, typename CharB>
+static inline uint32_t
+MismatchScalar(const CharA *a, const CharB *b, uint32_t i, uint32_t length)
+{
+    for (; i < length; i++) {
+        if (a[i] != b[i])
+            return i;
+    }
+    return length;
+}
+
+static inline void
+WidenScalar(const uint8_t *src, uint32_t i, uint32_t length, uint16_t *dst)
+{
+    for (; i < length; i++)
+        dst[i] = src[i];
+}
+
+static inline bool
+NarrowScalar(const uint16_t *src, uint32_t i, uint32_t length, uint8_t *dst)
+{
+    for (; i < length; i++) {
+        if (src[i] > 0xFFu)
+            return false;
+        dst[i] = src[i];
+    }
+    return true;
+}
+
+
+#if defined(WHISPER_STRING_KERNELS_X86)
+
+//
+// SSE2 kernels.  SSE2 is part of x86-64, so these are the baseline.
+//
+
+static inline __m128i
+LoadSSE2(const void *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+static uint32_t
+Mismatch8_SSE2(const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint32_t eq = _mm_movemask_epi8(
+                        _mm_cmpeq_epi8(LoadSSE2(a + i), LoadSSE2(b + i)));
+        if (eq != 0xFFFFu)
+            return i + __builtin_ctz(~eq);
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static uint32_t
+Mismatch16_SSE2(const uint16_t *a, const uint16_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint32_t eq = _mm_movemask_epi8(
+                        _mm_cmpeq_epi16(LoadSSE2(a + i), LoadSSE2(b + i)));
+        if (eq != 0xFFFFu)
+            return i + (__builtin_ctz(~eq) / 2);
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static uint32_t
+Mismatch8x16_SSE2(const uint8_t *a, const uint16_t *b, uint32_t length)
+{
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i wideA = _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + i)),
+                zero);
+        uint32_t eq = _mm_movemask_epi8(
+                        _mm_cmpeq_epi16(wideA, LoadSSE2(b + i)));
+        if (eq != 0xFFFFu)
+            return i + (__builtin_ctz(~eq) / 2);
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static void
+Widen_SSE2(const uint8_t *src, uint32_t length, uint16_t *dst)
+{
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i narrow = LoadSSE2(src + i);
+        __m128i *out = reinterpret_cast<__m128i *>(dst + i);
+        _mm_storeu_si128(out, _mm_unpacklo_epi8(narrow, zero));
+        _mm_storeu_si128(out + 1, _mm_unpackhi_epi8(narrow, zero));
+    }
+    WidenScalar(src, i, length, dst);
+}
+
+static bool
+Narrow_SSE2(const uint16_t *src, uint32_t length, uint8_t *dst)
+{
+    __m128i highBytes = _mm_set1_epi16(int16_t(0xFF00));
+    __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m128i wide = LoadSSE2(src + i);
+        __m128i high = _mm_and_si128(wide, highBytes);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF)
+            return false;
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(wide, wide));
+    }
+    return NarrowScalar(src, i, length, dst);
+}
+
+
+//
+// AVX2 kernels, used if the CPU has AVX2.  The chars left over from
+// the 32-byte loops go to the SSE2 kernels.
+//
+
+#define WHISPER_AVX2_ __attribute__((target("avx2")))
+
+WHISPER_AVX2_ static inline __m256i
+LoadAVX2(const void *p)
+{
+    return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+
+WHISPER_AVX2_ static uint32_t
+Mismatch8_AVX2(const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        uint32_t eq = _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi8(LoadAVX2(a + i), LoadAVX2(b + i)));
+        if (eq != 0xFFFFFFFFu)
+            return i + __builtin_ctz(~eq);
+    }
+    return i + Mismatch8_SSE2(a + i, b + i, length - i);
+}
+
+WHISPER_AVX2_ static uint32_t
+Mismatch16_AVX2(const uint16_t *a, const uint16_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint32_t eq = _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi16(LoadAVX2(a + i), LoadAVX2(b + i)));
+        if (eq != 0xFFFFFFFFu)
+            return i + (__builtin_ctz(~eq) / 2);
+    }
+    return i + Mismatch16_SSE2(a + i, b + i, length - i);
+}
+
+WHISPER_AVX2_ static uint32_t
+Mismatch8x16_AVX2(const uint8_t *a, const uint16_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i wideA = _mm256_cvtepu8_epi16(LoadSSE2(a + i));
+        uint32_t eq = _mm256_movemask_epi8(
+                        _mm256_cmpeq_epi16(wideA, LoadAVX2(b + i)));
+        if (eq != 0xFFFFFFFFu)
+            return i + (__builtin_ctz(~eq) / 2);
+    }
+    return i + Mismatch8x16_SSE2(a + i, b + i, length - i);
+}
+
+WHISPER_AVX2_ static void
+Widen_AVX2(const uint8_t *src, uint32_t length, uint16_t *dst)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_cvtepu8_epi16(LoadSSE2(src + i)));
+    }
+    WidenScalar(src, i, length, dst);
+}
+
+WHISPER_AVX2_ static bool
+Narrow_AVX2(const uint16_t *src, uint32_t length, uint8_t *dst)
+{
+    __m256i highBytes = _mm256_set1_epi16(int16_t(0xFF00));
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m256i wide = LoadAVX2(src + i);
+        if (!_mm256_testz_si256(wide, highBytes))
+            return false;
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(_mm256_castsi256_si128(wide),
+                                          _mm256_extracti128_si256(wide, 1)));
+    }
+    return Narrow_SSE2(src + i, length - i, dst + i);
+}
+
+#undef WHISPER_AVX2_
+
+#elif defined(WHISPER_STRING_KERNELS_NEON)
+
+//
+// NEON kernels.  When a block of chars holds a mismatch, the scalar
+// loop finds it within the block.
+//
+
+static uint32_t
+Mismatch8_NEON(const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        if (vminvq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i))) != 0xFFu)
+            break;
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static uint32_t
+Mismatch16_NEON(const uint16_t *a, const uint16_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        if (vminvq_u16(vceqq_u16(vld1q_u16(a + i), vld1q_u16(b + i)))
+                != 0xFFFFu)
+        {
+            break;
+        }
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static uint32_t
+Mismatch8x16_NEON(const uint8_t *a, const uint16_t *b, uint32_t length)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint16x8_t wideA = vmovl_u8(vld1_u8(a + i));
+        if (vminvq_u16(vceqq_u16(wideA, vld1q_u16(b + i))) != 0xFFFFu)
+            break;
+    }
+    return MismatchScalar(a, b, i, length);
+}
+
+static void
+Widen_NEON(const uint8_t *src, uint32_t length, uint16_t *dst)
+{
+    uint32_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t narrow = vld1q_u8(src + i);
+        vst1q_u16(dst + i, vmovl_u8(vget_low_u8(narrow)));
+        vst1q_u16(dst + i + 8, vmovl_high_u8(narrow));
+    }
+    WidenScalar(src, i, length, dst);
+}
+
+static bool
+Narrow_NEON(const uint16_t *src, uint32_t length, uint8_t *dst)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint16x8_t wide = vld1q_u16(src + i);
+        if (vmaxvq_u16(wide) > 0xFFu)
+            return false;
+        vst1_u8(dst + i, vmovn_u16(wide));
+    }
+    return NarrowScalar(src, i, length, dst);
+}
+
+#else // no vector kernels
+
+static uint32_t
+Mismatch8_Scalar(const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+    return MismatchScalar(a, b, 0, length);
+}
+
+static uint32_t
+Mismatch16_Scalar(const uint16_t *a, const uint16_t *b, uint32_t length)
+{
+    return MismatchScalar(a, b, 0, length);
+}
+
+static uint32_t
+Mismatch8x16_Scalar(const uint8_t *a, const uint16_t *b, uint32_t length)
+{
+    return MismatchScalar(a, b, 0, length);
+}
+
+static void
+Widen_Scalar(const uint8_t *src, uint32_t length, uint16_t *dst)
+{
+    WidenScalar(src, 0, length, dst);
+}
+
+static bool
+Narrow_Scalar(const uint16_t *src, uint32_t length, uint8_t *dst)
+{
+    return NarrowScalar(src, 0, length, dst);
+}
+
+#endif
+
+
+//
+// Kernel selection.
+//
+
+struct StringKernels
+{
+    const char *name;
+    uint32_t (*mismatch8)(const uint8_t *, const uint8_t *, uint32_t);
+    uint32_t (*mismatch16)(const uint16_t *, const uint16_t *, uint32_t);
+    uint32_t (*mismatch8x16)(const uint8_t *, const uint16_t *, uint32_t);
+    void (*widen)(const uint8_t *, uint32_t, uint16_t *);
+    bool (*narrow)(const uint16_t *, uint32_t, uint8_t *);
+};
+
+#define KERNELS_(name, suffix) \
+    { name, Mismatch8_##suffix, Mismatch16_##suffix, \
+      Mismatch8x16_##suffix, Widen_##suffix, Narrow_##suffix }
+
+#if defined(WHISPER_STRING_KERNELS_X86)
+static const StringKernels BaselineKernels = KERNELS_("sse2", SSE2);
+static const StringKernels Avx2Kernels = KERNELS_("avx2", AVX2);
+#elif defined(WHISPER_STRING_KERNELS_NEON)
+static const StringKernels BaselineKernels = KERNELS_("neon", NEON);
+#else
+static const StringKernels BaselineKernels = KERNELS_("scalar", Scalar);
+#endif
+
+#undef KERNELS_
+
+static const StringKernels *Kernels = &BaselineKernels;
+
+void
+InitializeStringKernels()
+{
+#if defined(WHISPER_STRING_KERNELS_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        Kernels = &Avx2Kernels;
+#endif
+
+    SpewDebugNote("Using %s string kernels.", Kernels->name);
+}
+
+uint32_t
+MismatchChars(const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+    return Kernels->mismatch8(a, b, length);
+}
+
+uint32_t
+MismatchChars(const uint16_t *a, const uint16_t *b, uint32_t length)
+{
+    return Kernels->mismatch16(a, b, length);
+}
+
+uint32_t
+MismatchChars(const uint8_t *a, const uint16_t *b, uint32_t length)
+{
+    return Kernels->mismatch8x16(a, b, length);
+}
+
+void
+WidenChars(const uint8_t *src, uint32_t length, uint16_t *dst)
+{
+    Kernels->widen(src, length, dst);
+}
+
+bool
+NarrowChars(const uint16_t *src, uint32_t length, uint8_t *dst)
+{
+    return Kernels->narrow(src, length, dst);
+}
+
+
+} // namespace VM
+} // namespace Whisper
@@ -0,0 +1,49 @@
+#ifndef WHISPER__VM__STRING_KERNELS_HPP
+#define WHISPER__VM__STRING_KERNELS_HPP
+
+#include "common.hpp"
+#include "debug.hpp"
+
+namespace Whisper {
+namespace VM {
+
+//
+// String kernels
+//
+// The char loops under string comparison and string creation, for
+// 8-bit and 16-bit char data.  Each is implemented with SSE2 on x86-64
+// and with NEON on AArch64, and with plain loops elsewhere.  On x86-64,
+// InitializeStringKernels switches to AVX2 versions if the CPU has AVX2.
+//
+// The kernels read and write unaligned data.
+//
+
+// Pick the kernels for the CPU.  Until this is called, the baseline
+// kernels for the target are used.
+void InitializeStringKernels();
+
+// Index of the first char at which |a| and |b| differ, or |length| if
+// the first |length| chars of both are the same.
+uint32_t MismatchChars(const uint8_t *a, const uint8_t *b, uint32_t length);
+uint32_t MismatchChars(const uint16_t *a, const uint16_t *b, uint32_t length);
+uint32_t MismatchChars(const uint8_t *a, const uint16_t *b, uint32_t length);
+
+inline uint32_t
+MismatchChars(const uint16_t *a, const uint8_t *b, uint32_t length)
+{
+    return MismatchChars(b, a, length);
+}
+
+// Copy |length| 8-bit chars from |src| into 16-bit chars at |dst|.
+void WidenChars(const uint8_t *src, uint32_t length, uint16_t *dst);
+
+// Copy |length| 16-bit chars from |src| into 8-bit chars at |dst|, if
+// they all fit in 8 bits.  Returns false, with |dst| partly written,
+// if they do not.
+bool NarrowChars(const uint16_t *src, uint32_t length, uint8_t *dst);
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__STRING_KERNELS_HPP
@@ -1,4 +1,7 @@
 
+#include <algorithm>
+#include <string.h>
+
 #include "rooting_inlines.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/tuple.hpp"
@@ -9,33 +12,30 @@ namespace VM {
 
 Tuple::Tuple() : HeapThing()
 {
+    // Constructors store without write barriers: things created directly
+    // in tenured space have all their cards marked when allocated.
     uint32_t vals = size();
+    Value *dst = values();
     for (uint32_t i = 0; i < vals; i++)
-        element(i).set(Value::Undefined(), this);
+        dst[i] = Value::Undefined();
 }
 
 Tuple::Tuple(const Tuple &other) : HeapThing(other)
 {
     uint32_t vals = size();
-    uint32_t otherVals = other.size();
-    if (vals <= otherVals) {
-        for (uint32_t i = 0; i < vals; i++)
-            set(i, other.element(i));
-        return;
-    }
-
-    uint32_t i;
-    for (i = 0; i < otherVals; i++)
-        set(i, other.element(i));
-    for (; i < vals; i++)
-        set(i, Value::Undefined());
+    uint32_t copied = std::min(vals, other.size());
+    Value *dst = values();
+    if (copied > 0)
+        memcpy(dst, other.values(), copied * sizeof(Value));
+    for (uint32_t i = copied; i < vals; i++)
+        dst[i] = Value::Undefined();
 }
 
 Tuple::Tuple(const Value *vals) : HeapThing()
 {
     uint32_t count = size();
-    for (uint32_t i = 0; i < count; i++)
-        element(i).set(vals[i], this);
+    if (count > 0)
+        memcpy(values(), vals, count * sizeof(Value));
 }
 
 uint32_t
@@ -64,6 +64,60 @@ Tuple::set(uint32_t idx, const Value &val)
     element(idx).set(val, this);
 }
 
+void
+Tuple::copyFrom(uint32_t start, const Value *vals, uint32_t count)
+{
+    WH_ASSERT(start <= size() && count <= size() - start);
+    if (count == 0)
+        return;
+
+    Value *dst = values() + start;
+    memmove(dst, vals, count * sizeof(Value));
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (IsBarrieredValue(dst[i])) {
+            noteWrites(dst, count * sizeof(Value));
+            break;
+        }
+    }
+}
+
+void
+Tuple::copyFrom(uint32_t start, const Tuple *other, uint32_t otherStart,
+                uint32_t count)
+{
+    WH_ASSERT(otherStart <= other->size() &&
+              count <= other->size() - otherStart);
+    copyFrom(start, other->values() + otherStart, count);
+}
+
+void
+Tuple::fill(uint32_t start, uint32_t count, const Value &val)
+{
+    WH_ASSERT(start <= size() && count <= size() - start);
+    if (count == 0)
+        return;
+
+    Value *dst = values() + start;
+    for (uint32_t i = 0; i < count; i++)
+        dst[i] = val;
+
+    if (IsBarrieredValue(val))
+        noteWrites(dst, count * sizeof(Value));
+}
+
+const Value *
+Tuple::values() const
+{
+    return reinterpret_cast<const Value *>(this);
+}
+
+Value *
+Tuple::values()
+{
+    return reinterpret_cast<Value *>(this);
+}
+
 const Heap<Value> &
 Tuple::element(uint32_t idx) const
 {
@@ -5,6 +5,7 @@
 #include "debug.hpp"
 #include "value.hpp"
 #include "rooting.hpp"
+#include "ref_scanner.hpp"
 #include "vm/heap_thing.hpp"
 
 namespace Whisper {
@@ -16,6 +17,7 @@ namespace VM {
 //
 class Tuple : public HeapThing, public TypedHeapThing<HeapType::Tuple>
 {
+  friend class Whisper::RefScanner<Tuple>;
   public:
     Tuple();
     Tuple(const Tuple &other);
@@ -27,13 +29,46 @@ class Tuple : public HeapThing, public TypedHeapThing<HeapType::Tuple>
     Handle<Value> operator [](uint32_t idx) const;
     void set(uint32_t idx, const Value &val);
 
+    // Bulk stores into the |count| elements from |start|.  The values are
+    // copied in one go, and a single write barrier marks the cards of the
+    // whole range, rather than one barrier per element.  |vals| may point
+    // into this tuple.
+    void copyFrom(uint32_t start, const Value *vals, uint32_t count);
+    void copyFrom(uint32_t start, const Tuple *other, uint32_t otherStart,
+                  uint32_t count);
+    void fill(uint32_t start, uint32_t count, const Value &val);
+
   private:
+    const Value *values() const;
+    Value *values();
+
     const Heap<Value> &element(uint32_t idx) const;
     Heap<Value> &element(uint32_t idx);
 };
 
 
 } // namespace VM
+
+
+template <>
+class RefScanner<VM::Tuple> : public FieldRefScanner<0>
+{
+  public:
+    inline RefScanner(VM::Tuple &tuple) {
+        if (tuple.size() > 0)
+            setValueRange(tuple.element(0).addr(), tuple.size());
+    }
+
+    // Scan only the elements in [start, end), for tuples large enough to
+    // be scanned in chunks.
+    inline RefScanner(VM::Tuple &tuple, uint32_t start, uint32_t end) {
+        WH_ASSERT(start <= end && end <= tuple.size());
+        if (start < end)
+            setValueRange(tuple.element(start).addr(), end - start);
+    }
+};
+
+
 } // namespace Whisper
 
 #endif // WHISPER__VM__TUPLE_HPP
@@ -0,0 +1,87 @@
+
+#include "value_inlines.hpp"
+#include "rooting_inlines.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/type_feedback.hpp"
+#include "vm/script.hpp"
+#include "vm/property_cache.hpp"
+
+#include <string.h>
+
+namespace Whisper {
+namespace VM {
+
+
+TypeFeedback::TypeFeedback()
+{
+    memset(recastThis<uint8_t>(), 0, length());
+}
+
+uint32_t
+TypeFeedback::length() const
+{
+    return objectSize();
+}
+
+uint8_t
+TypeFeedback::typesAt(uint32_t pcOffset) const
+{
+    WH_ASSERT(pcOffset < length());
+    return recastThis<uint8_t>()[pcOffset];
+}
+
+/*static*/ bool
+TypeFeedback::IsRecordingOpcode(Interp::Opcode opcode)
+{
+    using Interp::Opcode;
+    if (Interp::IsFusedOpcode(opcode)) {
+        return IsRecordingOpcode(Interp::GetFusedFirstOpcode(opcode)) ||
+               IsRecordingOpcode(Interp::GetFusedSecondOpcode(opcode));
+    }
+    return (opcode >= Opcode::Add_SSS && opcode <= Opcode::Neg_VV) ||
+           opcode == Opcode::GetProp || opcode == Opcode::SetProp;
+}
+
+void
+DumpTypeFeedback(Script *script, FILE *out)
+{
+    if (!script->hasTypeFeedback())
+        return;
+
+    static const char *TypeNames[] = {
+        "int32", "double", "string", "object", "other"
+    };
+
+    TypeFeedback *feedback = script->typeFeedback();
+    DecodedBytecode *decoded = script->decoded();
+    for (const Interp::DecodedOp *op = decoded->ops();
+         op < decoded->opsEnd(); op++)
+    {
+        if (!TypeFeedback::IsRecordingOpcode(op->opcode))
+            continue;
+
+        fprintf(out, "pc %u %s", (unsigned) op->pcOffset,
+                Interp::GetOpcodeName(op->opcode));
+        uint8_t types = feedback->typesAt(op->pcOffset);
+        const char *sep = " ";
+        for (unsigned i = 0; i < 5; i++) {
+            if (types & (1 << i)) {
+                fprintf(out, "%s%s", sep, TypeNames[i]);
+                sep = ",";
+            }
+        }
+        if (op->opcode == Interp::Opcode::GetProp ||
+            op->opcode == Interp::Opcode::SetProp)
+        {
+            uint32_t cacheIndex = ToUInt32(op->operands[1].signedValue());
+            fprintf(out, " shapes=%u", (unsigned)
+                    PropertyCache::NumShapes(script->propertyCaches(),
+                                             cacheIndex));
+        }
+        fprintf(out, "\n");
+    }
+}
+
+
+} // namespace VM
+} // namespace Whisper
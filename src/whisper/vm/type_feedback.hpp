@@ -0,0 +1,101 @@
+#ifndef WHISPER__VM__TYPE_FEEDBACK_HPP
+#define WHISPER__VM__TYPE_FEEDBACK_HPP
+
+#include <stdio.h>
+
+#include "common.hpp"
+#include "debug.hpp"
+#include "value.hpp"
+#include "vm/heap_type_defn.hpp"
+#include "vm/heap_thing.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "interp/bytecode_ops.hpp"
+
+namespace Whisper {
+namespace VM {
+
+class Script;
+
+
+//
+// TypeFeedback
+//
+// The types seen by the arithmetic ops and property access ops of a
+// script, for choosing fast paths and for offline analysis (see
+// DumpTypeFeedback).  A script's type feedback is created when it is
+// decoded, if it has any such ops (see Script::typeFeedback).
+//
+// Feedback is one byte per byte of the script's bytecode, indexed by
+// the pc offset of the op: decoded ops are copied by the baseline JIT,
+// and split out of fused ops, but keep their pc offset.  Each byte is a
+// set of ObservedType bits.  Arithmetic ops record the types of their
+// operands, and property ops the types of the values they get or set.
+// The shapes seen by property ops are held by their inline caches
+// instead (see PropertyCache).
+//
+struct TypeFeedback : public HeapThing,
+                      public TypedHeapThing<HeapType::TypeFeedback>
+{
+  public:
+    enum ObservedType : uint8_t
+    {
+        Int32       = 0x01,
+        Double      = 0x02,
+        String      = 0x04,
+        Object      = 0x08,
+        Other       = 0x10
+    };
+
+    TypeFeedback();
+
+    uint32_t length() const;
+
+    uint8_t typesAt(uint32_t pcOffset) const;
+
+    static inline uint8_t TypeOf(const Value &val) {
+        if (val.isInt32())
+            return Int32;
+        if (val.isNumber())
+            return Double;
+        if (val.isString())
+            return String;
+        if (val.isObject())
+            return Object;
+        return Other;
+    }
+
+    // Record the types of |val|, or of both |lhs| and |rhs|, at
+    // |pcOffset|.  Types seen before do not write the feedback again.
+    inline void record(uint32_t pcOffset, const Value &val) {
+        recordTypes(pcOffset, TypeOf(val));
+    }
+    inline void record(uint32_t pcOffset, const Value &lhs,
+                       const Value &rhs)
+    {
+        recordTypes(pcOffset, TypeOf(lhs) | TypeOf(rhs));
+    }
+
+    // Whether ops with |opcode| record type feedback.
+    static bool IsRecordingOpcode(Interp::Opcode opcode);
+
+  private:
+    inline void recordTypes(uint32_t pcOffset, uint8_t types) {
+        WH_ASSERT(pcOffset < length());
+        uint8_t *slot = recastThis<uint8_t>() + pcOffset;
+        if ((*slot & types) != types)
+            *slot |= types;
+    }
+};
+
+// Print the type feedback of each arithmetic and property op of
+// |script|, one op per line: its pc offset, its name, and the types it
+// has seen, followed by the number of shapes in its inline cache for
+// property ops.  Ops which have not run print no types.  Prints
+// nothing if the script has no type feedback.
+void DumpTypeFeedback(Script *script, FILE *out);
+
+
+} // namespace VM
+} // namespace Whisper
+
+#endif // WHISPER__VM__TYPE_FEEDBACK_HPP
@@ -1,24 +1,35 @@
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <deque>
 #include <iostream>
+#include <vector>
 #include "common.hpp"
 #include "allocators.hpp"
 #include "spew.hpp"
+#include "trace.hpp"
 #include "parser/code_source.hpp"
 #include "parser/tokenizer.hpp"
+#include "parser/parallel_parser.hpp"
 #include "parser/syntax_tree.hpp"
 #include "parser/syntax_tree_inlines.hpp"
-#include "parser/parser.hpp"
 #include "value.hpp"
 #include "slab.hpp"
 #include "vm/heap_thing.hpp"
 #include "vm/heap_thing_inlines.hpp"
 #include "vm/double.hpp"
 #include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
 #include "runtime.hpp"
 #include "runtime_inlines.hpp"
+#include "heap_stats.hpp"
 #include "rooting.hpp"
 #include "rooting_inlines.hpp"
 #include "ref_scanner.hpp"
+#include "embed.hpp"
 
 #include "vm/reference.hpp"
 #include "vm/property_descriptor.hpp"
@@ -27,75 +38,247 @@
 #include "vm/shape_tree.hpp"
 #include "vm/bytecode.hpp"
 #include "vm/script.hpp"
+#include "vm/stack_frame.hpp"
+#include "vm/type_feedback.hpp"
 
-#include "interp/bytecode_generator.hpp"
 #include "interp/interpreter.hpp"
+#include "interp/op_pair_profiler.hpp"
+#include "interp/op_profiler.hpp"
+#include "interp/sampling_profiler.hpp"
 
 using namespace Whisper;
 
-struct Printer {
-    void operator ()(const char *s) {
-        std::cerr << s;
+// The compile options asked for by environment variables.
+static CompileOptions
+ShellCompileOptions()
+{
+    CompileOptions options;
+    options.lazyFunctions = !getenv("WHEAGERPARSE");
+    options.fuseOps = !getenv("WHNOFUSE");
+    options.foldConstants = !getenv("WHNOFOLD");
+    options.localTemps = getenv("WHLOCALTEMPS") != nullptr;
+    options.printStats = getenv("WHCOMPILESTATS") != nullptr;
+    return options;
+}
+
+static void
+ReportCompileError(CodeSource &source, const char *error,
+                   const CompileInfo &info)
+{
+    if (info.parseError) {
+        LineIndex lines(source);
+        std::cerr << "Parse error at line "
+                  << (lines.line(info.errorPosition) + 1) << ", column "
+                  << (lines.column(info.errorPosition) + 1) << ": "
+                  << error << std::endl;
+        return;
     }
-    void operator ()(const uint8_t *s, uint32_t len) {
-        for (size_t i = 0; i < len; i++)
-            std::cerr << static_cast<char>(s[i]);
+    std::cerr << "Compile error: " << error << std::endl;
+}
+
+// Scripts are run on up to MaxScriptThreads threads at once.
+static constexpr uint32_t MaxScriptThreads = 64;
+
+// A thread started for WHTHREADS, which runs the script in a thread
+// context of its own.
+struct ScriptThread
+{
+    Runtime *runtime;
+    const char *filename;
+    pthread_t thread;
+    bool result;
+};
+
+static void *
+RunScriptThread(void *arg)
+{
+    ScriptThread *st = reinterpret_cast<ScriptThread *>(arg);
+    st->result = false;
+
+    FileCodeSource input(st->filename);
+    if (!input.initialize())
+        return nullptr;
+
+    if (st->runtime->registerThread())
+        return nullptr;
+    ThreadContext *thrcx = st->runtime->threadContext();
+    if (const char *threshold = getenv("WHJITTHRESHOLD"))
+        thrcx->setJitThreshold(atoi(threshold));
+    if (const char *iterations = getenv("WHOPTITERATIONS"))
+        thrcx->setOptIterations(atoi(iterations));
+    if (getenv("WHCOMPACT"))
+        thrcx->setCompactTenured(true);
+
+    {
+        RunContext runcx(thrcx);
+        RunActivationHelper _rah(runcx);
+        RunContext *cx = &runcx;
+
+        // The code frozen by the main thread is used if there is any.
+        CompileOptions options = ShellCompileOptions();
+        options.cacheDir = getenv("WHBYTECODECACHE");
+        options.printStats = false;
+        CompileInfo info;
+        Root<VM::Script *> script(cx);
+        if (const char *err = CompileScript(cx, input, options, &script,
+                                            &info))
+        {
+            ReportCompileError(input, err, info);
+        } else {
+            st->result = Interp::InterpretScript(cx, script);
+        }
     }
+
+    st->runtime->unregisterThread();
+    return nullptr;
+}
+
+// A thread started for WHTIMELIMIT, which interrupts the script of a
+// run context once it has run for |millis| milliseconds.
+struct TimeLimitThread
+{
+    RunContext *cx;
+    uint32_t millis;
+    pthread_t thread;
 };
 
+static void *
+RunTimeLimitThread(void *arg)
+{
+    TimeLimitThread *tl = reinterpret_cast<TimeLimitThread *>(arg);
+    struct timespec remaining;
+    remaining.tv_sec = tl->millis / 1000;
+    remaining.tv_nsec = (tl->millis % 1000) * 1000000L;
+    while (nanosleep(&remaining, &remaining) != 0)
+        continue;
+
+    tl->cx->requestInterrupt();
+    return nullptr;
+}
+
+// With WHSLICE, the script is suspended at the end of each time slice,
+// and resumed by the shell, as an event loop would.  Other interrupts
+// terminate it.  Between slices, the shell gives WHIDLE microseconds of
+// idle time to the collector, and reports WHMEMORYPRESSURE (moderate or
+// critical), if asked to.
+static bool
+SuspendAtTimeSlice(RunContext *cx, RunContext::InterruptReason reason,
+                   void *)
+{
+    if (reason != RunContext::InterruptReason::TimeSlice)
+        return false;
+    cx->suspendScript();
+    return true;
+}
+
 int main(int argc, char **argv) {
     std::cout << "Whisper says hello." << std::endl;
 
     InitializeSpew();
     Interp::InitializeOpcodeInfo();
 
+    // WHTRACE=<path> records trace events, and writes them to <path> in
+    // the Chrome trace format on exit.
+    const char *tracePath = getenv("WHTRACE");
+    if (tracePath && !EnableTracing())
+        std::cerr << "Could not enable tracing." << std::endl;
+    VM::InitializeStringKernels();
+    InitializeKeywordTable();
+    InitializeQuickTokenTable();
+
     // Open input file.
     if (argc <= 1) {
         std::cerr << "No input file provided!" << std::endl;
         exit(1);
     }
 
+    // An input file of "-" streams the script from stdin, parsing it
+    // as it is read.
+    bool streamInput = strcmp(argv[1], "-") == 0;
     FileCodeSource inputFile(argv[1]);
-    if (!inputFile.initialize()) {
+    StreamCodeSource inputStream("<stdin>", STDIN_FILENO);
+    CodeSource *input = &inputFile;
+    if (streamInput) {
+        if (!inputStream.initialize()) {
+            std::cerr << "Could not stream stdin." << std::endl;
+            std::cerr << inputStream.error() << std::endl;
+            exit(1);
+        }
+        input = &inputStream;
+    } else if (!inputFile.initialize()) {
         std::cerr << "Could not open input file " << argv[1]
                   << " for reading." << std::endl;
         std::cerr << inputFile.error() << std::endl;
         exit(1);
     }
-    BumpAllocator allocator;
-    STLBumpAllocator<uint8_t> wrappedAllocator(allocator);
-    InitializeKeywordTable();
-    InitializeQuickTokenTable();
-    Tokenizer tokenizer(wrappedAllocator, inputFile);
-    Parser parser(tokenizer);
-
-    ProgramNode *program = parser.parseProgram();
-    if (!program) {
-        WH_ASSERT(parser.hasError());
-        std::cerr << "Parse error: " << parser.error() << std::endl;
-        return 1;
-    }
-
-    Printer pr;
-    PrintNode(tokenizer.source(), program, pr, 0);
 
-    // Annotate the program.
-    AST::SyntaxAnnotator annotator(wrappedAllocator, program, inputFile);
-    if (!annotator.annotate()) {
-        WH_ASSERT(annotator.hasError());
-        std::cerr << "Syntax annotation failed: " << annotator.error()
+    // Further input files are compiled along with the script, parsing
+    // them in parallel on WHPARSETHREADS threads, and run after it, in
+    // order, as the files of a multi-file program.  WHPARSECHECK checks
+    // the parallel parse against a serial one.
+    std::deque<FileCodeSource> moreFiles;
+    if (streamInput && argc > 2) {
+        std::cerr << "Stdin cannot be streamed with other input files."
                   << std::endl;
-        return 1;
+        exit(1);
+    }
+    for (int i = 2; i < argc; i++) {
+        moreFiles.emplace_back(argv[i]);
+        if (!moreFiles.back().initialize()) {
+            std::cerr << "Could not open input file " << argv[i]
+                      << " for reading." << std::endl;
+            std::cerr << moreFiles.back().error() << std::endl;
+            exit(1);
+        }
     }
 
+    // Size the heap as asked to.  WHMAXHEAP is in bytes.
+    RuntimeConfig config;
+    if (const char *slabs = getenv("WHHATCHERYSLABS"))
+        config.hatcherySlabs = atoi(slabs);
+    if (const char *slabs = getenv("WHNURSERYSLABS"))
+        config.nurserySlabs = atoi(slabs);
+    if (const char *percent = getenv("WHTENUREDGROWTH"))
+        config.tenuredGrowthPercent = atoi(percent);
+    if (const char *bytes = getenv("WHMAXHEAP"))
+        config.maxHeapBytes = strtoull(bytes, nullptr, 10);
+
     // Initialize a runtime.
     Runtime runtime;
-    if (!runtime.initialize()) {
+    if (!runtime.initialize(config)) {
         WH_ASSERT(runtime.hasError());
         std::cerr << "Runtime error: " << runtime.error() << std::endl;
         return 1;
     }
 
+    // Back standard slabs with huge pages if asked to.
+    if (getenv("WHHUGEPAGES"))
+        runtime.slabReserve().setUseHugePages(true);
+
+    // Intern strings in one table for all threads if asked to.
+    if (getenv("WHSHAREDSTRINGS")) {
+        if (const char *err = runtime.enableSharedStringTable()) {
+            std::cerr << "Runtime error: " << err << std::endl;
+            return 1;
+        }
+    }
+
+    // Share frozen compiled code between threads if asked to.
+    if (getenv("WHSHAREDCODE")) {
+        if (const char *err = runtime.enableSharedCodeHeap()) {
+            std::cerr << "Runtime error: " << err << std::endl;
+            return 1;
+        }
+    }
+
+    // Start thread contexts from a heap snapshot if asked to.
+    if (getenv("WHSNAPSHOT")) {
+        if (const char *err = runtime.enableStartupSnapshot()) {
+            std::cerr << "Runtime error: " << err << std::endl;
+            return 1;
+        }
+    }
+
     // Create a new thread context.
     const char *err = runtime.registerThread();
     if (err) {
@@ -104,31 +287,121 @@ int main(int argc, char **argv) {
     }
     ThreadContext *thrcx = runtime.threadContext();
 
+    // Sample allocations if asked to.
+    if (const char *interval = getenv("WHALLOCPROFILE")) {
+        int bytes = atoi(interval);
+        if (bytes > 0 && !thrcx->startAllocationProfiler(bytes)) {
+            std::cerr << "Could not start allocation profiler." << std::endl;
+            return 1;
+        }
+    }
+
+    // Count interpreted op pairs if asked to.
+    const char *opPairs = getenv("WHOPPAIRS");
+    if (opPairs && !thrcx->startOpPairProfiler()) {
+        std::cerr << "Could not start op pair profiler." << std::endl;
+        return 1;
+    }
+
+    // Count interpreted ops if asked to.  WHOPPROFILE=cycles also times
+    // them.
+    if (const char *opProfile = getenv("WHOPPROFILE")) {
+        bool cycles = strcmp(opProfile, "cycles") == 0;
+        if (!thrcx->startOpProfiler(cycles)) {
+            std::cerr << "Could not start op profiler." << std::endl;
+            return 1;
+        }
+    }
+
+    // Sample the script's stacks if asked to.  WHSAMPLEPROFILE is the
+    // sampling interval, in microseconds of CPU time.
+    if (const char *interval = getenv("WHSAMPLEPROFILE")) {
+        int micros = atoi(interval);
+        if (micros <= 0)
+            micros = Interp::SamplingProfiler::DefaultIntervalMicros;
+        if (const char *error = thrcx->startSamplingProfiler(micros)) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+    }
+
+    // Override the baseline JIT threshold if asked to.
+    if (const char *threshold = getenv("WHJITTHRESHOLD"))
+        thrcx->setJitThreshold(atoi(threshold));
+
+    // Override the loop iterations before optimizing if asked to.
+    if (const char *iterations = getenv("WHOPTITERATIONS"))
+        thrcx->setOptIterations(atoi(iterations));
+
+    // Scan the native stack conservatively if asked to.
+    if (getenv("WHCONSERVATIVESTACK") &&
+        !thrcx->enableConservativeStackScan())
+    {
+        std::cerr << "Could not find native stack bounds." << std::endl;
+        return 1;
+    }
+
+    // Compact the tenured generation on major GCs if asked to.
+    if (getenv("WHCOMPACT"))
+        thrcx->setCompactTenured(true);
+
     // Create a run context for execution.
     RunContext runcx(thrcx);
     RunActivationHelper _rah(runcx);
 
     RunContext *cx = &runcx;
 
-    // Generate bytecode.
-    Interp::BytecodeGenerator bcgen(cx, wrappedAllocator, program, annotator,
-                                    false);
-    Root<VM::Bytecode *> bc(cx, bcgen.generateBytecode());
-    if (bcgen.hasError()) {
-        std::cerr << "Codgen error: " << bcgen.error() << "!" << std::endl;
-        return 1;
-    }
-    WH_ASSERT(bc != nullptr);
+    // Compile the script, loading its bytecode from the cache directory
+    // if asked to and it holds bytecode for this source.  A streamed
+    // source is parsed as it is read, so it is not cached.
+    CompileOptions options = ShellCompileOptions();
+    options.cacheDir = streamInput ? nullptr : getenv("WHBYTECODECACHE");
+    options.printProgram = true;
+    options.checkParallelParse = getenv("WHPARSECHECK") != nullptr;
+    std::vector<CodeSource *> sources;
+    sources.push_back(input);
+    for (FileCodeSource &file : moreFiles)
+        sources.push_back(&file);
+    std::vector<CompileInfo> infos(sources.size());
 
-    // Get constant pool tuple.
-    Root<VM::Tuple *> constants(cx);
-    if (!bcgen.constants(constants))
-        return false;
+    Root<VM::Script *> script(cx);
+    VectorRoot<VM::Script *> scripts(cx);
+    const char *compileErr;
+    if (sources.size() == 1) {
+        compileErr = CompileScript(cx, *input, options, &script, &infos[0]);
+    } else {
+        uint32_t parseThreads = ParallelParser::DefaultNumThreads();
+        if (const char *threads = getenv("WHPARSETHREADS"))
+            parseThreads = Max(atoi(threads), 1);
+        compileErr = CompileScripts(cx, sources.data(), sources.size(),
+                                    parseThreads, options, scripts,
+                                    infos.data());
+        if (!compileErr)
+            script = scripts.get(0);
+    }
+    uint32_t compiled = compileErr ? scripts.size() : 0;
+    CodeSource &compiledSource = *sources[compiled];
+    const CompileInfo &info = infos[compiled];
 
-    VM::Script::Config scriptCfg(false, VM::Script::TopLevel,
-                                    bcgen.maxStackDepth());
-    Root<VM::Script *> script(cx,
-            cx->inHatchery().create<VM::Script>(bc, constants, scriptCfg));
+    // A read error ends a streamed source early, so it may have
+    // compiled anyway.
+    if (streamInput && inputStream.hasError()) {
+        std::cerr << "Could not read stdin: " << inputStream.error()
+                  << std::endl;
+        return 1;
+    }
+    if (compileErr) {
+        ReportCompileError(compiledSource, compileErr, info);
+        return 1;
+    }
+    if (info.cached) {
+        std::cerr << "Loaded cached bytecode from " << options.cacheDir
+                  << std::endl;
+    }
+    if (info.cacheWriteFailed) {
+        std::cerr << "Could not write bytecode cache in "
+                  << options.cacheDir << std::endl;
+    }
     std::cerr << "Created script with max stack depth " <<
                  script->maxStackDepth() << std::endl;
 
@@ -136,12 +409,142 @@ int main(int argc, char **argv) {
     VM::SpewHeapThingSlab(cx->hatchery());
 
     // Print bytecode contents.
-    VM::SpewBytecodeObject(bc);
+    VM::SpewBytecodeObject(script->bytecode());
+
+    // Freeze everything loaded so far if asked to, as a process would
+    // before forking workers.
+    if (getenv("WHFREEZEHEAP") && !thrcx->freezeHeap()) {
+        std::cerr << "Could not freeze heap." << std::endl;
+        return 1;
+    }
+
+    // Also run the script on WHTHREADS - 1 other threads if asked to,
+    // each parsing and running it in its own thread context.
+    ScriptThread scriptThreads[MaxScriptThreads];
+    uint32_t numScriptThreads = 0;
+    if (const char *threads = getenv("WHTHREADS")) {
+        int count = atoi(threads);
+        if (count > int(MaxScriptThreads))
+            count = MaxScriptThreads;
+        while (!streamInput && int(numScriptThreads) + 1 < count) {
+            ScriptThread &st = scriptThreads[numScriptThreads];
+            st.runtime = &runtime;
+            st.filename = argv[1];
+            if (pthread_create(&st.thread, nullptr, RunScriptThread, &st))
+                break;
+            numScriptThreads++;
+        }
+    }
+
+    // Interrupt the script once it has run for WHTIMELIMIT milliseconds
+    // if asked to.
+    TimeLimitThread timeLimit;
+    bool hasTimeLimit = false;
+    if (const char *millis = getenv("WHTIMELIMIT")) {
+        timeLimit.cx = cx;
+        timeLimit.millis = atoi(millis);
+        if (pthread_create(&timeLimit.thread, nullptr, RunTimeLimitThread,
+                           &timeLimit))
+        {
+            std::cerr << "Could not start time limit thread." << std::endl;
+            return 1;
+        }
+        hasTimeLimit = true;
+    }
+
+    // Terminate the script once it has used WHCPUBUDGET milliseconds of
+    // CPU time if asked to.
+    if (const char *millis = getenv("WHCPUBUDGET"))
+        cx->setCpuBudget(uint64_t(atoi(millis)) * 1000000);
 
     // Interpret the script.
     std::cerr << "Running script" << std::endl;
-    bool interpResult = Interp::InterpretScript(cx, script);
+    bool interpResult;
+    if (const char *millis = getenv("WHSLICE")) {
+        cx->setSchedulerHook(SuspendAtTimeSlice, nullptr);
+        cx->setTimeSlice(uint64_t(atoi(millis)) * 1000000);
+
+        const char *idleMicros = getenv("WHIDLE");
+        const char *pressure = getenv("WHMEMORYPRESSURE");
+        ThreadContext::MemoryPressure pressureLevel =
+            (pressure && strcmp(pressure, "critical") == 0)
+                ? ThreadContext::MemoryPressure::Critical
+                : ThreadContext::MemoryPressure::Moderate;
+
+        Root<VM::StackFrame *> suspended(cx);
+        interpResult = Interp::InterpretScript(cx, script, &suspended);
+        uint32_t slices = 1;
+        while (interpResult && suspended) {
+            if (idleMicros) {
+                uint64_t deadline = MonotonicNanos() +
+                                    uint64_t(atoi(idleMicros)) * 1000;
+                interpResult = thrcx->notifyIdle(deadline);
+            }
+            if (pressure && interpResult)
+                interpResult = thrcx->notifyMemoryPressure(pressureLevel);
+            if (!interpResult)
+                break;
+
+            Root<VM::StackFrame *> frame(cx, suspended);
+            interpResult = Interp::ResumeScript(cx, frame, &suspended);
+            slices++;
+        }
+        std::cerr << "Script ran in " << slices << " slices." << std::endl;
+    } else {
+        interpResult = Interp::InterpretScript(cx, script);
+    }
     std::cerr << "Script result: " << interpResult << std::endl;
+    for (uint32_t i = 1; interpResult && i < scripts.size(); i++) {
+        interpResult = Interp::InterpretScript(cx, scripts.get(i));
+        std::cerr << "Script " << argv[i + 1] << " result: "
+                  << interpResult << std::endl;
+    }
+    if (hasTimeLimit) {
+        pthread_cancel(timeLimit.thread);
+        pthread_join(timeLimit.thread, nullptr);
+    }
+    if (thrcx->hitHeapLimit())
+        std::cerr << "Heap limit reached." << std::endl;
+
+    for (uint32_t i = 0; i < numScriptThreads; i++) {
+        pthread_join(scriptThreads[i].thread, nullptr);
+        if (!scriptThreads[i].result)
+            std::cerr << "Script thread " << (i + 1) << " failed."
+                      << std::endl;
+    }
+
+    // Print heap statistics if asked to.
+    if (getenv("WHHEAPSTATS")) {
+        HeapStats stats(/* perSlab = */ false);
+        if (stats.collect(thrcx))
+            stats.print(stderr);
+    }
+    if (AllocationProfiler *profiler = thrcx->allocationProfiler())
+        profiler->print(stderr);
+    if (Interp::OpPairProfiler *profiler = thrcx->opPairProfiler()) {
+        int maxPairs = atoi(opPairs);
+        profiler->print(stderr, maxPairs > 0 ? maxPairs : 20);
+    }
+    if (Interp::OpProfiler *profiler = thrcx->opProfiler())
+        profiler->print(stderr, 20);
+    if (Interp::SamplingProfiler *profiler = thrcx->samplingProfiler())
+        profiler->print(stderr);
+
+    // Print the type feedback of the script's ops if asked to.
+    if (getenv("WHTYPEFEEDBACK"))
+        VM::DumpTypeFeedback(script, stderr);
+
+    // Print the runtime's GC metrics, in the Prometheus text format.
+    if (getenv("WHMETRICS")) {
+        RuntimeMetrics metrics;
+        runtime.metrics(&metrics);
+        metrics.printPrometheus(stderr);
+    }
+
+    if (tracePath && TracingEnabled()) {
+        if (const char *error = WriteChromeTrace(tracePath))
+            std::cerr << error << std::endl;
+    }
 
     return 0;
 }
@@ -0,0 +1,1010 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common.hpp"
+#include "allocators.hpp"
+#include "spew.hpp"
+#include "parser/code_source.hpp"
+#include "parser/tokenizer.hpp"
+#include "parser/syntax_tree.hpp"
+#include "parser/syntax_tree_inlines.hpp"
+#include "parser/parser.hpp"
+#include "value.hpp"
+#include "slab.hpp"
+#include "vm/heap_thing.hpp"
+#include "vm/heap_thing_inlines.hpp"
+#include "vm/string.hpp"
+#include "vm/string_kernels.hpp"
+#include "runtime.hpp"
+#include "runtime_inlines.hpp"
+#include "rooting.hpp"
+#include "rooting_inlines.hpp"
+#include "string_table.hpp"
+
+#include "vm/tuple.hpp"
+#include "vm/bytecode.hpp"
+#include "vm/script.hpp"
+
+#include "interp/bytecode_generator.hpp"
+#include "interp/interpreter.hpp"
+
+using namespace Whisper;
+
+//
+// whisper-bench runs a fixed set of micro-benchmarks of the runtime's
+// hot paths, and prints their results to stdout as JSON.
+//
+// Every benchmark does a fixed amount of work, so that results can be
+// compared between builds.  Each result gives the number of operations
+// timed, the time per operation and the throughput, in operations and
+// (for benchmarks over source text) bytes per second.  The format of
+// the output only changes along with its "format" number.
+//
+// An argument, if given, runs only the benchmarks whose names contain
+// it.  With "--scripts <dir> [runs]", the scripts of a directory are
+// benchmarked instead (see BenchScripts).
+//
+
+static constexpr uint32_t BenchFormat = 1;
+
+// Runs of each script in script mode, by default.
+static constexpr uint32_t DefaultScriptRuns = 10;
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t ops;
+    uint64_t nanos;
+    uint64_t bytes;
+};
+
+static std::vector<BenchResult> Results;
+static const char *Filter = nullptr;
+
+static bool
+Selected(const char *name)
+{
+    return !Filter || strstr(name, Filter);
+}
+
+static uint64_t
+NowNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+AddResult(const char *name, uint64_t ops, uint64_t nanos, uint64_t bytes)
+{
+    BenchResult result;
+    result.name = name;
+    result.ops = ops;
+    result.nanos = nanos;
+    result.bytes = bytes;
+    Results.push_back(result);
+}
+
+static void
+PrintResults()
+{
+    printf("{\n");
+    printf("  \"format\": %u,\n", (unsigned) BenchFormat);
+    printf("  \"benchmarks\": [");
+    for (size_t i = 0; i < Results.size(); i++) {
+        const BenchResult &result = Results[i];
+        double secs = result.nanos / 1e9;
+        double nsPerOp = result.ops ? double(result.nanos) / result.ops : 0;
+        double opsPerSec = secs > 0 ? result.ops / secs : 0;
+        double bytesPerSec = secs > 0 ? result.bytes / secs : 0;
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"ns\": %llu, "
+               "\"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, "
+               "\"bytes_per_sec\": %.1f}",
+               i ? "," : "", result.name.c_str(),
+               (unsigned long long) result.ops,
+               (unsigned long long) result.nanos,
+               nsPerOp, opsPerSec, bytesPerSec);
+    }
+    printf("\n  ]\n}\n");
+}
+
+// Sources are generated in memory, so that every run sees the same
+// text.
+class BenchCodeSource : public CodeSource
+{
+  public:
+    BenchCodeSource(const char *name, const std::string &text)
+      : CodeSource(name)
+    {
+        data_ = reinterpret_cast<const uint8_t *>(text.data());
+        dataSize_ = text.size();
+        dataEnd_ = data_ + dataSize_;
+    }
+};
+
+// Source the parser accepts, but the bytecode generator need not.
+static std::string
+ParserCorpus()
+{
+    std::string text;
+    char buf[512];
+    for (uint32_t i = 0; i < 400; i++) {
+        snprintf(buf, sizeof(buf),
+            "var a%u = %u, b%u = [1, , 3], c%u = { x: %u, \"y\": 2.5 };\n"
+            "function f%u(p, q) {\n"
+            "    for (var i = 0; i < q; i++) { if (i %% 2) continue; }\n"
+            "    while (q > p) { if (q %% 3) a%u = 'str%u'; else q--; }\n"
+            "    try { throw p; } catch (e) { a%u = e; } finally { p = 0; }\n"
+            "    return f%u.call(null, a%u, b%u)[0] + c%u.x * 3;\n"
+            "}\n",
+            i, i, i, i, i, i, i, i, i, i, i, i, i);
+        text += buf;
+    }
+    return text;
+}
+
+// Source made of expression statements only, which the bytecode
+// generator handles.
+static std::string
+CodegenCorpus()
+{
+    std::string text;
+    char buf[256];
+    for (uint32_t i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf),
+            "({key_%u: %u, other: %u.5}).key_%u;\n"
+            "(%u + 2.5) * 3 - %u / 4;\n",
+            i, i, i, i, i, i);
+        text += buf;
+    }
+    return text;
+}
+
+// Arithmetic statements for the interpreter.  Constant folding is
+// disabled when they are compiled, so that the Add and Mul ops run.
+static std::string
+ArithmeticCorpus()
+{
+    std::string text;
+    char buf[128];
+    for (uint32_t i = 0; i < 200; i++) {
+        snprintf(buf, sizeof(buf), "(%u + %u) * (%u + 1.5) + %u * 2;\n",
+                 i, i + 1, i + 2, i + 3);
+        text += buf;
+    }
+    return text;
+}
+
+// Collect outside of timed regions, so that benchmarks of allocation
+// do not grow the heap without bound.
+static bool
+MaybeCollect(ThreadContext *thrcx)
+{
+    if (thrcx->needsGC())
+        return thrcx->performGC();
+    return true;
+}
+
+static bool
+BenchAllocation(RunContext *cx)
+{
+    static constexpr uint32_t Batches = 256;
+    static constexpr uint32_t BatchSize = 4096;
+    ThreadContext *thrcx = cx->threadContext();
+
+    for (uint32_t tenured = 0; tenured < 2; tenured++) {
+        const char *name = tenured ? "alloc.tenured.tuple"
+                                   : "alloc.hatchery.tuple";
+        if (!Selected(name))
+            continue;
+
+        uint64_t nanos = 0;
+        for (uint32_t batch = 0; batch < Batches; batch++) {
+            AllocationContext acx = tenured ? cx->inTenured()
+                                            : cx->inHatchery();
+            uint64_t start = NowNanos();
+            for (uint32_t i = 0; i < BatchSize; i++) {
+                if (!acx.createSized<VM::Tuple>(2 * sizeof(Value)))
+                    return false;
+            }
+            nanos += NowNanos() - start;
+
+            if (!MaybeCollect(thrcx))
+                return false;
+        }
+        AddResult(name, uint64_t(Batches) * BatchSize, nanos, 0);
+    }
+    return true;
+}
+
+static bool
+BenchStringTable(RunContext *cx)
+{
+    static constexpr uint32_t KeyLength = 16;
+    static constexpr uint32_t NumLookups = 1 << 18;
+    static const uint32_t Sizes[] = { 1000, 10000, 100000 };
+    static constexpr uint32_t MaxSize = 100000;
+
+    if (!Selected("string_table."))
+        return true;
+
+    ThreadContext *thrcx = cx->threadContext();
+    StringTable &table = thrcx->stringTable();
+
+    // Keys are formatted up front, so that only the table is timed.
+    // Missing keys have a different prefix.
+    std::vector<uint8_t> keys(MaxSize * KeyLength);
+    std::vector<uint8_t> missing(MaxSize * KeyLength);
+    char buf[KeyLength + 1];
+    for (uint32_t i = 0; i < MaxSize; i++) {
+        snprintf(buf, sizeof(buf), "bench_key_%06u", (unsigned) i);
+        memcpy(&keys[i * KeyLength], buf, KeyLength);
+        snprintf(buf, sizeof(buf), "bench_mis_%06u", (unsigned) i);
+        memcpy(&missing[i * KeyLength], buf, KeyLength);
+    }
+
+    Root<VM::LinearString *> result(cx);
+    uint32_t size = 0;
+    for (uint32_t target : Sizes) {
+        char name[64];
+
+        // Grow the table to |target| keys.
+        uint64_t nanos = 0;
+        uint32_t added = target - size;
+        while (size < target) {
+            uint32_t batchEnd = Min<uint32_t>(size + 1024, target);
+            uint64_t start = NowNanos();
+            for (; size < batchEnd; size++) {
+                if (!table.addString(&keys[size * KeyLength], KeyLength,
+                                     &result))
+                {
+                    return false;
+                }
+            }
+            nanos += NowNanos() - start;
+
+            if (!MaybeCollect(thrcx))
+                return false;
+        }
+        snprintf(name, sizeof(name), "string_table.add.%u",
+                 (unsigned) target);
+        AddResult(name, added, nanos, 0);
+
+        // Look up keys which are present, in a scattered order.
+        uint64_t start = NowNanos();
+        uint32_t found = 0;
+        for (uint32_t i = 0; i < NumLookups; i++) {
+            uint32_t idx = (i * 7919U) % size;
+            if (table.lookupString(&keys[idx * KeyLength], KeyLength))
+                found++;
+        }
+        nanos = NowNanos() - start;
+        if (found != NumLookups)
+            return false;
+        snprintf(name, sizeof(name), "string_table.lookup_hit.%u",
+                 (unsigned) target);
+        AddResult(name, NumLookups, nanos, 0);
+
+        start = NowNanos();
+        for (uint32_t i = 0; i < NumLookups; i++) {
+            uint32_t idx = (i * 7919U) % size;
+            if (table.lookupString(&missing[idx * KeyLength], KeyLength))
+                return false;
+        }
+        nanos = NowNanos() - start;
+        snprintf(name, sizeof(name), "string_table.lookup_miss.%u",
+                 (unsigned) target);
+        AddResult(name, NumLookups, nanos, 0);
+    }
+    return true;
+}
+
+static bool
+BenchTokenizer(const std::string &corpus)
+{
+    static constexpr uint32_t Runs = 20;
+    if (!Selected("tokenizer.read_token"))
+        return true;
+
+    BenchCodeSource source("<tokenizer corpus>", corpus);
+    uint64_t tokens = 0;
+    uint64_t nanos = 0;
+    for (uint32_t run = 0; run < Runs; run++) {
+        BumpAllocator allocator;
+        STLBumpAllocator<uint8_t> wrappedAllocator(allocator);
+        Tokenizer tokenizer(wrappedAllocator, source);
+
+        uint64_t start = NowNanos();
+        for (;;) {
+            const Token &tok = tokenizer.readToken(Tokenizer::InputElement_Div,
+                                                   true);
+            tok.debug_markUsed();
+            if (tok.isError())
+                return false;
+            if (tok.isEnd())
+                break;
+            tokens++;
+        }
+        nanos += NowNanos() - start;
+    }
+    AddResult("tokenizer.read_token", tokens, nanos,
+              uint64_t(Runs) * corpus.size());
+    return true;
+}
+
+static bool
+BenchParser(const std::string &corpus)
+{
+    static constexpr uint32_t Runs = 20;
+    if (!Selected("parser.parse_program"))
+        return true;
+
+    BenchCodeSource source("<parser corpus>", corpus);
+    uint64_t nanos = 0;
+    for (uint32_t run = 0; run < Runs; run++) {
+        BumpAllocator allocator;
+        STLBumpAllocator<uint8_t> wrappedAllocator(allocator);
+        Tokenizer tokenizer(wrappedAllocator, source);
+        Parser parser(tokenizer);
+
+        uint64_t start = NowNanos();
+        ProgramNode *program = parser.parseProgram();
+        nanos += NowNanos() - start;
+        if (!program) {
+            fprintf(stderr, "Parse error: %s\n", parser.error());
+            return false;
+        }
+    }
+    AddResult("parser.parse_program", Runs, nanos,
+              uint64_t(Runs) * corpus.size());
+    return true;
+}
+
+// The phases of running a script, timed separately by the script
+// benchmarks.
+enum class Phase : uint32_t
+{
+    Tokenize,
+    Parse,
+    Annotate,
+    Codegen,
+    Decode,
+    Interpret,
+    LIMIT
+};
+
+static constexpr uint32_t NumPhases = uint32_t(Phase::LIMIT);
+
+static const char *const PhaseNames[NumPhases] = {
+    "tokenize", "parse", "annotate", "codegen", "decode", "interpret"
+};
+
+struct PhaseTime
+{
+    uint64_t wallNanos;
+    uint64_t cpuNanos;
+};
+
+static uint64_t
+CpuNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Times one phase from construction to stop(), adding to the phase's
+// entry in |phases|, if there is one.
+class PhaseTimer
+{
+  private:
+    PhaseTime *phases_;
+    Phase phase_;
+    uint64_t wallStart_;
+    uint64_t cpuStart_;
+
+  public:
+    PhaseTimer(PhaseTime *phases, Phase phase)
+      : phases_(phases),
+        phase_(phase),
+        wallStart_(NowNanos()),
+        cpuStart_(CpuNanos())
+    {}
+
+    void stop() {
+        uint64_t wallEnd = NowNanos();
+        uint64_t cpuEnd = CpuNanos();
+        if (!phases_)
+            return;
+        phases_[uint32_t(phase_)].wallNanos += wallEnd - wallStart_;
+        phases_[uint32_t(phase_)].cpuNanos += cpuEnd - cpuStart_;
+    }
+};
+
+// Parse, annotate and generate bytecode for |source|, adding the time
+// taken by each to |phases| if it is given, and storing the peak memory
+// of the compilation in |compileBytes| if it is given.  Returns an error
+// message on failure.
+static const char *
+GenerateBytecode(RunContext *cx, CodeSource &source, bool foldConstants,
+                 MutHandle<VM::Bytecode *> bytecode,
+                 MutHandle<VM::Tuple *> constants,
+                 uint32_t *maxStackDepth, uint32_t *numLocals,
+                 PhaseTime *phases, size_t *compileBytes = nullptr)
+{
+    CompilationArena arena;
+    Tokenizer tokenizer(arena, source);
+    Parser parser(tokenizer);
+
+    PhaseTimer parseTimer(phases, Phase::Parse);
+    ProgramNode *program = parser.parseProgram();
+    parseTimer.stop();
+    if (!program)
+        return parser.error();
+
+    AST::SyntaxAnnotator annotator(arena, program, source);
+    PhaseTimer annotateTimer(phases, Phase::Annotate);
+    bool annotated = annotator.annotate();
+    annotateTimer.stop();
+    if (!annotated)
+        return annotator.error();
+
+    Interp::BytecodeGenerator bcgen(cx, arena, program, annotator, false);
+    bcgen.setFoldConstants(foldConstants);
+
+    PhaseTimer codegenTimer(phases, Phase::Codegen);
+    bytecode = bcgen.generateBytecode();
+    codegenTimer.stop();
+    if (bcgen.hasError())
+        return bcgen.error();
+
+    VM::Tuple *tuple = nullptr;
+    if (!bcgen.constants(tuple))
+        return "Could not allocate constants.";
+    constants = tuple;
+    *maxStackDepth = bcgen.maxStackDepth();
+    *numLocals = bcgen.numLocals();
+    if (compileBytes)
+        *compileBytes = arena.peakBytes();
+    return nullptr;
+}
+
+static bool
+BenchBytecodeGenerator(RunContext *cx, const std::string &corpus)
+{
+    static constexpr uint32_t Runs = 20;
+    if (!Selected("bytecode_generator.generate"))
+        return true;
+
+    BenchCodeSource source("<codegen corpus>", corpus);
+    Root<VM::Bytecode *> bytecode(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+    PhaseTime phases[NumPhases] = {};
+    for (uint32_t run = 0; run < Runs; run++) {
+        if (const char *err = GenerateBytecode(cx, source, true, &bytecode,
+                                               &constants, &maxStackDepth,
+                                               &numLocals, phases))
+        {
+            fprintf(stderr, "Codegen error: %s\n", err);
+            return false;
+        }
+        if (!MaybeCollect(cx->threadContext()))
+            return false;
+    }
+    AddResult("bytecode_generator.generate", Runs,
+              phases[uint32_t(Phase::Codegen)].wallNanos,
+              uint64_t(Runs) * corpus.size());
+    return true;
+}
+
+// Run arithmetic ops in the interpreter, and in baseline compiled code.
+// Each operation is one executed op.
+static bool
+BenchInterpreter(RunContext *cx, const std::string &corpus)
+{
+    static constexpr uint32_t Runs = 2000;
+    ThreadContext *thrcx = cx->threadContext();
+    uint32_t savedThreshold = thrcx->jitThreshold();
+
+    BenchCodeSource source("<arithmetic corpus>", corpus);
+    Root<VM::Bytecode *> bytecode(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+    if (const char *err = GenerateBytecode(cx, source, false, &bytecode,
+                                           &constants, &maxStackDepth,
+                                           &numLocals, nullptr))
+    {
+        fprintf(stderr, "Codegen error: %s\n", err);
+        return false;
+    }
+    uint32_t numOps = Interp::CountBytecodeOps(bytecode);
+
+    for (uint32_t jit = 0; jit < 2; jit++) {
+        const char *name = jit ? "interp.add_mul.baseline"
+                               : "interp.add_mul";
+        if (!Selected(name))
+            continue;
+
+        // Compile on the first run, or never.
+        thrcx->setJitThreshold(jit ? 1 : 0);
+
+        VM::Script::Config config(false, VM::Script::TopLevel,
+                                  maxStackDepth, numLocals);
+        Root<VM::Script *> script(cx,
+            cx->inHatchery().create<VM::Script>(bytecode.get(),
+                                                constants.get(), config));
+        if (!script.get() || !Interp::DecodeScript(cx, script))
+            return false;
+
+        // Warm up, which also compiles the script.
+        if (!Interp::InterpretScript(cx, script))
+            return false;
+
+        uint64_t start = NowNanos();
+        for (uint32_t run = 0; run < Runs; run++) {
+            if (!Interp::InterpretScript(cx, script))
+                return false;
+        }
+        uint64_t nanos = NowNanos() - start;
+        AddResult(name, uint64_t(Runs) * numOps, nanos, 0);
+    }
+
+    thrcx->setJitThreshold(savedThreshold);
+    return true;
+}
+
+// Run a small handler script for a stream of inputs: entering it with
+// InterpretScript for each, running it prepared, and running it
+// prepared in batches.  Each operation is one run of the handler.
+static bool
+BenchPreparedScript(RunContext *cx)
+{
+    static constexpr uint32_t Runs = 1 << 18;
+    static constexpr uint32_t BatchSize = 1024;
+
+    std::string corpus = "result = input * 2 + 1;";
+    BenchCodeSource source("<handler corpus>", corpus);
+    Root<VM::Bytecode *> bytecode(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+    if (const char *err = GenerateBytecode(cx, source, false, &bytecode,
+                                           &constants, &maxStackDepth,
+                                           &numLocals, nullptr))
+    {
+        fprintf(stderr, "Codegen error: %s\n", err);
+        return false;
+    }
+
+    VM::Script::Config config(false, VM::Script::TopLevel,
+                              maxStackDepth, numLocals);
+    Root<VM::Script *> script(cx,
+        cx->inHatchery().create<VM::Script>(bytecode.get(),
+                                            constants.get(), config));
+    if (!script.get())
+        return false;
+
+    Root<Value> inputName(cx);
+    Root<Value> resultName(cx);
+    if (!VM::NormalizeString(cx, reinterpret_cast<const uint8_t *>("input"),
+                             5, &inputName) ||
+        !VM::NormalizeString(cx, reinterpret_cast<const uint8_t *>("result"),
+                             6, &resultName))
+    {
+        return false;
+    }
+
+    // Warm up, which also leaves an input for the entered runs.
+    Interp::PreparedScript prepared(cx);
+    Root<Value> input(cx, Value::Int32(0));
+    Root<Value> result(cx);
+    if (!prepared.prepare(script, inputName, resultName) ||
+        !prepared.run(input, &result))
+    {
+        return false;
+    }
+
+    if (Selected("interp.handler.entry")) {
+        uint64_t start = NowNanos();
+        for (uint32_t run = 0; run < Runs; run++) {
+            if (!Interp::InterpretScript(cx, script))
+                return false;
+        }
+        AddResult("interp.handler.entry", Runs, NowNanos() - start, 0);
+    }
+
+    if (Selected("interp.handler.prepared")) {
+        uint64_t start = NowNanos();
+        for (uint32_t run = 0; run < Runs; run++) {
+            input = Value::Int32(run);
+            if (!prepared.run(input, &result))
+                return false;
+        }
+        AddResult("interp.handler.prepared", Runs, NowNanos() - start, 0);
+    }
+
+    if (Selected("interp.handler.batch")) {
+        VectorRoot<Value> inputs(cx);
+        VectorRoot<Value> results(cx);
+        for (uint32_t i = 0; i < BatchSize; i++)
+            inputs.append(Value::Int32(i));
+
+        uint64_t start = NowNanos();
+        for (uint32_t run = 0; run < Runs; run += BatchSize) {
+            results.clear();
+            if (!prepared.runBatch(inputs, results))
+                return false;
+        }
+        uint64_t nanos = NowNanos() - start;
+
+        for (uint32_t i = 0; i < BatchSize; i++) {
+            const Value &result = results.ref(i);
+            if (!result.isInt32() || result.int32Value() != int32_t(2*i + 1)) {
+                fprintf(stderr, "Wrong result for batch input %u.\n", i);
+                return false;
+            }
+        }
+        AddResult("interp.handler.batch", Runs, nanos, 0);
+    }
+    return true;
+}
+
+// Push and pop call frames on the native stack, for calls passing as
+// many arguments as the callee has formals, and for calls which must be
+// adapted.  Each operation is one call.
+static bool
+BenchCallFrames(RunContext *cx)
+{
+    static constexpr uint32_t Calls = 1 << 22;
+    static constexpr uint32_t NumFormals = 3;
+
+    std::string corpus = "1;";
+    BenchCodeSource source("<call frame corpus>", corpus);
+    Root<VM::Bytecode *> bytecode(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+    if (const char *err = GenerateBytecode(cx, source, false, &bytecode,
+                                           &constants, &maxStackDepth,
+                                           &numLocals, nullptr))
+    {
+        fprintf(stderr, "Codegen error: %s\n", err);
+        return false;
+    }
+
+    // The caller's stack holds the reserved header slots and arguments.
+    uint32_t callerDepth = VM::NativeStack::FrameHeaderWords + NumFormals;
+    VM::Script::Config config(false, VM::Script::TopLevel, callerDepth,
+                              numLocals);
+    Root<VM::Script *> script(cx,
+        cx->inHatchery().create<VM::Script>(bytecode.get(),
+                                            constants.get(), config));
+    if (!script.get())
+        return false;
+
+    VM::NativeStack &stack = cx->nativeStack();
+    for (uint32_t adapted = 0; adapted < 2; adapted++) {
+        const char *name = adapted ? "native_stack.call.adapted"
+                                   : "native_stack.call.exact";
+        if (!Selected(name))
+            continue;
+
+        VM::NativeFrameHelper caller(stack, script, 0, 0);
+        if (!caller.frame())
+            return false;
+
+        uint32_t numPassedArgs = adapted ? 1 : NumFormals;
+        uint64_t start = NowNanos();
+        for (uint32_t i = 0; i < Calls; i++) {
+            for (uint32_t j = 0; j < VM::NativeStack::FrameHeaderWords; j++)
+                caller.frame()->pushStack(Value::Undefined());
+            for (uint32_t j = 0; j < numPassedArgs; j++)
+                caller.frame()->pushStack(Value::Int32(j));
+
+            VM::NativeFrame *frame = stack.pushCallFrame(script,
+                                                         numPassedArgs,
+                                                         NumFormals);
+            if (!frame)
+                return false;
+            stack.popFrame(frame);
+        }
+        uint64_t nanos = NowNanos() - start;
+        AddResult(name, Calls, nanos, 0);
+    }
+    return true;
+}
+
+//
+// Script benchmarks
+//
+// In script mode, every .js file of a directory is run a number of
+// times, in name order, on one warm runtime.  Each run tokenizes the
+// script, then parses, annotates and compiles it, decodes the bytecode
+// and interprets it, and each phase is timed in wall and thread CPU
+// time.  Tokenizing is a separate pass over the source, as the parser
+// tokenizes as it goes.
+//
+// The heap is collected before each script's runs, and the peak slab
+// memory of the thread during them is reported, along with the peak
+// memory of compiling the script.  A script whose
+// phases fail is reported with the error, and the phases it reached.
+//
+
+struct ScriptResult
+{
+    std::string name;
+    uint32_t bytes;
+    uint32_t runs;
+    PhaseTime phases[NumPhases];
+    uint64_t minWallNanos;
+    size_t peakSlabBytes;
+    size_t peakCompileBytes;
+    std::string error;
+};
+
+static std::vector<ScriptResult> ScriptResults;
+
+static bool
+ListScripts(const char *dirName, std::vector<std::string> &names)
+{
+    DIR *dir = opendir(dirName);
+    if (!dir)
+        return false;
+
+    while (struct dirent *entry = readdir(dir)) {
+        size_t len = strlen(entry->d_name);
+        if (len > 3 && strcmp(entry->d_name + len - 3, ".js") == 0)
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+
+    std::sort(names.begin(), names.end());
+    return true;
+}
+
+// Run the script in |source| once, storing the peak memory of its
+// compilation in |compileBytes|.  Returns an error message on failure.
+static const char *
+RunScript(RunContext *cx, CodeSource &source, PhaseTime *phases,
+          size_t *compileBytes)
+{
+    {
+        BumpAllocator allocator;
+        STLBumpAllocator<uint8_t> wrappedAllocator(allocator);
+        Tokenizer tokenizer(wrappedAllocator, source);
+
+        PhaseTimer timer(phases, Phase::Tokenize);
+        for (;;) {
+            const Token &tok = tokenizer.readToken(Tokenizer::InputElement_Div,
+                                                   true);
+            tok.debug_markUsed();
+            if (tok.isError() || tok.isEnd())
+                break;
+        }
+        timer.stop();
+    }
+
+    Root<VM::Bytecode *> bytecode(cx);
+    Root<VM::Tuple *> constants(cx);
+    uint32_t maxStackDepth = 0;
+    uint32_t numLocals = 0;
+    if (const char *err = GenerateBytecode(cx, source, true, &bytecode,
+                                           &constants, &maxStackDepth,
+                                           &numLocals, phases, compileBytes))
+    {
+        return err;
+    }
+
+    PhaseTimer decodeTimer(phases, Phase::Decode);
+    VM::Script::Config config(false, VM::Script::TopLevel,
+                              maxStackDepth, numLocals);
+    Root<VM::Script *> script(cx,
+        cx->inHatchery(AllocSite::Script).create<VM::Script>(
+            bytecode.get(), constants.get(), config));
+    bool decoded = script.get() && Interp::DecodeScript(cx, script);
+    decodeTimer.stop();
+    if (!decoded)
+        return "Could not decode script.";
+
+    PhaseTimer interpretTimer(phases, Phase::Interpret);
+    bool interpreted = Interp::InterpretScript(cx, script);
+    interpretTimer.stop();
+    if (!interpreted)
+        return "Script failed.";
+    return nullptr;
+}
+
+static bool
+BenchScripts(RunContext *cx, const char *dirName, uint32_t runs)
+{
+    ThreadContext *thrcx = cx->threadContext();
+
+    std::vector<std::string> names;
+    if (!ListScripts(dirName, names)) {
+        fprintf(stderr, "Could not read directory %s.\n", dirName);
+        return false;
+    }
+
+    for (const std::string &name : names) {
+        std::string path = std::string(dirName) + "/" + name;
+        FileCodeSource source(path.c_str());
+        if (!source.initialize()) {
+            fprintf(stderr, "Could not read %s: %s\n", path.c_str(),
+                    source.error());
+            return false;
+        }
+
+        // Start each script from a collected heap.
+        if (!thrcx->performMajorGC())
+            return false;
+        thrcx->finishSweeping();
+        thrcx->resetPeakSlabBytes();
+
+        ScriptResult result;
+        result.name = name;
+        result.bytes = source.dataSize();
+        result.runs = 0;
+        memset(result.phases, 0, sizeof(result.phases));
+        result.minWallNanos = UINT64_MAX;
+        result.peakCompileBytes = 0;
+
+        for (uint32_t run = 0; run < runs; run++) {
+            PhaseTime phases[NumPhases] = {};
+            size_t compileBytes = 0;
+            const char *err = RunScript(cx, source, phases, &compileBytes);
+            if (compileBytes > result.peakCompileBytes)
+                result.peakCompileBytes = compileBytes;
+
+            uint64_t wallNanos = 0;
+            for (uint32_t i = 0; i < NumPhases; i++) {
+                result.phases[i].wallNanos += phases[i].wallNanos;
+                result.phases[i].cpuNanos += phases[i].cpuNanos;
+                wallNanos += phases[i].wallNanos;
+            }
+            result.runs++;
+            if (wallNanos < result.minWallNanos)
+                result.minWallNanos = wallNanos;
+
+            if (err) {
+                result.error = err;
+                break;
+            }
+        }
+
+        result.peakSlabBytes = thrcx->peakSlabBytes();
+        ScriptResults.push_back(result);
+    }
+    return true;
+}
+
+static void
+PrintJsonString(const std::string &str)
+{
+    putchar('"');
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (static_cast<unsigned char>(c) < 0x20)
+            printf("\\u%04x", (unsigned) c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+static void
+PrintScriptResults()
+{
+    printf("{\n");
+    printf("  \"format\": %u,\n", (unsigned) BenchFormat);
+    printf("  \"scripts\": [");
+    for (size_t i = 0; i < ScriptResults.size(); i++) {
+        const ScriptResult &result = ScriptResults[i];
+        printf("%s\n    {\"name\": ", i ? "," : "");
+        PrintJsonString(result.name);
+        printf(", \"bytes\": %u, \"runs\": %u, \"min_wall_ns\": %llu, "
+               "\"peak_slab_bytes\": %llu, \"peak_compile_bytes\": %llu, "
+               "\"error\": ",
+               (unsigned) result.bytes, (unsigned) result.runs,
+               (unsigned long long) result.minWallNanos,
+               (unsigned long long) result.peakSlabBytes,
+               (unsigned long long) result.peakCompileBytes);
+        if (result.error.empty())
+            printf("null");
+        else
+            PrintJsonString(result.error);
+
+        // Phase times are means over the runs.
+        printf(",\n     \"phases\": {");
+        for (uint32_t p = 0; p < NumPhases; p++) {
+            printf("%s\"%s\": {\"wall_ns\": %llu, \"cpu_ns\": %llu}",
+                   p ? ", " : "", PhaseNames[p],
+                   (unsigned long long) (result.phases[p].wallNanos /
+                                         result.runs),
+                   (unsigned long long) (result.phases[p].cpuNanos /
+                                         result.runs));
+        }
+        printf("}}");
+    }
+    printf("\n  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    const char *scriptDir = nullptr;
+    uint32_t scriptRuns = DefaultScriptRuns;
+    if (argc >= 3 && strcmp(argv[1], "--scripts") == 0) {
+        scriptDir = argv[2];
+        if (argc == 4)
+            scriptRuns = atoi(argv[3]);
+    }
+    if (scriptDir ? (argc > 4 || scriptRuns == 0) : argc > 2) {
+        fprintf(stderr, "Usage: %s [filter]\n", argv[0]);
+        fprintf(stderr, "       %s --scripts <dir> [runs]\n", argv[0]);
+        return 1;
+    }
+    if (!scriptDir && argc == 2)
+        Filter = argv[1];
+
+    InitializeSpew();
+    Interp::InitializeOpcodeInfo();
+    VM::InitializeStringKernels();
+    InitializeKeywordTable();
+    InitializeQuickTokenTable();
+
+    Runtime runtime;
+    if (!runtime.initialize()) {
+        WH_ASSERT(runtime.hasError());
+        fprintf(stderr, "Runtime error: %s\n", runtime.error());
+        return 1;
+    }
+    if (const char *err = runtime.registerThread()) {
+        fprintf(stderr, "Could not register thread: %s\n", err);
+        return 1;
+    }
+    ThreadContext *thrcx = runtime.threadContext();
+
+    std::string parserCorpus = ParserCorpus();
+    std::string codegenCorpus = CodegenCorpus();
+    std::string arithmeticCorpus = ArithmeticCorpus();
+
+    bool ok;
+    {
+        RunContext runcx(thrcx);
+        RunActivationHelper _rah(runcx);
+        RunContext *cx = &runcx;
+
+        if (scriptDir) {
+            ok = BenchScripts(cx, scriptDir, scriptRuns);
+        } else {
+            ok = BenchAllocation(cx) &&
+                 BenchStringTable(cx) &&
+                 BenchTokenizer(parserCorpus) &&
+                 BenchParser(parserCorpus) &&
+                 BenchBytecodeGenerator(cx, codegenCorpus) &&
+                 BenchInterpreter(cx, arithmeticCorpus) &&
+                 BenchPreparedScript(cx) &&
+                 BenchCallFrames(cx);
+        }
+    }
+    runtime.unregisterThread();
+
+    if (!ok) {
+        fprintf(stderr, "Benchmark failed.\n");
+        return 1;
+    }
+
+    if (scriptDir)
+        PrintScriptResults();
+    else
+        PrintResults();
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Int32 arithmetic whose result is not an int32: division and modulo by
+// zero, INT32_MIN / -1, and negative zero.  Operands are read from
+// variables, so nothing is folded.  The script fails, reading a property
+// of an undefined global, if any result is wrong.
+//
+// Without comparison operators, results are checked by their truth:
+//   r - 1 / 0 is false only when r is Infinity,
+//   r + 1 / 0 is false only when r is -Infinity,
+//   r * 0 + 1 is false only when r is NaN or infinite,
+//   1 / r + 1 / 0 is false only when r is -0 (or -Infinity).
+zero = 0;
+five = 5;
+minusOne = -1;
+minusFive = -5;
+seven = 7;
+minusSeven = -7;
+min = -2147483647 - 1;
+
+a = five / zero;
+if (a - 1 / 0) { wrong.a; }
+
+b = minusFive / zero;
+if (b + 1 / 0) { wrong.b; }
+
+c = zero / zero;
+if (c * 0 + 1) { wrong.c; }
+if (c + 1) { wrong.c; }
+
+d = min / minusOne;
+if (d - 2147483647 - 1) { wrong.d; }
+
+e = five % zero;
+if (e * 0 + 1) { wrong.e; }
+if (e + 1) { wrong.e; }
+
+f = min % minusOne;
+if (f) { wrong.f; }
+if (1 / f + 1 / 0) { wrong.f; }
+
+g = -zero;
+if (g) { wrong.g; }
+if (1 / g + 1 / 0) { wrong.g; }
+
+h = zero * minusFive;
+if (h) { wrong.h; }
+if (1 / h + 1 / 0) { wrong.h; }
+
+i = zero / minusFive;
+if (i) { wrong.i; }
+if (1 / i + 1 / 0) { wrong.i; }
+
+j = minusSeven % seven;
+if (j) { wrong.j; }
+if (1 / j + 1 / 0) { wrong.j; }
+
+// Positive zeros stay positive.
+k = zero * five;
+if (1 / k - 1 / 0) { wrong.k; }
+l = seven % seven;
+if (1 / l - 1 / 0) { wrong.l; }
+
+// The same operations in a hot loop, for the compiled tiers.  The
+// optimizing tier bails out of the loop when a result is -0.
+n = 2000;
+while (n) {
+  m = zero / minusFive;
+  o = -zero;
+  p = zero * minusFive;
+  n = n - 1;
+}
+if (1 / m + 1 / 0) { wrong.m; }
+if (1 / o + 1 / 0) { wrong.o; }
+if (1 / p + 1 / 0) { wrong.p; }
@@ -0,0 +1,37 @@
+// Bytecode cache round trip.  Run this twice with WHBYTECODECACHE set to
+// a directory: the first run writes a cache file, and the second prints
+// "Loaded cached bytecode" and runs from it.  Both runs must succeed.
+//
+// The constant pool holds every kind of cached constant: global and
+// property names (interned strings), index names, string literals short
+// and long, and doubles, including infinities and -0.  The script fails,
+// reading a property of an undefined global, if any is wrong.
+point = { x: 3, y: 4, 7: 5 };
+point.x = point.x + point.y;
+point[7] = point[7] * 2;
+if (point.x - 7) { wrong.x; }
+if (point.y - 4) { wrong.y; }
+if (point[7] - 10) { wrong.index; }
+
+short = "ab";
+long = "a string literal too long to be an immediate string";
+copy = { name: long, other: short };
+found = 0;
+if (copy.name) { found = found + 1; }
+if (copy.other) { found = found + 1; }
+if (found - 2) { wrong.strings; }
+
+half = 0.5;
+inf = 1 / 0;
+negZero = 0 * -1;
+if (half + half - 1) { wrong.half; }
+if (inf - 1 / 0) { wrong.inf; }
+if (1 / negZero + 1 / 0) { wrong.negZero; }
+
+total = 0;
+count = 10;
+while (count) {
+  total = total + point.x;
+  count = count - 1;
+}
+if (total - 70) { wrong.total; }
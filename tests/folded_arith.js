@@ -0,0 +1,42 @@
+// Constant arithmetic folded during bytecode generation, whose result is
+// not an int32.  Folding evaluates it as the interpreter would, so these
+// must neither trap in the compiler nor differ from unfolded results.
+// The script fails, reading a property of an undefined global, if any
+// result is wrong.  See arith_special.js for how results are checked.
+a = (-2147483647 - 1) / -1;
+if (a - 2147483647 - 1) { wrong.a; }
+
+b = 7 % 0;
+if (b * 0 + 1) { wrong.b; }
+if (b + 1) { wrong.b; }
+
+c = 1 / 0;
+if (c - 1 / 0) { wrong.c; }
+
+d = -1 / 0;
+if (d + 1 / 0) { wrong.d; }
+
+e = 0 / 0;
+if (e * 0 + 1) { wrong.e; }
+if (e + 1) { wrong.e; }
+
+f = (-2147483647 - 1) % -1;
+if (f) { wrong.f; }
+if (1 / f + 1 / 0) { wrong.f; }
+
+g = 1 / -0;
+if (g + 1 / 0) { wrong.g; }
+
+h = 0 * -5;
+if (h) { wrong.h; }
+if (1 / h + 1 / 0) { wrong.h; }
+
+i = -7 % 7;
+if (i) { wrong.i; }
+if (1 / i + 1 / 0) { wrong.i; }
+
+j = 7 % 3;
+if (j - 1) { wrong.j; }
+
+k = 7.5 % 2;
+if (k - 1.5) { wrong.k; }
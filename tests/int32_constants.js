@@ -0,0 +1,25 @@
+// Folded int32 constants, at and beyond the bounds of an immediate
+// operand (-2^27 .. 2^27-1).  Those which do not fit are pushed from the
+// constant pool.  The script fails, reading a property of an undefined
+// global, if any constant is wrong.
+x = 100000 * 10000;
+y = 2147483647;
+z = -2147483647 - 1;
+a = 134217727;
+b = 134217728;
+c = -134217728;
+d = -134217729;
+e = 8388607;
+f = 8388608;
+g = -8388609;
+
+if (x - 1000000000) { wrong.x; }
+if (y - 2147483646 - 1) { wrong.y; }
+if (z + 2147483647 + 1) { wrong.z; }
+if (a - 134217726 - 1) { wrong.a; }
+if (b - 134217727 - 1) { wrong.b; }
+if (c + 134217727 + 1) { wrong.c; }
+if (d + 134217728 + 1) { wrong.d; }
+if (e - 8388606 - 1) { wrong.e; }
+if (f - 8388607 - 1) { wrong.f; }
+if (g + 8388608 + 1) { wrong.g; }